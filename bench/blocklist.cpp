@@ -0,0 +1,118 @@
+/**********************************************************************
+File name: blocklist.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "dragonstash/cache/blocklist.hpp"
+#include "dragonstash/cache/common.hpp"
+
+#include "testutils/tempdir.hpp"
+
+namespace {
+
+/**
+ * @brief Mark every other block, so that each present block is an entry of
+ * its own.
+ */
+void fragment(Dragonstash::Blocklist &blocklist, std::uint64_t nblocks)
+{
+    for (std::uint64_t block = 0; block < nblocks; block += 2) {
+        blocklist.mark(block, 1, Dragonstash::Blocklist::READ);
+    }
+}
+
+std::vector<std::uint64_t> random_blocks(std::uint64_t nblocks, std::size_t n)
+{
+    std::mt19937_64 rng(4711);
+    std::uniform_int_distribution<std::uint64_t> dist(0, nblocks - 1);
+    std::vector<std::uint64_t> result(n);
+    for (auto &block: result) {
+        block = dist(rng);
+    }
+    return result;
+}
+
+}
+
+TEST_CASE("Blocklist on a fragmented list", "[blocklist]")
+{
+    constexpr std::uint64_t nblocks = 100000;
+    TemporaryDirectory tempdir;
+    Dragonstash::Blocklist blocklist(tempdir.path() / "blocklist");
+    fragment(blocklist, nblocks);
+    REQUIRE(blocklist.nentries() == nblocks / 2);
+
+    const auto blocks = random_blocks(nblocks, 4096);
+
+    BENCHMARK("state of random blocks") {
+        std::uint64_t present = 0;
+        for (std::uint64_t block: blocks) {
+            present += blocklist.state(block) != Dragonstash::Blocklist::ABSENT;
+        }
+        return present;
+    };
+
+    BENCHMARK("truncate_access of 128 KiB at random blocks") {
+        std::size_t total = 0;
+        for (std::uint64_t block: blocks) {
+            total += blocklist.truncate_access(off_t(block * blocklist.block_size()),
+                                               128 * 1024);
+        }
+        return total;
+    };
+
+    BENCHMARK("mark filling and reopening a gap") {
+        // merges three entries into one and splits them again
+        const std::uint64_t gap = (blocks.front() | 1);
+        blocklist.mark(gap, 1, Dragonstash::Blocklist::READ);
+        blocklist.mark(gap, 1, Dragonstash::Blocklist::ABSENT);
+        return blocklist.nentries();
+    };
+
+    BENCHMARK("mark of a new block at the end") {
+        const std::uint64_t block = nblocks + 1;
+        blocklist.mark(block, 1, Dragonstash::Blocklist::READ);
+        blocklist.mark(block, 1, Dragonstash::Blocklist::ABSENT);
+        return blocklist.nentries();
+    };
+}
+
+TEST_CASE("Blocklist construction", "[blocklist]")
+{
+    BENCHMARK_ADVANCED("fragmenting 10k blocks")(Catch::Benchmark::Chronometer meter) {
+        TemporaryDirectory tempdir;
+        std::vector<std::unique_ptr<Dragonstash::Blocklist>> blocklists;
+        for (int i = 0; i < meter.runs(); ++i) {
+            blocklists.emplace_back(std::make_unique<Dragonstash::Blocklist>(
+                                        tempdir.path() / std::to_string(i)));
+        }
+        meter.measure([&blocklists](int i) {
+            fragment(*blocklists[i], 10000);
+        });
+    };
+}
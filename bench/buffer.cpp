@@ -0,0 +1,78 @@
+/**********************************************************************
+File name: buffer.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "dragonstash/fuse/buffer.hpp"
+
+#include "testutils/fuse_backend.hpp"
+
+TEST_CASE("Directory reply buffers", "[buffer]")
+{
+    TestFuseBackend fuse;
+    auto req_wrap = fuse.new_request();
+    Fuse::Request req(req_wrap);
+    struct stat stbuf{};
+    stbuf.st_mode = S_IFREG;
+
+    std::vector<std::string> names;
+    for (int i = 0; i < 1000; ++i) {
+        names.emplace_back("a-moderately-long-file-name-" + std::to_string(i));
+    }
+
+    BENCHMARK("DirBuffer::add of 1000 entries") {
+        Fuse::DirBuffer buffer(128 * 1024);
+        off_t off = 0;
+        for (const auto &name: names) {
+            buffer.add(req, name, stbuf, ++off);
+        }
+        return buffer.length();
+    };
+
+    Fuse::DirBuffer reused(128 * 1024);
+    BENCHMARK("DirBuffer::add of 1000 entries into a reused buffer") {
+        reused.rewind(0);
+        off_t off = 0;
+        for (const auto &name: names) {
+            reused.add(req, name, stbuf, ++off);
+        }
+        return reused.length();
+    };
+
+    BENCHMARK("DirBufferPlus::add of 1000 entries") {
+        Fuse::DirBufferPlus buffer(256 * 1024);
+        struct fuse_entry_param e{};
+        e.attr = stbuf;
+        off_t off = 0;
+        for (const auto &name: names) {
+            buffer.add(req, name, e, ++off);
+        }
+        return buffer.length();
+    };
+}
@@ -0,0 +1,139 @@
+/**********************************************************************
+File name: cache.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "dragonstash/cache/cache.hpp"
+
+#include "testutils/tempdir.hpp"
+
+namespace {
+
+const Dragonstash::InodeAttributes file_attr{
+    .common = Dragonstash::CommonFileAttributes{},
+    .mode = S_IFREG | S_IRUSR,
+};
+
+const Dragonstash::InodeAttributes dir_attr{
+    .common = Dragonstash::CommonFileAttributes{},
+    .mode = S_IFDIR | S_IRUSR | S_IXUSR,
+};
+
+ino_t make_dir(Dragonstash::Cache &cache, std::size_t nentries)
+{
+    auto txn = cache.begin_rw();
+    const ino_t dir = *txn.emplace(Dragonstash::ROOT_INO, "dir", dir_attr);
+    for (std::size_t i = 0; i < nentries; ++i) {
+        (void)txn.emplace(dir, "file" + std::to_string(i), file_attr);
+    }
+    (void)txn.commit();
+    return dir;
+}
+
+void bench_emplace(std::size_t nentries)
+{
+    TemporaryDirectory tempdir;
+    Dragonstash::Cache cache(tempdir.path());
+    const ino_t dir = make_dir(cache, nentries);
+
+    // each run adds a new name, so the directory keeps its size
+    std::size_t next = nentries;
+    BENCHMARK("Cache::emplace of a new entry") {
+        return cache.emplace(dir, "file" + std::to_string(next++), file_attr);
+    };
+    BENCHMARK("Cache::emplace of an existing entry") {
+        return cache.emplace(dir, "file0", file_attr);
+    };
+}
+
+}
+
+TEST_CASE("Cache::emplace into a directory with 10k entries", "[cache]")
+{
+    bench_emplace(10000);
+}
+
+TEST_CASE("Cache::emplace into a directory with 100k entries", "[cache][.large]")
+{
+    bench_emplace(100000);
+}
+
+TEST_CASE("CacheTransactionRO::path", "[cache]")
+{
+    TemporaryDirectory tempdir;
+    Dragonstash::Cache cache(tempdir.path());
+
+    for (std::size_t depth: {1, 8, 32}) {
+        ino_t leaf = Dragonstash::ROOT_INO;
+        {
+            auto txn = cache.begin_rw();
+            for (std::size_t i = 0; i < depth; ++i) {
+                leaf = *txn.emplace(leaf, "d" + std::to_string(depth), dir_attr);
+            }
+            (void)txn.commit();
+        }
+
+        // read-only transactions go through the path cache; write
+        // transactions always walk the tree
+        BENCHMARK("path at depth " + std::to_string(depth) + ", read-only") {
+            return cache.begin_ro().path(leaf);
+        };
+        BENCHMARK("path at depth " + std::to_string(depth) + ", read-write") {
+            auto txn = cache.begin_rw();
+            auto result = txn.path(leaf);
+            txn.abort();
+            return result;
+        };
+    }
+}
+
+TEST_CASE("CacheTransactionRO::getattr", "[cache]")
+{
+    TemporaryDirectory tempdir;
+    Dragonstash::Cache cache(tempdir.path());
+    constexpr std::size_t nentries = 10000;
+    const ino_t dir = make_dir(cache, nentries);
+
+    std::vector<ino_t> inos;
+    {
+        auto txn = cache.begin_ro();
+        for (std::size_t i = 0; i < nentries; ++i) {
+            inos.push_back(*txn.lookup(dir, "file" + std::to_string(i)));
+        }
+    }
+
+    BENCHMARK("getattr of " + std::to_string(nentries) + " inodes") {
+        auto txn = cache.begin_ro();
+        std::uint64_t sum = 0;
+        for (ino_t ino: inos) {
+            sum += txn.getattr(ino)->attr.mode;
+        }
+        return sum;
+    };
+}
@@ -0,0 +1,142 @@
+/**********************************************************************
+File name: environment.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_BENCH_ENVIRONMENT_H
+#define DRAGONSTASH_BENCH_ENVIRONMENT_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dragonstash/backend/in_memory.hpp"
+#include "dragonstash/cache/cache.hpp"
+#include "dragonstash/fs.hpp"
+
+#include "testutils/tempdir.hpp"
+#include "testutils/fuse_backend.hpp"
+
+/**
+ * @brief A file system over an in-memory backend, driven in-process.
+ *
+ * Unlike the test environment, all work happens in the calling thread, so
+ * that the benchmarks measure the code paths and not the scheduling.
+ */
+class BenchEnvironment {
+public:
+    BenchEnvironment():
+        m_cache(m_cachedir.path()),
+        m_fs(m_cache, m_backend, 0, 0, 0)
+    {
+
+    }
+
+private:
+    TemporaryDirectory m_cachedir;
+    Dragonstash::Cache m_cache;
+    Dragonstash::Backend::InMemoryFilesystem m_backend;
+    Dragonstash::Filesystem m_fs;
+    TestFuseBackend m_fuse;
+
+public:
+    [[nodiscard]] inline Dragonstash::Cache &cache() {
+        return m_cache;
+    }
+
+    [[nodiscard]] inline Dragonstash::Backend::InMemoryFilesystem &backend() {
+        return m_backend;
+    }
+
+    [[nodiscard]] inline Dragonstash::Filesystem &fs() {
+        return m_fs;
+    }
+
+    [[nodiscard]] inline TestFuseBackend &fuse() {
+        return m_fuse;
+    }
+
+    /**
+     * @brief Fill the backend root with @a n regular files.
+     */
+    void populate_backend(std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            m_backend.emplace<Dragonstash::Backend::InMemory::File>(
+                        "file" + std::to_string(i)).update_attr(
+                        Dragonstash::Backend::Stat{
+                            .mode = S_IFREG | S_IRUSR,
+                            .size = i,
+                            .uid = getuid(),
+                            .gid = getgid(),
+                        });
+        }
+    }
+
+    /**
+     * @brief Open a directory through the file system, syncing it with the
+     * backend.
+     */
+    [[nodiscard]] fuse_file_info opendir(fuse_ino_t ino) {
+        auto req = m_fuse.new_request();
+        struct fuse_file_info fi{};
+        m_fs.opendir(req.wrap(), ino, &fi);
+        if (req.reply_type() != TestFuseReplyType::OPEN) {
+            throw std::runtime_error("opendir failed");
+        }
+        return std::get<TestFuseReplyOpen>(req.reply_argv());
+    }
+
+    void releasedir(fuse_ino_t ino, fuse_file_info &fi) {
+        auto req = m_fuse.new_request();
+        m_fs.releasedir(req.wrap(), ino, &fi);
+    }
+};
+
+/**
+ * @brief Offset of the last entry in a readdir reply, or -1 if it is empty.
+ *
+ * @param plus Whether the reply is from readdirplus.
+ */
+inline off_t last_dirent_offset(std::string_view reply, bool plus)
+{
+    // struct fuse_dirent: ino, off, namelen, type, name; padded to 8 bytes.
+    // readdirplus prefixes each one with a struct fuse_entry_out.
+    const std::size_t prefix = plus ? 128 : 0;
+    off_t result = -1;
+    std::size_t pos = 0;
+    while (pos + prefix + 24 <= reply.size()) {
+        std::uint64_t off;
+        std::uint32_t namelen;
+        std::memcpy(&off, reply.data() + pos + prefix + 8, sizeof(off));
+        std::memcpy(&namelen, reply.data() + pos + prefix + 16, sizeof(namelen));
+        result = off_t(off);
+        pos += (prefix + 24 + namelen + 7) & ~std::size_t(7);
+    }
+    return result;
+}
+
+#endif
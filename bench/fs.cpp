@@ -0,0 +1,113 @@
+/**********************************************************************
+File name: fs.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <string>
+
+#include "environment.hpp"
+
+namespace {
+
+void bench_opendir(std::size_t nentries)
+{
+    BenchEnvironment env;
+    env.populate_backend(nentries);
+    // the first sync creates the entries; later ones rewrite the directory
+    auto fi = env.opendir(Dragonstash::ROOT_INO);
+    env.releasedir(Dragonstash::ROOT_INO, fi);
+
+    BENCHMARK("opendir rewrite of " + std::to_string(nentries) + " entries") {
+        auto fi = env.opendir(Dragonstash::ROOT_INO);
+        env.releasedir(Dragonstash::ROOT_INO, fi);
+        return fi.fh;
+    };
+}
+
+/**
+ * @brief List a directory to the end.
+ *
+ * @return Number of replies it took.
+ */
+std::size_t list_dir(BenchEnvironment &env, fuse_file_info &fi, bool plus)
+{
+    constexpr std::size_t reply_size = 128 * 1024;
+    std::size_t nreplies = 0;
+    off_t off = 0;
+    while (true) {
+        auto req = env.fuse().new_request();
+        if (plus) {
+            env.fs().readdirplus(req.wrap(), Dragonstash::ROOT_INO, reply_size, off, &fi);
+        } else {
+            env.fs().readdir(req.wrap(), Dragonstash::ROOT_INO, reply_size, off, &fi);
+        }
+        if (req.reply_type() != TestFuseReplyType::BUF) {
+            throw std::runtime_error("readdir failed");
+        }
+        ++nreplies;
+        const off_t last = last_dirent_offset(std::get<TestFuseReplyBuf>(req.reply_argv()), plus);
+        if (last < 0) {
+            return nreplies;
+        }
+        off = last;
+    }
+}
+
+void bench_readdir(std::size_t nentries)
+{
+    BenchEnvironment env;
+    env.populate_backend(nentries);
+    auto fi = env.opendir(Dragonstash::ROOT_INO);
+
+    BENCHMARK("readdir of " + std::to_string(nentries) + " entries") {
+        return list_dir(env, fi, false);
+    };
+    BENCHMARK("readdirplus of " + std::to_string(nentries) + " entries") {
+        return list_dir(env, fi, true);
+    };
+
+    env.releasedir(Dragonstash::ROOT_INO, fi);
+}
+
+}
+
+TEST_CASE("opendir on a directory with 10k entries", "[fs]")
+{
+    bench_opendir(10000);
+}
+
+TEST_CASE("opendir on a directory with 100k entries", "[fs][.large]")
+{
+    bench_opendir(100000);
+}
+
+TEST_CASE("readdir on a directory with 10k entries", "[fs]")
+{
+    bench_readdir(10000);
+}
+
+TEST_CASE("readdir on a directory with 100k entries", "[fs][.large]")
+{
+    bench_readdir(100000);
+}
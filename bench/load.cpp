@@ -0,0 +1,385 @@
+/**********************************************************************
+File name: load.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dragonstash/backend/fault_injection.hpp"
+#include "dragonstash/backend/in_memory.hpp"
+#include "dragonstash/cache/cache.hpp"
+#include "dragonstash/fs.hpp"
+
+#include "testutils/tempdir.hpp"
+#include "testutils/fuse_backend.hpp"
+#include "testutils/load.hpp"
+
+#include <CLI/CLI.hpp>
+
+namespace {
+
+using Dragonstash::Backend::InMemory::Directory;
+using Dragonstash::Backend::InMemory::File;
+using Dragonstash::Backend::Stat;
+
+struct Options {
+    std::vector<std::size_t> threads{1, 2, 4, 8};
+    std::vector<std::string> workloads{"walk", "stat", "readdirplus", "seqread", "randread"};
+    double duration = 5.0;
+    double latency_ms = 0.;
+    double bandwidth_mib = 0.;
+    std::size_t fanout = 8;
+    std::size_t depth = 3;
+    std::size_t entries = 10000;
+    std::size_t files = 16;
+    std::size_t file_size = 4 << 20;
+    std::size_t read_size = 128 << 10;
+    bool no_warmup = false;
+    std::optional<Dragonstash::Backend::FaultInjectingFilesystem::Config> faults;
+};
+
+Stat dir_stat()
+{
+    return Stat{
+        .mode = S_IFDIR | S_IRWXU,
+        .uid = getuid(),
+        .gid = getgid(),
+    };
+}
+
+void make_file(Directory &parent, const std::string &name, std::size_t size)
+{
+    auto &file = parent.emplace<File>(name);
+    file.update_attr(Stat{
+        .mode = S_IFREG | S_IRUSR,
+        .size = size,
+        .uid = getuid(),
+        .gid = getgid(),
+    });
+    file.data().assign(size, std::byte(0x55));
+}
+
+void make_tree(Directory &dir, std::size_t fanout, std::size_t depth)
+{
+    for (std::size_t i = 0; i < fanout; ++i) {
+        make_file(dir, "f" + std::to_string(i), 64);
+    }
+    if (depth == 0) {
+        return;
+    }
+    for (std::size_t i = 0; i < fanout; ++i) {
+        auto &child = dir.emplace<Directory>("d" + std::to_string(i));
+        child.update_attr(dir_stat());
+        make_tree(child, fanout, depth - 1);
+    }
+}
+
+/**
+ * @brief The backend contents: a balanced tree for walking, one huge
+ * directory and large files for reading.
+ */
+void populate(Dragonstash::Backend::InMemoryFilesystem &backend, const Options &options)
+{
+    auto &tree = backend.emplace<Directory>("tree");
+    tree.update_attr(dir_stat());
+    make_tree(tree, options.fanout, options.depth);
+
+    auto &huge = backend.emplace<Directory>("huge");
+    huge.update_attr(dir_stat());
+    for (std::size_t i = 0; i < options.entries; ++i) {
+        make_file(huge, "e" + std::to_string(i), 0);
+    }
+
+    auto &data = backend.emplace<Directory>("data");
+    data.update_attr(dir_stat());
+    for (std::size_t i = 0; i < options.files; ++i) {
+        make_file(data, "s" + std::to_string(i), options.file_size);
+    }
+}
+
+/**
+ * @brief Like `find`: list every directory below @a ino, depth first.
+ */
+void walk(LoadClient &client, fuse_ino_t ino, const std::atomic<bool> &stop)
+{
+    auto fi = client.opendir(ino);
+    if (!fi) {
+        return;
+    }
+    auto entries = client.readdirplus(ino, *fi);
+    client.releasedir(ino, *fi);
+    if (!entries) {
+        return;
+    }
+    std::vector<fuse_ino_t> looked_up;
+    looked_up.reserve(entries->size());
+    for (const auto &entry: *entries) {
+        looked_up.push_back(entry.ino);
+        if (S_ISDIR(entry.mode) && !stop) {
+            walk(client, entry.ino, stop);
+        }
+    }
+    client.forget(looked_up);
+}
+
+/**
+ * @brief Like `ls -l` over names the client already knows: a lookup and a
+ * getattr for random files of the tree.
+ */
+void stat_files(LoadClient &client, fuse_ino_t tree, const Options &options,
+                std::mt19937 &rng, const std::atomic<bool> &stop)
+{
+    std::uniform_int_distribution<std::size_t> pick(0, options.fanout - 1);
+    while (!stop) {
+        fuse_ino_t dir = tree;
+        std::vector<fuse_ino_t> looked_up;
+        for (std::size_t level = 0; level < options.depth; ++level) {
+            auto child = client.lookup(dir, "d" + std::to_string(pick(rng)));
+            if (!child) {
+                break;
+            }
+            looked_up.push_back(*child);
+            dir = *child;
+        }
+        auto file = client.lookup(dir, "f" + std::to_string(pick(rng)));
+        if (file) {
+            looked_up.push_back(*file);
+            (void)client.getattr(*file);
+        }
+        client.forget(looked_up);
+    }
+}
+
+void read_file(LoadClient &client, fuse_ino_t ino, const Options &options,
+               std::mt19937 *rng, const std::atomic<bool> &stop)
+{
+    auto fi = client.open(ino);
+    if (!fi) {
+        return;
+    }
+    const std::size_t chunks = std::max<std::size_t>(options.file_size / options.read_size, 1);
+    std::uniform_int_distribution<std::size_t> pick(0, chunks - 1);
+    for (std::size_t i = 0; i < chunks && !stop; ++i) {
+        const std::size_t chunk = rng ? pick(*rng) : i;
+        (void)client.read(ino, *fi, options.read_size, off_t(chunk * options.read_size));
+    }
+    client.release(ino, *fi);
+}
+
+class LoadEnvironment {
+public:
+    explicit LoadEnvironment(const Options &options):
+        m_cache(m_cachedir.path()),
+        m_faulty(options.faults
+                 ? std::make_unique<Dragonstash::Backend::FaultInjectingFilesystem>(m_backend, *options.faults)
+                 : nullptr),
+        m_fs(m_cache, m_faulty ? *m_faulty : static_cast<Dragonstash::Backend::Filesystem&>(m_backend))
+    {
+        populate(m_backend, options);
+        m_backend.network().configure(Dragonstash::Backend::InMemory::Network::Config{
+            .latency = std::chrono::microseconds(std::int64_t(options.latency_ms * 1000.)),
+            .bandwidth = std::uint64_t(options.bandwidth_mib * 1024. * 1024.),
+        });
+
+        Dragonstash::Metrics::Histogram setup;
+        LoadClient client(m_fs, m_fuse, setup);
+        m_tree = lookup(client, Dragonstash::ROOT_INO, "tree");
+        m_huge = lookup(client, Dragonstash::ROOT_INO, "huge");
+        const fuse_ino_t data = lookup(client, Dragonstash::ROOT_INO, "data");
+        for (std::size_t i = 0; i < options.files; ++i) {
+            m_files.push_back(lookup(client, data, "s" + std::to_string(i)));
+        }
+    }
+
+private:
+    TemporaryDirectory m_cachedir;
+    Dragonstash::Cache m_cache;
+    Dragonstash::Backend::InMemoryFilesystem m_backend;
+    std::unique_ptr<Dragonstash::Backend::FaultInjectingFilesystem> m_faulty;
+    Dragonstash::Filesystem m_fs;
+    TestFuseBackend m_fuse;
+    fuse_ino_t m_tree;
+    fuse_ino_t m_huge;
+    std::vector<fuse_ino_t> m_files;
+
+    static fuse_ino_t lookup(LoadClient &client, fuse_ino_t parent, const std::string &name) {
+        auto result = client.lookup(parent, name);
+        if (!result) {
+            throw std::runtime_error("failed to look up " + name);
+        }
+        return *result;
+    }
+
+public:
+    [[nodiscard]] LoadWorker worker(const std::string &workload, const Options &options) {
+        if (workload == "walk") {
+            return [this](LoadClient &client, std::size_t, const std::atomic<bool> &stop) {
+                while (!stop) {
+                    walk(client, m_tree, stop);
+                }
+            };
+        }
+        if (workload == "stat") {
+            return [this, &options](LoadClient &client, std::size_t thread, const std::atomic<bool> &stop) {
+                std::mt19937 rng(thread);
+                stat_files(client, m_tree, options, rng, stop);
+            };
+        }
+        if (workload == "readdirplus") {
+            return [this](LoadClient &client, std::size_t, const std::atomic<bool> &stop) {
+                while (!stop) {
+                    auto fi = client.opendir(m_huge);
+                    if (!fi) {
+                        continue;
+                    }
+                    auto entries = client.readdirplus(m_huge, *fi);
+                    client.releasedir(m_huge, *fi);
+                    if (entries) {
+                        std::vector<fuse_ino_t> looked_up;
+                        looked_up.reserve(entries->size());
+                        for (const auto &entry: *entries) {
+                            looked_up.push_back(entry.ino);
+                        }
+                        client.forget(looked_up);
+                    }
+                }
+            };
+        }
+        if (workload == "seqread" || workload == "randread") {
+            const bool random = workload == "randread";
+            return [this, &options, random](LoadClient &client, std::size_t thread, const std::atomic<bool> &stop) {
+                std::mt19937 rng(thread);
+                // each thread starts on its own file
+                for (std::size_t i = thread; !stop; ++i) {
+                    read_file(client, m_files[i % m_files.size()], options,
+                              random ? &rng : nullptr, stop);
+                }
+            };
+        }
+        throw std::invalid_argument("unknown workload: " + workload);
+    }
+
+    /**
+     * @brief Run @a workload once from a single thread, so that the
+     * measurements see a warm cache.
+     */
+    void warmup(const std::string &workload, const Options &options) {
+        Dragonstash::Metrics::Histogram latency;
+        LoadClient client(m_fs, m_fuse, latency);
+        const std::atomic<bool> stop{false};
+        if (workload == "walk" || workload == "stat") {
+            walk(client, m_tree, stop);
+        } else if (workload == "readdirplus") {
+            auto fi = client.opendir(m_huge);
+            if (fi) {
+                (void)client.readdirplus(m_huge, *fi);
+                client.releasedir(m_huge, *fi);
+            }
+        } else {
+            for (fuse_ino_t file: m_files) {
+                read_file(client, file, options, nullptr, stop);
+            }
+        }
+    }
+
+    [[nodiscard]] LoadResult run(std::size_t threads, double duration, const LoadWorker &worker) {
+        return run_load(m_fs, m_fuse, threads, std::chrono::duration<double>(duration), worker);
+    }
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    CLI::App app{"Drive a dragonstash file system over an in-memory backend from several threads"};
+    Options options;
+    app.add_option("-t,--threads", options.threads, "Thread counts to measure each workload with (default: 1 2 4 8)")->type_name("N");
+    app.add_option("-w,--workload", options.workloads, "Workloads to run: walk, stat, readdirplus, seqread, randread (default: all)")->type_name("NAME");
+    app.add_option("--duration", options.duration, "Seconds to run each measurement for (default: 5)")->type_name("SECONDS");
+    app.add_option("--latency-ms", options.latency_ms, "Round trip latency of the emulated backend link (default: 0)")->type_name("MS");
+    app.add_option("--bandwidth-mib", options.bandwidth_mib, "Bandwidth of the emulated backend link in MiB/s; zero is unlimited (default: 0)")->type_name("MIBPS");
+    app.add_option("--fanout", options.fanout, "Subdirectories and files per directory of the walked tree (default: 8)")->type_name("N");
+    app.add_option("--depth", options.depth, "Depth of the walked tree (default: 3)")->type_name("N");
+    app.add_option("--entries", options.entries, "Entries in the huge directory (default: 10000)")->type_name("N");
+    app.add_option("--files", options.files, "Number of files to read (default: 16)")->type_name("N");
+    app.add_option("--file-size", options.file_size, "Size of the files to read in bytes (default: 4 MiB)")->type_name("BYTES");
+    app.add_option("--read-size", options.read_size, "Size of each read in bytes (default: 128 KiB)")->type_name("BYTES");
+    std::string faults;
+    app.add_option("--faults", faults, "Inject latency jitter and failures on top of the link, see --inject-faults of the mount command")->type_name("SPEC");
+    app.add_flag("--no-warmup", options.no_warmup, "Measure with a cold cache: skip the single-threaded pass over the contents");
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (!faults.empty()) {
+        auto faults_result = Dragonstash::Backend::FaultInjectingFilesystem::parse_config(faults);
+        if (!faults_result) {
+            std::cerr << "invalid fault injection: " << faults << std::endl;
+            return 2;
+        }
+        options.faults = *faults_result;
+    }
+    if (options.fanout == 0 || options.files == 0 || options.read_size == 0) {
+        std::cerr << "--fanout, --files and --read-size must be positive" << std::endl;
+        return 2;
+    }
+
+    std::cout << "workload,threads,requests,errors,seconds,requests_per_second,p50_us,p99_us,p999_us" << std::endl;
+    for (const auto &workload: options.workloads) {
+        for (std::size_t threads: options.threads) {
+            // a fresh cache for every point, so that the measurements are
+            // independent of each other
+            LoadEnvironment env(options);
+            LoadWorker worker;
+            try {
+                worker = env.worker(workload, options);
+            } catch (const std::invalid_argument &exc) {
+                std::cerr << exc.what() << std::endl;
+                return 2;
+            }
+            if (!options.no_warmup) {
+                env.warmup(workload, options);
+            }
+            const LoadResult result = env.run(threads, options.duration, worker);
+            std::cout << workload << ','
+                      << result.threads << ','
+                      << result.requests << ','
+                      << result.errors << ','
+                      << result.elapsed.count() << ','
+                      << result.requests_per_second() << ','
+                      << result.latency.quantile(0.5) / 1000. << ','
+                      << result.latency.quantile(0.99) / 1000. << ','
+                      << result.latency.quantile(0.999) / 1000. << std::endl;
+        }
+    }
+    return 0;
+}
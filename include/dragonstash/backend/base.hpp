@@ -29,8 +29,10 @@ authors named in the AUTHORS file.
 #include <string>
 #include <memory>
 #include <optional>
+#include <string_view>
 
 #include "dragonstash/error.hpp"
+#include "dragonstash/inline_function.hpp"
 
 namespace Dragonstash::Backend {
 
@@ -39,6 +41,26 @@ static inline bool is_not_connected(const Result<T> &result) {
     return !result && result.error() == ENOTCONN;
 }
 
+/**
+ * @brief Number of bytes a Completion can capture.
+ */
+static constexpr std::size_t COMPLETION_CAPACITY = 64;
+
+/**
+ * @brief Callback which receives the result of an asynchronous operation.
+ *
+ * Completions are called exactly once, either before the operation
+ * returns or later from a thread of the backend. They must not block on
+ * other backend operations, since that may stall the thread which
+ * delivers results; follow-up work which is expensive belongs on a worker
+ * pool.
+ *
+ * State which does not fit into the capacity, including a completion
+ * which is wrapped by another one, has to be moved to the heap.
+ */
+template <typename T>
+using Completion = InlineFunction<void(Result<T>), COMPLETION_CAPACITY>;
+
 struct Stat {
     uint32_t mode;
     uint64_t size;
@@ -49,6 +71,13 @@ struct Stat {
 };
 
 
+/**
+ * @brief Entry returned by Dir::readdir().
+ *
+ * If `complete` is set, all Stat fields are valid and the entry does not
+ * need to be stat-ed separately. Otherwise, only the file type bits of
+ * `mode` may be valid.
+ */
 struct DirEntry: public Stat {
     std::string name;
     bool complete;
@@ -66,6 +95,13 @@ public:
     virtual Result<void> fsync() = 0;
     virtual Result<void> close() = 0;
 
+    /**
+     * @brief Change the size of the file.
+     *
+     * The default implementation fails with EOPNOTSUPP.
+     */
+    virtual Result<void> ftruncate(off_t size);
+
 };
 
 
@@ -78,6 +114,66 @@ public:
     virtual Result<void> fsyncdir() = 0;
     virtual Result<void> closedir() = 0;
 
+    /**
+     * @brief Obtain the attributes of an entry of this directory.
+     *
+     * This allows backends to resolve the entry relative to the open
+     * directory instead of walking the full path again. It may be called
+     * from multiple threads and concurrently with readdir().
+     *
+     * The default implementation fails with ENOSYS, in which case the caller
+     * should fall back to Filesystem::lstat().
+     */
+    virtual Result<Stat> lstat_entry(std::string_view name);
+
+};
+
+/**
+ * @brief Handle on a backend directory for operations relative to it.
+ *
+ * Handles allow to operate on the entries of a directory without resolving
+ * the path of the directory again for each operation (openat()/fstatat() and
+ * friends for local directories, re-used remote handles for network
+ * backends). All operations take the name of a direct child; names
+ * containing slashes as well as "." and ".." are rejected with EINVAL.
+ *
+ * Handles may be used from multiple threads concurrently.
+ */
+class DirectoryHandle {
+public:
+    virtual ~DirectoryHandle();
+
+public:
+    virtual Result<std::unique_ptr<File>> open(std::string_view name,
+                                               int accesstype,
+                                               mode_t mode) = 0;
+    /**
+     * @brief Open a stream over the entries of the directory itself.
+     */
+    virtual Result<std::unique_ptr<Dir>> opendir() = 0;
+    virtual Result<Stat> lstat(std::string_view name) = 0;
+    virtual Result<std::string> readlink(std::string_view name) = 0;
+
+    /**
+     * @brief Asynchronous variant of lstat().
+     *
+     * @a name is only used before this returns, and the handle is not
+     * used anymore once @a done has been called. The default
+     * implementation calls lstat() and completes right away.
+     */
+    virtual void lstat_async(std::string_view name, Completion<Stat> &&done);
+
+    /**
+     * @brief Check whether the handle still refers to the directory at the
+     * path it was opened with.
+     *
+     * Handles which keep the directory itself open follow it when it is
+     * renamed or replaced on the backend. The default implementation returns
+     * true, which is right for handles which resolve the path for each
+     * operation.
+     */
+    virtual Result<bool> is_current();
+
 };
 
 class Filesystem {
@@ -92,8 +188,34 @@ public:
     virtual Result<Stat> lstat(std::string_view path) = 0;
     virtual Result<std::string> readlink(std::string_view path) = 0;
 
+    /**
+     * @brief Asynchronous variant of lstat().
+     *
+     * Backends on which results arrive independently of the caller (such
+     * as network backends which have many requests in flight) override
+     * this, so that callers do not occupy a thread for the round-trip.
+     *
+     * @a path is only used before this returns. The default implementation
+     * calls lstat() and completes right away.
+     */
+    virtual void lstat_async(std::string_view path, Completion<Stat> &&done);
+
+    /**
+     * @brief Open a handle on a directory.
+     *
+     * The default implementation returns a handle which joins the names
+     * to @a path and forwards to the path-based operations of this
+     * filesystem; it does not check whether the directory exists.
+     */
+    virtual Result<std::unique_ptr<DirectoryHandle>> open_directory(std::string_view path);
+
 };
 
+/**
+ * @brief Check whether a name refers to a direct child of a directory.
+ */
+[[nodiscard]] bool is_valid_entry_name(std::string_view name);
+
 }
 
 #endif
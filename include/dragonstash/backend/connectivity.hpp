@@ -0,0 +1,301 @@
+/**********************************************************************
+File name: connectivity.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_BACKEND_CONNECTIVITY_H
+#define DRAGONSTASH_BACKEND_CONNECTIVITY_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "dragonstash/backend/base.hpp"
+#include "dragonstash/metrics.hpp"
+
+namespace Dragonstash::Backend {
+
+/**
+ * @brief Track whether a backend is reachable and fail fast while it is not.
+ *
+ * This wraps another filesystem. As long as the backend is connected,
+ * all operations are forwarded. The first operation which fails with
+ * ENOTCONN switches the state to disconnected; from then on, all
+ * operations (including those on files, directory streams and handles
+ * obtained earlier) fail with ENOTCONN right away, without asking the
+ * backend, so that the frontend serves them from the cache.
+ *
+ * While disconnected, a background thread probes the backend by stat-ing
+ * the probe path. The interval between probes starts at the initial
+ * backoff and doubles after each failed probe, up to the maximum backoff.
+ * Once a probe succeeds, the state switches back to connected.
+ *
+ * Closing files and directory streams is always forwarded, so that their
+ * resources are released.
+ *
+ * The latency of all forwarded operations is recorded per method, see
+ * collect_metrics().
+ */
+class ConnectivityFilesystem: public Filesystem {
+public:
+    enum class State {
+        CONNECTED,
+        DISCONNECTED,
+    };
+
+    struct Config {
+        /**
+         * @brief Delay before the first probe after the backend went away.
+         */
+        std::chrono::milliseconds initial_backoff{500};
+
+        /**
+         * @brief Upper limit for the delay between probes.
+         */
+        std::chrono::milliseconds max_backoff{60000};
+
+        /**
+         * @brief Backend path which is stat-ed by probes.
+         */
+        std::string probe_path = "/";
+
+        /**
+         * @brief State to start in.
+         *
+         * Starting disconnected is useful if the backend is known to be
+         * unavailable, as then not even the first request waits for it.
+         */
+        State initial_state = State::CONNECTED;
+    };
+
+    /**
+     * @brief Backend operations whose latency is recorded.
+     */
+    enum class Method {
+        OPEN,
+        OPENDIR,
+        LSTAT,
+        READLINK,
+        OPEN_DIRECTORY,
+        FSTAT,
+        PREAD,
+        PWRITE,
+        FSYNC,
+        FTRUNCATE,
+        CLOSE,
+        READDIR,
+        FSYNCDIR,
+        CLOSEDIR,
+        LSTAT_ENTRY,
+    };
+
+    static constexpr std::size_t METHODS = std::size_t(Method::LSTAT_ENTRY) + 1;
+
+public:
+    explicit ConnectivityFilesystem(Filesystem &backend);
+    ConnectivityFilesystem(Filesystem &backend, const Config &config);
+    ConnectivityFilesystem(const ConnectivityFilesystem &src) = delete;
+    ConnectivityFilesystem(ConnectivityFilesystem &&src) = delete;
+    ConnectivityFilesystem &operator=(const ConnectivityFilesystem &src) = delete;
+    ConnectivityFilesystem &operator=(ConnectivityFilesystem &&src) = delete;
+    ~ConnectivityFilesystem() override;
+
+private:
+    Filesystem &m_backend;
+    const Config m_config;
+
+    /**
+     * @brief Copy of the state for the fast path.
+     */
+    std::atomic<bool> m_connected;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake_cv;
+    std::condition_variable m_state_cv;
+    std::chrono::milliseconds m_backoff;
+    bool m_stopping;
+
+    std::atomic<std::uint64_t> m_disconnects;
+    std::atomic<std::uint64_t> m_reconnects;
+    std::atomic<std::uint64_t> m_probes;
+    std::atomic<std::uint64_t> m_short_circuited;
+
+    std::array<Metrics::Histogram, METHODS> m_latency;
+
+    std::thread m_prober;
+
+    void run();
+    void set_connected(bool connected);
+
+public:
+    [[nodiscard]] static const char *method_name(Method method);
+
+    /**
+     * @brief Run an operation on the backend and record its latency.
+     */
+    template <typename F>
+    auto measured(Method method, F &&op) -> decltype(op())
+    {
+        const auto started = Metrics::Clock::now();
+        auto result = op();
+        m_latency[std::size_t(method)].record_since(started);
+        return result;
+    }
+
+    /**
+     * @brief Run an operation on the backend unless it is known to be down.
+     *
+     * If the operation fails with ENOTCONN, the state switches to
+     * disconnected.
+     */
+    template <typename F>
+    auto guarded(Method method, F &&op) -> decltype(op())
+    {
+        if (!m_connected.load(std::memory_order_acquire)) {
+            m_short_circuited.fetch_add(1, std::memory_order_relaxed);
+            return make_result(FAILED, ENOTCONN);
+        }
+        auto result = measured(method, std::forward<F>(op));
+        if (is_not_connected(result)) {
+            mark_disconnected();
+        }
+        return result;
+    }
+
+    /**
+     * @brief Asynchronous variant of guarded().
+     *
+     * @a op receives the completion to pass to the backend.
+     */
+    template <typename T, typename F>
+    void guarded_async(Method method, F &&op, Completion<T> &&done)
+    {
+        if (!m_connected.load(std::memory_order_acquire)) {
+            m_short_circuited.fetch_add(1, std::memory_order_relaxed);
+            done(make_result(FAILED, ENOTCONN));
+            return;
+        }
+        // the completion of the caller does not fit next to our state
+        auto inner = std::make_unique<Completion<T>>(std::move(done));
+        Metrics::Histogram &latency = m_latency[std::size_t(method)];
+        op(Completion<T>([this, &latency, started = Metrics::Clock::now(),
+                          inner = std::move(inner)](Result<T> result) mutable {
+            latency.record_since(started);
+            if (is_not_connected(result)) {
+                mark_disconnected();
+            }
+            (*inner)(std::move(result));
+        }));
+    }
+
+    [[nodiscard]] inline State state() const {
+        return m_connected.load(std::memory_order_acquire)
+                ? State::CONNECTED
+                : State::DISCONNECTED;
+    }
+
+    /**
+     * @brief Switch to the disconnected state and start probing.
+     */
+    void mark_disconnected();
+
+    /**
+     * @brief Probe the backend right away.
+     *
+     * @return true if the backend is connected.
+     */
+    bool probe();
+
+    /**
+     * @brief Block until the backend is connected or the timeout expires.
+     *
+     * @return true if the backend is connected.
+     */
+    bool wait_connected(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Delay before the next probe.
+     */
+    [[nodiscard]] std::chrono::milliseconds backoff();
+
+    /**
+     * @brief Number of switches from connected to disconnected.
+     */
+    [[nodiscard]] inline std::uint64_t disconnects() const {
+        return m_disconnects.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Number of switches from disconnected to connected.
+     */
+    [[nodiscard]] inline std::uint64_t reconnects() const {
+        return m_reconnects.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Number of probes sent to the backend.
+     */
+    [[nodiscard]] inline std::uint64_t probes() const {
+        return m_probes.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Number of operations which failed without asking the backend.
+     */
+    [[nodiscard]] inline std::uint64_t short_circuited() const {
+        return m_short_circuited.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Latency of the operations of a method which were forwarded to
+     * the backend.
+     */
+    [[nodiscard]] inline const Metrics::Histogram &latency(Method method) const {
+        return m_latency[std::size_t(method)];
+    }
+
+    /**
+     * @brief Write the connection state, its counters and the latency
+     * histograms.
+     */
+    void collect_metrics(Metrics::TextWriter &out) const;
+
+    // Filesystem interface
+public:
+    Result<std::unique_ptr<File>> open(std::string_view path, int accesstype, mode_t mode) override;
+    Result<std::unique_ptr<Dir>> opendir(std::string_view path) override;
+    Result<Stat> lstat(std::string_view path) override;
+    Result<std::string> readlink(std::string_view path) override;
+    void lstat_async(std::string_view path, Completion<Stat> &&done) override;
+    Result<std::unique_ptr<DirectoryHandle>> open_directory(std::string_view path) override;
+
+};
+
+}
+
+#endif
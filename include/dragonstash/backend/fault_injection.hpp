@@ -0,0 +1,283 @@
+/**********************************************************************
+File name: fault_injection.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_BACKEND_FAULT_INJECTION_H
+#define DRAGONSTASH_BACKEND_FAULT_INJECTION_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string_view>
+#include <thread>
+
+#include "dragonstash/backend/base.hpp"
+#include "dragonstash/metrics.hpp"
+
+namespace Dragonstash::Backend {
+
+/**
+ * @brief Make another backend behave like one behind a slow and unreliable
+ * link.
+ *
+ * Every operation is delayed by a latency with random jitter before its
+ * result is returned, data read and written additionally queues for a
+ * bandwidth which is shared by all operations, and operations randomly
+ * fail with ENOTCONN. With a flap duration, each of those failures takes
+ * the backend down for that long, during which all operations fail.
+ *
+ * Failed operations are not forwarded. Closing files and directory streams
+ * is always forwarded right away, so that their resources are released.
+ *
+ * Asynchronous operations do not block the caller: their results are held
+ * back by a timer thread until the delay has passed.
+ */
+class FaultInjectingFilesystem: public Filesystem {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Jitter {
+        /**
+         * @brief Uniformly distributed between zero and the jitter.
+         */
+        UNIFORM,
+
+        /**
+         * @brief Exponentially distributed with the jitter as mean, which
+         * gives a long tail of slow operations.
+         */
+        EXPONENTIAL,
+    };
+
+    struct Config {
+        /**
+         * @brief Delay which is added to every operation.
+         */
+        std::chrono::microseconds latency{0};
+
+        /**
+         * @brief Scale of the random delay which is added on top of the
+         * latency.
+         */
+        std::chrono::microseconds jitter{0};
+
+        Jitter jitter_distribution = Jitter::UNIFORM;
+
+        /**
+         * @brief Bytes per second for data read and written; zero is
+         * unlimited.
+         */
+        std::uint64_t bandwidth = 0;
+
+        /**
+         * @brief Probability with which an operation fails with ENOTCONN.
+         */
+        double failure_rate = 0.;
+
+        /**
+         * @brief Time for which the backend stays down after an injected
+         * failure; zero only fails the single operation.
+         */
+        std::chrono::milliseconds flap_duration{0};
+
+        std::uint64_t seed = 0;
+    };
+
+public:
+    FaultInjectingFilesystem(Filesystem &backend, const Config &config);
+    FaultInjectingFilesystem(const FaultInjectingFilesystem &src) = delete;
+    FaultInjectingFilesystem(FaultInjectingFilesystem &&src) = delete;
+    FaultInjectingFilesystem &operator=(const FaultInjectingFilesystem &src) = delete;
+    FaultInjectingFilesystem &operator=(FaultInjectingFilesystem &&src) = delete;
+    ~FaultInjectingFilesystem() override;
+
+private:
+    struct Delayed {
+        Completion<Stat> done;
+        Result<Stat> result;
+    };
+
+    Filesystem &m_backend;
+    const Config m_config;
+
+    std::mutex m_mutex;
+    std::mt19937_64 m_rng;
+    Clock::time_point m_down_until;
+    Clock::time_point m_link_free;
+
+    std::atomic<std::uint64_t> m_injected_failures;
+    std::atomic<std::uint64_t> m_flaps;
+
+    std::mutex m_timer_mutex;
+    std::condition_variable m_timer_cv;
+    std::multimap<Clock::time_point, std::unique_ptr<Delayed>> m_timers;
+    bool m_stopping;
+    std::thread m_timer;
+
+    void run_timers();
+    void deliver_at(Clock::time_point deadline, std::unique_ptr<Delayed> &&delayed);
+
+public:
+    struct Admission {
+        /**
+         * @brief Time at which the result may be returned.
+         */
+        Clock::time_point deadline;
+
+        /**
+         * @brief Whether the operation fails with ENOTCONN instead of being
+         * forwarded.
+         */
+        bool fail;
+    };
+
+    /**
+     * @brief Decide the fate of an operation which starts now.
+     *
+     * @param round_trip Whether the operation waits for the latency; reads
+     *   from directory streams only wait for their data.
+     */
+    [[nodiscard]] Admission admit(bool round_trip = true);
+
+    /**
+     * @brief Queue @a nbytes for the link.
+     *
+     * @return The time at which the data has passed the link when sending
+     *   starts at @a start.
+     */
+    [[nodiscard]] Clock::time_point transfer(Clock::time_point start, std::size_t nbytes);
+
+    /**
+     * @brief Run an operation on the backend as if it were behind the link.
+     */
+    template <typename F>
+    auto injected(F &&op) -> decltype(op())
+    {
+        const Admission admission = admit();
+        if (admission.fail) {
+            std::this_thread::sleep_until(admission.deadline);
+            return make_result(FAILED, ENOTCONN);
+        }
+        auto result = op();
+        std::this_thread::sleep_until(admission.deadline);
+        return result;
+    }
+
+    /**
+     * @brief Like injected(), but additionally wait for the bytes which
+     * were transferred by the operation.
+     */
+    template <typename F>
+    Result<ssize_t> injected_transfer(F &&op)
+    {
+        const Admission admission = admit();
+        if (admission.fail) {
+            std::this_thread::sleep_until(admission.deadline);
+            return make_result(FAILED, ENOTCONN);
+        }
+        Result<ssize_t> result = op();
+        if (result && *result > 0) {
+            std::this_thread::sleep_until(transfer(admission.deadline, std::size_t(*result)));
+        } else {
+            std::this_thread::sleep_until(admission.deadline);
+        }
+        return result;
+    }
+
+    /**
+     * @brief Asynchronous variant of injected().
+     *
+     * @a op receives the completion to pass to the backend; the result is
+     * held back until the delay has passed.
+     */
+    template <typename F>
+    void injected_async(F &&op, Completion<Stat> &&done)
+    {
+        const Admission admission = admit();
+        if (admission.fail) {
+            deliver_at(admission.deadline, std::make_unique<Delayed>(
+                           Delayed{std::move(done), make_result(FAILED, ENOTCONN)}));
+            return;
+        }
+        // the completion of the caller does not fit next to our state
+        auto delayed = std::make_unique<Delayed>(
+                    Delayed{std::move(done), make_result(FAILED, EIO)});
+        op(Completion<Stat>([this, deadline = admission.deadline,
+                             delayed = std::move(delayed)](Result<Stat> result) mutable {
+            delayed->result = std::move(result);
+            deliver_at(deadline, std::move(delayed));
+        }));
+    }
+
+    /**
+     * @brief Number of operations which failed because of the injection.
+     */
+    [[nodiscard]] inline std::uint64_t injected_failures() const {
+        return m_injected_failures.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Number of times the backend went down for the flap duration.
+     */
+    [[nodiscard]] inline std::uint64_t flaps() const {
+        return m_flaps.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Write the counters of injected failures.
+     */
+    void collect_metrics(Metrics::TextWriter &out) const;
+
+    /**
+     * @brief Parse a configuration in the format `KEY=VALUE[,KEY=VALUE...]`.
+     *
+     * Keys: `latency` and `jitter` (milliseconds), `distribution`
+     * (`uniform` or `exponential`), `bandwidth` (KiB per second),
+     * `failure` (probability between 0 and 1), `flap` (milliseconds) and
+     * `seed`.
+     *
+     * Error codes:
+     *
+     * - EINVAL: The specification is malformed.
+     */
+    [[nodiscard]] static Result<Config> parse_config(std::string_view spec);
+
+    // Filesystem interface
+public:
+    Result<std::unique_ptr<File>> open(std::string_view path, int accesstype, mode_t mode) override;
+    Result<std::unique_ptr<Dir>> opendir(std::string_view path) override;
+    Result<Stat> lstat(std::string_view path) override;
+    Result<std::string> readlink(std::string_view path) override;
+    void lstat_async(std::string_view path, Completion<Stat> &&done) override;
+    Result<std::unique_ptr<DirectoryHandle>> open_directory(std::string_view path) override;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,118 @@
+/**********************************************************************
+File name: handle_table.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_BACKEND_HANDLE_TABLE_H
+#define DRAGONSTASH_BACKEND_HANDLE_TABLE_H
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "dragonstash/backend/base.hpp"
+
+namespace Dragonstash::Backend {
+
+/**
+ * @brief Bounded LRU table of open directory handles.
+ *
+ * The table is keyed by an opaque 64 bit key (the frontend uses cache
+ * inodes). Handles are shared: evicting or invalidating a handle which is
+ * in use by another thread only drops the table's reference, and the handle
+ * is closed once the last user lets go of it.
+ */
+class HandleTable {
+public:
+    using Key = std::uint64_t;
+    using HandlePtr = std::shared_ptr<DirectoryHandle>;
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::size_t DEFAULT_CAPACITY = 256;
+
+public:
+    explicit HandleTable(std::size_t capacity = DEFAULT_CAPACITY);
+    HandleTable(const HandleTable &src) = delete;
+    HandleTable(HandleTable &&src) = delete;
+    HandleTable &operator=(const HandleTable &src) = delete;
+    HandleTable &operator=(HandleTable &&src) = delete;
+    ~HandleTable() = default;
+
+private:
+    struct Record {
+        Key key;
+        HandlePtr handle;
+        /** When the handle was put or last marked as checked */
+        Clock::time_point checked;
+    };
+
+    std::mutex m_mutex;
+    std::size_t m_capacity;
+    std::list<Record> m_lru;
+    std::unordered_map<Key, std::list<Record>::iterator> m_index;
+
+public:
+    /**
+     * @brief Return the handle for @a key, or nullptr if there is none.
+     */
+    [[nodiscard]] HandlePtr get(Key key);
+
+    /**
+     * @brief Return the handle for @a key, or nullptr if there is none.
+     *
+     * @param checked Set to the time at which the handle was put or last
+     *   marked as checked; see mark_checked().
+     */
+    [[nodiscard]] HandlePtr get(Key key, Clock::time_point &checked);
+
+    /**
+     * @brief Insert or replace the handle for @a key.
+     *
+     * If the table is full, the least recently used handle is evicted.
+     */
+    void put(Key key, HandlePtr handle);
+
+    /**
+     * @brief Record that the handle for @a key has been found to still
+     * refer to the right directory.
+     *
+     * @see DirectoryHandle::is_current()
+     */
+    void mark_checked(Key key);
+
+    void invalidate(Key key);
+    void clear();
+
+    [[nodiscard]] std::size_t size();
+
+    [[nodiscard]] inline std::size_t capacity() const {
+        return m_capacity;
+    }
+
+};
+
+}
+
+#endif
@@ -25,7 +25,10 @@ authors named in the AUTHORS file.
 #ifndef DRAGONSTASH_BACKEND_IN_MEMORY_H
 #define DRAGONSTASH_BACKEND_IN_MEMORY_H
 
+#include <chrono>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 
@@ -35,6 +38,52 @@ namespace Dragonstash::Backend {
 
 namespace InMemory {
 
+/**
+ * @brief Delays which emulate a network link in front of the in-memory
+ * backend, e.g. a WAN.
+ *
+ * Every request waits for the round trip latency; requests from several
+ * threads wait concurrently. Data additionally queues for the bandwidth,
+ * which is shared by all transfers.
+ */
+class Network {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Config {
+        std::chrono::microseconds latency{0};
+
+        /** Bytes per second; zero is unlimited */
+        std::uint64_t bandwidth = 0;
+    };
+
+    Network() = default;
+    Network(const Network &src) = delete;
+    Network(Network &&src) = delete;
+    Network &operator=(const Network &src) = delete;
+    Network &operator=(Network &&src) = delete;
+
+private:
+    mutable std::mutex m_mutex;
+    Config m_config;
+    Clock::time_point m_link_free;
+
+public:
+    void configure(const Config &config);
+
+    [[nodiscard]] Config config() const;
+
+    /**
+     * @brief Wait for the latency of a request.
+     */
+    void round_trip();
+
+    /**
+     * @brief Wait until @a nbytes have passed the link.
+     */
+    void transfer(std::size_t nbytes);
+};
+
 class Node {
 public:
     Node() = default;
@@ -81,11 +130,12 @@ public:
 class FileHandle: public Dragonstash::Backend::File {
 public:
     FileHandle() = delete;
-    explicit FileHandle(InMemory::File &file);
+    explicit FileHandle(InMemory::File &file, Network *network = nullptr);
     ~FileHandle() override;
 
 private:
     InMemory::File *m_file;
+    Network *m_network;
 
     // File interface
 public:
@@ -93,6 +143,7 @@ public:
     Result<ssize_t> pread(void *buf, size_t count, off_t offset) override;
     Result<ssize_t> pwrite(const void *buf, size_t count, off_t offset) override;
     Result<void> fsync() override;
+    Result<void> ftruncate(off_t size) override;
     Result<void> close() override;
 };
 
@@ -154,7 +205,7 @@ public:
 class DirHandle: public Dragonstash::Backend::Dir {
 public:
     DirHandle() = delete;
-    explicit DirHandle(Directory &node);
+    explicit DirHandle(Directory &node, Network *network = nullptr);
     ~DirHandle() override;
 
 private:
@@ -165,6 +216,7 @@ private:
     };
 
     Directory *m_node;
+    Network *m_network;
     State m_state;
     Directory::Children::iterator m_iter;
 
@@ -173,6 +225,7 @@ public:
     Result<DirEntry> readdir() override;
     Result<void> fsyncdir() override;
     Result<void> closedir() override;
+    Result<Stat> lstat_entry(std::string_view name) override;
 };
 
 }
@@ -180,6 +233,7 @@ public:
 class InMemoryFilesystem: public Filesystem, public InMemory::Directory {
 private:
     bool m_connected{true};
+    InMemory::Network m_network;
 
 public:
     [[nodiscard]] inline bool connected() const {
@@ -188,6 +242,14 @@ public:
 
     void set_connected(bool connected);
 
+    /**
+     * @brief The emulated link to the backend; without configuration, it
+     * adds no delay.
+     */
+    [[nodiscard]] inline InMemory::Network &network() {
+        return m_network;
+    }
+
     // Filesystem interface
 public:
     [[nodiscard]] Result<std::unique_ptr<File> > open(std::string_view path, int accesstype, mode_t mode) override;
@@ -47,6 +47,7 @@ public:
     Result<Stat> fstat() override;
     Result<ssize_t> pread(void *buf, size_t count, off_t offset) override;
     Result<ssize_t> pwrite(const void *buf, size_t count, off_t offset) override;
+    Result<void> ftruncate(off_t size) override;
     Result<void> fsync() override;
     Result<void> close() override;
 };
@@ -64,6 +65,31 @@ public:
     Result<DirEntry> readdir() override;
     Result<void> fsyncdir() override;
     Result<void> closedir() override;
+    Result<Stat> lstat_entry(std::string_view name) override;
+};
+
+class LocalDirectoryHandle: public DirectoryHandle {
+public:
+    /**
+     * @param path Full path the directory has been opened with; see
+     *   is_current().
+     */
+    LocalDirectoryHandle(int fd, std::string path);
+    ~LocalDirectoryHandle() override;
+
+private:
+    int m_fd;
+    std::string m_path;
+
+    // DirectoryHandle interface
+public:
+    Result<std::unique_ptr<File>> open(std::string_view name,
+                                       int accesstype,
+                                       mode_t mode) override;
+    Result<std::unique_ptr<Dir>> opendir() override;
+    Result<Stat> lstat(std::string_view name) override;
+    Result<std::string> readlink(std::string_view name) override;
+    Result<bool> is_current() override;
 };
 
 class LocalFilesystem: public Filesystem {
@@ -83,6 +109,7 @@ public:
     [[nodiscard]] Result<std::unique_ptr<Dir> > opendir(std::string_view path) override;
     [[nodiscard]] Result<Stat> lstat(std::string_view path) override;
     [[nodiscard]] Result<std::string> readlink(std::string_view path) override;
+    [[nodiscard]] Result<std::unique_ptr<DirectoryHandle>> open_directory(std::string_view path) override;
 
 };
 
@@ -0,0 +1,343 @@
+/**********************************************************************
+File name: sftp.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_BACKEND_SFTP_H
+#define DRAGONSTASH_BACKEND_SFTP_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "dragonstash/backend/base.hpp"
+#include "dragonstash/backend/sftp_protocol.hpp"
+
+namespace Dragonstash::Backend {
+
+/**
+ * @brief One SFTP connection.
+ *
+ * The session talks to the server over a stream socket, usually one end of
+ * a socketpair whose other end is stdin/stdout of `ssh -s sftp`. Requests
+ * can be sent from multiple threads; a reader thread routes the replies to
+ * the waiting callers by request id, so that any number of requests can
+ * be in flight at the same time.
+ *
+ * Replies to requests sent with send_async() are handed to a dispatcher
+ * thread, which runs the callbacks in order; a callback which blocks
+ * delays the other callbacks, but not the replies to callers waiting in
+ * receive().
+ *
+ * Once the connection breaks, all pending and future requests fail with
+ * ENOTCONN.
+ */
+class SftpSession {
+public:
+    struct Reply {
+        Sftp::PacketType type;
+
+        /**
+         * @brief The body of the reply, without the request id.
+         */
+        std::string body;
+    };
+
+    /**
+     * @brief Called with the reply to a request sent with send_async().
+     *
+     * Large enough to hold a Completion and a few more bytes of state.
+     */
+    using Callback = InlineFunction<void(Result<Reply>), COMPLETION_CAPACITY + 32>;
+
+public:
+    /**
+     * @param fd The socket; the session takes ownership.
+     * @param child Process which is terminated and reaped when the session
+     *   is destroyed, or -1.
+     */
+    explicit SftpSession(int fd, pid_t child = -1);
+    SftpSession(const SftpSession &src) = delete;
+    SftpSession(SftpSession &&src) = delete;
+    SftpSession &operator=(const SftpSession &src) = delete;
+    SftpSession &operator=(SftpSession &&src) = delete;
+    ~SftpSession();
+
+private:
+    struct Pending {
+        std::optional<Reply> reply;
+
+        /**
+         * @brief Set for requests sent with send_async().
+         */
+        Callback callback;
+    };
+
+    /**
+     * @brief Queue of the dispatcher thread.
+     *
+     * Shared with the thread, so that a callback may destroy the session
+     * it runs on.
+     */
+    struct Dispatch {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool stopped = false;
+        std::deque<std::pair<Callback, Result<Reply>>> queue;
+    };
+
+private:
+    int m_fd;
+    pid_t m_child;
+
+    std::mutex m_write_mutex;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_reply_cv;
+    bool m_connected;
+    std::uint32_t m_next_id;
+    std::unordered_map<std::uint32_t, Pending> m_pending;
+
+    std::atomic<std::size_t> m_handles;
+
+    std::shared_ptr<Dispatch> m_dispatch;
+    std::thread m_dispatcher;
+    std::thread m_reader;
+
+    Result<void> write_packet(Sftp::PacketType type,
+                              const std::uint32_t *id,
+                              std::string_view body);
+    Result<std::string> read_packet();
+    Result<std::uint32_t> send_pending(Sftp::PacketType type,
+                                       std::string_view body,
+                                       Callback *callback);
+    void disconnect();
+    void run();
+    static void dispatch(std::shared_ptr<Dispatch> state);
+
+public:
+    /**
+     * @brief Start a process and connect a session to its stdin and stdout.
+     *
+     * The session is not initialised yet.
+     */
+    [[nodiscard]] static Result<std::unique_ptr<SftpSession>> spawn(
+            const std::vector<std::string> &argv);
+
+    /**
+     * @brief Negotiate the protocol version and start receiving replies.
+     *
+     * Must be called once before any request is sent.
+     *
+     * Error codes:
+     *
+     * - ENOTCONN: The connection broke.
+     * - EPROTO: The server does not speak version 3.
+     */
+    [[nodiscard]] Result<void> init();
+
+    /**
+     * @brief Send a request without waiting for the reply.
+     *
+     * @param body The body of the request after the request id.
+     * @return The request id, which must be passed to receive() exactly
+     *   once.
+     */
+    [[nodiscard]] Result<std::uint32_t> send(Sftp::PacketType type,
+                                             std::string_view body);
+
+    /**
+     * @brief Send a request and call @a callback with its reply on the
+     * dispatcher thread.
+     *
+     * If the session is not connected, @a callback is called before
+     * send_async() returns.
+     */
+    void send_async(Sftp::PacketType type,
+                    std::string_view body,
+                    Callback &&callback);
+
+    /**
+     * @brief Wait for the reply to a request sent earlier.
+     */
+    [[nodiscard]] Result<Reply> receive(std::uint32_t id);
+
+    /**
+     * @brief Send a request and wait for its reply.
+     */
+    [[nodiscard]] Result<Reply> call(Sftp::PacketType type,
+                                     std::string_view body);
+
+    [[nodiscard]] bool connected() const;
+
+    /**
+     * @brief Number of requests sent and not received plus the number of
+     * remote handles open on the session.
+     */
+    [[nodiscard]] std::size_t load() const;
+
+    /**
+     * @brief Count a remote handle towards load().
+     */
+    void add_handle();
+    void remove_handle();
+
+};
+
+/**
+ * @brief Interpret a STATUS reply.
+ *
+ * Any other reply fails with EBADMSG.
+ */
+[[nodiscard]] Result<void> sftp_status(const SftpSession::Reply &reply);
+
+/**
+ * @brief Backend for a directory on an SFTP server.
+ *
+ * The filesystem keeps a pool of sessions. Each operation runs on the
+ * session with the lowest load; a new session is connected when all
+ * sessions are busy and the pool is not full yet. Broken sessions are
+ * dropped from the pool, so that the next operation reconnects. Files and
+ * directory streams stay on the session they were opened on.
+ *
+ * Reads are split into chunks, of which several are requested at the same
+ * time instead of waiting for each one in turn, so that a read of a large
+ * range costs about one round-trip instead of one per chunk.
+ *
+ * The SFTP protocol has no inode numbers and only second resolution for
+ * times; the ctime reported is the mtime.
+ */
+class SftpFilesystem: public Filesystem {
+public:
+    /**
+     * @brief Create a connected and initialised session.
+     */
+    using Connector = std::function<Result<std::unique_ptr<SftpSession>>()>;
+
+    struct Config {
+        /**
+         * @brief Directory on the server which is the root of the backend;
+         * empty for the login directory.
+         */
+        std::string root;
+
+        /**
+         * @brief Maximum number of sessions in the pool.
+         */
+        std::size_t connections = 4;
+
+        /**
+         * @brief Number of bytes requested by a single READ or WRITE.
+         */
+        std::size_t chunk_size = 32*1024;
+
+        /**
+         * @brief Number of READ or WRITE requests which a single pread()
+         * or pwrite() keeps in flight.
+         */
+        std::size_t max_outstanding = 16;
+    };
+
+    /**
+     * @brief How to reach an SFTP server given by URL.
+     */
+    struct Target {
+        /**
+         * @brief Command which connects stdin and stdout to the SFTP
+         * subsystem of the server.
+         */
+        std::vector<std::string> command;
+        std::string root;
+    };
+
+public:
+    explicit SftpFilesystem(Connector connector);
+    SftpFilesystem(Connector connector, const Config &config);
+
+private:
+    Connector m_connector;
+    Config m_config;
+
+    std::mutex m_pool_mutex;
+    std::vector<std::shared_ptr<SftpSession>> m_sessions;
+
+    Result<std::shared_ptr<SftpSession>> session();
+
+public:
+    /**
+     * @brief Parse `sftp://[USER@]HOST[:PORT][/PATH]` or
+     * `[USER@]HOST:[PATH]`.
+     *
+     * The command runs ssh with the sftp subsystem.
+     *
+     * Error codes:
+     *
+     * - EINVAL: The URL is malformed.
+     */
+    [[nodiscard]] static Result<Target> parse_url(std::string_view url);
+
+    /**
+     * @brief Connector which spawns @a command for each session.
+     */
+    [[nodiscard]] static Connector command_connector(std::vector<std::string> command);
+
+    /**
+     * @brief Map a backend path to the path on the server.
+     *
+     * Error codes:
+     *
+     * - EINVAL: The path is not absolute.
+     */
+    [[nodiscard]] Result<std::string> remote_path(std::string_view path) const;
+
+    /**
+     * @brief Number of sessions in the pool.
+     */
+    [[nodiscard]] std::size_t sessions();
+
+    // Filesystem interface
+public:
+    [[nodiscard]] Result<std::unique_ptr<File>> open(std::string_view path,
+                                                     int accesstype,
+                                                     mode_t mode) override;
+    [[nodiscard]] Result<std::unique_ptr<Dir>> opendir(std::string_view path) override;
+    [[nodiscard]] Result<Stat> lstat(std::string_view path) override;
+    void lstat_async(std::string_view path, Completion<Stat> &&done) override;
+    [[nodiscard]] Result<std::string> readlink(std::string_view path) override;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,205 @@
+/**********************************************************************
+File name: sftp_protocol.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_BACKEND_SFTP_PROTOCOL_H
+#define DRAGONSTASH_BACKEND_SFTP_PROTOCOL_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "dragonstash/backend/base.hpp"
+
+/**
+ * Encoding of the SSH File Transfer Protocol, version 3
+ * (draft-ietf-secsh-filexfer-02), which is what OpenSSH speaks.
+ *
+ * A packet is a uint32 length followed by a byte type and the body; all
+ * integers are big endian, strings are prefixed with their uint32 length.
+ * Except for INIT and VERSION, the body starts with a uint32 request id.
+ */
+namespace Dragonstash::Backend::Sftp {
+
+static constexpr std::uint32_t PROTOCOL_VERSION = 3;
+
+/**
+ * @brief Largest packet which is accepted from the peer.
+ */
+static constexpr std::uint32_t MAX_PACKET_SIZE = 256*1024;
+
+enum class PacketType: std::uint8_t {
+    INIT = 1,
+    VERSION = 2,
+    OPEN = 3,
+    CLOSE = 4,
+    READ = 5,
+    WRITE = 6,
+    LSTAT = 7,
+    FSTAT = 8,
+    SETSTAT = 9,
+    FSETSTAT = 10,
+    OPENDIR = 11,
+    READDIR = 12,
+    REMOVE = 13,
+    MKDIR = 14,
+    RMDIR = 15,
+    REALPATH = 16,
+    STAT = 17,
+    RENAME = 18,
+    READLINK = 19,
+    SYMLINK = 20,
+    STATUS = 101,
+    HANDLE = 102,
+    DATA = 103,
+    NAME = 104,
+    ATTRS = 105,
+    EXTENDED = 200,
+    EXTENDED_REPLY = 201,
+};
+
+enum class Status: std::uint32_t {
+    OK = 0,
+    END_OF_FILE = 1,
+    NO_SUCH_FILE = 2,
+    PERMISSION_DENIED = 3,
+    FAILURE = 4,
+    BAD_MESSAGE = 5,
+    NO_CONNECTION = 6,
+    CONNECTION_LOST = 7,
+    OP_UNSUPPORTED = 8,
+};
+
+static constexpr std::uint32_t ATTR_SIZE = 0x00000001;
+static constexpr std::uint32_t ATTR_UIDGID = 0x00000002;
+static constexpr std::uint32_t ATTR_PERMISSIONS = 0x00000004;
+static constexpr std::uint32_t ATTR_ACMODTIME = 0x00000008;
+static constexpr std::uint32_t ATTR_EXTENDED = 0x80000000;
+
+/**
+ * @brief Attribute flags which make a Stat complete.
+ */
+static constexpr std::uint32_t ATTR_ALL = ATTR_SIZE | ATTR_UIDGID |
+        ATTR_PERMISSIONS | ATTR_ACMODTIME;
+
+static constexpr std::uint32_t OPEN_READ = 0x00000001;
+static constexpr std::uint32_t OPEN_WRITE = 0x00000002;
+static constexpr std::uint32_t OPEN_APPEND = 0x00000004;
+static constexpr std::uint32_t OPEN_CREAT = 0x00000008;
+static constexpr std::uint32_t OPEN_TRUNC = 0x00000010;
+static constexpr std::uint32_t OPEN_EXCL = 0x00000020;
+
+/**
+ * @brief Append the fields of a packet body to a buffer.
+ */
+class Encoder {
+public:
+    Encoder() = default;
+
+private:
+    std::string m_buf;
+
+public:
+    Encoder &u8(std::uint8_t value);
+    Encoder &u32(std::uint32_t value);
+    Encoder &u64(std::uint64_t value);
+    Encoder &string(std::string_view value);
+
+    /**
+     * @brief Append an attribute block with the fields selected by
+     * @a flags.
+     *
+     * Times are truncated to seconds; the protocol does not have more.
+     */
+    Encoder &attrs(const Stat &attr, std::uint32_t flags);
+
+    [[nodiscard]] inline const std::string &data() const {
+        return m_buf;
+    }
+
+    [[nodiscard]] inline std::string take() {
+        return std::move(m_buf);
+    }
+
+};
+
+/**
+ * @brief Read the fields of a packet body.
+ *
+ * All reads fail (return false) once the data is exhausted; the decoder
+ * does not own the data.
+ */
+class Decoder {
+public:
+    explicit Decoder(std::string_view data);
+
+private:
+    std::string_view m_data;
+
+public:
+    [[nodiscard]] bool u8(std::uint8_t &value);
+    [[nodiscard]] bool u32(std::uint32_t &value);
+    [[nodiscard]] bool u64(std::uint64_t &value);
+
+    /**
+     * @brief Read a string; the view points into the decoded data.
+     */
+    [[nodiscard]] bool string(std::string_view &value);
+
+    /**
+     * @brief Read an attribute block.
+     *
+     * Fields which are not present are zero; extended attributes are
+     * skipped. The ctime is set to the mtime, since the protocol does not
+     * have it.
+     *
+     * @param flags The flags of the block, i.e. the fields present.
+     */
+    [[nodiscard]] bool attrs(Stat &attr, std::uint32_t &flags);
+
+    [[nodiscard]] inline bool at_end() const {
+        return m_data.empty();
+    }
+
+};
+
+/**
+ * @brief Map an SFTP status code to an errno value.
+ *
+ * OK maps to zero. Connection errors map to ENOTCONN.
+ */
+[[nodiscard]] int status_to_errno(std::uint32_t status);
+
+/**
+ * @brief Map an errno value to the nearest SFTP status code.
+ */
+[[nodiscard]] Status errno_to_status(int err);
+
+/**
+ * @brief Map open(2) flags to SFTP open flags.
+ */
+[[nodiscard]] std::uint32_t open_flags(int accesstype);
+
+}
+
+#endif
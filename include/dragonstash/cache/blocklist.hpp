@@ -27,6 +27,7 @@ authors named in the AUTHORS file.
 
 #include <filesystem>
 #include <variant>
+#include <vector>
 
 #include "common.hpp"
 
@@ -68,14 +69,32 @@ public:
  * Blocklist layout:
  *
  * - Superblock (512 B):
+ *   - std::uint32_t magic
+ *   - std::uint8_t version
+ *   - std::uint8_t reserved[3]
  *   - std::uint64_t size
- *   - std::uint8_t reserved[512-sizeof(std::uint64_t)]
- * - Listblocks (512 B each):
- *   - Array of entries (16 B each)
+ *   - std::uint64_t entries
+ *   - std::uint64_t blocks_by_state[4]
+ *   - std::uint8_t tag[32]
+ *   - std::uint32_t block_size (zero in files which predate it: 4096)
+ *   - std::uint8_t reserved[512-92]
+ * - Pages (4096 B each):
+ *   - std::uint16_t count
+ *   - std::uint8_t reserved[14]
+ *   - Array of 255 entries (16 B each), the first `count` of which are used
  *     - std::uint64_t start
  *     - std::uint16_t count
- *     - std::uint16_t unused
+ *     - std::uint8_t state
+ *     - std::uint8_t unused
  *     - std::uint32_t unused
+ *
+ * Entries are sorted within a page and the ranges of the pages do not
+ * overlap, but the pages are not sorted within the file. Pages with a zero
+ * count are unused. The order of the pages is reconstructed when the file is
+ * opened.
+ *
+ * Version 0 files used a single sorted array of entries directly behind the
+ * superblock. They are converted when opened.
  */
 
 class Blocklist
@@ -89,13 +108,28 @@ public:
         WRITTEN = 3,
     };
 
+    /**
+     * @brief Opaque data stored alongside the blocks.
+     *
+     * The Blocklist does not interpret the tag; users can use it to record
+     * which version of the data the blocks describe.
+     */
+    using Tag = std::array<std::uint8_t, 32>;
+
+    /**
+     * @brief A contiguous range of blocks.
+     */
+    struct Range {
+        std::uint64_t start;
+        std::uint64_t count;
+    };
+
 private:
     static constexpr std::uint32_t magic = 0x4c427344;  /* b'DsBL' */
+    static constexpr std::uint8_t version_flat = 0;
+    static constexpr std::uint8_t version_paged = 1;
     static constexpr std::size_t internal_block_size = 512;
-    static constexpr std::size_t grow_size = 4096;
-    static constexpr std::size_t initial_block_count = grow_size / internal_block_size;
-    static_assert(grow_size % internal_block_size == 0);
-    static_assert(grow_size >= internal_block_size);
+    static constexpr std::size_t page_size = 4096;
 
     using entry_block_count_type = std::uint16_t;
 
@@ -107,7 +141,9 @@ private:
         std::uint64_t size;
         std::uint64_t entries;
         std::array<std::uint64_t, 4> blocks_by_state;
-        std::array<std::uint8_t, 512-56> reserved_fin;
+        std::array<std::uint8_t, 32> tag;
+        std::uint32_t block_size;
+        std::array<std::uint8_t, 512-92> reserved_fin;
     };
 
     static_assert(sizeof(Superblock) == internal_block_size);
@@ -134,85 +170,109 @@ private:
     static_assert(alignof(Entry) <= 16);
     static_assert(std::is_pod<Entry>::value);
 
-    struct File
-    {
-        using value_type = Entry;
-        using reference = Entry&;
-        using const_reference = const Entry&;
-        using iterator = Entry*;
-        using const_iterator = const Entry*;
-        using difference_type = std::iterator_traits<iterator>::difference_type;
-        using size_type = std::size_t;
-
-        Superblock superblock;
-        Entry entries[];
+    static constexpr std::size_t entries_per_page = page_size / sizeof(Entry) - 1;
 
-        [[nodiscard]] inline size_type size() const {
-            return superblock.entries;
-        }
+    struct Page
+    {
+        std::uint16_t count;
+        std::array<std::uint8_t, 14> reserved;
+        Entry entries[entries_per_page];
+    };
 
-        [[nodiscard]] inline iterator begin() {
-            return &entries[0];
-        }
+    static_assert(sizeof(Page) == page_size);
+    static_assert(std::is_pod<Page>::value);
 
-        [[nodiscard]] inline const_iterator cbegin() const {
-            return &entries[0];
-        }
+    struct File
+    {
+        Superblock superblock;
+        Page pages[];
+    };
 
-        [[nodiscard]] inline const_iterator begin() const {
-            return cbegin();
-        }
+    static_assert(sizeof(File) == sizeof(Superblock));
+    static_assert(alignof(File) <= 16);
+    static_assert(std::is_pod<File>::value);
 
-        [[nodiscard]] inline iterator end() {
-            return &entries[size()];
-        }
+    /**
+     * @brief Location of an entry.
+     *
+     * The page is an index into m_directory, not a page number in the file.
+     */
+    struct Position
+    {
+        std::size_t page;
+        std::size_t entry;
 
-        [[nodiscard]] inline const_iterator cend() const {
-            return &entries[size()];
+        inline bool operator==(const Position &other) const {
+            return page == other.page && entry == other.entry;
         }
 
-        [[nodiscard]] inline const_iterator end() const {
-            return cend();
+        inline bool operator!=(const Position &other) const {
+            return !(*this == other);
         }
     };
 
-    static_assert(sizeof(File) == sizeof(Superblock));
-    static_assert(alignof(File) <= 16);
-    static_assert(std::is_pod<File>::value);
-
 public:
     Blocklist() = delete;
     explicit Blocklist(FileHandle fd);
-    explicit Blocklist(const std::filesystem::path &path);
+    /**
+     * @param block_size Size of the blocks in bytes, recorded when the file
+     *   is created. Existing files keep their block size; see block_size().
+     */
+    explicit Blocklist(const std::filesystem::path &path,
+                       std::uint32_t block_size = CACHE_PAGE_SIZE);
     ~Blocklist();
 
 private:
     FileHandle m_fd;
+    std::uint32_t m_block_size;
     mutable File *m_mapping;
     mutable std::size_t m_mapped_size;
 
+    /**
+     * @brief Numbers of the used pages, in the order of their entries.
+     */
+    mutable std::vector<std::uint32_t> m_directory;
+
+    /**
+     * @brief Numbers of the unused pages; the lowest number is last.
+     */
+    mutable std::vector<std::uint32_t> m_free_pages;
+
     using SuperblockGuard = copyfree_wrap<Superblock>;
     static Superblock read_superblock(int fd);
 
 private:
-    static FileHandle open(const std::filesystem::path &path);
+    static FileHandle open(const std::filesystem::path &path,
+                           std::uint32_t block_size);
     void ensure_mapped() const;
     void ensure_unmapped() const;
 
     /**
-     * @brief Grow the mapping by grow_size bytes.
+     * @brief Rewrite a version 0 file in the paged layout.
+     */
+    void convert_flat(const Superblock &header);
+
+    /**
+     * @brief Rebuild m_directory and m_free_pages from the mapped file.
+     */
+    void load_directory() const;
+
+    /**
+     * @brief Grow the file by one page.
      *
-     * This invalidates all iterators, because there is no guarantee that the
-     * mapping will live at the same address at it was before.
+     * This leaves the file unmapped.
      */
     void grow();
 
     /**
-     * @brief Ensure that at least one more entry can be stored.
+     * @brief Return the number of an unused page, growing the file if
+     * necessary.
      *
-     * If necessary, this calls grow().
+     * This invalidates all references into the mapping.
      */
-    void require_space();
+    [[nodiscard]] std::uint32_t allocate_page();
+
+    [[nodiscard]] std::size_t npages() const;
 
     /**
      * @brief Return a handle to current Superblock data.
@@ -239,76 +299,66 @@ private:
         return SuperblockGuard(m_mapping->superblock);
     }
 
-    File::iterator delete_entry(File::iterator iter);
+    [[nodiscard]] inline Page &page_at(std::size_t index) const {
+        return m_mapping->pages[m_directory[index]];
+    }
+
+    [[nodiscard]] inline Entry &entry_at(const Position &pos) const {
+        return page_at(pos.page).entries[pos.entry];
+    }
+
+    [[nodiscard]] inline Position end_position() const {
+        return Position{m_directory.size(), 0};
+    }
+
+    void advance(Position &pos) const;
 
     /**
-     * Delete a range of entries.
-     *
-     * @param begin Iterator pointing at the first entry to delete.
-     * @param end Iterator pointing behind the last entry to delete.
+     * @brief Move to the previous entry.
      *
-     * @return Iterator pointing at the entry behind the last deleted one.
+     * @return false if there is no previous entry; @a pos is unchanged then.
      */
-    File::iterator delete_range(File::iterator begin, File::iterator end);
+    bool retreat(Position &pos) const;
 
     /**
-     * Try to merge an entry with the previous entry.
+     * Return the "closest" entry containing block.
+     *
+     * @param block The number of the block to search an entry for.
      *
-     * @param iter Iterator pointing at the entry to merge into the previous
-     *   one.
+     * If no entry exists, this function returns the first entry describing
+     * a block following the block pointed to by `block`.
      *
-     * If a merge is possible, returns an iterator to the merged entry.
-     * If a merge is not possible, returns the iterator unchanged.
+     * This is a binary search over the pages, followed by a binary search
+     * within the page.
      *
-     * @return Iterator pointing to the previous entry or the merged entry.
+     * @return Position of the entry.
      */
-    std::pair<bool, File::iterator> try_merge_with_previous(File::iterator iter);
+    [[nodiscard]] Position search_entry(std::uint64_t block) const;
 
     /**
-     * Insert an entry before another.
-     *
-     * @param dest The entry before which to insert.
-     * @param entry New entry to insert.
+     * Delete entries.
      *
-     * Invalidates all iterators.
-     *
-     * @return An iterator pointing at the newly inserted entry.
+     * Pages which become empty are released. The entries may span several
+     * pages. Invalidates all positions behind @a at.
      */
-    File::iterator insert_before(File::iterator dest, Entry &&entry);
+    void erase_entries(Position at, std::size_t n);
 
     /**
-     * Split an entry in two parts
-     *
-     * @param at Iterator pointing at the entry to split.
-     * @param split_point The (absolute) block number at which to split the
-     *   entry.
-     *
-     * Behaviour becomes undefined if !at->contains(split_point).
-     *
-     * This method invalidates all iterators.
+     * Insert entries before the entry at @a at.
      *
-     * @return Iterator pointing at the first of the two halves after splitting.
+     * If the page is full, it is split. Invalidates all positions and all
+     * references into the mapping.
      */
-    File::iterator split_entry(File::iterator at, std::uint64_t split_point);
+    void insert_entries(Position at, const Entry *entries, std::size_t n);
 
     /**
-     * Return the "closest" entry containing block.
-     *
-     * @param block The number of the block to search an entry for.
+     * Replace @a nremove entries starting at @a at with @a n new ones.
      *
-     * If no entry exists, this function returns the first entry describing
-     * a block following the block pointed to by `block`.
-     *
-     * @return Iterator pointing at the entry.
+     * Entries are overwritten in place as far as possible.
      */
-    File::iterator search_entry(std::uint64_t block);
-    File::const_iterator search_entry(std::uint64_t block) const;
+    void replace_entries(Position at, std::size_t nremove,
+                         const Entry *entries, std::size_t n);
 
-    File::difference_type escape_iterator(File::iterator iter) const;
-
-    std::pair<File::iterator, File::iterator> find_overlapping_entries(
-            std::uint64_t start,
-            entry_block_count_type count);
     void mark_internal(std::uint64_t start,
                        entry_block_count_type count,
                        State state);
@@ -329,6 +379,44 @@ public:
               std::uint64_t count,
               State state);
 
+    /**
+     * @brief Change the state of the blocks in a range which are in a given
+     * state.
+     *
+     * @param start First block to consider.
+     * @param count Number of blocks to consider.
+     * @param from Only blocks in this state are changed. ABSENT selects the
+     *   blocks which are not present.
+     * @param to The new state of the selected blocks.
+     *
+     * Blocks in other states are left alone.
+     */
+    void transition(std::uint64_t start,
+                    std::uint64_t count,
+                    State from,
+                    State to);
+
+    /**
+     * @brief Return the ranges of blocks in a given state.
+     *
+     * @param start First block to consider.
+     * @param count Number of blocks to consider.
+     * @param state State to look for; ABSENT returns the gaps.
+     *
+     * The returned ranges are clipped to the considered range, sorted and
+     * maximal.
+     */
+    [[nodiscard]] std::vector<Range> ranges(std::uint64_t start,
+                                            std::uint64_t count,
+                                            State state) const;
+
+    /**
+     * @brief Count the blocks in a given state within a range.
+     */
+    [[nodiscard]] std::uint64_t count(std::uint64_t start,
+                                      std::uint64_t count,
+                                      State state) const;
+
     /**
      * @brief Query the state of a single block.
      *
@@ -378,6 +466,13 @@ public:
      */
     [[nodiscard]] std::uint64_t capacity() const;
 
+    /**
+     * @brief Return the size of a block in bytes.
+     */
+    [[nodiscard]] inline std::uint32_t block_size() const {
+        return m_block_size;
+    }
+
     /**
      * @brief Truncate an attempted access to the largest safe range.
      *
@@ -395,6 +490,25 @@ public:
      */
     [[nodiscard]] std::size_t truncate_access(off_t start, std::size_t size) const;
 
+    /**
+     * @brief Mark all blocks as ABSENT.
+     *
+     * This does not shrink the file; call shrink() for that.
+     */
+    void clear();
+
+    /**
+     * @brief Return the tag stored in the superblock.
+     *
+     * A freshly created Blocklist has an all-zero tag.
+     */
+    [[nodiscard]] Tag tag() const;
+
+    /**
+     * @brief Replace the tag stored in the superblock.
+     */
+    void set_tag(const Tag &tag);
+
     /**
      * @brief Check internal consistency and throw exceptions.
      *
@@ -420,13 +534,13 @@ public:
      * it has grown in the past.
      *
      * Note that this will, in the general case, not reduce capacity() to
-     * nentries(), since for efficiency reasons, the list operates on internal
-     * blocks of entries. This means that capacity for entries is added/removed
+     * nentries(), since for efficiency reasons, the list operates on pages
+     * of entries. This means that capacity for entries is added/removed
      * approximately in steps of 256.
      *
-     * Note that shrinking may unmap the file (without remapping it), so it
-     * is an expensive-ish operation and implies a sync(), so it is not
-     * performed automatically.
+     * Shrinking packs all entries into as few pages as possible and remaps
+     * the file, so it is an expensive-ish operation (linear in the number of
+     * entries) and implies a sync(); it is not performed automatically.
      */
     void shrink() const;
 
@@ -26,150 +26,96 @@ authors named in the AUTHORS file.
 #define DRAGONSTASH_CACHE_CACHE_H
 
 #include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <exception>
 #include <filesystem>
+#include <functional>
 #include <mutex>
+#include <optional>
 #include <list>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "dragonstash/error.hpp"
+#include "dragonstash/metrics.hpp"
+#include "dragonstash/pin_policy.hpp"
+#include "dragonstash/trace.hpp"
 
 #include "lmdb-safe.hh"
 #include "dragonstash/backend/base.hpp"
-#include "dragonstash/debug_mutex.hpp"
 
 #include "dragonstash/cache/inode.hpp"
 #include "dragonstash/cache/common.hpp"
+#include "dragonstash/cache/inode_references.hpp"
+#include "dragonstash/cache/path_cache.hpp"
+#include "dragonstash/cache/regular_file.hpp"
+#include "dragonstash/cache/transaction_log.hpp"
 
 namespace Dragonstash {
 
-class CachedDir {
-public:
-    explicit CachedDir(MDBROTransaction &&transaction,
-                       MDBROCursor &&cursor,
-                       ino_t ino);
-    CachedDir(const CachedDir &src) = delete;
-    CachedDir(CachedDir &&src) noexcept;
-    CachedDir &operator=(const CachedDir &src) = delete;
-    CachedDir &operator=(CachedDir &&src) noexcept;
-    ~CachedDir() = default;
-
-private:
-    MDBROTransaction m_transaction;
-    MDBROCursor m_cursor;
-    ino_t m_ino;
-    bool m_eof;
-    off_t m_size;
-    off_t m_curr_off;
-
-    void mark_eof();
+class CacheTransactionRO;
+class CacheTransactionRW;
+class CachedDir;
+struct JournalHeader;
 
-    Result<DirectoryEntry> parse_entry(const char *buf, size_t sz);
-    Result<DirectoryEntry> parse_entry_v1(const char *buf, size_t sz);
+/**
+ * @brief Changes to a regular file which have not been written back to the
+ * backend yet.
+ *
+ * The data of the extents is held in the cached contents of the file, in
+ * WRITTEN blocks.
+ */
+struct JournalEntry {
+    struct Extent {
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
 
-public:
     /**
-     * @brief Read a single directory entry from the current offset.
-     *
-     * @return The directory entry and its offset.
+     * @brief Counter which changes with every change recorded for the
+     * inode.
      */
-    Result<std::tuple<DirectoryEntry, off_t>> ReadDir();
+    std::uint64_t generation;
 
     /**
-     * @brief Set the cursor position to a specific offset.
-     * @param offset The offset position.
-     *
-     * @return Error code if offset is out of bounds.
+     * @brief Size of the file after the changes.
      */
-    Result<void> Seek(off_t offset);
-
-};
-
-
-class CacheTransactionRO;
-class CacheTransactionRW;
-
-
-class InodeReferences {
-public:
-    struct Record {
-        std::uint64_t nrefs;
-        bool doomed;
-    };
-
-public:
-    InodeReferences() = default;
-    InodeReferences(const InodeReferences &src) = delete;
-    InodeReferences(InodeReferences &&src) = delete;
-    InodeReferences &operator=(const InodeReferences &src) = delete;
-    InodeReferences &operator=(InodeReferences &&src) = delete;
-    ~InodeReferences() = default;
+    std::uint64_t size;
 
-private:
-    std::unordered_map<ino_t, Record> m_refs;
+    /**
+     * @brief The file does not exist on the backend yet.
+     */
+    bool created;
 
-public:
-    [[nodiscard]] inline Result<std::uint64_t> incref(ino_t ino, std::uint64_t by) {
-        auto iter = m_refs.find(ino);
-        if (iter == m_refs.end()) {
-            m_refs.emplace(ino, Record{by, false});
-            return make_result(by);
-        }
-        if (iter->second.doomed) {
-            return make_result(FAILED, ESTALE);
-        }
-        iter->second.nrefs += by;
-        return make_result(iter->second.nrefs);
-    }
-
-    [[nodiscard]] inline Result<std::uint64_t> decref(ino_t ino, std::uint64_t by) {
-        if (by == 0) {
-            return make_result(FAILED, EINVAL);
-        }
-
-        auto iter = m_refs.find(ino);
-        if (iter == m_refs.end() || iter->second.nrefs < by) {
-            throw std::runtime_error("attempt to decrease counter below zero");
-        }
-        iter->second.nrefs -= by;
-        return make_result(iter->second.nrefs);
-    }
-
-    [[nodiscard]] inline Result<void> doom(ino_t ino) {
-        auto iter = m_refs.find(ino);
-        if (iter == m_refs.end()) {
-            m_refs.emplace(ino, Record{0, true});
-            return make_result();
-        }
-        if (iter->second.nrefs > 0) {
-            return make_result(FAILED, EBUSY);
-        }
-        iter->second.doomed = true;
-        return make_result();
-    }
-
-    [[nodiscard]] inline bool doomed(ino_t ino) const {
-        auto iter = m_refs.find(ino);
-        if (iter == m_refs.end()) {
-            return false;
-        }
-        return iter->second.doomed;
-    }
-
-    [[nodiscard]] inline std::uint64_t refcount(ino_t ino) const {
-        auto iter = m_refs.find(ino);
-        if (iter == m_refs.end()) {
-            return 0;
-        }
-        return iter->second.nrefs;
-    }
+    /**
+     * @brief The size of the file has to be set on the backend before the
+     * extents are written.
+     */
+    bool resized;
 
+    /**
+     * @brief Byte ranges to write, ascending and disjoint.
+     */
+    std::vector<Extent> extents;
 };
 
 
 class CacheDatabase {
 public:
     CacheDatabase() = delete;
-    explicit CacheDatabase(std::shared_ptr<MDBEnv> env);
+    /**
+     * @param block_size Block size for cached contents to use if the cache
+     *   is new. Zero selects the recorded block size or, for new caches,
+     *   CACHE_PAGE_SIZE. A block size which differs from the recorded one is
+     *   an error.
+     */
+    CacheDatabase(std::shared_ptr<MDBEnv> env,
+                  const std::filesystem::path &content_root,
+                  std::uint32_t block_size = 0);
 
 private:
     std::shared_ptr<MDBEnv> m_env;
@@ -179,11 +125,30 @@ private:
     MDBDbi m_tree_name_key_db;
     MDBDbi m_orphan_db;
     MDBDbi m_links_db;
+    MDBDbi m_negative_db;
+    MDBDbi m_pins_db;
+    MDBDbi m_journal_db;
+    MDBDbi m_dir_sync_db;
 
     size_t m_max_name_length;
+    const std::uint32_t m_block_size;
 
-    debug_mutex m_in_memory_lock_mutex;
     InodeReferences m_in_memory_locks;
+    TransactionLogPool m_transaction_logs;
+
+    PathCache m_path_cache;
+    ContentStore m_content_store;
+
+    /**
+     * @brief Orphan key at which CacheTransactionRW::reap_orphans() resumes.
+     *
+     * Only accessed from write transactions, i.e. under the LMDB writer lock.
+     */
+    ino_t m_orphan_cursor;
+
+    Metrics::Histogram m_ro_duration;
+    Metrics::Histogram m_rw_duration;
+    Metrics::Counter m_commits;
 
     void validate_max_key_size();
 
@@ -223,77 +188,359 @@ public:
         return m_links_db;
     }
 
+    [[nodiscard]] inline MDBDbi &negative_db()
+    {
+        return m_negative_db;
+    }
+
+    [[nodiscard]] inline MDBDbi &pins_db()
+    {
+        return m_pins_db;
+    }
+
+    [[nodiscard]] inline MDBDbi &journal_db()
+    {
+        return m_journal_db;
+    }
+
+    [[nodiscard]] inline MDBDbi &dir_sync_db()
+    {
+        return m_dir_sync_db;
+    }
+
     [[nodiscard]] inline size_t max_name_length() const
     {
         return m_max_name_length;
     }
 
-    [[nodiscard]] Result<void> check_name(std::string_view name, bool for_writing);
-
-    [[nodiscard]] inline auto in_memory_lock_guard() {
-        return std::unique_lock<debug_mutex>(m_in_memory_lock_mutex);
+    /**
+     * @brief Block size of the cached file contents in bytes.
+     */
+    [[nodiscard]] inline std::uint32_t block_size() const
+    {
+        return m_block_size;
     }
 
+    [[nodiscard]] Result<void> check_name(std::string_view name, bool for_writing);
+
     [[nodiscard]] inline InodeReferences &in_memory_locks() {
         return m_in_memory_locks;
     }
 
+    [[nodiscard]] inline TransactionLogPool &transaction_logs() {
+        return m_transaction_logs;
+    }
+
+    [[nodiscard]] inline PathCache &path_cache() {
+        return m_path_cache;
+    }
+
+    [[nodiscard]] inline ContentStore &content_store() {
+        return m_content_store;
+    }
+
+    [[nodiscard]] inline ino_t orphan_cursor() const {
+        return m_orphan_cursor;
+    }
+
+    inline void set_orphan_cursor(ino_t ino) {
+        m_orphan_cursor = ino;
+    }
+
+    /**
+     * @brief Time from the start of top-level transactions to their commit
+     * or abort.
+     */
+    [[nodiscard]] inline Metrics::Histogram &transaction_duration(bool read_write) {
+        return read_write ? m_rw_duration : m_ro_duration;
+    }
+
+    /**
+     * @brief Top-level write transactions which have been committed.
+     */
+    [[nodiscard]] inline Metrics::Counter &commits() {
+        return m_commits;
+    }
+
+};
+
+
+class Cache;
+
+/**
+ * @brief A single logical write operation against the cache.
+ *
+ * @see GroupCommit
+ */
+/**
+ * @brief Entry of a backend listing for CacheTransactionRW::rewrite_dir().
+ */
+struct DirRewriteEntry {
+    std::string name;
+    InodeAttributes attr;
+};
+
+/**
+ * @brief Change which CacheTransactionRW::rewrite_dir() makes to an entry.
+ */
+enum class DirRewriteChange {
+    /**
+     * @brief The name is new in the directory.
+     */
+    ADDED,
+
+    /**
+     * @brief The attributes changed; the inode is kept.
+     */
+    CHANGED,
+
+    /**
+     * @brief The format changed, so the entry gets a new inode.
+     */
+    REPLACED,
+
+    /**
+     * @brief The name is gone from the directory.
+     */
+    REMOVED,
+};
+
+/**
+ * @brief Called by CacheTransactionRW::rewrite_dir() before each change.
+ *
+ * @param ino Inode of the cached entry, or INVALID_INO for added entries.
+ * @param attr New attributes, or nullptr for removed entries.
+ */
+using DirRewriteObserver = std::function<void(DirRewriteChange change,
+                                              std::string_view name,
+                                              ino_t ino,
+                                              const InodeAttributes *attr)>;
+
+/**
+ * @brief Number of entries changed by CacheTransactionRW::rewrite_dir().
+ */
+struct DirRewriteStats {
+    std::size_t added;
+    std::size_t changed;
+    std::size_t replaced;
+    std::size_t removed;
+};
+
+using WriteOperation = std::function<Result<void>(CacheTransactionRW &txn)>;
+
+/**
+ * @brief Coalesce write operations of concurrent requests into shared LMDB
+ * commits.
+ *
+ * Each submitted operation runs in its own nested transaction of a shared
+ * write transaction. If an operation fails, only its nested transaction is
+ * aborted; the other operations of the group are unaffected. Once all
+ * operations of the group have run, the shared transaction is committed and
+ * all submitters are woken up.
+ *
+ * The first thread to submit while no group is being committed becomes the
+ * leader: it waits for up to the configured delay (or until the configured
+ * number of operations is queued), runs the group and commits it. Operations
+ * submitted while a group is being committed are collected into the next
+ * group, so that even with zero delay, concurrent writers share commits.
+ *
+ * Transaction hooks of an operation are moved to the shared transaction when
+ * its nested transaction commits. Thus, hooks fire in order for each logical
+ * operation and operations fire in the order in which they were run. If any
+ * stage 1 hook fails or the commit fails, the whole group is rolled back and
+ * all operations of the group report the error.
+ *
+ * @note Operations must not submit further operations; the submitting thread
+ * may be the leader and would deadlock.
+ */
+class GroupCommit {
+public:
+    GroupCommit() = delete;
+    explicit GroupCommit(Cache &cache);
+    GroupCommit(const GroupCommit &src) = delete;
+    GroupCommit(GroupCommit &&src) = delete;
+    GroupCommit &operator=(const GroupCommit &src) = delete;
+    GroupCommit &operator=(GroupCommit &&src) = delete;
+    ~GroupCommit() = default;
+
+private:
+    struct Pending {
+        WriteOperation op;
+        Result<void> result;
+        std::exception_ptr exception;
+        bool done;
+        /** Trace of the submitter, continued by the leader */
+        Trace::Handle trace;
+    };
+
+    Cache &m_cache;
+
+    std::mutex m_queue_mutex;
+    std::condition_variable m_queue_cv;
+    std::vector<Pending*> m_queue;
+    bool m_leader_active;
+
+    std::chrono::microseconds m_max_delay;
+    std::size_t m_max_operations;
+
+    std::atomic<std::uint64_t> m_commits;
+    std::atomic<std::uint64_t> m_operations;
+
+    void run_group(const std::vector<Pending*> &group);
+
+public:
+    /**
+     * @brief Configure the window in which operations are coalesced.
+     *
+     * @param max_delay Time the leader waits for further operations before
+     *   committing. Zero only coalesces operations which are submitted while
+     *   a previous group is being committed.
+     * @param max_operations Maximum number of operations in a single group.
+     */
+    void set_window(std::chrono::microseconds max_delay,
+                    std::size_t max_operations);
+
+    /**
+     * @brief Run an operation as part of a group commit.
+     *
+     * Blocks until the group containing the operation has been committed or
+     * rolled back.
+     *
+     * @return The result of the operation or the error of the group commit.
+     */
+    [[nodiscard]] Result<void> submit(WriteOperation &&op);
+
+    /**
+     * @brief Number of LMDB commits issued so far.
+     */
+    [[nodiscard]] inline std::uint64_t commits() const {
+        return m_commits.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Number of operations which have been run so far.
+     */
+    [[nodiscard]] inline std::uint64_t operations() const {
+        return m_operations.load(std::memory_order_relaxed);
+    }
+
 };
 
 
 /**
- * @brief Handle to a regular, cached file.
- * 
- * This handle arbitrates access to the cached file. The file can be manipulated
- * concurrently. The effects of that are similar to the effects of concurrently
- * manipulating a file on disk.
- * 
- * Most operations will generally not need a valid write transaction, however,
- * in some cases, (write) access to the LMDB data is required (for example, 
- * when resizing a file due to a write beyond the current last block).  In such
- * cases, if not passed a valid write transaction, the methods will start a 
- * transaction on their own.
- * 
- * Note that there is still no synchronisation between the LMDB-backed metadata
- * and the data inside the cache; in case of a crash, it is possible that 
- * data is missing from the cache for which LMDB already has metadata.
+ * @brief Number of orphans visited, plus children of orphaned directories
+ * orphaned, per incremental reaping step.
  *
- * Random notes:
+ * @see CacheTransactionRW::reap_orphans
+ */
+static constexpr std::size_t CACHE_ORPHAN_REAP_BUDGET = 256;
+
+/**
+ * @brief Remove orphaned inodes from the cache in the background.
  *
- * - Three backing files: page list (vector of startpage+size tuples), blockmap
- *   (two bytes / page with access counter and state), actual data
- * - Idea: use mmaped file with vector directly. however, that will not work
- *   because C++ allocators require zero-initialised memory from allocate() and
- *   do not support reallocate (which would be required to resize the mapping as
- *   needed).
- *   -> we need a custom vector-like implementation
+ * Each commit reaps at most CACHE_ORPHAN_REAP_BUDGET worth of orphans. If
+ * orphans are left over, e.g. after a large directory subtree has been
+ * dropped, the commit wakes the reaper. The reaper then works through the
+ * backlog in operations of the same size, submitted to the group commit, so
+ * that foreground writers never wait for more than one step.
  */
-class RegularFileHandle {
+class OrphanReaper {
+public:
+    OrphanReaper() = delete;
+    explicit OrphanReaper(Cache &cache,
+                          std::size_t budget = CACHE_ORPHAN_REAP_BUDGET);
+    OrphanReaper(const OrphanReaper &src) = delete;
+    OrphanReaper(OrphanReaper &&src) = delete;
+    OrphanReaper &operator=(const OrphanReaper &src) = delete;
+    OrphanReaper &operator=(OrphanReaper &&src) = delete;
+    ~OrphanReaper();
+
 private:
-    ino_t m_ino;
-    int m_blockmap_fd;
-    int m_blocks_fd;
-    void *m_blockmap_mmap;
+    Cache &m_cache;
+    const std::size_t m_budget;
+    std::mutex m_mutex;
+    std::condition_variable m_wake_cv;
+    std::condition_variable m_idle_cv;
+    bool m_pending;
+    bool m_busy;
+    bool m_stopping;
+    std::atomic<std::uint64_t> m_steps;
+    std::atomic<std::uint64_t> m_failures;
+    std::thread m_thread;
+
+    void run();
 
 public:
-    [[nodiscard]] ino_t inode() const;
+    [[nodiscard]] inline std::size_t budget() const {
+        return m_budget;
+    }
 
-    [[nodiscard]] Result<std::size_t> pread(off_t off, void *buf, std::size_t n);
-    [[nodiscard]] Result<std::size_t> pwrite(off_t off, const void *buf, std::size_t n);
-    [[nodiscard]] Result<void> truncate(std::size_t size);
-    [[nodiscard]] Result<void> allocate(int mode, off_t offset, off_t len);
-    [[nodiscard]] Result<void> fsync();
+    /**
+     * @brief Ask the reaper to run until no reapable orphans are left.
+     */
+    void wake();
+
+    /**
+     * @brief Block until the reaper has run out of work.
+     */
+    void wait_idle();
+
+    /**
+     * @brief Number of reaping steps run in the background so far.
+     */
+    [[nodiscard]] inline std::uint64_t steps() const {
+        return m_steps.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Number of background reaping steps which failed.
+     */
+    [[nodiscard]] inline std::uint64_t failures() const {
+        return m_failures.load(std::memory_order_relaxed);
+    }
 
 };
 
 
-class Cache {
+/**
+ * @brief Exclusive lock on a cache directory.
+ *
+ * A Cache reaps orphans which it does not reference and keeps in-memory
+ * state about the inodes and contents, both of which are only valid while
+ * no other process changes the cache. The lock is a flock(2) on the `lock`
+ * file in the directory and is dropped when the process exits.
+ *
+ * Throws std::runtime_error if the directory is locked already, including
+ * by another Cache in the same process.
+ */
+class CacheDirectoryLock {
 public:
-    static const bool deadlock_detection;
+    CacheDirectoryLock() = delete;
+    explicit CacheDirectoryLock(const std::filesystem::path &db_path);
+    CacheDirectoryLock(const CacheDirectoryLock &src) = delete;
+    CacheDirectoryLock(CacheDirectoryLock &&src) = delete;
+    CacheDirectoryLock &operator=(const CacheDirectoryLock &src) = delete;
+    CacheDirectoryLock &operator=(CacheDirectoryLock &&src) = delete;
+    ~CacheDirectoryLock();
+
+private:
+    int m_fd;
+
+};
+
 
+class Cache {
 public:
     Cache() = delete;
-    explicit Cache(const std::filesystem::path &db_path);
+    /**
+     * @param block_size Block size for cached file contents; only used when
+     *   the cache is created. See CacheDatabase.
+     *
+     * The cache directory is locked for the lifetime of the cache; see
+     * CacheDirectoryLock.
+     */
+    explicit Cache(const std::filesystem::path &db_path,
+                   std::uint32_t block_size = 0);
     Cache(const Cache &src) = delete;
     Cache(Cache &&src) = delete;
     Cache &operator=(const Cache &src) = delete;
@@ -301,7 +548,10 @@ public:
     ~Cache() = default;
 
 private:
+    CacheDirectoryLock m_dir_lock;
     CacheDatabase m_db;
+    GroupCommit m_group_commit;
+    OrphanReaper m_orphan_reaper;
 
 public:
     /**
@@ -312,9 +562,46 @@ public:
         return m_db.max_name_length();
     }
 
+    /**
+     * @brief Block size of the cached file contents in bytes.
+     */
+    [[nodiscard]] inline std::uint32_t block_size() const
+    {
+        return m_db.block_size();
+    }
+
     [[nodiscard]] CacheTransactionRO begin_ro();
     [[nodiscard]] CacheTransactionRW begin_rw();
 
+    [[nodiscard]] inline GroupCommit &group_commit()
+    {
+        return m_group_commit;
+    }
+
+    [[nodiscard]] inline OrphanReaper &orphan_reaper()
+    {
+        return m_orphan_reaper;
+    }
+
+    /**
+     * @brief In-memory directory entry cache used for path reconstruction.
+     */
+    [[nodiscard]] inline PathCache &path_cache()
+    {
+        return m_db.path_cache();
+    }
+
+    /**
+     * @brief Run a write operation, sharing the commit with concurrent
+     * writers.
+     *
+     * @see GroupCommit::submit
+     */
+    [[nodiscard]] inline Result<void> write(WriteOperation &&op)
+    {
+        return m_group_commit.submit(std::move(op));
+    }
+
     /**
      * @brief Look up the name of an inode
      * @param ino Number of the inode
@@ -379,97 +666,94 @@ public:
     [[nodiscard]] Result<void> writelink(ino_t ino, std::string_view dest);
 
     [[nodiscard]] Result<std::string> path(ino_t ino);
-};
-
-
-/**
- * @brief A group of functions which may be executed when the transaction
- * commits or aborts.
- *
- * @see CacheTransactionRO::add_transaction_hook for semantics.
- */
-class TransactionHook
-{
-public:
-    TransactionHook() = default;
-    template <typename T1, typename T2, typename T3, typename T4>
-    TransactionHook(T1 &&stage_1_commit,
-                    T2 &&stage_1_rollback,
-                    T3 &&stage_2_commit,
-                    T4 &&rollback):
-        m_stage_1_commit(std::forward<T1>(stage_1_commit)),
-        m_stage_1_rollback(std::forward<T2>(stage_1_rollback)),
-        m_stage_2_commit(std::forward<T3>(stage_2_commit)),
-        m_rollback(std::forward<T4>(rollback))
-    {
 
-    }
-    TransactionHook(const TransactionHook &src) = delete;
-    TransactionHook(TransactionHook &&src) = default;
-    TransactionHook &operator=(const TransactionHook &src) = delete;
-    TransactionHook &operator=(TransactionHook &&src) = default;
-    ~TransactionHook() = default;
-
-private:
     /**
-     * @brief Executed on commit
+     * @brief Open a stream over the entries of a directory.
+     *
+     * The stream reads from a snapshot of the cache taken when this is
+     * called.
      *
-     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     * Error codes:
+     *
+     * - ENOENT: @a dir does not exist.
      */
-    std::function<Result<void>()> m_stage_1_commit;
+    [[nodiscard]] Result<std::unique_ptr<CachedDir>> opendir(ino_t dir);
 
     /**
-     * @brief Executed when a later commit hook failed
+     * @brief Open the cached contents of a regular file.
      *
-     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     * The handle is shared with all other users of the inode. The cached data
+     * is not validated against the inode attributes;
+     * see RegularFileHandle::validate.
      */
-    std::function<void()> m_stage_1_rollback;
+    [[nodiscard]] Result<std::shared_ptr<RegularFileHandle>> open_file(ino_t ino);
 
     /**
-     * @brief Executed when all pre commit hooks have passed.
+     * @brief Limit the size of the cached file contents.
      *
-     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     * @param bytes Budget in bytes; zero means no limit. Contents which
+     *   exceed the budget are evicted immediately.
+     *
+     * @see ContentStore
      */
-    std::function<void()> m_stage_2_commit;
+    void set_content_budget(std::uint64_t bytes);
 
     /**
-     * @brief Executed when the transaction is rolled back.
+     * @brief Make contents which were pinned by some rules evictable again.
+     *
+     * Pinned regular files which match @a released, but not @a kept, are
+     * unpinned. Contents pinned by other means, e.g. by a prefetch, are
+     * left alone.
      *
-     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     * @return The number of files which have been unpinned.
      */
-    std::function<void()> m_rollback;
+    std::size_t unpin(const PinPolicy &released, const PinPolicy &kept);
+
+    /**
+     * @brief Write the transaction, commit, lock and content usage metrics.
+     */
+    void collect_metrics(Metrics::TextWriter &out);
+};
 
-    bool m_stage_1_ran{false};
 
+/**
+ * @brief Pin rules of a cache which may be in use by a mount.
+ *
+ * Only the pin rules and their metadata are opened. Unlike Cache, this does
+ * not lock the cache directory and never touches inodes or contents, so it
+ * is safe to use while the cache is mounted; the mount picks up the changes
+ * on its next lookup.
+ */
+class PinRuleStore {
 public:
-    [[nodiscard]] inline Result<void> stage_1_commit() {
-        if (m_stage_1_commit) {
-            auto result = m_stage_1_commit();
-            if (result) {
-                m_stage_1_ran = true;
-            }
-            return result;
-        }
-        return make_result();
-    }
+    PinRuleStore() = delete;
+    explicit PinRuleStore(const std::filesystem::path &db_path);
+    PinRuleStore(const PinRuleStore &src) = delete;
+    PinRuleStore(PinRuleStore &&src) = delete;
+    PinRuleStore &operator=(const PinRuleStore &src) = delete;
+    PinRuleStore &operator=(PinRuleStore &&src) = delete;
+    ~PinRuleStore() = default;
 
-    inline void stage_1_rollback() {
-        if (m_stage_1_ran && m_stage_1_rollback) {
-            m_stage_1_rollback();
-        }
-    }
+private:
+    std::shared_ptr<MDBEnv> m_env;
+    MDBDbi m_meta_db;
+    MDBDbi m_pins_db;
 
-    inline void stage_2_commit() {
-        if (m_stage_2_commit) {
-            m_stage_2_commit();
-        }
-    }
+public:
+    /**
+     * @see CacheTransactionRO::pin_rules()
+     */
+    [[nodiscard]] std::vector<PinRule> rules();
 
-    inline void rollback() {
-        if (m_rollback) {
-            m_rollback();
-        }
-    }
+    /**
+     * @see CacheTransactionRW::add_pin_rule()
+     */
+    [[nodiscard]] std::uint64_t add(const PinRule &rule);
+
+    /**
+     * @see CacheTransactionRW::remove_pin_rule()
+     */
+    [[nodiscard]] Result<void> remove(std::uint64_t id);
 
 };
 
@@ -484,28 +768,59 @@ public:
     CacheTransactionRO(CacheTransactionRO &&src) noexcept = default;
     CacheTransactionRO &operator=(const CacheTransactionRO &src) = delete;
     CacheTransactionRO &operator=(CacheTransactionRO &&src) noexcept = default;
-    ~CacheTransactionRO() = default;
+    ~CacheTransactionRO();
 
 private:
     CacheDatabase *m_db;
     MDBROTransaction m_txn;
     CacheTransactionRW *m_parent;
-    std::vector<TransactionHook> m_transaction_hooks;
-    std::unique_lock<debug_mutex> m_inode_counter_lock;
+
+    /**
+     * @brief Lock changes and hooks to apply on commit or abort.
+     *
+     * Taken from and returned to CacheDatabase::transaction_logs().
+     */
+    TransactionLog m_log;
+
+    /**
+     * @brief PathCache epoch sampled before the snapshot was obtained.
+     *
+     * Only set for top-level read-only transactions; those are the only ones
+     * which use the path cache.
+     */
+    std::optional<std::uint64_t> m_path_cache_epoch;
+
+    Metrics::Clock::time_point m_started;
+
+    /**
+     * @brief Record the duration of a top-level transaction which ends.
+     */
+    void finish();
 
 protected:
+    bool m_read_write;
+
     [[nodiscard]] inline CacheDatabase &db() {
         return *m_db;
     }
 
-    [[nodiscard]] inline InodeReferences &inode_in_memory_locks();
+    [[nodiscard]] inline InodeReferences &inode_in_memory_locks() {
+        return db().in_memory_locks();
+    }
 
     [[nodiscard]] inline MDBROTransactionImpl *ro_transaction() {
         return m_txn.get();
     }
 
 protected:
-    std::unique_ptr<std::set<ino_t>> m_rewrite_inode_set;
+    /**
+     * @brief Inodes orphaned in this transaction.
+     *
+     * They are evicted from the path cache when they are orphaned and once
+     * more after the commit, to drop any stale records which readers with an
+     * older snapshot inserted in between.
+     */
+    std::vector<ino_t> m_orphaned_inodes;
 
 public:
     /**
@@ -517,7 +832,7 @@ public:
     template <typename T>
     inline void add_transaction_hook(T &&src)
     {
-        m_transaction_hooks.emplace_back(std::forward<T>(src));
+        m_log.add_hook(std::forward<T>(src));
     }
 
     /**
@@ -532,6 +847,8 @@ public:
      *   transaction has failed its stage 1 check.
      *
      * Any callback can be nullptr, in which case it is assumed that it succeds.
+     * Callbacks are stored without allocation and may capture at most
+     * TRANSACTION_HOOK_CAPACITY bytes.
      *
      * For a single TransactionHook, the commit flow is the following:
      *
@@ -568,10 +885,10 @@ public:
                                      T3 &&stage_2_commit,
                                      T4 &&rollback)
     {
-        m_transaction_hooks.emplace_back(std::forward<T1>(stage_1_commit),
-                                         std::forward<T2>(stage_1_rollback),
-                                         std::forward<T3>(stage_2_commit),
-                                         std::forward<T4>(rollback));
+        m_log.add_hook(std::forward<T1>(stage_1_commit),
+                       std::forward<T2>(stage_1_rollback),
+                       std::forward<T3>(stage_2_commit),
+                       std::forward<T4>(rollback));
     }
 
     /**
@@ -634,6 +951,17 @@ public:
      */
     [[nodiscard]] Result<ino_t> lookup(ino_t parent, std::string_view name);
 
+    /**
+     * @brief Look up a negative entry recorded with put_negative().
+     *
+     * Expired entries are returned as well; it is up to the caller to
+     * compare the expiry time with the current time.
+     *
+     * @return The time at which the entry expires; ENOENT if there is none.
+     */
+    [[nodiscard]] Result<std::chrono::system_clock::time_point> lookup_negative(
+            ino_t parent, std::string_view name);
+
     [[nodiscard]] Result<Stat> getattr(ino_t ino);
 
     [[nodiscard]] Result<std::string> readlink(ino_t ino);
@@ -679,8 +1007,67 @@ public:
      */
     [[nodiscard]] Result<void> release(ino_t ino, uint64_t nlocks = 1);
 
+    /**
+     * @brief Decrease the reference counters of many inodes at once.
+     *
+     * This has the same semantics as calling release() for each element, but
+     * registers a single rollback hook and updates the counters in one pass.
+     *
+     * @param releases The releases to apply; reordered in place.
+     * @param reapable If not null, receives the orphans which were skipped
+     *   by the reaper because of references and have no references anymore.
+     *   Pass them to CacheTransactionRW::reap_released() to remove them.
+     */
+    [[nodiscard]] Result<void> release_many(std::vector<InodeReferences::Release> &releases,
+                                            std::vector<ino_t> *reapable = nullptr);
+
     [[nodiscard]] Result<bool> test_flag(ino_t ino, InodeFlag flag);
 
+    /**
+     * @brief Backend metadata recorded when the directory was last synced.
+     *
+     * Error codes:
+     *
+     * - ENOENT: The inode does not exist.
+     * - ENODATA: No stamp was recorded, or the directory is not synced.
+     */
+    [[nodiscard]] Result<DirSyncStamp> dir_sync_stamp(ino_t ino);
+
+    /**
+     * @brief Read the pin rules, ordered by id.
+     *
+     * Retired rules are included. Records which cannot be parsed are
+     * skipped.
+     */
+    [[nodiscard]] std::vector<PinRule> pin_rules();
+
+    /**
+     * @brief Counter which changes whenever the pin rules change.
+     */
+    [[nodiscard]] std::uint64_t pin_generation();
+
+    /**
+     * @brief Read the changes journaled for an inode.
+     *
+     * Error codes:
+     *
+     * - ENOENT: Nothing is journaled for the inode.
+     */
+    [[nodiscard]] Result<JournalEntry> journal(ino_t ino);
+
+    /**
+     * @brief Whether changes are journaled for an inode.
+     *
+     * Such inodes are newer in the cache than on the backend; their
+     * attributes and contents must not be replaced with the backend's.
+     */
+    [[nodiscard]] bool journaled(ino_t ino);
+
+    /**
+     * @brief Inodes with journaled changes, in ascending order.
+     */
+    [[nodiscard]] std::vector<ino_t> journaled_inodes();
+
     inline explicit operator bool() const {
         return bool(m_txn);
     }
@@ -689,6 +1076,7 @@ public:
     [[nodiscard]] Result<void> commit();
 
     friend class Cache;
+    friend class CachedDir;
 };
 
 class CacheTransactionRW: public CacheTransactionRO {
@@ -718,10 +1106,79 @@ private:
         return static_cast<MDBRWTransactionImpl*>(ro_transaction());
     }
 
+    /**
+     * @brief Directory of the rewrite in progress, or INVALID_INO.
+     */
+    ino_t m_rewrite_dir = INVALID_INO;
+
+    /**
+     * @brief Entries of the directory when the rewrite started, in
+     * ascending order; re-emplaced entries are replaced by INVALID_INO.
+     */
+    std::vector<ino_t> m_rewrite_candidates;
+
+    /**
+     * @brief Keep an entry of the directory which is being rewritten.
+     */
+    void keep_rewrite_candidate(ino_t parent, ino_t ino);
+
     [[nodiscard]] ino_t allocate_next_inode();
 
     [[nodiscard]] Result<void> make_orphan(ino_t ino);
 
+    /**
+     * @brief Remove a doomed orphan and its data.
+     *
+     * The children of a directory are orphaned in turn, as far as @a budget
+     * allows; each child consumes one unit. The inode record is removed on
+     * the first visit, so that only the remaining children are processed on
+     * later visits.
+     *
+     * @return true if the orphan is gone completely and its record in the
+     *   orphan database can be deleted.
+     */
+    [[nodiscard]] Result<bool> reap_orphan(ino_t ino, std::size_t &budget);
+
+    /**
+     * @brief Reap an inode which has just been orphaned, unless it is
+     * locked.
+     *
+     * Children of a large directory may be left for later reaping steps.
+     */
+    void reap_orphan_now(ino_t ino);
+
+    /**
+     * @brief Write the directory entry pair for an inode.
+     *
+     * Both the name-keyed and the inode-keyed record are (over-)written with
+     * a copy of @a attrs.
+     */
+    void put_dir_entry(ino_t parent, std::string_view name, ino_t ino,
+                       const InodeAttributes &attrs);
+
+    /**
+     * @brief Update the attributes stored in the directory entry of an inode.
+     *
+     * This must be called whenever the attributes of a linked inode change.
+     * Does nothing for the root inode or orphans.
+     */
+    [[nodiscard]] Result<void> sync_dir_entry(ino_t ino, const Inode &inode);
+
+    /**
+     * @brief Journal header of an inode; a zeroed header if there is none.
+     */
+    [[nodiscard]] JournalHeader journal_header(ino_t ino);
+
+    /**
+     * @brief Store the journal header of an inode with a new generation.
+     */
+    void put_journal_header(ino_t ino, JournalHeader &header);
+
+    /**
+     * @brief Drop all journal records of an inode.
+     */
+    void forget_journal(ino_t ino);
+
 public:
     [[nodiscard]] inline CacheTransactionRW begin_nested()
     {
@@ -748,13 +1205,146 @@ public:
     [[nodiscard]] Result<ino_t> emplace(ino_t parent, std::string_view name,
                                         const InodeAttributes &attrs);
 
+    /**
+     * @brief Record that a name does not exist on the backend.
+     *
+     * The record is dropped when the name is emplaced or the directory is
+     * rewritten, and ignored by users after @a expiry.
+     */
+    [[nodiscard]] Result<void> put_negative(ino_t parent, std::string_view name,
+                                            std::chrono::system_clock::time_point expiry);
+
+    /**
+     * @brief Drop the negative entry for a name, if any.
+     */
+    void forget_negative(ino_t parent, std::string_view name);
+
+    /**
+     * @brief Drop all negative entries of a directory.
+     */
+    void forget_negatives(ino_t dir);
+
+    /**
+     * @brief Store a new pin rule.
+     *
+     * The id of @a rule is ignored; a new one is assigned.
+     *
+     * @return The id of the rule.
+     */
+    [[nodiscard]] std::uint64_t add_pin_rule(const PinRule &rule);
+
+    /**
+     * @brief Remove a pin rule.
+     *
+     * The rule is retired: it stops pinning new contents, but stays in the
+     * database until the contents it pinned have been unpinned with
+     * Cache::unpin() and purge_pin_rules() has been called.
+     *
+     * Error codes:
+     *
+     * - ENOENT: There is no active rule with the id.
+     */
+    [[nodiscard]] Result<void> remove_pin_rule(std::uint64_t id);
+
+    /**
+     * @brief Delete retired pin rules for good.
+     *
+     * Ids of active rules are ignored.
+     */
+    void purge_pin_rules(const std::vector<std::uint64_t> &ids);
+
+    /**
+     * @brief Record that @a length bytes at @a offset have been written to
+     * the cached contents of a regular file.
+     *
+     * The range is merged with the extents it overlaps or touches.
+     *
+     * @param size Size of the file after the write.
+     */
+    void journal_write(ino_t ino, std::uint64_t offset, std::uint64_t length,
+                       std::uint64_t size);
+
+    /**
+     * @brief Record that the size of a regular file has changed.
+     *
+     * Extents beyond the new size are cut.
+     */
+    void journal_resize(ino_t ino, std::uint64_t size);
+
+    /**
+     * @brief Record that a regular file has been created in the cache and
+     * does not exist on the backend.
+     */
+    void journal_create(ino_t ino);
+
+    /**
+     * @brief Record that the backend file of a created regular file exists
+     * now.
+     *
+     * The file is only resized instead of created when it is written back
+     * the next time. The generation is kept, so that a write-back which has
+     * created the file can still complete the journal.
+     */
+    void journal_backend_created(ino_t ino);
+
+    /**
+     * @brief Drop the journal of an inode after it has been written back.
+     *
+     * @param generation The JournalEntry::generation which was written back.
+     * @return false if further changes have been journaled since, in which
+     *   case the journal is kept.
+     */
+    [[nodiscard]] bool complete_journal(ino_t ino, std::uint64_t generation);
+
+    /**
+     * @brief Remove an inode from the cache.
+     *
+     * Error codes:
+     *
+     * - EBUSY: Changes are journaled for the inode.
+     */
     [[nodiscard]] Result<void> unlink(ino_t ino);
     [[nodiscard]] Result<void> unlink(ino_t parent, ino_t child);
     [[nodiscard]] Result<void> unlink(ino_t parent, std::string_view name);
 
+    /**
+     * @brief Replace the common attributes of an inode.
+     *
+     * Error codes:
+     *
+     * - ENOENT: No such inode.
+     */
     // TODO: `which` argument
     [[nodiscard]] Result<void> setattr(ino_t ino, const CommonFileAttributes &attrs);
 
+    /**
+     * @brief Remove orphaned inodes and their data, incrementally.
+     *
+     * Visits the orphans starting where the previous call stopped, so that
+     * successive calls work through the whole orphan database. Locked orphans
+     * are skipped and picked up again by a later pass.
+     *
+     * @param budget Maximum number of orphans to visit plus children of
+     *   orphaned directories to orphan; zero means no limit.
+     * @return true if the budget ran out and orphans may be left which could
+     *   be reaped.
+     */
+    [[nodiscard]] Result<bool> reap_orphans(std::size_t budget);
+
+    /**
+     * @brief Reap orphans reported by CacheTransactionRO::release_many().
+     *
+     * Inodes which are not orphans (anymore) or have been locked again are
+     * left alone.
+     */
+    void reap_released(const std::vector<ino_t> &inos);
+
+    /**
+     * @brief Remove all orphaned inodes which are not locked.
+     *
+     * This may take a long time after a large directory subtree has been
+     * dropped; prefer reap_orphans() in latency sensitive paths.
+     */
     [[nodiscard]] Result<void> clean_orphans();
 
     [[nodiscard]] Result<void> writelink(ino_t ino, std::string_view dest);
@@ -763,13 +1353,23 @@ public:
                                             std::initializer_list<InodeFlag> to_set,
                                             std::initializer_list<InodeFlag> to_clear = std::initializer_list<InodeFlag>());
 
+    /**
+     * @brief Record the backend metadata of a directory along with its
+     * listing, or drop the record if @a stamp is empty.
+     *
+     * Error codes:
+     *
+     * - ENOENT: The inode does not exist.
+     */
+    [[nodiscard]] Result<void> set_dir_sync_stamp(ino_t ino, const std::optional<DirSyncStamp> &stamp);
+
     /**
      * @brief Start rewriting a complete directory
      *
      * @param dir The inode of the directory to rewrite.
      *
      * This marks all inodes in the directory for removal, but does not unlink
-     * them yet. The emplace() operation can be used to remove the mark for
+     * them yet. Negative entries of the directory are dropped. The emplace() operation can be used to remove the mark for
      * removal.
      *
      * Calling finish_dir_rewrite() unlinks all inodes from the directory which
@@ -799,6 +1399,109 @@ public:
      * - EBADFD: No rewrite operation is in progress.
      */
     [[nodiscard]] Result<void> finish_dir_rewrite();
+
+    /**
+     * @brief Replace the entries of a directory with a backend listing.
+     *
+     * @param dir The inode of the directory to rewrite.
+     * @param entries The listing; sorted by name in place.
+     * @param observer Called before each change, while the negative
+     *   entries of the directory still exist; may be empty.
+     *
+     * This has the effect of start_dir_rewrite(), emplace() for each entry
+     * and finish_dir_rewrite(), but merges the sorted listing against the
+     * sorted entries of the directory in the cache and only writes the
+     * differences. Entries whose attributes are unchanged are not written,
+     * so that re-syncing an unchanged directory only reads. Entries with
+     * journaled changes are left alone. Of several entries with the same
+     * name, the last one wins.
+     *
+     * Error codes:
+     *
+     * - EALREADY: A rewrite operation is in progress in this transaction.
+     * - EIO: The directory entries in the cache are corrupt.
+     */
+    [[nodiscard]] Result<DirRewriteStats> rewrite_dir(
+            ino_t dir, std::vector<DirRewriteEntry> &entries,
+            const DirRewriteObserver &observer = nullptr);
+};
+
+
+/**
+ * @brief Stream over the entries of a cached directory.
+ *
+ * The stream reads in batches. A batch takes a read-only transaction and a
+ * cursor on the tree index when it reads its first entry and keeps them
+ * until release(). Reading a batch sequentially thus costs a single seek
+ * plus one cursor step per entry, instead of one B-tree descent per entry.
+ * Reading from an offset other than the one the previous call returned,
+ * or the first read of a batch, re-positions the cursor.
+ *
+ * Between batches, the stream only remembers where it was, so that an open
+ * directory does not hold on to a reader slot of the database, nor keep
+ * the database from reusing freed pages.
+ *
+ * Use Cache::opendir() to create a stream.
+ *
+ * @note The stream must not be used concurrently from multiple threads.
+ */
+class CachedDir {
+public:
+    CachedDir() = delete;
+    CachedDir(Cache &cache, ino_t dir, ino_t parent);
+    CachedDir(const CachedDir &src) = delete;
+    CachedDir(CachedDir &&src) = delete;
+    CachedDir &operator=(const CachedDir &src) = delete;
+    CachedDir &operator=(CachedDir &&src) = delete;
+    ~CachedDir() = default;
+
+private:
+    Cache &m_cache;
+    std::optional<CacheTransactionRO> m_txn;
+    std::optional<MDBROCursor> m_cursor;
+    ino_t m_dir;
+    ino_t m_parent;
+
+    /**
+     * @brief Inode of the entry the cursor points at, if it is positioned.
+     */
+    ino_t m_cursor_ino;
+
+    /**
+     * @brief The prev_end argument which yielded the entry at the cursor.
+     */
+    ino_t m_cursor_prev;
+
+public:
+    [[nodiscard]] inline ino_t inode() const {
+        return m_dir;
+    }
+
+    /**
+     * @brief The transaction from whose snapshot the current batch reads;
+     * it is begun if needed.
+     */
+    [[nodiscard]] CacheTransactionRO &transaction();
+
+    /**
+     * @brief End the current batch.
+     *
+     * The entries returned by the batch become invalid. The next readdir()
+     * begins a new batch from the most recent state of the cache.
+     */
+    void release();
+
+    /**
+     * @brief Read a single directory entry.
+     *
+     * This has the same semantics as CacheTransactionRO::readdir(). The
+     * entry is valid until release() is called.
+     *
+     * @param prev_end The last inode returned by readdir to continue reading
+     * the directory stream or zero to start from the beginning.
+     * @return error code zero at EOF
+     */
+    [[nodiscard]] Result<DirectoryEntry> readdir(ino_t prev_end);
 };
 
 }
@@ -33,6 +33,25 @@ namespace Dragonstash {
 static constexpr std::size_t CACHE_PAGE_SIZE = 4096;
 static constexpr std::size_t CACHE_INODE_SIZE = CACHE_PAGE_SIZE / 16;
 
+/**
+ * @brief Limits for the block size of cached file contents.
+ *
+ * The block size is chosen when a cache is created; CACHE_PAGE_SIZE is the
+ * default.
+ */
+static constexpr std::size_t MIN_CACHE_BLOCK_SIZE = CACHE_PAGE_SIZE;
+static constexpr std::size_t MAX_CACHE_BLOCK_SIZE = 16 * 1024 * 1024;
+
+/**
+ * @brief Check whether a block size is a power of two within the limits.
+ */
+[[nodiscard]] constexpr bool is_valid_block_size(std::uint64_t size)
+{
+    return size >= MIN_CACHE_BLOCK_SIZE &&
+            size <= MAX_CACHE_BLOCK_SIZE &&
+            (size & (size - 1)) == 0;
+}
+
 template <typename T>
 class copyfree_wrap
 {
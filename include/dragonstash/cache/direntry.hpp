@@ -42,10 +42,33 @@ struct DirEntryV1 {
     std::uint16_t flags;
     std::uint32_t mode;
     ino_t entry_ino;
+};
+
+/**
+ * @brief Directory entry which carries a copy of the attributes of the inode
+ * it points at.
+ *
+ * The attributes are kept in sync with the inodes database by the writers.
+ * This allows readdir on the cache to return complete entries from a single
+ * scan over the tree database, without looking up each inode.
+ */
+struct DirEntryV2 {
+    std::uint8_t version;
+    std::uint8_t _reserved0;
+    std::uint16_t flags;
+    std::uint32_t _reserved1;
+    ino_t entry_ino;
+    InodeAttributes attr;
 
-    [[nodiscard]] static Result<std::tuple<copyfree_wrap<DirEntryV1>, std::string_view>> parse_inplace(std::basic_string_view<std::byte> buf);
+    /**
+     * @brief Parse a directory entry.
+     *
+     * Version 1 entries are accepted and upgraded on the fly; since they do
+     * not carry attributes, has_attributes() returns false for the result.
+     */
+    [[nodiscard]] static Result<std::tuple<copyfree_wrap<DirEntryV2>, std::string_view>> parse_inplace(std::basic_string_view<std::byte> buf);
 
-    [[nodiscard]] inline static Result<std::tuple<DirEntryV1, std::string>> parse(std::basic_string_view<std::byte> buf)
+    [[nodiscard]] inline static Result<std::tuple<DirEntryV2, std::string>> parse(std::basic_string_view<std::byte> buf)
     {
         auto result = parse_inplace(buf);
         if (!result) {
@@ -54,12 +77,22 @@ struct DirEntryV1 {
         return make_result(std::make_tuple(std::get<0>(*result).extract(),
                                            std::string(std::get<1>(*result))));
     }
+
+    /**
+     * @brief Return true if the entry carries valid inode attributes.
+     */
+    [[nodiscard]] inline bool has_attributes() const {
+        return version >= 2;
+    }
 };
 
-using DirEntry = DirEntryV1;
+static_assert(std::is_pod_v<DirEntryV2>);
+
+using DirEntry = DirEntryV2;
 
+static constexpr std::size_t DIR_ENTRY_V1_SIZE = sizeof(DirEntryV1);
 static constexpr std::size_t DIR_ENTRY_SIZE = sizeof(DirEntry);
-static constexpr std::uint8_t DIR_ENTRY_VERSION = 1;
+static constexpr std::uint8_t DIR_ENTRY_VERSION = 2;
 
 // TODO: replace char* by std::span<char> once we have it
 [[nodiscard]] inline std::tuple<DirEntry*, char*> emplace(
@@ -69,8 +102,10 @@ static constexpr std::uint8_t DIR_ENTRY_VERSION = 1;
 {
     buf.resize(DIR_ENTRY_SIZE + name_size);
     DirEntry &dir_entry = *reinterpret_cast<DirEntry*>(buf.data());
-    dir_entry.version = DIR_ENTRY_VERSION;
-    dir_entry.entry_ino = entry_ino;
+    dir_entry = DirEntry{
+        .version = DIR_ENTRY_VERSION,
+        .entry_ino = entry_ino,
+    };
     return std::make_tuple(
                 &dir_entry,
                 reinterpret_cast<char*>(std::data(buf)) + DIR_ENTRY_SIZE);
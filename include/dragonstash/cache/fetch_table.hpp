@@ -0,0 +1,174 @@
+/**********************************************************************
+File name: fetch_table.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_CACHE_FETCH_TABLE_H
+#define DRAGONSTASH_CACHE_FETCH_TABLE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "dragonstash/error.hpp"
+
+namespace Dragonstash {
+
+/**
+ * @brief Default number of backend fetches per inode which run at a time.
+ */
+static constexpr std::size_t CACHE_MAX_RUNNING_FETCHES = 4;
+
+/**
+ * @brief Default size up to which queued fetches are merged, in bytes.
+ */
+static constexpr std::size_t CACHE_MAX_MERGED_FETCH_SIZE = 8 * 1024 * 1024;
+
+/**
+ * @brief Table of the backend fetches in flight for one inode.
+ *
+ * Concurrent cache misses go through the table, so that the backend sees as
+ * few requests as possible:
+ *
+ * - A miss which starts inside a fetch in flight waits for that fetch
+ *   instead of issuing its own.
+ * - A miss which overlaps with a later fetch is cut short in front of it.
+ * - Only a limited number of fetches run at a time. Misses which arrive while
+ *   all slots are busy are queued, and queued misses which are adjacent to
+ *   each other are merged into one larger fetch.
+ *
+ * Callers are expected to pass block-aligned ranges; merged ranges then stay
+ * block-aligned.
+ *
+ * The table does not know about the cache itself. The fetcher of the caller
+ * which issues a fetch is expected to store the data; all callers which
+ * waited for the fetch get a copy of the data, too.
+ *
+ * All methods are thread-safe.
+ */
+class FetchTable {
+public:
+    /**
+     * @brief Data delivered by a fetch.
+     *
+     * The data may be shorter than requested if the end of the file was
+     * reached.
+     */
+    struct Fetch {
+        std::uint64_t offset;
+        std::vector<char> data;
+
+        [[nodiscard]] inline std::uint64_t end() const {
+            return offset + data.size();
+        }
+    };
+
+    /**
+     * @brief Callback which reads @a n bytes at @a offset into @a buf.
+     *
+     * Returns the number of bytes read; anything less than @a n is taken as
+     * the end of the file.
+     */
+    using Fetcher = std::function<Result<std::size_t>(std::uint64_t offset,
+                                                      char *buf,
+                                                      std::size_t n)>;
+
+    explicit FetchTable(std::size_t max_running = CACHE_MAX_RUNNING_FETCHES,
+                        std::size_t max_merged_size = CACHE_MAX_MERGED_FETCH_SIZE);
+    FetchTable(const FetchTable &src) = delete;
+    FetchTable(FetchTable &&src) = delete;
+    FetchTable &operator=(const FetchTable &src) = delete;
+    FetchTable &operator=(FetchTable &&src) = delete;
+    ~FetchTable() = default;
+
+private:
+    struct Entry {
+        std::uint64_t start;
+        std::uint64_t end;
+        bool running;
+        bool done;
+        int error;
+        std::shared_ptr<Fetch> result;
+    };
+
+    const std::size_t m_max_running;
+    const std::size_t m_max_merged_size;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<std::shared_ptr<Entry>> m_entries;
+    std::size_t m_running;
+    std::atomic<std::uint64_t> m_issued;
+    std::atomic<std::uint64_t> m_joined;
+
+    [[nodiscard]] Result<std::shared_ptr<const Fetch>> wait(
+            std::unique_lock<std::mutex> &lock,
+            std::shared_ptr<Entry> entry);
+    [[nodiscard]] Result<std::shared_ptr<const Fetch>> run(
+            std::unique_lock<std::mutex> &lock,
+            std::shared_ptr<Entry> entry,
+            const Fetcher &fetcher);
+
+public:
+    /**
+     * @brief Fetch the range [start, end), or join a fetch covering start.
+     *
+     * The returned fetch always contains @a start unless the end of the file
+     * was reached before it, but it may end before @a end (if the range was
+     * cut short in front of another fetch) or extend beyond it (if another
+     * fetch was merged into it). Callers iterate until they have what they
+     * need.
+     *
+     * @a fetcher is only called if this call issues a new fetch. In that
+     * case, it may be called with a larger range than requested.
+     */
+    [[nodiscard]] Result<std::shared_ptr<const Fetch>> fetch(
+            std::uint64_t start, std::uint64_t end,
+            const Fetcher &fetcher);
+
+    /**
+     * @brief Number of fetches which are queued or running.
+     */
+    [[nodiscard]] std::size_t in_flight();
+
+    /**
+     * @brief Number of fetches which have been passed to a fetcher.
+     */
+    [[nodiscard]] inline std::uint64_t issued() const {
+        return m_issued.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Number of calls which were served by another call's fetch.
+     */
+    [[nodiscard]] inline std::uint64_t joined() const {
+        return m_joined.load(std::memory_order_relaxed);
+    }
+
+};
+
+}
+
+#endif
@@ -58,6 +58,25 @@ struct CommonFileAttributes {
 
 static_assert(std::is_pod_v<CommonFileAttributes>);
 
+inline bool operator==(const CommonFileAttributes &a, const CommonFileAttributes &b)
+{
+    return a.size == b.size &&
+            a.nblocks == b.nblocks &&
+            a.uid == b.uid &&
+            a.gid == b.gid &&
+            a.atime.tv_sec == b.atime.tv_sec &&
+            a.atime.tv_nsec == b.atime.tv_nsec &&
+            a.mtime.tv_sec == b.mtime.tv_sec &&
+            a.mtime.tv_nsec == b.mtime.tv_nsec &&
+            a.ctime.tv_sec == b.ctime.tv_sec &&
+            a.ctime.tv_nsec == b.ctime.tv_nsec;
+}
+
+inline bool operator!=(const CommonFileAttributes &a, const CommonFileAttributes &b)
+{
+    return !(a == b);
+}
+
 struct InodeAttributes {
     CommonFileAttributes common;
     std::uint32_t mode;
@@ -81,9 +100,24 @@ struct InodeAttributes {
 
 static_assert(std::is_pod_v<InodeAttributes>);
 
+inline bool operator==(const InodeAttributes &a, const InodeAttributes &b)
+{
+    return a.mode == b.mode && a.common == b.common;
+}
+
+inline bool operator!=(const InodeAttributes &a, const InodeAttributes &b)
+{
+    return !(a == b);
+}
+
 struct Stat {
     InodeAttributes attr;
     ino_t ino;
+    /**
+     * @brief Block size of the cache the inode was read from; reported as
+     * st_blksize.
+     */
+    std::uint32_t blksize;
 
     inline operator struct stat() const {
         struct stat result{};
@@ -93,7 +127,7 @@ struct Stat {
         result.st_uid = attr.common.uid;
         result.st_gid = attr.common.gid;
         result.st_size = off_t(attr.common.size);
-        result.st_blksize = CACHE_PAGE_SIZE;
+        result.st_blksize = blksize;
         result.st_blocks = blkcnt_t(attr.common.nblocks);
         result.st_atim = attr.common.atime;
         result.st_mtim = attr.common.mtime;
@@ -104,11 +138,56 @@ struct Stat {
 
 static_assert(std::is_pod_v<Stat>);
 
+/**
+ * @brief Directory entry as returned by the cache.
+ *
+ * The name points into the memory map of the cache database and is only
+ * valid while the transaction which returned the entry is alive and has not
+ * modified the database.
+ */
 struct DirectoryEntry: public Stat {
-    std::string name;
+    std::string_view name;
     bool complete;
 };
 
+/**
+ * @brief Backend metadata of a directory at the time it was last synced.
+ *
+ * As long as the backend reports the same stamp for a directory, its
+ * entries have not been added, removed or renamed, and the cached listing
+ * can be used without asking the backend for it again.
+ */
+struct DirSyncStamp {
+    struct timespec mtime;
+    struct timespec ctime;
+    std::uint64_t backend_ino;
+
+    static DirSyncStamp from_backend_stat(const Backend::Stat &attr)
+    {
+        return DirSyncStamp{
+            .mtime = attr.mtime,
+            .ctime = attr.ctime,
+            .backend_ino = attr.ino,
+        };
+    }
+};
+
+static_assert(std::is_pod_v<DirSyncStamp>);
+
+inline bool operator==(const DirSyncStamp &a, const DirSyncStamp &b)
+{
+    return a.mtime.tv_sec == b.mtime.tv_sec &&
+            a.mtime.tv_nsec == b.mtime.tv_nsec &&
+            a.ctime.tv_sec == b.ctime.tv_sec &&
+            a.ctime.tv_nsec == b.ctime.tv_nsec &&
+            a.backend_ino == b.backend_ino;
+}
+
+inline bool operator!=(const DirSyncStamp &a, const DirSyncStamp &b)
+{
+    return !(a == b);
+}
+
 enum class InodeFlag {
     /**
      * @brief Indicate that the inode has been fully synced from the source at
@@ -123,6 +202,13 @@ enum class InodeFlag {
     SYNCED = 0,
 };
 
+/**
+ * @brief In-memory form of an inode record.
+ *
+ * Records of version 1 are this struct as-is and are parsed without a copy.
+ * Records of later versions use a compact, variable-length encoding (see
+ * serialize()) and are decoded into this struct.
+ */
 struct InodeV1 {
     std::uint8_t version;
     std::uint8_t _reserved0;
@@ -174,8 +260,16 @@ using Inode = InodeV1;
 
 static_assert(std::is_pod_v<Inode>);
 
+/**
+ * @brief Size of a version 1 inode record.
+ */
 static constexpr std::size_t INODE_SIZE = sizeof(Inode);
-static constexpr std::size_t INODE_CURRENT_VERSION = 1;
+static constexpr std::size_t INODE_CURRENT_VERSION = 2;
+
+/**
+ * @brief Upper bound for the size of an inode record written by serialize().
+ */
+static constexpr std::size_t INODE_MAX_ENCODED_SIZE = 1 + 13*10;
 
 template <typename T>
 inline Inode mkinode(T &&attr, ino_t parent = INVALID_INO) {
@@ -186,23 +280,32 @@ inline Inode mkinode(T &&attr, ino_t parent = INVALID_INO) {
     };
 }
 
-inline void serialize(const Inode &inode, std::byte *buf) {
-    memcpy(buf, &inode, INODE_SIZE);
-}
+/**
+ * @brief Encode an inode record of the current version into @a buf.
+ *
+ * The record is the version byte followed by LEB128 varints for the flags,
+ * parent, mode, uid, gid, size and block count, then the timestamps: the
+ * mtime seconds zigzag-encoded, the atime and ctime seconds as zigzag deltas
+ * to the mtime, and the nanoseconds as plain varints. Typical records take
+ * 30 to 40 bytes instead of the INODE_SIZE bytes of version 1.
+ *
+ * @a buf must have room for INODE_MAX_ENCODED_SIZE bytes.
+ *
+ * @return The number of bytes written.
+ */
+std::size_t serialize(const Inode &inode, std::byte *buf);
 
 template <typename T, typename _ = typename std::enable_if<sizeof(T) == 1 && std::is_arithmetic_v<T>>::type>
 inline std::basic_string<T> serialize_as(const Inode &inode) {
-    std::basic_string<T> buf;
-    buf.resize(INODE_SIZE);
-    serialize(inode, reinterpret_cast<std::byte*>(buf.data()));
-    return buf;
+    std::byte buf[INODE_MAX_ENCODED_SIZE];
+    const std::size_t size = serialize(inode, buf);
+    return std::basic_string<T>(reinterpret_cast<const T*>(buf), size);
 }
 
 inline std::basic_string<std::byte> serialize(const Inode &inode) {
-    std::basic_string<std::byte> buf;
-    buf.resize(INODE_SIZE);
-    serialize(inode, buf.data());
-    return buf;
+    std::byte buf[INODE_MAX_ENCODED_SIZE];
+    const std::size_t size = serialize(inode, buf);
+    return std::basic_string<std::byte>(buf, size);
 }
 
 }
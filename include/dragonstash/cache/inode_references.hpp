@@ -0,0 +1,200 @@
+/**********************************************************************
+File name: inode_references.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_CACHE_INODE_REFERENCES_H
+#define DRAGONSTASH_CACHE_INODE_REFERENCES_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dragonstash/error.hpp"
+#include "dragonstash/cache/inode.hpp"
+#include "dragonstash/metrics.hpp"
+
+namespace Dragonstash {
+
+/**
+ * @brief In-memory lock counters of inodes.
+ *
+ * An inode with a non-zero counter must not be removed from the cache; an
+ * inode which is about to be removed is doomed and cannot be locked anymore.
+ *
+ * The counters are kept in a sharded hash map. A shard is only locked to
+ * find a counter (shared) or to insert one (exclusive); the counters
+ * themselves are updated with atomic compare-and-swap, so that the doomed
+ * check of incref() and the zero check of doom() cannot race. Counters are
+ * never removed from the map, thus references to them stay valid.
+ *
+ * Shard locks are tried first; only when that fails, the wait for the lock
+ * is timed, so that the uncontended path stays free of clock reads.
+ */
+class InodeReferences {
+public:
+    static constexpr std::size_t DEFAULT_SHARDS = 64;
+
+    struct Release {
+        ino_t ino;
+        std::uint64_t by;
+    };
+
+public:
+    explicit InodeReferences(std::size_t nshards = DEFAULT_SHARDS);
+    InodeReferences(const InodeReferences &src) = delete;
+    InodeReferences(InodeReferences &&src) = delete;
+    InodeReferences &operator=(const InodeReferences &src) = delete;
+    InodeReferences &operator=(InodeReferences &&src) = delete;
+    ~InodeReferences() = default;
+
+private:
+    /**
+     * @brief Bit of a counter which marks the inode as doomed.
+     */
+    static constexpr std::uint64_t DOOMED = std::uint64_t(1) << 63;
+
+    /**
+     * @brief Bit of a counter which records that dooming failed because the
+     * inode had references.
+     */
+    static constexpr std::uint64_t DOOM_PENDING = std::uint64_t(1) << 62;
+
+    /**
+     * @brief Bits of a counter which hold the number of references.
+     */
+    static constexpr std::uint64_t COUNT = DOOM_PENDING - 1;
+
+    using Counter = std::atomic<std::uint64_t>;
+
+    struct Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<ino_t, Counter> counters;
+    };
+
+    std::vector<Shard> m_shards;
+
+    mutable Metrics::Counter m_lock_acquisitions;
+    mutable Metrics::Histogram m_lock_wait;
+
+    [[nodiscard]] std::shared_lock<std::shared_mutex> lock_shared(const Shard &shard) const;
+    [[nodiscard]] std::unique_lock<std::shared_mutex> lock_exclusive(Shard &shard);
+
+    [[nodiscard]] inline Shard &shard_for(ino_t ino) {
+        return m_shards[ino % m_shards.size()];
+    }
+
+    [[nodiscard]] inline const Shard &shard_for(ino_t ino) const {
+        return m_shards[ino % m_shards.size()];
+    }
+
+    [[nodiscard]] const Counter *find(ino_t ino) const;
+
+    [[nodiscard]] inline Counter *find(ino_t ino) {
+        return const_cast<Counter*>(std::as_const(*this).find(ino));
+    }
+
+    [[nodiscard]] Counter &get(ino_t ino);
+
+public:
+    /**
+     * @brief Add references to an inode.
+     *
+     * Error codes:
+     *
+     * - ESTALE: the inode is doomed.
+     *
+     * @return The new number of references.
+     */
+    [[nodiscard]] Result<std::uint64_t> incref(ino_t ino, std::uint64_t by);
+
+    /**
+     * @brief Drop references from an inode.
+     *
+     * Dropping more references than the inode has is a logic error and
+     * throws std::runtime_error.
+     *
+     * Error codes:
+     *
+     * - EINVAL: @a by is zero.
+     *
+     * @return The new number of references.
+     */
+    [[nodiscard]] Result<std::uint64_t> decref(ino_t ino, std::uint64_t by);
+
+    /**
+     * @brief Drop references from many inodes at once.
+     *
+     * The releases are grouped by shard, so that each shard is locked once
+     * instead of once per inode. If the same inode occurs more than once,
+     * the releases add up.
+     *
+     * Dropping more references than an inode has is a logic error and throws
+     * std::runtime_error; the releases applied before that stay applied.
+     *
+     * @param releases The releases to apply; reordered in place.
+     * @param reapable If not null, receives the inodes which dropped to zero
+     *   references after an attempt to doom them failed, i.e. orphans which
+     *   were only kept alive by references.
+     */
+    void decref_many(std::vector<Release> &releases,
+                     std::vector<ino_t> *reapable = nullptr);
+
+    /**
+     * @brief Mark an unreferenced inode as doomed.
+     *
+     * Dooming a doomed inode succeeds. If the inode has references, this is
+     * remembered, see decref_many().
+     *
+     * Error codes:
+     *
+     * - EBUSY: the inode has references.
+     */
+    [[nodiscard]] Result<void> doom(ino_t ino);
+
+    [[nodiscard]] bool doomed(ino_t ino) const;
+
+    [[nodiscard]] std::uint64_t refcount(ino_t ino) const;
+
+    /**
+     * @brief Number of shard locks taken.
+     */
+    [[nodiscard]] inline std::uint64_t lock_acquisitions() const {
+        return m_lock_acquisitions.value();
+    }
+
+    /**
+     * @brief Time spent waiting for shard locks which were held by others.
+     */
+    [[nodiscard]] inline const Metrics::Histogram &lock_wait() const {
+        return m_lock_wait;
+    }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,155 @@
+/**********************************************************************
+File name: path_cache.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_CACHE_PATH_CACHE_H
+#define DRAGONSTASH_CACHE_PATH_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "dragonstash/cache/inode.hpp"
+
+namespace Dragonstash {
+
+/**
+ * @brief Bounded, sharded in-memory cache of directory entries keyed by
+ * inode.
+ *
+ * Each record maps an inode to its parent inode and its name in the parent.
+ * This is what CacheTransactionRO::path() needs per level of the tree, and
+ * caching the individual entries (instead of full paths) means that an
+ * invalidated directory automatically invalidates the paths of everything
+ * below it.
+ *
+ * Consistency with LMDB snapshots is ensured with an epoch counter: readers
+ * sample the epoch before they obtain their snapshot and only insert records
+ * if no invalidation has happened since. Invalidations bump the epoch before
+ * they remove the record, so a reader with an older snapshot can never
+ * re-insert an invalidated record.
+ */
+class PathCache {
+public:
+    struct Entry {
+        ino_t parent;
+        std::string name;
+    };
+
+    static constexpr std::size_t DEFAULT_CAPACITY = 65536;
+    static constexpr std::size_t DEFAULT_SHARDS = 16;
+
+public:
+    explicit PathCache(std::size_t capacity = DEFAULT_CAPACITY,
+                       std::size_t nshards = DEFAULT_SHARDS);
+    PathCache(const PathCache &src) = delete;
+    PathCache(PathCache &&src) = delete;
+    PathCache &operator=(const PathCache &src) = delete;
+    PathCache &operator=(PathCache &&src) = delete;
+    ~PathCache() = default;
+
+private:
+    struct Record {
+        ino_t ino;
+        Entry entry;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Record> lru;
+        std::unordered_map<ino_t, std::list<Record>::iterator> index;
+    };
+
+    std::size_t m_shard_capacity;
+    std::vector<Shard> m_shards;
+    std::atomic<std::uint64_t> m_epoch;
+    std::atomic<std::uint64_t> m_hits;
+    std::atomic<std::uint64_t> m_misses;
+
+    [[nodiscard]] inline Shard &shard_for(ino_t ino) {
+        return m_shards[ino % m_shards.size()];
+    }
+
+public:
+    /**
+     * @brief Current invalidation epoch.
+     *
+     * Must be sampled *before* the LMDB snapshot which is used to fill the
+     * cache is obtained.
+     */
+    [[nodiscard]] inline std::uint64_t epoch() const {
+        return m_epoch.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Look up the directory entry of an inode.
+     *
+     * Counts as hit or miss in the statistics.
+     */
+    [[nodiscard]] std::optional<Entry> lookup(ino_t ino);
+
+    /**
+     * @brief Insert the directory entry of an inode.
+     *
+     * @param epoch The epoch sampled before the snapshot from which the entry
+     *   was read was obtained. If an invalidation happened since, the entry is
+     *   not inserted.
+     */
+    void insert(ino_t ino, ino_t parent, std::string_view name,
+                std::uint64_t epoch);
+
+    /**
+     * @brief Remove the entry of an inode, if any.
+     */
+    void invalidate(ino_t ino);
+
+    /**
+     * @brief Remove all entries.
+     */
+    void clear();
+
+    [[nodiscard]] std::size_t size();
+
+    [[nodiscard]] inline std::size_t capacity() const {
+        return m_shard_capacity * m_shards.size();
+    }
+
+    [[nodiscard]] inline std::uint64_t hits() const {
+        return m_hits.load(std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] inline std::uint64_t misses() const {
+        return m_misses.load(std::memory_order_relaxed);
+    }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,418 @@
+/**********************************************************************
+File name: regular_file.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_CACHE_REGULAR_FILE_H
+#define DRAGONSTASH_CACHE_REGULAR_FILE_H
+
+#include <sys/types.h>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "dragonstash/error.hpp"
+
+#include "dragonstash/cache/blocklist.hpp"
+#include "dragonstash/cache/fetch_table.hpp"
+#include "dragonstash/cache/inode.hpp"
+#include "dragonstash/cache/space_manager.hpp"
+
+namespace Dragonstash {
+
+class ContentStore;
+
+/**
+ * @brief Handle to the cached contents of a regular file.
+ *
+ * The contents are stored in a sparse data file, using the same offsets as
+ * the file on the backend. A Blocklist records which blocks
+ * of the data file hold valid data.
+ *
+ * A handle can be used concurrently. Reads of cached data run in parallel;
+ * storing data and invalidation are serialised.
+ *
+ * Handles opened through a ContentStore report stores and hits to the
+ * store's SpaceManager, so that the cache as a whole stays within its
+ * budget.
+ *
+ * Misses on the handle are meant to be fetched through fetches(), so that
+ * concurrent users of the same file share their backend requests.
+ *
+ * Note that there is no synchronisation between the LMDB-backed metadata
+ * and the data inside the cache; in case of a crash, it is possible that
+ * data is missing from the cache for which LMDB already has metadata.
+ *
+ * @see ContentStore
+ */
+class RegularFileHandle {
+public:
+    RegularFileHandle() = delete;
+    /**
+     * @param store If given, the handle reports to the SpaceManager of the
+     *   store and uses its block size for new blocklists.
+     */
+    RegularFileHandle(ino_t ino,
+                      const std::filesystem::path &blocklist_path,
+                      FileHandle data_fd,
+                      ContentStore *store = nullptr);
+    RegularFileHandle(const RegularFileHandle &src) = delete;
+    RegularFileHandle(RegularFileHandle &&src) = delete;
+    RegularFileHandle &operator=(const RegularFileHandle &src) = delete;
+    RegularFileHandle &operator=(RegularFileHandle &&src) = delete;
+    ~RegularFileHandle() = default;
+
+private:
+    const ino_t m_ino;
+    std::shared_mutex m_blocks_mutex;
+    Blocklist m_blocks;
+    FileHandle m_data;
+    std::uint64_t m_generation;
+    ContentStore *const m_store;
+    const std::uint64_t m_chunk_blocks;
+    FetchTable m_fetches;
+
+    /**
+     * @brief Count the evictable blocks in each chunk of a range of chunks.
+     *
+     * Must be called with m_blocks_mutex held.
+     */
+    [[nodiscard]] std::vector<std::uint64_t> evictable_blocks(
+            std::uint64_t first_chunk,
+            std::uint64_t end_chunk) const;
+
+    /**
+     * @brief Report a hit on the byte range to the space manager.
+     */
+    void touch(off_t off, std::size_t n);
+
+    /**
+     * @brief Report the change in evictable blocks per chunk to the space
+     * manager and reclaim space if needed.
+     *
+     * Must be called without m_blocks_mutex held.
+     */
+    void account(std::uint64_t first_chunk,
+                 const std::vector<std::uint64_t> &evictable_before,
+                 const std::vector<std::uint64_t> &evictable_after);
+
+public:
+    [[nodiscard]] ino_t inode() const;
+
+    /**
+     * @brief Size of the blocks in which contents are cached, in bytes.
+     */
+    [[nodiscard]] inline std::uint32_t block_size() const {
+        return m_blocks.block_size();
+    }
+
+    /**
+     * @brief Backend fetches in flight for this file.
+     */
+    [[nodiscard]] inline FetchTable &fetches() {
+        return m_fetches;
+    }
+
+    /**
+     * @brief Read cached data.
+     *
+     * Only the cached range starting at @a off is read; the read stops at the
+     * first block which is not cached.
+     *
+     * @return The number of bytes read. Zero if the block containing @a off
+     *   is not cached.
+     */
+    [[nodiscard]] Result<std::size_t> pread(off_t off, void *buf, std::size_t n);
+
+    /**
+     * @brief Access the cached range starting at @a off in place.
+     *
+     * Calls @a f with the descriptor of the data file and the number of
+     * cached bytes at @a off (at most @a n). The range stays valid while
+     * @a f runs, so the descriptor can be handed out for zero-copy replies.
+     */
+    template <typename F>
+    auto with_cached_range(off_t off, std::size_t n, F &&f)
+    {
+        std::shared_lock<std::shared_mutex> guard(m_blocks_mutex);
+        const std::size_t available = m_blocks.truncate_access(off, n);
+        touch(off, available);
+        return f(int(m_data), available);
+    }
+
+    /**
+     * @brief Store data fetched from the backend.
+     *
+     * @param generation The generation() at the time the fetch was started.
+     *   If the cached data has been discarded in the meantime, the data
+     *   belongs to an old version of the file and nothing is stored.
+     *
+     * All blocks which are fully covered by the range are marked with
+     * @a state. Partially covered blocks are written, but not marked, since
+     * the remainder of the block is unknown -- except for the last block if
+     * @a eof is set: the range then ends at the end of the file and nothing
+     * beyond it will ever be read.
+     *
+     * Storing with the READAHEAD state only marks blocks which are not
+     * present yet, so that blocks which have been read already are not
+     * demoted.
+     *
+     * WRITTEN blocks are neither overwritten nor re-marked; they hold data
+     * which is newer than the backend.
+     *
+     * @return The number of bytes stored.
+     */
+    [[nodiscard]] Result<std::size_t> store(std::uint64_t generation,
+                                            off_t off, const void *buf, std::size_t n,
+                                            bool eof,
+                                            Blocklist::State state = Blocklist::READ);
+
+    /**
+     * @brief Store data written by a user of the file system.
+     *
+     * All blocks touched by the range are marked WRITTEN: they are not
+     * evicted and not overwritten by store() until settle() is called.
+     * A partially covered block must be cached already, unless the part which
+     * is not covered lies beyond the end of the file; ENODATA is returned
+     * otherwise.
+     *
+     * Afterwards, the handle is bound to the version described by @a attr,
+     * whose size must include the range.
+     */
+    [[nodiscard]] Result<void> write(off_t off, const void *buf, std::size_t n,
+                                     const CommonFileAttributes &attr);
+
+    /**
+     * @brief Change the size of the cached file from @a old_size to the size
+     * in @a attr.
+     *
+     * Blocks beyond the new size are dropped. When the file grows, the new
+     * range reads as zeroes and is marked WRITTEN, including the block
+     * holding the old end of file, which must be cached already if it is
+     * partial (ENODATA otherwise).
+     *
+     * Afterwards, the handle is bound to the version described by @a attr.
+     */
+    [[nodiscard]] Result<void> resize(std::uint64_t old_size,
+                                      const CommonFileAttributes &attr);
+
+    /**
+     * @brief Bind the handle to the version described by @a attr again,
+     * keeping all blocks.
+     *
+     * This undoes the binding of write() or resize() if the change could not
+     * be recorded for the file, so that the cached data, including WRITTEN
+     * blocks of earlier changes, is not discarded by the next validate().
+     */
+    void retag(const CommonFileAttributes &attr);
+
+    /**
+     * @brief Mark all WRITTEN blocks as READ once they have been written back
+     * and bind the handle to the version described by @a attr.
+     *
+     * @return The number of blocks which were settled.
+     */
+    [[nodiscard]] std::uint64_t settle(const CommonFileAttributes &attr);
+
+    /**
+     * @brief Mark READAHEAD blocks in a range as READ.
+     *
+     * This is to be called when the range has been read by a user.
+     */
+    void promote(off_t off, std::size_t n);
+
+    /**
+     * @brief Drop the evictable blocks of a chunk from the cache.
+     *
+     * READ and READAHEAD blocks are marked ABSENT and their storage is
+     * released by punching a hole into the data file. Blocks in other states
+     * are kept.
+     *
+     * This does not report to the space manager; it is meant to be called
+     * for victims selected by it.
+     *
+     * @return The number of blocks which were dropped.
+     */
+    [[nodiscard]] Result<std::uint64_t> evict(std::uint64_t chunk);
+
+    /**
+     * @brief Mark all PINNED blocks as READ, so that they can be evicted.
+     *
+     * @return The number of blocks which were unpinned.
+     */
+    std::uint64_t unpin();
+
+    /**
+     * @brief Counter which changes whenever the cached data is discarded.
+     */
+    [[nodiscard]] std::uint64_t generation();
+
+    /**
+     * @brief Drop the cached data unless it belongs to the given version of
+     * the file.
+     *
+     * The version is identified by the size and the modification time. When
+     * the cached data was stored for a different version, it is discarded
+     * and the handle is bound to the new version.
+     *
+     * @return true if cached data was kept, false if it was discarded.
+     */
+    [[nodiscard]] Result<bool> validate(const CommonFileAttributes &attr);
+
+    [[nodiscard]] Result<void> fsync();
+
+    /**
+     * @brief Number of cached blocks.
+     */
+    [[nodiscard]] std::uint64_t cached_blocks();
+
+    /**
+     * @brief Number of cached blocks in a given state.
+     */
+    [[nodiscard]] std::uint64_t cached_blocks(Blocklist::State state);
+
+};
+
+
+/**
+ * @brief Directory holding the cached contents of regular files.
+ *
+ * Each inode gets a data file and a blocklist file, named after the inode
+ * number. Handles are shared: all users of an inode which is open at the same
+ * time get the same RegularFileHandle.
+ *
+ * The store enforces a budget on the size of the cached contents; once it is
+ * exceeded, blocks are evicted in the order chosen by the SpaceManager.
+ * Only READ and READAHEAD blocks are subject to eviction.
+ */
+class ContentStore {
+public:
+    ContentStore() = delete;
+    /**
+     * @param root Directory holding the content files.
+     * @param budget Maximum size of the evictable contents in bytes; zero
+     *   means no limit.
+     * @param block_size Size of the blocks in which contents are cached.
+     *   Contents cached with a different block size are discarded.
+     */
+    explicit ContentStore(std::filesystem::path root,
+                          std::uint64_t budget = 0,
+                          std::uint32_t block_size = CACHE_PAGE_SIZE);
+    ContentStore(const ContentStore &src) = delete;
+    ContentStore(ContentStore &&src) = delete;
+    ContentStore &operator=(const ContentStore &src) = delete;
+    ContentStore &operator=(ContentStore &&src) = delete;
+    ~ContentStore() = default;
+
+private:
+    const std::filesystem::path m_root;
+    const std::uint32_t m_block_size;
+    std::mutex m_open_mutex;
+    std::unordered_map<ino_t, std::weak_ptr<RegularFileHandle>> m_open;
+    SpaceManager m_space;
+    mutable std::mutex m_pinned_mutex;
+    std::unordered_set<ino_t> m_pinned;
+
+    [[nodiscard]] std::filesystem::path data_path(ino_t ino) const;
+    [[nodiscard]] std::filesystem::path blocklist_path(ino_t ino) const;
+    [[nodiscard]] Result<std::shared_ptr<RegularFileHandle>> open_files(ino_t ino);
+    void scan();
+
+public:
+    /**
+     * @brief Open the cached contents of an inode, creating them if needed.
+     *
+     * If the blocklist of the inode is unreadable, the cached contents are
+     * discarded and started from scratch.
+     */
+    [[nodiscard]] Result<std::shared_ptr<RegularFileHandle>> open(ino_t ino);
+
+    /**
+     * @brief Delete the cached contents of an inode.
+     *
+     * Handles which are still open keep working on the deleted files.
+     */
+    void remove(ino_t ino);
+
+    /**
+     * @brief Evict contents until the budget is met.
+     *
+     * This is called automatically after data has been stored.
+     */
+    void reclaim();
+
+    /**
+     * @brief Change the budget (in bytes) and evict contents if needed.
+     */
+    void set_budget(std::uint64_t budget);
+
+    [[nodiscard]] inline const std::filesystem::path &root() const {
+        return m_root;
+    }
+
+    [[nodiscard]] inline SpaceManager &space() {
+        return m_space;
+    }
+
+    /**
+     * @brief Record that an inode has PINNED blocks.
+     *
+     * This is called by the handles; the set is rebuilt from the blocklists
+     * when the store is opened.
+     */
+    void add_pinned(ino_t ino);
+
+    void remove_pinned(ino_t ino);
+
+    /**
+     * @brief Inodes which (may) have PINNED blocks, in ascending order.
+     *
+     * Inodes whose cached data has been discarded since they were pinned
+     * may be included.
+     */
+    [[nodiscard]] std::vector<ino_t> pinned() const;
+
+    [[nodiscard]] inline std::uint32_t block_size() const {
+        return m_block_size;
+    }
+
+    /**
+     * @brief Number of blocks in a chunk of the SpaceManager.
+     *
+     * Chunks span the same number of bytes regardless of the block size,
+     * but hold at least one block.
+     */
+    [[nodiscard]] inline std::uint64_t chunk_blocks() const {
+        return std::max<std::uint64_t>(
+                    CACHE_CHUNK_BLOCKS * CACHE_PAGE_SIZE / m_block_size, 1);
+    }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,195 @@
+/**********************************************************************
+File name: space_manager.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_CACHE_SPACE_MANAGER_H
+#define DRAGONSTASH_CACHE_SPACE_MANAGER_H
+
+#include <sys/types.h>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace Dragonstash {
+
+/**
+ * @brief Number of blocks of CACHE_PAGE_SIZE bytes which are accounted for
+ * as a single unit.
+ *
+ * With larger blocks, chunks hold proportionally fewer blocks; see
+ * ContentStore::chunk_blocks().
+ */
+static constexpr std::uint64_t CACHE_CHUNK_BLOCKS = 256;
+
+/**
+ * @brief Cache-wide index of evictable file contents.
+ *
+ * The contents are tracked in chunks of a fixed number of blocks, keyed by
+ * inode and chunk number. Each chunk is charged with the number of its
+ * blocks which are cached and may be evicted (READ or READAHEAD).
+ *
+ * Eviction order follows the 2Q algorithm, so that a single sequential scan
+ * cannot flush the working set:
+ *
+ * - Chunks seen for the first time enter a FIFO ("in") queue. Accesses
+ *   while in that queue do not count.
+ * - Chunks evicted from the in queue are remembered in a ghost list
+ *   without data.
+ * - A chunk which is stored again while in the ghost list enters the LRU
+ *   ("main") queue, where accesses move it to the front.
+ * - Eviction takes from the in queue while it holds more than a quarter of
+ *   the budget, and from the main queue otherwise.
+ *
+ * The index itself does not evict; next_victim() tells the caller which
+ * chunk to drop. All methods are thread-safe.
+ */
+class SpaceManager {
+public:
+    struct ChunkKey {
+        ino_t ino;
+        std::uint64_t chunk;
+
+        inline bool operator==(const ChunkKey &other) const {
+            return ino == other.ino && chunk == other.chunk;
+        }
+    };
+
+    struct Victim {
+        ChunkKey key;
+        /**
+         * @brief Number of blocks the chunk was charged with.
+         */
+        std::uint64_t blocks;
+    };
+
+public:
+    /**
+     * @param budget Number of blocks which may be cached; zero means no
+     *   limit.
+     * @param chunk_blocks Number of blocks in a chunk.
+     */
+    explicit SpaceManager(std::uint64_t budget = 0,
+                          std::uint64_t chunk_blocks = CACHE_CHUNK_BLOCKS);
+    SpaceManager(const SpaceManager &src) = delete;
+    SpaceManager(SpaceManager &&src) = delete;
+    SpaceManager &operator=(const SpaceManager &src) = delete;
+    SpaceManager &operator=(SpaceManager &&src) = delete;
+    ~SpaceManager() = default;
+
+private:
+    enum class Queue {
+        IN,
+        MAIN,
+    };
+
+    struct Entry {
+        ChunkKey key;
+        std::uint64_t blocks;
+        Queue queue;
+    };
+
+    struct ChunkKeyHash {
+        inline std::size_t operator()(const ChunkKey &key) const {
+            return std::hash<std::uint64_t>()(std::uint64_t(key.ino) * 0x9e3779b97f4a7c15ULL ^ key.chunk);
+        }
+    };
+
+    using EntryList = std::list<Entry>;
+    using GhostList = std::list<ChunkKey>;
+
+    mutable std::mutex m_mutex;
+    const std::uint64_t m_chunk_blocks;
+    std::uint64_t m_budget;
+    std::uint64_t m_used;
+    std::uint64_t m_in_used;
+
+    /* front is the most recently inserted/used entry */
+    EntryList m_in;
+    EntryList m_main;
+    GhostList m_ghosts;
+    std::unordered_map<ChunkKey, EntryList::iterator, ChunkKeyHash> m_index;
+    std::unordered_map<ChunkKey, GhostList::iterator, ChunkKeyHash> m_ghost_index;
+    /* chunk numbers of each inode which are in the queues or ghosts */
+    std::unordered_map<ino_t, std::unordered_set<std::uint64_t>> m_inode_chunks;
+
+    [[nodiscard]] std::uint64_t max_in_used() const;
+    [[nodiscard]] std::size_t max_ghosts() const;
+    void remember_ghost(const ChunkKey &key);
+    void remove_entry(EntryList::iterator iter);
+    void track_chunk(const ChunkKey &key);
+    void untrack_chunk(const ChunkKey &key);
+
+public:
+    /**
+     * @brief Account for blocks which have been added to the cache.
+     *
+     * Charging counts as an access to the chunk.
+     */
+    void charge(const ChunkKey &key, std::uint64_t blocks);
+
+    /**
+     * @brief Account for blocks which have been removed from the cache
+     * without going through next_victim().
+     */
+    void discharge(const ChunkKey &key, std::uint64_t blocks);
+
+    /**
+     * @brief Record a read of cached data in a chunk.
+     */
+    void touch(const ChunkKey &key);
+
+    /**
+     * @brief Remove all chunks of an inode, e.g. because its cached data
+     * has been deleted.
+     *
+     * This takes time proportional to the number of chunks of the inode,
+     * not to the size of the index.
+     */
+    void forget(ino_t ino);
+
+    /**
+     * @brief Select a chunk to evict, if the budget is exceeded.
+     *
+     * The chunk is removed from the index and its blocks are no longer
+     * accounted for; the caller is expected to evict them.
+     */
+    [[nodiscard]] std::optional<Victim> next_victim();
+
+    void set_budget(std::uint64_t budget);
+
+    [[nodiscard]] std::uint64_t budget() const;
+
+    /**
+     * @brief Number of blocks currently accounted for.
+     */
+    [[nodiscard]] std::uint64_t used() const;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,296 @@
+/**********************************************************************
+File name: transaction_log.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_CACHE_TRANSACTION_LOG_H
+#define DRAGONSTASH_CACHE_TRANSACTION_LOG_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "dragonstash/error.hpp"
+#include "dragonstash/inline_function.hpp"
+#include "dragonstash/cache/inode.hpp"
+#include "dragonstash/cache/inode_references.hpp"
+
+namespace Dragonstash {
+
+/**
+ * @brief Number of bytes a transaction hook callback may capture.
+ */
+static constexpr std::size_t TRANSACTION_HOOK_CAPACITY = 3 * sizeof(void*);
+
+/**
+ * @brief A group of functions which may be executed when the transaction
+ * commits or aborts.
+ *
+ * The callbacks are stored inline; they may capture at most
+ * TRANSACTION_HOOK_CAPACITY bytes.
+ *
+ * @see CacheTransactionRO::add_transaction_hook for semantics.
+ */
+class TransactionHook
+{
+public:
+    template <typename Signature>
+    using Callback = InlineFunction<Signature, TRANSACTION_HOOK_CAPACITY>;
+
+public:
+    TransactionHook() = default;
+    template <typename T1, typename T2, typename T3, typename T4>
+    TransactionHook(T1 &&stage_1_commit,
+                    T2 &&stage_1_rollback,
+                    T3 &&stage_2_commit,
+                    T4 &&rollback):
+        m_stage_1_commit(std::forward<T1>(stage_1_commit)),
+        m_stage_1_rollback(std::forward<T2>(stage_1_rollback)),
+        m_stage_2_commit(std::forward<T3>(stage_2_commit)),
+        m_rollback(std::forward<T4>(rollback))
+    {
+
+    }
+    TransactionHook(const TransactionHook &src) = delete;
+    TransactionHook(TransactionHook &&src) noexcept = default;
+    TransactionHook &operator=(const TransactionHook &src) = delete;
+    TransactionHook &operator=(TransactionHook &&src) noexcept = default;
+    ~TransactionHook() = default;
+
+private:
+    /**
+     * @brief Executed on commit
+     *
+     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     */
+    Callback<Result<void>()> m_stage_1_commit;
+
+    /**
+     * @brief Executed when a later commit hook failed
+     *
+     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     */
+    Callback<void()> m_stage_1_rollback;
+
+    /**
+     * @brief Executed when all pre commit hooks have passed.
+     *
+     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     */
+    Callback<void()> m_stage_2_commit;
+
+    /**
+     * @brief Executed when the transaction is rolled back.
+     *
+     * @see CacheTransactionRO::add_transaction_hook for semantics.
+     */
+    Callback<void()> m_rollback;
+
+    bool m_stage_1_ran{false};
+
+public:
+    [[nodiscard]] inline Result<void> stage_1_commit() {
+        if (m_stage_1_commit) {
+            auto result = m_stage_1_commit();
+            if (result) {
+                m_stage_1_ran = true;
+            }
+            return result;
+        }
+        return make_result();
+    }
+
+    inline void stage_1_rollback() {
+        if (m_stage_1_ran && m_stage_1_rollback) {
+            m_stage_1_rollback();
+        }
+    }
+
+    inline void stage_2_commit() {
+        if (m_stage_2_commit) {
+            m_stage_2_commit();
+        }
+    }
+
+    inline void rollback() {
+        if (m_rollback) {
+            m_rollback();
+        }
+    }
+
+};
+
+
+/**
+ * @brief Undo log of a cache transaction.
+ *
+ * Changes to the in-memory lock counters are the by far most common thing a
+ * transaction has to undo, so they are recorded as plain (inode, delta)
+ * records instead of hooks. Other hooks are kept in a separate list and are
+ * referenced by a marker record, so that all undo actions still run in
+ * reverse order of recording.
+ *
+ * Logs keep their capacity when cleared; see TransactionLogPool.
+ */
+class TransactionLog
+{
+public:
+    TransactionLog() = default;
+    TransactionLog(const TransactionLog &src) = delete;
+    TransactionLog(TransactionLog &&src) noexcept = default;
+    TransactionLog &operator=(const TransactionLog &src) = delete;
+    TransactionLog &operator=(TransactionLog &&src) noexcept = default;
+    ~TransactionLog() = default;
+
+private:
+    struct Record {
+        ino_t ino;
+        /**
+         * @brief Counter change which undoes the record; zero marks the
+         * next hook.
+         */
+        std::int64_t undo;
+    };
+
+    std::vector<Record> m_records;
+    std::vector<TransactionHook> m_hooks;
+
+public:
+    /**
+     * @brief Record that @a n locks were taken on @a ino.
+     */
+    inline void record_lock(ino_t ino, std::uint64_t n) {
+        m_records.push_back(Record{ino, -static_cast<std::int64_t>(n)});
+    }
+
+    /**
+     * @brief Record that @a n locks were released from @a ino.
+     */
+    inline void record_release(ino_t ino, std::uint64_t n) {
+        m_records.push_back(Record{ino, static_cast<std::int64_t>(n)});
+    }
+
+    template <typename... T>
+    inline void add_hook(T &&...args) {
+        m_hooks.emplace_back(std::forward<T>(args)...);
+        m_records.push_back(Record{INVALID_INO, 0});
+    }
+
+    /**
+     * @brief Run the stage 1 commit callbacks of all hooks in order.
+     *
+     * Stops at and returns the first error.
+     */
+    [[nodiscard]] Result<void> stage_1_commit();
+
+    /**
+     * @brief Run the stage 2 commit callbacks of all hooks in order.
+     */
+    void stage_2_commit();
+
+    /**
+     * @brief Undo everything recorded, in reverse order.
+     *
+     * First, the stage 1 rollback callbacks of all hooks run; after that the
+     * lock counter changes are reverted and the rollback callbacks of the
+     * hooks are called.
+     */
+    void rollback(InodeReferences &locks);
+
+    /**
+     * @brief Move all records of @a src to the end of this log.
+     *
+     * @a src is cleared, but keeps its capacity.
+     */
+    void append(TransactionLog &src);
+
+    /**
+     * @brief Drop all records without running anything.
+     */
+    void clear();
+
+    [[nodiscard]] inline bool empty() const {
+        return m_records.empty();
+    }
+
+    [[nodiscard]] inline std::size_t size() const {
+        return m_records.size();
+    }
+
+    /**
+     * @brief Number of records the log can hold without allocating.
+     */
+    [[nodiscard]] inline std::size_t capacity() const {
+        return m_records.capacity();
+    }
+
+};
+
+
+/**
+ * @brief Free list of transaction logs.
+ *
+ * Transactions take their log from the pool and return it when they are
+ * destroyed, so that the buffers are reused instead of being allocated for
+ * every transaction.
+ */
+class TransactionLogPool
+{
+public:
+    static constexpr std::size_t DEFAULT_MAX_LOGS = 16;
+
+    /**
+     * @brief Logs which grew beyond this number of records are not kept.
+     */
+    static constexpr std::size_t DEFAULT_MAX_RECORDS = 4096;
+
+public:
+    explicit TransactionLogPool(std::size_t max_logs = DEFAULT_MAX_LOGS,
+                                std::size_t max_records = DEFAULT_MAX_RECORDS);
+
+private:
+    std::mutex m_mutex;
+    std::vector<TransactionLog> m_free;
+    const std::size_t m_max_logs;
+    const std::size_t m_max_records;
+
+public:
+    /**
+     * @brief Take an empty log from the pool or create a new one.
+     */
+    [[nodiscard]] TransactionLog acquire();
+
+    /**
+     * @brief Return a log to the pool.
+     *
+     * Its contents are dropped. Logs without capacity, oversized logs and
+     * logs exceeding the pool size are discarded.
+     */
+    void recycle(TransactionLog &&log);
+
+    [[nodiscard]] std::size_t size();
+
+};
+
+}
+
+#endif
@@ -1 +1,6 @@
-#define FUSE_USE_VERSION 31
+#ifdef DRAGONSTASH_FUSE_LOOP_CFG
+// libfuse 3.12 and later: configurable thread limits of the loop
+#define FUSE_USE_VERSION 312
+#else
+#define FUSE_USE_VERSION 32
+#endif
@@ -25,12 +25,30 @@ authors named in the AUTHORS file.
 #ifndef DRAGONSTASH_FS_H
 #define DRAGONSTASH_FS_H
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "fuse/interface.hpp"
+#include "fuse/notify.hpp"
 #include "dragonstash/backend/base.hpp"
+#include "dragonstash/backend/handle_table.hpp"
 #include "cache/cache.hpp"
+#include "dragonstash/metrics.hpp"
+#include "dragonstash/prefetch.hpp"
+#include "dragonstash/readahead.hpp"
+#include "dragonstash/timeout_policy.hpp"
+#include "dragonstash/trace.hpp"
+#include "dragonstash/worker_pool.hpp"
 
 namespace Dragonstash {
 
@@ -38,22 +56,799 @@ class Filesystem: public Fuse::Interface
 {
 public:
     Filesystem() = delete;
-    explicit Filesystem(Cache &cache, Backend::Filesystem &backend);
+    /**
+     * @param backend_concurrency Number of backend operations which may be
+     *   in flight concurrently when syncing a directory; zero performs them
+     *   sequentially in the request thread.
+     * @param readahead_concurrency Number of prefetches which may be in
+     *   flight concurrently; zero performs them in the request thread.
+     * @param notify_concurrency Number of threads which send invalidation
+     *   notifications to the kernel; zero sends them in the request thread
+     *   right after the reply, which may deadlock with a real kernel.
+     * @param pin_concurrency Number of files which are downloaded
+     *   concurrently because a pin rule matches them; zero downloads them
+     *   in the request thread.
+     */
+    explicit Filesystem(Cache &cache, Backend::Filesystem &backend,
+                        std::size_t backend_concurrency = WorkerPool::DEFAULT_CONCURRENCY,
+                        std::size_t readahead_concurrency = Readahead::DEFAULT_CONCURRENCY,
+                        std::size_t notify_concurrency = 1,
+                        std::size_t pin_concurrency = DEFAULT_PIN_CONCURRENCY);
+
+    /**
+     * @brief Default number of concurrent downloads of pinned files.
+     */
+    static constexpr std::size_t DEFAULT_PIN_CONCURRENCY = 2;
+
+    /**
+     * @brief Default for set_negative_timeout().
+     */
+    static constexpr double DEFAULT_NEGATIVE_TIMEOUT = 1.0;
+
+    /**
+     * @brief Default interval of the background flusher; see
+     * set_write_back().
+     */
+    static constexpr std::chrono::milliseconds DEFAULT_FLUSH_INTERVAL{5000};
+
+    /**
+     * @brief Name of the directory of the control files in the root
+     * directory.
+     *
+     * The directory exists while any control file is enabled. It does not
+     * show up in the listing of the root directory, and a backend entry of
+     * the same name is left out when the root directory is synced.
+     */
+    static constexpr std::string_view CONTROL_DIR_NAME = ".dragonstash";
+
+    /**
+     * @brief Name of the metrics control file in the control directory; see
+     * set_metrics_file().
+     */
+    static constexpr std::string_view METRICS_FILE_NAME = "metrics";
+
+    /**
+     * @brief Inode number of the metrics control file; never allocated by
+     * the cache.
+     */
+    static constexpr fuse_ino_t METRICS_INO = std::numeric_limits<fuse_ino_t>::max();
+
+    /**
+     * @brief Name of the trace control file in the control directory; see
+     * set_tracing().
+     */
+    static constexpr std::string_view TRACE_FILE_NAME = "trace";
+
+    /**
+     * @brief Inode number of the trace control file; never allocated by the
+     * cache.
+     */
+    static constexpr fuse_ino_t TRACE_INO = METRICS_INO - 1;
+
+    /**
+     * @brief Inode number of the control directory; never allocated by the
+     * cache.
+     */
+    static constexpr fuse_ino_t CONTROL_DIR_INO = METRICS_INO - 2;
+
+    ~Filesystem();
+
+    /**
+     * @brief Request handlers whose latency is recorded.
+     */
+    enum class Op {
+        LOOKUP,
+        FORGET,
+        GETATTR,
+        READLINK,
+        OPEN,
+        READ,
+        RELEASE,
+        OPENDIR,
+        READDIR,
+        RELEASEDIR,
+        SETXATTR,
+        SETATTR,
+        WRITE,
+        FSYNC,
+        CREATE,
+        READDIRPLUS,
+        FORGET_MULTI,
+    };
+
+    static constexpr std::size_t OPS = std::size_t(Op::FORGET_MULTI) + 1;
+
+    [[nodiscard]] static const char *op_name(Op op);
+
+    /**
+     * @brief Outcome of a write_back().
+     */
+    struct FlushStats {
+        /**
+         * @brief Files whose changes have been written back completely.
+         */
+        std::size_t files;
+        /**
+         * @brief Files which changed while they were written back; they are
+         * written back again by the next flush.
+         */
+        std::size_t deferred;
+        /**
+         * @brief Files which could not be written back.
+         */
+        std::size_t failed;
+        /**
+         * @brief Bytes written to the backend.
+         */
+        std::uint64_t bytes;
+        /**
+         * @brief Error of the first file which could not be written back.
+         */
+        int error;
+    };
 
 private:
     Cache &m_cache;
     Backend::Filesystem &m_backend_fs;
+    WorkerPool m_backend_pool;
+    Backend::HandleTable m_backend_dirs;
+    Readahead::Config m_readahead_config;
+    WorkerPool m_readahead_pool;
+    double m_negative_timeout;
+    bool m_dir_change_detection;
+    TimeoutPolicy m_timeouts;
+    Fuse::Notifier m_notifier;
+    WorkerPool m_notify_pool;
+    TaskGroup m_notifications;
+
+    /**
+     * @brief Pin rules of the cache, as of m_pin_generation.
+     */
+    std::shared_mutex m_pin_policy_mutex;
+    std::shared_ptr<const PinPolicy> m_pin_policy;
+    std::uint64_t m_pin_generation;
+
+    /**
+     * @brief Inodes whose download has been scheduled and not finished.
+     */
+    std::mutex m_pins_mutex;
+    std::unordered_set<ino_t> m_pins_in_flight;
+
+    WorkerPool m_pin_pool;
+    TaskGroup m_pin_tasks;
+
+    /**
+     * @brief When lookups last found the cached inodes up-to-date on the
+     * backend.
+     *
+     * Entries are dropped when the kernel forgets the inode, so an inode
+     * which is looked up again after that is revalidated right away.
+     */
+    std::mutex m_validated_mutex;
+    std::unordered_map<ino_t, std::chrono::steady_clock::time_point> m_validated;
+    std::unordered_set<ino_t> m_refreshes_in_flight;
+
+    /**
+     * @brief Background revalidations, run on the backend worker pool.
+     */
+    TaskGroup m_refresh_tasks;
+
+    /**
+     * @brief Prefetches started through PREFETCH_XATTR; they run one after
+     * the other, each with its own parallelism.
+     */
+    WorkerPool m_prefetch_pool;
+    TaskGroup m_prefetch_tasks;
+
+    /**
+     * @brief Whether writes are absorbed by the cache; see set_write_back().
+     */
+    bool m_write_back;
+
+    static constexpr std::size_t JOURNAL_LOCK_SHARDS = 64;
+
+    /**
+     * @brief Serialise changes to journaled files with the completion of
+     * their write-back; see journal_mutex().
+     */
+    std::array<std::mutex, JOURNAL_LOCK_SHARDS> m_journal_mutexes;
+
+    /**
+     * @brief Held while write_back() runs.
+     */
+    std::mutex m_flush_mutex;
+
+    std::mutex m_flusher_mutex;
+    std::condition_variable m_flusher_wakeup;
+    bool m_flusher_stop;
+    std::chrono::milliseconds m_flush_interval;
+    std::thread m_flusher;
+
+    /**
+     * @brief Time from the start of a request until its reply, per handler.
+     */
+    std::array<Metrics::Histogram, OPS> m_op_latency;
+
+    /**
+     * @brief Outcomes of lookups: answered from the cache alone, confirmed
+     * by the backend, or changed by what the backend said.
+     */
+    Metrics::Counter m_lookup_hits;
+    Metrics::Counter m_lookup_revalidated;
+    Metrics::Counter m_lookup_misses;
+
+    /**
+     * @brief Bytes read through the file system, by where they came from.
+     */
+    Metrics::Counter m_read_cached_bytes;
+    Metrics::Counter m_read_fetched_bytes;
+
+    /**
+     * @brief Connected opendir calls which found the backend directory
+     * unchanged and skipped the resync.
+     */
+    Metrics::Counter m_opendir_unchanged;
+
+    /**
+     * @brief Outcomes of prefetches started through PREFETCH_XATTR.
+     */
+    Metrics::Counter m_prefetch_directories;
+    Metrics::Counter m_prefetch_files;
+    Metrics::Counter m_prefetch_errors;
+
+    Metrics::Registry m_metrics;
+    bool m_metrics_file;
+
+    Trace::Recorder m_tracer;
+
+    [[nodiscard]] inline Metrics::Histogram &op_latency(Op op) {
+        return m_op_latency[std::size_t(op)];
+    }
+
+    /**
+     * @brief Start measuring and, if it is picked, tracing a request.
+     *
+     * The returned scope makes the trace current on the calling thread
+     * while the handler runs.
+     */
+    [[nodiscard]] Trace::Scope begin_request(Fuse::Request &req, Op op);
+
+    /**
+     * @brief Whether @a ino is the control directory or a control file;
+     * these hold no references in the cache.
+     */
+    [[nodiscard]] static inline bool is_control_inode(fuse_ino_t ino) {
+        return ino >= CONTROL_DIR_INO;
+    }
+
+    [[nodiscard]] static inline bool is_control_file(fuse_ino_t ino) {
+        return ino >= TRACE_INO;
+    }
+
+    /**
+     * @brief Whether the control directory exists, i.e. whether any control
+     * file is enabled.
+     */
+    [[nodiscard]] bool has_control_dir() const;
+
+    /**
+     * @brief Whether @a name in the directory @a parent is the control
+     * directory, which hides the backend entry of the same name.
+     */
+    [[nodiscard]] bool is_control_dir(ino_t parent, std::string_view name) const;
+
+    /**
+     * @brief Inode number of the enabled control file named @a name in the
+     * control directory, or zero.
+     */
+    [[nodiscard]] fuse_ino_t control_file(std::string_view name) const;
+
+    /**
+     * @brief Attributes of the control directory or a control file.
+     */
+    [[nodiscard]] struct stat control_file_stat(fuse_ino_t ino) const;
+
+    void open_control_file(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi);
+
+    /**
+     * @brief Reply to a readdir or readdirplus of the control directory.
+     *
+     * The offset of an entry is its index plus one.
+     */
+    void read_control_dir(Fuse::Request &req, size_t size, off_t off, bool plus);
+
+    /**
+     * @brief A kernel cache entry which is out of date.
+     *
+     * Refers to the dentry @a name in the directory @a ino if a name is set,
+     * and to the attributes of @a ino otherwise. If @a data is set, the
+     * cached data of @a ino is dropped, too.
+     */
+    struct Invalidation {
+        fuse_ino_t ino;
+        std::string name;
+        bool data;
+    };
+
+    /**
+     * @brief Send invalidations to the kernel, if a notifier is set.
+     *
+     * Must only be called once the request which found the changes has been
+     * replied to.
+     *
+     * This never blocks: the kernel may not have released the locks of the
+     * request yet, and the notification thread may be waiting for exactly
+     * those locks. The notification queue is unbounded for that reason.
+     */
+    void notify(std::vector<Invalidation> &&invalidations);
+
+    /**
+     * @brief Seconds since @a ino was last found up-to-date on the backend,
+     * or infinity if this is not known.
+     */
+    double validation_age(ino_t ino);
+
+    void mark_validated(ino_t ino);
+
+    /**
+     * @brief Revalidate the cached entry @a name in @a parent in the
+     * background, unless this is already in progress.
+     *
+     * If the backend reports a change, the cache is updated and the kernel
+     * cache entries are invalidated.
+     */
+    void schedule_refresh(ino_t parent, std::string_view name, ino_t ino);
+
+    void refresh_entry(ino_t parent, const std::string &name, ino_t ino);
+
+    /**
+     * @brief A lookup which waits for the backend.
+     */
+    struct PendingLookup {
+        Fuse::Request req;
+        ino_t parent;
+        std::string name;
+        std::shared_ptr<const PinPolicy> pins;
+        struct fuse_entry_param e;
+    };
+
+    /**
+     * @brief Reconcile the cache with the backend result of a lookup and
+     * reply to it.
+     */
+    void finish_lookup(PendingLookup &lookup, Result<Backend::Stat> &&stat_result);
+
+    /**
+     * @brief Timeout rule for an inode, or for the entry @a name in it.
+     */
+    const TimeoutPolicy::Rule &timeout_rule(CacheTransactionRO &txn,
+                                            ino_t ino,
+                                            std::string_view name = std::string_view());
 
     Result<std::string> get_backend_path(CacheTransactionRO &txn, ino_t ino);
 
+    /**
+     * @brief Obtain a backend handle on a cached directory.
+     *
+     * Handles are kept in an LRU table keyed by the cache inode; on a miss,
+     * the directory is opened by its path. Handles from the table which have
+     * not been checked for longer than the attribute timeout of the
+     * directory are revalidated first, see revalidate_backend_dir().
+     *
+     * @param from_table Set to true if the handle came from the table.
+     */
+    Result<Backend::HandleTable::HandlePtr> backend_dir(CacheTransactionRO &txn,
+                                                        ino_t ino,
+                                                        bool &from_table);
+
+    /**
+     * @brief Check that a handle from the table still refers to the
+     * directory at the path of @a ino on the backend.
+     *
+     * A handle which keeps the directory open follows it when it is renamed
+     * on the backend, so that operations on it would silently go to the
+     * wrong directory. If the handle is not current or cannot be checked,
+     * it is dropped from the table.
+     *
+     * @return @a handle if it is current, nullptr otherwise.
+     */
+    Backend::HandleTable::HandlePtr revalidate_backend_dir(
+            ino_t ino, Backend::HandleTable::HandlePtr handle);
+
+    /**
+     * @brief Run an operation relative to a backend directory.
+     *
+     * If the operation fails with ENOENT or ESTALE on a handle from the
+     * table, the directory may have been removed or replaced on the backend
+     * since it was opened. In that case, the handle is re-opened and the
+     * operation is retried once.
+     */
+    template <typename F>
+    auto with_backend_dir(CacheTransactionRO &txn, ino_t ino, F &&op)
+            -> decltype(op(std::declval<Backend::DirectoryHandle&>()));
+
+    /**
+     * @brief Asynchronous lstat of an entry, with the retry of
+     * with_backend_dir().
+     *
+     * @a txn is ended before the backend is asked, so that no snapshot is
+     * held while the request is in flight. @a done may run on a backend
+     * thread.
+     */
+    void lstat_backend_async(CacheTransactionRO &txn, ino_t dir,
+                             std::string_view name,
+                             Backend::Completion<Backend::Stat> &&done);
+
+    /**
+     * @brief Replace the cached contents of a directory with the backend
+     * contents.
+     *
+     * Entries which the backend returns complete are used as-is; all others
+     * are stat-ed through the backend worker pool while the directory is
+     * still being read. The cache write transaction is only taken once all
+     * results are in.
+     *
+     * If a notifier is set, kernel cache entries which the sync found to be
+     * out of date are added to @a invalidations.
+     *
+     * @a stamp is the backend metadata of the directory from before it was
+     * read; it is recorded with the listing if it is safe to compare
+     * against later. See dir_unchanged().
+     */
+    Result<void> sync_dir(ino_t ino, const std::string &backend_path,
+                          Backend::Dir &dir,
+                          std::vector<Invalidation> &invalidations,
+                          const std::optional<DirSyncStamp> &stamp = std::nullopt);
+
+    /**
+     * @brief Check whether the cached listing of a directory is still
+     * current, going by the backend metadata of the directory.
+     *
+     * Returns false if change detection is disabled. Otherwise, @a stamp
+     * receives the current metadata when the backend could be asked, for
+     * passing to sync_dir().
+     */
+    bool dir_unchanged(ino_t ino, const std::string &backend_path,
+                       std::optional<DirSyncStamp> &stamp);
+
+    /**
+     * @brief State of a regular file opened through open() or create().
+     *
+     * The backend file is null if the backend was not connected when the
+     * file was opened, or if the file only exists in the cache; only cached
+     * data can be read then.
+     *
+     * The size grows with writes through the file.
+     */
+    struct OpenFile {
+        std::shared_ptr<RegularFileHandle> content;
+        std::shared_ptr<Backend::File> backend;
+        std::atomic<std::uint64_t> size;
+        std::uint64_t generation;
+        std::shared_ptr<Readahead> readahead;
+        bool writable;
+    };
+
+    /**
+     * @brief Lock which serialises the changes of a file with the completion
+     * of its write-back.
+     *
+     * Held from the change of the cached contents until it has been
+     * journaled, so that write_back() never settles data which has not been
+     * written back. Files share the locks by inode number, so that changes
+     * of different files mostly go through group commit together.
+     */
+    [[nodiscard]] inline std::mutex &journal_mutex(ino_t ino)
+    {
+        return m_journal_mutexes[ino % JOURNAL_LOCK_SHARDS];
+    }
+
+    /**
+     * @brief Make sure that a block of a file is cached, fetching it from
+     * the backend if needed.
+     *
+     * This is needed before a block is modified partially. If @a backend is
+     * null, the backend file is opened by its path and stored there.
+     *
+     * @param size Size of the file as known to the cache.
+     */
+    Result<void> fill_block(ino_t ino, const std::shared_ptr<RegularFileHandle> &content,
+                            std::shared_ptr<Backend::File> &backend,
+                            std::uint64_t block, std::uint64_t size);
+
+    /**
+     * @brief Open the backend file of a cached inode by its name in the
+     * cached parent directory.
+     */
+    Result<std::unique_ptr<Backend::File>> open_backend_file(ino_t ino, int flags,
+                                                             mode_t mode);
+
+    /**
+     * @brief Write the journaled changes of a regular file to the backend.
+     *
+     * @param completed Set to true if the journal of the file is empty
+     *   afterwards, false if it changed while it was written back.
+     * @return The number of bytes written to the backend.
+     */
+    Result<std::uint64_t> flush_file(ino_t ino, bool &completed);
+
+    /**
+     * @brief Body of the background flusher thread.
+     */
+    void run_flusher();
+
+    void stop_flusher();
+
+    /**
+     * @brief Prefetch a range into the cache in the background.
+     *
+     * The data is marked as READAHEAD and promoted to READ when it is read.
+     */
+    void start_readahead(OpenFile &file, const Readahead::Range &range);
+
+    /**
+     * @brief Read from an open file, going to the backend for blocks which
+     * are not cached.
+     *
+     * Cached ranges are served from the content store without touching the
+     * backend. Misses are fetched in whole blocks, stored in the cache and
+     * marked as READ.
+     *
+     * @return The number of bytes read; this is short only at the end of the
+     *   file.
+     */
+    Result<std::size_t> read_file(OpenFile &file, char *buf, std::size_t size,
+                                  off_t off);
+
+    /**
+     * @brief Sync a directory from the backend for prefetch().
+     */
+    Result<void> prefetch_dir(ino_t ino, const std::string &backend_path);
+
+    /**
+     * @brief Download the complete contents of a regular file as PINNED.
+     *
+     * Blocks which are cached already are re-marked without asking the
+     * backend.
+     *
+     * @return The number of bytes downloaded from the backend.
+     */
+    Result<std::uint64_t> pull_file(ino_t ino, const std::string &backend_path);
+
+    /**
+     * @brief Current pin rules of the cache.
+     *
+     * If the rules have changed since they were last read, they are
+     * reloaded. Contents of rules which have been removed are unpinned in
+     * the background.
+     */
+    std::shared_ptr<const PinPolicy> pin_policy(CacheTransactionRO &txn);
+
+    /**
+     * @brief Download a regular file in the background, unless this is
+     * already in progress or the file is pinned completely.
+     */
+    void schedule_pin(ino_t ino, std::string &&path, std::uint64_t size);
+
+    /**
+     * @brief Apply the pin rules to an entry which has been looked up.
+     */
+    void pin_entry(const PinPolicy &policy, ino_t parent, std::string_view name,
+                   const struct fuse_entry_param &e);
+
+    /**
+     * @brief Apply the pin rules to the regular files in a directory.
+     *
+     * @param dir_path Path of the directory as returned by
+     *   CacheTransactionRO::path().
+     */
+    void pin_dir(const PinPolicy &policy, ino_t dir, const std::string &dir_path);
+
+public:
+    /**
+     * @brief Configure readahead for files opened from now on.
+     */
+    void set_readahead_config(const Readahead::Config &config);
+
+    /**
+     * @brief Configure how long names reported missing by the backend are
+     * remembered, in seconds.
+     *
+     * Such names are answered with a negative entry until the time is up,
+     * without asking the backend again, and the kernel is told to cache
+     * them for the same time. Zero disables negative caching.
+     */
+    void set_negative_timeout(double seconds);
+
+    /**
+     * @brief Configure whether opendir trusts the cached listing of a
+     * directory whose backend mtime, ctime and inode number are the same
+     * as when it was last synced.
+     *
+     * Such directories are not read from the backend again. Backends which
+     * do not update the timestamps of a directory when its entries change
+     * must not be used with this.
+     *
+     * Changing a file in place does not touch its directory, so that the
+     * attributes of the entries are then only refreshed by lookup. Until
+     * the kernel looks an entry up again, getattr and readdirplus hand out
+     * the attributes cached before the change. Disabled by default.
+     */
+    void set_dir_change_detection(bool enabled);
+
+    /**
+     * @brief Configure the timeouts handed to the kernel and when lookups
+     * revalidate cached entries with the backend.
+     *
+     * Must not be called while requests are being processed.
+     */
+    void set_timeout_policy(const TimeoutPolicy &policy);
+
+    /**
+     * @brief Set the notifier used to evict kernel cache entries when
+     * changes on the backend are discovered.
+     *
+     * With a notifier, the dentries and attributes cached by the kernel are
+     * kept coherent with the backend even with long timeouts, as far as
+     * lookups and opendir find out about changes.
+     *
+     * Waits for the notifications queued for the previous notifier. Must not
+     * be called while requests are being processed.
+     */
+    void set_notifier(const Fuse::Notifier &notifier);
+
+    /**
+     * @brief Populate the cache with a subtree of the backend.
+     *
+     * The directories below @a path are synced level by level, with up to
+     * PrefetchOptions::concurrency directories in flight at the same time;
+     * the entries of each directory are stat-ed through the backend worker
+     * pool and written in one transaction, as with opendir().
+     *
+     * Failures below the start directory are counted in the stats and do
+     * not stop the prefetch.
+     *
+     * @param path Backend path of the start directory.
+     *
+     * Error codes:
+     *
+     * - ENOENT: The start directory does not exist.
+     * - ENOTDIR: The start is not a directory.
+     * - EINVAL: The path contains `..`.
+     * - Errors of the backend when syncing the start directory.
+     */
+    [[nodiscard]] Result<PrefetchStats> prefetch(std::string_view path,
+                                                 const PrefetchOptions &options);
+
+    /**
+     * @brief Absorb writes into the cache and write them back to the backend
+     * in the background.
+     *
+     * When enabled, files can be opened for writing and created, and their
+     * size and times can be changed. Changes are made to the cache right
+     * away, as WRITTEN blocks, and recorded in the journal of the cache;
+     * they are visible through the file system at once, whether the backend
+     * is connected or not. Every @a flush_interval, write_back() is called to
+     * write the journaled changes back. Zero disables the background
+     * flusher; write_back() must be called explicitly then.
+     *
+     * Only contents and sizes are written back. Times which are set are kept
+     * in the cache until the backend reports its own after a write-back.
+     *
+     * Must not be called while requests are being processed.
+     */
+    void set_write_back(bool enabled,
+                        std::chrono::milliseconds flush_interval = DEFAULT_FLUSH_INTERVAL);
+
+    /**
+     * @brief Write the journaled changes back to the backend.
+     *
+     * Files are written back through the backend worker pool; adjacent and
+     * overlapping writes have been merged by the journal already, so each
+     * file takes one write per contiguous range. A file which is changed
+     * while it is written back stays journaled and is written back again by
+     * the next flush.
+     *
+     * A file created in the cache is not written back if a file of the same
+     * name has appeared on the backend in the meantime; it fails with EEXIST
+     * and stays journaled.
+     */
+    FlushStats write_back();
+
+    /**
+     * @brief Block until the downloads scheduled because of pin rules have
+     * completed.
+     *
+     * Files which match a pin rule are downloaded in the background when
+     * they are looked up or their directory is opened. The contents are
+     * stored as PINNED, so that they are never evicted.
+     */
+    void wait_pinned();
+
+    /**
+     * @brief Block until the background revalidations of lookups have
+     * completed.
+     *
+     * With TimeoutPolicy::Rule::hard_ttl set, lookups of entries which
+     * have been found up-to-date recently are answered from the cache and
+     * revalidated afterwards.
+     */
+    void wait_revalidated();
+
+    /**
+     * @brief Block until the prefetches started by setting PREFETCH_XATTR
+     * have completed.
+     *
+     * The attribute is set as soon as the prefetch has been scheduled: the
+     * kernel holds the lock of the directory for the duration of the
+     * request, and the prefetch needs to invalidate entries in it.
+     */
+    void wait_prefetched();
+
+    /**
+     * @brief Metrics of the file system, including those of the cache.
+     *
+     * Further components, e.g. the backend, can be added to the registry;
+     * it is rendered when the metrics control file is opened.
+     */
+    [[nodiscard]] inline Metrics::Registry &metrics() {
+        return m_metrics;
+    }
+
+    /**
+     * @brief Write the request latencies and hit counters.
+     */
+    void collect_metrics(Metrics::TextWriter &out) const;
+
+    /**
+     * @brief Expose the metrics as a read-only file in the control
+     * directory.
+     *
+     * The file is named METRICS_FILE_NAME; see CONTROL_DIR_NAME. Each open
+     * takes a snapshot of metrics() in the Prometheus text format.
+     *
+     * Must not be called while requests are being processed.
+     */
+    void set_metrics_file(bool enabled);
+
+    /**
+     * @brief Traces of requests, with the time spent in their phases.
+     */
+    [[nodiscard]] inline Trace::Recorder &tracer() {
+        return m_tracer;
+    }
+
+    /**
+     * @brief Trace sampled or slow requests and expose the traces as a
+     * read-only file in the control directory.
+     *
+     * The file is named TRACE_FILE_NAME and exists while tracing is
+     * enabled; see CONTROL_DIR_NAME. Each open takes a snapshot of the kept
+     * traces in the Chrome trace event format. Without DRAGONSTASH_TRACING,
+     * nothing is traced.
+     *
+     * @see Trace::Recorder::configure
+     */
+    void set_tracing(std::uint64_t sample_every, Trace::Clock::duration threshold);
+
 public:
+    void init(struct fuse_conn_info *conn);
     void lookup(Fuse::Request &&req, fuse_ino_t parent, std::string_view name);
     void forget(Fuse::Request &&req, fuse_ino_t ino, uint64_t nlookup);
     void getattr(Fuse::Request &&req, fuse_ino_t ino, struct fuse_file_info *fi);
     void readlink(Fuse::Request &&req, fuse_ino_t ino);
+    void open(Fuse::Request &&req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void read(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+    void release(Fuse::Request &&req, fuse_ino_t ino, struct fuse_file_info *fi);
     void opendir(Fuse::Request &&req, fuse_ino_t ino, struct fuse_file_info *fi);
     void readdir(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
     void releasedir(Fuse::Request &&req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void setxattr(Fuse::Request &&req, fuse_ino_t ino, std::string_view name, std::string_view value, int flags);
+    void setattr(Fuse::Request &&req, fuse_ino_t ino, struct stat &attr, int to_set, struct fuse_file_info *fi);
+    void write(Fuse::Request &&req, fuse_ino_t ino, std::string_view buf, off_t off, struct fuse_file_info *fi);
+    void write_buf(Fuse::Request &&req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi);
+    void fsync(Fuse::Request &&req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+    void create(Fuse::Request &&req, fuse_ino_t parent, std::string_view name, mode_t mode, struct fuse_file_info *fi);
     void readdirplus(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
     void forget_multi(Fuse::Request &&req, size_t count, struct fuse_forget_data *forgets);
     /* void forget(Fuse::Request &&req, fuse_ino_t ino, uint64_t nlookup); */
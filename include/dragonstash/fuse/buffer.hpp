@@ -25,8 +25,11 @@ authors named in the AUTHORS file.
 #ifndef DRAGONSTASH_FUSE_BUFFER_H
 #define DRAGONSTASH_FUSE_BUFFER_H
 
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <string>
+#include <string_view>
 
 struct fuse_entry_param;
 struct stat;
@@ -35,66 +38,149 @@ namespace Fuse {
 
 class Request;
 
-class DirBuffer {
+/**
+ * @brief Storage for directory listing replies.
+ *
+ * The storage is borrowed from a per-thread spare buffer and returned to it
+ * on destruction, so that consecutive replies on the same thread reuse the
+ * same allocation. If the spare buffer is already in use (e.g. by another
+ * buffer on the same thread), a fresh one is used.
+ */
+class ReplyBuffer {
+public:
+    /**
+     * @brief Spare buffers which grew beyond this size are not kept.
+     */
+    static constexpr std::size_t MAX_RETAINED_SIZE = 1024*1024;
+
+protected:
+    /**
+     * @param limit Maximum length of the reply in bytes, as requested by the
+     *   kernel. The storage is sized to it up front. Zero means no limit; the
+     *   storage grows as needed then.
+     */
+    explicit ReplyBuffer(std::size_t limit);
+    ReplyBuffer(const ReplyBuffer &src) = delete;
+    ReplyBuffer(ReplyBuffer &&src) = delete;
+    ReplyBuffer &operator=(const ReplyBuffer &src) = delete;
+    ReplyBuffer &operator=(ReplyBuffer &&src) = delete;
+    ~ReplyBuffer();
+
 private:
-    std::basic_string<char> m_buf;
+    std::string m_buf;
+    std::size_t m_length;
+    const std::size_t m_limit;
+
+    /**
+     * @brief Scratch space to NUL-terminate names for libfuse.
+     */
+    std::array<char, 256> m_name;
+    std::string m_long_name;
+
+protected:
+    /**
+     * @brief Return a NUL-terminated copy of @a name.
+     *
+     * The copy is valid until the next call.
+     */
+    const char *terminate(std::string_view name);
+
+protected:
+    /**
+     * @brief Append an entry written by @a write.
+     *
+     * @a write is called with the free space and its size and must return
+     * the size of the entry; if that exceeds the free space, it must not
+     * have written anything (which is the contract of fuse_add_direntry()).
+     *
+     * @return false if the entry does not fit into the limit; nothing is
+     *   appended then.
+     */
+    template <typename F>
+    bool append(F &&write)
+    {
+        while (true) {
+            // the storage may be larger than the limit when it is reused
+            const std::size_t end = m_limit > 0 ? std::min(m_limit, m_buf.size()) : m_buf.size();
+            const std::size_t avail = end - m_length;
+            const std::size_t entry_size = write(&m_buf[m_length], avail);
+            if (entry_size <= avail) {
+                m_length += entry_size;
+                return true;
+            }
+            if (m_limit > 0 && m_length + entry_size > m_limit) {
+                return false;
+            }
+            grow(m_length + entry_size);
+        }
+    }
 
-    size_t prepare_add(Request &req, const char *name);
+    void grow(std::size_t min_size);
 
 public:
-    void add(Request &req,
-             const char *name,
-             const struct stat &stbuf,
-             off_t off);
-    void add(Request &req,
-             const char *name,
-             const struct stat &stbuf);
-
-    [[nodiscard]] inline const std::basic_string<char> &get() const {
-        return m_buf;
+    [[nodiscard]] inline std::string_view get() const {
+        return std::string_view(m_buf.data(), m_length);
     }
 
     [[nodiscard]] inline std::size_t length() const {
-        return m_buf.size();
+        return m_length;
     }
-};
 
+    [[nodiscard]] inline std::size_t limit() const {
+        return m_limit;
+    }
 
-class DirBufferPlus {
-private:
-    std::basic_string<char> m_buf;
+    inline void rewind(std::size_t offs) {
+        if (m_length > offs) {
+            m_length = offs;
+        }
+    }
+};
 
-    size_t prepare_add(Request &req,
-                       const char *name,
-                       const fuse_entry_param &e);
-    void execute_add(Request &req,
-                     size_t old_size,
-                     const char *name,
-                     const fuse_entry_param &e,
-                     off_t off);
 
+class DirBuffer: public ReplyBuffer {
 public:
-    void add(Request &req,
-             const char *name,
-             const fuse_entry_param &e,
+    /**
+     * @copydoc ReplyBuffer::ReplyBuffer
+     */
+    explicit DirBuffer(std::size_t limit = 0);
+
+public:
+    /**
+     * @brief Append a directory entry.
+     *
+     * @return false if the entry does not fit into the limit.
+     */
+    bool add(Request &req,
+             std::string_view name,
+             const struct stat &stbuf,
              off_t off);
-    void add(Request &req,
-             const char *name,
-             const fuse_entry_param &e);
+    bool add(Request &req,
+             std::string_view name,
+             const struct stat &stbuf);
+};
 
-    [[nodiscard]] inline const std::basic_string<char> &get() const {
-        return m_buf;
-    }
 
-    [[nodiscard]] inline std::size_t length() const {
-        return m_buf.size();
-    }
+class DirBufferPlus: public ReplyBuffer {
+public:
+    /**
+     * @copydoc ReplyBuffer::ReplyBuffer
+     */
+    explicit DirBufferPlus(std::size_t limit = 0);
 
-    inline void rewind(std::size_t offs) {
-        if (m_buf.size() > offs) {
-            m_buf.resize(offs);
-        }
-    }
+public:
+    /**
+     * @brief Append a directory entry with attributes.
+     *
+     * @return false if the entry does not fit into the limit.
+     */
+    bool add(Request &req,
+             std::string_view name,
+             const fuse_entry_param &e,
+             off_t off);
+    bool add(Request &req,
+             std::string_view name,
+             const fuse_entry_param &e);
 };
 
 }
@@ -28,6 +28,7 @@ authors named in the AUTHORS file.
 #include "dragonstash/dragonstash-config.h"
 #include <fuse_lowlevel.h>
 
+#include <cerrno>
 #include <stdexcept>
 
 #include "dragonstash/fuse/request.hpp"
@@ -40,6 +41,30 @@ namespace Fuse {
     impl->func(std::move(request_handle), __VA_ARGS__); \
     } while (0)
 
+/**
+ * @brief Thread limits of the multi-threaded request loop.
+ */
+struct LoopConfig {
+    /**
+     * @brief Read requests through a cloned /dev/fuse descriptor per
+     * thread.
+     */
+    bool clone_fd = true;
+
+    /**
+     * @brief Number of idle threads which are kept around instead of being
+     * ended; the libfuse default is 10.
+     */
+    unsigned max_idle_threads = 10;
+
+    /**
+     * @brief Maximum number of threads; zero keeps the libfuse default.
+     *
+     * Only honoured with libfuse 3.12 and later.
+     */
+    unsigned max_threads = 0;
+};
+
 template <typename Impl>
 class Session {
 public:
@@ -291,6 +316,13 @@ private:
     }
 
 public:
+    /**
+     * @brief The underlying libfuse session, e.g. to send notifications.
+     */
+    inline struct fuse_session *operator*() const {
+        return m_session;
+    }
+
     inline int mount(const char *mountpoint) {
         return fuse_session_mount(m_session, mountpoint);
     }
@@ -299,8 +331,26 @@ public:
         return fuse_session_loop(m_session);
     }
 
-    inline int loop_mt(bool clone_fds) {
-        return fuse_session_loop_mt(m_session, clone_fds);
+    inline int loop_mt(const LoopConfig &config) {
+#ifdef DRAGONSTASH_FUSE_LOOP_CFG
+        struct fuse_loop_config *cfg = fuse_loop_cfg_create();
+        if (!cfg) {
+            return -ENOMEM;
+        }
+        fuse_loop_cfg_set_clone_fd(cfg, config.clone_fd);
+        fuse_loop_cfg_set_idle_threads(cfg, config.max_idle_threads);
+        if (config.max_threads > 0) {
+            fuse_loop_cfg_set_max_threads(cfg, config.max_threads);
+        }
+        const int result = fuse_session_loop_mt(m_session, cfg);
+        fuse_loop_cfg_destroy(cfg);
+        return result;
+#else
+        struct fuse_loop_config cfg{};
+        cfg.clone_fd = config.clone_fd;
+        cfg.max_idle_threads = config.max_idle_threads;
+        return fuse_session_loop_mt(m_session, &cfg);
+#endif
     }
 
     inline void unmount() {
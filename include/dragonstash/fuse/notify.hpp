@@ -0,0 +1,84 @@
+/**********************************************************************
+File name: notify.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_FUSE_NOTIFY_H
+#define DRAGONSTASH_FUSE_NOTIFY_H
+
+#include "dragonstash/dragonstash-config.h"
+#include <fuse_lowlevel.h>
+
+#include <string_view>
+
+namespace Fuse {
+
+struct NotifyBackend {
+    int (*inval_inode)(struct fuse_session*, fuse_ino_t, off_t, off_t);
+    int (*inval_entry)(struct fuse_session*, fuse_ino_t, const char*, size_t);
+};
+
+extern NotifyBackend notify_backend;
+
+/**
+ * @brief Send cache invalidation notifications to the kernel.
+ *
+ * A default-constructed notifier is not attached to a session and drops all
+ * notifications.
+ *
+ * @note The kernel takes the locks of the affected inodes to process a
+ * notification. Notifications must thus not be sent from the execution path
+ * of a request which may hold such a lock, i.e. not before the request has
+ * been replied to.
+ */
+class Notifier {
+public:
+    Notifier();
+    explicit Notifier(struct fuse_session *session);
+
+private:
+    struct fuse_session *m_session;
+
+public:
+    inline operator bool() const {
+        return m_session != nullptr;
+    }
+
+    /**
+     * @brief Invalidate the cached attributes and data of an inode.
+     *
+     * @param off Start of the data to drop; negative to only drop the
+     *   attributes.
+     * @param len Amount of data to drop; zero drops everything from @a off.
+     */
+    int inval_inode(fuse_ino_t ino, off_t off = 0, off_t len = 0);
+
+    /**
+     * @brief Invalidate the kernel dentry of a name, positive or negative.
+     */
+    int inval_entry(fuse_ino_t parent, std::string_view name);
+
+};
+
+}
+
+#endif
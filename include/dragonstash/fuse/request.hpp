@@ -32,7 +32,17 @@ authors named in the AUTHORS file.
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <memory>
+#include <utility>
+
+namespace Dragonstash::Metrics {
+class Histogram;
+}
+
+namespace Dragonstash::Trace {
+class Context;
+}
 
 namespace Fuse {
 
@@ -84,6 +94,15 @@ public:
 private:
     fuse_req_t m_req;
     int m_default_error;
+    Dragonstash::Metrics::Histogram *m_latency;
+    std::chrono::steady_clock::time_point m_started;
+#ifdef DRAGONSTASH_TRACING
+    std::shared_ptr<Dragonstash::Trace::Context> m_trace;
+
+    void finish_trace();
+#endif
+
+    void record_latency();
 
 protected:
     void reset();
@@ -104,15 +123,50 @@ public:
     inline fuse_req_t release() {
         fuse_req_t result = m_req;
         m_req = nullptr;
+        if (m_latency) {
+            record_latency();
+        }
+#ifdef DRAGONSTASH_TRACING
+        if (m_trace) {
+            finish_trace();
+        }
+#endif
         return result;
     }
 
     inline void swap(Request &other) {
-        fuse_req_t tmp = m_req;
-        m_req = other.m_req;
-        other.m_req = tmp;
+        std::swap(m_req, other.m_req);
+        std::swap(m_default_error, other.m_default_error);
+        std::swap(m_latency, other.m_latency);
+        std::swap(m_started, other.m_started);
+#ifdef DRAGONSTASH_TRACING
+        std::swap(m_trace, other.m_trace);
+#endif
+    }
+
+    /**
+     * @brief Record the time from now until the request is replied to in
+     * @a histogram.
+     */
+    inline void measure(Dragonstash::Metrics::Histogram &histogram) {
+        m_latency = &histogram;
+        m_started = std::chrono::steady_clock::now();
+    }
+
+#ifdef DRAGONSTASH_TRACING
+    /**
+     * @brief Attach a trace which is finished when the request is replied
+     * to.
+     */
+    inline void trace(std::shared_ptr<Dragonstash::Trace::Context> context) {
+        m_trace = std::move(context);
     }
 
+    [[nodiscard]] inline const std::shared_ptr<Dragonstash::Trace::Context> &trace() const {
+        return m_trace;
+    }
+#endif
+
     inline fuse_req_t operator*() const {
         return m_req;
     }
@@ -204,6 +258,24 @@ public: /* REPLY FUNCTIONS */
         return backend.reply_data(release(), bufv, flags);
     }
 
+    /**
+     * @brief Reply with a range of a file, passed by file descriptor.
+     *
+     * This allows libfuse to splice the data into the device without copying
+     * it through userspace, if splicing has been negotiated in init. The
+     * range must stay valid until this returns.
+     */
+    inline int reply_fd(int fd, off_t pos, size_t size,
+                        enum fuse_buf_copy_flags flags = FUSE_BUF_SPLICE_MOVE) {
+        struct fuse_bufvec bufv{};
+        bufv.count = 1;
+        bufv.buf[0].size = size;
+        bufv.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufv.buf[0].fd = fd;
+        bufv.buf[0].pos = pos;
+        return reply_data(&bufv, flags);
+    }
+
     inline int reply_iov(const iovec *iov, int count) {
         check();
         return backend.reply_iov(release(), iov, count);
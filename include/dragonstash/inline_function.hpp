@@ -0,0 +1,155 @@
+/**********************************************************************
+File name: inline_function.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_INLINE_FUNCTION_H
+#define DRAGONSTASH_INLINE_FUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Dragonstash {
+
+template <typename Signature, std::size_t Capacity>
+class InlineFunction;
+
+/**
+ * @brief Move-only callable wrapper which never allocates.
+ *
+ * The callable is stored in a buffer of @a Capacity bytes inside the wrapper.
+ * Callables which do not fit or cannot be moved without throwing are rejected
+ * at compile time; capture by reference or use std::function instead.
+ */
+template <typename R, typename... Args, std::size_t Capacity>
+class InlineFunction<R(Args...), Capacity>
+{
+public:
+    static constexpr std::size_t capacity = Capacity;
+
+public:
+    InlineFunction() noexcept = default;
+
+    InlineFunction(std::nullptr_t) noexcept
+    {
+
+    }
+
+    template <typename F,
+              typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InlineFunction>>>
+    InlineFunction(F &&f)
+    {
+        using Stored = std::decay_t<F>;
+        static_assert(sizeof(Stored) <= Capacity,
+                      "callable does not fit into the inline storage");
+        static_assert(alignof(Stored) <= alignof(std::max_align_t),
+                      "callable is over-aligned");
+        static_assert(std::is_nothrow_move_constructible_v<Stored>,
+                      "callable must be nothrow move constructible");
+
+        new (&m_storage) Stored(std::forward<F>(f));
+        m_invoke = [](void *storage, Args &&...args) -> R {
+            return (*static_cast<Stored*>(storage))(std::forward<Args>(args)...);
+        };
+        m_relocate = [](void *dest, void *src) noexcept {
+            Stored *obj = static_cast<Stored*>(src);
+            if (dest) {
+                new (dest) Stored(std::move(*obj));
+            }
+            obj->~Stored();
+        };
+    }
+
+    InlineFunction(const InlineFunction &src) = delete;
+
+    InlineFunction(InlineFunction &&src) noexcept
+    {
+        take(src);
+    }
+
+    InlineFunction &operator=(const InlineFunction &src) = delete;
+
+    InlineFunction &operator=(InlineFunction &&src) noexcept
+    {
+        if (this != &src) {
+            reset();
+            take(src);
+        }
+        return *this;
+    }
+
+    InlineFunction &operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    ~InlineFunction()
+    {
+        reset();
+    }
+
+private:
+    std::aligned_storage_t<Capacity, alignof(std::max_align_t)> m_storage;
+    R (*m_invoke)(void*, Args&&...){nullptr};
+    void (*m_relocate)(void*, void*) noexcept{nullptr};
+
+    void take(InlineFunction &src) noexcept
+    {
+        if (src.m_relocate) {
+            src.m_relocate(&m_storage, &src.m_storage);
+        }
+        m_invoke = src.m_invoke;
+        m_relocate = src.m_relocate;
+        src.m_invoke = nullptr;
+        src.m_relocate = nullptr;
+    }
+
+public:
+    /**
+     * @brief Destroy the stored callable, if any.
+     */
+    void reset() noexcept
+    {
+        if (m_relocate) {
+            m_relocate(nullptr, &m_storage);
+        }
+        m_invoke = nullptr;
+        m_relocate = nullptr;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return m_invoke != nullptr;
+    }
+
+    R operator()(Args... args)
+    {
+        return m_invoke(&m_storage, std::forward<Args>(args)...);
+    }
+};
+
+}
+
+#endif
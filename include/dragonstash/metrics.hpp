@@ -0,0 +1,274 @@
+/**********************************************************************
+File name: metrics.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_METRICS_H
+#define DRAGONSTASH_METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Dragonstash::Metrics {
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Number of shards per Counter; threads are spread over them.
+ */
+static constexpr std::size_t COUNTER_SHARDS = 16;
+
+/**
+ * @brief Shard of the calling thread.
+ *
+ * Threads are assigned shards round-robin on first use, so that up to
+ * COUNTER_SHARDS threads never share a cache line when counting.
+ */
+[[nodiscard]] std::size_t thread_shard();
+
+/**
+ * @brief Monotonic counter which can be incremented from any thread without
+ * locking.
+ *
+ * Each thread increments its own shard; value() adds them up and may thus
+ * miss increments which are in flight.
+ */
+class Counter {
+public:
+    Counter() = default;
+    Counter(const Counter &src) = delete;
+    Counter(Counter &&src) = delete;
+    Counter &operator=(const Counter &src) = delete;
+    Counter &operator=(Counter &&src) = delete;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<std::uint64_t> value{0};
+    };
+
+    std::array<Shard, COUNTER_SHARDS> m_shards;
+
+public:
+    inline void add(std::uint64_t n = 1) {
+        m_shards[thread_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] std::uint64_t value() const;
+
+};
+
+/**
+ * @brief Latency histogram with logarithmic buckets, in the spirit of
+ * HdrHistogram.
+ *
+ * Values (nanoseconds, by convention) below SUB_BUCKETS are counted
+ * exactly; above that, each power of two is split into SUB_BUCKETS linear
+ * buckets, which bounds the relative error of quantiles to
+ * 1 / SUB_BUCKETS. Values beyond MAX_EXPONENT end up in the last bucket.
+ *
+ * Recording is a single relaxed atomic increment plus a Counter update and
+ * can be done from any thread.
+ */
+class Histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 3;
+    static constexpr std::uint64_t SUB_BUCKETS = std::uint64_t(1) << SUB_BUCKET_BITS;
+
+    /**
+     * @brief Largest power of two which is resolved; 2^47 ns are about
+     * 39 hours.
+     */
+    static constexpr unsigned MAX_EXPONENT = 47;
+
+    static constexpr std::size_t BUCKETS =
+            (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    struct Snapshot {
+        std::array<std::uint64_t, BUCKETS> buckets;
+        std::uint64_t count;
+        std::uint64_t sum;
+
+        /**
+         * @brief Number of values below @a bound, which should be a power of
+         * two to be exact.
+         */
+        [[nodiscard]] std::uint64_t count_below(std::uint64_t bound) const;
+
+        /**
+         * @brief Upper bound of the bucket holding the @a q quantile.
+         *
+         * @param q Quantile between 0 and 1.
+         * @return Zero if nothing has been recorded.
+         */
+        [[nodiscard]] std::uint64_t quantile(double q) const;
+    };
+
+public:
+    Histogram();
+    Histogram(const Histogram &src) = delete;
+    Histogram(Histogram &&src) = delete;
+    Histogram &operator=(const Histogram &src) = delete;
+    Histogram &operator=(Histogram &&src) = delete;
+
+private:
+    std::array<std::atomic<std::uint64_t>, BUCKETS> m_buckets;
+    Counter m_sum;
+
+public:
+    [[nodiscard]] static std::size_t bucket_of(std::uint64_t value);
+
+    /**
+     * @brief Smallest value which is counted in @a bucket.
+     */
+    [[nodiscard]] static std::uint64_t bucket_start(std::size_t bucket);
+
+    inline void record(std::uint64_t value) {
+        m_buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        m_sum.add(value);
+    }
+
+    inline void record(Clock::duration duration) {
+        record(std::uint64_t(std::max<Clock::rep>(
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+                   0)));
+    }
+
+    inline void record_since(Clock::time_point start) {
+        record(Clock::now() - start);
+    }
+
+    [[nodiscard]] Snapshot snapshot() const;
+
+};
+
+/**
+ * @brief Record the lifetime of the timer into a histogram.
+ */
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram &histogram):
+        m_histogram(histogram),
+        m_start(Clock::now())
+    {
+
+    }
+
+    ScopedTimer(const ScopedTimer &src) = delete;
+    ScopedTimer &operator=(const ScopedTimer &src) = delete;
+
+    ~ScopedTimer() {
+        m_histogram.record_since(m_start);
+    }
+
+private:
+    Histogram &m_histogram;
+    const Clock::time_point m_start;
+
+};
+
+/**
+ * @brief Format metrics in the Prometheus text exposition format.
+ *
+ * Samples belong to the family which was started last. Labels are passed
+ * preformatted, e.g. `op="lookup"`, or empty.
+ */
+class TextWriter {
+public:
+    enum class Type {
+        COUNTER,
+        GAUGE,
+        HISTOGRAM,
+    };
+
+public:
+    TextWriter() = default;
+
+private:
+    std::string m_out;
+    std::string m_family;
+
+    void write_sample(std::string_view suffix, std::string_view labels,
+                      std::string_view extra_label, const std::string &value);
+
+public:
+    void family(std::string_view name, Type type, std::string_view help);
+
+    void sample(std::string_view labels, std::uint64_t value);
+    void sample(std::string_view labels, double value);
+
+    /**
+     * @brief Write a histogram of nanosecond values, converted to seconds.
+     *
+     * Buckets are emitted at powers of two from about 1 us to about 69 s.
+     */
+    void histogram(std::string_view labels, const Histogram &histogram);
+
+    [[nodiscard]] inline const std::string &text() const {
+        return m_out;
+    }
+
+};
+
+/**
+ * @brief Collection of the metrics of several components.
+ *
+ * The components own their metrics; they are asked to write them out when
+ * the registry is rendered. Collectors must stay valid as long as the
+ * registry is rendered.
+ */
+class Registry {
+public:
+    using Collector = std::function<void(TextWriter &out)>;
+
+public:
+    Registry() = default;
+    Registry(const Registry &src) = delete;
+    Registry(Registry &&src) = delete;
+    Registry &operator=(const Registry &src) = delete;
+    Registry &operator=(Registry &&src) = delete;
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<Collector> m_collectors;
+
+public:
+    void add(Collector &&collector);
+
+    /**
+     * @brief Render all metrics in the Prometheus text format.
+     */
+    [[nodiscard]] std::string render() const;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+/**********************************************************************
+File name: pin_policy.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_PIN_POLICY_H
+#define DRAGONSTASH_PIN_POLICY_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dragonstash/error.hpp"
+
+namespace Dragonstash {
+
+/**
+ * @brief A rule selecting regular files whose contents are pinned in the
+ * cache.
+ *
+ * Paths are relative to the mount root in the format returned by
+ * CacheTransactionRO::path(), i.e. starting with a slash.
+ */
+struct PinRule {
+    enum class Kind: std::uint8_t {
+        /**
+         * @brief Match all files below a directory (or the file itself).
+         */
+        SUBTREE = 0,
+
+        /**
+         * @brief Match paths against a shell pattern, see fnmatch(3).
+         *
+         * Wildcards do not match slashes; a pattern ending in `*.csv`
+         * only matches files in the directory named before it.
+         */
+        GLOB = 1,
+    };
+
+    /**
+     * @brief Identifier assigned by CacheTransactionRW::add_pin_rule().
+     */
+    std::uint64_t id = 0;
+
+    Kind kind = Kind::SUBTREE;
+
+    /**
+     * @brief Path of the subtree or the pattern, depending on the kind.
+     *
+     * Subtree paths are normalised by make_subtree(); patterns get a
+     * leading slash by make_glob().
+     */
+    std::string pattern;
+
+    /**
+     * @brief Files larger than this (in bytes) are not pinned; zero means
+     * no limit.
+     */
+    std::uint64_t max_size = 0;
+
+    /**
+     * @brief Set for rules which have been removed, but whose contents are
+     * still pinned.
+     *
+     * Retired rules do not pin anything. They are kept until a mount has
+     * unpinned the contents they selected; see
+     * CacheTransactionRW::remove_pin_rule().
+     */
+    bool retired = false;
+
+    [[nodiscard]] static PinRule make_subtree(std::string_view path,
+                                              std::uint64_t max_size = 0);
+    [[nodiscard]] static PinRule make_glob(std::string_view pattern,
+                                           std::uint64_t max_size = 0);
+
+    /**
+     * @brief Check whether the rule pins a regular file.
+     */
+    [[nodiscard]] bool matches(std::string_view path, std::uint64_t size) const;
+
+    /**
+     * @brief Check whether the rule may pin files directly inside a
+     * directory.
+     *
+     * This is exact for subtrees and conservative for patterns whose
+     * directory part contains escapes.
+     */
+    [[nodiscard]] bool may_match_in(std::string_view dir_path) const;
+
+    /**
+     * @brief Human-readable form, e.g. for listing the rules.
+     */
+    [[nodiscard]] std::string to_string() const;
+
+    /**
+     * @brief Serialise the rule for the cache database.
+     *
+     * The identifier is not part of the record; it is the key.
+     */
+    [[nodiscard]] std::string serialise() const;
+
+    /**
+     * @brief Parse a record written by serialise().
+     *
+     * Error codes:
+     *
+     * - EINVAL: The record is malformed.
+     */
+    [[nodiscard]] static Result<PinRule> parse(std::uint64_t id,
+                                               std::string_view record);
+
+};
+
+/**
+ * @brief An immutable set of pin rules.
+ *
+ * A file is pinned if any rule matches it.
+ */
+class PinPolicy {
+public:
+    PinPolicy() = default;
+    explicit PinPolicy(std::vector<PinRule> rules);
+
+private:
+    std::vector<PinRule> m_rules;
+
+public:
+    [[nodiscard]] inline bool empty() const {
+        return m_rules.empty();
+    }
+
+    [[nodiscard]] inline const std::vector<PinRule> &rules() const {
+        return m_rules;
+    }
+
+    [[nodiscard]] bool matches(std::string_view path, std::uint64_t size) const;
+
+    [[nodiscard]] bool may_match_in(std::string_view dir_path) const;
+
+};
+
+}
+
+#endif
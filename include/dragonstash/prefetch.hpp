@@ -0,0 +1,112 @@
+/**********************************************************************
+File name: prefetch.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_PREFETCH_H
+#define DRAGONSTASH_PREFETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+
+#include "dragonstash/error.hpp"
+
+namespace Dragonstash {
+
+/**
+ * @brief Name of the extended attribute which starts a prefetch on a mount.
+ *
+ * Setting it on a directory prefetches the subtree below it; the value is
+ * parsed with PrefetchOptions::parse(). The call returns once the prefetch
+ * has been started; it runs in the background, and its outcome is counted
+ * in the metrics of the mount.
+ */
+static constexpr std::string_view PREFETCH_XATTR = "user.dragonstash.prefetch";
+
+/**
+ * @brief Options for Filesystem::prefetch().
+ */
+struct PrefetchOptions {
+    static constexpr std::size_t UNLIMITED_DEPTH = std::numeric_limits<std::size_t>::max();
+
+    /**
+     * @brief Number of directory levels below the start to descend into.
+     *
+     * Zero only syncs the start directory itself.
+     */
+    std::size_t depth = UNLIMITED_DEPTH;
+
+    /**
+     * @brief Download the contents of regular files, too.
+     *
+     * The contents are stored as PINNED, so that they are never evicted.
+     */
+    bool content = false;
+
+    /**
+     * @brief Number of directories and files processed in parallel; zero
+     *   selects the number of cores.
+     */
+    std::size_t concurrency = 0;
+
+    /**
+     * @brief Parse options in the format `[depth=N][,content][,jobs=N]`.
+     *
+     * An empty string selects the defaults.
+     *
+     * Error codes:
+     *
+     * - EINVAL: The specification is malformed.
+     */
+    [[nodiscard]] static Result<PrefetchOptions> parse(std::string_view spec);
+};
+
+/**
+ * @brief Summary of a completed prefetch.
+ */
+struct PrefetchStats {
+    /**
+     * @brief Directories which have been synced.
+     */
+    std::uint64_t directories = 0;
+
+    /**
+     * @brief Regular files whose contents have been pinned.
+     */
+    std::uint64_t files = 0;
+
+    /**
+     * @brief Bytes downloaded from the backend.
+     */
+    std::uint64_t bytes = 0;
+
+    /**
+     * @brief Directories and files which could not be prefetched.
+     */
+    std::uint64_t errors = 0;
+};
+
+}
+
+#endif
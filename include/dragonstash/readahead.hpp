@@ -0,0 +1,129 @@
+/**********************************************************************
+File name: readahead.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_READAHEAD_H
+#define DRAGONSTASH_READAHEAD_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+
+namespace Dragonstash {
+
+/**
+ * @brief Access pattern tracker for a single open file.
+ *
+ * The tracker detects sequential streams of reads and decides which ranges
+ * to prefetch ahead of the reader. The window starts small and doubles with
+ * every prefetch, up to the amount of data the backend delivers within the
+ * configured lead time (as measured on completed prefetches). Any
+ * non-sequential read resets the window.
+ *
+ * At most one prefetch is in flight at any time. All methods are
+ * thread-safe.
+ */
+class Readahead {
+public:
+    struct Config {
+        /**
+         * @brief Window used when a stream is first detected.
+         */
+        std::size_t min_window = 128 * 1024;
+
+        /**
+         * @brief Upper bound of the window; zero disables readahead.
+         */
+        std::size_t max_window = 32 * 1024 * 1024;
+
+        /**
+         * @brief How far ahead of the reader readahead tries to stay.
+         */
+        std::chrono::milliseconds lead_time{3000};
+
+        /**
+         * @brief Number of consecutive sequential reads after which a stream
+         * is assumed.
+         */
+        unsigned sequential_threshold = 2;
+    };
+
+    struct Range {
+        std::uint64_t offset;
+        std::size_t size;
+    };
+
+    static constexpr std::size_t DEFAULT_CONCURRENCY = 4;
+
+public:
+    Readahead(const Config &config, std::uint64_t file_size);
+
+private:
+    const Config m_config;
+    mutable std::mutex m_mutex;
+    const std::uint64_t m_file_size;
+
+    std::uint64_t m_next_offset;
+    unsigned m_sequential_reads;
+    std::size_t m_window;
+    std::uint64_t m_prefetched_end;
+    bool m_in_flight;
+
+    /**
+     * @brief Exponentially weighted average of the prefetch throughput in
+     * bytes per second; zero while no measurement is available.
+     */
+    double m_throughput;
+
+    [[nodiscard]] std::size_t target_window() const;
+
+public:
+    /**
+     * @brief Record a read and return the range to prefetch, if any.
+     *
+     * A returned range is in flight until completed() is called for it.
+     */
+    [[nodiscard]] std::optional<Range> access(std::uint64_t offset, std::size_t size);
+
+    /**
+     * @brief Report the outcome of a prefetch returned by access().
+     *
+     * @param fetched Number of bytes actually fetched. If this is less than
+     *   the size of the range, readahead is suspended until the next stream
+     *   is detected.
+     * @param elapsed Time the backend took to deliver the data.
+     */
+    void completed(const Range &range, std::size_t fetched,
+                   std::chrono::steady_clock::duration elapsed);
+
+    [[nodiscard]] std::size_t window() const;
+
+    [[nodiscard]] double throughput() const;
+
+};
+
+}
+
+#endif
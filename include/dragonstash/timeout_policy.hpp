@@ -0,0 +1,205 @@
+/**********************************************************************
+File name: timeout_policy.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_TIMEOUT_POLICY_H
+#define DRAGONSTASH_TIMEOUT_POLICY_H
+
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "dragonstash/error.hpp"
+
+namespace Dragonstash {
+
+/**
+ * @brief Decides how long the kernel may cache entries and attributes, and
+ * when lookups have to ask the backend.
+ *
+ * There is a default rule for the whole mount, which can be overridden for
+ * subtrees. Subtrees are identified by their path relative to the mount
+ * root (e.g. `/archive`); the rule of the longest matching subtree wins.
+ *
+ * The policy is configured before the filesystem is mounted and only read
+ * afterwards; it is not synchronised.
+ */
+class TimeoutPolicy {
+public:
+    /**
+     * @brief Timeout which is effectively infinite for the kernel.
+     */
+    static constexpr double INFINITE_TIMEOUT = 1e9;
+
+    struct Rule {
+        /**
+         * @brief Seconds for which the kernel may cache attributes.
+         */
+        double attr_timeout = 1.0;
+
+        /**
+         * @brief Seconds for which the kernel may cache directory entries.
+         */
+        double entry_timeout = 1.0;
+
+        /**
+         * @brief Age (in seconds) of the cached modification time after
+         * which an entry is trusted without asking the backend.
+         *
+         * Files which have not changed for a long time are unlikely to
+         * change now; with this set, lookups of such entries are served from
+         * the cache. Zero means that lookups always revalidate.
+         */
+        double stable_after = 0;
+
+        /**
+         * @brief Seconds after an entry was last found up-to-date on the
+         * backend during which lookups use it without asking the backend.
+         *
+         * Only used if hard_ttl is set; at most hard_ttl.
+         */
+        double soft_ttl = 0;
+
+        /**
+         * @brief Seconds after an entry was last found up-to-date on the
+         * backend after which lookups revalidate it before replying.
+         *
+         * Lookups of entries which are older than soft_ttl, but younger
+         * than this, are answered from the cache right away and revalidated
+         * in the background. Zero means that lookups always revalidate
+         * before replying (unless the entry is stable).
+         */
+        double hard_ttl = 0;
+    };
+
+    /**
+     * @brief How a lookup of a cached entry is revalidated.
+     */
+    enum class Revalidation {
+        /**
+         * @brief Reply from the cache without asking the backend.
+         */
+        NONE,
+
+        /**
+         * @brief Reply from the cache and ask the backend afterwards.
+         */
+        BACKGROUND,
+
+        /**
+         * @brief Ask the backend before replying.
+         */
+        SYNCHRONOUS,
+    };
+
+public:
+    TimeoutPolicy() = default;
+    explicit TimeoutPolicy(const Rule &defaults);
+
+private:
+    Rule m_defaults;
+    double m_offline_timeout = 0;
+
+    /**
+     * @brief Subtree rules, ordered by decreasing path length.
+     */
+    std::vector<std::pair<std::string, Rule>> m_subtrees;
+
+public:
+    [[nodiscard]] inline const Rule &defaults() const {
+        return m_defaults;
+    }
+
+    inline void set_defaults(const Rule &rule) {
+        m_defaults = rule;
+    }
+
+    /**
+     * @brief Set the rule for a subtree, replacing any previous rule for it.
+     *
+     * Leading and trailing slashes of @a path are optional.
+     */
+    void add_subtree(std::string_view path, const Rule &rule);
+
+    [[nodiscard]] inline bool has_subtrees() const {
+        return !m_subtrees.empty();
+    }
+
+    /**
+     * @brief Rule for the entry with the given path.
+     *
+     * @param path Path relative to the mount root in the format returned by
+     *   CacheTransactionRO::path(), i.e. starting with a slash; the root
+     *   itself is the empty string.
+     */
+    [[nodiscard]] const Rule &rule_for(std::string_view path) const;
+
+    /**
+     * @brief Minimal timeout for replies served while the backend is not
+     * connected.
+     *
+     * The cache cannot change while the backend is away, so the kernel may
+     * keep what it got for a long time. Zero uses the timeouts of the rule.
+     */
+    [[nodiscard]] inline double offline_timeout() const {
+        return m_offline_timeout;
+    }
+
+    inline void set_offline_timeout(double seconds) {
+        m_offline_timeout = seconds;
+    }
+
+    /**
+     * @brief Check whether an entry with the given cached modification time
+     * can be used without revalidation.
+     */
+    [[nodiscard]] static bool is_stable(const Rule &rule,
+                                        const struct timespec &mtime,
+                                        const struct timespec &now);
+
+    /**
+     * @brief Decide how to revalidate an entry which was last found
+     * up-to-date on the backend @a age seconds ago.
+     */
+    [[nodiscard]] static Revalidation revalidation(const Rule &rule, double age);
+
+    /**
+     * @brief Parse a subtree rule in the format `PATH=TIMEOUT[,STABLE_AFTER]`.
+     *
+     * TIMEOUT is used for both attributes and entries; all values are in
+     * seconds.
+     *
+     * Error codes:
+     *
+     * - EINVAL: The specification is malformed.
+     */
+    [[nodiscard]] static Result<std::pair<std::string, Rule>> parse_subtree(
+            std::string_view spec);
+
+};
+
+}
+
+#endif
@@ -0,0 +1,301 @@
+/**********************************************************************
+File name: trace.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_TRACE_H
+#define DRAGONSTASH_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Dragonstash::Trace {
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Whether the instrumentation points are compiled in.
+ *
+ * Without DRAGONSTASH_TRACING, Scope and Span are empty and requests carry
+ * no trace; the Recorder still exists, but never records anything.
+ */
+static constexpr bool ENABLED =
+    #ifdef DRAGONSTASH_TRACING
+        true
+    #else
+        false
+    #endif
+        ;
+
+/**
+ * @brief Phases of a request which are recorded as spans.
+ */
+enum class Phase {
+    /** Resolving an inode to its path, see CacheTransactionRO::path() */
+    PATH_WALK,
+    /** Waiting for the backend to stat an entry */
+    BACKEND_LSTAT,
+    /** Creating or updating an entry in the cache */
+    EMPLACE,
+    /** Waiting for the LMDB writer lock or a contended inode lock */
+    LOCK_WAIT,
+    /** Waiting for a group commit, including running and committing it */
+    GROUP_COMMIT,
+    /** Committing a transaction, also nested ones into their parent */
+    COMMIT,
+};
+
+[[nodiscard]] const char *phase_name(Phase phase);
+
+/**
+ * @brief Small number identifying the calling thread in traces.
+ */
+[[nodiscard]] std::uint32_t thread_number();
+
+struct Event {
+    Phase phase;
+    std::uint32_t thread;
+    Clock::time_point start;
+    Clock::duration duration;
+};
+
+/**
+ * @brief A finished trace of a single request.
+ */
+struct Record {
+    /** Sequence number of the request, unique within the process */
+    std::uint64_t id;
+    /** Name of the handler which served the request */
+    const char *op;
+    /** Thread on which the handler started */
+    std::uint32_t thread;
+    Clock::time_point start;
+    /** Time from the start of the handler until the reply */
+    Clock::duration duration;
+    std::vector<Event> events;
+};
+
+class Recorder;
+
+/**
+ * @brief Trace of a request which is in flight.
+ *
+ * Spans may be added from any thread; a request can continue on a backend
+ * thread or have its writes run by the group commit leader. Spans which end
+ * after the request has been replied to are dropped.
+ */
+class Context: public std::enable_shared_from_this<Context> {
+public:
+    Context(Recorder &recorder, std::uint64_t id, const char *op, bool sampled);
+    Context(const Context &src) = delete;
+    Context(Context &&src) = delete;
+    Context &operator=(const Context &src) = delete;
+    Context &operator=(Context &&src) = delete;
+
+private:
+    Recorder &m_recorder;
+    const bool m_sampled;
+    std::mutex m_mutex;
+    bool m_finished;
+    Record m_record;
+
+public:
+    void add(Phase phase, Clock::time_point start, Clock::time_point end);
+
+    /**
+     * @brief End the trace and hand it to the recorder.
+     *
+     * The recorder keeps it if the request was sampled or took at least the
+     * threshold.
+     */
+    void finish();
+
+    [[nodiscard]] inline std::uint64_t id() const {
+        return m_record.id;
+    }
+};
+
+using Handle = std::shared_ptr<Context>;
+
+/**
+ * @brief Decides which requests are traced and keeps the most recent traces.
+ *
+ * Requests are traced either by sampling, every n-th request, or when they
+ * take at least a threshold. Threshold-triggered tracing has to record every
+ * request and throw away the fast ones, so it costs more than sampling.
+ */
+class Recorder {
+public:
+    explicit Recorder(std::size_t capacity = 1024);
+    Recorder(const Recorder &src) = delete;
+    Recorder(Recorder &&src) = delete;
+    Recorder &operator=(const Recorder &src) = delete;
+    Recorder &operator=(Recorder &&src) = delete;
+
+private:
+    const std::size_t m_capacity;
+    const Clock::time_point m_epoch;
+    std::atomic<std::uint64_t> m_sequence;
+    std::atomic<std::uint64_t> m_sample_every;
+    std::atomic<Clock::rep> m_threshold;
+
+    mutable std::mutex m_mutex;
+    std::deque<Record> m_records;
+
+public:
+    /**
+     * @brief Choose which requests are traced.
+     *
+     * @param sample_every Trace every n-th request; zero disables sampling.
+     * @param threshold Keep traces of requests which took at least this
+     *   long; zero disables threshold-triggered tracing.
+     */
+    void configure(std::uint64_t sample_every, Clock::duration threshold);
+
+    [[nodiscard]] bool enabled() const;
+
+    /**
+     * @brief Start the trace of a request.
+     *
+     * @return The trace, or null if the request is not traced.
+     */
+    [[nodiscard]] Handle begin(const char *op);
+
+    /**
+     * @brief Keep a finished trace if it is sampled or slow enough.
+     */
+    void submit(Record &&record, bool sampled);
+
+    /**
+     * @brief Copy of the kept traces, oldest first.
+     */
+    [[nodiscard]] std::vector<Record> records() const;
+
+    void clear();
+
+    /**
+     * @brief Render the kept traces in the Chrome trace event format.
+     *
+     * Requests and their phases become complete ("X") events on the thread
+     * they ran on; the request number is in the arguments of each event.
+     * The result can be loaded into chrome://tracing or Perfetto.
+     */
+    [[nodiscard]] std::string chrome_trace() const;
+};
+
+#ifdef DRAGONSTASH_TRACING
+
+/**
+ * @brief Trace of the request which the calling thread works on, if any.
+ */
+[[nodiscard]] Context *current();
+
+/**
+ * @brief Make a trace the current trace of the calling thread during the
+ * lifetime of the scope.
+ *
+ * Scopes nest; the previous trace is restored at the end.
+ */
+class Scope {
+public:
+    Scope();
+    explicit Scope(Handle context);
+    Scope(const Scope &src) = delete;
+    Scope(Scope &&src) = delete;
+    Scope &operator=(const Scope &src) = delete;
+    Scope &operator=(Scope &&src) = delete;
+    ~Scope();
+
+private:
+    Handle m_context;
+    Context *m_previous;
+};
+
+/**
+ * @brief Record a phase of the current trace, from construction until end()
+ * or destruction.
+ *
+ * Spans can be moved, e.g. into the completion of an asynchronous call;
+ * they stay attached to the trace which was current when they were created.
+ */
+class Span {
+public:
+    explicit Span(Phase phase);
+    Span(const Span &src) = delete;
+    Span(Span &&src) noexcept = default;
+    Span &operator=(const Span &src) = delete;
+    Span &operator=(Span &&src) noexcept = default;
+    inline ~Span() {
+        end();
+    }
+
+private:
+    Handle m_context;
+    Phase m_phase;
+    Clock::time_point m_start;
+
+public:
+    inline void end() {
+        if (m_context) {
+            m_context->add(m_phase, m_start, Clock::now());
+            m_context = nullptr;
+        }
+    }
+};
+
+/**
+ * @brief The current trace of the calling thread, to continue it elsewhere.
+ */
+[[nodiscard]] Handle current_handle();
+
+#else
+
+class Scope {
+public:
+    inline Scope() {}
+    inline explicit Scope(const Handle&) {}
+    inline ~Scope() {}
+};
+
+class Span {
+public:
+    inline explicit Span(Phase) {}
+    inline ~Span() {}
+    inline void end() {}
+};
+
+[[nodiscard]] inline Handle current_handle() {
+    return nullptr;
+}
+
+#endif
+
+}
+
+#endif
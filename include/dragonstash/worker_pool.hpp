@@ -0,0 +1,146 @@
+/**********************************************************************
+File name: worker_pool.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_WORKER_POOL_H
+#define DRAGONSTASH_WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Dragonstash {
+
+/**
+ * @brief Fixed-size pool of threads with a bounded task queue.
+ *
+ * The pool is used to fan out blocking backend operations. submit() blocks
+ * while the queue is full, which provides back-pressure to producers which
+ * generate work faster than the backend can handle it.
+ *
+ * A pool without threads runs all tasks inline in submit().
+ */
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    static constexpr std::size_t DEFAULT_CONCURRENCY = 16;
+
+    /**
+     * @brief Queue limit for pools whose producers must never block in
+     * submit().
+     */
+    static constexpr std::size_t UNBOUNDED = std::numeric_limits<std::size_t>::max();
+
+public:
+    /**
+     * @param nthreads Number of worker threads.
+     * @param max_queued Maximum number of tasks waiting for a worker; zero
+     *   selects four times the number of threads.
+     */
+    explicit WorkerPool(std::size_t nthreads = DEFAULT_CONCURRENCY,
+                        std::size_t max_queued = 0);
+    WorkerPool(const WorkerPool &src) = delete;
+    WorkerPool(WorkerPool &&src) = delete;
+    WorkerPool &operator=(const WorkerPool &src) = delete;
+    WorkerPool &operator=(WorkerPool &&src) = delete;
+    ~WorkerPool();
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_space_cv;
+    std::deque<Task> m_queue;
+    std::size_t m_max_queued;
+    bool m_stopping;
+    std::vector<std::thread> m_threads;
+
+    void worker();
+
+public:
+    /**
+     * @brief Queue a task for execution.
+     *
+     * Tasks must not throw; use TaskGroup to propagate exceptions.
+     */
+    void submit(Task &&task);
+
+    /**
+     * @brief Queue a task unless the queue is full.
+     *
+     * Like submit(), a pool without threads runs the task inline.
+     *
+     * @return false if the task has been dropped.
+     */
+    bool try_submit(Task &&task);
+
+    [[nodiscard]] inline std::size_t concurrency() const {
+        return m_threads.size();
+    }
+
+};
+
+/**
+ * @brief Track completion of a set of tasks submitted to a WorkerPool.
+ *
+ * The destructor waits for all tasks of the group.
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(WorkerPool &pool);
+    TaskGroup(const TaskGroup &src) = delete;
+    TaskGroup(TaskGroup &&src) = delete;
+    TaskGroup &operator=(const TaskGroup &src) = delete;
+    TaskGroup &operator=(TaskGroup &&src) = delete;
+    ~TaskGroup();
+
+private:
+    WorkerPool &m_pool;
+    std::mutex m_mutex;
+    std::condition_variable m_done_cv;
+    std::size_t m_pending;
+    std::exception_ptr m_exception;
+
+    void wait_all();
+
+public:
+    void submit(WorkerPool::Task &&task);
+
+    /**
+     * @brief Wait for all tasks submitted so far.
+     *
+     * Rethrows the first exception thrown by any of the tasks.
+     */
+    void wait();
+
+};
+
+}
+
+#endif
@@ -28,8 +28,121 @@ namespace Dragonstash::Backend {
 
 File::~File() = default;
 
+Result<void> File::ftruncate(off_t)
+{
+    return make_result(FAILED, EOPNOTSUPP);
+}
+
 Dir::~Dir() = default;
 
+Result<Stat> Dir::lstat_entry(std::string_view)
+{
+    return make_result(FAILED, ENOSYS);
+}
+
+DirectoryHandle::~DirectoryHandle() = default;
+
+Result<bool> DirectoryHandle::is_current()
+{
+    return make_result(true);
+}
+
+void DirectoryHandle::lstat_async(std::string_view name, Completion<Stat> &&done)
+{
+    done(lstat(name));
+}
+
 Filesystem::~Filesystem() = default;
 
+void Filesystem::lstat_async(std::string_view path, Completion<Stat> &&done)
+{
+    done(lstat(path));
+}
+
+namespace {
+
+class PathDirectoryHandle: public DirectoryHandle {
+public:
+    PathDirectoryHandle(Filesystem &fs, std::string_view path):
+        m_fs(fs),
+        m_path(path)
+    {
+
+    }
+
+private:
+    Filesystem &m_fs;
+    std::string m_path;
+
+    Result<std::string> child_path(std::string_view name) const {
+        if (!is_valid_entry_name(name)) {
+            return make_result(FAILED, EINVAL);
+        }
+        std::string result(m_path);
+        result.reserve(result.size() + name.size() + 1);
+        if (result.empty() || result.back() != '/') {
+            result += '/';
+        }
+        result += name;
+        return result;
+    }
+
+    // DirectoryHandle interface
+public:
+    Result<std::unique_ptr<File>> open(std::string_view name, int accesstype, mode_t mode) override
+    {
+        auto path = child_path(name);
+        if (!path) {
+            return copy_error(path);
+        }
+        return m_fs.open(*path, accesstype, mode);
+    }
+
+    Result<std::unique_ptr<Dir>> opendir() override
+    {
+        return m_fs.opendir(m_path);
+    }
+
+    Result<Stat> lstat(std::string_view name) override
+    {
+        auto path = child_path(name);
+        if (!path) {
+            return copy_error(path);
+        }
+        return m_fs.lstat(*path);
+    }
+
+    void lstat_async(std::string_view name, Completion<Stat> &&done) override
+    {
+        auto path = child_path(name);
+        if (!path) {
+            done(copy_error(path));
+            return;
+        }
+        m_fs.lstat_async(*path, std::move(done));
+    }
+
+    Result<std::string> readlink(std::string_view name) override
+    {
+        auto path = child_path(name);
+        if (!path) {
+            return copy_error(path);
+        }
+        return m_fs.readlink(*path);
+    }
+};
+
+}
+
+Result<std::unique_ptr<DirectoryHandle>> Filesystem::open_directory(std::string_view path)
+{
+    return std::make_unique<PathDirectoryHandle>(*this, path);
+}
+
+bool is_valid_entry_name(std::string_view name)
+{
+    return !name.empty() && name != "." && name != ".." &&
+            name.find('/') == std::string_view::npos;
+}
+
 }
@@ -0,0 +1,399 @@
+/**********************************************************************
+File name: connectivity.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/backend/connectivity.hpp"
+
+#include <algorithm>
+
+namespace Dragonstash::Backend {
+
+namespace {
+
+using Method = ConnectivityFilesystem::Method;
+
+class ConnectivityFile: public File {
+public:
+    ConnectivityFile(ConnectivityFilesystem &fs, std::unique_ptr<File> &&file):
+        m_fs(fs),
+        m_file(std::move(file))
+    {
+
+    }
+
+private:
+    ConnectivityFilesystem &m_fs;
+    std::unique_ptr<File> m_file;
+
+    // File interface
+public:
+    Result<Stat> fstat() override
+    {
+        return m_fs.guarded(Method::FSTAT, [this]() { return m_file->fstat(); });
+    }
+
+    Result<ssize_t> pread(void *buf, size_t count, off_t offset) override
+    {
+        return m_fs.guarded(Method::PREAD, [&]() { return m_file->pread(buf, count, offset); });
+    }
+
+    Result<ssize_t> pwrite(const void *buf, size_t count, off_t offset) override
+    {
+        return m_fs.guarded(Method::PWRITE, [&]() { return m_file->pwrite(buf, count, offset); });
+    }
+
+    Result<void> fsync() override
+    {
+        return m_fs.guarded(Method::FSYNC, [this]() { return m_file->fsync(); });
+    }
+
+    Result<void> ftruncate(off_t size) override
+    {
+        return m_fs.guarded(Method::FTRUNCATE, [&]() { return m_file->ftruncate(size); });
+    }
+
+    Result<void> close() override
+    {
+        return m_fs.measured(Method::CLOSE, [this]() { return m_file->close(); });
+    }
+};
+
+class ConnectivityDir: public Dir {
+public:
+    ConnectivityDir(ConnectivityFilesystem &fs, std::unique_ptr<Dir> &&dir):
+        m_fs(fs),
+        m_dir(std::move(dir))
+    {
+
+    }
+
+private:
+    ConnectivityFilesystem &m_fs;
+    std::unique_ptr<Dir> m_dir;
+
+    // Dir interface
+public:
+    Result<DirEntry> readdir() override
+    {
+        return m_fs.guarded(Method::READDIR, [this]() { return m_dir->readdir(); });
+    }
+
+    Result<void> fsyncdir() override
+    {
+        return m_fs.guarded(Method::FSYNCDIR, [this]() { return m_dir->fsyncdir(); });
+    }
+
+    Result<void> closedir() override
+    {
+        return m_fs.measured(Method::CLOSEDIR, [this]() { return m_dir->closedir(); });
+    }
+
+    Result<Stat> lstat_entry(std::string_view name) override
+    {
+        return m_fs.guarded(Method::LSTAT_ENTRY, [this, name]() { return m_dir->lstat_entry(name); });
+    }
+};
+
+template <typename T>
+static Result<std::unique_ptr<Dir>> wrap_dir(ConnectivityFilesystem &fs, Result<T> &&result)
+{
+    if (!result) {
+        return copy_error(result);
+    }
+    return make_result(std::unique_ptr<Dir>(
+                           std::make_unique<ConnectivityDir>(fs, std::move(*result))));
+}
+
+template <typename T>
+static Result<std::unique_ptr<File>> wrap_file(ConnectivityFilesystem &fs, Result<T> &&result)
+{
+    if (!result) {
+        return copy_error(result);
+    }
+    return make_result(std::unique_ptr<File>(
+                           std::make_unique<ConnectivityFile>(fs, std::move(*result))));
+}
+
+class ConnectivityDirectoryHandle: public DirectoryHandle {
+public:
+    ConnectivityDirectoryHandle(ConnectivityFilesystem &fs,
+                                std::unique_ptr<DirectoryHandle> &&handle):
+        m_fs(fs),
+        m_handle(std::move(handle))
+    {
+
+    }
+
+private:
+    ConnectivityFilesystem &m_fs;
+    std::unique_ptr<DirectoryHandle> m_handle;
+
+    // DirectoryHandle interface
+public:
+    Result<std::unique_ptr<File>> open(std::string_view name, int accesstype, mode_t mode) override
+    {
+        return wrap_file(m_fs, m_fs.guarded(Method::OPEN, [&]() {
+            return m_handle->open(name, accesstype, mode);
+        }));
+    }
+
+    Result<std::unique_ptr<Dir>> opendir() override
+    {
+        return wrap_dir(m_fs, m_fs.guarded(Method::OPENDIR, [this]() { return m_handle->opendir(); }));
+    }
+
+    Result<Stat> lstat(std::string_view name) override
+    {
+        return m_fs.guarded(Method::LSTAT, [this, name]() { return m_handle->lstat(name); });
+    }
+
+    void lstat_async(std::string_view name, Completion<Stat> &&done) override
+    {
+        m_fs.guarded_async<Stat>(Method::LSTAT, [this, name](Completion<Stat> &&inner) {
+            m_handle->lstat_async(name, std::move(inner));
+        }, std::move(done));
+    }
+
+    Result<std::string> readlink(std::string_view name) override
+    {
+        return m_fs.guarded(Method::READLINK, [this, name]() { return m_handle->readlink(name); });
+    }
+
+    Result<bool> is_current() override
+    {
+        return m_fs.guarded(Method::LSTAT, [this]() { return m_handle->is_current(); });
+    }
+};
+
+}
+
+ConnectivityFilesystem::ConnectivityFilesystem(Filesystem &backend):
+    ConnectivityFilesystem(backend, Config())
+{
+
+}
+
+ConnectivityFilesystem::ConnectivityFilesystem(Filesystem &backend,
+                                               const Config &config):
+    m_backend(backend),
+    m_config(config),
+    m_connected(config.initial_state == State::CONNECTED),
+    m_backoff(std::max(config.initial_backoff, std::chrono::milliseconds(1))),
+    m_stopping(false),
+    m_disconnects(0),
+    m_reconnects(0),
+    m_probes(0),
+    m_short_circuited(0),
+    m_prober([this]() { run(); })
+{
+
+}
+
+ConnectivityFilesystem::~ConnectivityFilesystem()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stopping = true;
+    }
+    m_wake_cv.notify_all();
+    m_prober.join();
+}
+
+const char *ConnectivityFilesystem::method_name(Method method)
+{
+    switch (method) {
+    case Method::OPEN:
+        return "open";
+    case Method::OPENDIR:
+        return "opendir";
+    case Method::LSTAT:
+        return "lstat";
+    case Method::READLINK:
+        return "readlink";
+    case Method::OPEN_DIRECTORY:
+        return "open_directory";
+    case Method::FSTAT:
+        return "fstat";
+    case Method::PREAD:
+        return "pread";
+    case Method::PWRITE:
+        return "pwrite";
+    case Method::FSYNC:
+        return "fsync";
+    case Method::FTRUNCATE:
+        return "ftruncate";
+    case Method::CLOSE:
+        return "close";
+    case Method::READDIR:
+        return "readdir";
+    case Method::FSYNCDIR:
+        return "fsyncdir";
+    case Method::CLOSEDIR:
+        return "closedir";
+    case Method::LSTAT_ENTRY:
+        return "lstat_entry";
+    }
+    return "unknown";
+}
+
+void ConnectivityFilesystem::collect_metrics(Metrics::TextWriter &out) const
+{
+    using Type = Metrics::TextWriter::Type;
+    out.family("dragonstash_backend_connected", Type::GAUGE,
+               "Whether the backend is considered reachable.");
+    out.sample("", std::uint64_t(state() == State::CONNECTED));
+    out.family("dragonstash_backend_disconnects_total", Type::COUNTER,
+               "Switches from connected to disconnected.");
+    out.sample("", disconnects());
+    out.family("dragonstash_backend_reconnects_total", Type::COUNTER,
+               "Switches from disconnected to connected.");
+    out.sample("", reconnects());
+    out.family("dragonstash_backend_probes_total", Type::COUNTER,
+               "Probes sent to the backend while it was disconnected.");
+    out.sample("", probes());
+    out.family("dragonstash_backend_short_circuited_total", Type::COUNTER,
+               "Operations which failed without asking the backend.");
+    out.sample("", short_circuited());
+
+    out.family("dragonstash_backend_request_duration_seconds", Type::HISTOGRAM,
+               "Latency of the operations forwarded to the backend.");
+    for (std::size_t i = 0; i < METHODS; ++i) {
+        const Method method = Method(i);
+        out.histogram(std::string("method=\"") + method_name(method) + "\"",
+                      m_latency[i]);
+    }
+}
+
+void ConnectivityFilesystem::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+        if (m_connected.load(std::memory_order_acquire)) {
+            m_wake_cv.wait(lock, [this]() {
+                return m_stopping || !m_connected.load(std::memory_order_acquire);
+            });
+            continue;
+        }
+
+        if (m_wake_cv.wait_for(lock, m_backoff, [this]() {
+                return m_stopping || m_connected.load(std::memory_order_acquire);
+            }))
+        {
+            continue;
+        }
+
+        lock.unlock();
+        const bool connected = probe();
+        lock.lock();
+        if (!connected) {
+            m_backoff = std::min(m_backoff * 2,
+                                 std::max(m_config.max_backoff, m_backoff));
+        }
+    }
+}
+
+void ConnectivityFilesystem::set_connected(bool connected)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_connected.load(std::memory_order_acquire) == connected) {
+            return;
+        }
+        m_connected.store(connected, std::memory_order_release);
+        m_backoff = std::max(m_config.initial_backoff, std::chrono::milliseconds(1));
+        if (connected) {
+            m_reconnects.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            m_disconnects.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    m_wake_cv.notify_all();
+    m_state_cv.notify_all();
+}
+
+void ConnectivityFilesystem::mark_disconnected()
+{
+    set_connected(false);
+}
+
+bool ConnectivityFilesystem::probe()
+{
+    m_probes.fetch_add(1, std::memory_order_relaxed);
+    // any answer, even an error, means that the backend is there
+    const bool connected = !is_not_connected(m_backend.lstat(m_config.probe_path));
+    set_connected(connected);
+    return connected;
+}
+
+bool ConnectivityFilesystem::wait_connected(std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_state_cv.wait_for(lock, timeout, [this]() {
+        return m_connected.load(std::memory_order_acquire);
+    });
+}
+
+std::chrono::milliseconds ConnectivityFilesystem::backoff()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_backoff;
+}
+
+Result<std::unique_ptr<File>> ConnectivityFilesystem::open(std::string_view path, int accesstype, mode_t mode)
+{
+    return wrap_file(*this, guarded(Method::OPEN, [&]() { return m_backend.open(path, accesstype, mode); }));
+}
+
+Result<std::unique_ptr<Dir>> ConnectivityFilesystem::opendir(std::string_view path)
+{
+    return wrap_dir(*this, guarded(Method::OPENDIR, [this, path]() { return m_backend.opendir(path); }));
+}
+
+Result<Stat> ConnectivityFilesystem::lstat(std::string_view path)
+{
+    return guarded(Method::LSTAT, [this, path]() { return m_backend.lstat(path); });
+}
+
+void ConnectivityFilesystem::lstat_async(std::string_view path, Completion<Stat> &&done)
+{
+    guarded_async<Stat>(Method::LSTAT, [this, path](Completion<Stat> &&inner) {
+        m_backend.lstat_async(path, std::move(inner));
+    }, std::move(done));
+}
+
+Result<std::string> ConnectivityFilesystem::readlink(std::string_view path)
+{
+    return guarded(Method::READLINK, [this, path]() { return m_backend.readlink(path); });
+}
+
+Result<std::unique_ptr<DirectoryHandle>> ConnectivityFilesystem::open_directory(std::string_view path)
+{
+    auto result = guarded(Method::OPEN_DIRECTORY, [this, path]() { return m_backend.open_directory(path); });
+    if (!result) {
+        return copy_error(result);
+    }
+    return make_result(std::unique_ptr<DirectoryHandle>(
+                           std::make_unique<ConnectivityDirectoryHandle>(*this, std::move(*result))));
+}
+
+}
@@ -0,0 +1,443 @@
+/**********************************************************************
+File name: fault_injection.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/backend/fault_injection.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+
+namespace Dragonstash::Backend {
+
+namespace {
+
+class FaultInjectingFile: public File {
+public:
+    FaultInjectingFile(FaultInjectingFilesystem &fs, std::unique_ptr<File> &&file):
+        m_fs(fs),
+        m_file(std::move(file))
+    {
+
+    }
+
+private:
+    FaultInjectingFilesystem &m_fs;
+    std::unique_ptr<File> m_file;
+
+    // File interface
+public:
+    Result<Stat> fstat() override
+    {
+        return m_fs.injected([this]() { return m_file->fstat(); });
+    }
+
+    Result<ssize_t> pread(void *buf, size_t count, off_t offset) override
+    {
+        return m_fs.injected_transfer([&]() { return m_file->pread(buf, count, offset); });
+    }
+
+    Result<ssize_t> pwrite(const void *buf, size_t count, off_t offset) override
+    {
+        return m_fs.injected_transfer([&]() { return m_file->pwrite(buf, count, offset); });
+    }
+
+    Result<void> fsync() override
+    {
+        return m_fs.injected([this]() { return m_file->fsync(); });
+    }
+
+    Result<void> ftruncate(off_t size) override
+    {
+        return m_fs.injected([&]() { return m_file->ftruncate(size); });
+    }
+
+    Result<void> close() override
+    {
+        return m_file->close();
+    }
+};
+
+class FaultInjectingDir: public Dir {
+public:
+    FaultInjectingDir(FaultInjectingFilesystem &fs, std::unique_ptr<Dir> &&dir):
+        m_fs(fs),
+        m_dir(std::move(dir))
+    {
+
+    }
+
+private:
+    FaultInjectingFilesystem &m_fs;
+    std::unique_ptr<Dir> m_dir;
+
+    // Dir interface
+public:
+    Result<DirEntry> readdir() override
+    {
+        // entries arrive in batches, so only the opendir pays the latency
+        const auto admission = m_fs.admit(false);
+        if (admission.fail) {
+            return make_result(FAILED, ENOTCONN);
+        }
+        auto result = m_dir->readdir();
+        if (result) {
+            std::this_thread::sleep_until(m_fs.transfer(
+                        admission.deadline, sizeof(Stat) + result->name.size()));
+        }
+        return result;
+    }
+
+    Result<void> fsyncdir() override
+    {
+        return m_fs.injected([this]() { return m_dir->fsyncdir(); });
+    }
+
+    Result<void> closedir() override
+    {
+        return m_dir->closedir();
+    }
+
+    Result<Stat> lstat_entry(std::string_view name) override
+    {
+        return m_fs.injected([this, name]() { return m_dir->lstat_entry(name); });
+    }
+};
+
+template <typename T>
+static Result<std::unique_ptr<Dir>> wrap_dir(FaultInjectingFilesystem &fs, Result<T> &&result)
+{
+    if (!result) {
+        return copy_error(result);
+    }
+    return make_result(std::unique_ptr<Dir>(
+                           std::make_unique<FaultInjectingDir>(fs, std::move(*result))));
+}
+
+template <typename T>
+static Result<std::unique_ptr<File>> wrap_file(FaultInjectingFilesystem &fs, Result<T> &&result)
+{
+    if (!result) {
+        return copy_error(result);
+    }
+    return make_result(std::unique_ptr<File>(
+                           std::make_unique<FaultInjectingFile>(fs, std::move(*result))));
+}
+
+class FaultInjectingDirectoryHandle: public DirectoryHandle {
+public:
+    FaultInjectingDirectoryHandle(FaultInjectingFilesystem &fs,
+                                  std::unique_ptr<DirectoryHandle> &&handle):
+        m_fs(fs),
+        m_handle(std::move(handle))
+    {
+
+    }
+
+private:
+    FaultInjectingFilesystem &m_fs;
+    std::unique_ptr<DirectoryHandle> m_handle;
+
+    // DirectoryHandle interface
+public:
+    Result<std::unique_ptr<File>> open(std::string_view name, int accesstype, mode_t mode) override
+    {
+        return wrap_file(m_fs, m_fs.injected([&]() {
+            return m_handle->open(name, accesstype, mode);
+        }));
+    }
+
+    Result<std::unique_ptr<Dir>> opendir() override
+    {
+        return wrap_dir(m_fs, m_fs.injected([this]() { return m_handle->opendir(); }));
+    }
+
+    Result<Stat> lstat(std::string_view name) override
+    {
+        return m_fs.injected([this, name]() { return m_handle->lstat(name); });
+    }
+
+    void lstat_async(std::string_view name, Completion<Stat> &&done) override
+    {
+        m_fs.injected_async([this, name](Completion<Stat> &&inner) {
+            m_handle->lstat_async(name, std::move(inner));
+        }, std::move(done));
+    }
+
+    Result<std::string> readlink(std::string_view name) override
+    {
+        return m_fs.injected([this, name]() { return m_handle->readlink(name); });
+    }
+
+    Result<bool> is_current() override
+    {
+        return m_fs.injected([this]() { return m_handle->is_current(); });
+    }
+};
+
+static bool parse_number(std::string_view str, double &out)
+{
+    if (str.empty()) {
+        return false;
+    }
+    const std::string buf(str);
+    char *end = nullptr;
+    errno = 0;
+    out = std::strtod(buf.c_str(), &end);
+    return errno == 0 && end == buf.c_str() + buf.size() && out >= 0;
+}
+
+template <typename Duration>
+static Duration from_ms(double ms)
+{
+    return std::chrono::duration_cast<Duration>(
+                std::chrono::duration<double, std::milli>(ms));
+}
+
+}
+
+FaultInjectingFilesystem::FaultInjectingFilesystem(Filesystem &backend,
+                                                   const Config &config):
+    m_backend(backend),
+    m_config(config),
+    m_rng(config.seed),
+    m_injected_failures(0),
+    m_flaps(0),
+    m_stopping(false),
+    m_timer([this]() { run_timers(); })
+{
+
+}
+
+FaultInjectingFilesystem::~FaultInjectingFilesystem()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_timer_mutex);
+        m_stopping = true;
+    }
+    m_timer_cv.notify_all();
+    m_timer.join();
+}
+
+void FaultInjectingFilesystem::run_timers()
+{
+    std::unique_lock<std::mutex> lock(m_timer_mutex);
+    while (true) {
+        if (m_timers.empty()) {
+            if (m_stopping) {
+                return;
+            }
+            m_timer_cv.wait(lock);
+            continue;
+        }
+
+        auto first = m_timers.begin();
+        // completions are owed exactly once, so they are delivered early
+        // instead of being dropped when shutting down
+        if (!m_stopping && first->first > Clock::now()) {
+            m_timer_cv.wait_until(lock, first->first);
+            continue;
+        }
+
+        std::unique_ptr<Delayed> delayed = std::move(first->second);
+        m_timers.erase(first);
+        lock.unlock();
+        delayed->done(std::move(delayed->result));
+        lock.lock();
+    }
+}
+
+void FaultInjectingFilesystem::deliver_at(Clock::time_point deadline,
+                                          std::unique_ptr<Delayed> &&delayed)
+{
+    if (deadline <= Clock::now()) {
+        delayed->done(std::move(delayed->result));
+        return;
+    }
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> guard(m_timer_mutex);
+        auto iter = m_timers.emplace(deadline, std::move(delayed));
+        earliest = iter == m_timers.begin();
+    }
+    if (earliest) {
+        m_timer_cv.notify_all();
+    }
+}
+
+FaultInjectingFilesystem::Admission FaultInjectingFilesystem::admit(bool round_trip)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    const Clock::time_point now = Clock::now();
+
+    Admission result{now, false};
+    if (round_trip) {
+        result.deadline += m_config.latency;
+        const double jitter = double(m_config.jitter.count());
+        if (jitter > 0) {
+            double extra;
+            switch (m_config.jitter_distribution) {
+            case Jitter::EXPONENTIAL:
+                extra = std::exponential_distribution<double>(1. / jitter)(m_rng);
+                break;
+            case Jitter::UNIFORM:
+            default:
+                extra = std::uniform_real_distribution<double>(0., jitter)(m_rng);
+                break;
+            }
+            result.deadline += std::chrono::microseconds(std::int64_t(extra));
+        }
+    }
+
+    if (now < m_down_until) {
+        result.fail = true;
+    } else if (m_config.failure_rate > 0 &&
+               std::uniform_real_distribution<double>(0., 1.)(m_rng) < m_config.failure_rate) {
+        result.fail = true;
+        if (m_config.flap_duration.count() > 0) {
+            m_down_until = now + m_config.flap_duration;
+            m_flaps.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (result.fail) {
+        m_injected_failures.fetch_add(1, std::memory_order_relaxed);
+    }
+    return result;
+}
+
+FaultInjectingFilesystem::Clock::time_point FaultInjectingFilesystem::transfer(
+        Clock::time_point start, std::size_t nbytes)
+{
+    if (m_config.bandwidth == 0) {
+        return start;
+    }
+    const auto duration = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(double(nbytes) / double(m_config.bandwidth)));
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_link_free = std::max(m_link_free, start) + duration;
+    return m_link_free;
+}
+
+void FaultInjectingFilesystem::collect_metrics(Metrics::TextWriter &out) const
+{
+    using Type = Metrics::TextWriter::Type;
+    out.family("dragonstash_backend_injected_failures_total", Type::COUNTER,
+               "Backend operations which failed because of fault injection.");
+    out.sample("", injected_failures());
+    out.family("dragonstash_backend_injected_flaps_total", Type::COUNTER,
+               "Times the backend was taken down by fault injection.");
+    out.sample("", flaps());
+}
+
+Result<FaultInjectingFilesystem::Config> FaultInjectingFilesystem::parse_config(
+        std::string_view spec)
+{
+    Config config;
+    while (!spec.empty()) {
+        const auto comma = spec.find(',');
+        const std::string_view item = spec.substr(0, comma);
+        spec = comma == std::string_view::npos ? std::string_view() : spec.substr(comma + 1);
+
+        const auto eq = item.find('=');
+        if (eq == std::string_view::npos) {
+            return make_result(FAILED, EINVAL);
+        }
+        const std::string_view key = item.substr(0, eq);
+        const std::string_view value = item.substr(eq + 1);
+
+        if (key == "distribution") {
+            if (value == "uniform") {
+                config.jitter_distribution = Jitter::UNIFORM;
+            } else if (value == "exponential") {
+                config.jitter_distribution = Jitter::EXPONENTIAL;
+            } else {
+                return make_result(FAILED, EINVAL);
+            }
+            continue;
+        }
+
+        double number;
+        if (!parse_number(value, number)) {
+            return make_result(FAILED, EINVAL);
+        }
+        if (key == "latency") {
+            config.latency = from_ms<std::chrono::microseconds>(number);
+        } else if (key == "jitter") {
+            config.jitter = from_ms<std::chrono::microseconds>(number);
+        } else if (key == "bandwidth") {
+            config.bandwidth = std::uint64_t(number * 1024);
+        } else if (key == "failure") {
+            if (number > 1) {
+                return make_result(FAILED, EINVAL);
+            }
+            config.failure_rate = number;
+        } else if (key == "flap") {
+            config.flap_duration = from_ms<std::chrono::milliseconds>(number);
+        } else if (key == "seed") {
+            config.seed = std::uint64_t(number);
+        } else {
+            return make_result(FAILED, EINVAL);
+        }
+    }
+    return config;
+}
+
+Result<std::unique_ptr<File>> FaultInjectingFilesystem::open(std::string_view path, int accesstype, mode_t mode)
+{
+    return wrap_file(*this, injected([&]() { return m_backend.open(path, accesstype, mode); }));
+}
+
+Result<std::unique_ptr<Dir>> FaultInjectingFilesystem::opendir(std::string_view path)
+{
+    return wrap_dir(*this, injected([this, path]() { return m_backend.opendir(path); }));
+}
+
+Result<Stat> FaultInjectingFilesystem::lstat(std::string_view path)
+{
+    return injected([this, path]() { return m_backend.lstat(path); });
+}
+
+void FaultInjectingFilesystem::lstat_async(std::string_view path, Completion<Stat> &&done)
+{
+    injected_async([this, path](Completion<Stat> &&inner) {
+        m_backend.lstat_async(path, std::move(inner));
+    }, std::move(done));
+}
+
+Result<std::string> FaultInjectingFilesystem::readlink(std::string_view path)
+{
+    return injected([this, path]() { return m_backend.readlink(path); });
+}
+
+Result<std::unique_ptr<DirectoryHandle>> FaultInjectingFilesystem::open_directory(std::string_view path)
+{
+    auto result = injected([this, path]() { return m_backend.open_directory(path); });
+    if (!result) {
+        return copy_error(result);
+    }
+    return make_result(std::unique_ptr<DirectoryHandle>(
+                           std::make_unique<FaultInjectingDirectoryHandle>(*this, std::move(*result))));
+}
+
+}
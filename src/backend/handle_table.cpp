@@ -0,0 +1,117 @@
+/**********************************************************************
+File name: handle_table.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/backend/handle_table.hpp"
+
+#include <algorithm>
+
+namespace Dragonstash::Backend {
+
+HandleTable::HandleTable(std::size_t capacity):
+    m_capacity(std::max<std::size_t>(capacity, 1))
+{
+
+}
+
+HandleTable::HandlePtr HandleTable::get(Key key)
+{
+    Clock::time_point checked;
+    return get(key, checked);
+}
+
+HandleTable::HandlePtr HandleTable::get(Key key, Clock::time_point &checked)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter == m_index.end()) {
+        return nullptr;
+    }
+    // move to the front of the LRU list
+    m_lru.splice(m_lru.begin(), m_lru, iter->second);
+    checked = iter->second->checked;
+    return iter->second->handle;
+}
+
+void HandleTable::put(Key key, HandlePtr handle)
+{
+    // evicted handles are destroyed (and thus closed) outside of the lock
+    HandlePtr evicted;
+    const Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter != m_index.end()) {
+        evicted = std::move(iter->second->handle);
+        iter->second->handle = std::move(handle);
+        iter->second->checked = now;
+        m_lru.splice(m_lru.begin(), m_lru, iter->second);
+        return;
+    }
+
+    if (m_index.size() >= m_capacity) {
+        evicted = std::move(m_lru.back().handle);
+        m_index.erase(m_lru.back().key);
+        m_lru.pop_back();
+    }
+    m_lru.emplace_front(Record{key, std::move(handle), now});
+    m_index.emplace(key, m_lru.begin());
+}
+
+void HandleTable::mark_checked(Key key)
+{
+    const Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter != m_index.end()) {
+        iter->second->checked = now;
+    }
+}
+
+void HandleTable::invalidate(Key key)
+{
+    HandlePtr evicted;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter == m_index.end()) {
+        return;
+    }
+    evicted = std::move(iter->second->handle);
+    m_lru.erase(iter->second);
+    m_index.erase(iter);
+}
+
+void HandleTable::clear()
+{
+    std::list<Record> evicted;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_index.clear();
+    evicted.swap(m_lru);
+}
+
+std::size_t HandleTable::size()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_index.size();
+}
+
+}
@@ -24,9 +24,12 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include "dragonstash/backend/in_memory.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <thread>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -34,6 +37,43 @@ namespace Dragonstash::Backend {
 
 namespace InMemory {
 
+void Network::configure(const Config &config)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_config = config;
+}
+
+Network::Config Network::config() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_config;
+}
+
+void Network::round_trip()
+{
+    const auto latency = config().latency;
+    if (latency.count() > 0) {
+        std::this_thread::sleep_for(latency);
+    }
+}
+
+void Network::transfer(std::size_t nbytes)
+{
+    Clock::time_point done;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_config.bandwidth == 0) {
+            return;
+        }
+        // transfers queue behind each other on the link
+        const auto duration = std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(double(nbytes) / double(m_config.bandwidth)));
+        m_link_free = std::max(m_link_free, Clock::now()) + duration;
+        done = m_link_free;
+    }
+    std::this_thread::sleep_until(done);
+}
+
 Node::Node(const Stat &attr):
     m_attr(attr)
 {
@@ -146,8 +186,9 @@ void Directory::remove(const std::string &name)
     m_children.erase(iter);
 }
 
-DirHandle::DirHandle(Directory &node):
+DirHandle::DirHandle(Directory &node, Network *network):
     m_node(&node),
+    m_network(network),
     m_state(DOT),
     m_iter(m_node->children().begin())
 {
@@ -184,17 +225,31 @@ Result<DirEntry> DirHandle::readdir()
 
     auto iter = m_iter;
     ++m_iter;
+    if (m_network) {
+        m_network->transfer(sizeof(Stat) + iter->first.size());
+    }
 
-    // TODO: allow complete dir entry results, because SFTP will return those.
+    // the attributes are at hand, so return a complete entry, like a remote
+    // backend which gets attributes with the directory listing would
     return DirEntry{
-        Stat{
-            .ino = 0,
-        },
+        iter->second->attr(),
         iter->first,
-        false,
+        true,
     };
 }
 
+Result<Stat> DirHandle::lstat_entry(std::string_view name)
+{
+    if (m_network) {
+        m_network->round_trip();
+    }
+    auto iter = m_node->children().find(std::string(name));
+    if (iter == m_node->children().end()) {
+        return make_result(FAILED, ENOENT);
+    }
+    return iter->second->attr();
+}
+
 Result<void> DirHandle::fsyncdir()
 {
     return make_result(FAILED, EOPNOTSUPP);
@@ -207,8 +262,9 @@ Result<void> DirHandle::closedir()
 
 DirHandle::~DirHandle() = default;
 
-FileHandle::FileHandle(InMemory::File &file):
-    m_file(&file)
+FileHandle::FileHandle(InMemory::File &file, Network *network):
+    m_file(&file),
+    m_network(network)
 {
 
 }
@@ -217,6 +273,9 @@ FileHandle::~FileHandle() = default;
 
 Result<Stat> FileHandle::fstat()
 {
+    if (m_network) {
+        m_network->round_trip();
+    }
     return m_file->attr();
 }
 
@@ -233,6 +292,10 @@ Result<ssize_t> FileHandle::pread(void *buf, size_t count, off_t offset)
     if (end_offset > data.size()) {
         count -= (end_offset - data.size());
     }
+    if (m_network) {
+        m_network->round_trip();
+        m_network->transfer(count);
+    }
     memcpy(buf, &data[offset], count);
     return make_result(count);
 }
@@ -242,6 +305,10 @@ Result<ssize_t> FileHandle::pwrite(const void *buf, size_t count, off_t offset)
     if (offset < 0) {
         return make_result(FAILED, EINVAL);
     }
+    if (m_network) {
+        m_network->round_trip();
+        m_network->transfer(count);
+    }
     const std::size_t required_size = offset + count;
     auto &data = m_file->data();
     if (data.size() < required_size) {
@@ -257,6 +324,16 @@ Result<void> FileHandle::fsync()
     return make_result();
 }
 
+Result<void> FileHandle::ftruncate(off_t size)
+{
+    if (size < 0) {
+        return make_result(FAILED, EINVAL);
+    }
+    m_file->data().resize(static_cast<std::size_t>(size));
+    m_file->attr().size = static_cast<std::uint64_t>(size);
+    return make_result();
+}
+
 Result<void> FileHandle::close()
 {
     return make_result();
@@ -274,11 +351,29 @@ Result<std::unique_ptr<File> > InMemoryFilesystem::open(std::string_view path, i
     if (!m_connected) {
         return make_result(FAILED, ENOTCONN);
     }
+    m_network.round_trip();
 
     Result<InMemory::Node*> node = find(path);
+    if (!node && node.error() == ENOENT && (accesstype & O_CREAT)) {
+        const auto slash = path.find_last_of('/');
+        auto parent = find(slash == 0 ? std::string_view("/") : path.substr(0, slash));
+        if (!parent) {
+            return copy_error(parent);
+        }
+        auto *dir = dynamic_cast<InMemory::Directory*>(*parent);
+        if (!dir) {
+            return make_result(FAILED, ENOTDIR);
+        }
+        auto &file = dir->emplace<InMemory::File>(path.substr(slash + 1));
+        file.attr().mode = S_IFREG | (mode & 07777);
+        return std::make_unique<InMemory::FileHandle>(file, &m_network);
+    }
     if (!node) {
         return copy_error(node);
     }
+    if (accesstype & O_EXCL) {
+        return make_result(FAILED, EEXIST);
+    }
     {
         auto *dir = dynamic_cast<InMemory::Directory*>(*node);
         if (dir) {
@@ -289,7 +384,7 @@ Result<std::unique_ptr<File> > InMemoryFilesystem::open(std::string_view path, i
     if (!file) {
         return make_result(FAILED, EINVAL);
     }
-    return std::make_unique<InMemory::FileHandle>(*file);
+    return std::make_unique<InMemory::FileHandle>(*file, &m_network);
 }
 
 Result<std::unique_ptr<Dir> > InMemoryFilesystem::opendir(std::string_view path)
@@ -297,6 +392,7 @@ Result<std::unique_ptr<Dir> > InMemoryFilesystem::opendir(std::string_view path)
     if (!m_connected) {
         return make_result(FAILED, ENOTCONN);
     }
+    m_network.round_trip();
 
     Result<InMemory::Node*> node = find(path);
     if (!node) {
@@ -306,7 +402,7 @@ Result<std::unique_ptr<Dir> > InMemoryFilesystem::opendir(std::string_view path)
     if (!dir) {
         return make_result(FAILED, ENOTDIR);
     }
-    return std::make_unique<InMemory::DirHandle>(*dir);
+    return std::make_unique<InMemory::DirHandle>(*dir, &m_network);
 }
 
 Result<Stat> InMemoryFilesystem::lstat(std::string_view path)
@@ -314,6 +410,7 @@ Result<Stat> InMemoryFilesystem::lstat(std::string_view path)
     if (!m_connected) {
         return make_result(FAILED, ENOTCONN);
     }
+    m_network.round_trip();
 
     Result<InMemory::Node*> node = find(path);
     if (!node) {
@@ -327,6 +424,7 @@ Result<std::string> InMemoryFilesystem::readlink(std::string_view path)
     if (!m_connected) {
         return make_result(FAILED, ENOTCONN);
     }
+    m_network.round_trip();
 
     Result<InMemory::Node*> node = find(path);
     if (!node) {
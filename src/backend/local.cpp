@@ -90,6 +90,14 @@ Result<ssize_t> LocalFile::pwrite(const void *buf, size_t count, off_t offset)
     return result;
 }
 
+Result<void> LocalFile::ftruncate(off_t size)
+{
+    if (::ftruncate(m_fd, size) < 0) {
+        return Result<void>(FAILED, errno);
+    }
+    return Result<void>();
+}
+
 Result<void> LocalFile::fsync()
 {
     if (::fsync(m_fd) < 0) {
@@ -170,6 +178,23 @@ Result<void> LocalDir::fsyncdir()
     return Result<void>();
 }
 
+Result<Stat> LocalDir::lstat_entry(std::string_view name)
+{
+    if (name.empty() || name.find('/') != std::string_view::npos) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    // relative to the directory fd, the kernel does not have to walk the
+    // full path for each entry
+    const std::string name_buf(name);
+    struct stat buf{};
+    if (::fstatat(dirfd(m_fd), name_buf.c_str(), &buf, AT_SYMLINK_NOFOLLOW) < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    return from_os_stat(buf);
+}
+
 Result<void> LocalDir::closedir()
 {
     if (::closedir(m_fd) < 0) {
@@ -179,6 +204,131 @@ Result<void> LocalDir::closedir()
     return Result<void>();
 }
 
+/**
+ * Read a link with a known (lstat) size; shared by the path and the
+ * directory-relative implementation.
+ */
+template <typename Readlink>
+static Result<std::string> read_link_buffer(const struct stat &stat_buf,
+                                            Readlink &&do_readlink)
+{
+    std::string link_buf;
+    // add one char to be able to see if the link grew in the meantime
+    link_buf.resize(stat_buf.st_size + 1);
+    ssize_t link_size = do_readlink(link_buf.data(), link_buf.size());
+    if (link_size < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    if (link_size > stat_buf.st_size) {
+        // ??? meh.
+    }
+
+    link_buf.resize(link_size);
+    return link_buf;
+}
+
+LocalDirectoryHandle::LocalDirectoryHandle(int fd, std::string path):
+    m_fd(fd),
+    m_path(std::move(path))
+{
+
+}
+
+LocalDirectoryHandle::~LocalDirectoryHandle()
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+Result<std::unique_ptr<File>> LocalDirectoryHandle::open(std::string_view name,
+                                                         int accesstype,
+                                                         mode_t mode)
+{
+    if (!is_valid_entry_name(name)) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    const std::string name_buf(name);
+    int fd = ::openat(m_fd, name_buf.c_str(), accesstype, mode);
+    if (fd < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    return std::make_unique<LocalFile>(fd);
+}
+
+Result<std::unique_ptr<Dir>> LocalDirectoryHandle::opendir()
+{
+    // fdopendir takes ownership of the fd and uses its offset, so the stream
+    // needs its own
+    int fd = ::openat(m_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    DIR *dir = ::fdopendir(fd);
+    if (dir == nullptr) {
+        const int err = errno;
+        ::close(fd);
+        return make_result(FAILED, err);
+    }
+
+    return std::make_unique<LocalDir>(dir);
+}
+
+Result<Stat> LocalDirectoryHandle::lstat(std::string_view name)
+{
+    if (!is_valid_entry_name(name)) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    const std::string name_buf(name);
+    struct stat buf{};
+    if (::fstatat(m_fd, name_buf.c_str(), &buf, AT_SYMLINK_NOFOLLOW) < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    return from_os_stat(buf);
+}
+
+Result<std::string> LocalDirectoryHandle::readlink(std::string_view name)
+{
+    if (!is_valid_entry_name(name)) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    const std::string name_buf(name);
+    struct stat stat_buf{};
+    if (::fstatat(m_fd, name_buf.c_str(), &stat_buf, AT_SYMLINK_NOFOLLOW) < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    return read_link_buffer(stat_buf, [this, &name_buf](char *buf, std::size_t size){
+        return ::readlinkat(m_fd, name_buf.c_str(), buf, size);
+    });
+}
+
+Result<bool> LocalDirectoryHandle::is_current()
+{
+    struct stat fd_buf{};
+    if (::fstat(m_fd, &fd_buf) < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    struct stat path_buf{};
+    if (::lstat(m_path.c_str(), &path_buf) < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return make_result(false);
+        }
+        return make_result(FAILED, errno);
+    }
+
+    return make_result(fd_buf.st_dev == path_buf.st_dev &&
+                       fd_buf.st_ino == path_buf.st_ino);
+}
+
 LocalFilesystem::LocalFilesystem(const std::filesystem::path &root):
     m_root(root)
 {
@@ -267,17 +417,24 @@ Result<std::string> LocalFilesystem::readlink(std::string_view path)
         return make_result(FAILED, errno);
     }
 
-    std::string link_buf;
-    // add one char to be able to see if the link grew in the meantime
-    link_buf.resize(stat_buf.st_size + 1);
-    ssize_t link_size = ::readlink(full_path->c_str(), link_buf.data(), link_buf.size());
+    return read_link_buffer(stat_buf, [&full_path](char *buf, std::size_t size){
+        return ::readlink(full_path->c_str(), buf, size);
+    });
+}
 
-    if (link_size > stat_buf.st_size) {
-        // ??? meh.
+Result<std::unique_ptr<DirectoryHandle>> LocalFilesystem::open_directory(std::string_view path)
+{
+    const auto full_path = map_path(path);
+    if (!full_path) {
+        return copy_error(full_path);
     }
 
-    link_buf.resize(link_size);
-    return link_buf;
+    int fd = ::open(full_path->c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    return std::make_unique<LocalDirectoryHandle>(fd, std::move(*full_path));
 }
 
 }
@@ -0,0 +1,1088 @@
+/**********************************************************************
+File name: sftp.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/backend/sftp.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <deque>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace Dragonstash::Backend {
+
+using Sftp::PacketType;
+
+static Result<void> send_all(int fd, struct iovec *iov, std::size_t iovcnt)
+{
+    while (iovcnt > 0) {
+        struct msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        const ssize_t sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return make_result(FAILED, errno);
+        }
+
+        // skip what has been sent
+        std::size_t remaining = static_cast<std::size_t>(sent);
+        while (iovcnt > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+    return make_result();
+}
+
+static Result<void> read_all(int fd, char *buf, std::size_t size)
+{
+    while (size > 0) {
+        const ssize_t received = ::read(fd, buf, size);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return make_result(FAILED, errno);
+        }
+        if (received == 0) {
+            return make_result(FAILED, ENOTCONN);
+        }
+        buf += received;
+        size -= static_cast<std::size_t>(received);
+    }
+    return make_result();
+}
+
+static std::string join_path(std::string_view base, std::string_view name)
+{
+    if (base == ".") {
+        return std::string(name);
+    }
+    std::string result(base);
+    if (result.empty() || result.back() != '/') {
+        result.push_back('/');
+    }
+    result.append(name);
+    return result;
+}
+
+SftpSession::SftpSession(int fd, pid_t child):
+    m_fd(fd),
+    m_child(child),
+    m_connected(true),
+    m_next_id(0),
+    m_handles(0),
+    m_dispatch(std::make_shared<Dispatch>()),
+    m_dispatcher(&SftpSession::dispatch, m_dispatch)
+{
+
+}
+
+SftpSession::~SftpSession()
+{
+    disconnect();
+    if (m_reader.joinable()) {
+        m_reader.join();
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_dispatch->mutex);
+        m_dispatch->stopped = true;
+        m_dispatch->cv.notify_all();
+    }
+    if (m_dispatcher.get_id() == std::this_thread::get_id()) {
+        // destroyed by one of its callbacks; the thread finishes the queue
+        // on its own
+        m_dispatcher.detach();
+    } else {
+        m_dispatcher.join();
+    }
+    ::close(m_fd);
+    if (m_child > 0) {
+        ::kill(m_child, SIGTERM);
+        ::waitpid(m_child, nullptr, 0);
+    }
+}
+
+Result<std::unique_ptr<SftpSession>> SftpSession::spawn(const std::vector<std::string> &argv)
+{
+    if (argv.empty()) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    // prepared before forking; the child must not allocate
+    std::vector<char*> args;
+    args.reserve(argv.size() + 1);
+    for (const std::string &arg: argv) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return make_result(FAILED, errno);
+    }
+
+    const pid_t child = ::fork();
+    if (child < 0) {
+        const int err = errno;
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return make_result(FAILED, err);
+    }
+    if (child == 0) {
+        // dup2 clears close-on-exec on the copies
+        ::dup2(fds[1], STDIN_FILENO);
+        ::dup2(fds[1], STDOUT_FILENO);
+        ::execvp(args[0], args.data());
+        ::_exit(127);
+    }
+
+    ::close(fds[1]);
+    return std::make_unique<SftpSession>(fds[0], child);
+}
+
+Result<void> SftpSession::write_packet(PacketType type,
+                                       const std::uint32_t *id,
+                                       std::string_view body)
+{
+    Sftp::Encoder header;
+    header.u32(static_cast<std::uint32_t>(1 + (id ? 4 : 0) + body.size()));
+    header.u8(static_cast<std::uint8_t>(type));
+    if (id) {
+        header.u32(*id);
+    }
+
+    struct iovec iov[2] = {
+        {const_cast<char*>(header.data().data()), header.data().size()},
+        {const_cast<char*>(body.data()), body.size()},
+    };
+    std::lock_guard<std::mutex> guard(m_write_mutex);
+    return send_all(m_fd, iov, body.empty() ? 1 : 2);
+}
+
+Result<std::string> SftpSession::read_packet()
+{
+    char length_buf[4];
+    auto read_result = read_all(m_fd, length_buf, sizeof(length_buf));
+    if (!read_result) {
+        return copy_error(read_result);
+    }
+
+    std::uint32_t length = 0;
+    if (!Sftp::Decoder(std::string_view(length_buf, sizeof(length_buf))).u32(length) ||
+            length == 0 || length > Sftp::MAX_PACKET_SIZE) {
+        return make_result(FAILED, EBADMSG);
+    }
+
+    std::string packet(length, '\0');
+    read_result = read_all(m_fd, packet.data(), packet.size());
+    if (!read_result) {
+        return copy_error(read_result);
+    }
+    return packet;
+}
+
+void SftpSession::disconnect()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_connected) {
+        return;
+    }
+    m_connected = false;
+    // wakes the reader thread
+    ::shutdown(m_fd, SHUT_RDWR);
+    m_reply_cv.notify_all();
+
+    std::lock_guard<std::mutex> dispatch_guard(m_dispatch->mutex);
+    for (auto iter = m_pending.begin(); iter != m_pending.end();) {
+        if (!iter->second.callback) {
+            // left for receive()
+            ++iter;
+            continue;
+        }
+        m_dispatch->queue.emplace_back(std::move(iter->second.callback),
+                                       make_result(FAILED, ENOTCONN));
+        iter = m_pending.erase(iter);
+    }
+    m_dispatch->cv.notify_all();
+}
+
+void SftpSession::dispatch(std::shared_ptr<Dispatch> state)
+{
+    std::unique_lock<std::mutex> guard(state->mutex);
+    while (true) {
+        state->cv.wait(guard, [&state]() {
+            return state->stopped || !state->queue.empty();
+        });
+        if (state->queue.empty()) {
+            return;
+        }
+        auto item = std::move(state->queue.front());
+        state->queue.pop_front();
+        guard.unlock();
+        item.first(std::move(item.second));
+        // destroy the callback outside of the lock as well
+        item.first = nullptr;
+        guard.lock();
+    }
+}
+
+void SftpSession::run()
+{
+    while (true) {
+        auto packet = read_packet();
+        if (!packet) {
+            break;
+        }
+
+        Sftp::Decoder decoder(*packet);
+        std::uint8_t type = 0;
+        std::uint32_t id = 0;
+        if (!decoder.u8(type) || !decoder.u32(id)) {
+            break;
+        }
+
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto iter = m_pending.find(id);
+        if (iter == m_pending.end() || iter->second.reply) {
+            // the server is confused
+            continue;
+        }
+        Reply reply{static_cast<PacketType>(type), packet->substr(5)};
+        if (iter->second.callback) {
+            std::lock_guard<std::mutex> dispatch_guard(m_dispatch->mutex);
+            m_dispatch->queue.emplace_back(std::move(iter->second.callback),
+                                           std::move(reply));
+            m_dispatch->cv.notify_all();
+            m_pending.erase(iter);
+            continue;
+        }
+        iter->second.reply = std::move(reply);
+        m_reply_cv.notify_all();
+    }
+    disconnect();
+}
+
+Result<void> SftpSession::init()
+{
+    Sftp::Encoder body;
+    body.u32(Sftp::PROTOCOL_VERSION);
+    auto write_result = write_packet(PacketType::INIT, nullptr, body.data());
+    if (!write_result) {
+        disconnect();
+        return make_result(FAILED, ENOTCONN);
+    }
+
+    auto packet = read_packet();
+    if (!packet) {
+        disconnect();
+        return make_result(FAILED, ENOTCONN);
+    }
+
+    // extensions after the version are not used
+    Sftp::Decoder decoder(*packet);
+    std::uint8_t type = 0;
+    std::uint32_t version = 0;
+    if (!decoder.u8(type) || type != static_cast<std::uint8_t>(PacketType::VERSION) ||
+            !decoder.u32(version) || version != Sftp::PROTOCOL_VERSION) {
+        disconnect();
+        return make_result(FAILED, EPROTO);
+    }
+
+    m_reader = std::thread(&SftpSession::run, this);
+    return make_result();
+}
+
+Result<std::uint32_t> SftpSession::send_pending(PacketType type,
+                                                std::string_view body,
+                                                Callback *callback)
+{
+    std::uint32_t id = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (!m_connected) {
+            return make_result(FAILED, ENOTCONN);
+        }
+        id = m_next_id++;
+        Pending &pending = m_pending[id];
+        if (callback) {
+            pending.callback = std::move(*callback);
+        }
+    }
+
+    auto write_result = write_packet(type, &id, body);
+    if (!write_result) {
+        // hands a callback to the dispatcher
+        disconnect();
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_pending.erase(id);
+        return make_result(FAILED, ENOTCONN);
+    }
+    return id;
+}
+
+Result<std::uint32_t> SftpSession::send(PacketType type, std::string_view body)
+{
+    return send_pending(type, body, nullptr);
+}
+
+void SftpSession::send_async(PacketType type, std::string_view body,
+                             Callback &&callback)
+{
+    auto id = send_pending(type, body, &callback);
+    if (!id && callback) {
+        // never queued
+        callback(copy_error(id));
+    }
+}
+
+Result<SftpSession::Reply> SftpSession::receive(std::uint32_t id)
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto iter = m_pending.find(id);
+    if (iter == m_pending.end()) {
+        return make_result(FAILED, EINVAL);
+    }
+    // other senders may rehash the map while this one waits
+    m_reply_cv.wait(guard, [this, id, &iter]() {
+        iter = m_pending.find(id);
+        return iter->second.reply || !m_connected;
+    });
+
+    std::optional<Reply> reply = std::move(iter->second.reply);
+    m_pending.erase(iter);
+    if (!reply) {
+        return make_result(FAILED, ENOTCONN);
+    }
+    return std::move(*reply);
+}
+
+Result<SftpSession::Reply> SftpSession::call(PacketType type, std::string_view body)
+{
+    auto id = send(type, body);
+    if (!id) {
+        return copy_error(id);
+    }
+    return receive(*id);
+}
+
+bool SftpSession::connected() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_connected;
+}
+
+std::size_t SftpSession::load() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_pending.size() + m_handles.load(std::memory_order_relaxed);
+}
+
+void SftpSession::add_handle()
+{
+    m_handles.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SftpSession::remove_handle()
+{
+    m_handles.fetch_sub(1, std::memory_order_relaxed);
+}
+
+Result<void> sftp_status(const SftpSession::Reply &reply)
+{
+    if (reply.type != PacketType::STATUS) {
+        return make_result(FAILED, EBADMSG);
+    }
+    std::uint32_t status = 0;
+    if (!Sftp::Decoder(reply.body).u32(status)) {
+        return make_result(FAILED, EBADMSG);
+    }
+    const int err = Sftp::status_to_errno(status);
+    if (err != 0) {
+        return make_result(FAILED, err);
+    }
+    return make_result();
+}
+
+/**
+ * @brief Error of a reply which is not of the expected type.
+ */
+static int reply_error(const SftpSession::Reply &reply)
+{
+    auto status = sftp_status(reply);
+    return status ? EBADMSG : status.error();
+}
+
+static Result<std::string> handle_reply(const Result<SftpSession::Reply> &reply)
+{
+    if (!reply) {
+        return copy_error(reply);
+    }
+    if (reply->type != PacketType::HANDLE) {
+        return make_result(FAILED, reply_error(*reply));
+    }
+    std::string_view handle;
+    if (!Sftp::Decoder(reply->body).string(handle)) {
+        return make_result(FAILED, EBADMSG);
+    }
+    return std::string(handle);
+}
+
+static Result<Stat> attrs_reply(const Result<SftpSession::Reply> &reply)
+{
+    if (!reply) {
+        return copy_error(reply);
+    }
+    if (reply->type != PacketType::ATTRS) {
+        return make_result(FAILED, reply_error(*reply));
+    }
+    Stat attr{};
+    std::uint32_t flags = 0;
+    if (!Sftp::Decoder(reply->body).attrs(attr, flags)) {
+        return make_result(FAILED, EBADMSG);
+    }
+    return attr;
+}
+
+namespace {
+
+class SftpFile: public File {
+public:
+    SftpFile(std::shared_ptr<SftpSession> session, std::string handle,
+             const SftpFilesystem::Config &config):
+        m_session(std::move(session)),
+        m_handle(std::move(handle)),
+        m_chunk_size(std::max<std::size_t>(config.chunk_size, 1)),
+        m_max_outstanding(std::max<std::size_t>(config.max_outstanding, 1))
+    {
+        m_session->add_handle();
+    }
+
+    ~SftpFile() override
+    {
+        if (m_session) {
+            (void)close();
+        }
+    }
+
+private:
+    std::shared_ptr<SftpSession> m_session;
+    std::string m_handle;
+    const std::size_t m_chunk_size;
+    const std::size_t m_max_outstanding;
+
+    struct Chunk {
+        std::uint32_t id;
+        std::size_t pos;
+        std::size_t size;
+    };
+
+public:
+    Result<Stat> fstat() override
+    {
+        Sftp::Encoder body;
+        body.string(m_handle);
+        return attrs_reply(m_session->call(PacketType::FSTAT, body.data()));
+    }
+
+    Result<ssize_t> pread(void *buf, size_t count, off_t offset) override
+    {
+        std::deque<Chunk> in_flight;
+        std::size_t next = 0;
+        std::size_t done = 0;
+        bool end = false;
+        int err = 0;
+
+        while (true) {
+            while (!end && err == 0 && next < count && in_flight.size() < m_max_outstanding) {
+                const std::size_t size = std::min(m_chunk_size, count - next);
+                Sftp::Encoder body;
+                body.string(m_handle)
+                        .u64(static_cast<std::uint64_t>(offset) + next)
+                        .u32(static_cast<std::uint32_t>(size));
+                auto id = m_session->send(PacketType::READ, body.data());
+                if (!id) {
+                    err = id.error();
+                    break;
+                }
+                in_flight.emplace_back(Chunk{*id, next, size});
+                next += size;
+            }
+            if (in_flight.empty()) {
+                break;
+            }
+
+            const Chunk chunk = in_flight.front();
+            in_flight.pop_front();
+            auto reply = m_session->receive(chunk.id);
+            if (end || err != 0) {
+                // only draining the replies to requests sent ahead
+                continue;
+            }
+            if (!reply) {
+                err = reply.error();
+                continue;
+            }
+
+            if (reply->type != PacketType::DATA) {
+                auto status = sftp_status(*reply);
+                if (!status && status.error() == ENODATA) {
+                    end = true;
+                } else {
+                    err = status ? EBADMSG : status.error();
+                }
+                continue;
+            }
+
+            std::string_view data;
+            if (!Sftp::Decoder(reply->body).string(data) || data.size() > chunk.size) {
+                err = EBADMSG;
+                continue;
+            }
+            std::memcpy(static_cast<char*>(buf) + chunk.pos, data.data(), data.size());
+            done = chunk.pos + data.size();
+            // servers only return less than asked for at the end of the file
+            end = data.size() < chunk.size;
+        }
+
+        if (err != 0 && done == 0) {
+            return make_result(FAILED, err);
+        }
+        return static_cast<ssize_t>(done);
+    }
+
+    Result<ssize_t> pwrite(const void *buf, size_t count, off_t offset) override
+    {
+        std::deque<Chunk> in_flight;
+        std::size_t next = 0;
+        std::size_t done = 0;
+        int err = 0;
+
+        while (true) {
+            while (err == 0 && next < count && in_flight.size() < m_max_outstanding) {
+                const std::size_t size = std::min(m_chunk_size, count - next);
+                Sftp::Encoder body;
+                body.string(m_handle)
+                        .u64(static_cast<std::uint64_t>(offset) + next)
+                        .string(std::string_view(static_cast<const char*>(buf) + next, size));
+                auto id = m_session->send(PacketType::WRITE, body.data());
+                if (!id) {
+                    err = id.error();
+                    break;
+                }
+                in_flight.emplace_back(Chunk{*id, next, size});
+                next += size;
+            }
+            if (in_flight.empty()) {
+                break;
+            }
+
+            const Chunk chunk = in_flight.front();
+            in_flight.pop_front();
+            auto reply = m_session->receive(chunk.id);
+            if (err != 0) {
+                continue;
+            }
+            if (!reply) {
+                err = reply.error();
+                continue;
+            }
+            auto status = sftp_status(*reply);
+            if (!status) {
+                err = status.error();
+                continue;
+            }
+            done = chunk.pos + chunk.size;
+        }
+
+        if (err != 0 && done == 0) {
+            return make_result(FAILED, err);
+        }
+        return static_cast<ssize_t>(done);
+    }
+
+    Result<void> ftruncate(off_t size) override
+    {
+        if (size < 0) {
+            return make_result(FAILED, EINVAL);
+        }
+        Stat attr{};
+        attr.size = static_cast<std::uint64_t>(size);
+        Sftp::Encoder body;
+        body.string(m_handle).attrs(attr, Sftp::ATTR_SIZE);
+        auto reply = m_session->call(PacketType::FSETSTAT, body.data());
+        if (!reply) {
+            return copy_error(reply);
+        }
+        return sftp_status(*reply);
+    }
+
+    Result<void> fsync() override
+    {
+        // servers without the extension answer with OP_UNSUPPORTED
+        Sftp::Encoder body;
+        body.string("fsync@openssh.com").string(m_handle);
+        auto reply = m_session->call(PacketType::EXTENDED, body.data());
+        if (!reply) {
+            return copy_error(reply);
+        }
+        return sftp_status(*reply);
+    }
+
+    Result<void> close() override
+    {
+        Sftp::Encoder body;
+        body.string(m_handle);
+        auto reply = m_session->call(PacketType::CLOSE, body.data());
+        m_session->remove_handle();
+        m_session.reset();
+        if (!reply) {
+            return copy_error(reply);
+        }
+        return sftp_status(*reply);
+    }
+
+};
+
+class SftpDir: public Dir {
+public:
+    SftpDir(std::shared_ptr<SftpSession> session, std::string handle,
+            std::string path):
+        m_session(std::move(session)),
+        m_handle(std::move(handle)),
+        m_path(std::move(path)),
+        m_end(false)
+    {
+        m_session->add_handle();
+    }
+
+    ~SftpDir() override
+    {
+        if (m_session) {
+            (void)closedir();
+        }
+    }
+
+private:
+    std::shared_ptr<SftpSession> m_session;
+    std::string m_handle;
+    std::string m_path;
+
+    std::deque<DirEntry> m_entries;
+    std::optional<std::uint32_t> m_pending;
+    bool m_end;
+
+    Result<void> request_more()
+    {
+        Sftp::Encoder body;
+        body.string(m_handle);
+        auto id = m_session->send(PacketType::READDIR, body.data());
+        if (!id) {
+            return copy_error(id);
+        }
+        m_pending = *id;
+        return make_result();
+    }
+
+    Result<void> receive_more()
+    {
+        const std::uint32_t id = *m_pending;
+        m_pending.reset();
+        auto reply = m_session->receive(id);
+        if (!reply) {
+            return copy_error(reply);
+        }
+
+        if (reply->type != PacketType::NAME) {
+            auto status = sftp_status(*reply);
+            if (!status && status.error() == ENODATA) {
+                m_end = true;
+                return make_result();
+            }
+            return make_result(FAILED, status ? EBADMSG : status.error());
+        }
+
+        Sftp::Decoder decoder(reply->body);
+        std::uint32_t count = 0;
+        if (!decoder.u32(count)) {
+            return make_result(FAILED, EBADMSG);
+        }
+        for (std::uint32_t i = 0; i < count; ++i) {
+            std::string_view name, longname;
+            Stat attr{};
+            std::uint32_t flags = 0;
+            if (!decoder.string(name) || !decoder.string(longname) ||
+                    !decoder.attrs(attr, flags)) {
+                return make_result(FAILED, EBADMSG);
+            }
+            m_entries.emplace_back(DirEntry{
+                                       attr,
+                                       std::string(name),
+                                       (flags & Sftp::ATTR_ALL) == Sftp::ATTR_ALL,
+                                   });
+        }
+        return make_result();
+    }
+
+public:
+    Result<DirEntry> readdir() override
+    {
+        while (m_entries.empty()) {
+            if (m_end) {
+                return make_result(FAILED, 0);
+            }
+            if (!m_pending) {
+                auto request_result = request_more();
+                if (!request_result) {
+                    return copy_error(request_result);
+                }
+            }
+            auto receive_result = receive_more();
+            if (!receive_result) {
+                return copy_error(receive_result);
+            }
+            if (!m_end) {
+                // the next batch is on its way while this one is consumed;
+                // failures show up when it is needed
+                (void)request_more();
+            }
+        }
+
+        DirEntry entry = std::move(m_entries.front());
+        m_entries.pop_front();
+        return entry;
+    }
+
+    Result<void> fsyncdir() override
+    {
+        return make_result();
+    }
+
+    Result<void> closedir() override
+    {
+        if (m_pending) {
+            (void)m_session->receive(*m_pending);
+            m_pending.reset();
+        }
+        Sftp::Encoder body;
+        body.string(m_handle);
+        auto reply = m_session->call(PacketType::CLOSE, body.data());
+        m_session->remove_handle();
+        m_session.reset();
+        if (!reply) {
+            return copy_error(reply);
+        }
+        return sftp_status(*reply);
+    }
+
+    Result<Stat> lstat_entry(std::string_view name) override
+    {
+        if (!is_valid_entry_name(name)) {
+            return make_result(FAILED, EINVAL);
+        }
+        Sftp::Encoder body;
+        body.string(join_path(m_path, name));
+        return attrs_reply(m_session->call(PacketType::LSTAT, body.data()));
+    }
+
+};
+
+}
+
+SftpFilesystem::SftpFilesystem(Connector connector):
+    SftpFilesystem(std::move(connector), Config())
+{
+
+}
+
+SftpFilesystem::SftpFilesystem(Connector connector, const Config &config):
+    m_connector(std::move(connector)),
+    m_config(config)
+{
+
+}
+
+Result<std::shared_ptr<SftpSession>> SftpFilesystem::session()
+{
+    std::lock_guard<std::mutex> guard(m_pool_mutex);
+    m_sessions.erase(std::remove_if(m_sessions.begin(), m_sessions.end(),
+                                    [](const auto &session) { return !session->connected(); }),
+                     m_sessions.end());
+
+    std::shared_ptr<SftpSession> best;
+    std::size_t best_load = 0;
+    for (const auto &session: m_sessions) {
+        const std::size_t load = session->load();
+        if (!best || load < best_load) {
+            best = session;
+            best_load = load;
+        }
+    }
+    if (best && best_load == 0) {
+        return best;
+    }
+
+    if (m_sessions.size() < std::max<std::size_t>(m_config.connections, 1)) {
+        auto connect_result = m_connector();
+        if (connect_result) {
+            std::shared_ptr<SftpSession> session(std::move(*connect_result));
+            m_sessions.push_back(session);
+            return session;
+        }
+    }
+    if (!best) {
+        // whatever went wrong, the server cannot be reached
+        return make_result(FAILED, ENOTCONN);
+    }
+    return best;
+}
+
+std::size_t SftpFilesystem::sessions()
+{
+    std::lock_guard<std::mutex> guard(m_pool_mutex);
+    return m_sessions.size();
+}
+
+Result<SftpFilesystem::Target> SftpFilesystem::parse_url(std::string_view url)
+{
+    static constexpr std::string_view SCHEME = "sftp://";
+
+    Target target;
+    std::string_view userhost;
+    std::string_view port;
+    if (url.substr(0, SCHEME.size()) == SCHEME) {
+        std::string_view rest = url.substr(SCHEME.size());
+        const auto slash = rest.find('/');
+        std::string_view authority = rest.substr(0, slash);
+        if (slash != std::string_view::npos) {
+            target.root = std::string(rest.substr(slash));
+        }
+
+        const auto at = authority.rfind('@');
+        const auto colon = authority.find(':', at == std::string_view::npos ? 0 : at + 1);
+        userhost = authority.substr(0, colon);
+        if (colon != std::string_view::npos) {
+            port = authority.substr(colon + 1);
+            if (port.empty() || port.size() > 5 ||
+                    !std::all_of(port.begin(), port.end(), [](char ch) { return ch >= '0' && ch <= '9'; }) ||
+                    std::stoul(std::string(port)) == 0 ||
+                    std::stoul(std::string(port)) > 65535) {
+                return make_result(FAILED, EINVAL);
+            }
+        }
+    } else {
+        const auto colon = url.find(':');
+        if (colon == std::string_view::npos) {
+            return make_result(FAILED, EINVAL);
+        }
+        userhost = url.substr(0, colon);
+        target.root = std::string(url.substr(colon + 1));
+    }
+
+    const auto at = userhost.rfind('@');
+    const std::string_view host = at == std::string_view::npos ? userhost : userhost.substr(at + 1);
+    // a leading dash would be taken as an option by ssh
+    if (host.empty() || userhost.front() == '-' || at == 0) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    target.command = {"ssh", "-x", "-a", "-o", "ClearAllForwardings=yes"};
+    if (!port.empty()) {
+        target.command.emplace_back("-p");
+        target.command.emplace_back(port);
+    }
+    target.command.emplace_back(userhost);
+    target.command.emplace_back("-s");
+    target.command.emplace_back("sftp");
+    return target;
+}
+
+SftpFilesystem::Connector SftpFilesystem::command_connector(std::vector<std::string> command)
+{
+    return [command = std::move(command)]() -> Result<std::unique_ptr<SftpSession>> {
+        auto spawn_result = SftpSession::spawn(command);
+        if (!spawn_result) {
+            return copy_error(spawn_result);
+        }
+        auto init_result = (*spawn_result)->init();
+        if (!init_result) {
+            return copy_error(init_result);
+        }
+        return std::move(*spawn_result);
+    };
+}
+
+Result<std::string> SftpFilesystem::remote_path(std::string_view path) const
+{
+    if (path.empty() || path[0] != '/') {
+        return make_result(FAILED, EINVAL);
+    }
+    while (!path.empty() && path.front() == '/') {
+        path.remove_prefix(1);
+    }
+    while (!path.empty() && path.back() == '/') {
+        path.remove_suffix(1);
+    }
+
+    if (m_config.root.empty()) {
+        // relative to the login directory
+        return path.empty() ? std::string(".") : std::string(path);
+    }
+    if (path.empty()) {
+        return std::string(m_config.root);
+    }
+    return join_path(m_config.root, path);
+}
+
+Result<std::unique_ptr<File>> SftpFilesystem::open(std::string_view path,
+                                                   int accesstype,
+                                                   mode_t mode)
+{
+    auto path_result = remote_path(path);
+    if (!path_result) {
+        return copy_error(path_result);
+    }
+    auto session_result = session();
+    if (!session_result) {
+        return copy_error(session_result);
+    }
+
+    Stat attr{};
+    attr.mode = mode;
+    Sftp::Encoder body;
+    body.string(*path_result)
+            .u32(Sftp::open_flags(accesstype))
+            .attrs(attr, (accesstype & O_CREAT) ? Sftp::ATTR_PERMISSIONS : 0);
+    auto handle = handle_reply((*session_result)->call(PacketType::OPEN, body.data()));
+    if (!handle) {
+        return copy_error(handle);
+    }
+    return std::make_unique<SftpFile>(std::move(*session_result), std::move(*handle), m_config);
+}
+
+Result<std::unique_ptr<Dir>> SftpFilesystem::opendir(std::string_view path)
+{
+    auto path_result = remote_path(path);
+    if (!path_result) {
+        return copy_error(path_result);
+    }
+    auto session_result = session();
+    if (!session_result) {
+        return copy_error(session_result);
+    }
+
+    Sftp::Encoder body;
+    body.string(*path_result);
+    auto handle = handle_reply((*session_result)->call(PacketType::OPENDIR, body.data()));
+    if (!handle) {
+        return copy_error(handle);
+    }
+    return std::make_unique<SftpDir>(std::move(*session_result), std::move(*handle),
+                                     std::move(*path_result));
+}
+
+Result<Stat> SftpFilesystem::lstat(std::string_view path)
+{
+    auto path_result = remote_path(path);
+    if (!path_result) {
+        return copy_error(path_result);
+    }
+    auto session_result = session();
+    if (!session_result) {
+        return copy_error(session_result);
+    }
+
+    Sftp::Encoder body;
+    body.string(*path_result);
+    return attrs_reply((*session_result)->call(PacketType::LSTAT, body.data()));
+}
+
+void SftpFilesystem::lstat_async(std::string_view path, Completion<Stat> &&done)
+{
+    auto path_result = remote_path(path);
+    if (!path_result) {
+        done(copy_error(path_result));
+        return;
+    }
+    auto session_result = session();
+    if (!session_result) {
+        done(copy_error(session_result));
+        return;
+    }
+
+    Sftp::Encoder body;
+    body.string(*path_result);
+    (*session_result)->send_async(
+                PacketType::LSTAT, body.data(),
+                [done = std::move(done)](Result<SftpSession::Reply> reply) mutable {
+        done(attrs_reply(reply));
+    });
+}
+
+Result<std::string> SftpFilesystem::readlink(std::string_view path)
+{
+    auto path_result = remote_path(path);
+    if (!path_result) {
+        return copy_error(path_result);
+    }
+    auto session_result = session();
+    if (!session_result) {
+        return copy_error(session_result);
+    }
+
+    Sftp::Encoder body;
+    body.string(*path_result);
+    auto reply = (*session_result)->call(PacketType::READLINK, body.data());
+    if (!reply) {
+        return copy_error(reply);
+    }
+    if (reply->type != PacketType::NAME) {
+        return make_result(FAILED, reply_error(*reply));
+    }
+
+    Sftp::Decoder decoder(reply->body);
+    std::uint32_t count = 0;
+    std::string_view destination;
+    if (!decoder.u32(count) || count < 1 || !decoder.string(destination)) {
+        return make_result(FAILED, EBADMSG);
+    }
+    return std::string(destination);
+}
+
+}
@@ -0,0 +1,251 @@
+/**********************************************************************
+File name: sftp_protocol.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/backend/sftp_protocol.hpp"
+
+#include <cerrno>
+
+#include <fcntl.h>
+
+namespace Dragonstash::Backend::Sftp {
+
+Encoder &Encoder::u8(std::uint8_t value)
+{
+    m_buf.push_back(static_cast<char>(value));
+    return *this;
+}
+
+Encoder &Encoder::u32(std::uint32_t value)
+{
+    const char bytes[4] = {
+        static_cast<char>(value >> 24),
+        static_cast<char>(value >> 16),
+        static_cast<char>(value >> 8),
+        static_cast<char>(value),
+    };
+    m_buf.append(bytes, sizeof(bytes));
+    return *this;
+}
+
+Encoder &Encoder::u64(std::uint64_t value)
+{
+    u32(static_cast<std::uint32_t>(value >> 32));
+    return u32(static_cast<std::uint32_t>(value));
+}
+
+Encoder &Encoder::string(std::string_view value)
+{
+    u32(static_cast<std::uint32_t>(value.size()));
+    m_buf.append(value);
+    return *this;
+}
+
+Encoder &Encoder::attrs(const Stat &attr, std::uint32_t flags)
+{
+    flags &= ATTR_ALL;
+    u32(flags);
+    if (flags & ATTR_SIZE) {
+        u64(attr.size);
+    }
+    if (flags & ATTR_UIDGID) {
+        u32(attr.uid);
+        u32(attr.gid);
+    }
+    if (flags & ATTR_PERMISSIONS) {
+        u32(attr.mode);
+    }
+    if (flags & ATTR_ACMODTIME) {
+        u32(static_cast<std::uint32_t>(attr.atime.tv_sec));
+        u32(static_cast<std::uint32_t>(attr.mtime.tv_sec));
+    }
+    return *this;
+}
+
+Decoder::Decoder(std::string_view data):
+    m_data(data)
+{
+
+}
+
+bool Decoder::u8(std::uint8_t &value)
+{
+    if (m_data.empty()) {
+        return false;
+    }
+    value = static_cast<std::uint8_t>(m_data[0]);
+    m_data.remove_prefix(1);
+    return true;
+}
+
+bool Decoder::u32(std::uint32_t &value)
+{
+    if (m_data.size() < 4) {
+        return false;
+    }
+    value = 0;
+    for (std::size_t i = 0; i < 4; ++i) {
+        value = (value << 8) | static_cast<std::uint8_t>(m_data[i]);
+    }
+    m_data.remove_prefix(4);
+    return true;
+}
+
+bool Decoder::u64(std::uint64_t &value)
+{
+    std::uint32_t high = 0, low = 0;
+    if (m_data.size() < 8 || !u32(high) || !u32(low)) {
+        return false;
+    }
+    value = (std::uint64_t(high) << 32) | low;
+    return true;
+}
+
+bool Decoder::string(std::string_view &value)
+{
+    std::uint32_t size = 0;
+    if (!u32(size)) {
+        return false;
+    }
+    if (m_data.size() < size) {
+        return false;
+    }
+    value = m_data.substr(0, size);
+    m_data.remove_prefix(size);
+    return true;
+}
+
+bool Decoder::attrs(Stat &attr, std::uint32_t &flags)
+{
+    attr = Stat{};
+    if (!u32(flags)) {
+        return false;
+    }
+    if ((flags & ATTR_SIZE) && !u64(attr.size)) {
+        return false;
+    }
+    if ((flags & ATTR_UIDGID) && (!u32(attr.uid) || !u32(attr.gid))) {
+        return false;
+    }
+    if ((flags & ATTR_PERMISSIONS) && !u32(attr.mode)) {
+        return false;
+    }
+    if (flags & ATTR_ACMODTIME) {
+        std::uint32_t atime = 0, mtime = 0;
+        if (!u32(atime) || !u32(mtime)) {
+            return false;
+        }
+        attr.atime.tv_sec = atime;
+        attr.mtime.tv_sec = mtime;
+        attr.ctime.tv_sec = mtime;
+    }
+    if (flags & ATTR_EXTENDED) {
+        std::uint32_t count = 0;
+        if (!u32(count)) {
+            return false;
+        }
+        for (std::uint32_t i = 0; i < count; ++i) {
+            std::string_view type, data;
+            if (!string(type) || !string(data)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int status_to_errno(std::uint32_t status)
+{
+    switch (static_cast<Status>(status)) {
+    case Status::OK:
+        return 0;
+    case Status::END_OF_FILE:
+        return ENODATA;
+    case Status::NO_SUCH_FILE:
+        return ENOENT;
+    case Status::PERMISSION_DENIED:
+        return EACCES;
+    case Status::BAD_MESSAGE:
+        return EBADMSG;
+    case Status::NO_CONNECTION:
+    case Status::CONNECTION_LOST:
+        return ENOTCONN;
+    case Status::OP_UNSUPPORTED:
+        return ENOSYS;
+    case Status::FAILURE:
+    default:
+        return EIO;
+    }
+}
+
+Status errno_to_status(int err)
+{
+    switch (err) {
+    case 0:
+        return Status::OK;
+    case ENOENT:
+        return Status::NO_SUCH_FILE;
+    case EPERM:
+    case EACCES:
+        return Status::PERMISSION_DENIED;
+    case EBADMSG:
+        return Status::BAD_MESSAGE;
+    case ENOTCONN:
+        return Status::NO_CONNECTION;
+    case ENOSYS:
+        return Status::OP_UNSUPPORTED;
+    default:
+        return Status::FAILURE;
+    }
+}
+
+std::uint32_t open_flags(int accesstype)
+{
+    std::uint32_t result = 0;
+    switch (accesstype & O_ACCMODE) {
+    case O_RDONLY:
+        result = OPEN_READ;
+        break;
+    case O_WRONLY:
+        result = OPEN_WRITE;
+        break;
+    default:
+        result = OPEN_READ | OPEN_WRITE;
+        break;
+    }
+    if (accesstype & O_APPEND) {
+        result |= OPEN_APPEND;
+    }
+    if (accesstype & O_CREAT) {
+        result |= OPEN_CREAT;
+    }
+    if (accesstype & O_TRUNC) {
+        result |= OPEN_TRUNC;
+    }
+    if (accesstype & O_EXCL) {
+        result |= OPEN_EXCL;
+    }
+    return result;
+}
+
+}
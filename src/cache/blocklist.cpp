@@ -27,7 +27,9 @@ authors named in the AUTHORS file.
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
 #include <string>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -81,13 +83,38 @@ void FileHandle::reset(int other_fd) noexcept
 
 Blocklist::Blocklist(FileHandle fd):
     m_fd(std::move(fd)),
-    m_mapping(nullptr)
-{
+    m_block_size(CACHE_PAGE_SIZE),
+    m_mapping(nullptr),
+    m_mapped_size(0)
+{
+    const Superblock header = read_superblock(int(m_fd));
+    if (header.magic != magic) {
+        throw std::runtime_error("invalid magic");
+    }
+    if (header.version == version_flat) {
+        convert_flat(header);
+    } else if (header.version != version_paged) {
+        throw std::runtime_error("unsupported blocklist version " +
+                                 std::to_string(header.version));
+    }
+    if (header.block_size != 0) {
+        if (!is_valid_block_size(header.block_size)) {
+            throw std::runtime_error("invalid block size " +
+                                     std::to_string(header.block_size));
+        }
+        m_block_size = header.block_size;
+    }
+
     ensure_mapped();
+    if ((m_mapped_size - sizeof(Superblock)) % page_size != 0) {
+        throw std::runtime_error("incompatible or corrupted blocklist file");
+    }
+    load_directory();
 }
 
-Blocklist::Blocklist(const std::filesystem::path &path):
-    Blocklist(open(path))
+Blocklist::Blocklist(const std::filesystem::path &path,
+                     std::uint32_t block_size):
+    Blocklist(open(path, block_size))
 {
 
 }
@@ -100,8 +127,14 @@ Blocklist::~Blocklist()
     }
 }
 
-FileHandle Blocklist::open(const std::filesystem::path &path)
+FileHandle Blocklist::open(const std::filesystem::path &path,
+                           std::uint32_t block_size)
 {
+    if (!is_valid_block_size(block_size)) {
+        throw std::invalid_argument("invalid block size " +
+                                    std::to_string(block_size));
+    }
+
     FileHandle result(::open(path.c_str(),
                              O_CREAT | O_RDWR | O_CLOEXEC,
                              S_IRUSR | S_IWUSR));
@@ -123,27 +156,19 @@ FileHandle Blocklist::open(const std::filesystem::path &path)
 
     if (buf.st_size == 0) {
         // initialise
-        rc = ::ftruncate(int(result), initial_block_count * internal_block_size);
+        rc = ::ftruncate(int(result), sizeof(Superblock) + page_size);
         if (rc != 0) {
             throw std::runtime_error("failed to initialise blocklist file");
         }
         Superblock header{
             .magic = magic,
+            .version = version_paged,
+            .block_size = block_size,
         };
         ssize_t written = pwrite(int(result), &header, sizeof(header), 0);
         if (written != sizeof(header)) {
             throw std::runtime_error("failed to write superblock");
         }
-    } else {
-        // check
-        Superblock header{};
-        ssize_t read = pread(int(result), &header, sizeof(header), 0);
-        if (read != sizeof(header)) {
-            throw std::runtime_error("failed to read superblock");
-        }
-        if (header.magic != magic) {
-            throw std::runtime_error("invalid magic");
-        }
     }
 
     return result;
@@ -161,13 +186,14 @@ void Blocklist::ensure_mapped() const
     }
 
     assert((buf.st_mode & S_IFMT) == S_IFREG);
-    m_mapping = reinterpret_cast<File*>(mmap(nullptr, buf.st_size,
-                                             PROT_READ | PROT_WRITE,
-                                             MAP_SHARED,
-                                             int(m_fd), 0));
-    if (!m_mapping) {
+    void *mapping = mmap(nullptr, buf.st_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         int(m_fd), 0);
+    if (mapping == MAP_FAILED) {
         throw std::runtime_error(std::string("failed to map blocklist: ") + std::strerror(errno));
     }
+    m_mapping = reinterpret_cast<File*>(mapping);
     m_mapped_size = buf.st_size;
 }
 
@@ -183,6 +209,80 @@ void Blocklist::ensure_unmapped() const
     m_mapping = nullptr;
 }
 
+void Blocklist::convert_flat(const Superblock &header)
+{
+    const int fd = int(m_fd);
+    std::vector<Entry> entries(header.entries);
+    const ssize_t to_read = entries.size() * sizeof(Entry);
+    if (::pread(fd, entries.data(), to_read, sizeof(Superblock)) != to_read) {
+        throw std::runtime_error("failed to read flat blocklist");
+    }
+
+    const std::size_t npages = std::max<std::size_t>(
+                (entries.size() + entries_per_page - 1) / entries_per_page, 1);
+    std::vector<Page> pages(npages, Page{});
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        Page &page = pages[i / entries_per_page];
+        page.entries[page.count++] = entries[i];
+    }
+
+    // invalidate the file while rewriting it, so that a crash in between
+    // leaves a file which is rejected instead of one which is misread.
+    Superblock invalid = header;
+    invalid.magic = 0;
+    if (::pwrite(fd, &invalid, sizeof(invalid), 0) != sizeof(invalid) ||
+            ::fdatasync(fd) != 0)
+    {
+        throw std::runtime_error("failed to convert blocklist");
+    }
+
+    const ssize_t to_write = pages.size() * sizeof(Page);
+    if (::ftruncate(fd, sizeof(Superblock) + to_write) != 0 ||
+            ::pwrite(fd, pages.data(), to_write, sizeof(Superblock)) != to_write ||
+            ::fdatasync(fd) != 0)
+    {
+        throw std::runtime_error("failed to convert blocklist");
+    }
+
+    Superblock converted = header;
+    converted.version = version_paged;
+    if (::pwrite(fd, &converted, sizeof(converted), 0) != sizeof(converted)) {
+        throw std::runtime_error("failed to convert blocklist");
+    }
+}
+
+void Blocklist::load_directory() const
+{
+    ensure_mapped();
+    m_directory.clear();
+    m_free_pages.clear();
+    std::uint64_t total = 0;
+    for (std::size_t i = npages(); i > 0; --i) {
+        const std::uint32_t index = i - 1;
+        const Page &page = m_mapping->pages[index];
+        if (page.count > entries_per_page) {
+            throw std::runtime_error("inconsistency detected: page " +
+                                     std::to_string(index) + " overflows");
+        }
+        if (page.count == 0) {
+            m_free_pages.push_back(index);
+        } else {
+            m_directory.push_back(index);
+            total += page.count;
+        }
+    }
+    if (total != m_mapping->superblock.entries) {
+        throw std::runtime_error("inconsistency detected: pages hold " +
+                                 std::to_string(total) + " entries, but "
+                                 "superblock claims " +
+                                 std::to_string(m_mapping->superblock.entries));
+    }
+    std::sort(m_directory.begin(), m_directory.end(),
+              [this](std::uint32_t a, std::uint32_t b) {
+        return m_mapping->pages[a].entries[0].start < m_mapping->pages[b].entries[0].start;
+    });
+}
+
 void Blocklist::grow()
 {
     ensure_unmapped();
@@ -191,7 +291,7 @@ void Blocklist::grow()
     if (rc != 0) {
         throw std::runtime_error(std::string("failed to read blocklist: ") + std::strerror(errno));
     }
-    const std::size_t new_size = buf.st_size + grow_size;
+    const std::size_t new_size = buf.st_size + page_size;
     assert((buf.st_mode & S_IFMT) == S_IFREG);
     rc = ::ftruncate(int(m_fd), new_size);
     if (rc != 0) {
@@ -199,335 +299,248 @@ void Blocklist::grow()
     }
 }
 
-void Blocklist::require_space()
+std::uint32_t Blocklist::allocate_page()
 {
-    if (capacity() == nentries()) {
+    ensure_mapped();
+    if (m_free_pages.empty()) {
         grow();
         ensure_mapped();
+        m_free_pages.push_back(npages() - 1);
     }
-    assert(capacity() > nentries());
+    const std::uint32_t result = m_free_pages.back();
+    m_free_pages.pop_back();
+    assert(m_mapping->pages[result].count == 0);
+    return result;
 }
 
-Blocklist::File::iterator Blocklist::delete_entry(File::iterator iter)
+std::size_t Blocklist::npages() const
 {
     ensure_mapped();
-    if (iter == m_mapping->end()) {
-        return iter;
-    }
-    return delete_range(iter, iter + 1);
+    return (m_mapped_size - sizeof(Superblock)) / page_size;
 }
 
-Blocklist::File::iterator Blocklist::delete_range(Blocklist::File::iterator begin,
-                                                  Blocklist::File::iterator end)
+void Blocklist::advance(Position &pos) const
 {
-    const auto index = begin - m_mapping->begin();
-    const auto deleted = end - begin;
-    const auto to_move = m_mapping->end() - end;
-
-    assert(deleted >= 0);
-    assert(to_move >= 0);
-
-    /* std::cout << "delete: index=" << index
-              << ", deleted=" << deleted
-              << ", to_move=" << to_move
-              << "; nentries=" << m_mapping->superblock.entries << std::endl; */
-
-    assert(static_cast<unsigned>(to_move) +
-           static_cast<unsigned>(deleted) <= m_mapping->superblock.entries);
-
-    // update block bookkeeping
-    for (auto iter = begin; iter != end; ++iter) {
-        m_mapping->superblock.blocks_by_state[iter->state] -= iter->count;
+    ++pos.entry;
+    if (pos.entry == page_at(pos.page).count) {
+        ++pos.page;
+        pos.entry = 0;
     }
-
-    memmove(&m_mapping->entries[index],
-            &m_mapping->entries[index + deleted],
-            to_move * sizeof(Entry));
-    m_mapping->superblock.entries -= deleted;
-
-    return &m_mapping->entries[index];
 }
 
-std::pair<bool, Blocklist::File::iterator> Blocklist::try_merge_with_previous(Blocklist::File::iterator iter)
+bool Blocklist::retreat(Position &pos) const
 {
-    const auto iter_begin = m_mapping->begin();
-
-    if (iter == iter_begin) {
-        // std::cout << "merge rejected: at begin" << std::endl;
-        // at start of range, no previous entry -> no join
-        return std::make_pair(false, iter);
+    if (pos.entry > 0) {
+        --pos.entry;
+        return true;
     }
-
-    auto prev = iter - 1;
-    if (prev->end() != iter->start) {
-        // std::cout << "merge rejected: range not adjacent" << std::endl;
-        // end of previous is different from start -> no join
-        return std::make_pair(false, iter);
-    }
-
-    if (prev->state != iter->state) {
-        // std::cout << "merge rejected: state mismatch" << std::endl;
-        return std::make_pair(false, iter);
+    if (pos.page == 0) {
+        return false;
     }
-
-    const std::uint64_t new_count = std::uint64_t(prev->count) + std::uint64_t(iter->count);
-    if (new_count > std::numeric_limits<entry_block_count_type>::max()) {
-        // std::cout << "merge rejected: resulting range too large" << std::endl;
-        // new count would exceed limits -> no join
-        return std::make_pair(false, iter);
-    }
-
-    prev->count = new_count;
-    // we have to add the count to the bookkeeping because delete_entry will
-    // remove it.
-    m_mapping->superblock.blocks_by_state[prev->state] += iter->count;
-    return std::make_pair(true, delete_entry(iter) - 1);
-}
-
-Blocklist::File::iterator Blocklist::insert_before(File::iterator dest,
-        Blocklist::Entry &&entry)
-{
-    const auto insert_index = dest - m_mapping->begin();
-    const auto to_move = m_mapping->end() - dest;
-
-    require_space();  // invalidates all iterators!
-    if (to_move) {
-        memmove(&m_mapping->entries[insert_index + 1],
-                &m_mapping->entries[insert_index],
-                to_move * sizeof(Entry));
-    };
-
-    m_mapping->entries[insert_index] = entry;
-    ++m_mapping->superblock.entries;
-
-    return &m_mapping->entries[insert_index];
-}
-
-Blocklist::File::iterator Blocklist::split_entry(Blocklist::File::iterator at,
-                                                 std::uint64_t split_point)
-{
-    assert(at->start <= split_point);
-    assert(at->end() > split_point);
-
-    const auto old_end = at->end();
-    const auto old_count = at->count;
-    Entry new_entry = *at;
-    new_entry.start = split_point;
-    new_entry.count = old_end - split_point;
-    at->count = split_point - at->start;
-    at = insert_before(at + 1, std::move(new_entry)) - 1;
-
-    assert(at->end() == split_point);
-    assert((at+1)->end() == old_end);
-    assert(at->count + (at+1)->count == old_count);
-
-    return at;
+    --pos.page;
+    pos.entry = page_at(pos.page).count - 1;
+    return true;
 }
 
-Blocklist::File::iterator Blocklist::search_entry(std::uint64_t block)
+Blocklist::Position Blocklist::search_entry(std::uint64_t block) const
 {
     ensure_mapped();
-    auto result = std::upper_bound(
-                m_mapping->begin(),
-                m_mapping->end(),
+    auto page_iter = std::partition_point(
+                m_directory.begin(),
+                m_directory.end(),
+                [this, block](std::uint32_t index) {
+        const Page &page = m_mapping->pages[index];
+        return page.entries[page.count - 1].end() <= block;
+    });
+    if (page_iter == m_directory.end()) {
+        return end_position();
+    }
+
+    const Page &page = m_mapping->pages[*page_iter];
+    auto entry_iter = std::upper_bound(
+                &page.entries[0],
+                &page.entries[page.count],
                 block,
                 [](std::uint64_t block, const Entry &entry){
         return block < entry.end();
     });
-    /* std::cout << "search: target=" << block
-              << std::endl;
-    dump(std::cout);
-    std::cout << "-> " << escape_iterator(result) << std::endl; */
-    return result;
+    return Position{
+        static_cast<std::size_t>(page_iter - m_directory.begin()),
+        static_cast<std::size_t>(entry_iter - &page.entries[0]),
+    };
 }
 
-Blocklist::File::const_iterator Blocklist::search_entry(uint64_t block) const
+void Blocklist::erase_entries(Position at, std::size_t n)
 {
-    return const_cast<Blocklist*>(this)->search_entry(block);
-}
-
-
+    while (n > 0) {
+        Page &page = page_at(at.page);
+        const std::size_t here = std::min<std::size_t>(n, page.count - at.entry);
+        memmove(&page.entries[at.entry],
+                &page.entries[at.entry + here],
+                (page.count - at.entry - here) * sizeof(Entry));
+        page.count -= here;
+        m_mapping->superblock.entries -= here;
+        n -= here;
 
-Blocklist::File::difference_type Blocklist::escape_iterator(Blocklist::File::iterator iter) const
-{
-    return iter - m_mapping->begin();
+        if (page.count == 0) {
+            // at.page now refers to the following page
+            m_free_pages.push_back(m_directory[at.page]);
+            m_directory.erase(m_directory.begin() + at.page);
+        } else {
+            ++at.page;
+        }
+        at.entry = 0;
+    }
 }
 
-std::pair<Blocklist::File::iterator, Blocklist::File::iterator> Blocklist::find_overlapping_entries(uint64_t start, Blocklist::entry_block_count_type count)
+void Blocklist::insert_entries(Position at, const Entry *entries, std::size_t n)
 {
-    ensure_mapped();
-    if (m_mapping->begin() == m_mapping->end()) {
-        // empty range -> early out
-        // this saves some checks down below
-        return std::make_pair(m_mapping->end(), m_mapping->end());
-    }
+    assert(n <= entries_per_page / 2);
 
-    const std::uint64_t end = start + count;
-    File::iterator start_overlap = search_entry(start);
-    if (start_overlap == m_mapping->end()) {
-        return std::make_pair(m_mapping->end() - 1, m_mapping->end());
-    }
-    if (!start_overlap->contains(start)) {
-        // start_overlap points at the element *behind* the start, because there
-        // is no element overlapping it.
-        if (start_overlap == m_mapping->begin()) {
-            // no possible value for start_overlap, set it to the out-of-range
-            // iterator
-            start_overlap = m_mapping->end();
+    if (m_directory.empty()) {
+        const std::uint32_t index = allocate_page();
+        m_directory.push_back(index);
+        at = Position{0, 0};
+    } else if (at.entry == 0 && at.page > 0 &&
+               (at.page == m_directory.size() ||
+                page_at(at.page - 1).count + n <= entries_per_page))
+    {
+        // prefer appending to the previous page over prepending to the next
+        --at.page;
+        at.entry = page_at(at.page).count;
+    }
+
+    if (page_at(at.page).count + n > entries_per_page) {
+        const std::uint32_t new_index = allocate_page();  // invalidates all references!
+        Page &page = page_at(at.page);
+        Page &new_page = m_mapping->pages[new_index];
+        if (at.entry == page.count) {
+            // appending to a full page; do not split, so that sequentially
+            // growing lists keep their pages full
+            m_directory.insert(m_directory.begin() + at.page + 1, new_index);
+            at = Position{at.page + 1, 0};
         } else {
-            // make start_overlap point at the entry *before* `start`.
-            --start_overlap;
+            const std::size_t keep = page.count / 2;
+            const std::size_t moved = page.count - keep;
+            memcpy(&new_page.entries[0], &page.entries[keep], moved * sizeof(Entry));
+            new_page.count = moved;
+            page.count = keep;
+            m_directory.insert(m_directory.begin() + at.page + 1, new_index);
+            if (at.entry > keep) {
+                at = Position{at.page + 1, at.entry - keep};
+            }
         }
     }
 
-    File::iterator end_overlap = search_entry(end);
-    return std::make_pair(start_overlap, end_overlap);
+    Page &page = page_at(at.page);
+    memmove(&page.entries[at.entry + n],
+            &page.entries[at.entry],
+            (page.count - at.entry) * sizeof(Entry));
+    memcpy(&page.entries[at.entry], entries, n * sizeof(Entry));
+    page.count += n;
+    m_mapping->superblock.entries += n;
+}
+
+void Blocklist::replace_entries(Position at, std::size_t nremove,
+                                const Entry *entries, std::size_t n)
+{
+    const std::size_t common = std::min(nremove, n);
+    for (std::size_t i = 0; i < common; ++i) {
+        entry_at(at) = entries[i];
+        advance(at);
+    }
+    if (nremove > common) {
+        erase_entries(at, nremove - common);
+    } else if (n > common) {
+        insert_entries(at, entries + common, n - common);
+    }
 }
 
 void Blocklist::mark_internal(const uint64_t start,
                               const Blocklist::entry_block_count_type count,
                               const Blocklist::State state)
 {
-    /* next strategy:
-     * implement function returning two iterators: `before` and `after`.
-     * - `before` >= `after`
-     * - `before` == `after` <=> new range is fully contained within other entry
-     * - `after` - `before` > 1 => new range fully covers at least one existing
-     *   entry
-     * - `before` points at the entry overlapping with `start` or the last
-     *   entry whose end is before or at `start`
-     * - `after` points at the entry overlapping with `end` or at the first
-     *   entry whose start is after `end`
-     *
-     * then we can handle intersection of start with `before` and end with
-     * `after` in clean code, delete all entries in-between, insert the new
-     * entry and attempt merges with the `before` and `after` entry.
-     *
-     * bonus if we don’t even have to treat `before` = `after` specially.
-     *
-     * general algorithm:
-     * - handle overlap with `after` by splitting at `start`
-     * - handle overlap with `before` by splitting at `end`
-     * - delete everything between `after` and `before`, including split items
-     * - insert new item before `before`
-     * - try to merge `before` into new item and new item into `after`
-     */
-
-    // breaks indentation of QtCreator :(
-    // auto [start_overlap, end_overlap] = find_overlapping_entries(start, count);
-
-    Entry new_entry{
-        .start = start,
-        .count = count,
-        .state = std::uint8_t(state)
-    };
+    /* The entries overlapping the range, plus the adjacent ones (which may
+     * be merged with the new entry), are replaced by at most three entries:
+     * the part of an entry before the range, the new entry and the part of
+     * an entry behind the range. */
+    static constexpr auto limit = std::numeric_limits<entry_block_count_type>::max();
     const std::uint64_t end = start + count;
-    File::iterator start_overlap;
-    File::iterator end_overlap;
-    std::tie(start_overlap, end_overlap) = find_overlapping_entries(start, count);
-
-    // 1. neither start nor end overlaps (-> delete, insert)
-    // 2. start overlaps, end does not (-> truncate start, delete, insert)
-    // 3. both overlap but are not equal (-> truncate start, truncate end, delete, insert)
-    // 4. end overlaps, start does not (-> truncate end, delete, insert)
-    // 5. both overlap and are equal (-> split start/end, insert)
-
-    // case 5: an entry fully contains the new one
-    if (start_overlap != m_mapping->end() && start_overlap == end_overlap) {
-        // this requires creation of two new entries. we split the start overlap
-        // and then continue as normal, pretending that the two split parts
-        // were the two entries we found earlier. the start will at this point
-        // not overlap anymore and only the end needs to be taken care of.
-        start_overlap = split_entry(start_overlap, start);  // invalidates all iterators!
-        end_overlap = start_overlap + 1;
-    }
-
-    const bool start_contains = start_overlap != m_mapping->end() && start_overlap->contains(start);
-    const bool end_contains = end_overlap != m_mapping->end() && end_overlap->contains(end - 1);
-
-    // case 2: start overlaps, end does not
-    if (start_contains) {
-        // check for exact match:
-        if (start_overlap->start == start && start_overlap->count <= count) {
-            if (state == ABSENT) {
-                delete_range(start_overlap, end_overlap);
-                return;
-            }
 
-            m_mapping->superblock.blocks_by_state[start_overlap->state] -= start_overlap->count;
-            *start_overlap = new_entry;
-            m_mapping->superblock.blocks_by_state[state] += count;
-            // we still have to merge and delete manually here
-            auto item = delete_range(start_overlap+1, end_overlap) - 1;
-            auto next = item + 1;
-            if (next != m_mapping->end()) {
-                bool success;
-                File::iterator merged;
-                std::tie(success, merged) = try_merge_with_previous(next);
-                if (success) {
-                    item = merged;
-                }
+    Position first = search_entry(start);
+    {
+        Position prev = first;
+        if (retreat(prev)) {
+            const Entry &entry = entry_at(prev);
+            if (entry.end() == start && entry.state == std::uint8_t(state)) {
+                first = prev;
             }
-            try_merge_with_previous(item);
-            return;
         }
-        const auto old_count = start_overlap->count;
-        start_overlap->count = start - start_overlap->start;
-        assert(start_overlap->end() == start);
-        assert(old_count > start_overlap->count);
-        assert(start_overlap->count > 0);
-        m_mapping->superblock.blocks_by_state[start_overlap->state] -= (old_count - start_overlap->count);
     }
 
-    // case 4: end overlaps, start does not
-    if (end_contains) {
-        const auto old_end = end_overlap->end();
-        const auto old_count = end_overlap->count;
-        end_overlap->start = end;
-        end_overlap->count = old_end - end;
-        assert(!end_overlap->contains(end-1));
-        assert(old_count > end_overlap->count);
-        m_mapping->superblock.blocks_by_state[end_overlap->state] -= (old_count - end_overlap->count);
-    }
-
-    // case 1: neither start nor end overlap
-    File::iterator delete_begin = start_overlap;
-    if (delete_begin == m_mapping->end()) {
-        delete_begin = m_mapping->begin();
-    } else {
-        ++delete_begin;
-    }
-    const File::iterator delete_end = end_overlap;
-
-    /* std::cout << "start overlap: " << escape_iterator(start_overlap) << std::endl;
-    std::cout << "end overlap: " << escape_iterator(end_overlap) << std::endl;
-    std::cout << "delete begin: " << escape_iterator(delete_begin) << std::endl;
-    std::cout << "delete end: " << escape_iterator(delete_end) << std::endl; */
-
-    auto insert_at = delete_range(delete_begin, delete_end);  // invalidates all iterators!
-
-    if (state == ABSENT) {
-        return;
-    }
+    std::array<Entry, 3> replacement;
+    std::size_t nreplacement = 0;
+    auto emit = [&replacement, &nreplacement](const Entry &entry) {
+        if (nreplacement > 0) {
+            Entry &prev = replacement[nreplacement - 1];
+            if (prev.end() == entry.start && prev.state == entry.state &&
+                    std::uint64_t(prev.count) + entry.count <= limit)
+            {
+                prev.count += entry.count;
+                return;
+            }
+        }
+        assert(nreplacement < replacement.size());
+        replacement[nreplacement++] = entry;
+    };
 
-    auto inserted = insert_before(insert_at, std::move(new_entry));  // invalidates all iterators!
-    m_mapping->superblock.blocks_by_state[inserted->state] += inserted->count;
+    bool new_emitted = false;
+    auto emit_new = [&]() {
+        if (new_emitted) {
+            return;
+        }
+        new_emitted = true;
+        if (state != ABSENT) {
+            emit(Entry{
+                     .start = start,
+                     .count = count,
+                     .state = std::uint8_t(state),
+                 });
+        }
+    };
 
-    if (inserted != m_mapping->end()) {
-        auto next = inserted + 1;
-        if (next != m_mapping->end()) {
-            bool success;
-            File::iterator merged;
-            std::tie(success, merged) = try_merge_with_previous(next);   // invalidates all iterators!
-            if (success) {
-                inserted = merged;
-            }
+    auto &blocks_by_state = m_mapping->superblock.blocks_by_state;
+    std::size_t nremove = 0;
+    for (Position pos = first; pos != end_position(); advance(pos)) {
+        const Entry entry = entry_at(pos);
+        if (entry.start > end) {
+            break;
+        }
+        ++nremove;
+        blocks_by_state[entry.state] -= entry.count;
+        if (entry.start < start) {
+            emit(Entry{
+                     .start = entry.start,
+                     .count = entry_block_count_type(std::min(entry.end(), start) - entry.start),
+                     .state = entry.state,
+                 });
+        }
+        if (entry.end() > end) {
+            emit_new();
+            const std::uint64_t part_start = std::max(entry.start, end);
+            emit(Entry{
+                     .start = part_start,
+                     .count = entry_block_count_type(entry.end() - part_start),
+                     .state = entry.state,
+                 });
         }
     }
+    emit_new();
 
-    if (inserted != m_mapping->begin()) {
-        try_merge_with_previous(inserted);
+    for (std::size_t i = 0; i < nreplacement; ++i) {
+        blocks_by_state[replacement[i].state] += replacement[i].count;
     }
+    replace_entries(first, nremove, replacement.data(), nreplacement);
 }
 
 void Blocklist::mark(uint64_t start, uint64_t count, Blocklist::State state)
@@ -544,19 +557,65 @@ void Blocklist::mark(uint64_t start, uint64_t count, Blocklist::State state)
     }
 }
 
-Blocklist::State Blocklist::state(uint64_t block) const
+std::vector<Blocklist::Range> Blocklist::ranges(uint64_t start, uint64_t count,
+                                                Blocklist::State state) const
 {
-    ensure_mapped();
-    for (std::size_t i = 0; i < m_mapping->superblock.entries; ++i) {
-        const auto &entry = m_mapping->entries[i];
-        if (entry.start <= block) {
-            std::uint64_t end = entry.start + entry.count;
-            if (end > block) {
-                return State(entry.state);
+    std::vector<Range> result;
+    const std::uint64_t end = start + count;
+    std::uint64_t pos = start;
+    for (Position iter = search_entry(start);
+         iter != end_position() && entry_at(iter).start < end;
+         advance(iter))
+    {
+        const Entry &entry = entry_at(iter);
+        const std::uint64_t entry_start = std::max<std::uint64_t>(entry.start, start);
+        const std::uint64_t entry_end = std::min<std::uint64_t>(entry.end(), end);
+        if (state == ABSENT && entry_start > pos) {
+            result.push_back(Range{pos, entry_start - pos});
+        }
+        if (State(entry.state) == state) {
+            // adjacent entries of the same state exist if a merge would have
+            // exceeded the count limit
+            if (!result.empty() && result.back().start + result.back().count == entry_start) {
+                result.back().count += entry_end - entry_start;
+            } else {
+                result.push_back(Range{entry_start, entry_end - entry_start});
             }
         }
+        pos = entry_end;
+    }
+    if (state == ABSENT && pos < end) {
+        result.push_back(Range{pos, end - pos});
+    }
+    return result;
+}
+
+std::uint64_t Blocklist::count(uint64_t start, uint64_t count,
+                               Blocklist::State state) const
+{
+    std::uint64_t result = 0;
+    for (const Range &range: ranges(start, count, state)) {
+        result += range.count;
+    }
+    return result;
+}
+
+void Blocklist::transition(uint64_t start, uint64_t count,
+                           Blocklist::State from, Blocklist::State to)
+{
+    // collect first, marking invalidates all positions
+    for (const Range &range: ranges(start, count, from)) {
+        mark(range.start, range.count, to);
     }
-    return ABSENT;
+}
+
+Blocklist::State Blocklist::state(uint64_t block) const
+{
+    const Position pos = search_entry(block);
+    if (pos == end_position() || !entry_at(pos).contains(block)) {
+        return ABSENT;
+    }
+    return State(entry_at(pos).state);
 }
 
 uint64_t Blocklist::blocks(Blocklist::State state) const
@@ -592,8 +651,7 @@ uint64_t Blocklist::nentries() const
 
 uint64_t Blocklist::capacity() const
 {
-    ensure_mapped();
-    return (m_mapped_size - sizeof(File)) / sizeof(Entry);
+    return npages() * entries_per_page;
 }
 
 std::size_t Blocklist::truncate_access(off_t start, std::size_t size) const
@@ -601,69 +659,106 @@ std::size_t Blocklist::truncate_access(off_t start, std::size_t size) const
     if (start < 0) {
         return 0;
     }
-    const std::uint64_t start_block = start / CACHE_PAGE_SIZE;
-    const std::uint64_t requested_end_block = (start + size + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE;
-    auto start_block_iter = search_entry(start_block);
-    if (start_block_iter == m_mapping->end()) {
+    const std::uint64_t start_block = start / m_block_size;
+    const std::uint64_t requested_end_block = (start + size + m_block_size - 1) / m_block_size;
+    Position iter = search_entry(start_block);
+    if (iter == end_position()) {
         return 0;
     }
-    if (!start_block_iter->contains(start_block)) {
+    if (!entry_at(iter).contains(start_block)) {
         return 0;
     }
-    std::uint64_t end_of_available_range = start_block_iter->end();
-    while (start_block_iter != m_mapping->end() &&
+    std::uint64_t end_of_available_range = entry_at(iter).end();
+    advance(iter);
+    while (iter != end_position() &&
            end_of_available_range < requested_end_block)
     {
-        ++start_block_iter;
-        if (start_block_iter->start != end_of_available_range) {
+        if (entry_at(iter).start != end_of_available_range) {
             break;
         }
-        end_of_available_range = start_block_iter->end();
+        end_of_available_range = entry_at(iter).end();
+        advance(iter);
     }
-    const std::uint64_t end_block = std::min(requested_end_block + 1,
-                                             end_of_available_range);
-    const std::size_t max_length = (end_block - start_block) * CACHE_PAGE_SIZE;
-    return std::min(size, max_length);
+    // measured from `start`, not from the start of its block: an access
+    // starting in the middle of a block may only read up to the end of the
+    // available range.
+    const std::uint64_t max_length =
+            end_of_available_range * m_block_size - std::uint64_t(start);
+    return std::min<std::uint64_t>(size, max_length);
+}
+
+void Blocklist::clear()
+{
+    ensure_mapped();
+    for (std::uint32_t index: m_directory) {
+        m_mapping->pages[index].count = 0;
+        m_free_pages.push_back(index);
+    }
+    m_directory.clear();
+    std::sort(m_free_pages.begin(), m_free_pages.end(), std::greater<std::uint32_t>());
+    m_mapping->superblock.entries = 0;
+    m_mapping->superblock.blocks_by_state = {};
+}
+
+Blocklist::Tag Blocklist::tag() const
+{
+    return temporary_superblock()->tag;
+}
+
+void Blocklist::set_tag(const Tag &tag)
+{
+    ensure_mapped();
+    m_mapping->superblock.tag = tag;
 }
 
 void Blocklist::fsck() const
 {
     ensure_mapped();
-    const auto iter_begin = m_mapping->begin();
-    const auto iter_end = m_mapping->end();
     std::uint64_t prev_end = 0;
     std::uint64_t prev_start = 0;
+    std::uint64_t index = 0;
     std::array<std::uint64_t, 4> blocks_by_state{};
-    for (auto iter = iter_begin;
-         iter != iter_end;
-         ++iter)
-    {
-        const auto index = iter - iter_begin;
-        if (iter->start < prev_end) {
-            throw std::runtime_error(
-                        std::string("inconsistency detected: at ") +
-                        std::to_string(index) + ": entry start is at " +
-                        std::to_string(iter->start) + ", but previous end is "
-                        "at " + std::to_string(prev_end)
-                        );
-        }
-        if (iter->start < prev_start) {
+    for (std::size_t i = 0; i < m_directory.size(); ++i) {
+        const Page &page = page_at(i);
+        if (page.count == 0 || page.count > entries_per_page) {
             throw std::runtime_error(
-                        std::string("inconsistency detected: at ") +
-                        std::to_string(index) + ": entry start is at " +
-                        std::to_string(iter->start) + ", but previous start is "
-                        "at " + std::to_string(prev_start)
+                        std::string("inconsistency detected: page ") +
+                        std::to_string(m_directory[i]) + " holds " +
+                        std::to_string(page.count) + " entries"
                         );
         }
-        if (iter->count == 0) {
-            throw std::runtime_error(
-                        std::string("inconsistency detected: at ") +
-                        std::to_string(index) + ": entry count is zero"
-                        );
+        for (std::size_t j = 0; j < page.count; ++j, ++index) {
+            const Entry &entry = page.entries[j];
+            if (entry.start < prev_end) {
+                throw std::runtime_error(
+                            std::string("inconsistency detected: at ") +
+                            std::to_string(index) + ": entry start is at " +
+                            std::to_string(entry.start) + ", but previous end is "
+                            "at " + std::to_string(prev_end)
+                            );
+            }
+            if (entry.start < prev_start) {
+                throw std::runtime_error(
+                            std::string("inconsistency detected: at ") +
+                            std::to_string(index) + ": entry start is at " +
+                            std::to_string(entry.start) + ", but previous start is "
+                            "at " + std::to_string(prev_start)
+                            );
+            }
+            if (entry.count == 0) {
+                throw std::runtime_error(
+                            std::string("inconsistency detected: at ") +
+                            std::to_string(index) + ": entry count is zero"
+                            );
+            }
+            blocks_by_state[entry.state] += entry.count;
+            prev_start = entry.start;
+            prev_end = entry.end();
         }
-        blocks_by_state[iter->state] += iter->count;
-        prev_start = iter->start;
-        prev_end = iter->end();
+    }
+
+    if (index != m_mapping->superblock.entries) {
+        throw std::runtime_error("inconsistency detected: pages hold "+std::to_string(index)+" entries but superblock contains "+std::to_string(m_mapping->superblock.entries));
     }
 
     for (std::size_t i = 0; i < blocks_by_state.size(); ++i) {
@@ -677,37 +772,43 @@ void Blocklist::fsck() const
 
 void Blocklist::shrink() const
 {
-    auto superblock_guard = temporary_superblock();
-    const Superblock &superblock = *superblock_guard;
-
-    const std::size_t curr_grow_steps = m_mapped_size / grow_size;
-    if (curr_grow_steps <= 1) {
+    ensure_mapped();
+    const std::size_t curr_pages = npages();
+    if (curr_pages <= 1) {
         return;
     }
 
-    const std::size_t required_grow_steps = (
-                /* space needed for superblock */
-                sizeof(Superblock) +
-                /* space needed for current entries */
-                superblock.entries * sizeof(Entry) +
-                /* round up to full grow size */
-                grow_size - 1) / grow_size;
-
-    if (required_grow_steps == curr_grow_steps) {
+    const std::size_t required_pages = std::max<std::size_t>(
+                (m_mapping->superblock.entries + entries_per_page - 1) / entries_per_page,
+                1);
+    if (required_pages == curr_pages) {
         return;
     }
+    assert(required_pages < curr_pages);
 
-    const std::size_t new_file_size = required_grow_steps * grow_size;
-    const std::size_t new_capacity = (new_file_size - sizeof(Superblock)) / sizeof(Entry);
-    assert(new_file_size < m_mapped_size);
-    // double-assert that we don’t truncate away entries we have...
-    assert(new_capacity >= superblock.entries);
+    // pack all entries into the first pages, in order
+    std::vector<Entry> entries;
+    entries.reserve(m_mapping->superblock.entries);
+    for (std::size_t i = 0; i < m_directory.size(); ++i) {
+        const Page &page = page_at(i);
+        entries.insert(entries.end(), &page.entries[0], &page.entries[page.count]);
+    }
+    for (std::size_t i = 0; i < required_pages; ++i) {
+        Page &page = m_mapping->pages[i];
+        const std::size_t offset = i * entries_per_page;
+        const std::size_t n = std::min(entries.size() - offset, entries_per_page);
+        memcpy(&page.entries[0], &entries[offset], n * sizeof(Entry));
+        page.count = n;
+    }
+
+    const std::size_t new_file_size = sizeof(Superblock) + required_pages * page_size;
     ensure_unmapped();
     int rc = ftruncate(int(m_fd), new_file_size);
     if (rc != 0) {
         throw std::runtime_error(std::string("failed to shrink blocklist: ") +
                                  std::strerror(errno));
     }
+    load_directory();
 }
 
 std::ostream &Blocklist::dump(std::ostream &out) const
@@ -722,17 +823,17 @@ std::ostream &Blocklist::dump(std::ostream &out) const
             << m_mapping->superblock.blocks_by_state[i] << std::endl;
     }
     out << "  };" << std::endl;
-    out << "  {" << std::endl;
-    for (auto iter = m_mapping->begin();
-         iter != m_mapping->end();
-         ++iter)
-    {
-        const auto &entry = *iter;
-        out << "    Entry{.start = " << entry.start << ", "
-            << ".count = " << entry.count << " (end: " << entry.end() << "), "
-            << ".state = " << int(entry.state) << "}," << std::endl;
+    for (std::size_t i = 0; i < m_directory.size(); ++i) {
+        const Page &page = page_at(i);
+        out << "  page " << m_directory[i] << " {" << std::endl;
+        for (std::size_t j = 0; j < page.count; ++j) {
+            const auto &entry = page.entries[j];
+            out << "    Entry{.start = " << entry.start << ", "
+                << ".count = " << entry.count << " (end: " << entry.end() << "), "
+                << ".state = " << int(entry.state) << "}," << std::endl;
+        }
+        out << "  }" << std::endl;
     }
-    out << "  }" << std::endl;
     return out << "}" << std::endl;
 }
 
@@ -24,12 +24,22 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include "dragonstash/cache/cache.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <cstring>
 #include <ctime>
+#include <limits>
+#include <optional>
+
+#include <endian.h>
 
 #include "dragonstash/cache/direntry.hpp"
+#include "dragonstash/trace.hpp"
 
 /**
  * LMDB database layout
@@ -37,17 +47,68 @@ authors named in the AUTHORS file.
  * Database `inodes` (MDB_INTEGERKEY):
  *
  * - key: uint64_t inode
- * - value: uint8_t version + struct InodeV1 + type-specific inode data
+ * - value: inode record (see Dragonstash::serialize(const Inode&, std::byte*))
+ *   + type-specific inode data
+ *
+ * Version 1 records are a struct InodeV1; version 2 records use a compact
+ * varint encoding. Both are read; version 1 records are replaced by version
+ * 2 records when they are written next.
  *
  * Database `treei`:
  *
  * - key: uint64_t parent_inode + uint64_t child_inode
- * - value: uint32_t mode cache + name
+ * - value: struct DirEntryV2 (including a copy of the inode attributes) + name
  *
  * Database `treen`:
  *
  * - key: uint64_t parent_inode + name
- * - value: uint64_t child_inode + uint32_t mode cache
+ * - value: struct DirEntryV2 (including a copy of the inode attributes) + name
+ *
+ * Database `negn`:
+ *
+ * - key: uint64_t parent_inode + name
+ * - value: int64_t expiry (nanoseconds since the epoch of the system clock)
+ *
+ * Names which the backend reported as nonexistent. A record is dropped when
+ * the name is emplaced or the directory is rewritten; expired records are
+ * ignored and overwritten on the next miss.
+ *
+ * Databases created before the introduction of DirEntryV2 are migrated when
+ * the cache is opened; the `dir_entry_version` key in `meta` records the
+ * version of the stored entries.
+ *
+ * The `block_size` key in `meta` (uint32_t) records the block size of the
+ * cached file contents. It is chosen when the cache is created; caches
+ * which predate it use CACHE_PAGE_SIZE.
+ *
+ * Database `pins`:
+ *
+ * - key: uint64_t rule id
+ * - value: record written by PinRule::serialise()
+ *
+ * The `next_pin_id` key in `meta` (uint64_t) holds the id of the next rule;
+ * the `pin_generation` key (uint64_t) is incremented whenever the rules
+ * change, so that running mounts can tell when to reload them.
+ *
+ * Database `journal`:
+ *
+ * - key: uint64_t inode
+ * - value: struct JournalHeader
+ *
+ * - key: uint64_t inode + big-endian uint64_t start offset
+ * - value: uint64_t end offset
+ *
+ * Changes to regular files which have not been written back to the backend.
+ * The extents of an inode follow its header; they do not overlap and do not
+ * touch each other.
+ *
+ * Database `dirsync`:
+ *
+ * - key: uint64_t inode
+ * - value: struct DirSyncStamp
+ *
+ * Backend metadata of synced directories, recorded with the listing it
+ * belongs to. A stamp only counts while the directory has the SYNCED flag.
  */
 
 
@@ -64,8 +125,16 @@ static const std::string_view DB_NAME_TREE_INODE_KEY = "treei";
 static const std::string_view DB_NAME_TREE_NAME_KEY = "treen";
 static const std::string_view DB_NAME_ORPHANS = "orphans";
 static const std::string_view DB_NAME_LINKS = "links";
+static const std::string_view DB_NAME_NEGATIVE = "negn";
+static const std::string_view DB_NAME_PINS = "pins";
+static const std::string_view DB_NAME_JOURNAL = "journal";
+static const std::string_view DB_NAME_DIR_SYNC = "dirsync";
 
 static const std::string_view META_KEY_NEXT_INO = "next_ino";
+static const std::string_view META_KEY_DIR_ENTRY_VERSION = "dir_entry_version";
+static const std::string_view META_KEY_BLOCK_SIZE = "block_size";
+static const std::string_view META_KEY_NEXT_PIN_ID = "next_pin_id";
+static const std::string_view META_KEY_PIN_GENERATION = "pin_generation";
 
 template<typename T, typename _ = typename std::enable_if<std::is_arithmetic<T>::value && std::numeric_limits<T>::min() == 0>::type>
 T safe_dec(T &value, T by = 1)
@@ -89,147 +158,246 @@ static inline std::basic_string_view<std::byte> view(const MDBOutVal &val)
 }
 
 
-static inline Result<Inode> inode_from_lmdb(const MDBOutVal &val)
-{
-    return Inode::parse(view(val));
-}
+struct JournalHeader {
+    static constexpr std::uint32_t FLAG_CREATED = 1;
+    static constexpr std::uint32_t FLAG_RESIZED = 2;
 
+    std::uint64_t generation;
+    std::uint64_t size;
+    std::uint32_t flags;
+    std::uint32_t reserved;
+};
 
-static inline Result<copyfree_wrap<Inode>> inode_from_lmdb_inplace(const MDBOutVal &val)
+static_assert(std::is_pod_v<JournalHeader>);
+
+static std::string journal_extent_key(ino_t ino, std::uint64_t start)
 {
-    return Inode::parse_inplace(view(val));
+    std::string key;
+    key.resize(sizeof(ino_t) + sizeof(std::uint64_t));
+    const std::uint64_t start_be = htobe64(start);
+    memcpy(&key[0], &ino, sizeof(ino_t));
+    memcpy(&key[sizeof(ino_t)], &start_be, sizeof(std::uint64_t));
+    return key;
 }
 
+/**
+ * @brief Parse a record of the journal database as an extent of @a ino.
+ *
+ * @return false if the record is not an extent of @a ino.
+ */
+static bool parse_journal_extent(const MDBOutVal &key, const MDBOutVal &value,
+                                 ino_t ino, JournalEntry::Extent &extent)
+{
+    if (key.d_mdbval.mv_size != sizeof(ino_t) + sizeof(std::uint64_t) ||
+            memcmp(key.d_mdbval.mv_data, &ino, sizeof(ino_t)) != 0) {
+        return false;
+    }
+    std::uint64_t start_be;
+    memcpy(&start_be, static_cast<const char*>(key.d_mdbval.mv_data) + sizeof(ino_t),
+           sizeof(std::uint64_t));
+    extent.offset = be64toh(start_be);
+    extent.length = value.get<std::uint64_t>() - extent.offset;
+    return true;
+}
 
-CachedDir::CachedDir(MDBROTransaction &&transaction,
-                     MDBROCursor &&cursor,
-                     const ino_t ino):
-    m_transaction(std::move(transaction)),
-    m_cursor(std::move(cursor)),
-    m_ino(ino),
-    m_eof(false),
-    m_size(-1),
-    m_curr_off(0)
+/**
+ * @brief Position @a cursor on the last record before @a key.
+ */
+template <typename Cursor>
+static int seek_before(Cursor &cursor, const std::string &key,
+                       MDBOutVal &key_out, MDBOutVal &value_out)
 {
-    MDBInVal key(ino);
-    MDBOutVal unused_key{};
-    MDBOutVal unused_value{};
-    /* position the cursor at next item to read */
-    /* if not found, the directory has zero entries */
-    if (m_cursor.find(key, unused_key, unused_value) == MDB_NOTFOUND) {
-        mark_eof();
+    if (cursor.lower_bound(key, key_out, value_out) == 0) {
+        return cursor.prev(key_out, value_out);
     }
+    return cursor.nextprev(key_out, value_out, MDB_LAST);
 }
 
-void CachedDir::mark_eof()
+static inline std::string_view char_view(const MDBOutVal &val)
 {
-    if (m_eof) {
-        return;
-    }
+    return std::string_view(reinterpret_cast<const char*>(val.d_mdbval.mv_data),
+                            val.d_mdbval.mv_size);
+}
 
-    m_eof = true;
-    assert(m_curr_off + 1 == m_size || m_size == -1);
-    m_size = m_curr_off + 1;
+
+static inline Result<Inode> inode_from_lmdb(const MDBOutVal &val)
+{
+    return Inode::parse(view(val));
 }
 
-Result<DirectoryEntry> CachedDir::parse_entry(const char *buf, size_t sz)
+
+static inline Result<copyfree_wrap<Inode>> inode_from_lmdb_inplace(const MDBOutVal &val)
 {
-    if (sz < sizeof(std::uint8_t)) {
-        return make_result(FAILED, EIO);
-    }
+    return Inode::parse_inplace(view(val));
+}
 
-    std::uint8_t version;
-    memcpy(&version, &buf[0], sizeof(version));
 
-    switch (version) {
-    case 1:
-        return parse_entry_v1(&buf[1], sz-1);
-    default:
-        return make_result(FAILED, EIO);
-    }
+static inline std::string_view dir_entry_view(const std::basic_string<std::byte> &buf)
+{
+    return std::string_view(reinterpret_cast<const char*>(buf.data()),
+                            buf.size());
 }
 
-Result<DirectoryEntry> CachedDir::parse_entry_v1(const char *buf, size_t sz)
+
+static std::basic_string<std::byte> make_dir_entry(ino_t ino,
+                                                   std::string_view name,
+                                                   const InodeAttributes &attrs)
 {
-    if (sz <= sizeof(std::uint64_t) + sizeof(uint32_t)) {
-        return make_result(FAILED, EIO);
-    }
+    std::basic_string<std::byte> buf;
+    DirEntry *entry;
+    char *name_ptr;
+    std::tie(entry, name_ptr) = Dragonstash::emplace(buf, name.length(), ino);
+    entry->attr = attrs;
+    memcpy(name_ptr, name.data(), name.length());
+    return buf;
+}
+
+
+/**
+ * Upgrade all version 1 directory entries to the current version by copying
+ * the attributes from the inodes database.
+ */
+static void migrate_dir_entries(CacheDatabase &db, MDBRWTransaction &txn)
+{
+    auto cursor = txn->getRWCursor(db.tree_inode_key_db());
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    for (int rc = cursor.nextprev(key_out, value_out, MDB_FIRST);
+         rc == 0;
+         rc = cursor.nextprev(key_out, value_out, MDB_NEXT))
+    {
+        auto parse_result = DirEntry::parse(view(value_out));
+        if (!parse_result || std::get<0>(*parse_result).has_attributes()) {
+            continue;
+        }
+        const auto &[entry, name] = *parse_result;
 
-    DirectoryEntry result{};
-    result.complete = false;
-    memcpy(&result.ino, &buf[0], sizeof(result.ino));
-    buf += sizeof(result.ino); sz -= sizeof(result.ino);
+        std::array<ino_t, 2> key;
+        assert(key_out.d_mdbval.mv_size == sizeof(key));
+        memcpy(key.data(), key_out.d_mdbval.mv_data, sizeof(key));
 
-    memcpy(&result.attr.mode, &buf[0], sizeof(result.attr.mode));
-    buf += sizeof(result.attr.mode); sz -= sizeof(result.attr.mode);
+        MDBOutVal inode_value{};
+        if (txn->get(db.inodes_db(), key[1], inode_value) == MDB_NOTFOUND) {
+            continue;
+        }
+        auto inode = inode_from_lmdb(inode_value);
+        if (!inode) {
+            continue;
+        }
 
-    assert(sz >= 1);
-    result.name = std::string(&buf[0], sz);
+        const auto buf = make_dir_entry(entry.entry_ino, name, inode->attr);
+        cursor.put(key_out, dir_entry_view(buf));
 
-    return result;
+        std::string name_key;
+        name_key.resize(sizeof(ino_t) + name.length());
+        memcpy(&name_key[0], &key[0], sizeof(ino_t));
+        memcpy(&name_key[sizeof(ino_t)], name.data(), name.length());
+        txn->put(db.tree_name_key_db(), name_key, dir_entry_view(buf));
+    }
 }
 
-Result<std::tuple<DirectoryEntry, off_t> > CachedDir::ReadDir()
+
+/**
+ * Determine the block size of the cached contents and record it in `meta`.
+ */
+static std::uint32_t init_block_size(MDBEnv &env, MDBDbi &meta_db,
+                                     std::uint32_t requested)
 {
-    if (m_eof) {
-        /* return zero error code for EOF */
-        return make_result(FAILED, 0);
+    if (requested != 0 && !is_valid_block_size(requested)) {
+        throw std::invalid_argument("invalid block size " +
+                                    std::to_string(requested));
     }
 
-    MDBOutVal key, value;
-    const off_t this_offset = m_curr_off;
-    m_cursor.get(key, value, MDB_GET_CURRENT);
-    assert(key.get<ino_t>() == m_ino);
-
-    /* check if the next item still belongs to this key */
-    if (m_cursor.nextprev(key, value, MDB_NEXT_DUP) == MDB_NOTFOUND) {
-        mark_eof();
+    auto txn = env.getRWTransaction();
+    MDBOutVal value{};
+    std::uint32_t result;
+    if (txn->get(meta_db, META_KEY_BLOCK_SIZE, value) == MDB_NOTFOUND) {
+        const bool is_new = txn->get(meta_db, META_KEY_NEXT_INO, value) == MDB_NOTFOUND;
+        result = CACHE_PAGE_SIZE;
+        if (is_new && requested != 0) {
+            result = requested;
+        }
     } else {
-        /* this is an assumption about how LMDB works */
-        assert(key.get<ino_t>() == m_ino);
-        m_curr_off += 1;
+        result = value.get<std::uint32_t>();
     }
+    if (requested != 0 && requested != result) {
+        throw std::runtime_error("the cache uses a block size of " +
+                                 std::to_string(result) + " bytes");
+    }
+    txn->put(meta_db, META_KEY_BLOCK_SIZE, result);
+    txn->commit();
+    return result;
+}
 
+/* pin rule records, shared by the transactions and PinRuleStore */
 
-    Result<DirectoryEntry> result =
-            parse_entry(reinterpret_cast<char*>(value.d_mdbval.mv_data),
-                        value.d_mdbval.mv_size);
-    if (!result) {
-        return make_result(FAILED, result.error());
+static std::vector<PinRule> read_pin_rules(MDBROTransactionImpl &txn, MDBDbi &pins_db)
+{
+    std::vector<PinRule> result;
+    auto cursor = txn.getCursor(pins_db);
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    for (int rc = cursor.nextprev(key_out, value_out, MDB_FIRST);
+         rc == 0;
+         rc = cursor.nextprev(key_out, value_out, MDB_NEXT))
+    {
+        auto rule = PinRule::parse(key_out.get<std::uint64_t>(), char_view(value_out));
+        if (rule) {
+            result.emplace_back(std::move(*rule));
+        }
     }
-
-    return std::make_tuple(std::move(*result), this_offset);
+    // the keys are not ordered numerically
+    std::sort(result.begin(), result.end(), [](const PinRule &a, const PinRule &b) {
+        return a.id < b.id;
+    });
+    return result;
 }
 
-Result<void> CachedDir::Seek(off_t offset)
+static std::uint64_t read_pin_generation(MDBROTransactionImpl &txn, MDBDbi &meta_db)
 {
-    if (offset < 0) {
-        return make_result(FAILED, EINVAL);
-    }
-    if (offset > m_curr_off) {
-        /* seeking forward is not supported for now; we should not need this
-         * since directories are supposed to be a stream */
-        return make_result(FAILED, EINVAL);
-    }
-    if (offset == m_curr_off) {
-        return make_result();
+    MDBOutVal value{};
+    if (txn.get(meta_db, META_KEY_PIN_GENERATION, value) == MDB_NOTFOUND) {
+        return 0;
     }
+    return value.get<std::uint64_t>();
+}
 
-    MDBOutVal key, value;
-    while (m_curr_off > offset) {
-        int rc = m_cursor.nextprev(key, value, MDB_PREV_DUP);
-        assert(rc == 0);
-        assert(key.get<ino_t>() == m_ino);
-        m_curr_off -= 1;
+static std::uint64_t put_pin_rule(MDBRWTransactionImpl &txn, MDBDbi &meta_db,
+                                  MDBDbi &pins_db, const PinRule &rule)
+{
+    std::uint64_t id = 1;
+    MDBOutVal value{};
+    if (txn.get(meta_db, META_KEY_NEXT_PIN_ID, value) != MDB_NOTFOUND) {
+        id = value.get<std::uint64_t>();
     }
+    txn.put(meta_db, META_KEY_NEXT_PIN_ID, id + 1);
+    txn.put(pins_db, id, rule.serialise());
+    txn.put(meta_db, META_KEY_PIN_GENERATION, read_pin_generation(txn, meta_db) + 1);
+    return id;
+}
 
+static Result<void> retire_pin_rule(MDBRWTransactionImpl &txn, MDBDbi &meta_db,
+                                    MDBDbi &pins_db, std::uint64_t id)
+{
+    MDBOutVal value{};
+    if (txn.get(pins_db, id, value) == MDB_NOTFOUND) {
+        return make_result(FAILED, ENOENT);
+    }
+    auto rule = PinRule::parse(id, char_view(value));
+    if (!rule || rule->retired) {
+        return make_result(FAILED, ENOENT);
+    }
+    rule->retired = true;
+    txn.put(pins_db, id, rule->serialise());
+    txn.put(meta_db, META_KEY_PIN_GENERATION, read_pin_generation(txn, meta_db) + 1);
     return make_result();
 }
 
-
 /* Dragonstash::CacheDatabase */
 
-CacheDatabase::CacheDatabase(std::shared_ptr<MDBEnv> env):
+CacheDatabase::CacheDatabase(std::shared_ptr<MDBEnv> env,
+                             const std::filesystem::path &content_root,
+                             std::uint32_t block_size):
     m_env(std::move(env)),
     m_meta_db(m_env->openDB(DB_NAME_META, MDB_CREATE)),
     m_inodes_db(m_env->openDB(DB_NAME_INODES, MDB_CREATE)),
@@ -237,7 +405,14 @@ CacheDatabase::CacheDatabase(std::shared_ptr<MDBEnv> env):
     m_tree_name_key_db(m_env->openDB(DB_NAME_TREE_NAME_KEY, MDB_CREATE)),
     m_orphan_db(m_env->openDB(DB_NAME_ORPHANS, MDB_CREATE)),
     m_links_db(m_env->openDB(DB_NAME_LINKS, MDB_CREATE)),
-    m_max_name_length(0)
+    m_negative_db(m_env->openDB(DB_NAME_NEGATIVE, MDB_CREATE)),
+    m_pins_db(m_env->openDB(DB_NAME_PINS, MDB_CREATE)),
+    m_journal_db(m_env->openDB(DB_NAME_JOURNAL, MDB_CREATE)),
+    m_dir_sync_db(m_env->openDB(DB_NAME_DIR_SYNC, MDB_CREATE)),
+    m_max_name_length(0),
+    m_block_size(init_block_size(*m_env, m_meta_db, block_size)),
+    m_content_store(content_root, 0, m_block_size),
+    m_orphan_cursor(INVALID_INO)
 {
     validate_max_key_size();
 }
@@ -273,30 +448,66 @@ Result<void> CacheDatabase::check_name(std::string_view name, bool for_writing)
 }
 
 
-/* Dragonstash::Cache */
-
 template<typename T>
-auto with_rw_txn(CacheTransactionRW &&txn, T &&f) -> decltype(f(txn))
+auto with_rw_txn(OrphanReaper &reaper, CacheTransactionRW &&txn, T &&f) -> decltype(f(txn))
 {
     auto result = f(txn);
     if (!result) {
         txn.abort();
         return result;
     }
-    (void)txn.clean_orphans();
+    auto reap_result = txn.reap_orphans(reaper.budget());
     {
         auto commit_result = txn.commit();
         if (!commit_result) {
             return make_result(FAILED, commit_result.error());
         }
     }
+    if (reap_result && *reap_result) {
+        reaper.wake();
+    }
     return result;
 }
 
-const bool Cache::deadlock_detection = debug_mutex::is_safe;
+/* Dragonstash::CacheDirectoryLock */
+
+CacheDirectoryLock::CacheDirectoryLock(const std::filesystem::path &db_path):
+    m_fd(::open((db_path / "lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600))
+{
+    if (m_fd < 0) {
+        throw std::runtime_error(std::string("failed to open cache lock: ") + std::strerror(errno));
+    }
+    if (flock(m_fd, LOCK_EX | LOCK_NB) != 0) {
+        const int err = errno;
+        ::close(m_fd);
+        if (err == EWOULDBLOCK) {
+            throw std::runtime_error("cache is in use by another process: " + db_path.string());
+        }
+        throw std::runtime_error(std::string("failed to lock cache: ") + std::strerror(err));
+    }
+}
+
+CacheDirectoryLock::~CacheDirectoryLock()
+{
+    ::close(m_fd);
+}
+
+/* Dragonstash::Cache */
 
-Cache::Cache(const std::filesystem::path &db_path):
-    m_db(getMDBEnv((db_path / "db").c_str(), MDB_NOSUBDIR, 0600))
+static std::shared_ptr<MDBEnv> open_env(const std::filesystem::path &db_path)
+{
+    // MDB_NOTLS: directory streams keep their read-only transaction across
+    // requests, which may be served by different threads.
+    return getMDBEnv((db_path / "db").c_str(), MDB_NOSUBDIR | MDB_NOTLS, 0600);
+}
+
+Cache::Cache(const std::filesystem::path &db_path, std::uint32_t block_size):
+    m_dir_lock(db_path),
+    m_db(open_env(db_path),
+         db_path / "data",
+         block_size),
+    m_group_commit(*this),
+    m_orphan_reaper(*this)
 {
     auto txn = m_db.env().getRWTransaction();
     MDBOutVal value{};
@@ -324,22 +535,44 @@ Cache::Cache(const std::filesystem::path &db_path):
         const ino_t root_ino = ROOT_INO;
         auto buf = serialize_as<char>(root);
         txn->put(m_db.inodes_db(), root_ino, buf);
+    } else if (txn->get(m_db.meta_db(), META_KEY_DIR_ENTRY_VERSION, value) == MDB_NOTFOUND ||
+               value.get<std::uint8_t>() < DIR_ENTRY_VERSION) {
+        migrate_dir_entries(m_db, txn);
+    }
+    txn->put(m_db.meta_db(), META_KEY_DIR_ENTRY_VERSION, DIR_ENTRY_VERSION);
+    bool have_orphans = false;
+    {
+        auto cursor = txn->getCursor(m_db.orphan_db());
+        MDBOutVal key_out{};
+        have_orphans = cursor.nextprev(key_out, value, MDB_FIRST) == 0;
     }
     txn->commit();
 
-    with_rw_txn(begin_rw(), [](CacheTransactionRW &txn){
-        return txn.clean_orphans();
-    });
+    // orphans left over from the previous run are reaped by the commit; a
+    // large backlog, e.g. of a subtree dropped shortly before, is left to the
+    // reaper and does not delay the mount
+    if (have_orphans) {
+        (void)with_rw_txn(m_orphan_reaper, begin_rw(), [](CacheTransactionRW&){
+            return make_result();
+        });
+    }
 }
 
 CacheTransactionRO Cache::begin_ro()
 {
-    return CacheTransactionRO(m_db, m_db.env().getROTransaction());
+    // the epoch must be sampled before the snapshot is taken, see PathCache
+    const std::uint64_t path_cache_epoch = m_db.path_cache().epoch();
+    CacheTransactionRO txn(m_db, m_db.env().getROTransaction());
+    txn.m_path_cache_epoch = path_cache_epoch;
+    return txn;
 }
 
 CacheTransactionRW Cache::begin_rw()
 {
-    return CacheTransactionRW(m_db, m_db.env().getRWTransaction());
+    Trace::Span span(Trace::Phase::LOCK_WAIT);
+    MDBRWTransaction txn = m_db.env().getRWTransaction();
+    span.end();
+    return CacheTransactionRW(m_db, std::move(txn));
 }
 
 Result<std::string> Cache::name(ino_t ino)
@@ -364,21 +597,30 @@ Result<Stat> Cache::getattr(ino_t ino)
 
 Result<ino_t> Cache::emplace(ino_t parent, std::string_view name, const InodeAttributes &attrs)
 {
-    return with_rw_txn(begin_rw(), [parent, name, &attrs](CacheTransactionRW &txn){
-        return txn.emplace(parent, name, attrs);
+    Result<ino_t> ino_result(FAILED, EIO);
+    auto write_result = write([parent, name, &attrs, &ino_result](CacheTransactionRW &txn) -> Result<void> {
+        ino_result = txn.emplace(parent, name, attrs);
+        if (!ino_result) {
+            return copy_error(ino_result);
+        }
+        return make_result();
     });
+    if (!write_result) {
+        return copy_error(write_result);
+    }
+    return ino_result;
 }
 
 Result<void> Cache::lock(ino_t ino)
 {
-    return with_rw_txn(begin_rw(), [ino](CacheTransactionRW &txn){
+    return with_rw_txn(m_orphan_reaper, begin_rw(), [ino](CacheTransactionRW &txn){
         return txn.lock(ino);
     });
 }
 
 Result<void> Cache::release(ino_t ino)
 {
-    return with_rw_txn(begin_rw(), [ino](CacheTransactionRW &txn){
+    return with_rw_txn(m_orphan_reaper, begin_rw(), [ino](CacheTransactionRW &txn){
         return txn.release(ino);
     });
 }
@@ -390,7 +632,7 @@ Result<std::string> Cache::readlink(ino_t ino)
 
 Result<void> Cache::writelink(ino_t ino, std::string_view dest)
 {
-    return with_rw_txn(begin_rw(), [ino, &dest](CacheTransactionRW &txn){
+    return write([ino, &dest](CacheTransactionRW &txn){
         return txn.writelink(ino, dest);
     });
 }
@@ -400,35 +642,362 @@ Result<std::string> Cache::path(ino_t ino)
     return begin_ro().path(ino);
 }
 
+Result<std::unique_ptr<CachedDir>> Cache::opendir(ino_t dir)
+{
+    auto txn = begin_ro();
+    auto parent_result = txn.parent(dir);
+    if (!parent_result) {
+        return copy_error(parent_result);
+    }
+    const ino_t parent = *parent_result;
+    return std::make_unique<CachedDir>(*this, dir, parent);
+}
+
+Result<std::shared_ptr<RegularFileHandle>> Cache::open_file(ino_t ino)
+{
+    return m_db.content_store().open(ino);
+}
+
+void Cache::set_content_budget(std::uint64_t bytes)
+{
+    m_db.content_store().set_budget(bytes);
+}
+
+std::size_t Cache::unpin(const PinPolicy &released, const PinPolicy &kept)
+{
+    ContentStore &store = m_db.content_store();
+    std::size_t unpinned = 0;
+    for (const ino_t ino: store.pinned()) {
+        {
+            auto txn = begin_ro();
+            auto attr_result = txn.getattr(ino);
+            if (!attr_result || !S_ISREG(attr_result->attr.mode)) {
+                continue;
+            }
+            auto path_result = txn.path(ino);
+            if (!path_result) {
+                continue;
+            }
+            const std::uint64_t size = attr_result->attr.common.size;
+            if (!released.matches(*path_result, size) || kept.matches(*path_result, size)) {
+                continue;
+            }
+        }
+
+        auto handle_result = store.open(ino);
+        if (!handle_result) {
+            continue;
+        }
+        if ((*handle_result)->unpin() > 0) {
+            ++unpinned;
+        }
+    }
+    return unpinned;
+}
+
+void Cache::collect_metrics(Metrics::TextWriter &out)
+{
+    using Type = Metrics::TextWriter::Type;
+    out.family("dragonstash_cache_transaction_duration_seconds", Type::HISTOGRAM,
+               "Lifetime of top-level LMDB transactions.");
+    out.histogram("mode=\"ro\"", m_db.transaction_duration(false));
+    out.histogram("mode=\"rw\"", m_db.transaction_duration(true));
+
+    out.family("dragonstash_cache_commits_total", Type::COUNTER,
+               "Top-level LMDB write transactions committed.");
+    out.sample("", m_db.commits().value());
+    out.family("dragonstash_cache_group_commits_total", Type::COUNTER,
+               "Commits issued by the group commit.");
+    out.sample("", m_group_commit.commits());
+    out.family("dragonstash_cache_group_operations_total", Type::COUNTER,
+               "Write operations run through the group commit.");
+    out.sample("", m_group_commit.operations());
+    out.family("dragonstash_cache_orphan_reap_failures_total", Type::COUNTER,
+               "Background orphan reaping steps which failed.");
+    out.sample("", m_orphan_reaper.failures());
+
+    const InodeReferences &locks = m_db.in_memory_locks();
+    out.family("dragonstash_cache_inode_lock_acquisitions_total", Type::COUNTER,
+               "Shard locks taken to update in-memory inode references.");
+    out.sample("", locks.lock_acquisitions());
+    out.family("dragonstash_cache_inode_lock_wait_seconds", Type::HISTOGRAM,
+               "Time spent waiting for contended inode reference shard locks.");
+    out.histogram("", locks.lock_wait());
+
+    SpaceManager &space = m_db.content_store().space();
+    out.family("dragonstash_cache_content_blocks", Type::GAUGE,
+               "Blocks of cached file contents which count against the budget.");
+    out.sample("", space.used());
+    out.family("dragonstash_cache_content_budget_blocks", Type::GAUGE,
+               "Budget for cached file contents in blocks; zero means unlimited.");
+    out.sample("", space.budget());
+    out.family("dragonstash_cache_block_size_bytes", Type::GAUGE,
+               "Block size of cached file contents.");
+    out.sample("", std::uint64_t(block_size()));
+}
+
+/* Dragonstash::PinRuleStore */
+
+PinRuleStore::PinRuleStore(const std::filesystem::path &db_path):
+    m_env(open_env(db_path)),
+    m_meta_db(m_env->openDB(DB_NAME_META, MDB_CREATE)),
+    m_pins_db(m_env->openDB(DB_NAME_PINS, MDB_CREATE))
+{
+
+}
+
+std::vector<PinRule> PinRuleStore::rules()
+{
+    auto txn = m_env->getROTransaction();
+    return read_pin_rules(*txn, m_pins_db);
+}
+
+std::uint64_t PinRuleStore::add(const PinRule &rule)
+{
+    auto txn = m_env->getRWTransaction();
+    const std::uint64_t id = put_pin_rule(*txn, m_meta_db, m_pins_db, rule);
+    txn->commit();
+    return id;
+}
+
+Result<void> PinRuleStore::remove(std::uint64_t id)
+{
+    auto txn = m_env->getRWTransaction();
+    auto result = retire_pin_rule(*txn, m_meta_db, m_pins_db, id);
+    if (!result) {
+        txn->abort();
+        return result;
+    }
+    txn->commit();
+    return result;
+}
+
+/* Dragonstash::GroupCommit */
+
+GroupCommit::GroupCommit(Cache &cache):
+    m_cache(cache),
+    m_leader_active(false),
+    m_max_delay(0),
+    m_max_operations(1024),
+    m_commits(0),
+    m_operations(0)
+{
+
+}
+
+void GroupCommit::run_group(const std::vector<Pending*> &group)
+{
+    auto txn = m_cache.begin_rw();
+    for (Pending *pending: group) {
+        // attribute the work to the request which submitted it
+        const Trace::Scope trace_scope(pending->trace);
+        auto nested = txn.begin_nested();
+        try {
+            pending->result = pending->op(nested);
+        } catch (...) {
+            pending->exception = std::current_exception();
+            pending->result = make_result(FAILED, EIO);
+        }
+        if (pending->result) {
+            pending->result = nested.commit();
+        } else if (nested) {
+            nested.abort();
+        }
+    }
+    m_operations.fetch_add(group.size(), std::memory_order_relaxed);
+
+    auto reap_result = txn.reap_orphans(m_cache.orphan_reaper().budget());
+    auto commit_result = txn.commit();
+    m_commits.fetch_add(1, std::memory_order_relaxed);
+    if (!commit_result) {
+        for (Pending *pending: group) {
+            if (pending->result) {
+                pending->result = commit_result;
+            }
+        }
+    } else if (reap_result && *reap_result) {
+        m_cache.orphan_reaper().wake();
+    }
+}
+
+void GroupCommit::set_window(std::chrono::microseconds max_delay,
+                             std::size_t max_operations)
+{
+    std::lock_guard<std::mutex> guard(m_queue_mutex);
+    m_max_delay = max_delay;
+    m_max_operations = std::max<std::size_t>(max_operations, 1);
+}
+
+Result<void> GroupCommit::submit(WriteOperation &&op)
+{
+    Trace::Span span(Trace::Phase::GROUP_COMMIT);
+    Pending pending{std::move(op), Result<void>(), nullptr, false, Trace::current_handle()};
+
+    std::unique_lock<std::mutex> guard(m_queue_mutex);
+    m_queue.push_back(&pending);
+    // wake up a leader which may be waiting for the group to fill up
+    m_queue_cv.notify_all();
+
+    while (!pending.done) {
+        if (m_leader_active) {
+            m_queue_cv.wait(guard);
+            continue;
+        }
+
+        m_leader_active = true;
+        if (m_max_delay.count() > 0) {
+            m_queue_cv.wait_for(guard, m_max_delay, [this](){
+                return m_queue.size() >= m_max_operations;
+            });
+        }
+
+        const std::size_t group_size = std::min(m_queue.size(), m_max_operations);
+        std::vector<Pending*> group(m_queue.begin(),
+                                    m_queue.begin() + group_size);
+        m_queue.erase(m_queue.begin(), m_queue.begin() + group_size);
+        guard.unlock();
+
+        try {
+            run_group(group);
+        } catch (...) {
+            auto exception = std::current_exception();
+            for (Pending *member: group) {
+                if (!member->exception) {
+                    member->exception = exception;
+                }
+            }
+        }
+
+        guard.lock();
+        for (Pending *member: group) {
+            member->done = true;
+        }
+        m_leader_active = false;
+        m_queue_cv.notify_all();
+    }
+    guard.unlock();
+
+    if (pending.exception) {
+        std::rethrow_exception(pending.exception);
+    }
+    return pending.result;
+}
+
+/* Dragonstash::OrphanReaper */
+
+OrphanReaper::OrphanReaper(Cache &cache, std::size_t budget):
+    m_cache(cache),
+    m_budget(std::max<std::size_t>(budget, 1)),
+    m_pending(false),
+    m_busy(false),
+    m_stopping(false),
+    m_steps(0),
+    m_failures(0),
+    m_thread([this]() { run(); })
+{
+
+}
+
+OrphanReaper::~OrphanReaper()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake_cv.notify_all();
+    m_thread.join();
+}
+
+void OrphanReaper::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_wake_cv.wait(lock, [this]() { return m_pending || m_stopping; });
+        if (m_stopping) {
+            break;
+        }
+        m_pending = false;
+        m_busy = true;
+        lock.unlock();
+
+        bool more = true;
+        while (more) {
+            more = false;
+            auto write_result = m_cache.write([this, &more](CacheTransactionRW &txn) -> Result<void> {
+                auto reap_result = txn.reap_orphans(m_budget);
+                if (!reap_result) {
+                    return copy_error(reap_result);
+                }
+                more = *reap_result;
+                return make_result();
+            });
+            m_steps.fetch_add(1, std::memory_order_relaxed);
+            if (!write_result) {
+                // the next commit which finds leftovers wakes us again;
+                // failures are reported through failures()
+                m_failures.fetch_add(1, std::memory_order_relaxed);
+                more = false;
+            }
+
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (m_stopping) {
+                more = false;
+            }
+        }
+
+        lock.lock();
+        m_busy = false;
+        if (!m_pending) {
+            m_idle_cv.notify_all();
+        }
+    }
+    m_idle_cv.notify_all();
+}
+
+void OrphanReaper::wake()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending = true;
+    }
+    m_wake_cv.notify_one();
+}
+
+void OrphanReaper::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle_cv.wait(lock, [this]() { return (!m_pending && !m_busy) || m_stopping; });
+}
+
 /* Dragonstash::CacheTransactionRO */
 
 CacheTransactionRO::CacheTransactionRO(CacheDatabase &db, MDBROTransaction &&txn,
                                        CacheTransactionRW *parent):
     m_db(&db),
     m_txn(std::move(txn)),
-    m_parent(parent)
+    m_parent(parent),
+    m_log(db.transaction_logs().acquire()),
+    m_started(Metrics::Clock::now()),
+    m_read_write(false)
 {
 
 }
 
-InodeReferences &CacheTransactionRO::inode_in_memory_locks() {
-    if (m_inode_counter_lock) {
-        return db().in_memory_locks();
+CacheTransactionRO::~CacheTransactionRO()
+{
+    if (m_txn) {
+        finish();
     }
-
-    CacheTransactionRW *parent = m_parent;
-    while (parent) {
-        if (parent->m_inode_counter_lock) {
-            return parent->db().in_memory_locks();
-        }
-        parent = parent->m_parent;
+    if (m_db) {
+        m_db->transaction_logs().recycle(std::move(m_log));
     }
+}
 
-    // we don’t hold the lock and no parent holds the lock -> we need to lock
-    // here.
-    assert(!m_inode_counter_lock);
-    m_inode_counter_lock = db().in_memory_lock_guard();
-    return db().in_memory_locks();
+void CacheTransactionRO::finish()
+{
+    if (!m_parent) {
+        db().transaction_duration(m_read_write).record_since(m_started);
+    }
 }
 
 Result<std::string> CacheTransactionRO::name(ino_t parent, ino_t ino)
@@ -545,6 +1114,30 @@ Result<ino_t> CacheTransactionRO::lookup(ino_t parent, std::string_view name)
     return make_result(FAILED, ENOENT);
 }
 
+Result<std::chrono::system_clock::time_point> CacheTransactionRO::lookup_negative(
+        ino_t parent, std::string_view name)
+{
+    {
+        Result<void> name_ok = db().check_name(name, false);
+        if (!name_ok) {
+            return make_result(FAILED, name_ok.error());
+        }
+    }
+
+    std::string key;
+    key.resize(sizeof(ino_t) + name.length());
+    memcpy(&key[0], &parent, sizeof(ino_t));
+    memcpy(&key[sizeof(ino_t)], name.data(), name.length());
+
+    MDBOutVal value_out{};
+    if (ro_transaction()->get(db().negative_db(), key, value_out) == MDB_NOTFOUND) {
+        return make_result(FAILED, ENOENT);
+    }
+    return std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::nanoseconds(value_out.get<std::int64_t>())));
+}
+
 Result<Stat> CacheTransactionRO::getattr(ino_t ino)
 {
     MDBOutVal value{};
@@ -560,6 +1153,7 @@ Result<Stat> CacheTransactionRO::getattr(ino_t ino)
     return Stat{
         InodeAttributes(parsed->attr),
         ino,
+        db().block_size(),
     };
 }
 
@@ -586,8 +1180,9 @@ Result<DirectoryEntry> CacheTransactionRO::readdir(ino_t dir, ino_t prev_end)
         return make_result(DirectoryEntry{
                                Stat{
                                    .ino = dir,
+                                   .blksize = db().block_size(),
                                },
-                               std::string("."),
+                               std::string_view("."),
                                false,
                            });
     }
@@ -600,8 +1195,9 @@ Result<DirectoryEntry> CacheTransactionRO::readdir(ino_t dir, ino_t prev_end)
         return make_result(DirectoryEntry{
                                Stat{
                                    .ino = *parent_result,
+                                   .blksize = db().block_size(),
                                },
-                               std::string(".."),
+                               std::string_view(".."),
                                false,
                            });
     }
@@ -644,16 +1240,19 @@ Result<DirectoryEntry> CacheTransactionRO::readdir(ino_t dir, ino_t prev_end)
         }
     }
 
-    auto parse_result = DirEntry::parse(view(value_out));
+    auto parse_result = DirEntry::parse_inplace(view(value_out));
     if (!parse_result) {
         return make_result(FAILED, EIO);
     }
+    const auto &entry = *std::get<0>(*parse_result);
     return make_result(DirectoryEntry{
                            Stat{
+                               .attr = entry.attr,
                                .ino = key[1],
+                               .blksize = db().block_size(),
                            },
-                           std::string(std::get<1>(*parse_result)),
-                           false,
+                           std::get<1>(*parse_result),
+                           entry.has_attributes(),
                        });
 }
 
@@ -663,25 +1262,51 @@ Result<std::string> CacheTransactionRO::path(ino_t ino)
         return "";
     }
 
+    Trace::Span span(Trace::Phase::PATH_WALK);
+
+    // Write transactions bypass the path cache: they have to see their own
+    // uncommitted changes and must not leak them into the cache.
+    PathCache *path_cache = m_path_cache_epoch ? &db().path_cache() : nullptr;
+
     std::string buf;
     do {
-        auto parent_result = parent(ino);
-        if (!parent_result) {
-            return copy_error(parent_result);
+        ino_t parent_ino;
+        std::string entry_name;
+
+        std::optional<PathCache::Entry> cached;
+        if (path_cache) {
+            cached = path_cache->lookup(ino);
         }
 
-        auto name_result = name(*parent_result, ino);
-        if (!name_result) {
-            return copy_error(name_result);
+        if (cached) {
+            parent_ino = cached->parent;
+            entry_name = std::move(cached->name);
+        } else {
+            auto parent_result = parent(ino);
+            if (!parent_result) {
+                return copy_error(parent_result);
+            }
+
+            auto name_result = name(*parent_result, ino);
+            if (!name_result) {
+                return copy_error(name_result);
+            }
+
+            parent_ino = *parent_result;
+            entry_name = std::move(*name_result);
+            if (path_cache && parent_ino != INVALID_INO) {
+                path_cache->insert(ino, parent_ino, entry_name,
+                                   *m_path_cache_epoch);
+            }
         }
 
         std::size_t offset = buf.size();
-        buf.resize(offset + name_result->size() + 1);
-        std::copy(name_result->rbegin(), name_result->rend(),
+        buf.resize(offset + entry_name.size() + 1);
+        std::copy(entry_name.rbegin(), entry_name.rend(),
                   &buf[offset]);
-        offset += name_result->size();
+        offset += entry_name.size();
         buf[offset++] = '/';
-        ino = *parent_result;
+        ino = parent_ino;
     } while (ino != ROOT_INO);
 
     std::reverse(buf.begin(), buf.end());
@@ -696,9 +1321,7 @@ Result<void> CacheTransactionRO::lock(ino_t ino)
         return copy_error(inc_result);
     }
 
-    add_transaction_hook(nullptr, nullptr, nullptr, [&inode_locks, ino](){
-        safe_assert(inode_locks.decref(ino, 1));
-    });
+    m_log.record_lock(ino, 1);
 
     return make_result();
 }
@@ -712,9 +1335,26 @@ Result<void> CacheTransactionRO::release(ino_t ino, uint64_t nlocks)
     auto &inode_locks = inode_in_memory_locks();
     safe_assert(inode_locks.decref(ino, nlocks));
 
-    add_transaction_hook(nullptr, nullptr, nullptr, [&inode_locks, ino, nlocks](){
-        safe_assert(inode_locks.incref(ino, nlocks));
-    });
+    m_log.record_release(ino, nlocks);
+
+    return make_result();
+}
+
+Result<void> CacheTransactionRO::release_many(std::vector<InodeReferences::Release> &releases,
+                                              std::vector<ino_t> *reapable)
+{
+    if (releases.empty()) {
+        return make_result();
+    }
+
+    auto &inode_locks = inode_in_memory_locks();
+    inode_locks.decref_many(releases, reapable);
+
+    for (const auto &release: releases) {
+        if (release.by > 0) {
+            m_log.record_release(release.ino, release.by);
+        }
+    }
 
     return make_result();
 }
@@ -738,27 +1378,90 @@ Result<bool> CacheTransactionRO::test_flag(ino_t ino, InodeFlag flag)
     return (*inode)->test_flag(flag);
 }
 
-void CacheTransactionRO::abort()
+Result<DirSyncStamp> CacheTransactionRO::dir_sync_stamp(ino_t ino)
+{
+    auto synced = test_flag(ino, InodeFlag::SYNCED);
+    if (!synced) {
+        return copy_error(synced);
+    }
+    MDBOutVal value_out{};
+    if (!*synced ||
+            ro_transaction()->get(db().dir_sync_db(), ino, value_out) == MDB_NOTFOUND) {
+        return make_result(FAILED, ENODATA);
+    }
+    return value_out.get_struct<DirSyncStamp>();
+}
+
+std::vector<PinRule> CacheTransactionRO::pin_rules()
+{
+    return read_pin_rules(*ro_transaction(), db().pins_db());
+}
+
+std::uint64_t CacheTransactionRO::pin_generation()
+{
+    return read_pin_generation(*ro_transaction(), db().meta_db());
+}
+
+Result<JournalEntry> CacheTransactionRO::journal(ino_t ino)
 {
-    // two separate loops here to ensure that all stage 1 rollback callbacks
-    // run before all main
-    for (auto iter = m_transaction_hooks.rbegin();
-         iter != m_transaction_hooks.rend();
-         ++iter)
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    if (ro_transaction()->get(db().journal_db(), ino, value_out) == MDB_NOTFOUND) {
+        return make_result(FAILED, ENOENT);
+    }
+    const auto header = value_out.get_struct<JournalHeader>();
+    JournalEntry entry{
+        header.generation,
+        header.size,
+        (header.flags & JournalHeader::FLAG_CREATED) != 0,
+        (header.flags & JournalHeader::FLAG_RESIZED) != 0,
+        {}
+    };
+
+    auto cursor = ro_transaction()->getCursor(db().journal_db());
+    JournalEntry::Extent extent{};
+    for (int rc = cursor.lower_bound(journal_extent_key(ino, 0), key_out, value_out);
+         rc == 0 && parse_journal_extent(key_out, value_out, ino, extent);
+         rc = cursor.next(key_out, value_out))
     {
-        iter->stage_1_rollback();
+        entry.extents.push_back(extent);
     }
-    for (auto iter = m_transaction_hooks.rbegin();
-         iter != m_transaction_hooks.rend();
-         ++iter)
+    return entry;
+}
+
+bool CacheTransactionRO::journaled(ino_t ino)
+{
+    MDBOutVal value_out{};
+    return ro_transaction()->get(db().journal_db(), ino, value_out) != MDB_NOTFOUND;
+}
+
+std::vector<ino_t> CacheTransactionRO::journaled_inodes()
+{
+    std::vector<ino_t> result;
+    auto cursor = ro_transaction()->getCursor(db().journal_db());
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    for (int rc = cursor.nextprev(key_out, value_out, MDB_FIRST);
+         rc == 0;
+         rc = cursor.next(key_out, value_out))
     {
-        iter->rollback();
+        if (key_out.d_mdbval.mv_size == sizeof(ino_t)) {
+            result.push_back(key_out.get<ino_t>());
+        }
     }
+    // keys are in native byte order
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void CacheTransactionRO::abort()
+{
+    finish();
+    m_log.rollback(inode_in_memory_locks());
+    m_log.clear();
     m_txn->abort();
     m_txn = nullptr;
-    if (m_inode_counter_lock) {
-        m_inode_counter_lock.unlock();
-    }
+    m_orphaned_inodes.clear();
 }
 
 Result<void> CacheTransactionRO::commit()
@@ -767,40 +1470,38 @@ Result<void> CacheTransactionRO::commit()
         return make_result();
     }
 
+    Trace::Span span(Trace::Phase::COMMIT);
     if (!m_parent) {
-        Result<void> result;
-        auto iter = m_transaction_hooks.begin();
-        for (; iter != m_transaction_hooks.end(); ++iter) {
-            result = iter->stage_1_commit();
-            if (!result) {
-                abort();
-                return result;
-            }
+        auto result = m_log.stage_1_commit();
+        if (!result) {
+            abort();
+            return result;
         }
 
         // now all preparations have passed, we can go on and execute the commit
-        for (TransactionHook &hook: m_transaction_hooks) {
-            hook.stage_2_commit();
-        }
+        m_log.stage_2_commit();
     }
 
     m_txn->commit();
+    finish();
     if (m_parent) {
         // move all transaction hooks to parent: note that we don't execute any
         // of them in this transaction, not even the pre-checks.
-        std::move(m_transaction_hooks.begin(),
-                  m_transaction_hooks.end(),
-                  std::back_inserter(m_parent->m_transaction_hooks));
-    }
-    m_transaction_hooks.clear();
-    m_txn = nullptr;
-    if (m_inode_counter_lock) {
-        if (m_parent) {
-            m_parent->m_inode_counter_lock = std::move(m_inode_counter_lock);
-        } else {
-            m_inode_counter_lock.unlock();
+        m_parent->m_log.append(m_log);
+        std::copy(m_orphaned_inodes.begin(),
+                  m_orphaned_inodes.end(),
+                  std::back_inserter(m_parent->m_orphaned_inodes));
+    } else {
+        for (ino_t ino: m_orphaned_inodes) {
+            db().path_cache().invalidate(ino);
+        }
+        if (m_read_write) {
+            db().commits().add();
         }
     }
+    m_orphaned_inodes.clear();
+    m_log.clear();
+    m_txn = nullptr;
     return make_result();
 }
 
@@ -809,7 +1510,7 @@ Result<void> CacheTransactionRO::commit()
 CacheTransactionRW::CacheTransactionRW(CacheDatabase &cache, MDBRWTransaction &&txn, CacheTransactionRW *parent):
     CacheTransactionRO(cache, std::move(txn), parent)
 {
-
+    m_read_write = true;
 }
 
 ino_t CacheTransactionRW::allocate_next_inode()
@@ -842,6 +1543,9 @@ Result<void> CacheTransactionRW::make_orphan(ino_t ino)
     // and add it to the orphan database
     // we don't yet do any clean up or deletion.
 
+    db().path_cache().invalidate(ino);
+    m_orphaned_inodes.push_back(ino);
+
     std::string key;
     key.resize(sizeof(ino_t)*2);
     memcpy(&key[0], &parent, sizeof(ino_t));
@@ -892,6 +1596,7 @@ Result<void> CacheTransactionRW::make_orphan(ino_t ino)
 Result<ino_t> CacheTransactionRW::emplace(ino_t parent, std::string_view name,
                                           const InodeAttributes &attrs)
 {
+    Trace::Span span(Trace::Phase::EMPLACE);
     {
         auto name_ok = db().check_name(name, true);
         if (!name_ok) {
@@ -901,6 +1606,8 @@ Result<ino_t> CacheTransactionRW::emplace(ino_t parent, std::string_view name,
 
     Inode inode = mkinode(attrs, parent);
 
+    forget_negative(parent, name);
+
     // orphan old inode if this emplace operation overwrites an existing inode
     {
         auto name_cursor = rw_transaction()->getRWCursor(db().tree_name_key_db());
@@ -923,22 +1630,27 @@ Result<ino_t> CacheTransactionRW::emplace(ino_t parent, std::string_view name,
             assert(ino_cursor.find(old_ino, key_out, value_out) == 0);
             auto old_inode = inode_from_lmdb_inplace(value_out);
             assert(old_inode);
+            if (journaled(old_ino)) {
+                // the cache is newer than the backend; keep the inode as it
+                // is until the changes have been written back
+                keep_rewrite_candidate(parent, old_ino);
+                return make_result(old_ino);
+            }
             if (((*old_inode)->attr.mode & S_IFMT) == (attrs.mode & S_IFMT)) {
-                // do *not* remove, only update in-place
+                // do *not* remove, only update in-place; the flags describe
+                // the cached state and stay as they are
+                inode.flags = (*old_inode)->flags;
                 const auto buf = serialize_as<char>(inode);
                 ino_cursor.put(key_out, buf);
-                if (m_rewrite_inode_set) {
-                    // remove inode from deletion set since it was re-emplaced
-                    auto iter = m_rewrite_inode_set->find(old_ino);
-                    if (iter != m_rewrite_inode_set->end()) {
-                        m_rewrite_inode_set->erase(iter);
-                    }
-                }
+                put_dir_entry(parent, name, old_ino, attrs);
+                keep_rewrite_candidate(parent, old_ino);
                 return make_result(old_ino);
             }
 
             // if orphaning won't work, we can't be saved anyways
-            (void)make_orphan(old_ino);
+            if (make_orphan(old_ino)) {
+                reap_orphan_now(old_ino);
+            }
         }
     }
 
@@ -951,15 +1663,16 @@ Result<ino_t> CacheTransactionRW::emplace(ino_t parent, std::string_view name,
         rw_transaction()->put(db().inodes_db(), key, buf);
     }
 
-    std::basic_string<std::byte> direntry_buffer;
-    {
-        DirEntry *entry;
-        char *name_ptr;
-        std::tie(entry, name_ptr) = Dragonstash::emplace(direntry_buffer, name.length(), ino);
-        memcpy(name_ptr, name.data(), name.length());
-    }
-    std::string_view direntry_view(reinterpret_cast<char*>(direntry_buffer.data()),
-                                   direntry_buffer.size());
+    put_dir_entry(parent, name, ino, attrs);
+
+    return ino;
+}
+
+void CacheTransactionRW::put_dir_entry(ino_t parent, std::string_view name,
+                                       ino_t ino, const InodeAttributes &attrs)
+{
+    const auto direntry_buffer = make_dir_entry(ino, name, attrs);
+    const auto direntry_view = dir_entry_view(direntry_buffer);
 
     // write directory entry pair
     std::basic_string<std::byte> key_buf;
@@ -978,19 +1691,243 @@ Result<ino_t> CacheTransactionRW::emplace(ino_t parent, std::string_view name,
         std::string_view key(reinterpret_cast<char*>(key_buf.data()), key_buf.size());
         rw_transaction()->put(db().tree_inode_key_db(), key, direntry_view);
     }
+}
+
+Result<void> CacheTransactionRW::put_negative(ino_t parent, std::string_view name,
+                                             std::chrono::system_clock::time_point expiry)
+{
+    {
+        auto name_ok = db().check_name(name, true);
+        if (!name_ok) {
+            return make_result(FAILED, name_ok.error());
+        }
+    }
 
-    (void)clean_orphans();
+    std::string key;
+    key.resize(sizeof(ino_t) + name.length());
+    memcpy(&key[0], &parent, sizeof(ino_t));
+    memcpy(&key[sizeof(ino_t)], name.data(), name.length());
 
-    return ino;
+    const std::int64_t value = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                expiry.time_since_epoch()).count();
+    rw_transaction()->put(db().negative_db(), key, value);
+    return make_result();
+}
+
+void CacheTransactionRW::forget_negative(ino_t parent, std::string_view name)
+{
+    std::string key;
+    key.resize(sizeof(ino_t) + name.length());
+    memcpy(&key[0], &parent, sizeof(ino_t));
+    memcpy(&key[sizeof(ino_t)], name.data(), name.length());
+    (void)rw_transaction()->del(db().negative_db(), key);
+}
+
+void CacheTransactionRW::forget_negatives(ino_t dir)
+{
+    auto cursor = rw_transaction()->getRWCursor(db().negative_db());
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    while (cursor.lower_bound(dir, key_out, value_out) == 0) {
+        ino_t found_parent_ino;
+        memcpy(&found_parent_ino, key_out.d_mdbval.mv_data, sizeof(ino_t));
+        if (found_parent_ino != dir) {
+            break;
+        }
+        cursor.del();
+    }
+}
+
+std::uint64_t CacheTransactionRW::add_pin_rule(const PinRule &rule)
+{
+    return put_pin_rule(*rw_transaction(), db().meta_db(), db().pins_db(), rule);
+}
+
+Result<void> CacheTransactionRW::remove_pin_rule(std::uint64_t id)
+{
+    return retire_pin_rule(*rw_transaction(), db().meta_db(), db().pins_db(), id);
+}
+
+void CacheTransactionRW::purge_pin_rules(const std::vector<std::uint64_t> &ids)
+{
+    for (const std::uint64_t id: ids) {
+        MDBOutVal value{};
+        if (rw_transaction()->get(db().pins_db(), id, value) == MDB_NOTFOUND) {
+            continue;
+        }
+        auto rule = PinRule::parse(id, char_view(value));
+        if (rule && !rule->retired) {
+            continue;
+        }
+        (void)rw_transaction()->del(db().pins_db(), id);
+    }
+}
+
+JournalHeader CacheTransactionRW::journal_header(ino_t ino)
+{
+    MDBOutVal value_out{};
+    if (rw_transaction()->get(db().journal_db(), ino, value_out) == MDB_NOTFOUND) {
+        return JournalHeader{0, 0, 0, 0};
+    }
+    return value_out.get_struct<JournalHeader>();
+}
+
+void CacheTransactionRW::put_journal_header(ino_t ino, JournalHeader &header)
+{
+    ++header.generation;
+    rw_transaction()->put(db().journal_db(), ino, MDBInVal::fromStruct(header));
+}
+
+void CacheTransactionRW::forget_journal(ino_t ino)
+{
+    auto cursor = rw_transaction()->getRWCursor(db().journal_db());
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    while (cursor.lower_bound(ino, key_out, value_out) == 0) {
+        if (key_out.d_mdbval.mv_size < sizeof(ino_t) ||
+                memcmp(key_out.d_mdbval.mv_data, &ino, sizeof(ino_t)) != 0) {
+            break;
+        }
+        cursor.del();
+    }
+}
+
+void CacheTransactionRW::journal_write(ino_t ino, std::uint64_t offset,
+                                       std::uint64_t length, std::uint64_t size)
+{
+    JournalHeader header = journal_header(ino);
+    header.size = size;
+    put_journal_header(ino, header);
+    if (length == 0) {
+        return;
+    }
+
+    std::uint64_t start = offset;
+    std::uint64_t end = offset + length;
+    auto cursor = rw_transaction()->getRWCursor(db().journal_db());
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    JournalEntry::Extent extent{};
+
+    // the extent before the range may overlap or touch it
+    if (seek_before(cursor, journal_extent_key(ino, start), key_out, value_out) == 0 &&
+            parse_journal_extent(key_out, value_out, ino, extent) &&
+            extent.offset + extent.length >= start) {
+        start = extent.offset;
+        end = std::max(end, extent.offset + extent.length);
+        cursor.del();
+    }
+
+    // extents which start within the range are absorbed
+    while (cursor.lower_bound(journal_extent_key(ino, start), key_out, value_out) == 0 &&
+           parse_journal_extent(key_out, value_out, ino, extent) &&
+           extent.offset <= end) {
+        end = std::max(end, extent.offset + extent.length);
+        cursor.del();
+    }
+
+    rw_transaction()->put(db().journal_db(), journal_extent_key(ino, start), end);
+}
+
+void CacheTransactionRW::journal_resize(ino_t ino, std::uint64_t size)
+{
+    JournalHeader header = journal_header(ino);
+    header.size = size;
+    header.flags |= JournalHeader::FLAG_RESIZED;
+    put_journal_header(ino, header);
+
+    auto cursor = rw_transaction()->getRWCursor(db().journal_db());
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    JournalEntry::Extent extent{};
+
+    while (cursor.lower_bound(journal_extent_key(ino, size), key_out, value_out) == 0 &&
+           parse_journal_extent(key_out, value_out, ino, extent)) {
+        cursor.del();
+    }
+    if (seek_before(cursor, journal_extent_key(ino, size), key_out, value_out) == 0 &&
+            parse_journal_extent(key_out, value_out, ino, extent) &&
+            extent.offset + extent.length > size) {
+        cursor.put(key_out, size);
+    }
+}
+
+void CacheTransactionRW::journal_create(ino_t ino)
+{
+    JournalHeader header = journal_header(ino);
+    header.flags |= JournalHeader::FLAG_CREATED;
+    put_journal_header(ino, header);
+}
+
+void CacheTransactionRW::journal_backend_created(ino_t ino)
+{
+    JournalHeader header = journal_header(ino);
+    if ((header.flags & JournalHeader::FLAG_CREATED) == 0) {
+        return;
+    }
+    // the backend file may be shorter than the journaled size
+    header.flags = (header.flags & ~JournalHeader::FLAG_CREATED) |
+            JournalHeader::FLAG_RESIZED;
+    rw_transaction()->put(db().journal_db(), ino, MDBInVal::fromStruct(header));
+}
+
+bool CacheTransactionRW::complete_journal(ino_t ino, std::uint64_t generation)
+{
+    if (journal_header(ino).generation != generation) {
+        return false;
+    }
+    forget_journal(ino);
+    return true;
+}
+
+Result<void> CacheTransactionRW::setattr(ino_t ino, const CommonFileAttributes &attrs)
+{
+    auto cursor = rw_transaction()->getRWCursor(db().inodes_db());
+    const MDBInVal key_in(ino);
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+
+    if (cursor.find(key_in, key_out, value_out) != 0) {
+        return make_result(FAILED, ENOENT);
+    }
+
+    auto inode = inode_from_lmdb(value_out);
+    if (!inode) {
+        return copy_error(inode);
+    }
+    inode->attr.common = attrs;
+
+    const auto buf = serialize_as<char>(*inode);
+    cursor.put(key_out, buf);
+    return sync_dir_entry(ino, *inode);
+}
+
+Result<void> CacheTransactionRW::sync_dir_entry(ino_t ino, const Inode &inode)
+{
+    if (ino == ROOT_INO || inode.parent == INVALID_INO) {
+        return make_result();
+    }
+
+    auto name_result = name(inode.parent, ino);
+    if (!name_result) {
+        return copy_error(name_result);
+    }
+
+    put_dir_entry(inode.parent, *name_result, ino, inode.attr);
+    return make_result();
 }
 
 Result<void> CacheTransactionRW::unlink(ino_t ino)
 {
+    if (journaled(ino)) {
+        return make_result(FAILED, EBUSY);
+    }
     auto orphan_result = make_orphan(ino);
     if (!orphan_result) {
         return copy_error(orphan_result);
     }
-    return clean_orphans();
+    reap_orphan_now(ino);
+    return make_result();
 }
 
 Result<void> CacheTransactionRW::unlink(ino_t parent, ino_t child)
@@ -1014,23 +1951,149 @@ Result<void> CacheTransactionRW::unlink(ino_t parent, std::string_view name)
 
     auto parse_result = DirEntry::parse_inplace(view(value_out));
     assert(parse_result);
-    auto orphan_result = make_orphan(std::get<0>(*parse_result)->entry_ino);
+    const ino_t ino = std::get<0>(*parse_result)->entry_ino;
+    if (journaled(ino)) {
+        return make_result(FAILED, EBUSY);
+    }
+    auto orphan_result = make_orphan(ino);
     if (!orphan_result) {
         return copy_error(orphan_result);
     }
-    return clean_orphans();
+    reap_orphan_now(ino);
+    return make_result();
 }
 
-Result<void> CacheTransactionRW::clean_orphans()
+Result<bool> CacheTransactionRW::reap_orphan(ino_t ino, std::size_t &budget)
 {
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+
+    // clean up data associated with the inode:
+    // - for S_IFDIR: forget negative entries
+    // - for S_IFREG: delete cached blocks
+    // - for S_IFLNK: delete link destination entry
+    {
+        auto inode_cursor = rw_transaction()->getCursor(db().inodes_db());
+        if (inode_cursor.find(ino, key_out, value_out) == 0) {
+            auto inode_res = inode_from_lmdb_inplace(value_out);
+            if (inode_res) {
+                switch ((*inode_res)->attr.mode & S_IFMT)
+                {
+                case S_IFREG:
+                {
+                    // the inode is doomed, so nobody can have it open; if
+                    // its directory went away on the backend, changes which
+                    // have not been written back are lost with it
+                    db().content_store().remove(ino);
+                    forget_journal(ino);
+                    break;
+                }
+                case S_IFLNK:
+                {
+                    rw_transaction()->del(db().links_db(), ino);
+                    break;
+                }
+                case S_IFDIR:
+                {
+                    forget_negatives(ino);
+                    (void)rw_transaction()->del(db().dir_sync_db(), ino);
+                    break;
+                }
+                default:;
+                }
+            }
+            inode_cursor.del();
+        }
+    }
+
+    // orphan the children of a directory; the inode record may be gone
+    // already if the budget ran out on an earlier visit, so this goes by the
+    // directory entries alone.
+    auto dir_cursor = rw_transaction()->getCursor(db().tree_inode_key_db());
+    while (dir_cursor.lower_bound(ino, key_out, value_out) == 0) {
+        ino_t found_parent_ino;
+        memcpy(&found_parent_ino, key_out.d_mdbval.mv_data, sizeof(ino_t));
+        if (found_parent_ino != ino) {
+            // no more entries in this directory!
+            break;
+        }
+        if (budget == 0) {
+            return false;
+        }
+        --budget;
+
+        auto direntry_result = DirEntry::parse(view(value_out));
+        assert(direntry_result);
+        const ino_t found_child_ino = std::get<0>(*direntry_result).entry_ino;
+        (void)make_orphan(found_child_ino);
+    }
+    return true;
+}
+
+void CacheTransactionRW::reap_orphan_now(ino_t ino)
+{
+    if (!inode_in_memory_locks().doom(ino)) {
+        // locked; left for a later reaping step
+        return;
+    }
+    std::size_t budget = CACHE_ORPHAN_REAP_BUDGET;
+    auto reap_result = reap_orphan(ino, budget);
+    if (reap_result && *reap_result) {
+        rw_transaction()->del(db().orphan_db(), ino);
+    }
+}
+
+void CacheTransactionRW::reap_released(const std::vector<ino_t> &inos)
+{
+    MDBOutVal value_out{};
+    for (ino_t ino: inos) {
+        if (rw_transaction()->get(db().orphan_db(), ino, value_out) != 0) {
+            continue;
+        }
+        reap_orphan_now(ino);
+    }
+}
+
+Result<bool> CacheTransactionRW::reap_orphans(std::size_t budget)
+{
+    if (budget == 0) {
+        budget = std::numeric_limits<std::size_t>::max();
+    }
+
     auto &inode_locks = inode_in_memory_locks();
     auto cursor = rw_transaction()->getRWCursor(db().orphan_db());
     MDBOutVal key_out{};
     MDBOutVal value_out{};
-    int rc = cursor.nextprev(key_out, value_out, MDB_FIRST);
-    while (rc == 0)
-    {
+
+    const ino_t resume = db().orphan_cursor();
+    bool from_start = resume == INVALID_INO;
+    bool progress = false;
+    int rc = from_start
+            ? cursor.nextprev(key_out, value_out, MDB_FIRST)
+            : cursor.lower_bound(resume, key_out, value_out);
+    while (true) {
+        if (rc != 0) {
+            // end of the orphan list. Orphans before the point where we
+            // started, or children orphaned while we went along, are only
+            // found by another pass from the start. A pass from the start
+            // without any progress means that we are done.
+            if (from_start && !progress) {
+                db().set_orphan_cursor(INVALID_INO);
+                return false;
+            }
+            from_start = true;
+            progress = false;
+            rc = cursor.nextprev(key_out, value_out, MDB_FIRST);
+            continue;
+        }
+
         const auto ino = key_out.get<ino_t>();
+        if (budget == 0) {
+            db().set_orphan_cursor(ino);
+            return true;
+        }
+        --budget;
+
         const auto doom_result = inode_locks.doom(ino);
         if (!doom_result) {
             // cannot doom -> need to skip
@@ -1038,53 +2101,26 @@ Result<void> CacheTransactionRW::clean_orphans()
             continue;
         }
 
-
-        // TODO: clean up data associated with the inode:
-        // - DONE: for S_IFDIR: orphan child inodes recursively
-        // - for S_IFREG: delete cached blocks, release quota
-        // - DONE: for S_IFLNK: delete link destination entry
-        {
-            auto inode_cursor = rw_transaction()->getCursor(db().inodes_db());
-            MDBOutVal key_out{};
-            MDBOutVal value_out{};
-            if (inode_cursor.find(ino, key_out, value_out) == 0) {
-                auto inode_res = inode_from_lmdb_inplace(value_out);
-                if (inode_res) {
-                    switch ((*inode_res)->attr.mode & S_IFMT)
-                    {
-                    case S_IFLNK:
-                    {
-                        rw_transaction()->del(db().links_db(), ino);
-                        break;
-                    }
-                    case S_IFDIR:
-                    {
-                        // orphan all child entries of this directory
-                        auto dir_cursor = rw_transaction()->getCursor(db().tree_inode_key_db());
-                        while (dir_cursor.lower_bound(ino, key_out, value_out) == 0) {
-                            ino_t found_parent_ino;
-                            memcpy(&found_parent_ino, key_out.d_mdbval.mv_data, sizeof(ino_t));
-                            if (found_parent_ino != ino) {
-                                // no more entries in this directory!
-                                break;
-                            }
-
-                            auto direntry_result = DirEntry::parse(view(value_out));
-                            assert(direntry_result);
-                            const ino_t found_child_ino = std::get<0>(*direntry_result).entry_ino;
-                            (void)make_orphan(found_child_ino);
-                        }
-                    }
-                    default:;
-                    }
-                }
-                inode_cursor.del();
-            }
+        progress = true;
+        auto reap_result = reap_orphan(ino, budget);
+        if (!reap_result) {
+            return copy_error(reap_result);
         }
-        cursor.del();
-        // XXX: this is very inefficient, but there doesn’t seem to be a safe
-        // way to detect when the last item has been deleted...?
-        rc = cursor.nextprev(key_out, value_out, MDB_FIRST);
+        if (*reap_result) {
+            rw_transaction()->del(db().orphan_db(), ino);
+        }
+        // the writes above may have moved the cursor; seeking to the key we
+        // just handled yields the next orphan, or this one again if it is
+        // not done yet.
+        rc = cursor.lower_bound(ino, key_out, value_out);
+    }
+}
+
+Result<void> CacheTransactionRW::clean_orphans()
+{
+    auto reap_result = reap_orphans(0);
+    if (!reap_result) {
+        return copy_error(reap_result);
     }
     return make_result();
 }
@@ -1111,7 +2147,7 @@ Result<void> CacheTransactionRW::writelink(ino_t ino, std::string_view dest)
     auto buf = serialize_as<char>(*inode);
     ino_cursor.put(key_out, buf);
     rw_transaction()->put(db().links_db(), ino, dest);
-    return make_result();
+    return sync_dir_entry(ino, *inode);
 }
 
 Result<void> CacheTransactionRW::update_flags(ino_t ino, std::initializer_list<InodeFlag> to_set, std::initializer_list<InodeFlag> to_clear)
@@ -1130,12 +2166,17 @@ Result<void> CacheTransactionRW::update_flags(ino_t ino, std::initializer_list<I
         return copy_error(inode);
     }
 
+    const auto old_flags = inode->flags;
     for (InodeFlag flag: to_set) {
         inode->set_flag(flag, true);
     }
     for (InodeFlag flag: to_clear) {
         inode->set_flag(flag, false);
     }
+    if (inode->flags == old_flags) {
+        // e.g. marking an already synced directory as synced again
+        return make_result();
+    }
 
     const auto buf = serialize_as<char>(*inode);
     cursor.put(key_out, buf);
@@ -1143,12 +2184,45 @@ Result<void> CacheTransactionRW::update_flags(ino_t ino, std::initializer_list<I
     return make_result();
 }
 
+Result<void> CacheTransactionRW::set_dir_sync_stamp(ino_t ino, const std::optional<DirSyncStamp> &stamp)
+{
+    MDBOutVal value_out{};
+    if (rw_transaction()->get(db().inodes_db(), ino, value_out) == MDB_NOTFOUND) {
+        return make_result(FAILED, ENOENT);
+    }
+    if (stamp) {
+        rw_transaction()->put(db().dir_sync_db(), ino, MDBInVal::fromStruct(*stamp));
+    } else {
+        (void)rw_transaction()->del(db().dir_sync_db(), ino);
+    }
+    return make_result();
+}
+
+void CacheTransactionRW::keep_rewrite_candidate(ino_t parent, ino_t ino)
+{
+    if (parent != m_rewrite_dir) {
+        return;
+    }
+    auto iter = std::lower_bound(m_rewrite_candidates.begin(),
+                                 m_rewrite_candidates.end(),
+                                 ino);
+    if (iter != m_rewrite_candidates.end() && *iter == ino) {
+        *iter = INVALID_INO;
+    }
+}
+
 Result<void> CacheTransactionRW::start_dir_rewrite(ino_t dir)
 {
-    if (m_rewrite_inode_set) {
+    if (m_rewrite_dir != INVALID_INO) {
         return make_result(FAILED, EALREADY);
     }
 
+    // the rewrite replaces everything known about the directory
+    forget_negatives(dir);
+
+    m_rewrite_dir = dir;
+    m_rewrite_candidates.clear();
+
     auto ino_cursor = rw_transaction()->getRWCursor(db().tree_inode_key_db());
     MDBOutVal key_out{};
     MDBOutVal value_out{};
@@ -1164,31 +2238,297 @@ Result<void> CacheTransactionRW::start_dir_rewrite(ino_t dir)
         ino_t child;
     };
 
-    m_rewrite_inode_set = std::make_unique<std::set<ino_t>>();
-    std::set<ino_t> &ino_set = *m_rewrite_inode_set;
     while (key_out.get_struct<ino_pair>().parent == dir) {
-        const ino_t entry_ino = key_out.get_struct<ino_pair>().child;
-        ino_set.insert(entry_ino);
+        m_rewrite_candidates.push_back(key_out.get_struct<ino_pair>().child);
         if (ino_cursor.next(key_out, value_out) != 0) {
             break;
         }
     }
+    // the keys are in byte order, which is not the numeric order
+    std::sort(m_rewrite_candidates.begin(), m_rewrite_candidates.end());
 
     return make_result();
 }
 
 Result<void> CacheTransactionRW::finish_dir_rewrite()
 {
-    if (!m_rewrite_inode_set) {
+    if (m_rewrite_dir == INVALID_INO) {
         return make_result(FAILED, EBADFD);
     }
-    std::unique_ptr<std::set<ino_t>> set_ptr = std::move(m_rewrite_inode_set);
+    m_rewrite_dir = INVALID_INO;
+    const std::vector<ino_t> candidates = std::move(m_rewrite_candidates);
+    m_rewrite_candidates.clear();
 
-    for (ino_t ino: *set_ptr) {
+    for (ino_t ino: candidates) {
+        // files which are newer in the cache may not exist on the backend
+        // yet
+        if (ino == INVALID_INO || journaled(ino)) {
+            continue;
+        }
         (void)make_orphan(ino);
     }
 
     return make_result();
 }
 
+Result<DirRewriteStats> CacheTransactionRW::rewrite_dir(
+        ino_t dir, std::vector<DirRewriteEntry> &entries,
+        const DirRewriteObserver &observer)
+{
+    if (m_rewrite_dir != INVALID_INO) {
+        return make_result(FAILED, EALREADY);
+    }
+
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const DirRewriteEntry &a, const DirRewriteEntry &b) {
+        return a.name < b.name;
+    });
+    // of duplicates, keep the last one like repeated emplace() calls would
+    {
+        auto out = entries.begin();
+        for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
+            auto next = std::next(iter);
+            if (next != entries.end() && next->name == iter->name) {
+                continue;
+            }
+            if (out != iter) {
+                *out = std::move(*iter);
+            }
+            ++out;
+        }
+        entries.erase(out, entries.end());
+    }
+
+    struct Diff {
+        DirRewriteChange change;
+        std::size_t index;
+        ino_t ino;
+        /**
+         * @brief Name of removed entries, which are not in the listing.
+         */
+        std::string name;
+    };
+
+    // the differences are collected first, so that the writes do not
+    // disturb the cursor
+    std::vector<Diff> diffs;
+    {
+        auto cursor = rw_transaction()->getRWCursor(db().tree_name_key_db());
+        MDBOutVal key_out{};
+        MDBOutVal value_out{};
+        std::size_t next = 0;
+        for (int rc = cursor.lower_bound(dir, key_out, value_out);
+             rc == 0;
+             rc = cursor.next(key_out, value_out))
+        {
+            const std::string_view key(static_cast<const char*>(key_out.d_mdbval.mv_data),
+                                       key_out.d_mdbval.mv_size);
+            if (key.size() < sizeof(ino_t) || memcmp(key.data(), &dir, sizeof(ino_t)) != 0) {
+                break;
+            }
+            const std::string_view name = key.substr(sizeof(ino_t));
+
+            auto parse_result = DirEntry::parse_inplace(view(value_out));
+            if (!parse_result) {
+                return make_result(FAILED, EIO);
+            }
+            const auto &cached = std::get<0>(*parse_result);
+            const ino_t ino = cached->entry_ino;
+
+            while (next < entries.size() && std::string_view(entries[next].name) < name) {
+                diffs.push_back(Diff{DirRewriteChange::ADDED, next++, INVALID_INO, {}});
+            }
+
+            if (next < entries.size() && entries[next].name == name) {
+                const std::size_t index = next++;
+                if (journaled(ino)) {
+                    continue;
+                }
+                std::optional<InodeAttributes> old_attr;
+                if (cached->has_attributes()) {
+                    old_attr = cached->attr;
+                } else if (auto stat_result = getattr(ino)) {
+                    old_attr = stat_result->attr;
+                }
+                const InodeAttributes &new_attr = entries[index].attr;
+                if (!old_attr || (old_attr->mode & S_IFMT) != (new_attr.mode & S_IFMT)) {
+                    diffs.push_back(Diff{DirRewriteChange::REPLACED, index, ino, {}});
+                } else if (*old_attr != new_attr) {
+                    diffs.push_back(Diff{DirRewriteChange::CHANGED, index, ino, {}});
+                }
+                continue;
+            }
+
+            // files which are newer in the cache may not exist on the
+            // backend yet
+            if (!journaled(ino)) {
+                diffs.push_back(Diff{DirRewriteChange::REMOVED, 0, ino, std::string(name)});
+            }
+        }
+        while (next < entries.size()) {
+            diffs.push_back(Diff{DirRewriteChange::ADDED, next++, INVALID_INO, {}});
+        }
+    }
+
+    DirRewriteStats stats{};
+    for (const Diff &diff: diffs) {
+        if (diff.change == DirRewriteChange::REMOVED) {
+            if (observer) {
+                observer(diff.change, diff.name, diff.ino, nullptr);
+            }
+            if (make_orphan(diff.ino)) {
+                ++stats.removed;
+            }
+            continue;
+        }
+
+        const DirRewriteEntry &entry = entries[diff.index];
+        if (observer) {
+            observer(diff.change, entry.name, diff.ino, &entry.attr);
+        }
+        if (!emplace(dir, entry.name, entry.attr)) {
+            continue;
+        }
+        switch (diff.change) {
+        case DirRewriteChange::ADDED:
+            ++stats.added;
+            break;
+        case DirRewriteChange::CHANGED:
+            ++stats.changed;
+            break;
+        case DirRewriteChange::REPLACED:
+            ++stats.replaced;
+            break;
+        case DirRewriteChange::REMOVED:
+            break;
+        }
+    }
+
+    // the rewrite replaces everything known about the directory
+    forget_negatives(dir);
+
+    return stats;
+}
+
+/* Dragonstash::CachedDir */
+
+CachedDir::CachedDir(Cache &cache, ino_t dir, ino_t parent):
+    m_cache(cache),
+    m_dir(dir),
+    m_parent(parent),
+    m_cursor_ino(INVALID_INO),
+    m_cursor_prev(INVALID_INO)
+{
+
+}
+
+CacheTransactionRO &CachedDir::transaction()
+{
+    if (!m_txn) {
+        m_txn.emplace(m_cache.begin_ro());
+    }
+    return *m_txn;
+}
+
+void CachedDir::release()
+{
+    // the next batch has to seek from where this one stopped
+    m_cursor_ino = INVALID_INO;
+    m_cursor.reset();
+    m_txn.reset();
+}
+
+Result<DirectoryEntry> CachedDir::readdir(ino_t prev_end)
+{
+    if (prev_end == INVALID_INO) {
+        // return dot
+        return make_result(DirectoryEntry{
+                               Stat{
+                                   .ino = m_dir,
+                                   .blksize = m_cache.block_size(),
+                               },
+                               std::string_view("."),
+                               false,
+                           });
+    }
+    if (prev_end != m_parent && prev_end == m_dir) {
+        // dot dot
+        return make_result(DirectoryEntry{
+                               Stat{
+                                   .ino = m_parent,
+                                   .blksize = m_cache.block_size(),
+                               },
+                               std::string_view(".."),
+                               false,
+                           });
+    }
+
+    CacheTransactionRO &txn = transaction();
+    if (!m_cursor) {
+        m_cursor.emplace(txn.ro_transaction()->getCursor(txn.db().tree_inode_key_db()));
+    }
+    MDBROCursor &cursor = *m_cursor;
+
+    std::array<ino_t, 2> key{{m_dir, prev_end}};
+    const std::size_t key_bytes = key.size() * sizeof(decltype(key)::value_type);
+    MDBOutVal key_out{};
+    MDBOutVal value_out{};
+    int rc;
+    if (m_cursor_ino != INVALID_INO && m_cursor_prev == prev_end) {
+        // re-read: the caller could not use the entry we returned last (for
+        // example because it did not fit into the reply buffer anymore)
+        rc = cursor.get(key_out, value_out, MDB_GET_CURRENT);
+    } else if (m_cursor_ino != INVALID_INO && m_cursor_ino == prev_end) {
+        // sequential read: the cursor is still at the previous entry
+        rc = cursor.next(key_out, value_out);
+    } else {
+        if (prev_end == m_parent) {
+            // start iteration from zero
+            key[1] = 0;
+        }
+        MDBInVal key_in(std::string_view(reinterpret_cast<char*>(key.data()),
+                                         key_bytes));
+        rc = cursor.lower_bound(key_in, key_out, value_out);
+        if (rc == 0 && prev_end != m_parent) {
+            assert(key_out.d_mdbval.mv_size == key_bytes);
+            std::array<ino_t, 2> found_key;
+            memcpy(found_key.data(), key_out.d_mdbval.mv_data, key_bytes);
+            if (found_key == key) {
+                // advance by one for the next read
+                rc = cursor.next(key_out, value_out);
+            }
+        }
+    }
+    m_cursor_ino = INVALID_INO;
+
+    if (rc == MDB_NOTFOUND) {
+        // EOF!
+        return make_result(FAILED, 0);
+    }
+    assert(key_out.d_mdbval.mv_size == key_bytes);
+    memcpy(key.data(), key_out.d_mdbval.mv_data, key_bytes);
+
+    if (key[0] != m_dir) {
+        // EOF!
+        return make_result(FAILED, 0);
+    }
+
+    auto parse_result = DirEntry::parse_inplace(view(value_out));
+    if (!parse_result) {
+        return make_result(FAILED, EIO);
+    }
+    m_cursor_ino = key[1];
+    m_cursor_prev = prev_end;
+    const auto &entry = *std::get<0>(*parse_result);
+    return make_result(DirectoryEntry{
+                           Stat{
+                               .attr = entry.attr,
+                               .ino = key[1],
+                               .blksize = m_cache.block_size(),
+                           },
+                           std::get<1>(*parse_result),
+                           entry.has_attributes(),
+                       });
+}
+
 }
@@ -35,7 +35,32 @@ Result<std::tuple<copyfree_wrap<DirEntry>, std::string_view> > DirEntry::parse_i
     }
 
     const auto version = static_cast<std::uint8_t>(buf[0]);
-    if (version != 1) {
+    if (version == 1) {
+        // legacy entry without attributes, upgrade by copying
+        if (buf.size() < DIR_ENTRY_V1_SIZE) {
+            return make_result(FAILED, EINVAL);
+        }
+
+        DirEntryV1 legacy;
+        memcpy(&legacy, buf.data(), DIR_ENTRY_V1_SIZE);
+
+        std::string_view name_view(reinterpret_cast<const char*>(buf.data()), buf.size());
+        name_view.remove_prefix(DIR_ENTRY_V1_SIZE);
+
+        DirEntry entry{
+            .version = legacy.version,
+            .flags = legacy.flags,
+            .entry_ino = legacy.entry_ino,
+            .attr = InodeAttributes{
+                .mode = legacy.mode,
+            },
+        };
+        return std::make_tuple(
+                    copyfree_wrap<DirEntry>(std::move(entry)),
+                    name_view);
+    }
+
+    if (version != DIR_ENTRY_VERSION) {
         return make_result(FAILED, EINVAL);
     }
 
@@ -47,7 +72,7 @@ Result<std::tuple<copyfree_wrap<DirEntry>, std::string_view> > DirEntry::parse_i
     name_view.remove_prefix(DIR_ENTRY_SIZE);
 
     // alignment isn’t fulfilled, we have to use copy
-    if (reinterpret_cast<std::size_t>(buf.data()) % alignof(DirEntryV1) != 0) {
+    if (reinterpret_cast<std::size_t>(buf.data()) % alignof(DirEntry) != 0) {
         DirEntry entry;
         memcpy(&entry, buf.data(), DIR_ENTRY_SIZE);
         return std::make_tuple(
@@ -0,0 +1,141 @@
+/**********************************************************************
+File name: fetch_table.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/cache/fetch_table.hpp"
+
+#include <algorithm>
+
+namespace Dragonstash {
+
+FetchTable::FetchTable(std::size_t max_running, std::size_t max_merged_size):
+    m_max_running(std::max<std::size_t>(max_running, 1)),
+    m_max_merged_size(max_merged_size),
+    m_running(0),
+    m_issued(0),
+    m_joined(0)
+{
+
+}
+
+Result<std::shared_ptr<const FetchTable::Fetch>> FetchTable::wait(
+        std::unique_lock<std::mutex> &lock,
+        std::shared_ptr<Entry> entry)
+{
+    m_joined.fetch_add(1, std::memory_order_relaxed);
+    m_cv.wait(lock, [&entry]() { return entry->done; });
+    if (entry->error != 0) {
+        return make_result(FAILED, entry->error);
+    }
+    return std::shared_ptr<const Fetch>(entry->result);
+}
+
+Result<std::shared_ptr<const FetchTable::Fetch>> FetchTable::run(
+        std::unique_lock<std::mutex> &lock,
+        std::shared_ptr<Entry> entry,
+        const Fetcher &fetcher)
+{
+    // queued fetches stay open for merging until a slot is free
+    m_cv.wait(lock, [this]() { return m_running < m_max_running; });
+    entry->running = true;
+    ++m_running;
+    const std::uint64_t start = entry->start;
+    const std::uint64_t end = entry->end;
+    lock.unlock();
+
+    m_issued.fetch_add(1, std::memory_order_relaxed);
+    auto result = std::make_shared<Fetch>(Fetch{start, std::vector<char>(end - start)});
+    auto fetch_result = fetcher(start, result->data.data(), result->data.size());
+    if (fetch_result) {
+        result->data.resize(std::min<std::size_t>(*fetch_result, result->data.size()));
+    }
+
+    lock.lock();
+    --m_running;
+    entry->done = true;
+    entry->error = fetch_result ? 0 : fetch_result.error();
+    entry->result = result;
+    m_entries.erase(std::find(m_entries.begin(), m_entries.end(), entry));
+    m_cv.notify_all();
+
+    if (!fetch_result) {
+        return copy_error(fetch_result);
+    }
+    return std::shared_ptr<const Fetch>(std::move(result));
+}
+
+Result<std::shared_ptr<const FetchTable::Fetch>> FetchTable::fetch(
+        std::uint64_t start, std::uint64_t end,
+        const Fetcher &fetcher)
+{
+    if (end <= start) {
+        return std::make_shared<const Fetch>(Fetch{start, {}});
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::shared_ptr<Entry> container;
+    for (const auto &entry: m_entries) {
+        if (entry->start <= start && start < entry->end) {
+            container = entry;
+        } else if (start < entry->start && entry->start < end) {
+            // do not fetch anything twice
+            end = entry->start;
+        }
+    }
+
+    // [start, end) does not overlap with any fetch now, except for the
+    // container; queued fetches can thus be extended into it.
+    if (container) {
+        if (!container->running && container->end < end &&
+                end - container->start <= m_max_merged_size) {
+            container->end = end;
+        }
+        return wait(lock, container);
+    }
+
+    for (const auto &entry: m_entries) {
+        if (entry->running) {
+            continue;
+        }
+        if (entry->end == start && end - entry->start <= m_max_merged_size) {
+            entry->end = end;
+            return wait(lock, entry);
+        }
+        if (entry->start == end && entry->end - start <= m_max_merged_size) {
+            entry->start = start;
+            return wait(lock, entry);
+        }
+    }
+
+    auto entry = std::make_shared<Entry>(Entry{start, end, false, false, 0, nullptr});
+    m_entries.emplace_back(entry);
+    return run(lock, entry, fetcher);
+}
+
+std::size_t FetchTable::in_flight()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_entries.size();
+}
+
+}
@@ -49,12 +49,137 @@ void put(std::uint8_t *&buf, T in)
     buf += sizeof(T);
 }
 
+/*
+ * The varint helpers take and return the cursor by value: byte stores may
+ * alias anything, including a cursor passed by reference, which would
+ * then have to be reloaded after every byte.
+ */
+
+static inline std::uint8_t *put_varint(std::uint8_t *buf, std::uint64_t in)
+{
+    while (in >= 0x80) {
+        *buf++ = std::uint8_t(in | 0x80);
+        in >>= 7;
+    }
+    *buf++ = std::uint8_t(in);
+    return buf;
+}
+
+/**
+ * @brief Decode a varint from [@a buf, @a end).
+ *
+ * @return The position after the varint, or nullptr if it is truncated or
+ * longer than ten bytes.
+ */
+static inline const std::uint8_t *scan_varint(const std::uint8_t *buf,
+                                              const std::uint8_t *end,
+                                              std::uint64_t &out)
+{
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64 && buf != end; shift += 7) {
+        const std::uint8_t byte = *buf++;
+        value |= std::uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            out = value;
+            return buf;
+        }
+    }
+    return nullptr;
+}
+
+static inline std::uint64_t zigzag(std::int64_t value)
+{
+    return (std::uint64_t(value) << 1) ^ std::uint64_t(value >> 63);
+}
+
+static inline std::int64_t unzigzag(std::uint64_t value)
+{
+    return std::int64_t((value >> 1) ^ (~(value & 1) + 1));
+}
+
+/**
+ * @brief Difference of two seconds values, wrapping instead of overflowing.
+ */
+static inline std::int64_t delta(time_t value, time_t base)
+{
+    return std::int64_t(std::uint64_t(value) - std::uint64_t(base));
+}
+
+static inline time_t apply_delta(time_t base, std::int64_t delta)
+{
+    return time_t(std::uint64_t(base) + std::uint64_t(delta));
+}
+
+std::size_t serialize(const Inode &inode, std::byte *buf)
+{
+    const CommonFileAttributes &common = inode.attr.common;
+    std::uint8_t *const start = reinterpret_cast<std::uint8_t*>(buf);
+    std::uint8_t *out = start;
+    *out++ = std::uint8_t(INODE_CURRENT_VERSION);
+    out = put_varint(out, inode.flags);
+    out = put_varint(out, inode.parent);
+    out = put_varint(out, inode.attr.mode);
+    out = put_varint(out, common.uid);
+    out = put_varint(out, common.gid);
+    out = put_varint(out, common.size);
+    out = put_varint(out, common.nblocks);
+    out = put_varint(out, zigzag(common.mtime.tv_sec));
+    out = put_varint(out, std::uint64_t(common.mtime.tv_nsec));
+    out = put_varint(out, zigzag(delta(common.atime.tv_sec, common.mtime.tv_sec)));
+    out = put_varint(out, std::uint64_t(common.atime.tv_nsec));
+    out = put_varint(out, zigzag(delta(common.ctime.tv_sec, common.mtime.tv_sec)));
+    out = put_varint(out, std::uint64_t(common.ctime.tv_nsec));
+    const std::size_t size = std::size_t(out - start);
+    assert(size <= INODE_MAX_ENCODED_SIZE);
+    return size;
+}
+
+static bool parse_v2(std::basic_string_view<std::byte> buf, Inode &inode)
+{
+    static constexpr std::size_t NFIELDS = 13;
+    std::uint64_t fields[NFIELDS];
+    const auto *in = reinterpret_cast<const std::uint8_t*>(buf.data()) + 1;
+    const auto *const end = reinterpret_cast<const std::uint8_t*>(buf.data()) + buf.size();
+    for (std::uint64_t &field: fields) {
+        in = scan_varint(in, end, field);
+        if (!in) {
+            return false;
+        }
+    }
+
+    CommonFileAttributes &common = inode.attr.common;
+    inode.flags = std::uint16_t(fields[0]);
+    inode.parent = fields[1];
+    inode.attr.mode = std::uint32_t(fields[2]);
+    common.uid = std::uint32_t(fields[3]);
+    common.gid = std::uint32_t(fields[4]);
+    common.size = fields[5];
+    common.nblocks = fields[6];
+    common.mtime.tv_sec = time_t(unzigzag(fields[7]));
+    common.mtime.tv_nsec = long(fields[8]);
+    common.atime.tv_sec = apply_delta(common.mtime.tv_sec, unzigzag(fields[9]));
+    common.atime.tv_nsec = long(fields[10]);
+    common.ctime.tv_sec = apply_delta(common.mtime.tv_sec, unzigzag(fields[11]));
+    common.ctime.tv_nsec = long(fields[12]);
+    return true;
+}
+
 Result<copyfree_wrap<Inode> > Inode::parse_inplace(std::basic_string_view<std::byte> buf)
 {
     if (buf.empty()) {
         return make_result(FAILED, EINVAL);
     }
     const auto version = static_cast<std::uint8_t>(buf[0]);
+    if (version == 2) {
+        // compact records cannot be used in place; decoding them is still
+        // cheaper than the page faults the larger version 1 records cause
+        Inode inode{};
+        inode.version = version;
+        if (!parse_v2(buf, inode)) {
+            return make_result(FAILED, EINVAL);
+        }
+        return copyfree_wrap<Inode>(std::move(inode));
+    }
     if (version != 1) {
         return make_result(FAILED, EINVAL);
     }
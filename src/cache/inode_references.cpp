@@ -0,0 +1,197 @@
+/**********************************************************************
+File name: inode_references.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/cache/inode_references.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+#include "dragonstash/trace.hpp"
+
+namespace Dragonstash {
+
+InodeReferences::InodeReferences(std::size_t nshards):
+    m_shards(std::max<std::size_t>(nshards, 1))
+{
+
+}
+
+std::shared_lock<std::shared_mutex> InodeReferences::lock_shared(const Shard &shard) const
+{
+    m_lock_acquisitions.add();
+    std::shared_lock<std::shared_mutex> guard(shard.mutex, std::try_to_lock);
+    if (!guard.owns_lock()) {
+        Trace::Span span(Trace::Phase::LOCK_WAIT);
+        const auto started = Metrics::Clock::now();
+        guard.lock();
+        m_lock_wait.record_since(started);
+    }
+    return guard;
+}
+
+std::unique_lock<std::shared_mutex> InodeReferences::lock_exclusive(Shard &shard)
+{
+    m_lock_acquisitions.add();
+    std::unique_lock<std::shared_mutex> guard(shard.mutex, std::try_to_lock);
+    if (!guard.owns_lock()) {
+        Trace::Span span(Trace::Phase::LOCK_WAIT);
+        const auto started = Metrics::Clock::now();
+        guard.lock();
+        m_lock_wait.record_since(started);
+    }
+    return guard;
+}
+
+const InodeReferences::Counter *InodeReferences::find(ino_t ino) const
+{
+    const Shard &shard = shard_for(ino);
+    auto guard = lock_shared(shard);
+    auto iter = shard.counters.find(ino);
+    if (iter == shard.counters.end()) {
+        return nullptr;
+    }
+    return &iter->second;
+}
+
+InodeReferences::Counter &InodeReferences::get(ino_t ino)
+{
+    Counter *counter = find(ino);
+    if (counter) {
+        return *counter;
+    }
+    Shard &shard = shard_for(ino);
+    auto guard = lock_exclusive(shard);
+    return shard.counters.try_emplace(ino, 0).first->second;
+}
+
+Result<std::uint64_t> InodeReferences::incref(ino_t ino, std::uint64_t by)
+{
+    Counter &counter = get(ino);
+    std::uint64_t state = counter.load(std::memory_order_relaxed);
+    do {
+        if (state & DOOMED) {
+            return make_result(FAILED, ESTALE);
+        }
+    } while (!counter.compare_exchange_weak(state, state + by,
+                                            std::memory_order_acq_rel,
+                                            std::memory_order_relaxed));
+    return make_result((state + by) & COUNT);
+}
+
+Result<std::uint64_t> InodeReferences::decref(ino_t ino, std::uint64_t by)
+{
+    if (by == 0) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    Counter *counter = find(ino);
+    if (!counter) {
+        throw std::runtime_error("attempt to decrease counter below zero");
+    }
+    std::uint64_t state = counter->load(std::memory_order_relaxed);
+    do {
+        if ((state & COUNT) < by) {
+            throw std::runtime_error("attempt to decrease counter below zero");
+        }
+    } while (!counter->compare_exchange_weak(state, state - by,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_relaxed));
+    return make_result((state - by) & COUNT);
+}
+
+void InodeReferences::decref_many(std::vector<Release> &releases,
+                                  std::vector<ino_t> *reapable)
+{
+    const std::size_t nshards = m_shards.size();
+    std::sort(releases.begin(), releases.end(),
+              [nshards](const Release &a, const Release &b) {
+        return std::make_pair(a.ino % nshards, a.ino) < std::make_pair(b.ino % nshards, b.ino);
+    });
+
+    auto iter = releases.begin();
+    while (iter != releases.end()) {
+        Shard &shard = shard_for(iter->ino);
+        auto guard = lock_shared(shard);
+        for (; iter != releases.end() && &shard_for(iter->ino) == &shard; ++iter) {
+            if (iter->by == 0) {
+                continue;
+            }
+            auto counter_iter = shard.counters.find(iter->ino);
+            if (counter_iter == shard.counters.end()) {
+                throw std::runtime_error("attempt to decrease counter below zero");
+            }
+            Counter &counter = counter_iter->second;
+            std::uint64_t state = counter.load(std::memory_order_relaxed);
+            do {
+                if ((state & COUNT) < iter->by) {
+                    throw std::runtime_error("attempt to decrease counter below zero");
+                }
+            } while (!counter.compare_exchange_weak(state, state - iter->by,
+                                                    std::memory_order_acq_rel,
+                                                    std::memory_order_relaxed));
+            const std::uint64_t new_state = state - iter->by;
+            if (reapable && (new_state & COUNT) == 0 && (new_state & DOOM_PENDING)) {
+                reapable->push_back(iter->ino);
+            }
+        }
+    }
+}
+
+Result<void> InodeReferences::doom(ino_t ino)
+{
+    Counter &counter = get(ino);
+    std::uint64_t state = counter.load(std::memory_order_relaxed);
+    do {
+        if ((state & COUNT) > 0) {
+            // if the last reference is dropped before this lands, the orphan
+            // is not reported and waits for the next reaping pass instead
+            counter.fetch_or(DOOM_PENDING, std::memory_order_acq_rel);
+            return make_result(FAILED, EBUSY);
+        }
+    } while (!counter.compare_exchange_weak(state, (state | DOOMED) & ~DOOM_PENDING,
+                                            std::memory_order_acq_rel,
+                                            std::memory_order_relaxed));
+    return make_result();
+}
+
+bool InodeReferences::doomed(ino_t ino) const
+{
+    const Counter *counter = find(ino);
+    if (!counter) {
+        return false;
+    }
+    return counter->load(std::memory_order_acquire) & DOOMED;
+}
+
+std::uint64_t InodeReferences::refcount(ino_t ino) const
+{
+    const Counter *counter = find(ino);
+    if (!counter) {
+        return 0;
+    }
+    return counter->load(std::memory_order_acquire) & COUNT;
+}
+
+}
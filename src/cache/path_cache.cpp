@@ -0,0 +1,115 @@
+/**********************************************************************
+File name: path_cache.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/cache/path_cache.hpp"
+
+#include <algorithm>
+
+namespace Dragonstash {
+
+PathCache::PathCache(std::size_t capacity, std::size_t nshards):
+    m_shard_capacity(std::max<std::size_t>(capacity / std::max<std::size_t>(nshards, 1), 1)),
+    m_shards(std::max<std::size_t>(nshards, 1)),
+    m_epoch(0),
+    m_hits(0),
+    m_misses(0)
+{
+
+}
+
+std::optional<PathCache::Entry> PathCache::lookup(ino_t ino)
+{
+    Shard &shard = shard_for(ino);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto iter = shard.index.find(ino);
+    if (iter == shard.index.end()) {
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    // move to the front of the LRU list
+    shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+    return iter->second->entry;
+}
+
+void PathCache::insert(ino_t ino, ino_t parent, std::string_view name,
+                       std::uint64_t epoch)
+{
+    Shard &shard = shard_for(ino);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    // checked under the shard lock: invalidate() bumps the epoch before it
+    // takes the lock, so either we see the new epoch or it sees our record.
+    if (m_epoch.load(std::memory_order_acquire) != epoch) {
+        return;
+    }
+
+    auto iter = shard.index.find(ino);
+    if (iter != shard.index.end()) {
+        iter->second->entry = Entry{parent, std::string(name)};
+        shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+        return;
+    }
+
+    if (shard.index.size() >= m_shard_capacity) {
+        shard.index.erase(shard.lru.back().ino);
+        shard.lru.pop_back();
+    }
+    shard.lru.emplace_front(Record{ino, Entry{parent, std::string(name)}});
+    shard.index.emplace(ino, shard.lru.begin());
+}
+
+void PathCache::invalidate(ino_t ino)
+{
+    m_epoch.fetch_add(1, std::memory_order_acq_rel);
+    Shard &shard = shard_for(ino);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto iter = shard.index.find(ino);
+    if (iter == shard.index.end()) {
+        return;
+    }
+    shard.lru.erase(iter->second);
+    shard.index.erase(iter);
+}
+
+void PathCache::clear()
+{
+    m_epoch.fetch_add(1, std::memory_order_acq_rel);
+    for (Shard &shard: m_shards) {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        shard.index.clear();
+        shard.lru.clear();
+    }
+}
+
+std::size_t PathCache::size()
+{
+    std::size_t result = 0;
+    for (Shard &shard: m_shards) {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        result += shard.index.size();
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,731 @@
+/**********************************************************************
+File name: regular_file.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/cache/regular_file.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dragonstash/cache/common.hpp"
+
+namespace Dragonstash {
+
+static constexpr std::uint8_t CONTENT_TAG_VERSION = 1;
+
+/**
+ * @brief Encode the version of a file for the blocklist tag.
+ *
+ * A zero tag (as found in new blocklists) never matches, so that fresh
+ * content files are always bound to a version before use.
+ */
+static Blocklist::Tag make_content_tag(const CommonFileAttributes &attr)
+{
+    Blocklist::Tag tag{};
+    tag[0] = CONTENT_TAG_VERSION;
+    const std::uint64_t fields[3] = {
+        attr.size,
+        static_cast<std::uint64_t>(attr.mtime.tv_sec),
+        static_cast<std::uint64_t>(attr.mtime.tv_nsec),
+    };
+    static_assert(sizeof(fields) + 8 <= std::tuple_size_v<Blocklist::Tag>);
+    memcpy(&tag[8], fields, sizeof(fields));
+    return tag;
+}
+
+/**
+ * @brief Call @a f with the chunk number and block count of each chunk
+ * (of @a chunk_blocks blocks) overlapping @a range.
+ */
+template <typename F>
+static void split_chunks(Blocklist::Range range, std::uint64_t chunk_blocks, F &&f)
+{
+    while (range.count > 0) {
+        const std::uint64_t chunk = range.start / chunk_blocks;
+        const std::uint64_t n = std::min<std::uint64_t>(
+                    range.count,
+                    (chunk + 1) * chunk_blocks - range.start);
+        f(chunk, n);
+        range.start += n;
+        range.count -= n;
+    }
+}
+
+/* Dragonstash::RegularFileHandle */
+
+RegularFileHandle::RegularFileHandle(ino_t ino,
+                                     const std::filesystem::path &blocklist_path,
+                                     FileHandle data_fd,
+                                     ContentStore *store):
+    m_ino(ino),
+    m_blocks(blocklist_path, store ? store->block_size() : CACHE_PAGE_SIZE),
+    m_data(std::move(data_fd)),
+    m_generation(0),
+    m_store(store),
+    m_chunk_blocks(store ? store->chunk_blocks() : CACHE_CHUNK_BLOCKS)
+{
+
+}
+
+std::vector<std::uint64_t> RegularFileHandle::evictable_blocks(
+        std::uint64_t first_chunk,
+        std::uint64_t end_chunk) const
+{
+    std::vector<std::uint64_t> result(end_chunk - first_chunk, 0);
+    const std::uint64_t start = first_chunk * m_chunk_blocks;
+    const std::uint64_t count = (end_chunk - first_chunk) * m_chunk_blocks;
+    for (const Blocklist::State state: {Blocklist::READ, Blocklist::READAHEAD}) {
+        for (const Blocklist::Range &range: m_blocks.ranges(start, count, state)) {
+            split_chunks(range, m_chunk_blocks, [&](std::uint64_t chunk, std::uint64_t n) {
+                result[chunk - first_chunk] += n;
+            });
+        }
+    }
+    return result;
+}
+
+void RegularFileHandle::touch(off_t off, std::size_t n)
+{
+    if (!m_store || n == 0) {
+        return;
+    }
+    const std::uint64_t block_size = m_blocks.block_size();
+    const std::uint64_t first_chunk = std::uint64_t(off) / block_size / m_chunk_blocks;
+    const std::uint64_t last_chunk = (std::uint64_t(off) + n - 1) / block_size / m_chunk_blocks;
+    for (std::uint64_t chunk = first_chunk; chunk <= last_chunk; ++chunk) {
+        m_store->space().touch(SpaceManager::ChunkKey{m_ino, chunk});
+    }
+}
+
+void RegularFileHandle::account(std::uint64_t first_chunk,
+                                const std::vector<std::uint64_t> &evictable_before,
+                                const std::vector<std::uint64_t> &evictable_after)
+{
+    SpaceManager &space = m_store->space();
+    for (std::uint64_t i = 0; i < evictable_after.size(); ++i) {
+        const SpaceManager::ChunkKey key{m_ino, first_chunk + i};
+        if (evictable_after[i] > evictable_before[i]) {
+            space.charge(key, evictable_after[i] - evictable_before[i]);
+        } else if (evictable_after[i] < evictable_before[i]) {
+            space.discharge(key, evictable_before[i] - evictable_after[i]);
+        }
+    }
+    m_store->reclaim();
+}
+
+ino_t RegularFileHandle::inode() const
+{
+    return m_ino;
+}
+
+Result<std::size_t> RegularFileHandle::pread(off_t off, void *buf, std::size_t n)
+{
+    std::shared_lock<std::shared_mutex> guard(m_blocks_mutex);
+    const std::size_t available = m_blocks.truncate_access(off, n);
+    std::size_t done = 0;
+    while (done < available) {
+        ssize_t read = ::pread(int(m_data),
+                               static_cast<char*>(buf) + done,
+                               available - done,
+                               off + done);
+        if (read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return make_result(FAILED, errno);
+        }
+        if (read == 0) {
+            // the blocklist claims more than the data file has; this can
+            // only be the result of a crash.
+            return make_result(FAILED, EIO);
+        }
+        done += read;
+    }
+    touch(off, done);
+    return make_result(done);
+}
+
+Result<std::size_t> RegularFileHandle::store(std::uint64_t generation,
+                                             off_t off, const void *buf, std::size_t n,
+                                             bool eof,
+                                             Blocklist::State state)
+{
+    if (off < 0) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    if (generation != m_generation) {
+        return make_result(std::size_t(0));
+    }
+    if (n == 0) {
+        return make_result(std::size_t(0));
+    }
+
+    const std::uint64_t end = std::uint64_t(off) + n;
+    const std::uint64_t block_size = m_blocks.block_size();
+
+    // WRITTEN blocks are newer than anything the backend can return
+    std::vector<Blocklist::Range> written;
+    if (m_blocks.blocks(Blocklist::WRITTEN) > 0) {
+        const std::uint64_t first = std::uint64_t(off) / block_size;
+        written = m_blocks.ranges(first,
+                                  (end + block_size - 1) / block_size - first,
+                                  Blocklist::WRITTEN);
+    }
+
+    std::uint64_t pos = std::uint64_t(off);
+    auto write_until = [&](std::uint64_t until) -> Result<void> {
+        while (pos < until) {
+            ssize_t written = ::pwrite(int(m_data),
+                                       static_cast<const char*>(buf) + (pos - off),
+                                       until - pos,
+                                       off_t(pos));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return make_result(FAILED, errno);
+            }
+            pos += written;
+        }
+        return make_result();
+    };
+    for (const Blocklist::Range &range: written) {
+        auto result = write_until(std::min(range.start * block_size, end));
+        if (!result) {
+            return copy_error(result);
+        }
+        pos = std::max(pos, std::min((range.start + range.count) * block_size, end));
+    }
+    {
+        auto result = write_until(end);
+        if (!result) {
+            return copy_error(result);
+        }
+    }
+    const std::size_t done = n;
+
+    const std::uint64_t first_block = (std::uint64_t(off) + block_size - 1) / block_size;
+    const std::uint64_t end_block = eof
+            ? (end + block_size - 1) / block_size
+            : end / block_size;
+    if (end_block <= first_block) {
+        return make_result(done);
+    }
+
+    const std::uint64_t first_chunk = first_block / m_chunk_blocks;
+    const std::uint64_t end_chunk = (end_block + m_chunk_blocks - 1) / m_chunk_blocks;
+    std::vector<std::uint64_t> evictable_before;
+    if (m_store) {
+        evictable_before = evictable_blocks(first_chunk, end_chunk);
+    }
+
+    if (state == Blocklist::READAHEAD) {
+        m_blocks.transition(first_block, end_block - first_block,
+                            Blocklist::ABSENT, state);
+    } else {
+        m_blocks.mark(first_block, end_block - first_block, state);
+        for (const Blocklist::Range &range: written) {
+            m_blocks.mark(range.start, range.count, Blocklist::WRITTEN);
+        }
+    }
+
+    if (!m_store) {
+        return make_result(done);
+    }
+    if (state == Blocklist::PINNED) {
+        m_store->add_pinned(m_ino);
+    }
+
+    const std::vector<std::uint64_t> evictable_after = evictable_blocks(first_chunk, end_chunk);
+    guard.unlock();
+
+    account(first_chunk, evictable_before, evictable_after);
+    return make_result(done);
+}
+
+Result<void> RegularFileHandle::write(off_t off, const void *buf, std::size_t n,
+                                      const CommonFileAttributes &attr)
+{
+    if (off < 0 || std::uint64_t(off) + n > attr.size) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    const std::uint64_t end = std::uint64_t(off) + n;
+    const std::uint64_t block_size = m_blocks.block_size();
+    const std::uint64_t first_block = std::uint64_t(off) / block_size;
+    const std::uint64_t end_block = (end + block_size - 1) / block_size;
+
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    if (n > 0) {
+        // the parts of the edge blocks which are not written must be known
+        if ((off % block_size) != 0 &&
+                m_blocks.state(first_block) == Blocklist::ABSENT) {
+            return make_result(FAILED, ENODATA);
+        }
+        if ((end % block_size) != 0 && end < attr.size &&
+                m_blocks.state(end_block - 1) == Blocklist::ABSENT) {
+            return make_result(FAILED, ENODATA);
+        }
+    }
+
+    std::size_t done = 0;
+    while (done < n) {
+        ssize_t written = ::pwrite(int(m_data),
+                                   static_cast<const char*>(buf) + done,
+                                   n - done,
+                                   off + done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return make_result(FAILED, errno);
+        }
+        done += written;
+    }
+    m_blocks.set_tag(make_content_tag(attr));
+    if (n == 0) {
+        return make_result();
+    }
+
+    const std::uint64_t first_chunk = first_block / m_chunk_blocks;
+    const std::uint64_t end_chunk = (end_block + m_chunk_blocks - 1) / m_chunk_blocks;
+    std::vector<std::uint64_t> evictable_before;
+    if (m_store) {
+        evictable_before = evictable_blocks(first_chunk, end_chunk);
+    }
+    m_blocks.mark(first_block, end_block - first_block, Blocklist::WRITTEN);
+    if (!m_store) {
+        return make_result();
+    }
+    const std::vector<std::uint64_t> evictable_after = evictable_blocks(first_chunk, end_chunk);
+    guard.unlock();
+
+    account(first_chunk, evictable_before, evictable_after);
+    return make_result();
+}
+
+Result<void> RegularFileHandle::resize(std::uint64_t old_size,
+                                       const CommonFileAttributes &attr)
+{
+    const std::uint64_t new_size = attr.size;
+    const std::uint64_t block_size = m_blocks.block_size();
+    const std::uint64_t old_end_block = (old_size + block_size - 1) / block_size;
+    const std::uint64_t new_end_block = (new_size + block_size - 1) / block_size;
+
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    std::uint64_t first_block = 0;
+    std::uint64_t end_block = 0;
+    if (new_size < old_size) {
+        if (::ftruncate(int(m_data), off_t(new_size)) != 0) {
+            return make_result(FAILED, errno);
+        }
+        first_block = new_end_block;
+        end_block = old_end_block;
+    } else if (new_size > old_size) {
+        first_block = old_size / block_size;
+        if ((old_size % block_size) != 0 &&
+                m_blocks.state(first_block) == Blocklist::ABSENT) {
+            return make_result(FAILED, ENODATA);
+        }
+        // the data file may extend beyond the old end if a previous version
+        // was longer; the new range must read as zeroes
+        if (::ftruncate(int(m_data), off_t(old_size)) != 0 ||
+                ::ftruncate(int(m_data), off_t(new_size)) != 0) {
+            return make_result(FAILED, errno);
+        }
+        end_block = new_end_block;
+    }
+    m_blocks.set_tag(make_content_tag(attr));
+    if (end_block <= first_block) {
+        return make_result();
+    }
+
+    const std::uint64_t first_chunk = first_block / m_chunk_blocks;
+    const std::uint64_t end_chunk = (end_block + m_chunk_blocks - 1) / m_chunk_blocks;
+    std::vector<std::uint64_t> evictable_before;
+    if (m_store) {
+        evictable_before = evictable_blocks(first_chunk, end_chunk);
+    }
+    m_blocks.mark(first_block, end_block - first_block,
+                  new_size < old_size ? Blocklist::ABSENT : Blocklist::WRITTEN);
+    if (!m_store) {
+        return make_result();
+    }
+    const std::vector<std::uint64_t> evictable_after = evictable_blocks(first_chunk, end_chunk);
+    guard.unlock();
+
+    account(first_chunk, evictable_before, evictable_after);
+    return make_result();
+}
+
+void RegularFileHandle::retag(const CommonFileAttributes &attr)
+{
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    m_blocks.set_tag(make_content_tag(attr));
+}
+
+std::uint64_t RegularFileHandle::settle(const CommonFileAttributes &attr)
+{
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    m_blocks.set_tag(make_content_tag(attr));
+    const std::vector<Blocklist::Range> ranges = m_blocks.ranges(
+                0, std::numeric_limits<std::uint64_t>::max(), Blocklist::WRITTEN);
+    std::uint64_t settled = 0;
+    for (const Blocklist::Range &range: ranges) {
+        m_blocks.transition(range.start, range.count,
+                            Blocklist::WRITTEN, Blocklist::READ);
+        settled += range.count;
+    }
+    guard.unlock();
+
+    if (!m_store || settled == 0) {
+        return settled;
+    }
+    SpaceManager &space = m_store->space();
+    for (const Blocklist::Range &range: ranges) {
+        split_chunks(range, m_chunk_blocks, [&](std::uint64_t chunk, std::uint64_t n) {
+            space.charge(SpaceManager::ChunkKey{m_ino, chunk}, n);
+        });
+    }
+    m_store->reclaim();
+    return settled;
+}
+
+void RegularFileHandle::promote(off_t off, std::size_t n)
+{
+    if (off < 0 || n == 0) {
+        return;
+    }
+    {
+        std::shared_lock<std::shared_mutex> guard(m_blocks_mutex);
+        if (m_blocks.blocks(Blocklist::READAHEAD) == 0) {
+            // the common case; avoid the exclusive lock
+            return;
+        }
+    }
+
+    const std::uint64_t block_size = m_blocks.block_size();
+    const std::uint64_t first_block = std::uint64_t(off) / block_size;
+    const std::uint64_t end_block = (std::uint64_t(off) + n + block_size - 1) / block_size;
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    m_blocks.transition(first_block, end_block - first_block,
+                        Blocklist::READAHEAD, Blocklist::READ);
+}
+
+Result<std::uint64_t> RegularFileHandle::evict(std::uint64_t chunk)
+{
+    const std::uint64_t start = chunk * m_chunk_blocks;
+    const std::uint64_t block_size = m_blocks.block_size();
+
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    std::uint64_t evicted = 0;
+    for (const Blocklist::State state: {Blocklist::READ, Blocklist::READAHEAD}) {
+        for (const Blocklist::Range &range: m_blocks.ranges(start, m_chunk_blocks, state)) {
+            // mark first: a block which is marked but whose data is gone
+            // would be served as zeroes
+            m_blocks.mark(range.start, range.count, Blocklist::ABSENT);
+            evicted += range.count;
+            if (::fallocate(int(m_data),
+                            FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            off_t(range.start * block_size),
+                            off_t(range.count * block_size)) != 0)
+            {
+                if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                    // the blocks are still unusable for the cache; the space
+                    // is only reclaimed when the file is truncated.
+                    continue;
+                }
+                return make_result(FAILED, errno);
+            }
+        }
+    }
+    return make_result(evicted);
+}
+
+std::uint64_t RegularFileHandle::unpin()
+{
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    const std::vector<Blocklist::Range> ranges = m_blocks.ranges(
+                0, std::numeric_limits<std::uint64_t>::max(), Blocklist::PINNED);
+    std::uint64_t unpinned = 0;
+    for (const Blocklist::Range &range: ranges) {
+        m_blocks.transition(range.start, range.count,
+                            Blocklist::PINNED, Blocklist::READ);
+        unpinned += range.count;
+    }
+    guard.unlock();
+
+    if (!m_store) {
+        return unpinned;
+    }
+    m_store->remove_pinned(m_ino);
+    SpaceManager &space = m_store->space();
+    for (const Blocklist::Range &range: ranges) {
+        split_chunks(range, m_chunk_blocks, [&](std::uint64_t chunk, std::uint64_t n) {
+            space.charge(SpaceManager::ChunkKey{m_ino, chunk}, n);
+        });
+    }
+    m_store->reclaim();
+    return unpinned;
+}
+
+std::uint64_t RegularFileHandle::generation()
+{
+    std::shared_lock<std::shared_mutex> guard(m_blocks_mutex);
+    return m_generation;
+}
+
+Result<bool> RegularFileHandle::validate(const CommonFileAttributes &attr)
+{
+    const Blocklist::Tag tag = make_content_tag(attr);
+
+    std::unique_lock<std::shared_mutex> guard(m_blocks_mutex);
+    if (m_blocks.tag() == tag) {
+        return make_result(true);
+    }
+
+    m_blocks.clear();
+    ++m_generation;
+    if (m_store) {
+        m_store->space().forget(m_ino);
+    }
+    if (::ftruncate(int(m_data), 0) != 0) {
+        return make_result(FAILED, errno);
+    }
+    m_blocks.set_tag(tag);
+    return make_result(false);
+}
+
+Result<void> RegularFileHandle::fsync()
+{
+    if (::fdatasync(int(m_data)) != 0) {
+        return make_result(FAILED, errno);
+    }
+    return make_result();
+}
+
+std::uint64_t RegularFileHandle::cached_blocks()
+{
+    std::shared_lock<std::shared_mutex> guard(m_blocks_mutex);
+    return m_blocks.present_blocks();
+}
+
+std::uint64_t RegularFileHandle::cached_blocks(Blocklist::State state)
+{
+    std::shared_lock<std::shared_mutex> guard(m_blocks_mutex);
+    return m_blocks.blocks(state);
+}
+
+/* Dragonstash::ContentStore */
+
+static std::uint32_t validated_block_size(std::uint32_t block_size)
+{
+    if (!is_valid_block_size(block_size)) {
+        throw std::invalid_argument("invalid block size " +
+                                    std::to_string(block_size));
+    }
+    return block_size;
+}
+
+ContentStore::ContentStore(std::filesystem::path root,
+                           std::uint64_t budget,
+                           std::uint32_t block_size):
+    m_root(std::move(root)),
+    m_block_size(validated_block_size(block_size)),
+    m_space(budget / m_block_size, chunk_blocks())
+{
+    std::filesystem::create_directories(m_root);
+    scan();
+}
+
+void ContentStore::scan()
+{
+    // recency is not persisted; after a restart, all contents start out as
+    // seen once.
+    static const std::string suffix = ".blocks";
+    for (const auto &dirent: std::filesystem::directory_iterator(m_root)) {
+        const std::string name = dirent.path().filename().string();
+        if (name.size() <= suffix.size() ||
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+        {
+            continue;
+        }
+        ino_t ino;
+        try {
+            ino = std::stoull(name.substr(0, name.size() - suffix.size()));
+        } catch (const std::logic_error &) {
+            continue;
+        }
+
+        try {
+            const Blocklist blocks(dirent.path());
+            if (blocks.block_size() != m_block_size) {
+                // will be discarded when the inode is opened
+                continue;
+            }
+            for (const Blocklist::State state: {Blocklist::READ, Blocklist::READAHEAD}) {
+                for (const Blocklist::Range &range: blocks.ranges(
+                         0, std::numeric_limits<std::uint64_t>::max(), state))
+                {
+                    split_chunks(range, chunk_blocks(), [&](std::uint64_t chunk, std::uint64_t n) {
+                        m_space.charge(SpaceManager::ChunkKey{ino, chunk}, n);
+                    });
+                }
+            }
+            if (blocks.blocks(Blocklist::PINNED) > 0) {
+                add_pinned(ino);
+            }
+        } catch (const std::runtime_error &) {
+            // damaged; will be recreated when the inode is opened
+            continue;
+        }
+    }
+}
+
+std::filesystem::path ContentStore::data_path(ino_t ino) const
+{
+    return m_root / (std::to_string(ino) + ".data");
+}
+
+std::filesystem::path ContentStore::blocklist_path(ino_t ino) const
+{
+    return m_root / (std::to_string(ino) + ".blocks");
+}
+
+Result<std::shared_ptr<RegularFileHandle>> ContentStore::open_files(ino_t ino)
+{
+    FileHandle data_fd(::open(data_path(ino).c_str(),
+                              O_CREAT | O_RDWR | O_CLOEXEC,
+                              S_IRUSR | S_IWUSR));
+    if (!data_fd) {
+        return make_result(FAILED, errno);
+    }
+    auto handle = std::make_shared<RegularFileHandle>(ino,
+                                                      blocklist_path(ino),
+                                                      std::move(data_fd),
+                                                      this);
+    if (handle->block_size() != m_block_size) {
+        // the cache was recreated with a different block size
+        throw std::runtime_error("block size mismatch");
+    }
+    return make_result(std::move(handle));
+}
+
+Result<std::shared_ptr<RegularFileHandle>> ContentStore::open(ino_t ino)
+{
+    std::lock_guard<std::mutex> guard(m_open_mutex);
+    auto iter = m_open.find(ino);
+    if (iter != m_open.end()) {
+        if (auto handle = iter->second.lock()) {
+            return make_result(std::move(handle));
+        }
+        m_open.erase(iter);
+    }
+
+    Result<std::shared_ptr<RegularFileHandle>> result = make_result(FAILED, EIO);
+    try {
+        result = open_files(ino);
+    } catch (const std::runtime_error &) {
+        // the blocklist is damaged or unusable; the cached data cannot be
+        // trusted either, so start over.
+        std::error_code ec;
+        std::filesystem::remove(blocklist_path(ino), ec);
+        std::filesystem::remove(data_path(ino), ec);
+        try {
+            result = open_files(ino);
+        } catch (const std::runtime_error &) {
+            return make_result(FAILED, EIO);
+        }
+    }
+    if (!result) {
+        return result;
+    }
+
+    m_open.emplace(ino, *result);
+    return result;
+}
+
+void ContentStore::remove(ino_t ino)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_open_mutex);
+        m_open.erase(ino);
+    }
+    m_space.forget(ino);
+    remove_pinned(ino);
+    std::error_code ec;
+    std::filesystem::remove(blocklist_path(ino), ec);
+    std::filesystem::remove(data_path(ino), ec);
+}
+
+void ContentStore::add_pinned(ino_t ino)
+{
+    std::lock_guard<std::mutex> guard(m_pinned_mutex);
+    m_pinned.insert(ino);
+}
+
+void ContentStore::remove_pinned(ino_t ino)
+{
+    std::lock_guard<std::mutex> guard(m_pinned_mutex);
+    m_pinned.erase(ino);
+}
+
+std::vector<ino_t> ContentStore::pinned() const
+{
+    std::lock_guard<std::mutex> guard(m_pinned_mutex);
+    std::vector<ino_t> result(m_pinned.begin(), m_pinned.end());
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void ContentStore::reclaim()
+{
+    while (auto victim = m_space.next_victim()) {
+        auto handle = open(victim->key.ino);
+        if (!handle) {
+            continue;
+        }
+        auto evicted = (*handle)->evict(victim->key.chunk);
+        if (evicted && *evicted > victim->blocks) {
+            // blocks were stored between selecting and evicting the chunk
+            // and charged to a new entry; they are gone now.
+            m_space.discharge(victim->key, *evicted - victim->blocks);
+        }
+    }
+}
+
+void ContentStore::set_budget(std::uint64_t budget)
+{
+    m_space.set_budget(budget / m_block_size);
+    reclaim();
+}
+
+}
@@ -0,0 +1,229 @@
+/**********************************************************************
+File name: space_manager.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/cache/space_manager.hpp"
+
+#include <algorithm>
+
+namespace Dragonstash {
+
+SpaceManager::SpaceManager(std::uint64_t budget,
+                           std::uint64_t chunk_blocks):
+    m_chunk_blocks(chunk_blocks),
+    m_budget(budget),
+    m_used(0),
+    m_in_used(0)
+{
+
+}
+
+std::uint64_t SpaceManager::max_in_used() const
+{
+    return m_budget / 4;
+}
+
+std::size_t SpaceManager::max_ghosts() const
+{
+    // remember as many chunks as would fill half of the budget
+    return std::max<std::size_t>(m_budget / m_chunk_blocks / 2, 1);
+}
+
+void SpaceManager::track_chunk(const ChunkKey &key)
+{
+    m_inode_chunks[key.ino].insert(key.chunk);
+}
+
+void SpaceManager::untrack_chunk(const ChunkKey &key)
+{
+    auto iter = m_inode_chunks.find(key.ino);
+    if (iter == m_inode_chunks.end()) {
+        return;
+    }
+    iter->second.erase(key.chunk);
+    if (iter->second.empty()) {
+        m_inode_chunks.erase(iter);
+    }
+}
+
+void SpaceManager::remember_ghost(const ChunkKey &key)
+{
+    m_ghosts.push_front(key);
+    m_ghost_index[key] = m_ghosts.begin();
+    track_chunk(key);
+    while (m_ghosts.size() > max_ghosts()) {
+        untrack_chunk(m_ghosts.back());
+        m_ghost_index.erase(m_ghosts.back());
+        m_ghosts.pop_back();
+    }
+}
+
+void SpaceManager::remove_entry(EntryList::iterator iter)
+{
+    untrack_chunk(iter->key);
+    m_used -= iter->blocks;
+    if (iter->queue == Queue::IN) {
+        m_in_used -= iter->blocks;
+        m_index.erase(iter->key);
+        m_in.erase(iter);
+    } else {
+        m_index.erase(iter->key);
+        m_main.erase(iter);
+    }
+}
+
+void SpaceManager::charge(const ChunkKey &key, std::uint64_t blocks)
+{
+    if (blocks == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_used += blocks;
+
+    auto iter = m_index.find(key);
+    if (iter != m_index.end()) {
+        Entry &entry = *iter->second;
+        entry.blocks += blocks;
+        if (entry.queue == Queue::IN) {
+            m_in_used += blocks;
+        } else {
+            m_main.splice(m_main.begin(), m_main, iter->second);
+        }
+        return;
+    }
+
+    auto ghost = m_ghost_index.find(key);
+    if (ghost != m_ghost_index.end()) {
+        // seen before, not too long ago: this is part of the working set
+        m_ghosts.erase(ghost->second);
+        m_ghost_index.erase(ghost);
+        m_main.push_front(Entry{key, blocks, Queue::MAIN});
+        m_index.emplace(key, m_main.begin());
+        return;
+    }
+
+    m_in.push_front(Entry{key, blocks, Queue::IN});
+    m_in_used += blocks;
+    m_index.emplace(key, m_in.begin());
+    track_chunk(key);
+}
+
+void SpaceManager::discharge(const ChunkKey &key, std::uint64_t blocks)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter == m_index.end()) {
+        return;
+    }
+
+    Entry &entry = *iter->second;
+    blocks = std::min(blocks, entry.blocks);
+    if (blocks == entry.blocks) {
+        remove_entry(iter->second);
+        return;
+    }
+    entry.blocks -= blocks;
+    m_used -= blocks;
+    if (entry.queue == Queue::IN) {
+        m_in_used -= blocks;
+    }
+}
+
+void SpaceManager::touch(const ChunkKey &key)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_index.find(key);
+    if (iter == m_index.end() || iter->second->queue != Queue::MAIN) {
+        return;
+    }
+    m_main.splice(m_main.begin(), m_main, iter->second);
+}
+
+void SpaceManager::forget(ino_t ino)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto chunks_iter = m_inode_chunks.find(ino);
+    if (chunks_iter == m_inode_chunks.end()) {
+        return;
+    }
+    const std::unordered_set<std::uint64_t> chunks = std::move(chunks_iter->second);
+    m_inode_chunks.erase(chunks_iter);
+
+    for (const std::uint64_t chunk: chunks) {
+        const ChunkKey key{ino, chunk};
+        auto iter = m_index.find(key);
+        if (iter != m_index.end()) {
+            remove_entry(iter->second);
+            continue;
+        }
+        auto ghost = m_ghost_index.find(key);
+        if (ghost != m_ghost_index.end()) {
+            m_ghosts.erase(ghost->second);
+            m_ghost_index.erase(ghost);
+        }
+    }
+}
+
+std::optional<SpaceManager::Victim> SpaceManager::next_victim()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_budget == 0 || m_used <= m_budget) {
+        return std::nullopt;
+    }
+
+    if (!m_in.empty() && (m_in_used > max_in_used() || m_main.empty())) {
+        const Victim victim{m_in.back().key, m_in.back().blocks};
+        remove_entry(std::prev(m_in.end()));
+        remember_ghost(victim.key);
+        return victim;
+    }
+
+    if (!m_main.empty()) {
+        const Victim victim{m_main.back().key, m_main.back().blocks};
+        remove_entry(std::prev(m_main.end()));
+        return victim;
+    }
+
+    return std::nullopt;
+}
+
+void SpaceManager::set_budget(std::uint64_t budget)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_budget = budget;
+}
+
+std::uint64_t SpaceManager::budget() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_budget;
+}
+
+std::uint64_t SpaceManager::used() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_used;
+}
+
+}
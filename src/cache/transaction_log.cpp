@@ -0,0 +1,132 @@
+/**********************************************************************
+File name: transaction_log.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/cache/transaction_log.hpp"
+
+#include <cassert>
+#include <iterator>
+
+namespace Dragonstash {
+
+/* Dragonstash::TransactionLog */
+
+Result<void> TransactionLog::stage_1_commit()
+{
+    for (TransactionHook &hook: m_hooks) {
+        auto result = hook.stage_1_commit();
+        if (!result) {
+            return result;
+        }
+    }
+    return make_result();
+}
+
+void TransactionLog::stage_2_commit()
+{
+    for (TransactionHook &hook: m_hooks) {
+        hook.stage_2_commit();
+    }
+}
+
+void TransactionLog::rollback(InodeReferences &locks)
+{
+    // two separate passes here to ensure that all stage 1 rollback callbacks
+    // run before all main
+    for (auto iter = m_hooks.rbegin(); iter != m_hooks.rend(); ++iter) {
+        iter->stage_1_rollback();
+    }
+
+    auto hook = m_hooks.rbegin();
+    for (auto iter = m_records.rbegin(); iter != m_records.rend(); ++iter) {
+        if (iter->undo == 0) {
+            assert(hook != m_hooks.rend());
+            hook->rollback();
+            ++hook;
+        } else if (iter->undo < 0) {
+            [[maybe_unused]] auto result = locks.decref(
+                        iter->ino, static_cast<std::uint64_t>(-iter->undo));
+            assert(result);
+        } else {
+            [[maybe_unused]] auto result = locks.incref(
+                        iter->ino, static_cast<std::uint64_t>(iter->undo));
+            assert(result);
+        }
+    }
+}
+
+void TransactionLog::append(TransactionLog &src)
+{
+    m_records.insert(m_records.end(), src.m_records.begin(), src.m_records.end());
+    m_hooks.insert(m_hooks.end(),
+                   std::make_move_iterator(src.m_hooks.begin()),
+                   std::make_move_iterator(src.m_hooks.end()));
+    src.clear();
+}
+
+void TransactionLog::clear()
+{
+    m_records.clear();
+    m_hooks.clear();
+}
+
+/* Dragonstash::TransactionLogPool */
+
+TransactionLogPool::TransactionLogPool(std::size_t max_logs, std::size_t max_records):
+    m_max_logs(max_logs),
+    m_max_records(max_records)
+{
+    m_free.reserve(m_max_logs);
+}
+
+TransactionLog TransactionLogPool::acquire()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_free.empty()) {
+        return TransactionLog();
+    }
+    TransactionLog log = std::move(m_free.back());
+    m_free.pop_back();
+    return log;
+}
+
+void TransactionLogPool::recycle(TransactionLog &&log)
+{
+    if (log.capacity() == 0 || log.capacity() > m_max_records) {
+        return;
+    }
+    log.clear();
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_free.size() >= m_max_logs) {
+        return;
+    }
+    m_free.emplace_back(std::move(log));
+}
+
+std::size_t TransactionLogPool::size()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_free.size();
+}
+
+}
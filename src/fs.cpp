@@ -24,58 +24,462 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include "dragonstash/fs.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "dragonstash/fuse/buffer.hpp"
 
 namespace Dragonstash {
 
-Filesystem::Filesystem(Cache &cache, Backend::Filesystem &backend):
+/**
+ * @brief Number of bytes pull_file() fetches or re-marks at a time.
+ */
+static constexpr std::uint64_t PREFETCH_STEP = 4*1024*1024;
+
+/**
+ * @brief Number of pinned files which may wait for a download before
+ * lookups block.
+ */
+static constexpr std::size_t PIN_QUEUE_SIZE = 1024;
+
+/**
+ * @brief Number of bytes flush_file() copies to the backend at a time.
+ */
+static constexpr std::size_t FLUSH_STEP = 1024*1024;
+
+/**
+ * @brief How old the timestamps of a backend directory must be for its sync
+ * stamp to be recorded.
+ *
+ * Timestamps have a limited resolution on many file systems; a directory
+ * which changes again within the same tick after it was read keeps its
+ * stamp. Recent stamps are not trusted for that reason.
+ */
+static constexpr std::chrono::seconds DIR_STAMP_SETTLE_TIME(2);
+
+Filesystem::Filesystem(Cache &cache, Backend::Filesystem &backend,
+                       std::size_t backend_concurrency,
+                       std::size_t readahead_concurrency,
+                       std::size_t notify_concurrency,
+                       std::size_t pin_concurrency):
     m_cache(cache),
-    m_backend_fs(backend)
+    m_backend_fs(backend),
+    m_backend_pool(backend_concurrency),
+    m_readahead_pool(readahead_concurrency),
+    m_negative_timeout(DEFAULT_NEGATIVE_TIMEOUT),
+    m_dir_change_detection(false),
+    m_notify_pool(notify_concurrency, WorkerPool::UNBOUNDED),
+    m_notifications(m_notify_pool),
+    m_pin_policy(std::make_shared<const PinPolicy>()),
+    m_pin_generation(0),
+    m_pin_pool(pin_concurrency, PIN_QUEUE_SIZE),
+    m_pin_tasks(m_pin_pool),
+    m_refresh_tasks(m_backend_pool),
+    m_prefetch_pool(1, WorkerPool::UNBOUNDED),
+    m_prefetch_tasks(m_prefetch_pool),
+    m_write_back(false),
+    m_flusher_stop(false),
+    m_flush_interval(0),
+    m_metrics_file(false)
+{
+    m_metrics.add([this](Metrics::TextWriter &out) { collect_metrics(out); });
+    m_metrics.add([this](Metrics::TextWriter &out) { m_cache.collect_metrics(out); });
+}
+
+Filesystem::~Filesystem()
 {
+    stop_flusher();
+}
 
+void Filesystem::set_readahead_config(const Readahead::Config &config)
+{
+    m_readahead_config = config;
 }
 
-void Filesystem::lookup(Fuse::Request &&req, fuse_ino_t parent, std::string_view name)
+Result<Backend::HandleTable::HandlePtr> Filesystem::backend_dir(
+        CacheTransactionRO &txn,
+        ino_t ino,
+        bool &from_table)
+{
+    Backend::HandleTable::Clock::time_point checked;
+    if (auto handle = m_backend_dirs.get(ino, checked)) {
+        // checked as often as the kernel revalidates attributes
+        const std::chrono::duration<double> age =
+                Backend::HandleTable::Clock::now() - checked;
+        if (age.count() >= timeout_rule(txn, ino).attr_timeout) {
+            handle = revalidate_backend_dir(ino, std::move(handle));
+        }
+        if (handle) {
+            from_table = true;
+            return make_result(std::move(handle));
+        }
+    }
+    from_table = false;
+
+    auto path_result = txn.path(ino);
+    if (!path_result) {
+        return copy_error(path_result);
+    }
+
+    auto open_result = m_backend_fs.open_directory(
+                path_result->empty() ? std::string_view("/") : std::string_view(*path_result));
+    if (!open_result) {
+        return copy_error(open_result);
+    }
+
+    Backend::HandleTable::HandlePtr handle(std::move(*open_result));
+    m_backend_dirs.put(ino, handle);
+    return make_result(std::move(handle));
+}
+
+Backend::HandleTable::HandlePtr Filesystem::revalidate_backend_dir(
+        ino_t ino, Backend::HandleTable::HandlePtr handle)
+{
+    auto current = handle->is_current();
+    if (current && *current) {
+        m_backend_dirs.mark_checked(ino);
+        return handle;
+    }
+    // if the check failed, re-opening the directory finds out why
+    m_backend_dirs.invalidate(ino);
+    return nullptr;
+}
+
+void Filesystem::lstat_backend_async(CacheTransactionRO &txn, ino_t dir,
+                                     std::string_view name,
+                                     Backend::Completion<Backend::Stat> &&done)
+{
+    bool from_table = false;
+    auto handle = backend_dir(txn, dir, from_table);
+    txn.abort();
+    if (!handle) {
+        done(copy_error(handle));
+        return;
+    }
+
+    struct State {
+        Backend::HandleTable::HandlePtr handle;
+        Backend::Completion<Backend::Stat> done;
+        ino_t dir;
+        std::string name;
+        bool from_table;
+        Trace::Handle trace;
+        Trace::Span span;
+    };
+    // the handle is kept until the backend has answered; the trace of the
+    // request continues on whichever thread the answer arrives
+    auto state = std::make_unique<State>(
+                State{std::move(*handle), std::move(done), dir, std::string(name), from_table,
+                      Trace::current_handle(), Trace::Span(Trace::Phase::BACKEND_LSTAT)});
+    Backend::DirectoryHandle &dir_handle = *state->handle;
+    dir_handle.lstat_async(name, [this, state = std::move(state)](Result<Backend::Stat> result) mutable {
+        const Trace::Scope trace_scope(state->trace);
+        state->span.end();
+        if (!result && state->from_table &&
+                (result.error() == ENOENT || result.error() == ESTALE)) {
+            // see with_backend_dir(); the retry opens the directory by
+            // its path
+            m_backend_dirs.invalidate(state->dir);
+            auto txn = m_cache.begin_ro();
+            lstat_backend_async(txn, state->dir, state->name, std::move(state->done));
+            return;
+        }
+        state->done(std::move(result));
+    });
+}
+
+template <typename F>
+auto Filesystem::with_backend_dir(CacheTransactionRO &txn, ino_t ino, F &&op)
+        -> decltype(op(std::declval<Backend::DirectoryHandle&>()))
+{
+    bool from_table = false;
+    auto handle = backend_dir(txn, ino, from_table);
+    if (!handle) {
+        return copy_error(handle);
+    }
+
+    auto result = op(**handle);
+    if (!result && from_table &&
+            (result.error() == ENOENT || result.error() == ESTALE)) {
+        m_backend_dirs.invalidate(ino);
+        handle = backend_dir(txn, ino, from_table);
+        if (!handle) {
+            return copy_error(handle);
+        }
+        result = op(**handle);
+    }
+    return result;
+}
+
+void Filesystem::init(fuse_conn_info *conn)
 {
-    auto txn = m_cache.begin_rw();
+    // cached reads are replied by file descriptor, see read()
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+}
+
+/**
+ * @brief Lock an inode for the kernel and send it as entry reply.
+ *
+ * This takes care of committing the transaction; on success, the lock taken
+ * here is handed out to the kernel together with the entry.
+ */
+static void reply_locked_entry(Fuse::Request &req,
+                               CacheTransactionRO &txn,
+                               ino_t ino,
+                               struct fuse_entry_param &e)
+{
+    auto lock_result = txn.lock(ino);
+    if (!lock_result) {
+        req.reply_err(lock_result.error());
+        return;
+    }
+    e.ino = ino;
+
+    auto commit_result = txn.commit();
+    if (!commit_result) {
+        req.reply_err(commit_result.error());
+        return;
+    }
+    req.reply_entry(&e);
+}
 
-    Result<ino_t> ino_result = make_result(FAILED, -EOPNOTSUPP);
+/**
+ * @brief Reply to a lookup with a negative entry.
+ *
+ * The kernel caches the absence of the name for @a timeout seconds.
+ */
+static void reply_negative_entry(Fuse::Request &req, double timeout)
+{
     struct fuse_entry_param e{};
-    e.attr_timeout = 1.0;
-    e.entry_timeout = 1.0;
+    e.ino = 0;
+    e.entry_timeout = timeout;
+    req.reply_entry(&e);
+}
+
+void Filesystem::set_negative_timeout(double seconds)
+{
+    m_negative_timeout = std::max(seconds, 0.0);
+}
+
+void Filesystem::set_dir_change_detection(bool enabled)
+{
+    m_dir_change_detection = enabled;
+}
+
+void Filesystem::set_timeout_policy(const TimeoutPolicy &policy)
+{
+    m_timeouts = policy;
+}
+
+void Filesystem::set_notifier(const Fuse::Notifier &notifier)
+{
+    m_notifications.wait();
+    m_notifier = notifier;
+}
+
+void Filesystem::notify(std::vector<Invalidation> &&invalidations)
+{
+    if (!m_notifier || invalidations.empty()) {
+        return;
+    }
+
+    m_notifications.submit([notifier = m_notifier, invalidations = std::move(invalidations)]() mutable {
+        for (const Invalidation &inval: invalidations) {
+            // errors only mean that the kernel has nothing cached for it
+            if (!inval.name.empty()) {
+                (void)notifier.inval_entry(inval.ino, inval.name);
+            } else {
+                (void)notifier.inval_inode(inval.ino, inval.data ? 0 : -1, 0);
+            }
+        }
+    });
+}
 
-    auto path_result = txn.path(parent);
+const TimeoutPolicy::Rule &Filesystem::timeout_rule(CacheTransactionRO &txn,
+                                                    ino_t ino,
+                                                    std::string_view name)
+{
+    if (!m_timeouts.has_subtrees()) {
+        return m_timeouts.defaults();
+    }
+    auto path_result = txn.path(ino);
     if (!path_result) {
-        req.reply_err(path_result.error());
+        return m_timeouts.defaults();
+    }
+    if (!name.empty()) {
+        path_result->push_back('/');
+        path_result->append(name);
+    }
+    return m_timeouts.rule_for(*path_result);
+}
+
+void Filesystem::lookup(Fuse::Request &&req, fuse_ino_t parent, std::string_view name)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::LOOKUP);
+    struct fuse_entry_param e{};
+
+    if (is_control_dir(parent, name)) {
+        e.ino = CONTROL_DIR_INO;
+        e.attr = control_file_stat(CONTROL_DIR_INO);
+        req.reply_entry(&e);
+        return;
+    }
+    if (parent == CONTROL_DIR_INO) {
+        e.ino = control_file(name);
+        if (e.ino == 0) {
+            req.reply_err(ENOENT);
+            return;
+        }
+        e.attr = control_file_stat(e.ino);
+        req.reply_entry(&e);
         return;
     }
 
-    std::string backend_path = *path_result;
-    backend_path.reserve(backend_path.size() + name.size() + 1);
-    backend_path += '/';
-    backend_path += name;
-    std::string_view backend_path_view(backend_path);
+    // The common case is that the entry is cached already and has not changed
+    // on the backend. That case is served from a read-only transaction so that
+    // concurrent lookups do not serialise on the LMDB writer lock; a write
+    // transaction is only opened if the cache actually needs to change.
+    auto ro_txn = m_cache.begin_ro();
+    const TimeoutPolicy::Rule &rule = timeout_rule(ro_txn, parent, name);
+    const auto pins = pin_policy(ro_txn);
+    e.attr_timeout = rule.attr_timeout;
+    e.entry_timeout = rule.entry_timeout;
 
-    auto stat_result = m_backend_fs.lstat(backend_path_view);
-    if (stat_result) {
-        auto cache_attrs = InodeAttributes::from_backend_stat(*stat_result);
+    // names which the backend reported missing recently are not asked for
+    // again; this serves probes like PATH searches without a round-trip.
+    if (m_negative_timeout > 0) {
+        auto negative_result = ro_txn.lookup_negative(parent, name);
+        if (negative_result) {
+            const std::chrono::duration<double> remaining =
+                    *negative_result - std::chrono::system_clock::now();
+            if (remaining.count() > 0) {
+                m_lookup_hits.add();
+                reply_negative_entry(req, std::min(remaining.count(), m_negative_timeout));
+                return;
+            }
+        }
+    }
 
-        ino_result = txn.emplace(parent, name, cache_attrs);
-        if (!ino_result) {
-            req.reply_err(ino_result.error());
+    Result<ino_t> ino_result = ro_txn.lookup(parent, name);
+
+    // files with changes which have not been written back are newer in the
+    // cache; they may not even exist on the backend
+    if (ino_result && ro_txn.journaled(*ino_result)) {
+        auto attr_result = ro_txn.getattr(*ino_result);
+        if (attr_result) {
+            m_lookup_hits.add();
+            e.attr = *attr_result;
+            reply_locked_entry(req, ro_txn, *ino_result, e);
+            return;
+        }
+    }
+
+    // entries which have not changed for long enough are trusted without
+    // asking the backend, if the policy says so
+    if (ino_result && rule.stable_after > 0) {
+        auto attr_result = ro_txn.getattr(*ino_result);
+        struct timespec now{};
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (attr_result && TimeoutPolicy::is_stable(rule, attr_result->attr.common.mtime, now)) {
+            m_lookup_hits.add();
+            e.attr = *attr_result;
+            reply_locked_entry(req, ro_txn, *ino_result, e);
+            pin_entry(*pins, parent, name, e);
+            return;
+        }
+    }
+
+    // entries which were found up-to-date recently are served right away
+    // and, once they are old enough, revalidated after the reply
+    if (ino_result && rule.hard_ttl > 0) {
+        const auto revalidation = TimeoutPolicy::revalidation(
+                    rule, validation_age(*ino_result));
+        if (revalidation != TimeoutPolicy::Revalidation::SYNCHRONOUS) {
+            auto attr_result = ro_txn.getattr(*ino_result);
+            if (attr_result) {
+                m_lookup_hits.add();
+                e.attr = *attr_result;
+                reply_locked_entry(req, ro_txn, *ino_result, e);
+                pin_entry(*pins, parent, name, e);
+                if (revalidation == TimeoutPolicy::Revalidation::BACKGROUND) {
+                    schedule_refresh(parent, name, *ino_result);
+                }
+                return;
+            }
+        }
+    }
+
+    // if the parent cannot be resolved, the error ends up in stat_result;
+    // without anything cached under the name, that is what is replied.
+    // The reply is sent once the backend has answered, possibly from a
+    // backend thread.
+    auto lookup = std::make_unique<PendingLookup>(
+                PendingLookup{std::move(req), parent, std::string(name), pins, e});
+    lstat_backend_async(ro_txn, parent, name,
+                        [this, lookup = std::move(lookup)](Result<Backend::Stat> stat_result) mutable {
+        finish_lookup(*lookup, std::move(stat_result));
+    });
+}
+
+void Filesystem::finish_lookup(PendingLookup &lookup, Result<Backend::Stat> &&stat_result)
+{
+    Fuse::Request &req = lookup.req;
+    const ino_t parent = lookup.parent;
+    const std::string_view name = lookup.name;
+    const auto &pins = lookup.pins;
+    struct fuse_entry_param &e = lookup.e;
+
+    // the cache may have changed while the backend was asked
+    auto ro_txn = m_cache.begin_ro();
+    Result<ino_t> ino_result = ro_txn.lookup(parent, name);
+
+    if (ino_result && ro_txn.journaled(*ino_result)) {
+        // written to since the lookup started; see lookup()
+        auto attr_result = ro_txn.getattr(*ino_result);
+        if (attr_result) {
+            m_lookup_hits.add();
+            e.attr = *attr_result;
+            reply_locked_entry(req, ro_txn, *ino_result, e);
             return;
         }
+    }
+
+    InodeAttributes cache_attrs{};
+    if (stat_result) {
+        cache_attrs = InodeAttributes::from_backend_stat(*stat_result);
 
-        e.attr = Stat{
-            cache_attrs,
-            *ino_result
-        };
+        if (ino_result) {
+            auto attr_result = ro_txn.getattr(*ino_result);
+            if (attr_result && attr_result->attr == cache_attrs) {
+                // cache is up-to-date, nothing to write
+                m_lookup_revalidated.add();
+                mark_validated(*ino_result);
+                e.attr = *attr_result;
+                reply_locked_entry(req, ro_txn, *ino_result, e);
+                pin_entry(*pins, parent, name, e);
+                return;
+            }
+        }
     } else if (Backend::is_not_connected(stat_result)) {
         // backend not connected, retrieve from cache if available
-        ino_result = txn.lookup(parent, name);
         if (!ino_result) {
+            m_lookup_misses.add();
             if (ino_result.error() == ENOENT) {
-                auto flag_result = txn.test_flag(parent, InodeFlag::SYNCED);
+                auto flag_result = ro_txn.test_flag(parent, InodeFlag::SYNCED);
                 if (!flag_result || !*flag_result) {
                     // inode is not fully synced -> we return EIO, because we
                     // can not be sure that the entry really does not exist.
@@ -87,51 +491,205 @@ void Filesystem::lookup(Fuse::Request &&req, fuse_ino_t parent, std::string_view
             return;
         }
 
-        auto attr_result = txn.getattr(*ino_result);
+        auto attr_result = ro_txn.getattr(*ino_result);
         if (!attr_result) {
             // return EIO, because this is not supposed to even happen...
             req.reply_err(EIO);
             return;
         }
 
+        // nothing can change while the backend is away
+        m_lookup_hits.add();
+        e.attr_timeout = std::max(e.attr_timeout, m_timeouts.offline_timeout());
+        e.entry_timeout = std::max(e.entry_timeout, m_timeouts.offline_timeout());
         e.attr = *attr_result;
-    } else {
+        reply_locked_entry(req, ro_txn, *ino_result, e);
+        return;
+    }
+
+    // only names in a directory we know of are worth remembering
+    const bool cache_negative = !stat_result &&
+            stat_result.error() == ENOENT &&
+            m_negative_timeout > 0 &&
+            bool(ro_txn.getattr(parent));
+    if (!stat_result && !ino_result && !cache_negative) {
+        // The backend reported an error and we have nothing cached under that
+        // name, so there is nothing to clean up either.
+        m_lookup_misses.add();
+        req.reply_err(stat_result.error());
+        return;
+    }
+
+    // The snapshot is not needed anymore; end it before the write is
+    // submitted so that this thread does not hold two transactions at once
+    // (the write may run on this thread).
+    ro_txn.abort();
+    m_lookup_misses.add();
+
+    if (!stat_result) {
         // The backend reported an error, but it *is* connected. How to deal
         // with this?
         // In general, a backend error on lookup means, for all practical
         // purposes, that the file does not exist.
         // We will remove it from the cache (if it exists) and then return the
         // error the backend returned. Note that this has the downside that we
-        // cannot cache the proper error message from the backend; we might want
-        // to do negative caching in the future, too.
+        // cannot cache the proper error message from the backend; only ENOENT
+        // is remembered, as a negative entry.
 
         // if unlinking fails, what are we going to do? (most likely this is
         // just ENOENT anyways)
         // TODO: add some debug logging for this type of stuff
-        (void)txn.unlink(parent, name);
-        (void)txn.commit();
+        const auto expiry = std::chrono::system_clock::now() +
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::duration<double>(m_negative_timeout));
+        (void)m_cache.write([parent, name, cache_negative, expiry](CacheTransactionRW &txn){
+            (void)txn.unlink(parent, name);
+            if (cache_negative) {
+                (void)txn.put_negative(parent, name, expiry);
+            }
+            return make_result();
+        });
 
+        if (cache_negative) {
+            reply_negative_entry(req, m_negative_timeout);
+            return;
+        }
         req.reply_err(stat_result.error());
         return;
     }
 
-    auto lock_result = txn.lock(*ino_result);
-    if (!lock_result) {
-        req.reply_err(lock_result.error());
+    const ino_t cached_ino = ino_result ? *ino_result : INVALID_INO;
+    auto write_result = m_cache.write([parent, name, &cache_attrs, &ino_result](CacheTransactionRW &txn) -> Result<void> {
+        ino_result = txn.emplace(parent, name, cache_attrs);
+        if (!ino_result) {
+            return copy_error(ino_result);
+        }
+        // the lock is handed out to the kernel together with the entry
+        return txn.lock(*ino_result);
+    });
+    if (!write_result) {
+        req.reply_err(write_result.error());
         return;
     }
+
+    mark_validated(*ino_result);
     e.ino = *ino_result;
+    e.attr = Stat{
+        cache_attrs,
+        *ino_result,
+        m_cache.block_size(),
+    };
+    req.reply_entry(&e);
+    pin_entry(*pins, parent, name, e);
 
-    auto commit_result = txn.commit();
-    if (!commit_result) {
-        req.reply_err(commit_result.error());
+    if (cached_ino == *ino_result) {
+        // the inode has changed in place; the entry reply refreshes the
+        // attributes, but not the pages the kernel has cached.
+        notify({Invalidation{cached_ino, std::string(), S_ISREG(cache_attrs.mode)}});
+    }
+}
+
+double Filesystem::validation_age(ino_t ino)
+{
+    std::lock_guard<std::mutex> guard(m_validated_mutex);
+    auto iter = m_validated.find(ino);
+    if (iter == m_validated.end()) {
+        return std::numeric_limits<double>::infinity();
+    }
+    return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - iter->second).count();
+}
+
+void Filesystem::mark_validated(ino_t ino)
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(m_validated_mutex);
+    m_validated[ino] = now;
+}
+
+void Filesystem::schedule_refresh(ino_t parent, std::string_view name, ino_t ino)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_validated_mutex);
+        if (!m_refreshes_in_flight.insert(ino).second) {
+            return;
+        }
+    }
+
+    m_refresh_tasks.submit([this, parent, name = std::string(name), ino]() {
+        refresh_entry(parent, name, ino);
+        std::lock_guard<std::mutex> guard(m_validated_mutex);
+        m_refreshes_in_flight.erase(ino);
+    });
+}
+
+void Filesystem::refresh_entry(ino_t parent, const std::string &name, ino_t ino)
+{
+    auto ro_txn = m_cache.begin_ro();
+    auto stat_result = with_backend_dir(ro_txn, parent, [&name](Backend::DirectoryHandle &dir){
+        return dir.lstat(name);
+    });
+    if (Backend::is_not_connected(stat_result)) {
+        // once the hard TTL is over, lookups handle this themselves
         return;
     }
-    req.reply_entry(&e);
+
+    if (!stat_result) {
+        // same as in lookup(): the entry is gone for all practical purposes
+        ro_txn.abort();
+        (void)m_cache.write([parent, &name](CacheTransactionRW &txn){
+            (void)txn.unlink(parent, name);
+            return make_result();
+        });
+        notify({Invalidation{parent, name, false}});
+        return;
+    }
+
+    const InodeAttributes cache_attrs = InodeAttributes::from_backend_stat(*stat_result);
+    auto attr_result = ro_txn.getattr(ino);
+    if (attr_result && attr_result->attr == cache_attrs) {
+        mark_validated(ino);
+        return;
+    }
+    ro_txn.abort();
+
+    Result<ino_t> ino_result = make_result(FAILED, EIO);
+    auto write_result = m_cache.write([parent, &name, &cache_attrs, &ino_result](CacheTransactionRW &txn) -> Result<void> {
+        ino_result = txn.emplace(parent, name, cache_attrs);
+        if (!ino_result) {
+            return copy_error(ino_result);
+        }
+        return make_result();
+    });
+    if (!write_result) {
+        return;
+    }
+
+    mark_validated(*ino_result);
+    if (*ino_result == ino) {
+        notify({Invalidation{ino, std::string(), S_ISREG(cache_attrs.mode)}});
+    } else {
+        // the entry now refers to a different inode
+        notify({Invalidation{parent, name, false}});
+    }
+}
+
+void Filesystem::wait_revalidated()
+{
+    m_refresh_tasks.wait();
 }
 
 void Filesystem::forget(Fuse::Request &&req, fuse_ino_t ino, uint64_t nlookup)
 {
+    const Trace::Scope trace_scope = begin_request(req, Op::FORGET);
+    if (is_control_inode(ino)) {
+        req.reply_none();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_validated_mutex);
+        m_validated.erase(ino);
+    }
     auto txn = m_cache.begin_ro();
     auto release_result = txn.release(ino, nlookup);
     if (!release_result) {
@@ -144,6 +702,11 @@ void Filesystem::forget(Fuse::Request &&req, fuse_ino_t ino, uint64_t nlookup)
 
 void Filesystem::getattr(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi)
 {
+    const Trace::Scope trace_scope = begin_request(req, Op::GETATTR);
+    if (is_control_inode(ino)) {
+        req.reply_attr(control_file_stat(ino), 0);
+        return;
+    }
     auto txn = m_cache.begin_ro();
     auto getattr_result = txn.getattr(ino);
     if (!getattr_result) {
@@ -152,64 +715,1482 @@ void Filesystem::getattr(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi
     }
 
     struct stat stbuf = *getattr_result;
-    req.reply_attr(stbuf, 1.0);
+    req.reply_attr(stbuf, timeout_rule(txn, ino).attr_timeout);
+}
+
+void Filesystem::readlink(Fuse::Request &&req, fuse_ino_t ino)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::READLINK);
+    auto txn = m_cache.begin_ro();
+    auto parent_result = txn.parent(ino);
+    if (!parent_result) {
+        req.reply_err(parent_result.error());
+        return;
+    }
+    if (*parent_result == INVALID_INO) {
+        // the root inode is never a link; anything else without a parent
+        // is not reachable anymore
+        req.reply_err(ino == ROOT_INO ? EINVAL : ENOENT);
+        return;
+    }
+    auto name_result = txn.name(*parent_result, ino);
+    if (!name_result) {
+        req.reply_err(name_result.error());
+        return;
+    }
+
+    auto link = with_backend_dir(txn, *parent_result, [&name_result](Backend::DirectoryHandle &dir){
+        return dir.readlink(*name_result);
+    });
+    if (link) {
+        auto cached_link = txn.readlink(ino);
+        txn.abort();
+        if (!cached_link || *cached_link != *link) {
+            (void)m_cache.write([ino, &link](CacheTransactionRW &txn){
+                return txn.writelink(ino, *link);
+            });
+        }
+    } else if (Backend::is_not_connected(link)) {
+        // return from cache
+        link = txn.readlink(ino);
+        if (!link) {
+            req.reply_err(link.error());
+            return;
+        }
+    } else {
+        // how to deal with errors here? unlinking is a safe way forward
+        txn.abort();
+        (void)m_cache.write([ino](CacheTransactionRW &txn){
+            return txn.unlink(ino);
+        });
+        req.reply_err(link.error());
+        return;
+    }
+
+    req.reply_readlink(link->c_str());
 }
 
-void Filesystem::readlink(Fuse::Request &&req, fuse_ino_t ino)
-{
-    auto txn = m_cache.begin_rw();
-    auto path_result = txn.path(ino);
-    if (!path_result) {
-        req.reply_err(path_result.error());
-        return;
+void Filesystem::open(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::OPEN);
+    if (is_control_inode(ino)) {
+        open_control_file(std::move(req), ino, fi);
+        return;
+    }
+    const bool writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+    if (writable && !m_write_back) {
+        req.reply_err(EROFS);
+        return;
+    }
+
+    auto txn = m_cache.begin_ro();
+    auto attr_result = txn.getattr(ino);
+    if (!attr_result) {
+        req.reply_err(attr_result.error());
+        return;
+    }
+    if ((attr_result->attr.mode & S_IFMT) != S_IFREG) {
+        req.reply_err((attr_result->attr.mode & S_IFMT) == S_IFDIR ? EISDIR : EINVAL);
+        return;
+    }
+
+    auto parent_result = txn.parent(ino);
+    if (!parent_result) {
+        req.reply_err(parent_result.error());
+        return;
+    }
+    if (*parent_result == INVALID_INO) {
+        req.reply_err(ENOENT);
+        return;
+    }
+    const ino_t parent = *parent_result;
+    auto name_result = txn.name(parent, ino);
+    if (!name_result) {
+        req.reply_err(name_result.error());
+        return;
+    }
+
+    // files created in the cache do not exist on the backend yet
+    auto journal_result = txn.journal(ino);
+    Result<std::unique_ptr<Backend::File>> backend_file(FAILED, ENOENT);
+    if (!journal_result || !journal_result->created) {
+        backend_file = with_backend_dir(txn, parent, [&name_result](Backend::DirectoryHandle &dir){
+            return dir.open(*name_result, O_RDONLY, 0);
+        });
+    }
+    txn.abort();
+
+    std::optional<InodeAttributes> backend_attrs;
+    if (backend_file) {
+        auto stat_result = (*backend_file)->fstat();
+        if (!stat_result) {
+            req.reply_err(stat_result.error());
+            return;
+        }
+        backend_attrs = InodeAttributes::from_backend_stat(*stat_result);
+        if ((backend_attrs->mode & S_IFMT) != S_IFREG) {
+            req.reply_err(EIO);
+            return;
+        }
+    } else if (!journal_result && !Backend::is_not_connected(backend_file)) {
+        req.reply_err(backend_file.error());
+        return;
+    }
+
+    // Writes retag the cached contents; they must not happen between the
+    // check for journaled changes and the validation, which would drop them.
+    std::unique_lock<std::mutex> journal_guard(journal_mutex(ino), std::defer_lock);
+    if (m_write_back) {
+        journal_guard.lock();
+    }
+    {
+        auto fresh_txn = m_cache.begin_ro();
+        if (fresh_txn.journaled(ino)) {
+            // newer in the cache than on the backend
+            backend_attrs.reset();
+            attr_result = fresh_txn.getattr(ino);
+            if (!attr_result) {
+                req.reply_err(attr_result.error());
+                return;
+            }
+        }
+    }
+
+    // the cached data is bound to the most recent version of the file we
+    // know about: the backend version if connected, the cached one otherwise.
+    InodeAttributes attrs = attr_result->attr;
+    if (backend_attrs && *backend_attrs != attrs) {
+        attrs = *backend_attrs;
+        (void)m_cache.write([parent, &name_result, &attrs](CacheTransactionRW &txn) -> Result<void> {
+            auto emplace_result = txn.emplace(parent, *name_result, attrs);
+            if (!emplace_result) {
+                return copy_error(emplace_result);
+            }
+            return make_result();
+        });
+    }
+
+    auto content_result = m_cache.open_file(ino);
+    if (!content_result) {
+        req.reply_err(content_result.error());
+        return;
+    }
+    auto valid_result = (*content_result)->validate(attrs.common);
+    if (!valid_result) {
+        req.reply_err(valid_result.error());
+        return;
+    }
+    if (journal_guard.owns_lock()) {
+        journal_guard.unlock();
+    }
+
+    const std::uint64_t generation = (*content_result)->generation();
+    std::unique_ptr<OpenFile> file(new OpenFile{
+        std::move(*content_result),
+        backend_file ? std::shared_ptr<Backend::File>(std::move(*backend_file)) : nullptr,
+        attrs.common.size,
+        generation,
+        std::make_shared<Readahead>(m_readahead_config, attrs.common.size),
+        writable,
+    });
+    fi->fh = reinterpret_cast<std::uint64_t>(file.release());
+    // the page cache of the kernel is as good as ours if the file has not
+    // changed.
+    fi->keep_cache = *valid_result ? 1 : 0;
+    req.reply_open(fi);
+
+    if (attrs != attr_result->attr) {
+        // the data is taken care of by keep_cache
+        notify({Invalidation{ino, std::string(), false}});
+    }
+}
+
+/**
+ * @brief Build a fetcher which reads blocks from the backend and caches them.
+ *
+ * Fetches for reads fail on backend errors. Prefetches store whatever they
+ * got instead, since nobody waits for their data.
+ */
+static FetchTable::Fetcher blocks_fetcher(std::shared_ptr<RegularFileHandle> content,
+                                          std::shared_ptr<Backend::File> backend,
+                                          std::uint64_t generation,
+                                          std::uint64_t file_size,
+                                          Blocklist::State state)
+{
+    return [content = std::move(content), backend = std::move(backend),
+            generation, file_size, state](
+            std::uint64_t offset, char *buf, std::size_t n) -> Result<std::size_t>
+    {
+        std::size_t fetched = 0;
+        while (fetched < n) {
+            auto read_result = backend->pread(buf + fetched, n - fetched,
+                                              offset + fetched);
+            if (!read_result) {
+                if (state == Blocklist::READ) {
+                    return copy_error(read_result);
+                }
+                break;
+            }
+            if (*read_result == 0) {
+                // the file has shrunk on the backend since it was opened
+                break;
+            }
+            fetched += *read_result;
+        }
+
+        // caching is best-effort; the data can be served either way
+        (void)content->store(generation, offset, buf, fetched,
+                             offset + fetched == file_size, state);
+        return make_result(fetched);
+    };
+}
+
+Result<std::size_t> Filesystem::read_file(OpenFile &file, char *buf, std::size_t size,
+                                          off_t off)
+{
+    if (off < 0) {
+        return make_result(FAILED, EINVAL);
+    }
+    if (std::uint64_t(off) >= file.size) {
+        return make_result(std::size_t(0));
+    }
+    const std::size_t n = std::min<std::uint64_t>(size, file.size - off);
+
+    std::size_t done = 0;
+    // position at which the last fetch came back short
+    std::optional<std::uint64_t> short_at;
+    while (done < n) {
+        const std::uint64_t pos = std::uint64_t(off) + done;
+        auto hit_result = file.content->pread(pos, buf + done, n - done);
+        if (!hit_result) {
+            return copy_error(hit_result);
+        }
+        if (*hit_result > 0) {
+            m_read_cached_bytes.add(*hit_result);
+            done += *hit_result;
+            continue;
+        }
+
+        if (!file.backend) {
+            // a short read would be taken as EOF
+            return make_result(FAILED, EIO);
+        }
+
+        // fetch whole blocks, so that they can be marked as cached
+        const std::uint64_t block_size = file.content->block_size();
+        const std::uint64_t fetch_start = pos / block_size * block_size;
+        const std::uint64_t fetch_end = std::min<std::uint64_t>(
+                    (std::uint64_t(off) + n + block_size - 1) / block_size * block_size,
+                    file.size);
+        auto fetch_result = file.content->fetches().fetch(
+                    fetch_start, fetch_end,
+                    blocks_fetcher(file.content, file.backend,
+                                   file.generation, file.size,
+                                   Blocklist::READ));
+        if (!fetch_result) {
+            return copy_error(fetch_result);
+        }
+
+        // the fetch may have been issued by someone else and need not match
+        // our range; it contains pos unless the file has shrunk or it was a
+        // prefetch which gave up early. Try once more in that case.
+        const FetchTable::Fetch &fetch = **fetch_result;
+        if (fetch.offset > pos || fetch.end() <= pos) {
+            if (short_at == pos) {
+                break;
+            }
+            short_at = pos;
+            continue;
+        }
+        std::size_t copy = std::min<std::uint64_t>(fetch.end() - pos, n - done);
+        if (file.content->cached_blocks(Blocklist::WRITTEN) > 0) {
+            // the fetch may span blocks which have been written to; those
+            // are read from the cache in the next round
+            copy = std::min<std::uint64_t>(copy, block_size - pos % block_size);
+        }
+        memcpy(buf + done, fetch.data.data() + (pos - fetch.offset), copy);
+        m_read_fetched_bytes.add(copy);
+        done += copy;
+    }
+    return make_result(done);
+}
+
+void Filesystem::read(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::READ);
+    if (!fi || fi->fh == 0) {
+        req.reply_err(EBADF);
+        return;
+    }
+    if (is_control_file(ino)) {
+        const std::string &snapshot = *reinterpret_cast<const std::string*>(fi->fh);
+        if (off < 0) {
+            req.reply_err(EINVAL);
+            return;
+        }
+        const std::size_t start = std::min<std::uint64_t>(std::uint64_t(off), snapshot.size());
+        req.reply_buf(snapshot.data() + start, std::min(size, snapshot.size() - start));
+        return;
+    }
+    OpenFile &file = *reinterpret_cast<OpenFile*>(fi->fh);
+
+    if (off >= 0 && std::uint64_t(off) < file.size) {
+        const std::size_t n = std::min<std::uint64_t>(size, file.size - off);
+        if (file.backend) {
+            if (auto prefetch = file.readahead->access(off, n)) {
+                start_readahead(file, *prefetch);
+            }
+        }
+
+        // if the whole range is cached, it is passed to libfuse by
+        // descriptor, so that it can be spliced into the device instead of
+        // being copied.
+        const bool replied = file.content->with_cached_range(
+                    off, n,
+                    [&req, off, n](int fd, std::size_t available){
+            if (available < n) {
+                return false;
+            }
+            req.reply_fd(fd, off, n);
+            return true;
+        });
+        if (replied) {
+            m_read_cached_bytes.add(n);
+            file.content->promote(off, n);
+            return;
+        }
+    }
+
+    std::vector<char> buf(size);
+    auto read_result = read_file(file, buf.data(), size, off);
+    if (!read_result) {
+        req.reply_err(read_result.error());
+        return;
+    }
+    file.content->promote(off, *read_result);
+    req.reply_buf(buf.data(), *read_result);
+}
+
+void Filesystem::start_readahead(OpenFile &file, const Readahead::Range &range)
+{
+    auto task = [content = file.content,
+                 backend = file.backend,
+                 readahead = file.readahead,
+                 generation = file.generation,
+                 file_size = file.size.load(),
+                 range]()
+    {
+        // extend the range to whole blocks; partial blocks would not be
+        // marked as cached
+        const std::uint64_t block_size = content->block_size();
+        const std::uint64_t fetch_start = range.offset / block_size * block_size;
+        const std::uint64_t fetch_end = std::min<std::uint64_t>(
+                    (range.offset + range.size + block_size - 1) / block_size * block_size,
+                    file_size);
+
+        const auto fetcher = blocks_fetcher(content, backend, generation,
+                                            file_size, Blocklist::READAHEAD);
+        const auto started = std::chrono::steady_clock::now();
+        // fetches of readers in flight are joined rather than repeated, so
+        // the range may take several fetches
+        std::uint64_t pos = fetch_start;
+        while (pos < fetch_end) {
+            auto fetch_result = content->fetches().fetch(pos, fetch_end, fetcher);
+            if (!fetch_result || (*fetch_result)->end() <= pos) {
+                break;
+            }
+            pos = (*fetch_result)->end();
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - started;
+
+        readahead->completed(
+                    range,
+                    pos > range.offset ? std::min<std::uint64_t>(pos - range.offset, range.size) : 0,
+                    elapsed);
+    };
+
+    if (!m_readahead_pool.try_submit(std::move(task))) {
+        // all prefetchers are busy; give up on this one so that the stream
+        // can try again on the next read
+        file.readahead->completed(range, 0, std::chrono::steady_clock::duration::zero());
+    }
+}
+
+void Filesystem::release(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::RELEASE);
+    if (fi && fi->fh != 0) {
+        if (is_control_file(ino)) {
+            delete reinterpret_cast<std::string*>(fi->fh);
+        } else {
+            delete reinterpret_cast<OpenFile*>(fi->fh);
+        }
+        fi->fh = 0;
+    }
+    req.reply_err(0);
+}
+
+Result<std::unique_ptr<Backend::File>> Filesystem::open_backend_file(ino_t ino, int flags,
+                                                                 mode_t mode)
+{
+    auto txn = m_cache.begin_ro();
+    auto parent_result = txn.parent(ino);
+    if (!parent_result) {
+        return copy_error(parent_result);
+    }
+    if (*parent_result == INVALID_INO) {
+        return make_result(FAILED, ENOENT);
+    }
+    auto name_result = txn.name(*parent_result, ino);
+    if (!name_result) {
+        return copy_error(name_result);
+    }
+    return with_backend_dir(txn, *parent_result, [&](Backend::DirectoryHandle &dir){
+        return dir.open(*name_result, flags, mode);
+    });
+}
+
+Result<void> Filesystem::fill_block(ino_t ino, const std::shared_ptr<RegularFileHandle> &content,
+                                    std::shared_ptr<Backend::File> &backend,
+                                    std::uint64_t block, std::uint64_t size)
+{
+    const std::uint64_t block_size = content->block_size();
+    const std::uint64_t start = block * block_size;
+    char probe;
+    auto hit_result = content->pread(start, &probe, 1);
+    if (!hit_result) {
+        return copy_error(hit_result);
+    }
+    if (*hit_result > 0) {
+        return make_result();
+    }
+
+    if (!backend) {
+        auto open_result = open_backend_file(ino, O_RDONLY, 0);
+        if (!open_result) {
+            // the rest of the block cannot be known
+            return make_result(FAILED, EIO);
+        }
+        backend = std::move(*open_result);
+    }
+    auto fetch_result = content->fetches().fetch(
+                start, std::min(start + block_size, size),
+                blocks_fetcher(content, backend, content->generation(), size,
+                               Blocklist::READ));
+    if (!fetch_result) {
+        return copy_error(fetch_result);
+    }
+
+    hit_result = content->pread(start, &probe, 1);
+    if (!hit_result) {
+        return copy_error(hit_result);
+    }
+    if (*hit_result == 0) {
+        return make_result(FAILED, EIO);
+    }
+    return make_result();
+}
+
+void Filesystem::write(Fuse::Request &&req, fuse_ino_t ino, std::string_view buf, off_t off, fuse_file_info *fi)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::WRITE);
+    if (!fi || fi->fh == 0) {
+        req.reply_err(EBADF);
+        return;
+    }
+    OpenFile &file = *reinterpret_cast<OpenFile*>(fi->fh);
+    if (!file.writable) {
+        req.reply_err(EBADF);
+        return;
+    }
+    if (off < 0) {
+        req.reply_err(EINVAL);
+        return;
+    }
+
+    const std::uint64_t start = std::uint64_t(off);
+    const std::uint64_t end = start + buf.size();
+
+    // the parts of the edge blocks which are not written are kept
+    const std::uint64_t block_size = file.content->block_size();
+    std::shared_ptr<Backend::File> backend = file.backend;
+    const auto fill_edges = [&](std::uint64_t size) -> Result<void> {
+        if ((start % block_size) != 0 && start / block_size * block_size < size) {
+            auto fill_result = fill_block(ino, file.content, backend, start / block_size, size);
+            if (!fill_result) {
+                return copy_error(fill_result);
+            }
+        }
+        if ((end % block_size) != 0 && end < size) {
+            return fill_block(ino, file.content, backend, end / block_size, size);
+        }
+        return make_result();
+    };
+
+    // they are fetched before the file is locked, so that the backend is
+    // not asked while the lock holds up the write-back; with the lock held,
+    // they are only checked again
+    {
+        auto attr_result = m_cache.getattr(ino);
+        if (!attr_result) {
+            req.reply_err(attr_result.error());
+            return;
+        }
+        auto fill_result = fill_edges(attr_result->attr.common.size);
+        if (!fill_result) {
+            req.reply_err(fill_result.error());
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> journal_guard(journal_mutex(ino));
+    auto attr_result = m_cache.getattr(ino);
+    if (!attr_result) {
+        req.reply_err(attr_result.error());
+        return;
+    }
+    InodeAttributes attrs = attr_result->attr;
+    const std::uint64_t old_size = attrs.common.size;
+
+    // the cached contents may still be those of the version the file was
+    // opened with
+    auto valid_result = file.content->validate(attrs.common);
+    if (!valid_result) {
+        req.reply_err(valid_result.error());
+        return;
+    }
+
+    auto fill_result = fill_edges(old_size);
+    if (!fill_result) {
+        req.reply_err(fill_result.error());
+        return;
+    }
+
+    struct timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    attrs.common.mtime = now;
+    attrs.common.ctime = now;
+    if (start > old_size) {
+        // the gap reads as zeroes
+        CommonFileAttributes gap_attrs = attrs.common;
+        gap_attrs.size = start;
+        auto resize_result = file.content->resize(old_size, gap_attrs);
+        if (!resize_result) {
+            req.reply_err(resize_result.error());
+            return;
+        }
+    }
+    attrs.common.size = std::max(old_size, end);
+    auto write_result = file.content->write(off, buf.data(), buf.size(), attrs.common);
+    if (!write_result) {
+        file.content->retag(attr_result->attr.common);
+        req.reply_err(write_result.error());
+        return;
+    }
+
+    auto journal_result = m_cache.write([&](CacheTransactionRW &txn) {
+        if (start > old_size) {
+            txn.journal_resize(ino, start);
+        }
+        txn.journal_write(ino, start, buf.size(), attrs.common.size);
+        return txn.setattr(ino, attrs.common);
+    });
+    if (!journal_result) {
+        // the cached attributes are still the old ones; the contents must
+        // match them, or the changes journaled before are dropped
+        file.content->retag(attr_result->attr.common);
+        req.reply_err(journal_result.error());
+        return;
+    }
+
+    std::uint64_t size = file.size.load();
+    while (size < attrs.common.size &&
+           !file.size.compare_exchange_weak(size, attrs.common.size)) {
+    }
+    req.reply_write(buf.size());
+}
+
+void Filesystem::write_buf(Fuse::Request &&req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                           off_t off, fuse_file_info *fi)
+{
+    // the data may sit in a pipe; it is copied out so that it can be split
+    // into blocks
+    std::string data(fuse_buf_size(bufv), '\0');
+    struct fuse_bufvec dst{};
+    dst.count = 1;
+    dst.buf[0].size = data.size();
+    dst.buf[0].mem = data.data();
+    const ssize_t copied = fuse_buf_copy(&dst, bufv, fuse_buf_copy_flags(0));
+    if (copied < 0) {
+        req.reply_err(int(-copied));
+        return;
+    }
+    data.resize(std::size_t(copied));
+    // the latency is recorded by write()
+    write(std::move(req), ino, data, off, fi);
+}
+
+void Filesystem::setattr(Fuse::Request &&req, fuse_ino_t ino, struct stat &attr, int to_set,
+                         fuse_file_info *fi)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::SETATTR);
+    // the ctime is bumped for any change anyway
+    static constexpr int SUPPORTED = FUSE_SET_ATTR_SIZE |
+            FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+            FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW |
+            FUSE_SET_ATTR_CTIME;
+    if (!m_write_back || (to_set & ~SUPPORTED) != 0) {
+        req.reply_err(EROFS);
+        return;
+    }
+
+    OpenFile *file = fi && fi->fh != 0 ? reinterpret_cast<OpenFile*>(fi->fh) : nullptr;
+    std::shared_ptr<RegularFileHandle> content;
+    std::shared_ptr<Backend::File> backend;
+    if (file) {
+        content = file->content;
+        backend = file->backend;
+    }
+
+    // a partial last block which is extended is kept; like in write(), it
+    // is fetched before the file is locked
+    if ((to_set & FUSE_SET_ATTR_SIZE) && attr.st_size > 0) {
+        auto attr_result = m_cache.getattr(ino);
+        if (!attr_result) {
+            req.reply_err(attr_result.error());
+            return;
+        }
+        const InodeAttributes &attrs = attr_result->attr;
+        if ((attrs.mode & S_IFMT) == S_IFREG && std::uint64_t(attr.st_size) > attrs.common.size) {
+            if (!content) {
+                auto content_result = m_cache.open_file(ino);
+                if (!content_result) {
+                    req.reply_err(content_result.error());
+                    return;
+                }
+                content = std::move(*content_result);
+            }
+            const std::uint64_t block_size = content->block_size();
+            if ((attrs.common.size % block_size) != 0) {
+                auto fill_result = fill_block(ino, content, backend,
+                                              attrs.common.size / block_size,
+                                              attrs.common.size);
+                if (!fill_result) {
+                    req.reply_err(fill_result.error());
+                    return;
+                }
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> journal_guard(journal_mutex(ino));
+    auto txn = m_cache.begin_ro();
+    auto attr_result = txn.getattr(ino);
+    if (!attr_result) {
+        req.reply_err(attr_result.error());
+        return;
+    }
+    const double attr_timeout = timeout_rule(txn, ino).attr_timeout;
+    txn.abort();
+
+    InodeAttributes attrs = attr_result->attr;
+    const bool regular = (attrs.mode & S_IFMT) == S_IFREG;
+    if ((to_set & FUSE_SET_ATTR_SIZE) && !regular) {
+        req.reply_err((attrs.mode & S_IFMT) == S_IFDIR ? EISDIR : EINVAL);
+        return;
+    }
+    if ((to_set & FUSE_SET_ATTR_SIZE) && attr.st_size < 0) {
+        req.reply_err(EINVAL);
+        return;
+    }
+
+    struct timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    const std::uint64_t old_size = attrs.common.size;
+    attrs.common.ctime = now;
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        attrs.common.size = std::uint64_t(attr.st_size);
+        attrs.common.mtime = now;
+    }
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+        attrs.common.atime = now;
+    } else if (to_set & FUSE_SET_ATTR_ATIME) {
+        attrs.common.atime = attr.st_atim;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        attrs.common.mtime = now;
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+        attrs.common.mtime = attr.st_mtim;
+    }
+
+    if (regular) {
+        // the cached contents are bound to the mtime, too
+        if (!content) {
+            auto content_result = m_cache.open_file(ino);
+            if (!content_result) {
+                req.reply_err(content_result.error());
+                return;
+            }
+            content = std::move(*content_result);
+        }
+        auto valid_result = content->validate(attr_result->attr.common);
+        if (!valid_result) {
+            req.reply_err(valid_result.error());
+            return;
+        }
+
+        const std::uint64_t block_size = content->block_size();
+        if (attrs.common.size > old_size && (old_size % block_size) != 0) {
+            auto fill_result = fill_block(ino, content, backend, old_size / block_size, old_size);
+            if (!fill_result) {
+                req.reply_err(fill_result.error());
+                return;
+            }
+        }
+        auto resize_result = content->resize(old_size, attrs.common);
+        if (!resize_result) {
+            req.reply_err(resize_result.error());
+            return;
+        }
+    }
+
+    auto write_result = m_cache.write([&](CacheTransactionRW &txn) {
+        if (attrs.common.size != old_size) {
+            txn.journal_resize(ino, attrs.common.size);
+        }
+        return txn.setattr(ino, attrs.common);
+    });
+    if (!write_result) {
+        if (content) {
+            // see write()
+            content->retag(attr_result->attr.common);
+        }
+        req.reply_err(write_result.error());
+        return;
+    }
+    if (file) {
+        file->size = attrs.common.size;
+    }
+
+    struct stat stbuf = Stat{attrs, ino, m_cache.block_size()};
+    req.reply_attr(stbuf, attr_timeout);
+}
+
+void Filesystem::fsync(Fuse::Request &&req, fuse_ino_t ino, int datasync, fuse_file_info *fi)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::FSYNC);
+    if (!fi || fi->fh == 0) {
+        req.reply_err(EBADF);
+        return;
+    }
+    // written data is safe once it is in the cache; the journal is
+    // committed with each write already
+    OpenFile &file = *reinterpret_cast<OpenFile*>(fi->fh);
+    auto sync_result = file.content->fsync();
+    req.reply_err(sync_result ? 0 : sync_result.error());
+}
+
+void Filesystem::create(Fuse::Request &&req, fuse_ino_t parent, std::string_view name,
+                        mode_t mode, fuse_file_info *fi)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::CREATE);
+    if (!m_write_back) {
+        req.reply_err(EROFS);
+        return;
+    }
+    if ((mode & S_IFMT) != 0 && (mode & S_IFMT) != S_IFREG) {
+        req.reply_err(EINVAL);
+        return;
+    }
+    if (is_control_inode(parent) || is_control_dir(parent, name)) {
+        req.reply_err(EACCES);
+        return;
+    }
+
+    struct fuse_entry_param e{};
+    {
+        auto txn = m_cache.begin_ro();
+        auto parent_attr = txn.getattr(parent);
+        if (!parent_attr) {
+            req.reply_err(parent_attr.error());
+            return;
+        }
+        if ((parent_attr->attr.mode & S_IFMT) != S_IFDIR) {
+            req.reply_err(ENOTDIR);
+            return;
+        }
+        if (txn.lookup(parent, name)) {
+            req.reply_err(EEXIST);
+            return;
+        }
+        // the entry may not have been synced yet; while the backend is away,
+        // the write-back refuses to replace it instead
+        auto stat_result = with_backend_dir(txn, parent, [&name](Backend::DirectoryHandle &dir){
+            return dir.lstat(name);
+        });
+        if (stat_result) {
+            req.reply_err(EEXIST);
+            return;
+        }
+        const TimeoutPolicy::Rule &rule = timeout_rule(txn, parent, name);
+        e.attr_timeout = rule.attr_timeout;
+        e.entry_timeout = rule.entry_timeout;
+    }
+
+    struct timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    const fuse_ctx *ctx = req.ctx();
+    const InodeAttributes attrs{
+        .common = CommonFileAttributes{
+            .size = 0,
+            .nblocks = 0,
+            .uid = ctx ? std::uint32_t(ctx->uid) : std::uint32_t(getuid()),
+            .gid = ctx ? std::uint32_t(ctx->gid) : std::uint32_t(getgid()),
+            .atime = now,
+            .mtime = now,
+            .ctime = now,
+        },
+        .mode = S_IFREG | (mode & 07777),
+    };
+
+    Result<ino_t> ino_result(FAILED, EIO);
+    auto write_result = m_cache.write([&](CacheTransactionRW &txn) -> Result<void> {
+        ino_result = txn.emplace(parent, name, attrs);
+        if (!ino_result) {
+            return copy_error(ino_result);
+        }
+        txn.journal_create(*ino_result);
+        // the lock is handed out to the kernel together with the entry
+        return txn.lock(*ino_result);
+    });
+    if (!write_result) {
+        req.reply_err(write_result.error());
+        return;
+    }
+    const ino_t ino = *ino_result;
+
+    // the file may have been written back in the meantime, which tags the
+    // contents with the backend version; as nothing has been written to it
+    // yet, retagging them here loses nothing
+    std::lock_guard<std::mutex> journal_guard(journal_mutex(ino));
+    auto content_result = m_cache.open_file(ino);
+    if (!content_result) {
+        req.reply_err(content_result.error());
+        return;
+    }
+    auto valid_result = (*content_result)->validate(attrs.common);
+    if (!valid_result) {
+        req.reply_err(valid_result.error());
+        return;
+    }
+
+    const std::uint64_t generation = (*content_result)->generation();
+    std::unique_ptr<OpenFile> file(new OpenFile{
+        std::move(*content_result),
+        nullptr,
+        0,
+        generation,
+        std::make_shared<Readahead>(m_readahead_config, 0),
+        true,
+    });
+    fi->fh = reinterpret_cast<std::uint64_t>(file.release());
+
+    e.ino = ino;
+    e.attr = Stat{attrs, ino, m_cache.block_size()};
+    req.reply_create(&e, fi);
+}
+
+const char *Filesystem::op_name(Op op)
+{
+    switch (op) {
+    case Op::LOOKUP:
+        return "lookup";
+    case Op::FORGET:
+        return "forget";
+    case Op::GETATTR:
+        return "getattr";
+    case Op::READLINK:
+        return "readlink";
+    case Op::OPEN:
+        return "open";
+    case Op::READ:
+        return "read";
+    case Op::RELEASE:
+        return "release";
+    case Op::OPENDIR:
+        return "opendir";
+    case Op::READDIR:
+        return "readdir";
+    case Op::RELEASEDIR:
+        return "releasedir";
+    case Op::SETXATTR:
+        return "setxattr";
+    case Op::SETATTR:
+        return "setattr";
+    case Op::WRITE:
+        return "write";
+    case Op::FSYNC:
+        return "fsync";
+    case Op::CREATE:
+        return "create";
+    case Op::READDIRPLUS:
+        return "readdirplus";
+    case Op::FORGET_MULTI:
+        return "forget_multi";
+    }
+    return "unknown";
+}
+
+void Filesystem::collect_metrics(Metrics::TextWriter &out) const
+{
+    using Type = Metrics::TextWriter::Type;
+    out.family("dragonstash_fuse_request_duration_seconds", Type::HISTOGRAM,
+               "Time from the start of a request until its reply, per handler.");
+    for (std::size_t i = 0; i < OPS; ++i) {
+        out.histogram(std::string("op=\"") + op_name(Op(i)) + "\"", m_op_latency[i]);
+    }
+
+    out.family("dragonstash_lookups_total", Type::COUNTER,
+               "Lookups answered from the cache alone (hit), after the backend "
+               "confirmed the cache (revalidated), or with entries changed or "
+               "missing in the cache (miss).");
+    out.sample("result=\"hit\"", m_lookup_hits.value());
+    out.sample("result=\"revalidated\"", m_lookup_revalidated.value());
+    out.sample("result=\"miss\"", m_lookup_misses.value());
+
+    out.family("dragonstash_read_bytes_total", Type::COUNTER,
+               "Bytes read through the file system, by where they came from.");
+    out.sample("source=\"cache\"", m_read_cached_bytes.value());
+    out.sample("source=\"backend\"", m_read_fetched_bytes.value());
+
+    out.family("dragonstash_opendir_unchanged_total", Type::COUNTER,
+               "Connected opendir calls which found the backend directory "
+               "unchanged and skipped the resync.");
+    out.sample("", m_opendir_unchanged.value());
+
+    out.family("dragonstash_prefetch_total", Type::COUNTER,
+               "Directories and files prefetched through the prefetch "
+               "attribute, by outcome.");
+    out.sample("kind=\"directory\"", m_prefetch_directories.value());
+    out.sample("kind=\"file\"", m_prefetch_files.value());
+    out.sample("kind=\"error\"", m_prefetch_errors.value());
+}
+
+void Filesystem::set_metrics_file(bool enabled)
+{
+    m_metrics_file = enabled;
+}
+
+void Filesystem::set_tracing(std::uint64_t sample_every, Trace::Clock::duration threshold)
+{
+    m_tracer.configure(sample_every, threshold);
+}
+
+Trace::Scope Filesystem::begin_request(Fuse::Request &req, Op op)
+{
+    req.measure(op_latency(op));
+#ifdef DRAGONSTASH_TRACING
+    Trace::Handle trace = m_tracer.begin(op_name(op));
+    req.trace(trace);
+    return Trace::Scope(std::move(trace));
+#else
+    return Trace::Scope();
+#endif
+}
+
+bool Filesystem::has_control_dir() const
+{
+    return m_metrics_file || m_tracer.enabled();
+}
+
+bool Filesystem::is_control_dir(ino_t parent, std::string_view name) const
+{
+    return parent == ROOT_INO && name == CONTROL_DIR_NAME && has_control_dir();
+}
+
+fuse_ino_t Filesystem::control_file(std::string_view name) const
+{
+    if (m_metrics_file && name == METRICS_FILE_NAME) {
+        return METRICS_INO;
+    }
+    if (m_tracer.enabled() && name == TRACE_FILE_NAME) {
+        return TRACE_INO;
+    }
+    return 0;
+}
+
+struct stat Filesystem::control_file_stat(fuse_ino_t ino) const
+{
+    struct stat result{};
+    result.st_ino = ino;
+    if (ino == CONTROL_DIR_INO) {
+        result.st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+        result.st_nlink = 2;
+    } else {
+        result.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        result.st_nlink = 1;
+    }
+    result.st_uid = getuid();
+    result.st_gid = getgid();
+    clock_gettime(CLOCK_REALTIME, &result.st_mtim);
+    result.st_atim = result.st_mtim;
+    result.st_ctim = result.st_mtim;
+    return result;
+}
+
+void Filesystem::open_control_file(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    if (ino == CONTROL_DIR_INO) {
+        req.reply_err(EISDIR);
+        return;
+    }
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        req.reply_err(EACCES);
+        return;
+    }
+    std::string snapshot = ino == METRICS_INO ? m_metrics.render() : m_tracer.chrome_trace();
+    // the size is not known up front; with direct I/O, the kernel reads
+    // until the end of the snapshot regardless of st_size
+    fi->fh = reinterpret_cast<std::uint64_t>(new std::string(std::move(snapshot)));
+    fi->direct_io = 1;
+    fi->keep_cache = 0;
+    req.reply_open(fi);
+}
+
+void Filesystem::read_control_dir(Fuse::Request &req, size_t size, off_t off, bool plus)
+{
+    std::vector<std::pair<std::string_view, fuse_ino_t>> entries{
+        {".", CONTROL_DIR_INO},
+        {"..", ROOT_INO},
+    };
+    for (const std::string_view name: {METRICS_FILE_NAME, TRACE_FILE_NAME}) {
+        if (const fuse_ino_t ino = control_file(name)) {
+            entries.emplace_back(name, ino);
+        }
+    }
+
+    Fuse::DirBuffer buffer(size);
+    Fuse::DirBufferPlus buffer_plus(size);
+    for (std::size_t i = std::size_t(std::max<off_t>(off, 0)); i < entries.size(); ++i) {
+        struct fuse_entry_param e{};
+        e.ino = entries[i].second;
+        if (e.ino == ROOT_INO) {
+            // only the type of ".." is looked at
+            e.attr.st_ino = ROOT_INO;
+            e.attr.st_mode = S_IFDIR;
+        } else {
+            e.attr = control_file_stat(e.ino);
+        }
+        const bool added = plus
+                ? buffer_plus.add(req, entries[i].first, e, off_t(i + 1))
+                : buffer.add(req, entries[i].first, e.attr, off_t(i + 1));
+        if (!added) {
+            break;
+        }
+    }
+
+    const auto buf = plus ? buffer_plus.get() : buffer.get();
+    req.reply_buf(buf.data(), buf.size());
+}
+
+void Filesystem::set_write_back(bool enabled, std::chrono::milliseconds flush_interval)
+{
+    stop_flusher();
+    m_write_back = enabled;
+    m_flush_interval = flush_interval;
+    if (enabled && flush_interval.count() > 0) {
+        m_flusher_stop = false;
+        m_flusher = std::thread(&Filesystem::run_flusher, this);
+    }
+}
+
+void Filesystem::stop_flusher()
+{
+    if (!m_flusher.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_flusher_mutex);
+        m_flusher_stop = true;
+    }
+    m_flusher_wakeup.notify_all();
+    m_flusher.join();
+}
+
+void Filesystem::run_flusher()
+{
+    std::unique_lock<std::mutex> guard(m_flusher_mutex);
+    while (!m_flusher_stop) {
+        // writes are left to pile up for a while, so that they are merged
+        // in the journal; while the backend is away, this fails fast
+        m_flusher_wakeup.wait_for(guard, m_flush_interval, [this]() {
+            return m_flusher_stop;
+        });
+        if (m_flusher_stop) {
+            break;
+        }
+        guard.unlock();
+        (void)write_back();
+        guard.lock();
+    }
+}
+
+Result<std::uint64_t> Filesystem::flush_file(ino_t ino, bool &completed)
+{
+    completed = false;
+    auto txn = m_cache.begin_ro();
+    auto journal_result = txn.journal(ino);
+    if (!journal_result) {
+        completed = journal_result.error() == ENOENT;
+        return completed ? make_result(std::uint64_t(0)) : copy_error(journal_result);
+    }
+    const JournalEntry &journal = *journal_result;
+    auto attr_result = txn.getattr(ino);
+    if (!attr_result) {
+        return copy_error(attr_result);
+    }
+    txn.abort();
+
+    auto content_result = m_cache.open_file(ino);
+    if (!content_result) {
+        return copy_error(content_result);
+    }
+    std::shared_ptr<RegularFileHandle> content = std::move(*content_result);
+
+    // a file which has appeared on the backend since the inode was created
+    // in the cache is not replaced
+    auto open_result = open_backend_file(
+                ino, O_WRONLY | (journal.created ? O_CREAT | O_EXCL : 0),
+                attr_result->attr.mode & 07777);
+    if (!open_result) {
+        return copy_error(open_result);
+    }
+    std::unique_ptr<Backend::File> backend = std::move(*open_result);
+    if (journal.created) {
+        // later write-backs must open the file this one created
+        auto created_result = m_cache.write([ino](CacheTransactionRW &txn) {
+            txn.journal_backend_created(ino);
+            return make_result();
+        });
+        if (!created_result) {
+            (void)backend->close();
+            return copy_error(created_result);
+        }
+    }
+
+    auto upload = [&]() -> Result<std::uint64_t> {
+        if (journal.created || journal.resized) {
+            auto truncate_result = backend->ftruncate(off_t(journal.size));
+            if (!truncate_result) {
+                return copy_error(truncate_result);
+            }
+        }
+
+        std::vector<char> buf(FLUSH_STEP);
+        std::uint64_t written = 0;
+        for (const JournalEntry::Extent &extent: journal.extents) {
+            const std::uint64_t end = extent.offset + extent.length;
+            std::uint64_t pos = extent.offset;
+            while (pos < end) {
+                const std::size_t n = std::min<std::uint64_t>(buf.size(), end - pos);
+                auto read_result = content->pread(pos, buf.data(), n);
+                if (!read_result) {
+                    return copy_error(read_result);
+                }
+                if (*read_result == 0) {
+                    // WRITTEN blocks are never evicted
+                    return make_result(FAILED, EIO);
+                }
+                std::size_t done = 0;
+                while (done < *read_result) {
+                    auto write_result = backend->pwrite(buf.data() + done,
+                                                        *read_result - done,
+                                                        off_t(pos + done));
+                    if (!write_result) {
+                        return copy_error(write_result);
+                    }
+                    if (*write_result <= 0) {
+                        return make_result(FAILED, EIO);
+                    }
+                    done += std::size_t(*write_result);
+                }
+                pos += done;
+                written += done;
+            }
+        }
+
+        auto fsync_result = backend->fsync();
+        if (!fsync_result && fsync_result.error() != EOPNOTSUPP &&
+                fsync_result.error() != ENOSYS) {
+            return copy_error(fsync_result);
+        }
+        return make_result(written);
+    };
+    auto upload_result = upload();
+    auto stat_result = upload_result ? backend->fstat() : Result<Backend::Stat>(FAILED, EIO);
+    auto close_result = backend->close();
+    if (!upload_result) {
+        return copy_error(upload_result);
+    }
+    if (!stat_result) {
+        return copy_error(stat_result);
+    }
+    if (!close_result) {
+        return copy_error(close_result);
+    }
+    const InodeAttributes backend_attrs = InodeAttributes::from_backend_stat(*stat_result);
+
+    // the backend version is what the cache describes from now on, unless
+    // the file has changed again in the meantime
+    std::lock_guard<std::mutex> journal_guard(journal_mutex(ino));
+    auto write_result = m_cache.write([&](CacheTransactionRW &txn) -> Result<void> {
+        if (!txn.complete_journal(ino, journal.generation)) {
+            return make_result();
+        }
+        completed = true;
+        return txn.setattr(ino, backend_attrs.common);
+    });
+    if (!write_result) {
+        completed = false;
+        return copy_error(write_result);
+    }
+    if (completed) {
+        (void)content->settle(backend_attrs.common);
+        // the data is the same, only the times have changed
+        notify({Invalidation{ino, std::string(), false}});
+    }
+    return upload_result;
+}
+
+Filesystem::FlushStats Filesystem::write_back()
+{
+    std::lock_guard<std::mutex> flush_guard(m_flush_mutex);
+    const std::vector<ino_t> inos = m_cache.begin_ro().journaled_inodes();
+
+    FlushStats stats{};
+    std::mutex mutex;
+    {
+        TaskGroup group(m_backend_pool);
+        for (const ino_t ino: inos) {
+            group.submit([this, ino, &mutex, &stats]() {
+                bool completed = false;
+                auto result = flush_file(ino, completed);
+                std::lock_guard<std::mutex> guard(mutex);
+                if (!result) {
+                    if (stats.failed++ == 0) {
+                        stats.error = result.error();
+                    }
+                    return;
+                }
+                stats.bytes += *result;
+                if (completed) {
+                    ++stats.files;
+                } else {
+                    ++stats.deferred;
+                }
+            });
+        }
+        group.wait();
+    }
+    return stats;
+}
+
+/**
+ * @brief Whether a stamp is old enough to tell later changes apart from the
+ * state it was taken in.
+ */
+static bool settled(const DirSyncStamp &stamp)
+{
+    const auto limit = std::chrono::system_clock::to_time_t(
+                std::chrono::system_clock::now() - DIR_STAMP_SETTLE_TIME);
+    return stamp.mtime.tv_sec < limit && stamp.ctime.tv_sec < limit;
+}
+
+bool Filesystem::dir_unchanged(ino_t ino, const std::string &backend_path,
+                               std::optional<DirSyncStamp> &stamp)
+{
+    if (!m_dir_change_detection) {
+        return false;
+    }
+    auto stat_result = m_backend_fs.lstat(backend_path);
+    if (!stat_result || !S_ISDIR(stat_result->mode)) {
+        // let the listing find out what is going on
+        return false;
+    }
+    stamp = DirSyncStamp::from_backend_stat(*stat_result);
+
+    auto txn = m_cache.begin_ro();
+    auto cached = txn.dir_sync_stamp(ino);
+    return cached && *cached == *stamp;
+}
+
+Result<void> Filesystem::sync_dir(ino_t ino, const std::string &backend_path,
+                                  Backend::Dir &dir,
+                                  std::vector<Invalidation> &invalidations,
+                                  const std::optional<DirSyncStamp> &stamp)
+{
+    struct PendingEntry {
+        std::string name;
+        std::optional<InodeAttributes> attr;
+    };
+
+    // std::deque keeps the entries in place while workers fill them in
+    std::deque<PendingEntry> entries;
+    {
+        TaskGroup stats(m_backend_pool);
+        while (auto entry = dir.readdir()) {
+            if (entry->name == "." || entry->name == ".." || is_control_dir(ino, entry->name)) {
+                continue;
+            }
+
+            if (entry->complete) {
+                // the backend delivered the attributes with the listing
+                const auto attr = InodeAttributes::from_backend_stat(*entry);
+                entries.emplace_back(PendingEntry{std::move(entry->name), attr});
+                continue;
+            }
+
+            PendingEntry &pending = entries.emplace_back(
+                        PendingEntry{std::move(entry->name), std::nullopt});
+            stats.submit([this, &backend_path, &dir, &pending]() {
+                auto stat_result = dir.lstat_entry(pending.name);
+                if (!stat_result && stat_result.error() == ENOSYS) {
+                    std::string entry_path(backend_path);
+                    entry_path.reserve(entry_path.size() + pending.name.size() + 1);
+                    if (entry_path.size() > 1) {
+                        // need to add a slash to the end
+                        entry_path += '/';
+                    }
+                    entry_path += pending.name;
+                    stat_result = m_backend_fs.lstat(entry_path);
+                }
+                if (stat_result) {
+                    pending.attr = InodeAttributes::from_backend_stat(*stat_result);
+                }
+            });
+        }
+        stats.wait();
+    }
+
+    // entries without attributes are dropped by the rewrite
+    std::vector<DirRewriteEntry> listing;
+    listing.reserve(entries.size());
+    for (auto &pending: entries) {
+        if (pending.attr) {
+            listing.push_back(DirRewriteEntry{std::move(pending.name), *pending.attr});
+        }
     }
-    std::string_view backend_path;
 
-    if (path_result->empty()) {
-        backend_path = "/";
-    } else {
-        backend_path = *path_result;
+    const bool track_changes = bool(m_notifier);
+    const bool track_negatives = m_negative_timeout > 0;
+    std::optional<DirSyncStamp> new_stamp;
+    if (stamp && settled(*stamp)) {
+        new_stamp = stamp;
     }
+    return m_cache.write([ino, &listing, &invalidations, &new_stamp, track_changes, track_negatives](CacheTransactionRW &txn) -> Result<void> {
+        // the directory may have vanished while we were talking to the
+        // backend
+        auto dir_attr = txn.getattr(ino);
+        if (!dir_attr) {
+            return copy_error(dir_attr);
+        }
 
-    auto link = m_backend_fs.readlink(backend_path);
-    if (link) {
-        (void)txn.writelink(ino, *link);
-        (void)txn.commit();
-    } else if (Backend::is_not_connected(link)) {
-        // return from cache
-        link = txn.readlink(ino);
-        if (!link) {
-            req.reply_err(link.error());
-            return;
+        DirRewriteObserver observer;
+        if (track_changes) {
+            const auto now = std::chrono::system_clock::now();
+            observer = [&txn, &invalidations, ino, track_negatives, now](
+                    DirRewriteChange change, std::string_view name,
+                    ino_t entry_ino, const InodeAttributes *attr) {
+                switch (change) {
+                case DirRewriteChange::ADDED: {
+                    // the kernel may still hold negative dentries we handed
+                    // out for names which have appeared since
+                    if (!track_negatives) {
+                        break;
+                    }
+                    auto negative_result = txn.lookup_negative(ino, name);
+                    if (negative_result && *negative_result > now) {
+                        invalidations.push_back(Invalidation{ino, std::string(name), false});
+                    }
+                    break;
+                }
+                case DirRewriteChange::CHANGED:
+                    invalidations.push_back(Invalidation{entry_ino, std::string(), S_ISREG(attr->mode)});
+                    break;
+                case DirRewriteChange::REPLACED:
+                case DirRewriteChange::REMOVED:
+                    // the name now refers to a different inode or none
+                    invalidations.push_back(Invalidation{ino, std::string(name), false});
+                    break;
+                }
+            };
         }
-    } else {
-        // how to deal with errors here? unlinking is a safe way forward
-        (void)txn.unlink(ino);
-        (void)txn.commit();
-        req.reply_err(link.error());
-        return;
-    }
 
-    req.reply_readlink(link->c_str());
+        auto rewrite_result = txn.rewrite_dir(ino, listing, observer);
+        if (!rewrite_result) {
+            return copy_error(rewrite_result);
+        }
+        (void)txn.update_flags(ino, {InodeFlag::SYNCED});
+        (void)txn.set_dir_sync_stamp(ino, new_stamp);
+        return make_result();
+    });
 }
 
 void Filesystem::opendir(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi)
 {
-    auto txn = m_cache.begin_rw();
-    auto path_result = txn.path(ino);
-    if (!path_result) {
-        req.reply_err(path_result.error());
+    const Trace::Scope trace_scope = begin_request(req, Op::OPENDIR);
+    if (ino == CONTROL_DIR_INO) {
+        // listed from scratch by each readdir
+        fi->fh = 0;
+        req.reply_open(fi);
         return;
     }
-    std::string_view backend_path;
+    std::string dir_path;
+    std::string backend_path;
+    std::shared_ptr<const PinPolicy> pins;
+    {
+        auto txn = m_cache.begin_ro();
+        auto path_result = txn.path(ino);
+        if (!path_result) {
+            req.reply_err(path_result.error());
+            return;
+        }
+        pins = pin_policy(txn);
+        txn.abort();
 
-    if (path_result->empty()) {
-        backend_path = "/";
-    } else {
-        backend_path = *path_result;
+        dir_path = std::move(*path_result);
+        backend_path = dir_path.empty() ? std::string("/") : dir_path;
     }
 
-    auto dir = m_backend_fs.opendir(backend_path);
+    // opendir re-syncs the directory anyway, so this is a good time to
+    // refresh the handle: a table entry may refer to a directory which has
+    // been replaced on the backend since. A replaced directory has a
+    // different stamp, so an unchanged one can keep its handle.
+    std::vector<Invalidation> invalidations;
+    std::optional<DirSyncStamp> stamp;
+    Result<std::unique_ptr<Backend::Dir>> dir = make_result(FAILED, ENOTCONN);
+    if (dir_unchanged(ino, backend_path, stamp)) {
+        m_opendir_unchanged.add();
+        // the directory at the path is the one which was synced, but the
+        // handle may still follow one which has been renamed away since
+        if (auto handle = m_backend_dirs.get(ino)) {
+            (void)revalidate_backend_dir(ino, std::move(handle));
+        }
+    } else {
+        auto handle_result = m_backend_fs.open_directory(backend_path);
+        if (handle_result) {
+            Backend::HandleTable::HandlePtr handle(std::move(*handle_result));
+            dir = handle->opendir();
+            if (dir) {
+                m_backend_dirs.put(ino, std::move(handle));
+            } else {
+                m_backend_dirs.invalidate(ino);
+            }
+        } else {
+            m_backend_dirs.invalidate(ino);
+            dir = copy_error(handle_result);
+        }
+    }
     if (!dir && dir.error() != ENOTCONN) {
         req.reply_err(dir.error());
         return;
@@ -218,53 +2199,105 @@ void Filesystem::opendir(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi
     if (dir) {
         // if upstream is available, we can sync here; otherwise we go with what
         // we have cached.
-        (void)txn.start_dir_rewrite(ino);
-        while (auto entry = (*dir)->readdir()) {
-            std::string entry_path(backend_path);
-            entry_path.reserve(entry_path.size() + entry->name.size() + 1);
-            if (entry_path.size() > 1) {
-                // need to add a slash to the end
-                entry_path += '/';
-            }
-            entry_path += entry->name;
-            auto stat_result = m_backend_fs.lstat(entry_path);
-            if (!stat_result) {
-                continue;
-            }
-            const auto info = InodeAttributes::from_backend_stat(*stat_result);
-            (void)txn.emplace(ino, entry->name, info);
+        auto sync_result = sync_dir(ino, backend_path, **dir, invalidations, stamp);
+        if (!sync_result) {
+            req.reply_err(sync_result.error() == ENOENT ? ENOENT : EIO);
+            return;
         }
-        (void)txn.update_flags(ino, {InodeFlag::SYNCED});
-        (void)txn.finish_dir_rewrite();
     }
 
-    fi->fh = 0;
-    fi->cache_readdir = 1;
-    if (!txn.commit()) {
-        req.reply_err(EIO);
+    // the stream only reads on readdir, from the state after the sync
+    auto dir_result = m_cache.opendir(ino);
+    if (!dir_result) {
+        req.reply_err(dir_result.error());
         return;
     }
 
+    fi->fh = reinterpret_cast<std::uint64_t>(dir_result->release());
+    fi->cache_readdir = 1;
     req.reply_open(fi);
+
+    notify(std::move(invalidations));
+    pin_dir(*pins, ino, dir_path);
+}
+
+/**
+ * @brief Obtain the directory stream for a readdir request.
+ *
+ * Uses the stream created by opendir if there is one; otherwise, a temporary
+ * stream is opened and stored in @a temporary.
+ */
+static Result<CachedDir*> get_dir_stream(Cache &cache,
+                                         ino_t ino,
+                                         fuse_file_info *fi,
+                                         std::unique_ptr<CachedDir> &temporary)
+{
+    if (fi && fi->fh != 0) {
+        return reinterpret_cast<CachedDir*>(fi->fh);
+    }
+
+    auto open_result = cache.opendir(ino);
+    if (!open_result) {
+        return copy_error(open_result);
+    }
+    temporary = std::move(*open_result);
+    return temporary.get();
 }
 
+/**
+ * @brief Ends the batch of a directory stream when a request is done with
+ * it, so that open directories hold no transaction between requests.
+ */
+class DirBatch {
+public:
+    explicit DirBatch(CachedDir &dir):
+        m_dir(dir)
+    {
+    }
+    DirBatch(const DirBatch &src) = delete;
+    DirBatch &operator=(const DirBatch &src) = delete;
+    ~DirBatch()
+    {
+        m_dir.release();
+    }
+
+private:
+    CachedDir &m_dir;
+};
+
 void Filesystem::readdir(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
 {
-    Fuse::DirBuffer buffer;
+    const Trace::Scope trace_scope = begin_request(req, Op::READDIR);
+    if (ino == CONTROL_DIR_INO) {
+        read_control_dir(req, size, off, false);
+        return;
+    }
+    std::unique_ptr<CachedDir> temporary_dir;
+    auto dir_result = get_dir_stream(m_cache, ino, fi, temporary_dir);
+    if (!dir_result) {
+        req.reply_err(dir_result.error());
+        return;
+    }
+    CachedDir &dir = **dir_result;
+    const DirBatch batch(dir);
+    CacheTransactionRO &txn = dir.transaction();
+
+    Fuse::DirBuffer buffer(size);
     int error = 0;
     off_t cursor = off;
-    std::size_t to_send = 0;
     bool at_eof = false;
-    auto txn = m_cache.begin_ro();
-    while (buffer.length() < size) {
-        to_send = buffer.length();
-
-        auto readdir_result = txn.readdir(ino, cursor);
+    while (true) {
+        auto readdir_result = dir.readdir(cursor);
         if (!readdir_result) {
             error = readdir_result.error();
             at_eof = error == 0;
             break;
         }
+        if (is_control_dir(ino, readdir_result->name)) {
+            // synced before the control directory was enabled
+            cursor = readdir_result->ino;
+            continue;
+        }
 
         struct stat buf{};
         if (!readdir_result->complete) {
@@ -278,12 +2311,16 @@ void Filesystem::readdir(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t
             buf = *readdir_result;
         }
 
+        if (!buffer.add(req, readdir_result->name, buf, readdir_result->ino)) {
+            // does not fit anymore; the kernel will ask for it again
+            break;
+        }
         cursor = readdir_result->ino;
-        buffer.add(req, readdir_result->name.c_str(), buf, readdir_result->ino);
     }
 
     if (error != 0) {
         req.reply_err(error);
+        return;
     }
 
     if (at_eof && buffer.length() == 0) {
@@ -296,35 +2333,83 @@ void Filesystem::readdir(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t
         }
     }
 
-    auto buf = buffer.get();
-    req.reply_buf(buf.data(), to_send);
+    const auto buf = buffer.get();
+    req.reply_buf(buf.data(), buf.size());
 }
 
 void Filesystem::releasedir(Fuse::Request &&req, fuse_ino_t ino, fuse_file_info *fi)
 {
-    req.reply_none();
+    const Trace::Scope trace_scope = begin_request(req, Op::RELEASEDIR);
+    if (fi && fi->fh != 0) {
+        delete reinterpret_cast<CachedDir*>(fi->fh);
+        fi->fh = 0;
+    }
+    req.reply_err(0);
 }
 
 void Filesystem::readdirplus(Fuse::Request &&req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
 {
-    Fuse::DirBufferPlus buffer;
+    const Trace::Scope trace_scope = begin_request(req, Op::READDIRPLUS);
+    if (ino == CONTROL_DIR_INO) {
+        read_control_dir(req, size, off, true);
+        return;
+    }
+    std::unique_ptr<CachedDir> temporary_dir;
+    auto dir_result = get_dir_stream(m_cache, ino, fi, temporary_dir);
+    if (!dir_result) {
+        req.reply_err(dir_result.error());
+        return;
+    }
+    CachedDir &dir = **dir_result;
+    const DirBatch batch(dir);
+    CacheTransactionRO &txn = dir.transaction();
+
+    // The locks handed out with the entries are taken in a separate, short
+    // lived transaction: locking holds the in-memory lock until the
+    // transaction completes, which the long-lived stream transaction never
+    // does.
+    auto lock_txn = m_cache.begin_ro();
+
+    // subtree rules are matched against the path of each entry
+    std::string entry_path;
+    std::size_t dir_path_length = 0;
+    if (m_timeouts.has_subtrees()) {
+        auto path_result = txn.path(ino);
+        if (path_result) {
+            entry_path = std::move(*path_result);
+        }
+        dir_path_length = entry_path.size();
+    }
+    const TimeoutPolicy::Rule &dir_rule = m_timeouts.rule_for(entry_path);
+
+    Fuse::DirBufferPlus buffer(size);
     int error = 0;
     off_t cursor = off;
-    std::size_t to_send = 0;
-    auto txn = m_cache.begin_ro();
-    while (buffer.length() < size) {
-        to_send = buffer.length();
-
-        auto readdir_result = txn.readdir(ino, cursor);
+    while (true) {
+        auto readdir_result = dir.readdir(cursor);
         if (!readdir_result) {
             error = readdir_result.error();
             break;
         }
+        if (is_control_dir(ino, readdir_result->name)) {
+            // see readdir()
+            cursor = readdir_result->ino;
+            continue;
+        }
+
+        const TimeoutPolicy::Rule *rule = &dir_rule;
+        if (m_timeouts.has_subtrees() &&
+                readdir_result->name != "." && readdir_result->name != "..") {
+            entry_path.resize(dir_path_length);
+            entry_path.push_back('/');
+            entry_path.append(readdir_result->name);
+            rule = &m_timeouts.rule_for(entry_path);
+        }
 
         struct fuse_entry_param e{};
         e.ino = readdir_result->ino;
-        e.attr_timeout = 1.0;
-        e.entry_timeout = 1.0;
+        e.attr_timeout = rule->attr_timeout;
+        e.entry_timeout = rule->entry_timeout;
 
         if (!readdir_result->complete) {
             auto stat_result = txn.getattr(readdir_result->ino);
@@ -337,17 +2422,23 @@ void Filesystem::readdirplus(Fuse::Request &&req, fuse_ino_t ino, size_t size, o
             e.attr = *readdir_result;
         }
 
-        buffer.add(req, readdir_result->name.c_str(), e, readdir_result->ino);
+        const std::size_t prev_length = buffer.length();
+        if (!buffer.add(req, readdir_result->name, e, readdir_result->ino)) {
+            // does not fit anymore; the kernel will ask for it again, so it
+            // must not be locked either
+            break;
+        }
         cursor = readdir_result->ino;
 
         if (readdir_result->name != "." && readdir_result->name != "..") {
-            auto lock_result = txn.lock(readdir_result->ino);
+            auto lock_result = lock_txn.lock(readdir_result->ino);
             if (!lock_result) {
                 if (lock_result.error() == ESTALE) {
                     // inode has been deleted in the future -> skip this entry
-                    buffer.rewind(to_send);
+                    buffer.rewind(prev_length);
                     continue;
                 }
+                lock_txn.abort();
                 req.reply_err(EIO);
                 return;
             }
@@ -355,12 +2446,13 @@ void Filesystem::readdirplus(Fuse::Request &&req, fuse_ino_t ino, size_t size, o
     }
 
     if (error != 0) {
+        lock_txn.abort();
         req.reply_err(error);
         return;
     }
 
-    auto buf = buffer.get();
-    if (!txn.commit()) {
+    const auto buf = buffer.get();
+    if (!lock_txn.commit()) {
         // if the commit fails, we cannot hand out any locks -> we have to
         // return an error ... Question is if we may want to return ENOSYS
         // instead which would make things possibly fall back to readdir.
@@ -368,17 +2460,504 @@ void Filesystem::readdirplus(Fuse::Request &&req, fuse_ino_t ino, size_t size, o
         return;
     }
 
-    req.reply_buf(buf.data(), to_send);
+    req.reply_buf(buf.data(), buf.size());
 }
 
 void Filesystem::forget_multi(Fuse::Request &&req, size_t count, fuse_forget_data *forgets)
 {
-    auto txn = m_cache.begin_ro();
+    const Trace::Scope trace_scope = begin_request(req, Op::FORGET_MULTI);
+    {
+        std::lock_guard<std::mutex> guard(m_validated_mutex);
+        for (std::size_t i = 0; i < count; ++i) {
+            m_validated.erase(forgets[i].ino);
+        }
+    }
+
+    std::vector<InodeReferences::Release> releases;
+    releases.reserve(count);
     for (std::size_t i = 0; i < count; ++i) {
-        (void)txn.release(forgets[i].ino, forgets[i].nlookup);
+        // control files hold no references
+        if (forgets[i].nlookup > 0 && !is_control_inode(forgets[i].ino)) {
+            releases.push_back(InodeReferences::Release{forgets[i].ino, forgets[i].nlookup});
+        }
+    }
+
+    std::vector<ino_t> reapable;
+    {
+        auto txn = m_cache.begin_ro();
+        auto release_result = txn.release_many(releases, &reapable);
+        if (!release_result) {
+            req.reply_err(release_result.error());
+            return;
+        }
+        (void)txn.commit();
     }
-    (void)txn.commit();
     req.reply_none();
+
+    if (!reapable.empty()) {
+        // only the orphans which just lost their last reference need a visit
+        (void)m_cache.write([&reapable](CacheTransactionRW &txn){
+            txn.reap_released(reapable);
+            return make_result();
+        });
+    }
+}
+
+Result<void> Filesystem::prefetch_dir(ino_t ino, const std::string &backend_path)
+{
+    std::optional<DirSyncStamp> stamp;
+    if (dir_unchanged(ino, backend_path, stamp)) {
+        // see opendir()
+        if (auto handle = m_backend_dirs.get(ino)) {
+            (void)revalidate_backend_dir(ino, std::move(handle));
+        }
+        return make_result();
+    }
+
+    auto handle_result = m_backend_fs.open_directory(backend_path);
+    if (!handle_result) {
+        return copy_error(handle_result);
+    }
+    Backend::HandleTable::HandlePtr handle(std::move(*handle_result));
+    auto dir = handle->opendir();
+    if (!dir) {
+        m_backend_dirs.invalidate(ino);
+        return copy_error(dir);
+    }
+    m_backend_dirs.put(ino, std::move(handle));
+
+    std::vector<Invalidation> invalidations;
+    auto sync_result = sync_dir(ino, backend_path, **dir, invalidations, stamp);
+    if (!sync_result) {
+        return sync_result;
+    }
+    notify(std::move(invalidations));
+    return make_result();
+}
+
+Result<std::uint64_t> Filesystem::pull_file(ino_t ino, const std::string &backend_path)
+{
+    auto open_result = m_backend_fs.open(backend_path, O_RDONLY, 0);
+    if (!open_result) {
+        return copy_error(open_result);
+    }
+    std::shared_ptr<Backend::File> backend(std::move(*open_result));
+    auto stat_result = backend->fstat();
+    if (!stat_result) {
+        return copy_error(stat_result);
+    }
+    const InodeAttributes attrs = InodeAttributes::from_backend_stat(*stat_result);
+    if ((attrs.mode & S_IFMT) != S_IFREG) {
+        return make_result(FAILED, EIO);
+    }
+
+    auto content_result = m_cache.open_file(ino);
+    if (!content_result) {
+        return copy_error(content_result);
+    }
+    std::shared_ptr<RegularFileHandle> content = std::move(*content_result);
+    {
+        std::unique_lock<std::mutex> journal_guard(journal_mutex(ino), std::defer_lock);
+        if (m_write_back) {
+            journal_guard.lock();
+        }
+        if (m_cache.begin_ro().journaled(ino)) {
+            // the cached contents are newer than the backend's
+            return make_result(std::uint64_t(0));
+        }
+        auto valid_result = content->validate(attrs.common);
+        if (!valid_result) {
+            return copy_error(valid_result);
+        }
+    }
+
+    const std::uint64_t size = attrs.common.size;
+    const std::uint64_t block_size = content->block_size();
+    if (content->cached_blocks(Blocklist::PINNED) >= (size + block_size - 1) / block_size) {
+        return make_result(std::uint64_t(0));
+    }
+
+    // whole blocks, so that all of them get marked
+    const std::uint64_t step = std::max<std::uint64_t>(
+                PREFETCH_STEP / block_size * block_size, block_size);
+    const std::uint64_t generation = content->generation();
+    const auto fetcher = blocks_fetcher(content, backend, generation, size,
+                                        Blocklist::PINNED);
+    std::vector<char> buf;
+    std::uint64_t downloaded = 0;
+    for (std::uint64_t pos = 0; pos < size; pos += step) {
+        const std::uint64_t end = std::min(pos + step, size);
+        const std::size_t n = end - pos;
+
+        buf.resize(n);
+        auto hit_result = content->pread(pos, buf.data(), n);
+        if (hit_result && *hit_result == n) {
+            auto store_result = content->store(generation, pos, buf.data(), n,
+                                               end == size, Blocklist::PINNED);
+            if (!store_result) {
+                return copy_error(store_result);
+            }
+            continue;
+        }
+
+        // a fetch of a reader in flight may be joined; its blocks stay READ
+        std::uint64_t at = pos;
+        while (at < end) {
+            auto fetch_result = content->fetches().fetch(at, end, fetcher);
+            if (!fetch_result) {
+                return copy_error(fetch_result);
+            }
+            if ((*fetch_result)->end() <= at) {
+                // the file has shrunk on the backend
+                return make_result(downloaded);
+            }
+            downloaded += (*fetch_result)->end() - at;
+            at = (*fetch_result)->end();
+        }
+    }
+    return make_result(downloaded);
+}
+
+std::shared_ptr<const PinPolicy> Filesystem::pin_policy(CacheTransactionRO &txn)
+{
+    const std::uint64_t generation = txn.pin_generation();
+    {
+        std::shared_lock<std::shared_mutex> guard(m_pin_policy_mutex);
+        if (generation == m_pin_generation) {
+            return m_pin_policy;
+        }
+    }
+
+    std::vector<PinRule> active;
+    std::vector<PinRule> retired;
+    for (PinRule &rule: txn.pin_rules()) {
+        (rule.retired ? retired : active).emplace_back(std::move(rule));
+    }
+
+    std::shared_ptr<const PinPolicy> policy;
+    {
+        std::unique_lock<std::shared_mutex> guard(m_pin_policy_mutex);
+        if (generation == m_pin_generation) {
+            // someone else was faster
+            return m_pin_policy;
+        }
+        m_pin_policy = std::make_shared<const PinPolicy>(std::move(active));
+        m_pin_generation = generation;
+        policy = m_pin_policy;
+    }
+
+    if (!retired.empty()) {
+        m_pin_tasks.submit([this, policy, retired = PinPolicy(std::move(retired))]() {
+            (void)m_cache.unpin(retired, *policy);
+            std::vector<std::uint64_t> ids;
+            for (const PinRule &rule: retired.rules()) {
+                ids.push_back(rule.id);
+            }
+            (void)m_cache.write([&ids](CacheTransactionRW &txn) {
+                txn.purge_pin_rules(ids);
+                return make_result();
+            });
+        });
+    }
+    return policy;
+}
+
+void Filesystem::schedule_pin(ino_t ino, std::string &&path, std::uint64_t size)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_pins_mutex);
+        if (!m_pins_in_flight.insert(ino).second) {
+            return;
+        }
+    }
+
+    m_pin_tasks.submit([this, ino, path = std::move(path), size]() {
+        // pull_file() checks the same, but only after asking the backend
+        bool complete = false;
+        auto content_result = m_cache.open_file(ino);
+        if (content_result) {
+            const std::uint64_t block_size = (*content_result)->block_size();
+            const std::uint64_t nblocks = (size + block_size - 1) / block_size;
+            complete = (*content_result)->cached_blocks(Blocklist::PINNED) == nblocks &&
+                    (*content_result)->cached_blocks() == nblocks;
+        }
+        if (!complete) {
+            (void)pull_file(ino, path);
+        }
+
+        std::lock_guard<std::mutex> guard(m_pins_mutex);
+        m_pins_in_flight.erase(ino);
+    });
+}
+
+void Filesystem::pin_entry(const PinPolicy &policy, ino_t parent, std::string_view name,
+                           const fuse_entry_param &e)
+{
+    if (policy.empty() || e.ino == 0 || !S_ISREG(e.attr.st_mode)) {
+        return;
+    }
+
+    auto path_result = m_cache.begin_ro().path(parent);
+    if (!path_result) {
+        return;
+    }
+    std::string path = std::move(*path_result);
+    path += '/';
+    path += name;
+    if (!policy.matches(path, std::uint64_t(e.attr.st_size))) {
+        return;
+    }
+    schedule_pin(e.ino, std::move(path), std::uint64_t(e.attr.st_size));
+}
+
+void Filesystem::pin_dir(const PinPolicy &policy, ino_t dir, const std::string &dir_path)
+{
+    if (policy.empty() || !policy.may_match_in(dir_path)) {
+        return;
+    }
+
+    struct Match {
+        ino_t ino;
+        std::string path;
+        std::uint64_t size;
+    };
+    std::vector<Match> matches;
+    {
+        auto txn = m_cache.begin_ro();
+        ino_t cursor = 0;
+        while (true) {
+            auto entry = txn.readdir(dir, cursor);
+            if (!entry) {
+                break;
+            }
+            cursor = entry->ino;
+            if (entry->name == "." || entry->name == "..") {
+                continue;
+            }
+            InodeAttributes attr = entry->attr;
+            if (!entry->complete) {
+                auto attr_result = txn.getattr(entry->ino);
+                if (!attr_result) {
+                    continue;
+                }
+                attr = attr_result->attr;
+            }
+            if (!S_ISREG(attr.mode)) {
+                continue;
+            }
+            std::string path(dir_path);
+            path += '/';
+            path += entry->name;
+            if (policy.matches(path, attr.common.size)) {
+                matches.emplace_back(Match{entry->ino, std::move(path), attr.common.size});
+            }
+        }
+    }
+
+    for (Match &match: matches) {
+        schedule_pin(match.ino, std::move(match.path), match.size);
+    }
+}
+
+void Filesystem::wait_pinned()
+{
+    m_pin_tasks.wait();
+}
+
+void Filesystem::wait_prefetched()
+{
+    m_prefetch_tasks.wait();
+}
+
+Result<PrefetchStats> Filesystem::prefetch(std::string_view path,
+                                           const PrefetchOptions &options)
+{
+    ino_t start = ROOT_INO;
+    std::string start_path("/");
+    while (!path.empty()) {
+        const auto slash = path.find('/');
+        const std::string_view name = path.substr(0, slash);
+        path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+        if (name.empty() || name == ".") {
+            continue;
+        }
+        if (name == "..") {
+            return make_result(FAILED, EINVAL);
+        }
+
+        auto lookup_result = m_cache.begin_ro().lookup(start, name);
+        if (!lookup_result && lookup_result.error() == ENOENT) {
+            auto sync_result = prefetch_dir(start, start_path);
+            if (!sync_result && !Backend::is_not_connected(sync_result)) {
+                return copy_error(sync_result);
+            }
+            lookup_result = m_cache.begin_ro().lookup(start, name);
+        }
+        if (!lookup_result) {
+            return copy_error(lookup_result);
+        }
+        start = *lookup_result;
+        if (start_path.size() > 1) {
+            start_path += '/';
+        }
+        start_path += name;
+    }
+
+    {
+        auto attr_result = m_cache.begin_ro().getattr(start);
+        if (!attr_result) {
+            return copy_error(attr_result);
+        }
+        if ((attr_result->attr.mode & S_IFMT) != S_IFDIR) {
+            return make_result(FAILED, ENOTDIR);
+        }
+    }
+
+    auto sync_result = prefetch_dir(start, start_path);
+    if (!sync_result) {
+        return copy_error(sync_result);
+    }
+
+    struct Item {
+        ino_t ino;
+        std::string path;
+        bool dir;
+    };
+
+    std::mutex mutex;
+    PrefetchStats stats;
+    stats.directories = 1;
+
+    // appends the children of a synced directory to the next level
+    const auto expand = [this, &options, &mutex](ino_t dir, const std::string &dir_path,
+                                                  bool with_dirs, std::vector<Item> &next) {
+        std::vector<Item> children;
+        auto txn = m_cache.begin_ro();
+        ino_t cursor = 0;
+        while (true) {
+            auto entry = txn.readdir(dir, cursor);
+            if (!entry) {
+                break;
+            }
+            cursor = entry->ino;
+            if (entry->name == "." || entry->name == "..") {
+                continue;
+            }
+            mode_t mode = entry->attr.mode;
+            if (!entry->complete) {
+                auto attr_result = txn.getattr(entry->ino);
+                if (!attr_result) {
+                    continue;
+                }
+                mode = attr_result->attr.mode;
+            }
+            const bool is_dir = (mode & S_IFMT) == S_IFDIR;
+            if ((is_dir && !with_dirs) ||
+                    (!is_dir && ((mode & S_IFMT) != S_IFREG || !options.content))) {
+                continue;
+            }
+            std::string child_path(dir_path);
+            if (child_path.size() > 1) {
+                child_path += '/';
+            }
+            child_path += entry->name;
+            children.emplace_back(Item{entry->ino, std::move(child_path), is_dir});
+        }
+        txn.abort();
+
+        std::lock_guard<std::mutex> guard(mutex);
+        std::move(children.begin(), children.end(), std::back_inserter(next));
+    };
+
+    std::vector<Item> level;
+    expand(start, start_path, options.depth > 0, level);
+
+    WorkerPool pool(options.concurrency > 0
+                    ? options.concurrency
+                    : std::max<std::size_t>(std::thread::hardware_concurrency(), 1));
+    for (std::size_t depth = 1; !level.empty(); ++depth) {
+        // directories of this level are expanded into the next one as they
+        // complete; the level is done once all tasks are
+        std::vector<Item> next;
+        const bool with_dirs = depth < options.depth;
+        {
+            TaskGroup group(pool);
+            for (const Item &item: level) {
+                group.submit([this, &item, &expand, &mutex, &stats, &next, with_dirs]() {
+                    if (item.dir) {
+                        auto result = prefetch_dir(item.ino, item.path);
+                        std::unique_lock<std::mutex> guard(mutex);
+                        if (!result) {
+                            ++stats.errors;
+                            return;
+                        }
+                        ++stats.directories;
+                        guard.unlock();
+                        expand(item.ino, item.path, with_dirs, next);
+                    } else {
+                        auto result = pull_file(item.ino, item.path);
+                        std::lock_guard<std::mutex> guard(mutex);
+                        if (!result) {
+                            ++stats.errors;
+                            return;
+                        }
+                        ++stats.files;
+                        stats.bytes += *result;
+                    }
+                });
+            }
+            group.wait();
+        }
+        level = std::move(next);
+    }
+
+    return make_result(stats);
+}
+
+void Filesystem::setxattr(Fuse::Request &&req, fuse_ino_t ino, std::string_view name, std::string_view value, int flags)
+{
+    const Trace::Scope trace_scope = begin_request(req, Op::SETXATTR);
+    if (name != PREFETCH_XATTR) {
+        req.reply_err(ENOTSUP);
+        return;
+    }
+
+    auto options_result = PrefetchOptions::parse(value);
+    if (!options_result) {
+        req.reply_err(options_result.error());
+        return;
+    }
+
+    auto txn = m_cache.begin_ro();
+    auto attr_result = txn.getattr(ino);
+    if (!attr_result) {
+        req.reply_err(attr_result.error());
+        return;
+    }
+    if ((attr_result->attr.mode & S_IFMT) != S_IFDIR) {
+        req.reply_err(ENOTDIR);
+        return;
+    }
+    auto path_result = txn.path(ino);
+    if (!path_result) {
+        req.reply_err(path_result.error());
+        return;
+    }
+    txn.abort();
+
+    // the prefetch syncs the directory, which invalidates entries of it;
+    // the kernel processes those only once this request has been answered
+    req.reply_err(0);
+    m_prefetch_tasks.submit([this, path = std::move(*path_result), options = *options_result]() {
+        auto prefetch_result = prefetch(path, options);
+        if (!prefetch_result) {
+            m_prefetch_errors.add();
+            return;
+        }
+        m_prefetch_directories.add(prefetch_result->directories);
+        m_prefetch_files.add(prefetch_result->files);
+        m_prefetch_errors.add(prefetch_result->errors);
+    });
 }
 
 }
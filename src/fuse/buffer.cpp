@@ -24,66 +24,97 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include "dragonstash/fuse/buffer.hpp"
 
+#include <algorithm>
+
 #include "dragonstash/fuse/request.hpp"
 
 namespace Fuse {
 
-size_t DirBuffer::prepare_add(Request &req, const char *name)
+static thread_local std::string spare_buffer;
+
+/* Fuse::ReplyBuffer */
+
+ReplyBuffer::ReplyBuffer(std::size_t limit):
+    m_length(0),
+    m_limit(limit)
 {
-    const size_t old_size = m_buf.size();
-    const size_t new_size = old_size + fuse_add_direntry(*req, nullptr, 0,
-                                                         name, nullptr, 0);
-    m_buf.resize(new_size);
-    return old_size;
+    m_buf.swap(spare_buffer);
+    if (m_buf.size() < m_limit) {
+        m_buf.resize(m_limit);
+    }
 }
 
-void DirBuffer::add(Request &req, const char *name, const struct stat &stbuf, const off_t off)
+ReplyBuffer::~ReplyBuffer()
 {
-    const size_t old_size = prepare_add(req, name);
-    fuse_add_direntry(*req, &m_buf[old_size], m_buf.size() - old_size, name, &stbuf, off);
+    if (m_buf.size() <= MAX_RETAINED_SIZE && m_buf.size() > spare_buffer.size()) {
+        spare_buffer.swap(m_buf);
+    }
 }
 
-void DirBuffer::add(Request &req,
-                    const char *name,
-                    const struct stat &stbuf)
+const char *ReplyBuffer::terminate(std::string_view name)
+{
+    if (name.size() < m_name.size()) {
+        std::memcpy(m_name.data(), name.data(), name.size());
+        m_name[name.size()] = '\0';
+        return m_name.data();
+    }
+    m_long_name.assign(name);
+    return m_long_name.c_str();
+}
+
+void ReplyBuffer::grow(std::size_t min_size)
+{
+    // use the full capacity; it is there anyway
+    m_buf.resize(std::max({min_size, m_buf.size() * 2, m_buf.capacity()}));
+}
+
+/* Fuse::DirBuffer */
+
+DirBuffer::DirBuffer(std::size_t limit):
+    ReplyBuffer(limit)
 {
-    const size_t old_size = prepare_add(req, name);
-    fuse_add_direntry(*req, &m_buf[old_size], m_buf.size() - old_size, name, &stbuf, m_buf.size());
+
 }
 
-size_t DirBufferPlus::prepare_add(Request &req,
-                                  const char *name,
-                                  const fuse_entry_param &e)
+bool DirBuffer::add(Request &req, std::string_view name, const struct stat &stbuf, const off_t off)
 {
-    const size_t old_size = m_buf.size();
-    const size_t new_size = old_size + fuse_add_direntry_plus(
-                *req, nullptr, 0,
-                name, &e, 0);
-    m_buf.resize(new_size);
-    return old_size;
+    const char *c_name = terminate(name);
+    return append([&req, c_name, &stbuf, off](char *buf, std::size_t size) {
+        return fuse_add_direntry(*req, buf, size, c_name, &stbuf, off);
+    });
 }
 
-void DirBufferPlus::execute_add(Request &req,
-                                const size_t old_size,
-                                const char *name,
-                                const fuse_entry_param &e, const off_t off)
+bool DirBuffer::add(Request &req,
+                    std::string_view name,
+                    const struct stat &stbuf)
 {
-    fuse_add_direntry_plus(*req, &m_buf[old_size], m_buf.size() - old_size,
-                           name, &e, off);
+    // the offset is the end of the entry, which needs to be known first
+    const std::size_t entry_size = fuse_add_direntry(*req, nullptr, 0, terminate(name), nullptr, 0);
+    return add(req, name, stbuf, length() + entry_size);
+}
+
+/* Fuse::DirBufferPlus */
+
+DirBufferPlus::DirBufferPlus(std::size_t limit):
+    ReplyBuffer(limit)
+{
+
 }
 
-void DirBufferPlus::add(Request &req, const char *name,
+bool DirBufferPlus::add(Request &req, std::string_view name,
                         const fuse_entry_param &e,
                         const off_t off)
 {
-    const size_t old_size = prepare_add(req, name, e);
-    execute_add(req, old_size, name, e, off);
+    const char *c_name = terminate(name);
+    return append([&req, c_name, &e, off](char *buf, std::size_t size) {
+        return fuse_add_direntry_plus(*req, buf, size, c_name, &e, off);
+    });
 }
 
-void DirBufferPlus::add(Request &req, const char *name, const fuse_entry_param &e)
+bool DirBufferPlus::add(Request &req, std::string_view name, const fuse_entry_param &e)
 {
-    const size_t old_size = prepare_add(req, name, e);
-    execute_add(req, old_size, name, e, m_buf.size());
+    const std::size_t entry_size = fuse_add_direntry_plus(*req, nullptr, 0, terminate(name), &e, 0);
+    return add(req, name, e, length() + entry_size);
 }
 
 }
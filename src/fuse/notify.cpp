@@ -0,0 +1,63 @@
+/**********************************************************************
+File name: notify.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/fuse/notify.hpp"
+
+namespace Fuse {
+
+NotifyBackend notify_backend{
+    .inval_inode = &fuse_lowlevel_notify_inval_inode,
+    .inval_entry = &fuse_lowlevel_notify_inval_entry,
+};
+
+
+Notifier::Notifier():
+    m_session(nullptr)
+{
+
+}
+
+Notifier::Notifier(fuse_session *session):
+    m_session(session)
+{
+
+}
+
+int Notifier::inval_inode(fuse_ino_t ino, off_t off, off_t len)
+{
+    if (!m_session) {
+        return 0;
+    }
+    return notify_backend.inval_inode(m_session, ino, off, len);
+}
+
+int Notifier::inval_entry(fuse_ino_t parent, std::string_view name)
+{
+    if (!m_session) {
+        return 0;
+    }
+    return notify_backend.inval_entry(m_session, parent, name.data(), name.size());
+}
+
+}
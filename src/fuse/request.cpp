@@ -24,6 +24,9 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include "dragonstash/fuse/request.hpp"
 
+#include "dragonstash/metrics.hpp"
+#include "dragonstash/trace.hpp"
+
 namespace Fuse {
 
 RequestBackend backend{
@@ -57,23 +60,31 @@ RequestBackend backend{
 
 Request::Request():
     m_req(nullptr),
-    m_default_error(ECANCELED)
+    m_default_error(ECANCELED),
+    m_latency(nullptr)
 {
 
 }
 
 Request::Request(fuse_req_t req, int default_error):
     m_req(req),
-    m_default_error(default_error)
+    m_default_error(default_error),
+    m_latency(nullptr)
 {
 
 }
 
 Request::Request(Request &&src) noexcept:
     m_req(src.m_req),
-    m_default_error(src.m_default_error)
+    m_default_error(src.m_default_error),
+    m_latency(src.m_latency),
+    m_started(src.m_started)
+#ifdef DRAGONSTASH_TRACING
+    , m_trace(std::move(src.m_trace))
+#endif
 {
     src.m_req = nullptr;
+    src.m_latency = nullptr;
 }
 
 Request &Request::operator=(Request &&src) noexcept
@@ -83,7 +94,13 @@ Request &Request::operator=(Request &&src) noexcept
     }
     m_req = src.m_req;
     m_default_error = src.m_default_error;
+    m_latency = src.m_latency;
+    m_started = src.m_started;
+#ifdef DRAGONSTASH_TRACING
+    m_trace = std::move(src.m_trace);
+#endif
     src.m_req = nullptr;
+    src.m_latency = nullptr;
     return *this;
 }
 
@@ -103,6 +120,20 @@ Request::~Request()
     }
 }
 
+void Request::record_latency()
+{
+    m_latency->record_since(m_started);
+    m_latency = nullptr;
+}
+
+#ifdef DRAGONSTASH_TRACING
+void Request::finish_trace()
+{
+    m_trace->finish();
+    m_trace = nullptr;
+}
+#endif
+
 void Request::reset()
 {
     reply_err(m_default_error);
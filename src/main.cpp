@@ -30,26 +30,111 @@ authors named in the AUTHORS file.
 #include <iostream>
 #include <cstring>
 
+#include "dragonstash/backend/connectivity.hpp"
+#include "dragonstash/backend/fault_injection.hpp"
 #include "dragonstash/backend/local.hpp"
+#include "dragonstash/backend/sftp.hpp"
 #include "dragonstash/backend/in_memory.hpp"
 
 #include <CLI/CLI.hpp>
 
-class MountCommand
+/**
+ * @brief Backend selection, shared by the subcommands which use the backend.
+ */
+class BackendOptions
 {
 public:
-    explicit MountCommand(CLI::App &app):
-        m_cmd(*app.add_subcommand("mount", "Mount a dragonstash cache"))
+    BackendOptions(CLI::App &cmd, bool with_disconnected):
+        m_cmd(cmd)
     {
-
         auto &backend_group = *m_cmd.add_option_group("Backend");
         backend_group.require_option(1, 1);
-        backend_group.add_flag("-N,--disconnected", "Mount without backend");
+        if (with_disconnected) {
+            backend_group.add_flag("-N,--disconnected", "Mount without backend");
+        }
         backend_group.add_option("-L,--local", m_local_path, "Use a local directory as backend.")->type_name("PATH");
-        backend_group.add_flag("-S,--sshfs,--sftp", m_sshfs_url, "Use libssh to connect to a server as backend.")->type_name("URL");
+        backend_group.add_option("-S,--sshfs,--sftp", m_sshfs_url, "Use a directory on an SFTP server as backend, given as sftp://[USER@]HOST[:PORT][/PATH] or [USER@]HOST:[PATH]; ssh must be able to log in without asking.")->type_name("URL");
+
+        m_cmd.add_option("--sftp-connections", m_sftp_connections, "Maximum number of connections to the SFTP server (default: 4)")->type_name("N");
+    }
+
+private:
+    CLI::App &m_cmd;
+
+    std::string m_local_path;
+    std::string m_sshfs_url;
+    std::size_t m_sftp_connections = Dragonstash::Backend::SftpFilesystem::Config().connections;
+
+public:
+    [[nodiscard]] bool disconnected() const {
+        return m_cmd.count("--disconnected") > 0;
+    }
+
+    /**
+     * @brief Create the selected backend.
+     *
+     * @return nullptr if the options are invalid; the error has been
+     *   printed.
+     */
+    [[nodiscard]] std::unique_ptr<Dragonstash::Backend::Filesystem> make() const {
+        if (disconnected()) {
+            auto in_memory = std::make_unique<Dragonstash::Backend::InMemoryFilesystem>();
+            in_memory->set_connected(false);
+            return in_memory;
+        }
+        if (m_cmd.count("--local")) {
+            return std::make_unique<Dragonstash::Backend::LocalFilesystem>(std::filesystem::path(m_local_path));
+        }
+
+        auto target_result = Dragonstash::Backend::SftpFilesystem::parse_url(m_sshfs_url);
+        if (!target_result) {
+            std::cerr << "invalid SFTP URL: " << m_sshfs_url << std::endl;
+            return nullptr;
+        }
+        Dragonstash::Backend::SftpFilesystem::Config sftp;
+        sftp.root = target_result->root;
+        sftp.connections = m_sftp_connections;
+        return std::make_unique<Dragonstash::Backend::SftpFilesystem>(
+                    Dragonstash::Backend::SftpFilesystem::command_connector(std::move(target_result->command)),
+                    sftp);
+    }
+
+};
+
+class MountCommand
+{
+public:
+    explicit MountCommand(CLI::App &app):
+        m_cmd(*app.add_subcommand("mount", "Mount a dragonstash cache")),
+        m_backend(m_cmd, true)
+    {
 
         m_cmd.add_flag("-d,--debug", "Enable FUSE debug output (implies -f)");
         m_cmd.add_flag("-f,--foreground", "Stay in foreground");
+        m_cmd.add_option("--backend-concurrency", m_backend_concurrency, "Maximum number of concurrent backend operations when syncing a directory (default: 16)")->type_name("N");
+        m_cmd.add_option("--fuse-idle-threads", m_fuse_idle_threads, "Number of idle request threads which are kept around instead of being ended (default: 10)")->type_name("N");
+        m_cmd.add_option("--fuse-max-threads", m_fuse_max_threads, "Maximum number of request threads; 0 keeps the libfuse default; needs libfuse 3.12 or later (default: 0)")->type_name("N");
+        m_cmd.add_option("--block-size", m_block_size_kib, "Block size of cached file contents in KiB, a power of two between 4 and 16384; only used when the cache is created (default: 4)")->type_name("KIB");
+        m_cmd.add_option("--cache-size", m_cache_size_mib, "Maximum size of cached file contents in MiB; 0 means no limit (default: 0)")->type_name("MIB");
+        m_cmd.add_option("--readahead-max", m_readahead_max_kib, "Maximum readahead window in KiB; 0 disables readahead (default: 32768)")->type_name("KIB");
+        m_cmd.add_option("--readahead-lead", m_readahead_lead_ms, "Time in milliseconds by which readahead tries to stay ahead of sequential readers (default: 3000)")->type_name("MS");
+        m_cmd.add_option("--attr-timeout", m_attr_timeout, "Seconds for which the kernel may cache attributes (default: 1)")->type_name("SECONDS");
+        m_cmd.add_option("--entry-timeout", m_entry_timeout, "Seconds for which the kernel may cache directory entries (default: 1)")->type_name("SECONDS");
+        m_cmd.add_option("--negative-timeout", m_negative_timeout, "Seconds for which names missing on the backend are remembered; 0 disables negative caching (default: 1)")->type_name("SECONDS");
+        m_cmd.add_flag("--skip-unchanged-dirs", "Do not read a directory from the backend on opendir if its modification time says that it has not changed; the attributes of its entries are then only refreshed by lookups, so that files changed in place may show their old size and times until the kernel looks them up again. Must not be used with backends which do not update the timestamps of directories");
+        m_cmd.add_option("--stable-after", m_stable_after, "Trust cached entries without asking the backend once their modification time is this many seconds old; 0 always revalidates (default: 0)")->type_name("SECONDS");
+        m_cmd.add_option("--soft-ttl", m_soft_ttl, "Seconds after an entry was found up-to-date during which lookups use it without asking the backend; only used with --hard-ttl (default: 0)")->type_name("SECONDS");
+        m_cmd.add_option("--hard-ttl", m_hard_ttl, "Seconds after an entry was found up-to-date during which lookups use it right away and revalidate it in the background; 0 always revalidates before replying (default: 0)")->type_name("SECONDS");
+        m_cmd.add_option("--offline-timeout", m_offline_timeout, "Minimum timeout in seconds for entries served while the backend is not connected (default: 0)")->type_name("SECONDS");
+        m_cmd.add_option("--probe-interval", m_probe_interval_ms, "Milliseconds before the backend is probed after it went away; doubles after each failed probe (default: 500)")->type_name("MS");
+        m_cmd.add_option("--max-probe-interval", m_max_probe_interval_ms, "Upper limit for the interval between probes in milliseconds (default: 60000)")->type_name("MS");
+        m_cmd.add_flag("--metrics", "Expose request latencies, backend latencies and cache hit counters in the Prometheus text format as the file .dragonstash/metrics in the root of the mount, which hides a backend entry named .dragonstash");
+        m_cmd.add_option("--trace-sample", m_trace_sample, "Trace every N-th request and expose the traces in the Chrome trace format as the file .dragonstash/trace in the root of the mount (see --metrics); 0 disables sampling (default: 0)")->type_name("N");
+        m_cmd.add_option("--trace-threshold", m_trace_threshold_ms, "Also trace requests which take at least this many milliseconds; 0 disables (default: 0)")->type_name("MS");
+        m_cmd.add_flag("--write-back", "Accept writes and new files, keep them in the cache and write them back to the backend in the background, also after it was unreachable");
+        m_cmd.add_option("--flush-interval", m_flush_interval_ms, "Milliseconds between write-backs of changed files; 0 only writes back on unmount (default: 5000)")->type_name("MS");
+        m_cmd.add_option("--inject-faults", m_inject_faults, "Slow down the backend and make it fail, for staging runs, e.g. latency=50,jitter=20,bandwidth=1024,failure=0.01,flap=5000; times in milliseconds, bandwidth in KiB/s, distribution=exponential for a long tail")->type_name("SPEC");
+        m_cmd.add_option("--subtree-timeout", m_subtree_timeouts, "Override the timeouts for a subtree, e.g. /archive=3600,86400 for a long timeout and trusting entries older than a day; may be repeated")->type_name("PATH=SECONDS[,STABLE_AFTER]");
 
         m_cmd.add_option("cachedir", m_cachedir, "Path to the cache directory")->mandatory()->type_name("PATH");
         m_cmd.add_option("mountpoint", m_mountpoint, "Path to the mountpoint")->mandatory()->type_name("PATH");
@@ -57,28 +142,120 @@ public:
 
 private:
     CLI::App &m_cmd;
+    BackendOptions m_backend;
 
     std::string m_cachedir;
     std::string m_mountpoint;
-    std::string m_local_path;
-    std::string m_sshfs_url;
+    std::size_t m_backend_concurrency = Dragonstash::WorkerPool::DEFAULT_CONCURRENCY;
+    unsigned m_fuse_idle_threads = Fuse::LoopConfig().max_idle_threads;
+    unsigned m_fuse_max_threads = 0;
+    std::uint32_t m_block_size_kib = 0;
+    std::uint64_t m_cache_size_mib = 0;
+    std::size_t m_readahead_max_kib = Dragonstash::Readahead::Config().max_window / 1024;
+    std::size_t m_readahead_lead_ms = Dragonstash::Readahead::Config().lead_time.count();
+    std::uint64_t m_probe_interval_ms = Dragonstash::Backend::ConnectivityFilesystem::Config().initial_backoff.count();
+    std::uint64_t m_max_probe_interval_ms = Dragonstash::Backend::ConnectivityFilesystem::Config().max_backoff.count();
+    double m_attr_timeout = Dragonstash::TimeoutPolicy::Rule().attr_timeout;
+    double m_entry_timeout = Dragonstash::TimeoutPolicy::Rule().entry_timeout;
+    double m_negative_timeout = Dragonstash::Filesystem::DEFAULT_NEGATIVE_TIMEOUT;
+    double m_stable_after = Dragonstash::TimeoutPolicy::Rule().stable_after;
+    double m_soft_ttl = Dragonstash::TimeoutPolicy::Rule().soft_ttl;
+    double m_hard_ttl = Dragonstash::TimeoutPolicy::Rule().hard_ttl;
+    double m_offline_timeout = 0;
+    std::uint64_t m_flush_interval_ms = Dragonstash::Filesystem::DEFAULT_FLUSH_INTERVAL.count();
+    std::uint64_t m_trace_sample = 0;
+    double m_trace_threshold_ms = 0;
+    std::vector<std::string> m_subtree_timeouts;
+    std::string m_inject_faults;
 
 public:
     int execute() {
         const bool debug = m_cmd.count("-d");
         const bool foreground = debug || m_cmd.count("-f");
-        const bool clone_fd = true;
 
-        std::unique_ptr<Dragonstash::Backend::Filesystem> backend;
-        if (m_cmd.count("--disconnected")) {
-            auto in_memory = std::make_unique<Dragonstash::Backend::InMemoryFilesystem>();
-            in_memory->set_connected(false);
-            backend = std::move(in_memory);
-        } else if (m_cmd.count("--local")) {
-            backend = std::make_unique<Dragonstash::Backend::LocalFilesystem>(std::filesystem::path(m_local_path));
+        const bool disconnected = m_backend.disconnected();
+
+        Dragonstash::TimeoutPolicy timeouts(Dragonstash::TimeoutPolicy::Rule{
+                                                m_attr_timeout,
+                                                m_entry_timeout,
+                                                m_stable_after,
+                                                m_soft_ttl,
+                                                m_hard_ttl,
+                                            });
+        for (const auto &spec: m_subtree_timeouts) {
+            auto subtree_result = Dragonstash::TimeoutPolicy::parse_subtree(spec);
+            if (!subtree_result) {
+                std::cerr << "invalid subtree timeout: " << spec << std::endl;
+                return 1;
+            }
+            timeouts.add_subtree(subtree_result->first, subtree_result->second);
+        }
+        timeouts.set_offline_timeout(m_offline_timeout);
+        if (disconnected) {
+            // without a backend, nothing is ever going to change
+            timeouts.set_offline_timeout(Dragonstash::TimeoutPolicy::INFINITE_TIMEOUT);
+            auto rule = timeouts.defaults();
+            rule.attr_timeout = Dragonstash::TimeoutPolicy::INFINITE_TIMEOUT;
+            rule.entry_timeout = Dragonstash::TimeoutPolicy::INFINITE_TIMEOUT;
+            timeouts.set_defaults(rule);
+        }
+
+        std::unique_ptr<Dragonstash::Backend::Filesystem> backend = m_backend.make();
+        if (!backend) {
+            return 1;
+        }
+        std::unique_ptr<Dragonstash::Backend::FaultInjectingFilesystem> faulty;
+        if (m_cmd.count("--inject-faults")) {
+            auto faults_result = Dragonstash::Backend::FaultInjectingFilesystem::parse_config(m_inject_faults);
+            if (!faults_result) {
+                std::cerr << "invalid fault injection: " << m_inject_faults << std::endl;
+                return 1;
+            }
+            faulty = std::make_unique<Dragonstash::Backend::FaultInjectingFilesystem>(*backend, *faults_result);
+        }
+        // requests are served from the cache right away while the backend
+        // is known to be down
+        Dragonstash::Backend::ConnectivityFilesystem::Config connectivity;
+        connectivity.initial_backoff = std::chrono::milliseconds(m_probe_interval_ms);
+        connectivity.max_backoff = std::chrono::milliseconds(m_max_probe_interval_ms);
+        if (disconnected) {
+            connectivity.initial_state = Dragonstash::Backend::ConnectivityFilesystem::State::DISCONNECTED;
+        }
+        Dragonstash::Backend::ConnectivityFilesystem monitored(faulty ? *faulty : *backend, connectivity);
+
+        Dragonstash::Cache cache(m_cachedir, m_block_size_kib * 1024);
+        cache.set_content_budget(m_cache_size_mib * 1024 * 1024);
+        Dragonstash::Filesystem fs(cache, monitored, m_backend_concurrency);
+        {
+            Dragonstash::Readahead::Config readahead;
+            readahead.max_window = m_readahead_max_kib * 1024;
+            readahead.lead_time = std::chrono::milliseconds(m_readahead_lead_ms);
+            fs.set_readahead_config(readahead);
+        }
+        fs.set_negative_timeout(m_negative_timeout);
+        fs.set_dir_change_detection(m_cmd.count("--skip-unchanged-dirs") > 0);
+        fs.set_timeout_policy(timeouts);
+        if (m_cmd.count("--write-back")) {
+            fs.set_write_back(true, std::chrono::milliseconds(m_flush_interval_ms));
+        }
+        fs.metrics().add([&monitored](Dragonstash::Metrics::TextWriter &out) {
+            monitored.collect_metrics(out);
+        });
+        if (faulty) {
+            fs.metrics().add([&faulty](Dragonstash::Metrics::TextWriter &out) {
+                faulty->collect_metrics(out);
+            });
+        }
+        fs.set_metrics_file(m_cmd.count("--metrics") > 0);
+        if (m_trace_sample > 0 || m_trace_threshold_ms > 0) {
+            if (!Dragonstash::Trace::ENABLED) {
+                std::cerr << "tracing was disabled at build time (DRAGONSTASH_TRACING)" << std::endl;
+                return 1;
+            }
+            fs.set_tracing(m_trace_sample,
+                           std::chrono::duration_cast<Dragonstash::Trace::Clock::duration>(
+                               std::chrono::duration<double, std::milli>(m_trace_threshold_ms)));
         }
-        Dragonstash::Cache cache(m_cachedir);
-        Dragonstash::Filesystem fs(cache, *backend);
 
         // construct an argv array to trick fuse into setting the right options
         // ... this is a bit hacky, but it does what's needed.
@@ -98,6 +275,9 @@ public:
 
         int ret = 255;
         Fuse::Session<Dragonstash::Filesystem> session(fs, &args);
+        // with notifications, kernel caches are evicted when the backend
+        // is seen to change, regardless of the timeouts
+        fs.set_notifier(Fuse::Notifier(*session));
 
         if (session.set_signal_handlers() != 0) {
             std::cerr << "failed to set signal handlers" << std::endl;
@@ -113,13 +293,29 @@ public:
 
         fuse_daemonize(foreground);
 
-        ret = !session.loop_mt(clone_fd);
+        {
+            Fuse::LoopConfig loop;
+            loop.max_idle_threads = m_fuse_idle_threads;
+            loop.max_threads = m_fuse_max_threads;
+            ret = !session.loop_mt(loop);
+        }
 
         session.unmount();
+        if (m_cmd.count("--write-back")) {
+            // whatever the flusher has not gotten to yet; what fails stays
+            // journaled for the next mount
+            auto stats = fs.write_back();
+            if (stats.failed > 0) {
+                std::cerr << stats.failed << " changed files could not be written back: "
+                          << std::strerror(stats.error) << std::endl;
+            }
+        }
 
 cleanup_signal:
         session.remove_signal_handlers();
 exit:
+        // the session goes away before the filesystem does
+        fs.set_notifier(Fuse::Notifier());
         return ret;
     }
 
@@ -130,15 +326,170 @@ exit:
 };
 
 
+class PrefetchCommand
+{
+public:
+    explicit PrefetchCommand(CLI::App &app):
+        m_cmd(*app.add_subcommand("prefetch", "Populate a dragonstash cache with a subtree of the backend; the cache must not be mounted")),
+        m_backend(m_cmd, false)
+    {
+        m_cmd.add_option("--depth", m_depth, "Number of directory levels below the subpath to descend into (default: unlimited)")->type_name("N");
+        m_cmd.add_flag("--content", "Download the contents of regular files, too; they are pinned in the cache");
+        m_cmd.add_option("-j,--jobs", m_jobs, "Number of directories and files to process in parallel; 0 uses one per core (default: 0)")->type_name("N");
+        m_cmd.add_option("--backend-concurrency", m_backend_concurrency, "Maximum number of concurrent backend operations per directory (default: 16)")->type_name("N");
+        m_cmd.add_option("--block-size", m_block_size_kib, "Block size of cached file contents in KiB; only used when the cache is created (default: 4)")->type_name("KIB");
+
+        m_cmd.add_option("cachedir", m_cachedir, "Path to the cache directory")->mandatory()->type_name("PATH");
+        m_cmd.add_option("subpath", m_subpath, "Path of the subtree, relative to the backend root")->mandatory()->type_name("PATH");
+    }
+
+private:
+    CLI::App &m_cmd;
+    BackendOptions m_backend;
+
+    std::string m_cachedir;
+    std::string m_subpath;
+    std::size_t m_depth = Dragonstash::PrefetchOptions::UNLIMITED_DEPTH;
+    std::size_t m_jobs = 0;
+    std::size_t m_backend_concurrency = Dragonstash::WorkerPool::DEFAULT_CONCURRENCY;
+    unsigned m_fuse_idle_threads = Fuse::LoopConfig().max_idle_threads;
+    unsigned m_fuse_max_threads = 0;
+    std::uint32_t m_block_size_kib = 0;
+
+public:
+    int execute() {
+        auto backend = m_backend.make();
+        if (!backend) {
+            return 1;
+        }
+        // refuses to open a mounted cache; a prefetch on a mount goes
+        // through the prefetch attribute instead
+        std::unique_ptr<Dragonstash::Cache> cache;
+        try {
+            cache = std::make_unique<Dragonstash::Cache>(m_cachedir, m_block_size_kib * 1024);
+        } catch (const std::runtime_error &exc) {
+            std::cerr << "failed to open cache: " << exc.what() << std::endl;
+            return 1;
+        }
+        Dragonstash::Filesystem fs(*cache, *backend, m_backend_concurrency);
+
+        Dragonstash::PrefetchOptions options;
+        options.depth = m_depth;
+        options.content = m_cmd.count("--content");
+        options.concurrency = m_jobs;
+
+        auto result = fs.prefetch(m_subpath, options);
+        if (!result) {
+            std::cerr << "failed to prefetch " << m_subpath << ": "
+                      << std::strerror(result.error()) << std::endl;
+            return 1;
+        }
+        std::cout << result->directories << " directories, "
+                  << result->files << " files, "
+                  << result->bytes << " bytes downloaded, "
+                  << result->errors << " errors" << std::endl;
+        return result->errors > 0 ? 2 : 0;
+    }
+
+    explicit operator bool() const {
+        return bool(m_cmd);
+    }
+
+};
+
+
+class PinCommand
+{
+public:
+    explicit PinCommand(CLI::App &app):
+        m_cmd(*app.add_subcommand("pin", "Manage the rules which pin file contents in a dragonstash cache")),
+        m_add(*m_cmd.add_subcommand("add", "Pin the files below a path or matching a pattern")),
+        m_remove(*m_cmd.add_subcommand("remove", "Remove a pin rule; the contents become evictable once the cache is mounted")),
+        m_list(*m_cmd.add_subcommand("list", "List the pin rules"))
+    {
+        m_cmd.require_subcommand(1);
+
+        m_add.add_flag("-g,--glob", "Treat the path as a shell pattern; wildcards do not match slashes");
+        m_add.add_option("--max-size", m_max_size_mib, "Do not pin files larger than this, in MiB; 0 means no limit (default: 0)")->type_name("MIB");
+        m_add.add_option("cachedir", m_cachedir, "Path to the cache directory")->mandatory()->type_name("PATH");
+        m_add.add_option("path", m_pattern, "Path of the subtree or the pattern, relative to the mount root")->mandatory()->type_name("PATH");
+
+        m_remove.add_option("cachedir", m_cachedir, "Path to the cache directory")->mandatory()->type_name("PATH");
+        m_remove.add_option("id", m_id, "Id of the rule, as shown by list")->mandatory()->type_name("ID");
+
+        m_list.add_option("cachedir", m_cachedir, "Path to the cache directory")->mandatory()->type_name("PATH");
+    }
+
+private:
+    CLI::App &m_cmd;
+    CLI::App &m_add;
+    CLI::App &m_remove;
+    CLI::App &m_list;
+
+    std::string m_cachedir;
+    std::string m_pattern;
+    std::uint64_t m_max_size_mib = 0;
+    std::uint64_t m_id = 0;
+
+public:
+    int execute() {
+        // only the pin rules are opened, so this is safe while the cache is
+        // mounted; the mount picks up changes on its next lookup
+        Dragonstash::PinRuleStore pins(m_cachedir);
+
+        if (m_add) {
+            const std::uint64_t max_size = m_max_size_mib * 1024 * 1024;
+            const Dragonstash::PinRule rule = m_add.count("--glob")
+                    ? Dragonstash::PinRule::make_glob(m_pattern, max_size)
+                    : Dragonstash::PinRule::make_subtree(m_pattern, max_size);
+            std::cout << pins.add(rule) << std::endl;
+            return 0;
+        }
+
+        if (m_remove) {
+            auto result = pins.remove(m_id);
+            if (!result) {
+                std::cerr << "failed to remove pin rule " << m_id << ": "
+                          << std::strerror(result.error()) << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+
+        for (const auto &rule: pins.rules()) {
+            std::cout << rule.id << "\t" << rule.to_string();
+            if (rule.retired) {
+                std::cout << " (removed, not unpinned yet)";
+            }
+            std::cout << std::endl;
+        }
+        return 0;
+    }
+
+    explicit operator bool() const {
+        return bool(m_cmd);
+    }
+
+};
+
+
 int main(int argc, char **argv) {
     CLI::App app{"Dragonstash"};
 
     MountCommand mount(app);
+    PrefetchCommand prefetch(app);
+    PinCommand pin(app);
 
     CLI11_PARSE(app, argc, argv);
 
     if (mount) {
         mount.execute();
     }
+    if (prefetch) {
+        return prefetch.execute();
+    }
+    if (pin) {
+        return pin.execute();
+    }
     return 0;
 }
@@ -0,0 +1,215 @@
+/**********************************************************************
+File name: metrics.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/metrics.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+namespace Dragonstash::Metrics {
+
+std::size_t thread_shard()
+{
+    static std::atomic<std::size_t> next_shard{0};
+    thread_local const std::size_t shard =
+            next_shard.fetch_add(1, std::memory_order_relaxed) % COUNTER_SHARDS;
+    return shard;
+}
+
+/* Dragonstash::Metrics::Counter */
+
+std::uint64_t Counter::value() const
+{
+    std::uint64_t result = 0;
+    for (const Shard &shard: m_shards) {
+        result += shard.value.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+/* Dragonstash::Metrics::Histogram */
+
+Histogram::Histogram()
+{
+    for (auto &bucket: m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+std::size_t Histogram::bucket_of(std::uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return std::size_t(value);
+    }
+    const unsigned exponent = 63 - unsigned(__builtin_clzll(value));
+    if (exponent > MAX_EXPONENT) {
+        return BUCKETS - 1;
+    }
+    const std::uint64_t sub = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return std::size_t((exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub);
+}
+
+std::uint64_t Histogram::bucket_start(std::size_t bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    const unsigned exponent = unsigned(bucket / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+    const std::uint64_t sub = bucket % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub) << (exponent - SUB_BUCKET_BITS);
+}
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+    Snapshot result{};
+    for (std::size_t i = 0; i < BUCKETS; ++i) {
+        result.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        result.count += result.buckets[i];
+    }
+    result.sum = m_sum.value();
+    return result;
+}
+
+std::uint64_t Histogram::Snapshot::count_below(std::uint64_t bound) const
+{
+    std::uint64_t result = 0;
+    for (std::size_t i = 0; i + 1 < BUCKETS && bucket_start(i + 1) <= bound; ++i) {
+        result += buckets[i];
+    }
+    return result;
+}
+
+std::uint64_t Histogram::Snapshot::quantile(double q) const
+{
+    if (count == 0) {
+        return 0;
+    }
+    const std::uint64_t rank = std::max<std::uint64_t>(
+                1, std::uint64_t(std::ceil(std::clamp(q, 0.0, 1.0) * double(count))));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return i + 1 < BUCKETS ? bucket_start(i + 1) - 1 : bucket_start(i);
+        }
+    }
+    return bucket_start(BUCKETS - 1);
+}
+
+/* Dragonstash::Metrics::TextWriter */
+
+static std::string format_double(double value)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9g", value);
+    return buf;
+}
+
+void TextWriter::family(std::string_view name, Type type, std::string_view help)
+{
+    m_family = name;
+    m_out += "# HELP ";
+    m_out += name;
+    m_out += ' ';
+    m_out += help;
+    m_out += "\n# TYPE ";
+    m_out += name;
+    switch (type) {
+    case Type::COUNTER:
+        m_out += " counter\n";
+        break;
+    case Type::GAUGE:
+        m_out += " gauge\n";
+        break;
+    case Type::HISTOGRAM:
+        m_out += " histogram\n";
+        break;
+    }
+}
+
+void TextWriter::write_sample(std::string_view suffix, std::string_view labels,
+                              std::string_view extra_label, const std::string &value)
+{
+    m_out += m_family;
+    m_out += suffix;
+    if (!labels.empty() || !extra_label.empty()) {
+        m_out += '{';
+        m_out += labels;
+        if (!labels.empty() && !extra_label.empty()) {
+            m_out += ',';
+        }
+        m_out += extra_label;
+        m_out += '}';
+    }
+    m_out += ' ';
+    m_out += value;
+    m_out += '\n';
+}
+
+void TextWriter::sample(std::string_view labels, std::uint64_t value)
+{
+    write_sample("", labels, "", std::to_string(value));
+}
+
+void TextWriter::sample(std::string_view labels, double value)
+{
+    write_sample("", labels, "", format_double(value));
+}
+
+void TextWriter::histogram(std::string_view labels, const Histogram &histogram)
+{
+    static constexpr unsigned MIN_BOUND_EXPONENT = 10;
+    static constexpr unsigned MAX_BOUND_EXPONENT = 36;
+
+    const Histogram::Snapshot snapshot = histogram.snapshot();
+    for (unsigned exponent = MIN_BOUND_EXPONENT; exponent <= MAX_BOUND_EXPONENT; ++exponent) {
+        const std::uint64_t bound = std::uint64_t(1) << exponent;
+        write_sample("_bucket", labels,
+                     "le=\"" + format_double(double(bound) / 1e9) + "\"",
+                     std::to_string(snapshot.count_below(bound)));
+    }
+    write_sample("_bucket", labels, "le=\"+Inf\"", std::to_string(snapshot.count));
+    write_sample("_sum", labels, "", format_double(double(snapshot.sum) / 1e9));
+    write_sample("_count", labels, "", std::to_string(snapshot.count));
+}
+
+/* Dragonstash::Metrics::Registry */
+
+void Registry::add(Collector &&collector)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_collectors.emplace_back(std::move(collector));
+}
+
+std::string Registry::render() const
+{
+    TextWriter out;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (const Collector &collector: m_collectors) {
+        collector(out);
+    }
+    return out.text();
+}
+
+}
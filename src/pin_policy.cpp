@@ -0,0 +1,203 @@
+/**********************************************************************
+File name: pin_policy.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/pin_policy.hpp"
+
+#include <fnmatch.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace Dragonstash {
+
+/**
+ * Record layout:
+ *
+ * - std::uint8_t kind
+ * - std::uint8_t retired
+ * - std::uint8_t reserved[6]
+ * - std::uint64_t max_size
+ * - pattern
+ */
+static constexpr std::size_t RECORD_HEADER_SIZE = 16;
+
+static std::string normalize_path(std::string_view path)
+{
+    while (!path.empty() && path.front() == '/') {
+        path.remove_prefix(1);
+    }
+    while (!path.empty() && path.back() == '/') {
+        path.remove_suffix(1);
+    }
+    if (path.empty()) {
+        return std::string();
+    }
+    std::string result("/");
+    result.append(path);
+    return result;
+}
+
+static bool in_subtree(std::string_view path, std::string_view prefix)
+{
+    if (path.size() < prefix.size() ||
+            path.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    return path.size() == prefix.size() || path[prefix.size()] == '/';
+}
+
+static std::string_view dirname(std::string_view path)
+{
+    const auto slash = path.rfind('/');
+    if (slash == std::string_view::npos) {
+        return std::string_view();
+    }
+    return path.substr(0, slash);
+}
+
+static bool glob_matches(const std::string &pattern, std::string_view path)
+{
+    const std::string buf(path);
+    return fnmatch(pattern.c_str(), buf.c_str(), FNM_PATHNAME | FNM_PERIOD) == 0;
+}
+
+PinRule PinRule::make_subtree(std::string_view path, std::uint64_t max_size)
+{
+    PinRule rule;
+    rule.kind = Kind::SUBTREE;
+    rule.pattern = normalize_path(path);
+    rule.max_size = max_size;
+    return rule;
+}
+
+PinRule PinRule::make_glob(std::string_view pattern, std::uint64_t max_size)
+{
+    PinRule rule;
+    rule.kind = Kind::GLOB;
+    if (pattern.empty() || pattern.front() != '/') {
+        rule.pattern = "/";
+    }
+    rule.pattern.append(pattern);
+    rule.max_size = max_size;
+    return rule;
+}
+
+bool PinRule::matches(std::string_view path, std::uint64_t size) const
+{
+    if (max_size > 0 && size > max_size) {
+        return false;
+    }
+    switch (kind) {
+    case Kind::SUBTREE:
+        return in_subtree(path, pattern);
+    case Kind::GLOB:
+        return glob_matches(pattern, path);
+    }
+    return false;
+}
+
+bool PinRule::may_match_in(std::string_view dir_path) const
+{
+    switch (kind) {
+    case Kind::SUBTREE:
+        // the subtree may also name a single file in the directory
+        return in_subtree(dir_path, pattern) || dirname(pattern) == dir_path;
+    case Kind::GLOB:
+    {
+        const std::string dir_pattern(dirname(pattern));
+        if (dir_pattern.find('\\') != std::string::npos) {
+            // the last slash may be escaped; do not try to be clever
+            return true;
+        }
+        return glob_matches(dir_pattern, dir_path);
+    }
+    }
+    return false;
+}
+
+std::string PinRule::to_string() const
+{
+    std::string result(kind == Kind::GLOB ? "glob " : "subtree ");
+    result.append(pattern.empty() ? std::string_view("/") : std::string_view(pattern));
+    if (max_size > 0) {
+        result.append(" (at most ");
+        result.append(std::to_string(max_size));
+        result.append(" bytes)");
+    }
+    return result;
+}
+
+std::string PinRule::serialise() const
+{
+    std::string result(RECORD_HEADER_SIZE, '\0');
+    result[0] = static_cast<char>(kind);
+    result[1] = retired ? 1 : 0;
+    memcpy(&result[8], &max_size, sizeof(max_size));
+    result.append(pattern);
+    return result;
+}
+
+Result<PinRule> PinRule::parse(std::uint64_t id, std::string_view record)
+{
+    if (record.size() < RECORD_HEADER_SIZE) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    PinRule rule;
+    rule.id = id;
+    switch (static_cast<Kind>(record[0])) {
+    case Kind::SUBTREE:
+    case Kind::GLOB:
+        rule.kind = static_cast<Kind>(record[0]);
+        break;
+    default:
+        return make_result(FAILED, EINVAL);
+    }
+    rule.retired = record[1] != 0;
+    memcpy(&rule.max_size, &record[8], sizeof(rule.max_size));
+    rule.pattern = std::string(record.substr(RECORD_HEADER_SIZE));
+    return rule;
+}
+
+PinPolicy::PinPolicy(std::vector<PinRule> rules):
+    m_rules(std::move(rules))
+{
+
+}
+
+bool PinPolicy::matches(std::string_view path, std::uint64_t size) const
+{
+    return std::any_of(m_rules.begin(), m_rules.end(), [path, size](const PinRule &rule) {
+        return rule.matches(path, size);
+    });
+}
+
+bool PinPolicy::may_match_in(std::string_view dir_path) const
+{
+    return std::any_of(m_rules.begin(), m_rules.end(), [dir_path](const PinRule &rule) {
+        return rule.may_match_in(dir_path);
+    });
+}
+
+}
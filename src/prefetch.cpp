@@ -0,0 +1,68 @@
+/**********************************************************************
+File name: prefetch.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/prefetch.hpp"
+
+#include <charconv>
+
+namespace Dragonstash {
+
+static bool parse_count(std::string_view value, std::size_t &out)
+{
+    if (value.empty()) {
+        return false;
+    }
+    const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), out);
+    return ec == std::errc() && end == value.data() + value.size();
+}
+
+Result<PrefetchOptions> PrefetchOptions::parse(std::string_view spec)
+{
+    PrefetchOptions options;
+    while (!spec.empty()) {
+        const auto comma = spec.find(',');
+        const std::string_view item = spec.substr(0, comma);
+        spec = comma == std::string_view::npos
+                ? std::string_view()
+                : spec.substr(comma + 1);
+
+        const auto eq = item.find('=');
+        const std::string_view key = item.substr(0, eq);
+        const std::string_view value = eq == std::string_view::npos
+                ? std::string_view()
+                : item.substr(eq + 1);
+        if (key == "content" && eq == std::string_view::npos) {
+            options.content = true;
+        } else if (key == "depth" && parse_count(value, options.depth)) {
+            continue;
+        } else if (key == "jobs" && parse_count(value, options.concurrency)) {
+            continue;
+        } else {
+            return make_result(FAILED, EINVAL);
+        }
+    }
+    return options;
+}
+
+}
@@ -0,0 +1,144 @@
+/**********************************************************************
+File name: readahead.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/readahead.hpp"
+
+#include <algorithm>
+
+namespace Dragonstash {
+
+/**
+ * @brief Weight of a new sample in the throughput average.
+ */
+static constexpr double THROUGHPUT_SMOOTHING = 0.3;
+
+static Readahead::Config sanitize(Readahead::Config config)
+{
+    config.min_window = std::min(config.min_window, config.max_window);
+    return config;
+}
+
+Readahead::Readahead(const Config &config, std::uint64_t file_size):
+    m_config(sanitize(config)),
+    m_file_size(file_size),
+    m_next_offset(0),
+    m_sequential_reads(0),
+    m_window(m_config.min_window),
+    m_prefetched_end(0),
+    m_in_flight(false),
+    m_throughput(0)
+{
+
+}
+
+std::size_t Readahead::target_window() const
+{
+    if (m_throughput <= 0) {
+        return m_config.max_window;
+    }
+    const double lead_seconds = std::chrono::duration<double>(m_config.lead_time).count();
+    const double target = m_throughput * lead_seconds;
+    if (target >= double(m_config.max_window)) {
+        return m_config.max_window;
+    }
+    return std::max(m_config.min_window, std::size_t(target));
+}
+
+std::optional<Readahead::Range> Readahead::access(std::uint64_t offset, std::size_t size)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    const std::uint64_t end = offset + size;
+    if (offset == m_next_offset && m_sequential_reads > 0) {
+        ++m_sequential_reads;
+    } else {
+        m_sequential_reads = 1;
+        m_window = m_config.min_window;
+        m_prefetched_end = end;
+    }
+    m_next_offset = end;
+
+    if (m_config.max_window == 0 ||
+            m_sequential_reads < m_config.sequential_threshold ||
+            m_in_flight) {
+        return std::nullopt;
+    }
+
+    m_prefetched_end = std::max(m_prefetched_end, end);
+    if (m_prefetched_end >= m_file_size) {
+        return std::nullopt;
+    }
+    if (m_prefetched_end - end >= m_window / 2) {
+        // still far enough ahead
+        return std::nullopt;
+    }
+
+    m_window = std::max(m_config.min_window,
+                        std::min(m_window * 2, target_window()));
+    const std::uint64_t prefetch_end = std::min<std::uint64_t>(end + m_window, m_file_size);
+    if (prefetch_end <= m_prefetched_end) {
+        return std::nullopt;
+    }
+
+    Range result{m_prefetched_end, std::size_t(prefetch_end - m_prefetched_end)};
+    m_prefetched_end = prefetch_end;
+    m_in_flight = true;
+    return result;
+}
+
+void Readahead::completed(const Range &range, std::size_t fetched,
+                          std::chrono::steady_clock::duration elapsed)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_in_flight = false;
+
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    if (fetched > 0 && seconds > 0) {
+        const double sample = double(fetched) / seconds;
+        if (m_throughput <= 0) {
+            m_throughput = sample;
+        } else {
+            m_throughput += THROUGHPUT_SMOOTHING * (sample - m_throughput);
+        }
+    }
+
+    if (fetched < range.size) {
+        // error or the file has shrunk; do not retry right away
+        m_prefetched_end = range.offset + fetched;
+        m_sequential_reads = 0;
+    }
+}
+
+std::size_t Readahead::window() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_window;
+}
+
+double Readahead::throughput() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_throughput;
+}
+
+}
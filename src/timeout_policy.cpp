@@ -0,0 +1,148 @@
+/**********************************************************************
+File name: timeout_policy.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/timeout_policy.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+namespace Dragonstash {
+
+static std::string normalize_path(std::string_view path)
+{
+    while (!path.empty() && path.front() == '/') {
+        path.remove_prefix(1);
+    }
+    while (!path.empty() && path.back() == '/') {
+        path.remove_suffix(1);
+    }
+    if (path.empty()) {
+        return std::string();
+    }
+    std::string result("/");
+    result.append(path);
+    return result;
+}
+
+static bool parse_seconds(std::string_view str, double &out)
+{
+    if (str.empty()) {
+        return false;
+    }
+    const std::string buf(str);
+    char *end = nullptr;
+    errno = 0;
+    out = std::strtod(buf.c_str(), &end);
+    return errno == 0 && end == buf.c_str() + buf.size() && out >= 0;
+}
+
+TimeoutPolicy::TimeoutPolicy(const Rule &defaults):
+    m_defaults(defaults)
+{
+
+}
+
+void TimeoutPolicy::add_subtree(std::string_view path, const Rule &rule)
+{
+    std::string key = normalize_path(path);
+    if (key.empty()) {
+        m_defaults = rule;
+        return;
+    }
+
+    auto iter = std::find_if(m_subtrees.begin(), m_subtrees.end(),
+                             [&key](const auto &item) { return item.first == key; });
+    if (iter != m_subtrees.end()) {
+        iter->second = rule;
+        return;
+    }
+
+    // longer paths first, so that the first match is the most specific one
+    iter = std::find_if(m_subtrees.begin(), m_subtrees.end(),
+                        [&key](const auto &item) { return item.first.size() < key.size(); });
+    m_subtrees.emplace(iter, std::move(key), rule);
+}
+
+const TimeoutPolicy::Rule &TimeoutPolicy::rule_for(std::string_view path) const
+{
+    for (const auto &[prefix, rule]: m_subtrees) {
+        if (path.size() < prefix.size() ||
+                path.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        if (path.size() == prefix.size() || path[prefix.size()] == '/') {
+            return rule;
+        }
+    }
+    return m_defaults;
+}
+
+bool TimeoutPolicy::is_stable(const Rule &rule,
+                              const struct timespec &mtime,
+                              const struct timespec &now)
+{
+    if (rule.stable_after <= 0) {
+        return false;
+    }
+    const double age = double(now.tv_sec - mtime.tv_sec) +
+            double(now.tv_nsec - mtime.tv_nsec) / 1e9;
+    return age >= rule.stable_after;
+}
+
+TimeoutPolicy::Revalidation TimeoutPolicy::revalidation(const Rule &rule, double age)
+{
+    if (rule.hard_ttl <= 0 || age >= rule.hard_ttl) {
+        return Revalidation::SYNCHRONOUS;
+    }
+    if (age < rule.soft_ttl) {
+        return Revalidation::NONE;
+    }
+    return Revalidation::BACKGROUND;
+}
+
+Result<std::pair<std::string, TimeoutPolicy::Rule>> TimeoutPolicy::parse_subtree(
+        std::string_view spec)
+{
+    const auto eq = spec.rfind('=');
+    if (eq == std::string_view::npos || eq == 0) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    Rule rule;
+    std::string_view values = spec.substr(eq + 1);
+    const auto comma = values.find(',');
+    if (!parse_seconds(values.substr(0, comma), rule.entry_timeout)) {
+        return make_result(FAILED, EINVAL);
+    }
+    rule.attr_timeout = rule.entry_timeout;
+    if (comma != std::string_view::npos &&
+            !parse_seconds(values.substr(comma + 1), rule.stable_after)) {
+        return make_result(FAILED, EINVAL);
+    }
+
+    return std::make_pair(normalize_path(spec.substr(0, eq)), rule);
+}
+
+}
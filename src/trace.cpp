@@ -0,0 +1,264 @@
+/**********************************************************************
+File name: trace.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/trace.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <unistd.h>
+
+namespace Dragonstash::Trace {
+
+const char *phase_name(Phase phase)
+{
+    switch (phase) {
+    case Phase::PATH_WALK:
+        return "path_walk";
+    case Phase::BACKEND_LSTAT:
+        return "backend_lstat";
+    case Phase::EMPLACE:
+        return "emplace";
+    case Phase::LOCK_WAIT:
+        return "lock_wait";
+    case Phase::GROUP_COMMIT:
+        return "group_commit";
+    case Phase::COMMIT:
+        return "commit";
+    }
+    return "unknown";
+}
+
+std::uint32_t thread_number()
+{
+    static std::atomic<std::uint32_t> next_number{1};
+    thread_local const std::uint32_t number =
+            next_number.fetch_add(1, std::memory_order_relaxed);
+    return number;
+}
+
+/* Dragonstash::Trace::Context */
+
+Context::Context(Recorder &recorder, std::uint64_t id, const char *op, bool sampled):
+    m_recorder(recorder),
+    m_sampled(sampled),
+    m_finished(false),
+    m_record{id, op, thread_number(), Clock::now(), Clock::duration::zero(), {}}
+{
+
+}
+
+void Context::add(Phase phase, Clock::time_point start, Clock::time_point end)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_finished) {
+        return;
+    }
+    m_record.events.push_back(Event{phase, thread_number(), start, end - start});
+}
+
+void Context::finish()
+{
+    Record record;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_finished) {
+            return;
+        }
+        m_finished = true;
+        m_record.duration = Clock::now() - m_record.start;
+        record = std::move(m_record);
+    }
+    m_recorder.submit(std::move(record), m_sampled);
+}
+
+/* Dragonstash::Trace::Recorder */
+
+Recorder::Recorder(std::size_t capacity):
+    m_capacity(std::max<std::size_t>(capacity, 1)),
+    m_epoch(Clock::now()),
+    m_sequence(0),
+    m_sample_every(0),
+    m_threshold(0)
+{
+
+}
+
+void Recorder::configure(std::uint64_t sample_every, Clock::duration threshold)
+{
+    m_sample_every.store(sample_every, std::memory_order_relaxed);
+    m_threshold.store(std::max(threshold.count(), Clock::rep(0)),
+                      std::memory_order_relaxed);
+}
+
+bool Recorder::enabled() const
+{
+    return m_sample_every.load(std::memory_order_relaxed) > 0 ||
+            m_threshold.load(std::memory_order_relaxed) > 0;
+}
+
+Handle Recorder::begin(const char *op)
+{
+    const std::uint64_t sample_every = m_sample_every.load(std::memory_order_relaxed);
+    const bool by_threshold = m_threshold.load(std::memory_order_relaxed) > 0;
+    if (sample_every == 0 && !by_threshold) {
+        return nullptr;
+    }
+
+    const std::uint64_t id = m_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    const bool sampled = sample_every > 0 && id % sample_every == 0;
+    if (!sampled && !by_threshold) {
+        return nullptr;
+    }
+    return std::make_shared<Context>(*this, id, op, sampled);
+}
+
+void Recorder::submit(Record &&record, bool sampled)
+{
+    if (!sampled) {
+        const Clock::rep threshold = m_threshold.load(std::memory_order_relaxed);
+        if (threshold <= 0 || record.duration.count() < threshold) {
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_records.size() >= m_capacity) {
+        m_records.pop_front();
+    }
+    m_records.emplace_back(std::move(record));
+}
+
+std::vector<Record> Recorder::records() const
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return std::vector<Record>(m_records.begin(), m_records.end());
+}
+
+void Recorder::clear()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_records.clear();
+}
+
+namespace {
+
+void write_event(std::string &out, const char *name, const char *category,
+                 std::uint32_t thread, double ts, double dur,
+                 std::uint64_t request, int pid)
+{
+    char buf[256];
+    std::snprintf(buf, sizeof(buf),
+                  "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                  "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                  "\"args\":{\"request\":%llu}}",
+                  name, category, pid, unsigned(thread), ts, dur,
+                  static_cast<unsigned long long>(request));
+    out += buf;
+}
+
+}
+
+std::string Recorder::chrome_trace() const
+{
+    using Micros = std::chrono::duration<double, std::micro>;
+
+    const std::vector<Record> snapshot = records();
+    const int pid = int(getpid());
+
+    std::string out("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    for (const Record &record: snapshot) {
+        if (!first) {
+            out += ',';
+        }
+        first = false;
+        write_event(out, record.op, "request", record.thread,
+                    Micros(record.start - m_epoch).count(),
+                    Micros(record.duration).count(),
+                    record.id, pid);
+        for (const Event &event: record.events) {
+            out += ',';
+            write_event(out, phase_name(event.phase), "phase", event.thread,
+                        Micros(event.start - m_epoch).count(),
+                        Micros(event.duration).count(),
+                        record.id, pid);
+        }
+    }
+    out += "]}\n";
+    return out;
+}
+
+#ifdef DRAGONSTASH_TRACING
+
+namespace {
+
+thread_local Context *current_context = nullptr;
+
+}
+
+Context *current()
+{
+    return current_context;
+}
+
+Handle current_handle()
+{
+    return current_context ? current_context->shared_from_this() : nullptr;
+}
+
+/* Dragonstash::Trace::Scope */
+
+Scope::Scope():
+    m_previous(current_context)
+{
+
+}
+
+Scope::Scope(Handle context):
+    m_context(std::move(context)),
+    m_previous(current_context)
+{
+    current_context = m_context.get();
+}
+
+Scope::~Scope()
+{
+    current_context = m_previous;
+}
+
+/* Dragonstash::Trace::Span */
+
+Span::Span(Phase phase):
+    m_context(current_handle()),
+    m_phase(phase)
+{
+    if (m_context) {
+        m_start = Clock::now();
+    }
+}
+
+#endif
+
+}
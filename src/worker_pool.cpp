@@ -0,0 +1,160 @@
+/**********************************************************************
+File name: worker_pool.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "dragonstash/worker_pool.hpp"
+
+namespace Dragonstash {
+
+/* Dragonstash::WorkerPool */
+
+WorkerPool::WorkerPool(std::size_t nthreads, std::size_t max_queued):
+    m_max_queued(max_queued > 0 ? max_queued : nthreads * 4),
+    m_stopping(false)
+{
+    m_threads.reserve(nthreads);
+    for (std::size_t i = 0; i < nthreads; ++i) {
+        m_threads.emplace_back(&WorkerPool::worker, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_work_cv.notify_all();
+    for (auto &thread: m_threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_work_cv.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+        if (m_queue.empty()) {
+            // stopping and nothing left to do
+            return;
+        }
+
+        Task task = std::move(m_queue.front());
+        m_queue.pop_front();
+        lock.unlock();
+        m_space_cv.notify_one();
+        task();
+        lock.lock();
+    }
+}
+
+void WorkerPool::submit(Task &&task)
+{
+    if (m_threads.empty()) {
+        task();
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_space_cv.wait(lock, [this]() { return m_queue.size() < m_max_queued; });
+        m_queue.emplace_back(std::move(task));
+    }
+    m_work_cv.notify_one();
+}
+
+bool WorkerPool::try_submit(Task &&task)
+{
+    if (m_threads.empty()) {
+        task();
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.size() >= m_max_queued) {
+            return false;
+        }
+        m_queue.emplace_back(std::move(task));
+    }
+    m_work_cv.notify_one();
+    return true;
+}
+
+/* Dragonstash::TaskGroup */
+
+TaskGroup::TaskGroup(WorkerPool &pool):
+    m_pool(pool),
+    m_pending(0)
+{
+
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait_all();
+}
+
+void TaskGroup::wait_all()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done_cv.wait(lock, [this]() { return m_pending == 0; });
+}
+
+void TaskGroup::submit(WorkerPool::Task &&task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_pending;
+    }
+    m_pool.submit([this, task = std::move(task)]() {
+        std::exception_ptr exception;
+        try {
+            task();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (exception && !m_exception) {
+            m_exception = exception;
+        }
+        if (--m_pending == 0) {
+            m_done_cv.notify_all();
+        }
+    });
+}
+
+void TaskGroup::wait()
+{
+    wait_all();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_exception) {
+        std::exception_ptr exception = std::move(m_exception);
+        m_exception = nullptr;
+        std::rethrow_exception(exception);
+    }
+}
+
+}
@@ -0,0 +1,152 @@
+/**********************************************************************
+File name: connectivity.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <fcntl.h>
+
+#include "dragonstash/backend/connectivity.hpp"
+#include "dragonstash/backend/in_memory.hpp"
+
+#include "testutils/result.hpp"
+
+using namespace Dragonstash::Backend;
+
+SCENARIO("Connectivity tracking") {
+    InMemoryFilesystem backend;
+    backend.emplace<InMemory::Directory>("dir");
+    backend.emplace<InMemory::File>("file");
+
+    ConnectivityFilesystem::Config config;
+    // probes are run explicitly, unless a test asks for them
+    config.initial_backoff = std::chrono::hours(1);
+    config.max_backoff = std::chrono::hours(4);
+
+    GIVEN("A connected backend") {
+        ConnectivityFilesystem fs(backend, config);
+
+        THEN("Operations are forwarded") {
+            CHECK(fs.state() == ConnectivityFilesystem::State::CONNECTED);
+            check_result_ok(fs.lstat("/dir"));
+            check_result_error(fs.lstat("/nonexistent"), ENOENT);
+            CHECK(fs.state() == ConnectivityFilesystem::State::CONNECTED);
+            CHECK(fs.short_circuited() == 0);
+        }
+
+        WHEN("The backend goes away") {
+            auto handle_result = fs.open_directory("/");
+            require_result_ok(handle_result);
+            auto file_result = fs.open("/file", O_RDONLY, 0);
+            require_result_ok(file_result);
+
+            backend.set_connected(false);
+            check_result_error(fs.lstat("/dir"), ENOTCONN);
+
+            THEN("The state switches to disconnected") {
+                CHECK(fs.state() == ConnectivityFilesystem::State::DISCONNECTED);
+                CHECK(fs.disconnects() == 1);
+            }
+
+            THEN("Further operations fail without asking the backend") {
+                backend.set_connected(true);
+                check_result_error(fs.lstat("/dir"), ENOTCONN);
+                check_result_error(fs.opendir("/dir"), ENOTCONN);
+                check_result_error(fs.readlink("/file"), ENOTCONN);
+                check_result_error((*handle_result)->lstat("dir"), ENOTCONN);
+                check_result_error((*file_result)->fstat(), ENOTCONN);
+                CHECK(fs.short_circuited() == 5);
+            }
+
+            AND_WHEN("A probe fails") {
+                const auto backoff = fs.backoff();
+                CHECK(!fs.probe());
+
+                THEN("The backend stays disconnected") {
+                    CHECK(fs.state() == ConnectivityFilesystem::State::DISCONNECTED);
+                    CHECK(fs.probes() == 1);
+                    CHECK(fs.reconnects() == 0);
+                }
+
+                THEN("The backoff is unchanged by explicit probes") {
+                    CHECK(fs.backoff() == backoff);
+                }
+            }
+
+            AND_WHEN("The backend returns and is probed") {
+                backend.set_connected(true);
+                CHECK(fs.probe());
+
+                THEN("The state switches back") {
+                    CHECK(fs.state() == ConnectivityFilesystem::State::CONNECTED);
+                    CHECK(fs.reconnects() == 1);
+                }
+
+                THEN("Operations are forwarded again") {
+                    check_result_ok(fs.lstat("/dir"));
+                    check_result_ok((*handle_result)->lstat("dir"));
+                }
+            }
+        }
+    }
+
+    GIVEN("A backend which is known to be down") {
+        backend.set_connected(false);
+        config.initial_state = ConnectivityFilesystem::State::DISCONNECTED;
+
+        WHEN("Probing in the background with a short backoff") {
+            config.initial_backoff = std::chrono::milliseconds(1);
+            config.max_backoff = std::chrono::milliseconds(8);
+            ConnectivityFilesystem fs(backend, config);
+
+            THEN("The backoff grows up to the limit") {
+                while (fs.probes() < 6) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                CHECK(fs.backoff() == std::chrono::milliseconds(8));
+                CHECK(fs.state() == ConnectivityFilesystem::State::DISCONNECTED);
+            }
+
+            AND_WHEN("The backend returns") {
+                backend.set_connected(true);
+
+                THEN("The state switches back automatically") {
+                    CHECK(fs.wait_connected(std::chrono::seconds(10)));
+                    CHECK(fs.reconnects() == 1);
+                    check_result_ok(fs.lstat("/dir"));
+                }
+            }
+        }
+
+        WHEN("No probe has been run yet") {
+            ConnectivityFilesystem fs(backend, config);
+
+            THEN("Operations fail right away") {
+                CHECK(fs.state() == ConnectivityFilesystem::State::DISCONNECTED);
+                CHECK(!fs.wait_connected(std::chrono::milliseconds(1)));
+                check_result_error(fs.lstat("/dir"), ENOTCONN);
+                CHECK(fs.short_circuited() == 1);
+            }
+        }
+    }
+}
@@ -0,0 +1,203 @@
+/**********************************************************************
+File name: fault_injection.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <future>
+
+#include <fcntl.h>
+
+#include "dragonstash/backend/fault_injection.hpp"
+#include "dragonstash/backend/in_memory.hpp"
+
+#include "testutils/result.hpp"
+
+using namespace Dragonstash::Backend;
+using Dragonstash::Result;
+using Clock = std::chrono::steady_clock;
+
+SCENARIO("Fault injection") {
+    InMemoryFilesystem backend;
+    backend.emplace<InMemory::Directory>("dir");
+    auto &file = backend.emplace<InMemory::File>("file");
+    file.data().assign(64 * 1024, std::byte(0));
+    file.update_attr(Stat{.mode = S_IFREG | S_IRUSR, .size = 64 * 1024});
+
+    FaultInjectingFilesystem::Config config;
+
+    GIVEN("No faults") {
+        FaultInjectingFilesystem fs(backend, config);
+
+        THEN("Operations are forwarded") {
+            check_result_ok(fs.lstat("/dir"));
+            check_result_error(fs.lstat("/nonexistent"), ENOENT);
+            CHECK(fs.injected_failures() == 0);
+        }
+    }
+
+    GIVEN("A latency") {
+        config.latency = std::chrono::milliseconds(20);
+        FaultInjectingFilesystem fs(backend, config);
+
+        WHEN("Calling lstat") {
+            const auto start = Clock::now();
+            auto result = fs.lstat("/dir");
+            const auto elapsed = Clock::now() - start;
+
+            THEN("The result is delayed") {
+                check_result_ok(result);
+                CHECK(elapsed >= std::chrono::milliseconds(20));
+            }
+        }
+
+        WHEN("Calling lstat_async") {
+            std::promise<Result<Stat>> promise;
+            auto future = promise.get_future();
+            const auto start = Clock::now();
+            fs.lstat_async("/dir", [&promise](Result<Stat> result) {
+                promise.set_value(std::move(result));
+            });
+            const auto returned = Clock::now() - start;
+            auto result = future.get();
+            const auto elapsed = Clock::now() - start;
+
+            THEN("The caller is not blocked, but the completion is delayed") {
+                CHECK(returned < std::chrono::milliseconds(20));
+                CHECK(elapsed >= std::chrono::milliseconds(20));
+                check_result_ok(result);
+            }
+        }
+
+        WHEN("The filesystem is destroyed with a completion pending") {
+            bool called = false;
+            {
+                FaultInjectingFilesystem pending(backend, config);
+                pending.lstat_async("/dir", [&called](Result<Stat>) {
+                    called = true;
+                });
+            }
+
+            THEN("The completion is still called") {
+                CHECK(called);
+            }
+        }
+    }
+
+    GIVEN("A bandwidth") {
+        config.bandwidth = 1024 * 1024;
+        FaultInjectingFilesystem fs(backend, config);
+        auto open_result = fs.open("/file", O_RDONLY, 0);
+        require_result_ok(open_result);
+
+        WHEN("Reading") {
+            std::vector<char> buf(64 * 1024);
+            const auto start = Clock::now();
+            auto read_result = (*open_result)->pread(buf.data(), buf.size(), 0);
+            const auto elapsed = Clock::now() - start;
+
+            THEN("The data takes its time to pass the link") {
+                require_result_ok(read_result);
+                CHECK(std::size_t(*read_result) == buf.size());
+                // 64 KiB at 1 MiB/s
+                CHECK(elapsed >= std::chrono::milliseconds(60));
+            }
+        }
+    }
+
+    GIVEN("A failure rate of one") {
+        config.failure_rate = 1.;
+
+        WHEN("Without flaps") {
+            FaultInjectingFilesystem fs(backend, config);
+
+            THEN("All operations fail with ENOTCONN") {
+                check_result_error(fs.lstat("/dir"), ENOTCONN);
+                check_result_error(fs.opendir("/dir"), ENOTCONN);
+                check_result_error(fs.open("/file", O_RDONLY, 0), ENOTCONN);
+                CHECK(fs.injected_failures() == 3);
+                CHECK(fs.flaps() == 0);
+            }
+        }
+    }
+
+    GIVEN("A failure rate with long flaps") {
+        config.failure_rate = 0.5;
+        config.flap_duration = std::chrono::hours(1);
+        FaultInjectingFilesystem fs(backend, config);
+
+        WHEN("An operation has failed") {
+            while (fs.lstat("/dir")) {
+            }
+
+            THEN("The backend stays down") {
+                for (int i = 0; i < 20; ++i) {
+                    check_result_error(fs.lstat("/dir"), ENOTCONN);
+                }
+                CHECK(fs.flaps() == 1);
+                CHECK(fs.injected_failures() == 21);
+            }
+        }
+    }
+
+}
+
+SCENARIO("Fault injection configuration parsing") {
+    GIVEN("A full specification") {
+        auto result = FaultInjectingFilesystem::parse_config(
+                    "latency=50,jitter=2.5,distribution=exponential,bandwidth=1024,failure=0.01,flap=5000,seed=7");
+
+        THEN("All values are taken") {
+            require_result_ok(result);
+            CHECK(result->latency == std::chrono::milliseconds(50));
+            CHECK(result->jitter == std::chrono::microseconds(2500));
+            CHECK(result->jitter_distribution == FaultInjectingFilesystem::Jitter::EXPONENTIAL);
+            CHECK(result->bandwidth == 1024 * 1024);
+            CHECK(result->failure_rate == Approx(0.01));
+            CHECK(result->flap_duration == std::chrono::seconds(5));
+            CHECK(result->seed == 7);
+        }
+    }
+
+    GIVEN("An empty specification") {
+        auto result = FaultInjectingFilesystem::parse_config("");
+
+        THEN("Nothing is injected") {
+            require_result_ok(result);
+            CHECK(result->latency.count() == 0);
+            CHECK(result->failure_rate == 0);
+        }
+    }
+
+    GIVEN("Malformed specifications") {
+        THEN("They are rejected") {
+            check_result_error(FaultInjectingFilesystem::parse_config("latency"), EINVAL);
+            check_result_error(FaultInjectingFilesystem::parse_config("latency=fast"), EINVAL);
+            check_result_error(FaultInjectingFilesystem::parse_config("latency=-1"), EINVAL);
+            check_result_error(FaultInjectingFilesystem::parse_config("failure=2"), EINVAL);
+            check_result_error(FaultInjectingFilesystem::parse_config("distribution=normal"), EINVAL);
+            check_result_error(FaultInjectingFilesystem::parse_config("colour=blue"), EINVAL);
+        }
+    }
+}
@@ -0,0 +1,156 @@
+/**********************************************************************
+File name: handle_table.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include "dragonstash/backend/handle_table.hpp"
+
+using namespace Dragonstash;
+using namespace Dragonstash::Backend;
+
+namespace {
+
+class CountingHandle: public DirectoryHandle {
+public:
+    explicit CountingHandle(int &alive):
+        m_alive(alive)
+    {
+        ++m_alive;
+    }
+
+    ~CountingHandle() override
+    {
+        --m_alive;
+    }
+
+private:
+    int &m_alive;
+
+public:
+    Result<std::unique_ptr<File>> open(std::string_view, int, mode_t) override
+    {
+        return make_result(FAILED, ENOSYS);
+    }
+
+    Result<std::unique_ptr<Dir>> opendir() override
+    {
+        return make_result(FAILED, ENOSYS);
+    }
+
+    Result<Stat> lstat(std::string_view) override
+    {
+        return make_result(FAILED, ENOSYS);
+    }
+
+    Result<std::string> readlink(std::string_view) override
+    {
+        return make_result(FAILED, ENOSYS);
+    }
+};
+
+}
+
+SCENARIO("Backend handle table") {
+    GIVEN("A table with a capacity of two") {
+        HandleTable table(2);
+        int alive = 0;
+
+        WHEN("Looking up a key which has not been inserted") {
+            THEN("It returns nullptr") {
+                CHECK(table.get(1) == nullptr);
+            }
+        }
+
+        WHEN("Inserting three handles") {
+            auto h1 = std::make_shared<CountingHandle>(alive);
+            DirectoryHandle *h1_raw = h1.get();
+            table.put(1, std::move(h1));
+            table.put(2, std::make_shared<CountingHandle>(alive));
+            // touch 1 so that 2 is the least recently used
+            CHECK(table.get(1).get() == h1_raw);
+            table.put(3, std::make_shared<CountingHandle>(alive));
+
+            THEN("The least recently used handle is evicted and closed") {
+                CHECK(table.size() == 2);
+                CHECK(alive == 2);
+                CHECK(table.get(1).get() == h1_raw);
+                CHECK(table.get(2) == nullptr);
+                CHECK(table.get(3) != nullptr);
+            }
+        }
+
+        WHEN("Invalidating a handle which is in use") {
+            table.put(1, std::make_shared<CountingHandle>(alive));
+            auto in_use = table.get(1);
+            table.invalidate(1);
+
+            THEN("It is removed from the table, but kept open for the user") {
+                CHECK(table.get(1) == nullptr);
+                CHECK(table.size() == 0);
+                CHECK(alive == 1);
+                in_use.reset();
+                CHECK(alive == 0);
+            }
+        }
+
+        WHEN("Replacing a handle") {
+            table.put(1, std::make_shared<CountingHandle>(alive));
+            auto replacement = std::make_shared<CountingHandle>(alive);
+            DirectoryHandle *replacement_raw = replacement.get();
+            table.put(1, std::move(replacement));
+
+            THEN("The old handle is closed and the new one is returned") {
+                CHECK(alive == 1);
+                CHECK(table.size() == 1);
+                CHECK(table.get(1).get() == replacement_raw);
+            }
+        }
+
+        WHEN("Marking a handle as checked") {
+            table.put(1, std::make_shared<CountingHandle>(alive));
+            HandleTable::Clock::time_point put_at;
+            REQUIRE(table.get(1, put_at) != nullptr);
+            const auto before = HandleTable::Clock::now();
+            table.mark_checked(1);
+
+            THEN("The time of the check is returned with the handle") {
+                HandleTable::Clock::time_point checked;
+                REQUIRE(table.get(1, checked) != nullptr);
+                CHECK(put_at <= before);
+                CHECK(checked >= before);
+            }
+        }
+
+        WHEN("Clearing the table") {
+            table.put(1, std::make_shared<CountingHandle>(alive));
+            table.put(2, std::make_shared<CountingHandle>(alive));
+            table.clear();
+
+            THEN("All handles are closed") {
+                CHECK(table.size() == 0);
+                CHECK(alive == 0);
+            }
+        }
+    }
+}
@@ -27,7 +27,10 @@ authors named in the AUTHORS file.
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <chrono>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "dragonstash/backend/in_memory.hpp"
 
@@ -269,6 +272,100 @@ SCENARIO("Directory iteration") {
                     CHECK(entries[1].name == "f1");
                 }
             }
+
+            THEN("The child entries are complete") {
+                // skip . and ..
+                REQUIRE(handle.readdir());
+                REQUIRE(handle.readdir());
+
+                Dragonstash::Result<DirEntry> readdir_result = handle.readdir();
+                while (readdir_result) {
+                    CHECK(readdir_result->complete);
+                    if (readdir_result->name == "d1") {
+                        CHECK(readdir_result->mode == d1.attr().mode);
+                    } else {
+                        CHECK(readdir_result->mode == f1.attr().mode);
+                    }
+                    readdir_result = handle.readdir();
+                }
+            }
+        }
+
+        WHEN("Calling lstat_entry on the directory handle") {
+            auto opendir_result = fs.opendir("/");
+            REQUIRE(opendir_result);
+            auto &handle = **opendir_result;
+
+            THEN("It returns the attributes of existing entries") {
+                auto lstat_result = handle.lstat_entry("f1");
+                CHECK(lstat_result.error() == 0);
+                REQUIRE(lstat_result);
+                CHECK((lstat_result->mode & S_IFMT) == S_IFREG);
+            }
+
+            THEN("It fails with ENOENT for nonexistent entries") {
+                auto lstat_result = handle.lstat_entry("foo");
+                CHECK(!lstat_result);
+                CHECK(lstat_result.error() == ENOENT);
+            }
+        }
+    }
+}
+
+SCENARIO("Directory handles") {
+    InMemoryFilesystem fs;
+
+    GIVEN("An fs with a nested file and link") {
+        auto &d1 = fs.emplace<InMemory::Directory>("d1");
+        d1.emplace<InMemory::File>("f1");
+        d1.emplace<InMemory::Link>("l1", "f1");
+
+        WHEN("Opening a handle on the directory") {
+            auto handle_result = fs.open_directory("/d1");
+            CHECK(handle_result.error() == 0);
+            REQUIRE(handle_result);
+            auto &handle = **handle_result;
+
+            THEN("lstat works relative to the directory") {
+                auto lstat_result = handle.lstat("f1");
+                CHECK(lstat_result.error() == 0);
+                REQUIRE(lstat_result);
+                CHECK((lstat_result->mode & S_IFMT) == S_IFREG);
+            }
+
+            THEN("readlink works relative to the directory") {
+                auto readlink_result = handle.readlink("l1");
+                CHECK(readlink_result.error() == 0);
+                REQUIRE(readlink_result);
+                CHECK(*readlink_result == "f1");
+            }
+
+            THEN("open works relative to the directory") {
+                auto open_result = handle.open("f1", O_RDONLY, 0);
+                CHECK(open_result.error() == 0);
+                CHECK(open_result);
+            }
+
+            THEN("The directory can be iterated") {
+                auto opendir_result = handle.opendir();
+                CHECK(opendir_result.error() == 0);
+                CHECK(opendir_result);
+            }
+
+            THEN("Names which are not direct children are rejected") {
+                CHECK(handle.lstat("").error() == EINVAL);
+                CHECK(handle.lstat(".").error() == EINVAL);
+                CHECK(handle.lstat("..").error() == EINVAL);
+                CHECK(handle.lstat("f1/foo").error() == EINVAL);
+            }
+
+            AND_WHEN("The backend is disconnected") {
+                fs.set_connected(false);
+
+                THEN("Operations fail with ENOTCONN") {
+                    CHECK(handle.lstat("f1").error() == ENOTCONN);
+                }
+            }
         }
     }
 }
@@ -568,3 +665,67 @@ SCENARIO("Entry removal") {
         }
     }
 }
+
+SCENARIO("Emulated network link") {
+    using Clock = std::chrono::steady_clock;
+    InMemoryFilesystem fs;
+    auto &file = fs.emplace<InMemory::File>("f1");
+    file.data().assign(64 * 1024, std::byte(0));
+    file.update_attr(Stat{.mode = S_IFREG | S_IRUSR, .size = 64 * 1024});
+
+    GIVEN("A link with a latency") {
+        fs.network().configure(InMemory::Network::Config{
+            .latency = std::chrono::milliseconds(20),
+        });
+
+        WHEN("Calling lstat") {
+            const auto start = Clock::now();
+            auto lstat_result = fs.lstat("/f1");
+            const auto elapsed = Clock::now() - start;
+
+            THEN("The call waits for the round trip") {
+                CHECK(lstat_result);
+                CHECK(elapsed >= std::chrono::milliseconds(20));
+            }
+        }
+
+        WHEN("Calling lstat from several threads at once") {
+            const auto start = Clock::now();
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 4; ++i) {
+                threads.emplace_back([&fs]() { (void)fs.lstat("/f1"); });
+            }
+            for (auto &thread: threads) {
+                thread.join();
+            }
+            const auto elapsed = Clock::now() - start;
+
+            THEN("The requests wait concurrently") {
+                CHECK(elapsed >= std::chrono::milliseconds(20));
+                CHECK(elapsed < std::chrono::milliseconds(80));
+            }
+        }
+    }
+
+    GIVEN("A link with a bandwidth") {
+        fs.network().configure(InMemory::Network::Config{
+            .bandwidth = 1024 * 1024,
+        });
+        auto open_result = fs.open("/f1", O_RDONLY, 0);
+        REQUIRE(open_result);
+
+        WHEN("Reading from the file") {
+            std::vector<char> buf(64 * 1024);
+            const auto start = Clock::now();
+            auto read_result = (*open_result)->pread(buf.data(), buf.size(), 0);
+            const auto elapsed = Clock::now() - start;
+
+            THEN("The data takes its time to pass the link") {
+                REQUIRE(read_result);
+                CHECK(*read_result == buf.size());
+                // 64 KiB at 1 MiB/s
+                CHECK(elapsed >= std::chrono::milliseconds(60));
+            }
+        }
+    }
+}
@@ -0,0 +1,346 @@
+/**********************************************************************
+File name: sftp.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <future>
+#include <set>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dragonstash/backend/in_memory.hpp"
+#include "dragonstash/backend/sftp.hpp"
+
+#include "testutils/result.hpp"
+#include "testutils/sftp_server.hpp"
+
+using namespace Dragonstash::Backend;
+
+static std::basic_string<std::byte> pattern(std::size_t size)
+{
+    std::basic_string<std::byte> result(size, std::byte(0));
+    for (std::size_t i = 0; i < size; ++i) {
+        result[i] = std::byte(i * 7 + i / 251);
+    }
+    return result;
+}
+
+SCENARIO("SFTP backend") {
+    InMemoryFilesystem backend;
+    const auto contents = pattern(100000);
+    {
+        auto &file = backend.emplace<InMemory::File>("data.bin");
+        file.data() = contents;
+        file.attr().size = contents.size();
+        file.attr().mtime.tv_sec = 1536390000;
+        auto &dir = backend.emplace<InMemory::Directory>("books");
+        for (int i = 0; i < 20; ++i) {
+            dir.emplace<InMemory::File>("book" + std::to_string(i) + ".epub");
+        }
+        backend.emplace<InMemory::Link>("latest", "books/book19.epub");
+    }
+
+    TestSftpServer server(backend);
+    SftpFilesystem::Config config;
+    config.connections = 2;
+    config.chunk_size = 4096;
+    config.max_outstanding = 8;
+    SftpFilesystem fs(server.connector(), config);
+
+    GIVEN("A connected filesystem") {
+        WHEN("Entries are stat-ed") {
+            THEN("The attributes of the server are returned") {
+                auto stat_result = fs.lstat("/data.bin");
+                require_result_ok(stat_result);
+                CHECK(S_ISREG(stat_result->mode));
+                CHECK(stat_result->size == contents.size());
+                CHECK(stat_result->mtime.tv_sec == 1536390000);
+            }
+
+            THEN("The root is a directory") {
+                auto stat_result = fs.lstat("/");
+                require_result_ok(stat_result);
+                CHECK(S_ISDIR(stat_result->mode));
+            }
+
+            THEN("Missing entries fail with ENOENT") {
+                check_result_error(fs.lstat("/missing"), ENOENT);
+            }
+
+            THEN("Relative paths are rejected") {
+                check_result_error(fs.lstat("data.bin"), EINVAL);
+            }
+        }
+
+        WHEN("Entries are stat-ed asynchronously") {
+            std::promise<Dragonstash::Result<Stat>> found;
+            std::promise<Dragonstash::Result<Stat>> missing;
+            auto found_future = found.get_future();
+            auto missing_future = missing.get_future();
+            fs.lstat_async("/data.bin", [&found](Dragonstash::Result<Stat> result) {
+                found.set_value(std::move(result));
+            });
+            fs.lstat_async("/missing", [&missing](Dragonstash::Result<Stat> result) {
+                missing.set_value(std::move(result));
+            });
+
+            THEN("The results are delivered") {
+                auto stat_result = found_future.get();
+                require_result_ok(stat_result);
+                CHECK(stat_result->size == contents.size());
+                check_result_error(missing_future.get(), ENOENT);
+            }
+        }
+
+        WHEN("A link is read") {
+            auto link_result = fs.readlink("/latest");
+
+            THEN("Its destination is returned") {
+                require_result_ok(link_result);
+                CHECK(*link_result == "books/book19.epub");
+            }
+        }
+
+        WHEN("A directory is listed") {
+            auto dir_result = fs.opendir("/books");
+            require_result_ok(dir_result);
+            std::set<std::string> names;
+            bool all_complete = true;
+            while (true) {
+                auto entry = (*dir_result)->readdir();
+                if (!entry) {
+                    CHECK(entry.error() == 0);
+                    break;
+                }
+                if (entry->name == "." || entry->name == "..") {
+                    continue;
+                }
+                all_complete = all_complete && entry->complete && S_ISREG(entry->mode);
+                names.insert(entry->name);
+            }
+            check_result_ok((*dir_result)->closedir());
+
+            THEN("All entries are returned over several replies") {
+                CHECK(names.size() == 20);
+                CHECK(names.count("book0.epub") == 1);
+                CHECK(names.count("book19.epub") == 1);
+                CHECK(server.requests(Sftp::PacketType::READDIR) >= 3);
+            }
+
+            THEN("The entries come with complete attributes") {
+                CHECK(all_complete);
+                CHECK(server.requests(Sftp::PacketType::LSTAT) == 0);
+            }
+        }
+
+        WHEN("Entries are stat-ed through a directory stream") {
+            auto dir_result = fs.opendir("/books");
+            require_result_ok(dir_result);
+
+            THEN("They are resolved relative to the directory") {
+                auto stat_result = (*dir_result)->lstat_entry("book3.epub");
+                require_result_ok(stat_result);
+                CHECK(S_ISREG(stat_result->mode));
+                check_result_error((*dir_result)->lstat_entry("../data.bin"), EINVAL);
+            }
+        }
+
+        WHEN("A file is read") {
+            server.set_read_batch(config.max_outstanding);
+            auto file_result = fs.open("/data.bin", O_RDONLY, 0);
+            require_result_ok(file_result);
+            auto &file = **file_result;
+
+            THEN("The whole file can be read in one call") {
+                std::basic_string<std::byte> buf(contents.size() + 1000, std::byte(0));
+                auto read_result = file.pread(buf.data(), buf.size(), 0);
+                require_result_ok(read_result);
+                CHECK(std::size_t(*read_result) == contents.size());
+                buf.resize(contents.size());
+                CHECK(buf == contents);
+            }
+
+            THEN("Several chunks are requested without waiting for each") {
+                std::basic_string<std::byte> buf(contents.size(), std::byte(0));
+                auto read_result = file.pread(buf.data(), buf.size(), 0);
+                require_result_ok(read_result);
+                CHECK(server.max_pending_reads() == config.max_outstanding);
+            }
+
+            THEN("Reads across the end of the file are short") {
+                std::basic_string<std::byte> buf(10000, std::byte(0));
+                auto read_result = file.pread(buf.data(), buf.size(), contents.size() - 100);
+                require_result_ok(read_result);
+                CHECK(*read_result == 100);
+                CHECK(buf.substr(0, 100) == contents.substr(contents.size() - 100));
+            }
+
+            THEN("Reads past the end of the file return nothing") {
+                std::basic_string<std::byte> buf(10, std::byte(0));
+                auto read_result = file.pread(buf.data(), buf.size(), contents.size() + 10);
+                require_result_ok(read_result);
+                CHECK(*read_result == 0);
+            }
+
+            THEN("The attributes can be obtained from the open file") {
+                auto stat_result = file.fstat();
+                require_result_ok(stat_result);
+                CHECK(stat_result->size == contents.size());
+            }
+
+            THEN("Closing it succeeds") {
+                check_result_ok(file.close());
+            }
+        }
+
+        WHEN("Opening files while others are open") {
+            auto first = fs.open("/data.bin", O_RDONLY, 0);
+            auto second = fs.open("/data.bin", O_RDONLY, 0);
+            auto third = fs.open("/data.bin", O_RDONLY, 0);
+            require_result_ok(first);
+            require_result_ok(second);
+            require_result_ok(third);
+
+            THEN("The pool grows up to its limit") {
+                CHECK(fs.sessions() == 2);
+                CHECK(server.connections() == 2);
+            }
+        }
+
+        WHEN("Opening files one after another") {
+            for (int i = 0; i < 3; ++i) {
+                auto file = fs.open("/data.bin", O_RDONLY, 0);
+                require_result_ok(file);
+                check_result_ok((*file)->close());
+            }
+
+            THEN("The idle session is re-used") {
+                CHECK(fs.sessions() == 1);
+            }
+        }
+
+        WHEN("The connection breaks") {
+            require_result_ok(fs.lstat("/"));
+            auto file_result = fs.open("/data.bin", O_RDONLY, 0);
+            require_result_ok(file_result);
+            server.set_reachable(false);
+            server.disconnect_all();
+
+            THEN("Open files fail with ENOTCONN") {
+                std::byte buf[16];
+                check_result_error((*file_result)->pread(buf, sizeof(buf), 0), ENOTCONN);
+            }
+
+            THEN("Operations fail with ENOTCONN while the server is unreachable") {
+                // the first request may still find the old session until
+                // the reader notices
+                (void)fs.lstat("/");
+                check_result_error(fs.lstat("/"), ENOTCONN);
+            }
+
+            THEN("Asynchronous operations fail with ENOTCONN") {
+                (void)fs.lstat("/");
+                std::promise<Dragonstash::Result<Stat>> done;
+                auto future = done.get_future();
+                fs.lstat_async("/", [&done](Dragonstash::Result<Stat> result) {
+                    done.set_value(std::move(result));
+                });
+                check_result_error(future.get(), ENOTCONN);
+            }
+
+            AND_WHEN("The server becomes reachable again") {
+                (void)fs.lstat("/");
+                server.set_reachable(true);
+
+                THEN("A new session is connected") {
+                    require_result_ok(fs.lstat("/data.bin"));
+                    CHECK(server.connections() >= 2);
+                }
+            }
+        }
+    }
+
+    GIVEN("A filesystem rooted at a subdirectory") {
+        SftpFilesystem::Config rooted_config;
+        rooted_config.root = "books";
+        SftpFilesystem rooted(server.connector(), rooted_config);
+
+        THEN("Paths are resolved below it") {
+            CHECK(*rooted.remote_path("/") == "books");
+            CHECK(*rooted.remote_path("/book1.epub") == "books/book1.epub");
+            require_result_ok(rooted.lstat("/book1.epub"));
+        }
+
+        THEN("Without a root, paths are relative to the login directory") {
+            CHECK(*fs.remote_path("/") == ".");
+            CHECK(*fs.remote_path("/books/") == "books");
+        }
+    }
+}
+
+TEST_CASE("SFTP URLs are parsed", "[sftp]")
+{
+    SECTION("URL with user, port and path") {
+        auto result = SftpFilesystem::parse_url("sftp://alice@example.com:2222/srv/data");
+        require_result_ok(result);
+        CHECK(result->root == "/srv/data");
+        CHECK(result->command == std::vector<std::string>{
+                  "ssh", "-x", "-a", "-o", "ClearAllForwardings=yes",
+                  "-p", "2222", "alice@example.com", "-s", "sftp"});
+    }
+
+    SECTION("URL without path") {
+        auto result = SftpFilesystem::parse_url("sftp://example.com");
+        require_result_ok(result);
+        CHECK(result->root.empty());
+        CHECK(result->command.at(5) == "example.com");
+    }
+
+    SECTION("scp-like target") {
+        auto result = SftpFilesystem::parse_url("bob@host:media");
+        require_result_ok(result);
+        CHECK(result->root == "media");
+        CHECK(result->command.at(5) == "bob@host");
+    }
+
+    SECTION("Malformed URLs") {
+        check_result_error(SftpFilesystem::parse_url("example.com"), EINVAL);
+        check_result_error(SftpFilesystem::parse_url("sftp://"), EINVAL);
+        check_result_error(SftpFilesystem::parse_url("sftp://host:/x"), EINVAL);
+        check_result_error(SftpFilesystem::parse_url("sftp://host:99999"), EINVAL);
+        check_result_error(SftpFilesystem::parse_url("-oProxyCommand=x:path"), EINVAL);
+        check_result_error(SftpFilesystem::parse_url("@host:path"), EINVAL);
+    }
+}
+
+TEST_CASE("SFTP sessions of a command which does not speak SFTP fail", "[sftp]")
+{
+    auto connector = SftpFilesystem::command_connector({"true"});
+    check_result_error(connector(), ENOTCONN);
+
+    SftpFilesystem fs(SftpFilesystem::command_connector({"true"}));
+    check_result_error(fs.lstat("/"), ENOTCONN);
+    CHECK(fs.sessions() == 0);
+}
@@ -0,0 +1,173 @@
+/**********************************************************************
+File name: sftp_protocol.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dragonstash/backend/sftp_protocol.hpp"
+
+using namespace Dragonstash::Backend;
+
+SCENARIO("SFTP packet encoding") {
+    GIVEN("An encoder") {
+        Sftp::Encoder encoder;
+
+        WHEN("Integers and strings are appended") {
+            encoder.u8(0x12).u32(0x01020304).u64(0x05060708090a0b0cull).string("ab");
+
+            THEN("They are encoded big endian with length prefixed strings") {
+                const std::string expected("\x12"
+                                           "\x01\x02\x03\x04"
+                                           "\x05\x06\x07\x08\x09\x0a\x0b\x0c"
+                                           "\x00\x00\x00\x02" "ab", 19);
+                CHECK(encoder.data() == expected);
+            }
+
+            THEN("They can be decoded again") {
+                Sftp::Decoder decoder(encoder.data());
+                std::uint8_t u8 = 0;
+                std::uint32_t u32 = 0;
+                std::uint64_t u64 = 0;
+                std::string_view str;
+                REQUIRE(decoder.u8(u8));
+                REQUIRE(decoder.u32(u32));
+                REQUIRE(decoder.u64(u64));
+                REQUIRE(decoder.string(str));
+                CHECK(u8 == 0x12);
+                CHECK(u32 == 0x01020304);
+                CHECK(u64 == 0x05060708090a0b0cull);
+                CHECK(str == "ab");
+                CHECK(decoder.at_end());
+                CHECK(!decoder.u8(u8));
+            }
+        }
+
+        WHEN("Attributes are appended") {
+            Stat attr{};
+            attr.mode = S_IFREG | 0644;
+            attr.size = 1234567890123ull;
+            attr.uid = 1000;
+            attr.gid = 100;
+            attr.atime.tv_sec = 1536390000;
+            attr.atime.tv_nsec = 500;
+            attr.mtime.tv_sec = 1536390001;
+            encoder.attrs(attr, Sftp::ATTR_ALL);
+
+            THEN("All fields are decoded, with the mtime as ctime") {
+                Sftp::Decoder decoder(encoder.data());
+                Stat decoded{};
+                std::uint32_t flags = 0;
+                REQUIRE(decoder.attrs(decoded, flags));
+                CHECK(flags == Sftp::ATTR_ALL);
+                CHECK(decoded.mode == attr.mode);
+                CHECK(decoded.size == attr.size);
+                CHECK(decoded.uid == 1000);
+                CHECK(decoded.gid == 100);
+                CHECK(decoded.atime.tv_sec == 1536390000);
+                CHECK(decoded.atime.tv_nsec == 0);
+                CHECK(decoded.mtime.tv_sec == 1536390001);
+                CHECK(decoded.ctime.tv_sec == 1536390001);
+                CHECK(decoder.at_end());
+            }
+        }
+
+        WHEN("Only some attributes are appended") {
+            Stat attr{};
+            attr.mode = S_IFDIR | 0755;
+            attr.size = 4096;
+            encoder.attrs(attr, Sftp::ATTR_PERMISSIONS);
+
+            THEN("The others are decoded as zero") {
+                Sftp::Decoder decoder(encoder.data());
+                Stat decoded{};
+                std::uint32_t flags = 0;
+                REQUIRE(decoder.attrs(decoded, flags));
+                CHECK(flags == Sftp::ATTR_PERMISSIONS);
+                CHECK(decoded.mode == attr.mode);
+                CHECK(decoded.size == 0);
+                CHECK(decoder.at_end());
+            }
+        }
+    }
+
+    GIVEN("Attributes with extended entries") {
+        Sftp::Encoder encoder;
+        encoder.u32(Sftp::ATTR_SIZE | Sftp::ATTR_EXTENDED).u64(42)
+                .u32(1).string("foo@example.com").string("bar")
+                .string("after");
+
+        THEN("The extended entries are skipped") {
+            Sftp::Decoder decoder(encoder.data());
+            Stat decoded{};
+            std::uint32_t flags = 0;
+            REQUIRE(decoder.attrs(decoded, flags));
+            CHECK(decoded.size == 42);
+            std::string_view str;
+            REQUIRE(decoder.string(str));
+            CHECK(str == "after");
+        }
+    }
+
+    GIVEN("Truncated data") {
+        Sftp::Encoder encoder;
+        encoder.string("abcdef");
+        const std::string truncated = encoder.data().substr(0, 7);
+
+        THEN("Strings cannot be decoded") {
+            Sftp::Decoder decoder(truncated);
+            std::string_view str;
+            CHECK(!decoder.string(str));
+        }
+
+        THEN("Wider integers cannot be decoded") {
+            Sftp::Decoder decoder(std::string_view(truncated.data(), 3));
+            std::uint32_t u32 = 0;
+            CHECK(!decoder.u32(u32));
+        }
+    }
+}
+
+TEST_CASE("SFTP status and flag mapping", "[sftp]")
+{
+    SECTION("Status codes") {
+        CHECK(Sftp::status_to_errno(uint32_t(Sftp::Status::OK)) == 0);
+        CHECK(Sftp::status_to_errno(uint32_t(Sftp::Status::NO_SUCH_FILE)) == ENOENT);
+        CHECK(Sftp::status_to_errno(uint32_t(Sftp::Status::PERMISSION_DENIED)) == EACCES);
+        CHECK(Sftp::status_to_errno(uint32_t(Sftp::Status::CONNECTION_LOST)) == ENOTCONN);
+        CHECK(Sftp::status_to_errno(uint32_t(Sftp::Status::OP_UNSUPPORTED)) == ENOSYS);
+        CHECK(Sftp::status_to_errno(1000) == EIO);
+        CHECK(Sftp::errno_to_status(ENOENT) == Sftp::Status::NO_SUCH_FILE);
+        CHECK(Sftp::errno_to_status(EISDIR) == Sftp::Status::FAILURE);
+    }
+
+    SECTION("Open flags") {
+        CHECK(Sftp::open_flags(O_RDONLY) == Sftp::OPEN_READ);
+        CHECK(Sftp::open_flags(O_WRONLY | O_CREAT | O_TRUNC) ==
+              (Sftp::OPEN_WRITE | Sftp::OPEN_CREAT | Sftp::OPEN_TRUNC));
+        CHECK(Sftp::open_flags(O_RDWR | O_APPEND | O_EXCL) ==
+              (Sftp::OPEN_READ | Sftp::OPEN_WRITE | Sftp::OPEN_APPEND | Sftp::OPEN_EXCL));
+    }
+}
@@ -24,6 +24,8 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include <catch2/catch.hpp>
 
+#include <cstring>
+#include <fstream>
 #include <iostream>
 
 #include "dragonstash/cache/common.hpp"
@@ -978,6 +980,265 @@ SCENARIO("Truncation of access attempts", "[blocklist]")
 
 }
 
+TEST_CASE("Truncation of misaligned access attempts", "[blocklist]")
+{
+    TestBlocklist env;
+    Dragonstash::Blocklist &blist = env.blocklist();
+
+    blist.mark(1, 2, Dragonstash::Blocklist::READ);
+
+    // the available range ends at the end of block 2, no matter where in
+    // block 1 the access starts
+    CHECK(blist.truncate_access(
+              Dragonstash::CACHE_PAGE_SIZE + 100,
+              Dragonstash::CACHE_PAGE_SIZE * 4) ==
+          Dragonstash::CACHE_PAGE_SIZE * 2 - 100);
+    CHECK(blist.truncate_access(
+              Dragonstash::CACHE_PAGE_SIZE * 3 - 1,
+              Dragonstash::CACHE_PAGE_SIZE) == 1);
+    CHECK(blist.truncate_access(
+              Dragonstash::CACHE_PAGE_SIZE * 2 + 100,
+              10) == 10);
+}
+
+TEST_CASE("Clearing a blocklist", "[blocklist]")
+{
+    TestBlocklist env;
+    Dragonstash::Blocklist &blist = env.blocklist();
+
+    blist.mark(1, 2, Dragonstash::Blocklist::READ);
+    blist.mark(5, 1, Dragonstash::Blocklist::PINNED);
+    blist.clear();
+
+    CHECK(blist.nentries() == 0);
+    CHECK(blist.present_blocks() == 0);
+    CHECK(blist.state(1) == Dragonstash::Blocklist::ABSENT);
+    CHECK(blist.blocks(Dragonstash::Blocklist::PINNED) == 0);
+}
+
+TEST_CASE("Mark the start of an existing range with a different state", "[blocklist]")
+{
+    TestBlocklist env;
+    Dragonstash::Blocklist &blist = env.blocklist();
+
+    blist.mark(4, 4, Dragonstash::Blocklist::READAHEAD);
+    blist.mark(4, 1, Dragonstash::Blocklist::READ);
+
+    CHECK(blist.nentries() == 2);
+    CHECK(blist.state(4) == Dragonstash::Blocklist::READ);
+    CHECK(blist.state(5) == Dragonstash::Blocklist::READAHEAD);
+    CHECK(blist.state(7) == Dragonstash::Blocklist::READAHEAD);
+    CHECK(blist.blocks(Dragonstash::Blocklist::READ) == 1);
+    CHECK(blist.blocks(Dragonstash::Blocklist::READAHEAD) == 3);
+}
+
+TEST_CASE("Transition of blocks between states", "[blocklist]")
+{
+    TestBlocklist env;
+    Dragonstash::Blocklist &blist = env.blocklist();
+
+    blist.mark(2, 2, Dragonstash::Blocklist::READ);
+    blist.mark(4, 2, Dragonstash::Blocklist::READAHEAD);
+    blist.mark(8, 1, Dragonstash::Blocklist::READAHEAD);
+
+    SECTION("Absent blocks are filled without touching present ones") {
+        blist.transition(0, 10, Dragonstash::Blocklist::ABSENT,
+                         Dragonstash::Blocklist::READAHEAD);
+
+        CHECK(blist.state(0) == Dragonstash::Blocklist::READAHEAD);
+        CHECK(blist.state(2) == Dragonstash::Blocklist::READ);
+        CHECK(blist.state(3) == Dragonstash::Blocklist::READ);
+        CHECK(blist.state(6) == Dragonstash::Blocklist::READAHEAD);
+        CHECK(blist.state(9) == Dragonstash::Blocklist::READAHEAD);
+        CHECK(blist.state(10) == Dragonstash::Blocklist::ABSENT);
+        CHECK(blist.blocks(Dragonstash::Blocklist::READ) == 2);
+        CHECK(blist.blocks(Dragonstash::Blocklist::READAHEAD) == 8);
+    }
+
+    SECTION("Blocks in a state are promoted within the range only") {
+        blist.transition(3, 2, Dragonstash::Blocklist::READAHEAD,
+                         Dragonstash::Blocklist::READ);
+
+        CHECK(blist.state(4) == Dragonstash::Blocklist::READ);
+        CHECK(blist.state(5) == Dragonstash::Blocklist::READAHEAD);
+        CHECK(blist.state(8) == Dragonstash::Blocklist::READAHEAD);
+        CHECK(blist.blocks(Dragonstash::Blocklist::READ) == 3);
+        CHECK(blist.blocks(Dragonstash::Blocklist::READAHEAD) == 2);
+    }
+}
+
+TEST_CASE("Query ranges of blocks in a state", "[blocklist]")
+{
+    TestBlocklist env;
+    Dragonstash::Blocklist &blist = env.blocklist();
+
+    blist.mark(2, 2, Dragonstash::Blocklist::READ);
+    blist.mark(4, 2, Dragonstash::Blocklist::READAHEAD);
+    blist.mark(8, 3, Dragonstash::Blocklist::READ);
+
+    SECTION("Ranges are clipped to the queried range") {
+        auto ranges = blist.ranges(3, 6, Dragonstash::Blocklist::READ);
+        REQUIRE(ranges.size() == 2);
+        CHECK(ranges[0].start == 3);
+        CHECK(ranges[0].count == 1);
+        CHECK(ranges[1].start == 8);
+        CHECK(ranges[1].count == 1);
+        CHECK(blist.count(3, 6, Dragonstash::Blocklist::READ) == 2);
+    }
+
+    SECTION("Gaps are returned for ABSENT") {
+        auto ranges = blist.ranges(0, 12, Dragonstash::Blocklist::ABSENT);
+        REQUIRE(ranges.size() == 3);
+        CHECK(ranges[0].start == 0);
+        CHECK(ranges[0].count == 2);
+        CHECK(ranges[1].start == 6);
+        CHECK(ranges[1].count == 2);
+        CHECK(ranges[2].start == 11);
+        CHECK(ranges[2].count == 1);
+        CHECK(blist.count(0, 12, Dragonstash::Blocklist::ABSENT) == 5);
+    }
+
+    SECTION("States which are not present yield nothing") {
+        CHECK(blist.ranges(0, 12, Dragonstash::Blocklist::PINNED).empty());
+        CHECK(blist.count(0, 12, Dragonstash::Blocklist::PINNED) == 0);
+    }
+}
+
+TEST_CASE("Fragmented blocklists span multiple pages", "[blocklist]")
+{
+    TemporaryDirectory tempdir;
+    static constexpr std::uint64_t fragments = 2000;
+    // visit the fragments in a scattered order, so that inserts happen all
+    // over the list
+    auto fragment = [](std::uint64_t i) {
+        return (i * 7919) % fragments;
+    };
+
+    {
+        Dragonstash::Blocklist blist(tempdir.path() / "blocklist");
+        for (std::uint64_t i = 0; i < fragments; ++i) {
+            blist.mark(fragment(i) * 2, 1, Dragonstash::Blocklist::READ);
+        }
+        REQUIRE(blist.nentries() == fragments);
+        blist.fsck();
+
+        // punch holes into some pages and fill others
+        for (std::uint64_t i = 0; i < fragments; i += 10) {
+            blist.mark(i * 2, 2, Dragonstash::Blocklist::PINNED);
+        }
+        for (std::uint64_t i = 500; i < 800; ++i) {
+            blist.mark(i * 2, 1, Dragonstash::Blocklist::ABSENT);
+        }
+        blist.fsck();
+    }
+
+    Dragonstash::Blocklist blist(tempdir.path() / "blocklist");
+    blist.fsck();
+    for (std::uint64_t i = 0; i < fragments; ++i) {
+        Dragonstash::Blocklist::State expected = Dragonstash::Blocklist::READ;
+        if (i >= 500 && i < 800) {
+            expected = Dragonstash::Blocklist::ABSENT;
+        } else if (i % 10 == 0) {
+            expected = Dragonstash::Blocklist::PINNED;
+        }
+        REQUIRE(blist.state(i * 2) == expected);
+    }
+    CHECK(blist.state(1) == Dragonstash::Blocklist::PINNED);
+    CHECK(blist.state(3) == Dragonstash::Blocklist::ABSENT);
+    CHECK(blist.blocks(Dragonstash::Blocklist::PINNED) == 2 * fragments / 10 - 30);
+    CHECK(blist.blocks(Dragonstash::Blocklist::READ) == fragments - fragments / 10 - 270);
+    CHECK(blist.truncate_access(0, 4 * Dragonstash::CACHE_PAGE_SIZE) == 3 * Dragonstash::CACHE_PAGE_SIZE);
+}
+
+TEST_CASE("Convert blocklists in the flat layout", "[blocklist]")
+{
+    TemporaryDirectory tempdir;
+    const auto path = tempdir.path() / "blocklist";
+
+    {
+        // version 0: superblock followed by a sorted array of entries
+        std::vector<char> file(4096, 0);
+        const std::uint32_t magic = 0x4c427344;
+        const std::uint64_t nentries = 2;
+        const std::uint64_t blocks_by_state[4] = {0, 5, 1, 0};
+        memcpy(&file[0], &magic, sizeof(magic));
+        memcpy(&file[16], &nentries, sizeof(nentries));
+        memcpy(&file[24], blocks_by_state, sizeof(blocks_by_state));
+        file[56] = 7;
+
+        const std::uint64_t starts[2] = {2, 10};
+        const std::uint16_t counts[2] = {5, 1};
+        const std::uint8_t states[2] = {Dragonstash::Blocklist::READ,
+                                        Dragonstash::Blocklist::PINNED};
+        for (std::size_t i = 0; i < 2; ++i) {
+            char *entry = &file[512 + 16 * i];
+            memcpy(entry, &starts[i], sizeof(starts[i]));
+            memcpy(entry + 8, &counts[i], sizeof(counts[i]));
+            memcpy(entry + 10, &states[i], sizeof(states[i]));
+        }
+
+        std::ofstream out(path, std::ios::binary);
+        out.write(file.data(), file.size());
+    }
+
+    Dragonstash::Blocklist blist(path);
+    blist.fsck();
+    CHECK(blist.nentries() == 2);
+    CHECK(blist.state(1) == Dragonstash::Blocklist::ABSENT);
+    CHECK(blist.state(2) == Dragonstash::Blocklist::READ);
+    CHECK(blist.state(6) == Dragonstash::Blocklist::READ);
+    CHECK(blist.state(7) == Dragonstash::Blocklist::ABSENT);
+    CHECK(blist.state(10) == Dragonstash::Blocklist::PINNED);
+    CHECK(blist.tag()[0] == 7);
+
+    blist.mark(7, 3, Dragonstash::Blocklist::READ);
+    CHECK(blist.nentries() == 2);
+    CHECK(blist.blocks(Dragonstash::Blocklist::READ) == 8);
+}
+
+TEST_CASE("Blocklists record their block size", "[blocklist]")
+{
+    TemporaryDirectory tempdir;
+    static constexpr std::uint32_t block_size = 1024 * 1024;
+
+    {
+        Dragonstash::Blocklist blist(tempdir.path() / "blocklist", block_size);
+        CHECK(blist.block_size() == block_size);
+        blist.mark(1, 1, Dragonstash::Blocklist::READ);
+    }
+
+    Dragonstash::Blocklist blist(tempdir.path() / "blocklist");
+    CHECK(blist.block_size() == block_size);
+
+    SECTION("Accesses are truncated at block granularity") {
+        CHECK(blist.truncate_access(block_size - 1, 10) == 0);
+        CHECK(blist.truncate_access(block_size + 10, block_size * 2) == block_size - 10);
+    }
+
+    SECTION("Invalid block sizes are rejected") {
+        CHECK_THROWS_AS(Dragonstash::Blocklist(tempdir.path() / "other", 1000),
+                        std::invalid_argument);
+    }
+}
+
+TEST_CASE("Blocklist tags", "[blocklist]")
+{
+    TemporaryDirectory tempdir;
+    Dragonstash::Blocklist::Tag tag{};
+    tag[0] = 1;
+    tag[31] = 42;
+
+    {
+        Dragonstash::Blocklist blist(tempdir.path() / "blocklist");
+        CHECK(blist.tag() == Dragonstash::Blocklist::Tag{});
+        blist.set_tag(tag);
+        CHECK(blist.tag() == tag);
+    }
+
+    Dragonstash::Blocklist blist(tempdir.path() / "blocklist");
+    CHECK(blist.tag() == tag);
+}
+
 TEST_CASE("Split ranges exceeding limits into multiple ranges", "[blocklist]")
 {
     TestBlocklist env;
@@ -35,8 +35,13 @@ authors named in the AUTHORS file.
 #include <unistd.h>
 #include <ctime>
 #include <chrono>
+#include <optional>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "dragonstash/cache/cache.hpp"
+#include "dragonstash/cache/direntry.hpp"
 #include "testutils/tempdir.hpp"
 #include "testutils/result.hpp"
 
@@ -195,6 +200,77 @@ SCENARIO("Directory entry replacement")
     }
 }
 
+SCENARIO("Negative directory entries")
+{
+    TestSetup setup;
+    Dragonstash::Cache &cache = setup.cache();
+    Dragonstash::InodeAttributes dir_attr{
+        .mode = S_IFDIR
+    };
+    Dragonstash::InodeAttributes file_attr{
+        .mode = S_IFREG
+    };
+    const auto expiry = std::chrono::system_clock::now() + std::chrono::seconds(10);
+
+    GIVEN("A directory with negative entries") {
+        auto dir_result = cache.emplace(Dragonstash::ROOT_INO, "dir", dir_attr);
+        require_result_ok(dir_result);
+        const ino_t dir_ino = *dir_result;
+        {
+            auto txn = cache.begin_rw();
+            require_result_ok(txn.put_negative(dir_ino, "missing", expiry));
+            require_result_ok(txn.put_negative(dir_ino, "other", expiry));
+            require_result_ok(txn.put_negative(Dragonstash::ROOT_INO, "missing", expiry));
+            require_result_ok(txn.commit());
+        }
+
+        THEN("They can be looked up") {
+            auto txn = cache.begin_ro();
+            auto negative_result = txn.lookup_negative(dir_ino, "missing");
+            require_result_ok(negative_result);
+            CHECK(std::chrono::duration_cast<std::chrono::milliseconds>(
+                      *negative_result - expiry).count() == 0);
+            check_result_error(txn.lookup_negative(dir_ino, "unknown"), ENOENT);
+        }
+
+        WHEN("A name is emplaced") {
+            require_result_ok(cache.emplace(dir_ino, "missing", file_attr));
+
+            THEN("Its negative entry is dropped") {
+                auto txn = cache.begin_ro();
+                check_result_error(txn.lookup_negative(dir_ino, "missing"), ENOENT);
+                require_result_ok(txn.lookup_negative(dir_ino, "other"));
+                require_result_ok(txn.lookup_negative(Dragonstash::ROOT_INO, "missing"));
+            }
+        }
+
+        WHEN("The directory is rewritten") {
+            auto txn = cache.begin_rw();
+            require_result_ok(txn.start_dir_rewrite(dir_ino));
+            (void)txn.finish_dir_rewrite();
+            require_result_ok(txn.commit());
+
+            THEN("All its negative entries are dropped") {
+                auto txn = cache.begin_ro();
+                check_result_error(txn.lookup_negative(dir_ino, "missing"), ENOENT);
+                check_result_error(txn.lookup_negative(dir_ino, "other"), ENOENT);
+                require_result_ok(txn.lookup_negative(Dragonstash::ROOT_INO, "missing"));
+            }
+        }
+
+        WHEN("The directory is removed") {
+            auto txn = cache.begin_rw();
+            require_result_ok(txn.unlink(Dragonstash::ROOT_INO, "dir"));
+            require_result_ok(txn.commit());
+
+            THEN("Its negative entries are dropped") {
+                auto txn = cache.begin_ro();
+                check_result_error(txn.lookup_negative(dir_ino, "missing"), ENOENT);
+            }
+        }
+    }
+}
+
 SCENARIO("Reverse lookup")
 {
     TestSetup setup;
@@ -575,6 +651,38 @@ SCENARIO("Cross-process cache")
     }
 }
 
+SCENARIO("Block size of cached contents")
+{
+    GIVEN("A cache directory") {
+        TemporaryDirectory env;
+
+        WHEN("A cache is created without a block size") {
+            Dragonstash::Cache cache(env.path());
+
+            THEN("The default is used") {
+                CHECK(cache.block_size() == Dragonstash::CACHE_PAGE_SIZE);
+            }
+        }
+
+        WHEN("A cache is created with a block size") {
+            {
+                Dragonstash::Cache cache(env.path(), 1024 * 1024);
+                CHECK(cache.block_size() == 1024 * 1024);
+            }
+
+            THEN("It is kept when the cache is reopened") {
+                Dragonstash::Cache cache(env.path());
+                CHECK(cache.block_size() == 1024 * 1024);
+            }
+
+            THEN("Reopening with a different block size fails") {
+                CHECK_THROWS_AS(Dragonstash::Cache(env.path(), 64 * 1024),
+                                std::runtime_error);
+            }
+        }
+    }
+}
+
 SCENARIO("Storage and retrieval of symlinks") {
     GIVEN("An empty cache") {
         TestSetup setup;
@@ -871,6 +979,233 @@ SCENARIO("Reading directories") {
                 check_result_error(result, 0);
             }
         }
+
+        WHEN("Streaming the directory from a cursor") {
+            auto dir_result = cache.opendir(*parent_result);
+            require_result_ok(dir_result);
+            auto &dir = **dir_result;
+
+            THEN("All entries should be returned, and then EOF") {
+                CHECK(dir.inode() == *parent_result);
+
+                Dragonstash::Result<Dragonstash::DirectoryEntry> result = make_result(Dragonstash::FAILED, 0);
+
+                result = dir.readdir(0);
+                require_result_ok(result);
+                CHECK(result->name == ".");
+
+                result = dir.readdir(result->ino);
+                require_result_ok(result);
+                CHECK(result->name == "..");
+                CHECK(result->ino == Dragonstash::ROOT_INO);
+
+                result = dir.readdir(result->ino);
+                require_result_ok(result);
+                CHECK(result->name == "f1");
+                CHECK(result->ino == *ent1_result);
+
+                result = dir.readdir(result->ino);
+                require_result_ok(result);
+                CHECK(result->name == "f2");
+                CHECK(result->ino == *ent2_result);
+
+                result = dir.readdir(result->ino);
+                require_result_ok(result);
+                CHECK(result->name == "f3");
+                CHECK(result->ino == *ent3_result);
+
+                result = dir.readdir(result->ino);
+                check_result_error(result, 0);
+            }
+
+            THEN("Asking for the same entry twice returns it twice") {
+                auto result = dir.readdir(*ent1_result);
+                require_result_ok(result);
+                CHECK(result->name == "f2");
+
+                result = dir.readdir(*ent1_result);
+                require_result_ok(result);
+                CHECK(result->name == "f2");
+
+                result = dir.readdir(result->ino);
+                require_result_ok(result);
+                CHECK(result->name == "f3");
+            }
+
+            THEN("Reading on after the batch has ended continues where it stopped") {
+                auto result = dir.readdir(*ent1_result);
+                require_result_ok(result);
+                CHECK(result->name == "f2");
+                dir.release();
+
+                // the kernel asks again for an entry which did not fit
+                result = dir.readdir(*ent1_result);
+                require_result_ok(result);
+                CHECK(result->name == "f2");
+                dir.release();
+
+                result = dir.readdir(*ent2_result);
+                require_result_ok(result);
+                CHECK(result->name == "f3");
+            }
+
+            THEN("A batch begun after a change sees it") {
+                auto result = dir.readdir(*ent1_result);
+                require_result_ok(result);
+                CHECK(result->name == "f2");
+                dir.release();
+
+                require_result_ok(cache.write([&](Dragonstash::CacheTransactionRW &txn) {
+                    return txn.unlink(*ent3_result);
+                }));
+
+                result = dir.readdir(*ent2_result);
+                check_result_error(result, 0);
+            }
+
+            THEN("Seeking back and forth returns the same entries as readdir on a transaction") {
+                auto txn = cache.begin_ro();
+                for (Dragonstash::ino_t off: {*ent2_result, Dragonstash::ROOT_INO,
+                                              *ent3_result, *ent1_result}) {
+                    auto expected = txn.readdir(*parent_result, off);
+                    auto result = dir.readdir(off);
+                    if (expected) {
+                        require_result_ok(result);
+                        CHECK(result->name == expected->name);
+                        CHECK(result->ino == expected->ino);
+                    } else {
+                        check_result_error(result, expected.error());
+                    }
+                }
+            }
+        }
+
+        WHEN("Opening a non-existing directory as stream") {
+            auto dir_result = cache.opendir(*ent3_result + 100);
+
+            THEN("It fails with ENOENT") {
+                check_result_error(dir_result, ENOENT);
+            }
+        }
+    }
+}
+
+SCENARIO("Directory entry attributes") {
+    GIVEN("A cache with a file and a symlink") {
+        TemporaryDirectory env;
+        std::optional<Dragonstash::Cache> cache_storage(std::in_place, env.path());
+        Dragonstash::Cache *cache = &*cache_storage;
+
+        Dragonstash::InodeAttributes file_attrs{
+            .common = Dragonstash::CommonFileAttributes{
+                .size = 1234,
+                .uid = 1000,
+                .gid = 1001,
+            },
+            .mode = S_IFREG | 0644,
+        };
+        Dragonstash::InodeAttributes link_attrs{
+            .mode = S_IFLNK | 0777,
+        };
+
+        auto file_result = cache->emplace(Dragonstash::ROOT_INO, "file", file_attrs);
+        require_result_ok(file_result);
+        auto link_result = cache->emplace(Dragonstash::ROOT_INO, "link", link_attrs);
+        require_result_ok(link_result);
+        require_result_ok(cache->writelink(*link_result, "some/target"));
+
+        WHEN("Reading the directory") {
+            auto txn = cache->begin_ro();
+            auto file_entry = txn.readdir(Dragonstash::ROOT_INO, Dragonstash::ROOT_INO);
+            require_result_ok(file_entry);
+            auto link_entry = txn.readdir(Dragonstash::ROOT_INO, file_entry->ino);
+            require_result_ok(link_entry);
+
+            THEN("The entries are complete and carry the inode attributes") {
+                CHECK(file_entry->name == "file");
+                CHECK(file_entry->complete);
+                CHECK(file_entry->attr == file_attrs);
+
+                CHECK(link_entry->name == "link");
+                CHECK(link_entry->complete);
+                CHECK(link_entry->attr == txn.getattr(*link_result)->attr);
+                CHECK(link_entry->attr.common.size == strlen("some/target"));
+            }
+        }
+
+        WHEN("Updating the attributes of the file in-place") {
+            Dragonstash::InodeAttributes new_attrs = file_attrs;
+            new_attrs.common.size = 4321;
+            auto update_result = cache->emplace(Dragonstash::ROOT_INO, "file", new_attrs);
+            require_result_ok(update_result);
+            REQUIRE(*update_result == *file_result);
+
+            THEN("The directory entry reflects the new attributes") {
+                auto dir_result = cache->opendir(Dragonstash::ROOT_INO);
+                require_result_ok(dir_result);
+                auto entry = (*dir_result)->readdir(Dragonstash::ROOT_INO);
+                require_result_ok(entry);
+                CHECK(entry->name == "file");
+                CHECK(entry->complete);
+                CHECK(entry->attr == new_attrs);
+            }
+        }
+
+        WHEN("Opening a cache whose entries lack attributes") {
+            cache_storage.reset();
+            {
+                // rewrite all entries in the version 1 format
+                auto env_ptr = getMDBEnv((env.path() / "db").c_str(),
+                                         MDB_NOSUBDIR | MDB_NOTLS, 0600);
+                auto meta_db = env_ptr->openDB("meta", MDB_CREATE);
+                auto treei_db = env_ptr->openDB("treei", MDB_CREATE);
+                auto treen_db = env_ptr->openDB("treen", MDB_CREATE);
+                auto txn = env_ptr->getRWTransaction();
+                for (auto *db: {&treei_db, &treen_db}) {
+                    auto cursor = txn->getRWCursor(*db);
+                    MDBOutVal key_out{};
+                    MDBOutVal value_out{};
+                    for (int rc = cursor.nextprev(key_out, value_out, MDB_FIRST);
+                         rc == 0;
+                         rc = cursor.nextprev(key_out, value_out, MDB_NEXT))
+                    {
+                        std::basic_string_view<std::byte> value(
+                                    reinterpret_cast<std::byte*>(value_out.d_mdbval.mv_data),
+                                    value_out.d_mdbval.mv_size);
+                        auto parse_result = Dragonstash::DirEntry::parse(value);
+                        REQUIRE(parse_result);
+                        const auto &[entry, name] = *parse_result;
+                        Dragonstash::DirEntryV1 legacy{
+                            .version = 1,
+                            .mode = entry.attr.mode,
+                            .entry_ino = entry.entry_ino,
+                        };
+                        std::string buf(Dragonstash::DIR_ENTRY_V1_SIZE, '\0');
+                        memcpy(buf.data(), &legacy, Dragonstash::DIR_ENTRY_V1_SIZE);
+                        buf += name;
+                        cursor.put(key_out, buf);
+                    }
+                }
+                txn->del(meta_db, "dir_entry_version");
+                txn->commit();
+            }
+
+            cache_storage.emplace(env.path());
+            cache = &*cache_storage;
+
+            THEN("The entries are migrated to carry the attributes") {
+                auto txn = cache->begin_ro();
+                auto file_entry = txn.readdir(Dragonstash::ROOT_INO, Dragonstash::ROOT_INO);
+                require_result_ok(file_entry);
+                CHECK(file_entry->name == "file");
+                CHECK(file_entry->complete);
+                CHECK(file_entry->attr == file_attrs);
+
+                auto lookup_result = txn.lookup(Dragonstash::ROOT_INO, "link");
+                require_result_ok(lookup_result);
+                CHECK(*lookup_result == *link_result);
+            }
+        }
     }
 }
 
@@ -951,6 +1286,55 @@ SCENARIO("Path reconstruction") {
                 CHECK(*path == "/d1/d1/f1");
             }
         }
+
+        WHEN("Reconstructing the path of /d1/d1/f1 twice") {
+            const auto hits_before = cache.path_cache().hits();
+            require_result_ok(cache.path(*d1_d1_f1_r));
+            auto path = cache.path(*d1_d1_f1_r);
+
+            THEN("The second reconstruction is served from the path cache") {
+                require_result_ok(path);
+                CHECK(*path == "/d1/d1/f1");
+                CHECK(cache.path_cache().hits() - hits_before == 3);
+            }
+
+            AND_WHEN("Unlinking the locked inner directory") {
+                require_result_ok(cache.lock(*d1_d1_r));
+                {
+                    auto txn = cache.begin_rw();
+                    require_result_ok(txn.unlink(*d1_r, "d1"));
+                    require_result_ok(txn.commit());
+                }
+
+                THEN("The path of the orphaned directory cannot be reconstructed") {
+                    check_result_error(cache.path(*d1_d1_r), ENOENT);
+                }
+
+                THEN("The path of its children cannot be reconstructed") {
+                    check_result_error(cache.path(*d1_d1_f1_r), ENOENT);
+                }
+
+                THEN("Other paths are unaffected") {
+                    auto path = cache.path(*d1_f1_r);
+                    require_result_ok(path);
+                    CHECK(*path == "/d1/f1");
+                }
+            }
+
+            AND_WHEN("Rewriting /d1 without the inner directory") {
+                {
+                    auto txn = cache.begin_rw();
+                    require_result_ok(txn.start_dir_rewrite(*d1_r));
+                    require_result_ok(txn.emplace(*d1_r, "f1", file_attrs));
+                    require_result_ok(txn.finish_dir_rewrite());
+                    require_result_ok(txn.commit());
+                }
+
+                THEN("The path of the removed subtree cannot be reconstructed") {
+                    CHECK(!cache.path(*d1_d1_f1_r));
+                }
+            }
+        }
     }
 }
 
@@ -1082,16 +1466,9 @@ SCENARIO("Read-committed isolation level for locks") {
                 CHECK(*r_lookup_result == *d1_r);
             }
 
-            THEN("An attempt to lock the inode fails with a deadlock") {
-                if (Dragonstash::Cache::deadlock_detection) {
-                    // the behaviour of a normal mutex is undefined when a
-                    // thread already owns the mutex
-                    // the debug_mutex supports an additional out-of-band check
-                    // for mutex ownership, but only if compiled without NDEBUG
-                    // The deadlock_detection flag indicates if the mutex used
-                    // by libdragonstash was compiled without NDEBUG.
-                    CHECK_THROWS_AS(r1.lock(*r_lookup_result), std::system_error);
-                }
+            THEN("The inode can be locked while the writer is active") {
+                // lock counters are not tied to the lifetime of transactions
+                check_result_ok(r1.lock(*r_lookup_result));
             }
         }
 
@@ -1402,6 +1779,35 @@ SCENARIO("Transaction nesting") {
             }
         }
 
+        WHEN("Releasing locks in bulk in a nested transaction") {
+            auto d2_r = cache.emplace(Dragonstash::ROOT_INO, "d2", file_attrs);
+            require_result_ok(d2_r);
+            auto txn = cache.begin_rw();
+            check_result_ok(txn.lock(*d1_r));
+            check_result_ok(txn.lock(*d1_r));
+            check_result_ok(txn.lock(*d2_r));
+            auto txn2 = txn.begin_nested();
+            std::vector<Dragonstash::InodeReferences::Release> releases{
+                {*d1_r, 2}, {*d2_r, 1},
+            };
+            check_result_ok(txn2.release_many(releases));
+
+            THEN("All locks are released") {
+                CHECK_THROWS_WITH(
+                            txn2.release(*d1_r, 1),
+                            Catch::Matchers::Contains("counter below zero"));
+                CHECK_THROWS_WITH(
+                            txn2.release(*d2_r, 1),
+                            Catch::Matchers::Contains("counter below zero"));
+            }
+
+            THEN("All locks are restored when the inner transaction is aborted") {
+                txn2.abort();
+                check_result_ok(txn.release(*d1_r, 2));
+                check_result_ok(txn.release(*d2_r, 1));
+            }
+        }
+
         WHEN("Adding a rollback hook to a nested transaction") {
             auto txn = cache.begin_rw();
             auto txn2 = txn.begin_nested();
@@ -1612,74 +2018,189 @@ SCENARIO("Inode flags")
     }
 }
 
-SCENARIO("Directory rewriting") {
+SCENARIO("Directory sync stamps")
+{
     TestSetup setup;
     Dragonstash::Cache &cache = setup.cache();
+    const Dragonstash::DirSyncStamp stamp{
+        .mtime = {.tv_sec = 1536390000, .tv_nsec = 20180908},
+        .ctime = {.tv_sec = 1536390001, .tv_nsec = 0},
+        .backend_ino = 42,
+    };
     Dragonstash::InodeAttributes dir_attr{
         .mode = S_IFDIR
     };
-    Dragonstash::InodeAttributes reg_attr{
-        .mode = S_IFREG
-    };
-
-    GIVEN("A cache with a few entries in the root") {
-        const Dragonstash::ino_t dir_ino = Dragonstash::ROOT_INO;
-        std::vector<ino_t> entry_inos;
-        {
-            auto txn = cache.begin_rw();
-            auto add_entry = [&entry_inos, &cache, dir_ino, &txn](std::string_view name, const Dragonstash::InodeAttributes &attr) {
-                auto emplace_result = txn.emplace(dir_ino, name, attr);
-                require_result_ok(emplace_result);
-                entry_inos.emplace_back(*emplace_result);
-            };
-            add_entry("e1", dir_attr);
-            add_entry("e2", reg_attr);
-            add_entry("e3", reg_attr);
-            check_result_ok(txn.commit());
-        }
 
-        WHEN("Rewriting the directory without re-emplacing entries") {
-            {
-                auto txn = cache.begin_rw();
-                auto start_result = txn.start_dir_rewrite(dir_ino);
-                check_result_ok(start_result);
+    GIVEN("An empty cache") {
+        WHEN("Reading the stamp of the root") {
+            auto result = cache.begin_ro().dir_sync_stamp(Dragonstash::ROOT_INO);
 
-                auto end_result = txn.finish_dir_rewrite();
-                check_result_ok(end_result);
-                check_result_ok(txn.clean_orphans());
-                check_result_ok(txn.commit());
+            THEN("It fails with ENODATA") {
+                check_result_error(result, ENODATA);
             }
+        }
 
-            THEN("The entries are gone") {
-                for (ino_t entry_ino: entry_inos) {
-                    auto getattr_result = cache.getattr(entry_ino);
-                    check_result_error(getattr_result, ENOENT);
-                }
+        WHEN("Reading the stamp of a nonexistent inode") {
+            auto result = cache.begin_ro().dir_sync_stamp(nonexistent_inode);
+
+            THEN("It fails with ENOENT") {
+                check_result_error(result, ENOENT);
             }
+        }
 
-            THEN("The entries do not show up in readdir") {
-                auto txn = cache.begin_ro();
-                auto readdir_result = txn.readdir(dir_ino, Dragonstash::INVALID_INO);
-                require_result_ok(readdir_result);
-                CHECK(readdir_result->name == ".");
+        WHEN("Setting the stamp of a nonexistent inode") {
+            auto txn = cache.begin_rw();
+            auto result = txn.set_dir_sync_stamp(nonexistent_inode, stamp);
 
-                readdir_result = txn.readdir(dir_ino, readdir_result->ino);
-                check_result_error(readdir_result, 0);
+            THEN("It fails with ENOENT") {
+                check_result_error(result, ENOENT);
             }
         }
 
-        WHEN("Rewriting the directory with re-emplacing some entries") {
+        WHEN("Setting the stamp of a synced directory") {
             {
                 auto txn = cache.begin_rw();
-                auto start_result = txn.start_dir_rewrite(dir_ino);
-                check_result_ok(start_result);
+                check_result_ok(txn.update_flags(Dragonstash::ROOT_INO,
+                                                 {Dragonstash::InodeFlag::SYNCED}));
+                check_result_ok(txn.set_dir_sync_stamp(Dragonstash::ROOT_INO, stamp));
+                check_result_ok(txn.commit());
+            }
 
-                auto emplace_result = txn.emplace(dir_ino, "e1", dir_attr);
-                require_result_ok(emplace_result);
-                CHECK(*emplace_result == entry_inos[0]);
+            THEN("The stamp can be read back") {
+                auto result = cache.begin_ro().dir_sync_stamp(Dragonstash::ROOT_INO);
+                require_result_ok(result);
+                CHECK(*result == stamp);
+            }
 
-                emplace_result = txn.emplace(dir_ino, "e3", reg_attr);
-                require_result_ok(emplace_result);
+            AND_WHEN("Clearing the synced flag") {
+                {
+                    auto txn = cache.begin_rw();
+                    check_result_ok(txn.update_flags(Dragonstash::ROOT_INO,
+                                                     {},
+                                                     {Dragonstash::InodeFlag::SYNCED}));
+                    check_result_ok(txn.commit());
+                }
+
+                THEN("The stamp does not count anymore") {
+                    check_result_error(cache.begin_ro().dir_sync_stamp(Dragonstash::ROOT_INO), ENODATA);
+                }
+            }
+
+            AND_WHEN("Dropping the stamp") {
+                {
+                    auto txn = cache.begin_rw();
+                    check_result_ok(txn.set_dir_sync_stamp(Dragonstash::ROOT_INO, std::nullopt));
+                    check_result_ok(txn.commit());
+                }
+
+                THEN("It is gone") {
+                    check_result_error(cache.begin_ro().dir_sync_stamp(Dragonstash::ROOT_INO), ENODATA);
+                }
+            }
+        }
+
+        WHEN("A synced subdirectory is emplaced again with other attributes") {
+            ino_t dir_ino;
+            {
+                auto txn = cache.begin_rw();
+                auto emplace_result = txn.emplace(Dragonstash::ROOT_INO, "dir", dir_attr);
+                require_result_ok(emplace_result);
+                dir_ino = *emplace_result;
+                check_result_ok(txn.update_flags(dir_ino, {Dragonstash::InodeFlag::SYNCED}));
+                check_result_ok(txn.set_dir_sync_stamp(dir_ino, stamp));
+                check_result_ok(txn.commit());
+            }
+            Dragonstash::InodeAttributes new_attr = dir_attr;
+            new_attr.common.mtime.tv_sec = 1;
+            {
+                auto txn = cache.begin_rw();
+                auto emplace_result = txn.emplace(Dragonstash::ROOT_INO, "dir", new_attr);
+                require_result_ok(emplace_result);
+                REQUIRE(*emplace_result == dir_ino);
+                check_result_ok(txn.commit());
+            }
+
+            THEN("It stays synced and keeps its stamp") {
+                auto txn = cache.begin_ro();
+                auto flag_result = txn.test_flag(dir_ino, Dragonstash::InodeFlag::SYNCED);
+                require_result_ok(flag_result);
+                CHECK(*flag_result);
+                auto stamp_result = txn.dir_sync_stamp(dir_ino);
+                require_result_ok(stamp_result);
+                CHECK(*stamp_result == stamp);
+            }
+        }
+    }
+}
+
+SCENARIO("Directory rewriting") {
+    TestSetup setup;
+    Dragonstash::Cache &cache = setup.cache();
+    Dragonstash::InodeAttributes dir_attr{
+        .mode = S_IFDIR
+    };
+    Dragonstash::InodeAttributes reg_attr{
+        .mode = S_IFREG
+    };
+
+    GIVEN("A cache with a few entries in the root") {
+        const Dragonstash::ino_t dir_ino = Dragonstash::ROOT_INO;
+        std::vector<ino_t> entry_inos;
+        {
+            auto txn = cache.begin_rw();
+            auto add_entry = [&entry_inos, &cache, dir_ino, &txn](std::string_view name, const Dragonstash::InodeAttributes &attr) {
+                auto emplace_result = txn.emplace(dir_ino, name, attr);
+                require_result_ok(emplace_result);
+                entry_inos.emplace_back(*emplace_result);
+            };
+            add_entry("e1", dir_attr);
+            add_entry("e2", reg_attr);
+            add_entry("e3", reg_attr);
+            check_result_ok(txn.commit());
+        }
+
+        WHEN("Rewriting the directory without re-emplacing entries") {
+            {
+                auto txn = cache.begin_rw();
+                auto start_result = txn.start_dir_rewrite(dir_ino);
+                check_result_ok(start_result);
+
+                auto end_result = txn.finish_dir_rewrite();
+                check_result_ok(end_result);
+                check_result_ok(txn.clean_orphans());
+                check_result_ok(txn.commit());
+            }
+
+            THEN("The entries are gone") {
+                for (ino_t entry_ino: entry_inos) {
+                    auto getattr_result = cache.getattr(entry_ino);
+                    check_result_error(getattr_result, ENOENT);
+                }
+            }
+
+            THEN("The entries do not show up in readdir") {
+                auto txn = cache.begin_ro();
+                auto readdir_result = txn.readdir(dir_ino, Dragonstash::INVALID_INO);
+                require_result_ok(readdir_result);
+                CHECK(readdir_result->name == ".");
+
+                readdir_result = txn.readdir(dir_ino, readdir_result->ino);
+                check_result_error(readdir_result, 0);
+            }
+        }
+
+        WHEN("Rewriting the directory with re-emplacing some entries") {
+            {
+                auto txn = cache.begin_rw();
+                auto start_result = txn.start_dir_rewrite(dir_ino);
+                check_result_ok(start_result);
+
+                auto emplace_result = txn.emplace(dir_ino, "e1", dir_attr);
+                require_result_ok(emplace_result);
+                CHECK(*emplace_result == entry_inos[0]);
+
+                emplace_result = txn.emplace(dir_ino, "e3", reg_attr);
+                require_result_ok(emplace_result);
                 CHECK(*emplace_result == entry_inos[2]);
 
                 check_result_ok(txn.finish_dir_rewrite());
@@ -1707,6 +2228,209 @@ SCENARIO("Directory rewriting") {
     }
 }
 
+SCENARIO("Merging a backend listing into a directory") {
+    using Dragonstash::DirRewriteChange;
+    using Dragonstash::DirRewriteEntry;
+
+    TestSetup setup;
+    Dragonstash::Cache &cache = setup.cache();
+    Dragonstash::InodeAttributes dir_attr{
+        .mode = S_IFDIR
+    };
+    Dragonstash::InodeAttributes reg_attr{
+        .mode = S_IFREG
+    };
+    Dragonstash::InodeAttributes big_reg_attr{
+        .common = Dragonstash::CommonFileAttributes{
+            .size = 4096,
+        },
+        .mode = S_IFREG
+    };
+    Dragonstash::InodeAttributes big_dir_attr = big_reg_attr;
+    big_dir_attr.mode = S_IFDIR;
+    const Dragonstash::ino_t dir_ino = Dragonstash::ROOT_INO;
+
+    std::vector<std::tuple<DirRewriteChange, std::string, Dragonstash::ino_t>> changes;
+    auto observer = [&changes](DirRewriteChange change, std::string_view name,
+                               Dragonstash::ino_t ino, const Dragonstash::InodeAttributes*) {
+        changes.emplace_back(change, std::string(name), ino);
+    };
+
+    GIVEN("A cache with a few entries in the root") {
+        std::vector<ino_t> entry_inos;
+        {
+            auto txn = cache.begin_rw();
+            for (std::string_view name: {"e1", "e2", "e3"}) {
+                auto emplace_result = txn.emplace(dir_ino, name, name == "e1" ? dir_attr : reg_attr);
+                require_result_ok(emplace_result);
+                entry_inos.emplace_back(*emplace_result);
+            }
+            check_result_ok(txn.commit());
+        }
+
+        WHEN("Merging an unchanged listing") {
+            std::vector<DirRewriteEntry> listing{
+                {"e3", reg_attr},
+                {"e1", dir_attr},
+                {"e2", reg_attr},
+            };
+            auto txn = cache.begin_rw();
+            auto rewrite_result = txn.rewrite_dir(dir_ino, listing, observer);
+
+            THEN("Nothing is changed") {
+                require_result_ok(rewrite_result);
+                CHECK(rewrite_result->added == 0);
+                CHECK(rewrite_result->changed == 0);
+                CHECK(rewrite_result->replaced == 0);
+                CHECK(rewrite_result->removed == 0);
+                CHECK(changes.empty());
+            }
+
+            THEN("The listing is sorted") {
+                CHECK(listing[0].name == "e1");
+                CHECK(listing[1].name == "e2");
+                CHECK(listing[2].name == "e3");
+            }
+        }
+
+        WHEN("Merging a listing with differences") {
+            std::vector<DirRewriteEntry> listing{
+                {"e4", reg_attr},
+                {"e3", dir_attr},
+                {"e1", big_dir_attr},
+                {"e0", reg_attr},
+            };
+            {
+                auto txn = cache.begin_rw();
+                auto rewrite_result = txn.rewrite_dir(dir_ino, listing, observer);
+                require_result_ok(rewrite_result);
+                CHECK(rewrite_result->added == 2);
+                CHECK(rewrite_result->changed == 1);
+                CHECK(rewrite_result->replaced == 1);
+                CHECK(rewrite_result->removed == 1);
+                check_result_ok(txn.clean_orphans());
+                check_result_ok(txn.commit());
+            }
+
+            THEN("The observer saw the changes in name order") {
+                REQUIRE(changes.size() == 5);
+                CHECK(changes[0] == std::make_tuple(DirRewriteChange::ADDED, std::string("e0"), Dragonstash::INVALID_INO));
+                CHECK(changes[1] == std::make_tuple(DirRewriteChange::CHANGED, std::string("e1"), entry_inos[0]));
+                CHECK(changes[2] == std::make_tuple(DirRewriteChange::REMOVED, std::string("e2"), entry_inos[1]));
+                CHECK(changes[3] == std::make_tuple(DirRewriteChange::REPLACED, std::string("e3"), entry_inos[2]));
+                CHECK(changes[4] == std::make_tuple(DirRewriteChange::ADDED, std::string("e4"), Dragonstash::INVALID_INO));
+            }
+
+            THEN("Changed entries keep their inode") {
+                auto lookup_result = cache.lookup(dir_ino, "e1");
+                require_result_ok(lookup_result);
+                CHECK(*lookup_result == entry_inos[0]);
+                auto getattr_result = cache.getattr(entry_inos[0]);
+                require_result_ok(getattr_result);
+                CHECK(getattr_result->attr.common.size == 4096);
+            }
+
+            THEN("Removed entries are gone") {
+                check_result_error(cache.lookup(dir_ino, "e2"), ENOENT);
+                check_result_error(cache.getattr(entry_inos[1]), ENOENT);
+            }
+
+            THEN("Replaced entries get a new inode") {
+                auto lookup_result = cache.lookup(dir_ino, "e3");
+                require_result_ok(lookup_result);
+                CHECK(*lookup_result != entry_inos[2]);
+                auto getattr_result = cache.getattr(*lookup_result);
+                require_result_ok(getattr_result);
+                CHECK(S_ISDIR(getattr_result->attr.mode));
+            }
+
+            THEN("Added entries exist") {
+                check_result_ok(cache.lookup(dir_ino, "e0"));
+                check_result_ok(cache.lookup(dir_ino, "e4"));
+            }
+        }
+
+        WHEN("Merging an empty listing") {
+            std::vector<DirRewriteEntry> listing;
+            {
+                auto txn = cache.begin_rw();
+                auto rewrite_result = txn.rewrite_dir(dir_ino, listing);
+                require_result_ok(rewrite_result);
+                CHECK(rewrite_result->removed == 3);
+                check_result_ok(txn.clean_orphans());
+                check_result_ok(txn.commit());
+            }
+
+            THEN("The directory is empty") {
+                auto txn = cache.begin_ro();
+                auto readdir_result = txn.readdir(dir_ino, Dragonstash::INVALID_INO);
+                require_result_ok(readdir_result);
+                CHECK(readdir_result->name == ".");
+                check_result_error(txn.readdir(dir_ino, readdir_result->ino), 0);
+            }
+        }
+
+        WHEN("Merging a listing with duplicate names") {
+            std::vector<DirRewriteEntry> listing{
+                {"e1", dir_attr},
+                {"e2", reg_attr},
+                {"e2", big_reg_attr},
+                {"e3", reg_attr},
+            };
+            auto txn = cache.begin_rw();
+            auto rewrite_result = txn.rewrite_dir(dir_ino, listing);
+
+            THEN("The last one wins") {
+                require_result_ok(rewrite_result);
+                CHECK(rewrite_result->changed == 1);
+                CHECK(listing.size() == 3);
+                auto getattr_result = txn.getattr(entry_inos[1]);
+                require_result_ok(getattr_result);
+                CHECK(getattr_result->attr.common.size == 4096);
+            }
+        }
+    }
+
+    GIVEN("A directory with a negative entry") {
+        const auto expiry = std::chrono::system_clock::now() + std::chrono::seconds(10);
+        {
+            auto txn = cache.begin_rw();
+            require_result_ok(txn.put_negative(dir_ino, "new", expiry));
+            require_result_ok(txn.commit());
+        }
+
+        WHEN("The name appears in the listing") {
+            std::vector<DirRewriteEntry> listing{
+                {"new", reg_attr},
+            };
+            bool negative_seen = false;
+            auto txn = cache.begin_rw();
+            auto rewrite_result = txn.rewrite_dir(dir_ino, listing, [&](
+                    DirRewriteChange change, std::string_view name,
+                    Dragonstash::ino_t, const Dragonstash::InodeAttributes*) {
+                CHECK(change == DirRewriteChange::ADDED);
+                negative_seen = bool(txn.lookup_negative(dir_ino, name));
+            });
+
+            THEN("The observer sees the negative entry, which is dropped afterwards") {
+                require_result_ok(rewrite_result);
+                CHECK(negative_seen);
+                check_result_error(txn.lookup_negative(dir_ino, "new"), ENOENT);
+            }
+        }
+    }
+
+    GIVEN("A rewrite in progress") {
+        auto txn = cache.begin_rw();
+        require_result_ok(txn.start_dir_rewrite(dir_ino));
+
+        THEN("Merging fails with EALREADY") {
+            std::vector<DirRewriteEntry> listing;
+            check_result_error(txn.rewrite_dir(dir_ino, listing), EALREADY);
+        }
+    }
+}
+
 SCENARIO("Unlinking") {
     TestSetup setup;
     Dragonstash::Cache &cache = setup.cache();
@@ -1806,3 +2530,658 @@ SCENARIO("Unlinking") {
         }
     }
 }
+
+SCENARIO("Incremental orphan reaping") {
+    TestSetup setup;
+    Dragonstash::Cache &cache = setup.cache();
+    Dragonstash::InodeAttributes dir_attr{
+        .mode = S_IFDIR
+    };
+    Dragonstash::InodeAttributes reg_attr{
+        .mode = S_IFREG
+    };
+
+    GIVEN("A directory subtree") {
+        ino_t tree_ino;
+        std::vector<ino_t> children;
+        std::vector<ino_t> inos;
+        {
+            auto txn = cache.begin_rw();
+            auto tree_result = txn.emplace(Dragonstash::ROOT_INO, "tree", dir_attr);
+            require_result_ok(tree_result);
+            tree_ino = *tree_result;
+            auto sub_result = txn.emplace(tree_ino, "sub", dir_attr);
+            require_result_ok(sub_result);
+            children.emplace_back(*sub_result);
+            inos.emplace_back(*sub_result);
+            for (int i = 0; i < 10; ++i) {
+                auto emplace_result = txn.emplace(tree_ino, "f" + std::to_string(i), reg_attr);
+                require_result_ok(emplace_result);
+                children.emplace_back(*emplace_result);
+                inos.emplace_back(*emplace_result);
+                emplace_result = txn.emplace(*sub_result, "g" + std::to_string(i), reg_attr);
+                require_result_ok(emplace_result);
+                inos.emplace_back(*emplace_result);
+            }
+            check_result_ok(txn.commit());
+        }
+
+        WHEN("The subtree is unlinked") {
+            auto txn = cache.begin_rw();
+            check_result_ok(txn.unlink(tree_ino));
+
+            THEN("The directory itself is reaped right away") {
+                check_result_error(txn.getattr(tree_ino), ENOENT);
+            }
+
+            THEN("Its children are orphaned") {
+                for (ino_t ino: children) {
+                    auto parent_result = txn.parent(ino);
+                    require_result_ok(parent_result);
+                    CHECK(*parent_result == Dragonstash::INVALID_INO);
+                }
+            }
+
+            THEN("The orphans are reaped in bounded steps") {
+                std::size_t steps = 0;
+                while (true) {
+                    auto reap_result = txn.reap_orphans(4);
+                    require_result_ok(reap_result);
+                    ++steps;
+                    if (!*reap_result) {
+                        break;
+                    }
+                    REQUIRE(steps < 100);
+                }
+                CHECK(steps > 5);
+                for (ino_t ino: inos) {
+                    check_result_error(txn.getattr(ino), ENOENT);
+                }
+            }
+
+            AND_WHEN("One of the orphans is locked") {
+                const ino_t locked_ino = inos.back();
+                check_result_ok(txn.lock(locked_ino));
+                check_result_ok(txn.clean_orphans());
+
+                THEN("It is skipped") {
+                    check_result_ok(txn.getattr(locked_ino));
+                    for (ino_t ino: inos) {
+                        if (ino != locked_ino) {
+                            check_result_error(txn.getattr(ino), ENOENT);
+                        }
+                    }
+                }
+
+                THEN("Reaping without progress completes") {
+                    auto reap_result = txn.reap_orphans(4);
+                    require_result_ok(reap_result);
+                    CHECK(!*reap_result);
+                }
+
+                THEN("It is reaped once released") {
+                    check_result_ok(txn.release(locked_ino));
+                    check_result_ok(txn.clean_orphans());
+                    check_result_error(txn.getattr(locked_ino), ENOENT);
+                }
+
+                THEN("It is reported and reaped once released in bulk") {
+                    std::vector<Dragonstash::InodeReferences::Release> releases{
+                        {locked_ino, 1},
+                    };
+                    std::vector<ino_t> reapable;
+                    check_result_ok(txn.release_many(releases, &reapable));
+                    CHECK(reapable == std::vector<ino_t>{locked_ino});
+                    txn.reap_released(reapable);
+                    check_result_error(txn.getattr(locked_ino), ENOENT);
+                }
+            }
+        }
+    }
+
+    GIVEN("A directory with more entries than one reaping step handles") {
+        const std::size_t nentries = Dragonstash::CACHE_ORPHAN_REAP_BUDGET * 3;
+        ino_t dir_ino;
+        std::vector<ino_t> inos;
+        {
+            auto txn = cache.begin_rw();
+            auto dir_result = txn.emplace(Dragonstash::ROOT_INO, "big", dir_attr);
+            require_result_ok(dir_result);
+            dir_ino = *dir_result;
+            for (std::size_t i = 0; i < nentries; ++i) {
+                auto emplace_result = txn.emplace(dir_ino, "f" + std::to_string(i), reg_attr);
+                require_result_ok(emplace_result);
+                inos.emplace_back(*emplace_result);
+            }
+            check_result_ok(txn.commit());
+        }
+
+        WHEN("It is unlinked through a group commit") {
+            const auto steps_before = cache.orphan_reaper().steps();
+            check_result_ok(cache.write([dir_ino](Dragonstash::CacheTransactionRW &txn){
+                return txn.unlink(dir_ino);
+            }));
+
+            THEN("The rest is reaped in the background") {
+                cache.orphan_reaper().wait_idle();
+                CHECK(cache.orphan_reaper().steps() > steps_before);
+                for (ino_t ino: inos) {
+                    check_result_error(cache.getattr(ino), ENOENT);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Group commit") {
+    GIVEN("An empty cache") {
+        TestSetup setup;
+        Dragonstash::Cache &cache = setup.cache();
+
+        Dragonstash::InodeAttributes file_attrs{
+            .mode = S_IFREG,
+        };
+
+        WHEN("Submitting a write operation") {
+            Dragonstash::Result<ino_t> ino_result(Dragonstash::FAILED, EIO);
+            auto write_result = cache.write([&ino_result, &file_attrs](Dragonstash::CacheTransactionRW &txn) -> Dragonstash::Result<void> {
+                ino_result = txn.emplace(Dragonstash::ROOT_INO, "f1", file_attrs);
+                if (!ino_result) {
+                    return Dragonstash::copy_error(ino_result);
+                }
+                return Dragonstash::make_result();
+            });
+
+            THEN("The operation succeeds") {
+                check_result_ok(write_result);
+                check_result_ok(ino_result);
+            }
+
+            THEN("The changes are visible to new transactions") {
+                require_result_ok(ino_result);
+                auto lookup_result = cache.lookup(Dragonstash::ROOT_INO, "f1");
+                require_result_ok(lookup_result);
+                CHECK(*lookup_result == *ino_result);
+            }
+        }
+
+        WHEN("Submitting a failing write operation") {
+            static constexpr int random_errno = 1234;
+            std::atomic<bool> rollback_ran(false);
+            std::atomic<bool> stage_2_ran(false);
+            auto write_result = cache.write([&](Dragonstash::CacheTransactionRW &txn) -> Dragonstash::Result<void> {
+                auto ino_result = txn.emplace(Dragonstash::ROOT_INO, "f1", file_attrs);
+                if (!ino_result) {
+                    return Dragonstash::copy_error(ino_result);
+                }
+                txn.add_transaction_hook(nullptr, nullptr, [&stage_2_ran](){
+                    stage_2_ran = true;
+                }, [&rollback_ran](){
+                    rollback_ran = true;
+                });
+                return Dragonstash::make_result(Dragonstash::FAILED, random_errno);
+            });
+
+            THEN("The error of the operation is returned") {
+                check_result_error(write_result, random_errno);
+            }
+
+            THEN("The changes of the operation are rolled back") {
+                check_result_error(cache.lookup(Dragonstash::ROOT_INO, "f1"), ENOENT);
+                CHECK(rollback_ran);
+                CHECK(!stage_2_ran);
+            }
+
+            AND_WHEN("Submitting another operation") {
+                auto ino_result = cache.emplace(Dragonstash::ROOT_INO, "f2", file_attrs);
+
+                THEN("It is unaffected") {
+                    require_result_ok(ino_result);
+                    check_result_ok(cache.getattr(*ino_result));
+                }
+            }
+        }
+
+        WHEN("Submitting an operation with commit hooks") {
+            std::vector<int> order;
+            auto write_result = cache.write([&order](Dragonstash::CacheTransactionRW &txn) {
+                txn.add_commit_hook([&order](){
+                    order.push_back(1);
+                    return Dragonstash::make_result();
+                }, nullptr, [&order](){
+                    order.push_back(3);
+                });
+                txn.add_commit_hook([&order](){
+                    order.push_back(2);
+                    return Dragonstash::make_result();
+                }, nullptr, [&order](){
+                    order.push_back(4);
+                });
+                return Dragonstash::make_result();
+            });
+
+            THEN("The hooks have run in order before the write returned") {
+                check_result_ok(write_result);
+                CHECK(order == std::vector<int>{1, 2, 3, 4});
+            }
+        }
+
+        WHEN("Submitting many operations concurrently within a commit window") {
+            static constexpr std::size_t nthreads = 16;
+            cache.group_commit().set_window(std::chrono::milliseconds(200), nthreads);
+            const auto commits_before = cache.group_commit().commits();
+
+            std::vector<Dragonstash::Result<ino_t>> results(
+                        nthreads, Dragonstash::Result<ino_t>(Dragonstash::FAILED, EIO));
+            std::vector<std::thread> threads;
+            for (std::size_t i = 0; i < nthreads; ++i) {
+                threads.emplace_back([i, &cache, &results, &file_attrs](){
+                    results[i] = cache.emplace(Dragonstash::ROOT_INO,
+                                               "f" + std::to_string(i),
+                                               file_attrs);
+                });
+            }
+            for (auto &thread: threads) {
+                thread.join();
+            }
+
+            THEN("All operations succeed with distinct inodes") {
+                std::set<ino_t> inos;
+                for (auto &result: results) {
+                    require_result_ok(result);
+                    inos.insert(*result);
+                }
+                CHECK(inos.size() == nthreads);
+            }
+
+            THEN("The operations share commits") {
+                CHECK(cache.group_commit().commits() - commits_before < nthreads);
+            }
+
+            THEN("All entries are visible") {
+                for (std::size_t i = 0; i < nthreads; ++i) {
+                    auto lookup_result = cache.lookup(Dragonstash::ROOT_INO, "f" + std::to_string(i));
+                    require_result_ok(lookup_result);
+                    CHECK(*lookup_result == *results[i]);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Pin rules in the cache") {
+    TestSetup setup;
+    Dragonstash::Cache &cache = setup.cache();
+
+    GIVEN("An empty cache") {
+        THEN("There are no rules") {
+            CHECK(cache.begin_ro().pin_rules().empty());
+            CHECK(cache.begin_ro().pin_generation() == 0);
+        }
+
+        WHEN("Rules are added") {
+            std::uint64_t first = 0;
+            std::uint64_t second = 0;
+            {
+                auto txn = cache.begin_rw();
+                first = txn.add_pin_rule(Dragonstash::PinRule::make_subtree("/books"));
+                second = txn.add_pin_rule(Dragonstash::PinRule::make_glob("/*.md", 100));
+                require_result_ok(txn.commit());
+            }
+
+            THEN("They get distinct ids") {
+                CHECK(first != second);
+            }
+
+            THEN("They can be read back in order") {
+                auto rules = cache.begin_ro().pin_rules();
+                REQUIRE(rules.size() == 2);
+                CHECK(rules[0].id == first);
+                CHECK(rules[0].pattern == "/books");
+                CHECK(rules[1].id == second);
+                CHECK(rules[1].kind == Dragonstash::PinRule::Kind::GLOB);
+                CHECK(rules[1].max_size == 100);
+                CHECK(!rules[1].retired);
+            }
+
+            THEN("The generation changes") {
+                CHECK(cache.begin_ro().pin_generation() != 0);
+            }
+
+            AND_WHEN("A rule is removed") {
+                const std::uint64_t generation = cache.begin_ro().pin_generation();
+                {
+                    auto txn = cache.begin_rw();
+                    require_result_ok(txn.remove_pin_rule(first));
+                    require_result_ok(txn.commit());
+                }
+
+                THEN("It is retired") {
+                    auto rules = cache.begin_ro().pin_rules();
+                    REQUIRE(rules.size() == 2);
+                    CHECK(rules[0].retired);
+                    CHECK(!rules[1].retired);
+                    CHECK(cache.begin_ro().pin_generation() != generation);
+                }
+
+                THEN("It cannot be removed again") {
+                    auto txn = cache.begin_rw();
+                    check_result_error(txn.remove_pin_rule(first), ENOENT);
+                }
+
+                AND_WHEN("The rules are purged") {
+                    {
+                        auto txn = cache.begin_rw();
+                        txn.purge_pin_rules({first, second});
+                        require_result_ok(txn.commit());
+                    }
+
+                    THEN("Only the retired rule is gone") {
+                        auto rules = cache.begin_ro().pin_rules();
+                        REQUIRE(rules.size() == 1);
+                        CHECK(rules[0].id == second);
+                    }
+
+                    THEN("Its id is not reused") {
+                        auto txn = cache.begin_rw();
+                        const std::uint64_t third = txn.add_pin_rule(
+                                    Dragonstash::PinRule::make_subtree("/music"));
+                        CHECK(third != first);
+                        CHECK(third != second);
+                    }
+                }
+            }
+        }
+
+        WHEN("Removing a nonexistent rule") {
+            auto txn = cache.begin_rw();
+
+            THEN("ENOENT is returned") {
+                check_result_error(txn.remove_pin_rule(1234), ENOENT);
+            }
+        }
+    }
+
+    GIVEN("Pinned contents") {
+        Dragonstash::InodeAttributes dir_attr{
+            .mode = S_IFDIR
+        };
+        Dragonstash::InodeAttributes reg_attr{
+            .mode = S_IFREG
+        };
+        ino_t in_books;
+        ino_t in_root;
+        {
+            auto txn = cache.begin_rw();
+            auto dir_result = txn.emplace(Dragonstash::ROOT_INO, "books", dir_attr);
+            require_result_ok(dir_result);
+            auto file_result = txn.emplace(*dir_result, "a.epub", reg_attr);
+            require_result_ok(file_result);
+            in_books = *file_result;
+            file_result = txn.emplace(Dragonstash::ROOT_INO, "README.md", reg_attr);
+            require_result_ok(file_result);
+            in_root = *file_result;
+            require_result_ok(txn.commit());
+        }
+        const std::vector<char> data(Dragonstash::CACHE_PAGE_SIZE, 'p');
+        for (const ino_t ino: {in_books, in_root}) {
+            auto content_result = cache.open_file(ino);
+            require_result_ok(content_result);
+            auto &content = *content_result;
+            require_result_ok(content->store(content->generation(), 0,
+                                             data.data(), data.size(), true,
+                                             Dragonstash::Blocklist::PINNED));
+        }
+
+        WHEN("Unpinning the contents of a rule") {
+            Dragonstash::PinPolicy released({Dragonstash::PinRule::make_subtree("/")});
+            Dragonstash::PinPolicy kept({Dragonstash::PinRule::make_subtree("/books")});
+            const std::size_t unpinned = cache.unpin(released, kept);
+
+            THEN("Only files which are not pinned by another rule are unpinned") {
+                CHECK(unpinned == 1);
+                auto content_result = cache.open_file(in_root);
+                require_result_ok(content_result);
+                CHECK((*content_result)->cached_blocks(Dragonstash::Blocklist::PINNED) == 0);
+                CHECK((*content_result)->cached_blocks(Dragonstash::Blocklist::READ) == 1);
+
+                content_result = cache.open_file(in_books);
+                require_result_ok(content_result);
+                CHECK((*content_result)->cached_blocks(Dragonstash::Blocklist::PINNED) == 1);
+            }
+        }
+
+        WHEN("Unpinning the contents of an unrelated rule") {
+            Dragonstash::PinPolicy released({Dragonstash::PinRule::make_subtree("/music")});
+            const std::size_t unpinned = cache.unpin(released, Dragonstash::PinPolicy());
+
+            THEN("Nothing is unpinned") {
+                CHECK(unpinned == 0);
+            }
+        }
+    }
+}
+
+SCENARIO("Pin rules of a cache in use") {
+    TestSetup setup;
+    Dragonstash::Cache &cache = setup.cache();
+
+    GIVEN("A cache which references an orphaned inode") {
+        auto emplace_result = cache.emplace(Dragonstash::ROOT_INO, "entry",
+                                            Dragonstash::InodeAttributes{.mode = S_IFDIR});
+        require_result_ok(emplace_result);
+        require_result_ok(cache.lock(*emplace_result));
+        auto replace_result = cache.emplace(Dragonstash::ROOT_INO, "entry",
+                                            Dragonstash::InodeAttributes{.mode = S_IFREG});
+        require_result_ok(replace_result);
+        REQUIRE(*replace_result != *emplace_result);
+
+        WHEN("A pin rule is added through the pin rule store") {
+            std::uint64_t id = 0;
+            {
+                Dragonstash::PinRuleStore pins(setup.env().path());
+                id = pins.add(Dragonstash::PinRule::make_subtree("/books"));
+            }
+
+            THEN("The orphaned inode is kept") {
+                check_result_ok(cache.getattr(*emplace_result));
+            }
+
+            THEN("The cache sees the rule") {
+                auto rules = cache.begin_ro().pin_rules();
+                REQUIRE(rules.size() == 1);
+                CHECK(rules[0].id == id);
+                CHECK(rules[0].pattern == "/books");
+                CHECK(cache.begin_ro().pin_generation() != 0);
+            }
+
+            AND_WHEN("The rule is removed") {
+                Dragonstash::PinRuleStore pins(setup.env().path());
+                require_result_ok(pins.remove(id));
+
+                THEN("It is retired") {
+                    auto rules = pins.rules();
+                    REQUIRE(rules.size() == 1);
+                    CHECK(rules[0].retired);
+                    check_result_error(pins.remove(id), ENOENT);
+                }
+            }
+        }
+
+        WHEN("Opening the cache a second time") {
+            THEN("It is refused") {
+                CHECK_THROWS_AS(Dragonstash::Cache(setup.env().path()), std::runtime_error);
+                check_result_ok(cache.getattr(*emplace_result));
+            }
+        }
+    }
+}
+
+SCENARIO("Write-back journal") {
+    TestSetup setup;
+    Dragonstash::Cache &cache = setup.cache();
+    Dragonstash::InodeAttributes reg_attr{
+        .mode = S_IFREG
+    };
+
+    GIVEN("A file in the cache") {
+        ino_t ino;
+        {
+            auto txn = cache.begin_rw();
+            auto emplace_result = txn.emplace(Dragonstash::ROOT_INO, "notes.txt", reg_attr);
+            require_result_ok(emplace_result);
+            ino = *emplace_result;
+            require_result_ok(txn.commit());
+        }
+
+        THEN("Nothing is journaled for it") {
+            auto txn = cache.begin_ro();
+            CHECK(!txn.journaled(ino));
+            check_result_error(txn.journal(ino), ENOENT);
+            CHECK(txn.journaled_inodes().empty());
+        }
+
+        WHEN("Journaling overlapping and adjacent writes") {
+            {
+                auto txn = cache.begin_rw();
+                txn.journal_write(ino, 100, 50, 150);
+                txn.journal_write(ino, 0, 10, 150);
+                txn.journal_write(ino, 120, 80, 200);
+                txn.journal_write(ino, 200, 10, 210);
+                require_result_ok(txn.commit());
+            }
+
+            THEN("They are merged into contiguous extents") {
+                auto txn = cache.begin_ro();
+                auto journal_result = txn.journal(ino);
+                require_result_ok(journal_result);
+                CHECK(journal_result->size == 210);
+                CHECK(!journal_result->created);
+                CHECK(!journal_result->resized);
+                REQUIRE(journal_result->extents.size() == 2);
+                CHECK(journal_result->extents[0].offset == 0);
+                CHECK(journal_result->extents[0].length == 10);
+                CHECK(journal_result->extents[1].offset == 100);
+                CHECK(journal_result->extents[1].length == 110);
+            }
+
+            THEN("The inode is listed as journaled") {
+                auto txn = cache.begin_ro();
+                CHECK(txn.journaled(ino));
+                CHECK(txn.journaled_inodes() == std::vector<ino_t>{ino});
+            }
+
+            THEN("The file cannot be unlinked") {
+                auto txn = cache.begin_rw();
+                check_result_error(txn.unlink(ino), EBUSY);
+                check_result_error(txn.unlink(Dragonstash::ROOT_INO, "notes.txt"), EBUSY);
+            }
+
+            THEN("A rewrite of its directory keeps the file") {
+                {
+                    auto txn = cache.begin_rw();
+                    require_result_ok(txn.start_dir_rewrite(Dragonstash::ROOT_INO));
+                    require_result_ok(txn.finish_dir_rewrite());
+                    require_result_ok(txn.clean_orphans());
+                    require_result_ok(txn.commit());
+                }
+                check_result_ok(cache.getattr(ino));
+            }
+
+            THEN("Re-emplacing the file with another type keeps the inode") {
+                auto txn = cache.begin_rw();
+                auto emplace_result = txn.emplace(Dragonstash::ROOT_INO, "notes.txt",
+                                                  Dragonstash::InodeAttributes{.mode = S_IFDIR});
+                require_result_ok(emplace_result);
+                CHECK(*emplace_result == ino);
+            }
+
+            AND_WHEN("The file is truncated into the extents") {
+                {
+                    auto txn = cache.begin_rw();
+                    txn.journal_resize(ino, 120);
+                    require_result_ok(txn.commit());
+                }
+
+                THEN("The extents are cut at the new size") {
+                    auto txn = cache.begin_ro();
+                    auto journal_result = txn.journal(ino);
+                    require_result_ok(journal_result);
+                    CHECK(journal_result->size == 120);
+                    CHECK(journal_result->resized);
+                    REQUIRE(journal_result->extents.size() == 2);
+                    CHECK(journal_result->extents[1].offset == 100);
+                    CHECK(journal_result->extents[1].length == 20);
+                }
+            }
+
+            AND_WHEN("The journal is completed with its generation") {
+                std::uint64_t generation;
+                {
+                    auto txn = cache.begin_ro();
+                    auto journal_result = txn.journal(ino);
+                    require_result_ok(journal_result);
+                    generation = journal_result->generation;
+                }
+                bool completed;
+                {
+                    auto txn = cache.begin_rw();
+                    completed = txn.complete_journal(ino, generation);
+                    require_result_ok(txn.commit());
+                }
+
+                THEN("The journal is gone") {
+                    CHECK(completed);
+                    auto txn = cache.begin_ro();
+                    CHECK(!txn.journaled(ino));
+                    CHECK(txn.journaled_inodes().empty());
+                }
+
+                THEN("The file can be unlinked again") {
+                    auto txn = cache.begin_rw();
+                    check_result_ok(txn.unlink(ino));
+                }
+            }
+
+            AND_WHEN("The file changes again before the journal is completed") {
+                std::uint64_t generation;
+                {
+                    auto txn = cache.begin_ro();
+                    auto journal_result = txn.journal(ino);
+                    require_result_ok(journal_result);
+                    generation = journal_result->generation;
+                }
+                bool completed;
+                {
+                    auto txn = cache.begin_rw();
+                    txn.journal_write(ino, 300, 10, 310);
+                    completed = txn.complete_journal(ino, generation);
+                    require_result_ok(txn.commit());
+                }
+
+                THEN("The journal is kept") {
+                    CHECK(!completed);
+                    auto txn = cache.begin_ro();
+                    CHECK(txn.journaled(ino));
+                }
+            }
+        }
+
+        WHEN("Journaling the creation of the file") {
+            {
+                auto txn = cache.begin_rw();
+                txn.journal_create(ino);
+                require_result_ok(txn.commit());
+            }
+
+            THEN("The journal says so") {
+                auto txn = cache.begin_ro();
+                auto journal_result = txn.journal(ino);
+                require_result_ok(journal_result);
+                CHECK(journal_result->created);
+                CHECK(journal_result->size == 0);
+                CHECK(journal_result->extents.empty());
+            }
+        }
+    }
+}
@@ -0,0 +1,124 @@
+/**********************************************************************
+File name: direntry.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <sys/stat.h>
+
+#include "dragonstash/cache/direntry.hpp"
+
+SCENARIO("Directory entry deserialization") {
+    GIVEN("a current version directory entry with attributes") {
+        Dragonstash::InodeAttributes attrs{
+            Dragonstash::CommonFileAttributes{
+                .size = 0x123456789abcdef0,
+                .uid = 0x12345678,
+                .gid = 0x12345679,
+                .mtime = timespec{0x423456789abcdef0, 0x423456789abcdef1},
+            },
+            S_IFREG,
+        };
+        std::basic_string<std::byte> buf;
+        {
+            Dragonstash::DirEntry *entry;
+            char *name_ptr;
+            std::tie(entry, name_ptr) = Dragonstash::emplace(buf, 3, 0x1122334455667788);
+            entry->attr = attrs;
+            memcpy(name_ptr, "foo", 3);
+        }
+
+        WHEN("parsed") {
+            auto parse_result = Dragonstash::DirEntry::parse(buf);
+
+            THEN("the inode, name and attributes are preserved") {
+                REQUIRE(parse_result);
+                const auto &[entry, name] = *parse_result;
+                CHECK(entry.version == Dragonstash::DIR_ENTRY_VERSION);
+                CHECK(entry.has_attributes());
+                CHECK(entry.entry_ino == 0x1122334455667788);
+                CHECK(entry.attr == attrs);
+                CHECK(name == "foo");
+            }
+        }
+    }
+
+    GIVEN("a version 1 directory entry") {
+        Dragonstash::DirEntryV1 legacy{
+            .version = 1,
+            .mode = S_IFDIR,
+            .entry_ino = 0x1122334455667788,
+        };
+        std::basic_string<std::byte> buf;
+        buf.resize(Dragonstash::DIR_ENTRY_V1_SIZE + 3);
+        memcpy(buf.data(), &legacy, Dragonstash::DIR_ENTRY_V1_SIZE);
+        memcpy(buf.data() + Dragonstash::DIR_ENTRY_V1_SIZE, "bar", 3);
+
+        WHEN("parsed") {
+            auto parse_result = Dragonstash::DirEntry::parse(buf);
+
+            THEN("it is upgraded, but flagged as lacking attributes") {
+                REQUIRE(parse_result);
+                const auto &[entry, name] = *parse_result;
+                CHECK(!entry.has_attributes());
+                CHECK(entry.entry_ino == 0x1122334455667788);
+                CHECK(entry.attr.mode == S_IFDIR);
+                CHECK(name == "bar");
+            }
+        }
+    }
+
+    GIVEN("an invalid buffer") {
+        WHEN("the buffer is empty") {
+            std::basic_string<std::byte> buf;
+            auto parse_result = Dragonstash::DirEntry::parse(buf);
+
+            THEN("parsing fails with EINVAL") {
+                CHECK(!parse_result);
+                CHECK(parse_result.error() == EINVAL);
+            }
+        }
+
+        WHEN("the version is unknown") {
+            std::basic_string<std::byte> buf(Dragonstash::DIR_ENTRY_SIZE, std::byte(0));
+            buf[0] = std::byte(0xff);
+            auto parse_result = Dragonstash::DirEntry::parse(buf);
+
+            THEN("parsing fails with EINVAL") {
+                CHECK(!parse_result);
+                CHECK(parse_result.error() == EINVAL);
+            }
+        }
+
+        WHEN("the buffer is truncated") {
+            std::basic_string<std::byte> buf(Dragonstash::DIR_ENTRY_SIZE - 1, std::byte(0));
+            buf[0] = std::byte(Dragonstash::DIR_ENTRY_VERSION);
+            auto parse_result = Dragonstash::DirEntry::parse(buf);
+
+            THEN("parsing fails with EINVAL") {
+                CHECK(!parse_result);
+                CHECK(parse_result.error() == EINVAL);
+            }
+        }
+    }
+}
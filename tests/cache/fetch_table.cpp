@@ -0,0 +1,284 @@
+/**********************************************************************
+File name: fetch_table.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "dragonstash/cache/fetch_table.hpp"
+
+namespace {
+
+/**
+ * Fetcher which records its calls and blocks until it is opened.
+ */
+class GatedFetcher {
+public:
+    struct Call {
+        std::uint64_t offset;
+        std::size_t n;
+    };
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_open = false;
+    int m_error = 0;
+    std::vector<Call> m_calls;
+
+public:
+    Dragonstash::FetchTable::Fetcher fetcher() {
+        return [this](std::uint64_t offset, char *buf, std::size_t n)
+                -> Dragonstash::Result<std::size_t>
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_calls.emplace_back(Call{offset, n});
+            m_cv.notify_all();
+            m_cv.wait(lock, [this]() { return m_open; });
+            if (m_error != 0) {
+                return Dragonstash::make_result(Dragonstash::FAILED, m_error);
+            }
+            for (std::size_t i = 0; i < n; ++i) {
+                buf[i] = char((offset + i) / 4096);
+            }
+            return n;
+        };
+    }
+
+    void wait_for_calls(std::size_t ncalls) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this, ncalls]() { return m_calls.size() >= ncalls; });
+    }
+
+    void open(int error = 0) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_open = true;
+        m_error = error;
+        m_cv.notify_all();
+    }
+
+    /**
+     * Calls ordered by offset; queued fetches start in no particular order.
+     */
+    std::vector<Call> calls() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto result = m_calls;
+        std::sort(result.begin(), result.end(), [](const Call &a, const Call &b) {
+            return a.offset < b.offset;
+        });
+        return result;
+    }
+};
+
+void wait_until(const std::function<bool()> &cond)
+{
+    while (!cond()) {
+        std::this_thread::yield();
+    }
+}
+
+}
+
+SCENARIO("Fetch table") {
+    GatedFetcher gate;
+
+    GIVEN("A fetch table") {
+        Dragonstash::FetchTable table;
+
+        WHEN("A range is fetched") {
+            gate.open();
+            auto result = table.fetch(4096, 12288, gate.fetcher());
+
+            THEN("The fetcher is called for exactly that range") {
+                REQUIRE(gate.calls().size() == 1);
+                CHECK(gate.calls()[0].offset == 4096);
+                CHECK(gate.calls()[0].n == 8192);
+                CHECK(table.issued() == 1);
+                CHECK(table.joined() == 0);
+            }
+
+            THEN("The data is returned") {
+                REQUIRE(result);
+                CHECK((*result)->offset == 4096);
+                REQUIRE((*result)->data.size() == 8192);
+                CHECK((*result)->data[0] == 1);
+                CHECK((*result)->data[4096] == 2);
+            }
+
+            THEN("Nothing is left in flight") {
+                CHECK(table.in_flight() == 0);
+            }
+        }
+
+        WHEN("A range inside a running fetch is requested") {
+            std::thread first([&]() {
+                (void)table.fetch(0, 16384, gate.fetcher());
+            });
+            gate.wait_for_calls(1);
+
+            Dragonstash::Result<std::shared_ptr<const Dragonstash::FetchTable::Fetch>> second =
+                    Dragonstash::make_result(Dragonstash::FAILED, EINVAL);
+            std::thread second_thread([&]() {
+                second = table.fetch(4096, 8192, gate.fetcher());
+            });
+            wait_until([&]() { return table.joined() == 1; });
+            gate.open();
+            first.join();
+            second_thread.join();
+
+            THEN("It waits for the running fetch") {
+                CHECK(gate.calls().size() == 1);
+                CHECK(table.issued() == 1);
+                REQUIRE(second);
+                CHECK((*second)->offset == 0);
+                CHECK((*second)->data.size() == 16384);
+            }
+        }
+
+        WHEN("A range overlapping a later fetch is requested") {
+            std::thread first([&]() {
+                (void)table.fetch(8192, 16384, gate.fetcher());
+            });
+            gate.wait_for_calls(1);
+
+            std::thread second([&]() {
+                (void)table.fetch(0, 16384, gate.fetcher());
+            });
+            gate.wait_for_calls(2);
+            gate.open();
+            first.join();
+            second.join();
+
+            THEN("It is cut short in front of the running fetch") {
+                auto calls = gate.calls();
+                REQUIRE(calls.size() == 2);
+                CHECK(calls[0].offset == 0);
+                CHECK(calls[0].n == 8192);
+            }
+        }
+
+        WHEN("The fetch fails") {
+            std::thread first([&]() {
+                (void)table.fetch(0, 4096, gate.fetcher());
+            });
+            gate.wait_for_calls(1);
+
+            Dragonstash::Result<std::shared_ptr<const Dragonstash::FetchTable::Fetch>> second =
+                    std::shared_ptr<const Dragonstash::FetchTable::Fetch>();
+            std::thread second_thread([&]() {
+                second = table.fetch(0, 4096, gate.fetcher());
+            });
+            wait_until([&]() { return table.joined() == 1; });
+            gate.open(EIO);
+            first.join();
+            second_thread.join();
+
+            THEN("The error is passed to everyone waiting") {
+                REQUIRE(!second);
+                CHECK(second.error() == EIO);
+            }
+        }
+    }
+
+    GIVEN("A fetch table with a single fetch slot") {
+        Dragonstash::FetchTable table(1, 16384);
+
+        WHEN("Adjacent ranges are requested while the slot is busy") {
+            std::thread first([&]() {
+                (void)table.fetch(0, 4096, gate.fetcher());
+            });
+            gate.wait_for_calls(1);
+
+            std::thread second([&]() {
+                (void)table.fetch(4096, 8192, gate.fetcher());
+            });
+            wait_until([&]() { return table.in_flight() == 2; });
+
+            Dragonstash::Result<std::shared_ptr<const Dragonstash::FetchTable::Fetch>> third =
+                    Dragonstash::make_result(Dragonstash::FAILED, EINVAL);
+            std::thread third_thread([&]() {
+                third = table.fetch(8192, 12288, gate.fetcher());
+            });
+            wait_until([&]() { return table.joined() == 1; });
+
+            std::thread fourth([&]() {
+                (void)table.fetch(20480, 24576, gate.fetcher());
+            });
+            wait_until([&]() { return table.in_flight() == 3; });
+
+            gate.open();
+            first.join();
+            second.join();
+            third_thread.join();
+            fourth.join();
+
+            THEN("Adjacent queued ranges are merged into one fetch") {
+                auto calls = gate.calls();
+                REQUIRE(calls.size() == 3);
+                CHECK(calls[1].offset == 4096);
+                CHECK(calls[1].n == 8192);
+                REQUIRE(third);
+                CHECK((*third)->offset == 4096);
+                CHECK((*third)->data.size() == 8192);
+                CHECK((*third)->data[4096] == 2);
+            }
+
+            THEN("Ranges which are not adjacent are fetched separately") {
+                auto calls = gate.calls();
+                REQUIRE(calls.size() == 3);
+                CHECK(calls[2].offset == 20480);
+                CHECK(calls[2].n == 4096);
+            }
+        }
+
+        WHEN("Merging would exceed the size limit") {
+            std::thread first([&]() {
+                (void)table.fetch(0, 4096, gate.fetcher());
+            });
+            gate.wait_for_calls(1);
+
+            std::thread second([&]() {
+                (void)table.fetch(4096, 16384, gate.fetcher());
+            });
+            wait_until([&]() { return table.in_flight() == 2; });
+            std::thread third([&]() {
+                (void)table.fetch(16384, 24576, gate.fetcher());
+            });
+            wait_until([&]() { return table.in_flight() == 3; });
+
+            gate.open();
+            first.join();
+            second.join();
+            third.join();
+
+            THEN("The ranges are fetched separately") {
+                CHECK(gate.calls().size() == 3);
+                CHECK(table.joined() == 0);
+            }
+        }
+    }
+}
@@ -45,6 +45,16 @@ SCENARIO("Inode serialization") {
             },
             0x1122334455667788
         );
+        WHEN("serialized") {
+            const auto buf = Dragonstash::serialize(node);
+
+            THEN("the current compact version is written") {
+                REQUIRE(!buf.empty());
+                CHECK(static_cast<std::uint8_t>(buf[0]) == Dragonstash::INODE_CURRENT_VERSION);
+                CHECK(buf.size() <= Dragonstash::INODE_MAX_ENCODED_SIZE);
+            }
+        }
+
         WHEN("serialized and deserialized") {
             const auto buf = Dragonstash::serialize(node);
             auto parse_result = Dragonstash::Inode::parse(buf);
@@ -94,8 +104,8 @@ SCENARIO("Inode deserialization") {
             }
         }
 
-        WHEN("the buffer has the invalid version 0x02") {
-            std::array<std::uint8_t, 1> buf{{0x02}};
+        WHEN("the buffer has the invalid version 0x03") {
+            std::array<std::uint8_t, 1> buf{{0x03}};
             THEN("return -EINVAL") {
                 auto parse_result = Dragonstash::Inode::parse(std::basic_string_view<std::byte>(reinterpret_cast<std::byte*>(buf.data()), buf.size()));
                 CHECK(!parse_result);
@@ -171,3 +181,91 @@ SCENARIO("Inode deserialization") {
         }
     }
 }
+
+SCENARIO("Compact inode records") {
+    GIVEN("an Inode with typical attributes") {
+        Dragonstash::Inode node = mkinode(
+            Dragonstash::InodeAttributes{
+                Dragonstash::CommonFileAttributes{
+                    .size = 123456,
+                    .nblocks = 31,
+                    .uid = 1000,
+                    .gid = 1000,
+                    .atime = timespec{1536390000, 20180908},
+                    .mtime = timespec{1536390000, 20180908},
+                    .ctime = timespec{1536390005, 0},
+                },
+                S_IFREG | 0644,
+            },
+            4711
+        );
+        node.set_flag(Dragonstash::InodeFlag::SYNCED);
+
+        WHEN("serialized") {
+            const auto buf = Dragonstash::serialize(node);
+
+            THEN("the record is much smaller than a version 1 record") {
+                CHECK(buf.size() < Dragonstash::INODE_SIZE / 2);
+            }
+
+            THEN("it can be parsed back") {
+                auto parse_result = Dragonstash::Inode::parse(buf);
+                REQUIRE(parse_result);
+                CHECK(parse_result->parent == node.parent);
+                CHECK(parse_result->attr == node.attr);
+                CHECK(parse_result->test_flag(Dragonstash::InodeFlag::SYNCED));
+            }
+
+            THEN("trailing data is ignored") {
+                auto extended = buf;
+                extended.push_back(std::byte(0xff));
+                auto parse_result = Dragonstash::Inode::parse(extended);
+                REQUIRE(parse_result);
+                CHECK(parse_result->attr == node.attr);
+            }
+
+            THEN("every truncation is rejected") {
+                for (std::size_t len = 1; len < buf.size(); ++len) {
+                    auto parse_result = Dragonstash::Inode::parse(
+                                std::basic_string_view<std::byte>(buf.data(), len));
+                    CHECK(!parse_result);
+                    CHECK(parse_result.error() == EINVAL);
+                }
+            }
+        }
+    }
+
+    GIVEN("an Inode with timestamps before the epoch") {
+        Dragonstash::Inode node = mkinode(
+            Dragonstash::InodeAttributes{
+                Dragonstash::CommonFileAttributes{
+                    .atime = timespec{-1, 999999999},
+                    .mtime = timespec{-86400, 0},
+                    .ctime = timespec{1536390000, 1},
+                },
+                S_IFDIR,
+            }
+        );
+
+        WHEN("serialized and deserialized") {
+            auto parse_result = Dragonstash::Inode::parse(Dragonstash::serialize(node));
+
+            THEN("the timestamps are identical") {
+                REQUIRE(parse_result);
+                CHECK(parse_result->attr == node.attr);
+            }
+        }
+    }
+
+    GIVEN("a version 2 record with an overlong varint") {
+        std::array<std::uint8_t, 12> buf{{
+                0x02,
+                0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+            }};
+        THEN("return -EINVAL") {
+            auto parse_result = Dragonstash::Inode::parse(std::basic_string_view<std::byte>(reinterpret_cast<std::byte*>(buf.data()), buf.size()));
+            CHECK(!parse_result);
+            CHECK(parse_result.error() == EINVAL);
+        }
+    }
+}
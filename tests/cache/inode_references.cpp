@@ -0,0 +1,222 @@
+/**********************************************************************
+File name: inode_references.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <thread>
+#include <vector>
+
+#include "dragonstash/cache/inode_references.hpp"
+
+#include "../testutils/result.hpp"
+
+SCENARIO("Inode references") {
+    GIVEN("An empty reference table") {
+        Dragonstash::InodeReferences refs(4);
+
+        THEN("Inodes have no references and are not doomed") {
+            CHECK(refs.refcount(2) == 0);
+            CHECK(!refs.doomed(2));
+        }
+
+        WHEN("Adding references") {
+            auto inc_result = refs.incref(2, 1);
+            require_result_ok(inc_result);
+            CHECK(*inc_result == 1);
+            inc_result = refs.incref(2, 2);
+            require_result_ok(inc_result);
+            CHECK(*inc_result == 3);
+
+            THEN("They are counted") {
+                CHECK(refs.refcount(2) == 3);
+                CHECK(refs.refcount(3) == 0);
+            }
+
+            THEN("The inode cannot be doomed") {
+                check_result_error(refs.doom(2), EBUSY);
+                CHECK(!refs.doomed(2));
+            }
+
+            THEN("Dropping references counts down") {
+                auto dec_result = refs.decref(2, 2);
+                require_result_ok(dec_result);
+                CHECK(*dec_result == 1);
+            }
+
+            THEN("Dropping zero references fails with EINVAL") {
+                check_result_error(refs.decref(2, 0), EINVAL);
+            }
+
+            THEN("Dropping more references than there are throws") {
+                CHECK_THROWS_AS(refs.decref(2, 4), std::runtime_error);
+                CHECK(refs.refcount(2) == 3);
+            }
+
+            AND_WHEN("All references are dropped") {
+                require_result_ok(refs.decref(2, 3));
+
+                THEN("The inode can be doomed") {
+                    check_result_ok(refs.doom(2));
+                    CHECK(refs.doomed(2));
+                }
+            }
+        }
+
+        WHEN("Dooming an inode") {
+            check_result_ok(refs.doom(2));
+
+            THEN("It cannot be locked anymore") {
+                check_result_error(refs.incref(2, 1), ESTALE);
+                CHECK(refs.refcount(2) == 0);
+            }
+
+            THEN("It can be doomed again") {
+                check_result_ok(refs.doom(2));
+            }
+        }
+
+        WHEN("Dropping references of many inodes at once") {
+            require_result_ok(refs.incref(2, 3));
+            require_result_ok(refs.incref(3, 1));
+            require_result_ok(refs.incref(6, 2));
+            std::vector<Dragonstash::InodeReferences::Release> releases{
+                {6, 1}, {2, 1}, {3, 1}, {2, 1}, {6, 0},
+            };
+            std::vector<Dragonstash::ino_t> reapable;
+            refs.decref_many(releases, &reapable);
+
+            THEN("All releases are applied") {
+                CHECK(refs.refcount(2) == 1);
+                CHECK(refs.refcount(3) == 0);
+                CHECK(refs.refcount(6) == 1);
+            }
+
+            THEN("Nothing is reported as reapable") {
+                CHECK(reapable.empty());
+            }
+        }
+
+        WHEN("An inode is doomed while it has references") {
+            require_result_ok(refs.incref(2, 2));
+            require_result_ok(refs.incref(3, 1));
+            check_result_error(refs.doom(2), EBUSY);
+
+            AND_WHEN("Its last reference is released in bulk") {
+                std::vector<Dragonstash::InodeReferences::Release> releases{
+                    {2, 2}, {3, 1},
+                };
+                std::vector<Dragonstash::ino_t> reapable;
+                refs.decref_many(releases, &reapable);
+
+                THEN("It is reported as reapable") {
+                    CHECK(reapable == std::vector<Dragonstash::ino_t>{2});
+                    CHECK(refs.refcount(2) == 0);
+                }
+
+                THEN("It can be doomed now") {
+                    check_result_ok(refs.doom(2));
+                    CHECK(refs.doomed(2));
+                }
+            }
+
+            AND_WHEN("Only some references are released in bulk") {
+                std::vector<Dragonstash::InodeReferences::Release> releases{
+                    {2, 1},
+                };
+                std::vector<Dragonstash::ino_t> reapable;
+                refs.decref_many(releases, &reapable);
+
+                THEN("It is not reported as reapable") {
+                    CHECK(reapable.empty());
+                    CHECK(refs.refcount(2) == 1);
+                }
+            }
+        }
+
+        WHEN("Dropping references of an unknown inode") {
+            THEN("It throws") {
+                CHECK_THROWS_AS(refs.decref(2, 1), std::runtime_error);
+            }
+        }
+    }
+
+    GIVEN("A reference table used by many threads") {
+        Dragonstash::InodeReferences refs(4);
+        static constexpr int nthreads = 8;
+        static constexpr int nrounds = 1000;
+
+        WHEN("The threads lock and release a shared set of inodes") {
+            std::vector<std::thread> threads;
+            for (int i = 0; i < nthreads; ++i) {
+                threads.emplace_back([&refs]() {
+                    for (int round = 0; round < nrounds; ++round) {
+                        const Dragonstash::ino_t ino = 2 + round % 16;
+                        (void)refs.incref(ino, 2);
+                        (void)refs.decref(ino, 1);
+                    }
+                });
+            }
+            for (auto &thread: threads) {
+                thread.join();
+            }
+
+            THEN("No update is lost") {
+                std::uint64_t total = 0;
+                for (Dragonstash::ino_t ino = 2; ino < 18; ++ino) {
+                    total += refs.refcount(ino);
+                }
+                CHECK(total == nthreads * nrounds);
+            }
+        }
+
+        WHEN("Threads race to lock an inode which another thread dooms") {
+            std::atomic<int> locked(0);
+            std::atomic<bool> doomed(false);
+            std::vector<std::thread> threads;
+            for (int i = 0; i < nthreads; ++i) {
+                threads.emplace_back([&refs, &locked]() {
+                    if (refs.incref(2, 1)) {
+                        ++locked;
+                    }
+                });
+            }
+            threads.emplace_back([&refs, &doomed]() {
+                doomed = bool(refs.doom(2));
+            });
+            for (auto &thread: threads) {
+                thread.join();
+            }
+
+            THEN("Either the doom or the locks win") {
+                CHECK(refs.refcount(2) == std::uint64_t(locked));
+                if (doomed) {
+                    CHECK(refs.doomed(2));
+                    CHECK(locked == 0);
+                } else {
+                    CHECK(locked > 0);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,106 @@
+/**********************************************************************
+File name: path_cache.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include "dragonstash/cache/path_cache.hpp"
+
+SCENARIO("Path cache") {
+    GIVEN("An empty path cache") {
+        Dragonstash::PathCache cache(4, 1);
+
+        WHEN("Looking up an inode") {
+            auto result = cache.lookup(2);
+
+            THEN("It is not found") {
+                CHECK(!result);
+            }
+
+            THEN("A miss is counted") {
+                CHECK(cache.misses() == 1);
+                CHECK(cache.hits() == 0);
+            }
+        }
+
+        WHEN("Inserting an entry") {
+            cache.insert(2, Dragonstash::ROOT_INO, "foo", cache.epoch());
+
+            THEN("It can be looked up") {
+                auto result = cache.lookup(2);
+                REQUIRE(result);
+                CHECK(result->parent == Dragonstash::ROOT_INO);
+                CHECK(result->name == "foo");
+                CHECK(cache.hits() == 1);
+                CHECK(cache.misses() == 0);
+            }
+
+            AND_WHEN("Invalidating the entry") {
+                cache.invalidate(2);
+
+                THEN("It is not found anymore") {
+                    CHECK(!cache.lookup(2));
+                }
+            }
+        }
+
+        WHEN("Inserting an entry with an outdated epoch") {
+            const auto epoch = cache.epoch();
+            cache.invalidate(3);
+            cache.insert(2, Dragonstash::ROOT_INO, "foo", epoch);
+
+            THEN("The entry is not inserted") {
+                CHECK(!cache.lookup(2));
+                CHECK(cache.size() == 0);
+            }
+        }
+
+        WHEN("Inserting more entries than the capacity") {
+            for (ino_t ino = 2; ino < 7; ++ino) {
+                cache.insert(ino, Dragonstash::ROOT_INO, std::to_string(ino), cache.epoch());
+            }
+
+            THEN("The size is bounded") {
+                CHECK(cache.size() == cache.capacity());
+            }
+
+            THEN("The least recently used entry has been evicted") {
+                CHECK(!cache.lookup(2));
+                CHECK(cache.lookup(6));
+            }
+        }
+
+        WHEN("Filling the cache and using the oldest entry before inserting one more") {
+            for (ino_t ino = 2; ino < 6; ++ino) {
+                cache.insert(ino, Dragonstash::ROOT_INO, std::to_string(ino), cache.epoch());
+            }
+            REQUIRE(cache.lookup(2));
+            cache.insert(6, Dragonstash::ROOT_INO, "6", cache.epoch());
+
+            THEN("The recently used entry is retained") {
+                CHECK(cache.lookup(2));
+                CHECK(!cache.lookup(3));
+            }
+        }
+    }
+}
@@ -0,0 +1,514 @@
+/**********************************************************************
+File name: regular_file.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#include "dragonstash/cache/common.hpp"
+#include "dragonstash/cache/regular_file.hpp"
+
+#include "testutils/tempdir.hpp"
+#include "testutils/result.hpp"
+
+static Dragonstash::CommonFileAttributes make_version(std::uint64_t size,
+                                                      time_t mtime)
+{
+    Dragonstash::CommonFileAttributes result{};
+    result.size = size;
+    result.mtime.tv_sec = mtime;
+    return result;
+}
+
+SCENARIO("Regular file contents", "[regular_file]")
+{
+    TemporaryDirectory tmpdir;
+    Dragonstash::ContentStore store(tmpdir.path() / "data");
+    constexpr std::size_t page = Dragonstash::CACHE_PAGE_SIZE;
+
+    GIVEN("A freshly opened content handle") {
+        auto open_result = store.open(2);
+        require_result_ok(open_result);
+        auto handle = *open_result;
+
+        THEN("It is bound to no version") {
+            auto valid_result = handle->validate(make_version(page, 1));
+            require_result_ok(valid_result);
+            CHECK(!*valid_result);
+        }
+
+        THEN("Opening the inode again returns the same handle") {
+            auto other = store.open(2);
+            require_result_ok(other);
+            CHECK(other->get() == handle.get());
+        }
+
+        WHEN("Storing data which does not cover a full block") {
+            std::vector<char> data(100, 'x');
+            auto store_result = handle->store(handle->generation(), page + 10, data.data(), data.size(), false);
+            require_result_ok(store_result);
+            CHECK(*store_result == data.size());
+
+            THEN("Nothing is marked as cached") {
+                CHECK(handle->cached_blocks() == 0);
+                std::vector<char> buf(100);
+                auto read_result = handle->pread(page + 10, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == 0);
+            }
+        }
+
+        WHEN("Storing the tail of a file") {
+            std::vector<char> data(page + 100, 'y');
+            auto store_result = handle->store(handle->generation(), page, data.data(), data.size(), true);
+            require_result_ok(store_result);
+
+            THEN("The partial block at the end is cached too") {
+                CHECK(handle->cached_blocks() == 2);
+                std::vector<char> buf(data.size());
+                auto read_result = handle->pread(page, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == data.size());
+                CHECK(buf == data);
+            }
+
+            THEN("Reading from an uncached block returns nothing") {
+                std::vector<char> buf(page);
+                auto read_result = handle->pread(0, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == 0);
+            }
+        }
+
+        WHEN("Binding the handle to a version and storing data") {
+            auto valid_result = handle->validate(make_version(page * 2, 1));
+            require_result_ok(valid_result);
+            std::vector<char> data(page * 2, 'z');
+            require_result_ok(handle->store(handle->generation(), 0, data.data(), data.size(), true));
+
+            THEN("Validating against the same version keeps the data") {
+                auto valid_result = handle->validate(make_version(page * 2, 1));
+                require_result_ok(valid_result);
+                CHECK(*valid_result);
+                CHECK(handle->cached_blocks() == 2);
+            }
+
+            THEN("Validating against a different version drops the data") {
+                auto valid_result = handle->validate(make_version(page * 2, 2));
+                require_result_ok(valid_result);
+                CHECK(!*valid_result);
+                CHECK(handle->cached_blocks() == 0);
+            }
+
+            AND_WHEN("The handle is closed and the inode reopened") {
+                handle.reset();
+                auto open_result = store.open(2);
+                require_result_ok(open_result);
+                auto handle = *open_result;
+
+                THEN("The data is still there") {
+                    auto valid_result = handle->validate(make_version(page * 2, 1));
+                    require_result_ok(valid_result);
+                    CHECK(*valid_result);
+                    std::vector<char> buf(page * 2);
+                    auto read_result = handle->pread(0, buf.data(), buf.size());
+                    require_result_ok(read_result);
+                    CHECK(buf == data);
+                }
+            }
+
+            AND_WHEN("The contents are removed") {
+                handle.reset();
+                store.remove(2);
+                auto open_result = store.open(2);
+                require_result_ok(open_result);
+
+                THEN("Nothing is cached anymore") {
+                    CHECK((*open_result)->cached_blocks() == 0);
+                }
+            }
+        }
+    }
+
+    GIVEN("A handle with data stored by readahead") {
+        auto open_result = store.open(4);
+        require_result_ok(open_result);
+        auto handle = *open_result;
+        std::vector<char> data(page * 4, 'r');
+        require_result_ok(handle->store(handle->generation(), 0, data.data(), page, false));
+        require_result_ok(handle->store(handle->generation(), 0, data.data(), data.size(), false,
+                                        Dragonstash::Blocklist::READAHEAD));
+
+        THEN("Blocks which were read already are not demoted") {
+            CHECK(handle->cached_blocks(Dragonstash::Blocklist::READ) == 1);
+            CHECK(handle->cached_blocks(Dragonstash::Blocklist::READAHEAD) == 3);
+        }
+
+        WHEN("Part of the readahead data is consumed") {
+            handle->promote(page + 1, page);
+
+            THEN("The touched blocks are promoted to READ") {
+                CHECK(handle->cached_blocks(Dragonstash::Blocklist::READ) == 3);
+                CHECK(handle->cached_blocks(Dragonstash::Blocklist::READAHEAD) == 1);
+            }
+        }
+    }
+
+    GIVEN("A fetch which started before the data was discarded") {
+        auto open_result = store.open(5);
+        require_result_ok(open_result);
+        auto handle = *open_result;
+        const auto generation = handle->generation();
+        auto valid_result = handle->validate(make_version(page, 1));
+        require_result_ok(valid_result);
+
+        WHEN("The fetched data is stored") {
+            std::vector<char> data(page, 'o');
+            auto store_result = handle->store(generation, 0, data.data(), data.size(), true);
+
+            THEN("It is dropped") {
+                require_result_ok(store_result);
+                CHECK(*store_result == 0);
+                CHECK(handle->cached_blocks() == 0);
+            }
+        }
+    }
+
+    GIVEN("A damaged blocklist file") {
+        {
+            FILE *f = fopen((store.root() / "3.blocks").c_str(), "w");
+            REQUIRE(f);
+            fputs("garbage", f);
+            fclose(f);
+        }
+
+        WHEN("Opening the inode") {
+            auto open_result = store.open(3);
+
+            THEN("It starts from scratch") {
+                require_result_ok(open_result);
+                CHECK((*open_result)->cached_blocks() == 0);
+            }
+        }
+    }
+}
+
+SCENARIO("Large content blocks", "[regular_file]")
+{
+    TemporaryDirectory tmpdir;
+    constexpr std::uint32_t block_size = 64 * 1024;
+
+    GIVEN("A content store with 64 KiB blocks") {
+        Dragonstash::ContentStore store(tmpdir.path() / "data", 0, block_size);
+        auto open_result = store.open(2);
+        require_result_ok(open_result);
+        auto handle = *open_result;
+        CHECK(handle->block_size() == block_size);
+        CHECK(store.chunk_blocks() == 16);
+
+        WHEN("Storing less than a block") {
+            std::vector<char> data(Dragonstash::CACHE_PAGE_SIZE, 'l');
+            require_result_ok(handle->store(handle->generation(), 0, data.data(), data.size(), false));
+
+            THEN("Nothing is cached") {
+                CHECK(handle->cached_blocks() == 0);
+            }
+        }
+
+        WHEN("Storing a whole block") {
+            std::vector<char> data(block_size, 'L');
+            require_result_ok(handle->store(handle->generation(), 0, data.data(), data.size(), false));
+
+            THEN("It is cached") {
+                CHECK(handle->cached_blocks() == 1);
+                std::vector<char> buf(block_size);
+                auto read_result = handle->pread(0, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == block_size);
+            }
+
+            AND_WHEN("The store is reopened with a different block size") {
+                handle.reset();
+                Dragonstash::ContentStore reopened(tmpdir.path() / "data");
+                auto reopen_result = reopened.open(2);
+
+                THEN("The cached contents are discarded") {
+                    require_result_ok(reopen_result);
+                    CHECK((*reopen_result)->block_size() == Dragonstash::CACHE_PAGE_SIZE);
+                    CHECK((*reopen_result)->cached_blocks() == 0);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Content budget", "[regular_file]")
+{
+    TemporaryDirectory tmpdir;
+    constexpr std::size_t page = Dragonstash::CACHE_PAGE_SIZE;
+    constexpr std::size_t chunk = page * Dragonstash::CACHE_CHUNK_BLOCKS;
+    Dragonstash::ContentStore store(tmpdir.path() / "data", 2 * chunk);
+    std::vector<char> data(chunk, 'b');
+
+    GIVEN("A file larger than the budget") {
+        auto open_result = store.open(2);
+        require_result_ok(open_result);
+        auto handle = *open_result;
+
+        WHEN("It is stored chunk by chunk") {
+            for (std::size_t i = 0; i < 3; ++i) {
+                require_result_ok(handle->store(handle->generation(), i * chunk,
+                                                data.data(), data.size(), false));
+            }
+
+            THEN("The oldest chunk is evicted") {
+                CHECK(store.space().used() == 2 * Dragonstash::CACHE_CHUNK_BLOCKS);
+                CHECK(handle->cached_blocks() == 2 * Dragonstash::CACHE_CHUNK_BLOCKS);
+
+                std::vector<char> buf(page);
+                auto read_result = handle->pread(0, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == 0);
+
+                read_result = handle->pread(chunk, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == page);
+                CHECK(buf == std::vector<char>(page, 'b'));
+            }
+        }
+    }
+
+    GIVEN("A pinned file") {
+        auto open_result = store.open(3);
+        require_result_ok(open_result);
+        auto pinned = *open_result;
+        require_result_ok(pinned->store(pinned->generation(), 0,
+                                        data.data(), data.size(), false,
+                                        Dragonstash::Blocklist::PINNED));
+
+        WHEN("Other files exceed the budget") {
+            auto other_result = store.open(4);
+            require_result_ok(other_result);
+            auto other = *other_result;
+            for (std::size_t i = 0; i < 3; ++i) {
+                require_result_ok(other->store(other->generation(), i * chunk,
+                                               data.data(), data.size(), false));
+            }
+
+            THEN("The pinned blocks are not evicted") {
+                CHECK(pinned->cached_blocks(Dragonstash::Blocklist::PINNED) == Dragonstash::CACHE_CHUNK_BLOCKS);
+                CHECK(other->cached_blocks() == 2 * Dragonstash::CACHE_CHUNK_BLOCKS);
+            }
+        }
+
+        THEN("The store knows that it is pinned") {
+            CHECK(store.pinned() == std::vector<ino_t>{3});
+        }
+
+        WHEN("The store is reopened") {
+            Dragonstash::ContentStore reopened(tmpdir.path() / "data");
+
+            THEN("The pinned inodes are found again") {
+                CHECK(reopened.pinned() == std::vector<ino_t>{3});
+            }
+        }
+
+        WHEN("It is unpinned") {
+            CHECK(pinned->unpin() == Dragonstash::CACHE_CHUNK_BLOCKS);
+
+            THEN("The blocks are accounted for as READ") {
+                CHECK(pinned->cached_blocks(Dragonstash::Blocklist::PINNED) == 0);
+                CHECK(pinned->cached_blocks(Dragonstash::Blocklist::READ) == Dragonstash::CACHE_CHUNK_BLOCKS);
+                CHECK(store.space().used() == Dragonstash::CACHE_CHUNK_BLOCKS);
+                CHECK(store.pinned().empty());
+            }
+
+            AND_WHEN("Other files exceed the budget") {
+                auto other_result = store.open(4);
+                require_result_ok(other_result);
+                auto other = *other_result;
+                for (std::size_t i = 0; i < 2; ++i) {
+                    require_result_ok(other->store(other->generation(), i * chunk,
+                                                   data.data(), data.size(), false));
+                }
+
+                THEN("The formerly pinned blocks are evicted") {
+                    CHECK(pinned->cached_blocks() == 0);
+                    CHECK(other->cached_blocks() == 2 * Dragonstash::CACHE_CHUNK_BLOCKS);
+                }
+            }
+        }
+    }
+
+    GIVEN("Stored contents") {
+        {
+            auto open_result = store.open(5);
+            require_result_ok(open_result);
+            auto handle = *open_result;
+            require_result_ok(handle->store(handle->generation(), 0,
+                                            data.data(), data.size(), false));
+        }
+
+        WHEN("The store is reopened with a smaller budget") {
+            Dragonstash::ContentStore reopened(tmpdir.path() / "data");
+            CHECK(reopened.space().used() == Dragonstash::CACHE_CHUNK_BLOCKS);
+            reopened.set_budget(chunk / 2);
+
+            THEN("The existing contents are evicted") {
+                CHECK(reopened.space().used() == 0);
+                auto open_result = reopened.open(5);
+                require_result_ok(open_result);
+                CHECK((*open_result)->cached_blocks() == 0);
+            }
+        }
+
+        WHEN("The contents are removed") {
+            store.remove(5);
+
+            THEN("They are no longer accounted for") {
+                CHECK(store.space().used() == 0);
+            }
+        }
+    }
+}
+
+SCENARIO("Written contents", "[regular_file]")
+{
+    TemporaryDirectory tmpdir;
+    Dragonstash::ContentStore store(tmpdir.path() / "data");
+    constexpr std::size_t page = Dragonstash::CACHE_PAGE_SIZE;
+
+    GIVEN("A handle with a cached file of two blocks") {
+        auto open_result = store.open(2);
+        require_result_ok(open_result);
+        auto handle = *open_result;
+        const auto version = make_version(page * 2, 1);
+        require_result_ok(handle->validate(version));
+        std::vector<char> data(page * 2, 'r');
+        require_result_ok(handle->store(handle->generation(), 0, data.data(), data.size(), true));
+
+        WHEN("Writing into the middle of the first block") {
+            std::vector<char> written(10, 'w');
+            const auto changed = make_version(page * 2, 2);
+            require_result_ok(handle->write(100, written.data(), written.size(), changed));
+
+            THEN("The block is marked WRITTEN") {
+                CHECK(handle->cached_blocks(Dragonstash::Blocklist::WRITTEN) == 1);
+                CHECK(handle->cached_blocks(Dragonstash::Blocklist::READ) == 1);
+            }
+
+            THEN("The handle is bound to the new version") {
+                auto valid_result = handle->validate(changed);
+                require_result_ok(valid_result);
+                CHECK(*valid_result);
+            }
+
+            THEN("The written data is read back") {
+                std::vector<char> buf(page);
+                auto read_result = handle->pread(0, buf.data(), buf.size());
+                require_result_ok(read_result);
+                REQUIRE(*read_result == page);
+                std::vector<char> expected(page, 'r');
+                std::fill(expected.begin() + 100, expected.begin() + 110, 'w');
+                CHECK(buf == expected);
+            }
+
+            AND_WHEN("The block is stored again from the backend") {
+                std::vector<char> old(page, 'o');
+                require_result_ok(handle->store(handle->generation(), 0, old.data(), old.size(), false));
+
+                THEN("The written data is kept") {
+                    std::vector<char> buf(10);
+                    auto read_result = handle->pread(100, buf.data(), buf.size());
+                    require_result_ok(read_result);
+                    CHECK(buf == written);
+                }
+            }
+
+            AND_WHEN("The contents are settled") {
+                const auto backend = make_version(page * 2, 3);
+                CHECK(handle->settle(backend) == 1);
+
+                THEN("All blocks are READ") {
+                    CHECK(handle->cached_blocks(Dragonstash::Blocklist::WRITTEN) == 0);
+                    CHECK(handle->cached_blocks(Dragonstash::Blocklist::READ) == 2);
+                    auto valid_result = handle->validate(backend);
+                    require_result_ok(valid_result);
+                    CHECK(*valid_result);
+                }
+            }
+        }
+
+        WHEN("Writing partially into a block which is not cached") {
+            handle.reset();
+            auto other_result = store.open(3);
+            require_result_ok(other_result);
+            auto other = *other_result;
+            std::vector<char> written(10, 'w');
+
+            THEN("ENODATA is returned") {
+                check_result_error(other->write(100, written.data(), written.size(),
+                                                make_version(page * 2, 2)),
+                                   ENODATA);
+            }
+        }
+
+        WHEN("Writing beyond the size of the new version") {
+            std::vector<char> written(10, 'w');
+
+            THEN("EINVAL is returned") {
+                check_result_error(handle->write(page * 2, written.data(), written.size(),
+                                                 make_version(page * 2, 2)),
+                                   EINVAL);
+            }
+        }
+
+        WHEN("Shrinking the file") {
+            require_result_ok(handle->resize(page * 2, make_version(page / 2, 2)));
+
+            THEN("The blocks beyond the new end are dropped") {
+                CHECK(handle->cached_blocks() == 1);
+                std::vector<char> buf(page / 2);
+                auto read_result = handle->pread(0, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == page / 2);
+                CHECK(buf == std::vector<char>(page / 2, 'r'));
+            }
+        }
+
+        WHEN("Growing the file") {
+            require_result_ok(handle->resize(page * 2, make_version(page * 3 + 10, 2)));
+
+            THEN("The new range is WRITTEN and reads as zeroes") {
+                CHECK(handle->cached_blocks(Dragonstash::Blocklist::WRITTEN) == 2);
+                std::vector<char> buf(page + 10, 'x');
+                auto read_result = handle->pread(page * 2, buf.data(), buf.size());
+                require_result_ok(read_result);
+                CHECK(*read_result == page + 10);
+                CHECK(buf == std::vector<char>(page + 10, '\0'));
+            }
+        }
+    }
+}
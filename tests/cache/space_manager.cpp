@@ -0,0 +1,194 @@
+/**********************************************************************
+File name: space_manager.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "dragonstash/cache/space_manager.hpp"
+
+using Dragonstash::CACHE_CHUNK_BLOCKS;
+using Key = Dragonstash::SpaceManager::ChunkKey;
+
+static std::vector<Key> drain(Dragonstash::SpaceManager &space)
+{
+    std::vector<Key> result;
+    while (auto victim = space.next_victim()) {
+        result.push_back(victim->key);
+    }
+    return result;
+}
+
+SCENARIO("Space accounting", "[space_manager]")
+{
+    GIVEN("A space manager without budget") {
+        Dragonstash::SpaceManager space;
+
+        WHEN("Chunks are charged") {
+            for (std::uint64_t i = 0; i < 16; ++i) {
+                space.charge(Key{1, i}, CACHE_CHUNK_BLOCKS);
+            }
+
+            THEN("Nothing is evicted") {
+                CHECK(space.used() == 16 * CACHE_CHUNK_BLOCKS);
+                CHECK(!space.next_victim());
+            }
+        }
+    }
+
+    GIVEN("A space manager with a budget of four chunks") {
+        Dragonstash::SpaceManager space(4 * CACHE_CHUNK_BLOCKS);
+        for (std::uint64_t i = 0; i < 4; ++i) {
+            space.charge(Key{1, i}, CACHE_CHUNK_BLOCKS);
+        }
+
+        THEN("Nothing is evicted while within budget") {
+            CHECK(!space.next_victim());
+        }
+
+        WHEN("The budget is exceeded") {
+            space.charge(Key{2, 0}, 1);
+
+            THEN("The oldest chunk is evicted") {
+                auto victims = drain(space);
+                REQUIRE(victims.size() == 1);
+                CHECK(victims[0] == Key{1, 0});
+                CHECK(space.used() == 3 * CACHE_CHUNK_BLOCKS + 1);
+            }
+        }
+
+        WHEN("Blocks are discharged") {
+            space.discharge(Key{1, 0}, CACHE_CHUNK_BLOCKS / 2);
+            space.discharge(Key{1, 1}, CACHE_CHUNK_BLOCKS);
+
+            THEN("They are no longer accounted for") {
+                CHECK(space.used() == 2 * CACHE_CHUNK_BLOCKS + CACHE_CHUNK_BLOCKS / 2);
+            }
+        }
+
+        WHEN("An inode is forgotten") {
+            space.charge(Key{2, 0}, CACHE_CHUNK_BLOCKS);
+            space.forget(1);
+
+            THEN("Its chunks are gone") {
+                CHECK(space.used() == CACHE_CHUNK_BLOCKS);
+                CHECK(!space.next_victim());
+            }
+        }
+
+        WHEN("The budget is lowered") {
+            space.set_budget(2 * CACHE_CHUNK_BLOCKS);
+
+            THEN("Chunks are evicted in insertion order") {
+                auto victims = drain(space);
+                REQUIRE(victims.size() == 2);
+                CHECK(victims[0] == Key{1, 0});
+                CHECK(victims[1] == Key{1, 1});
+            }
+        }
+    }
+}
+
+SCENARIO("2Q eviction order", "[space_manager]")
+{
+    GIVEN("A chunk which was stored again after its eviction") {
+        Dragonstash::SpaceManager space(4 * CACHE_CHUNK_BLOCKS);
+        for (std::uint64_t i = 0; i < 5; ++i) {
+            space.charge(Key{1, i}, CACHE_CHUNK_BLOCKS);
+        }
+        REQUIRE(drain(space) == std::vector<Key>{Key{1, 0}});
+        space.charge(Key{1, 0}, CACHE_CHUNK_BLOCKS);
+        REQUIRE(drain(space) == std::vector<Key>{Key{1, 1}});
+
+        WHEN("A large file is scanned") {
+            std::vector<Key> victims;
+            for (std::uint64_t i = 0; i < 32; ++i) {
+                space.charge(Key{2, i}, CACHE_CHUNK_BLOCKS);
+                auto new_victims = drain(space);
+                victims.insert(victims.end(), new_victims.begin(), new_victims.end());
+            }
+
+            THEN("The chunk survives the scan") {
+                CHECK(std::find(victims.begin(), victims.end(), Key{1, 0}) == victims.end());
+                CHECK(std::find(victims.begin(), victims.end(), Key{2, 0}) != victims.end());
+            }
+        }
+    }
+
+    GIVEN("Two chunks in the main queue") {
+        Dragonstash::SpaceManager space(2 * CACHE_CHUNK_BLOCKS);
+        for (std::uint64_t i = 0; i < 3; ++i) {
+            space.charge(Key{1, i}, CACHE_CHUNK_BLOCKS);
+        }
+        REQUIRE(drain(space) == std::vector<Key>{Key{1, 0}});
+        space.charge(Key{1, 0}, CACHE_CHUNK_BLOCKS);
+        REQUIRE(drain(space) == std::vector<Key>{Key{1, 1}});
+        space.charge(Key{1, 1}, CACHE_CHUNK_BLOCKS);
+        REQUIRE(drain(space) == std::vector<Key>{Key{1, 2}});
+
+        WHEN("The least recently used one is accessed") {
+            space.touch(Key{1, 0});
+            space.charge(Key{2, 0}, 1);
+
+            THEN("The other one is evicted") {
+                CHECK(drain(space) == std::vector<Key>{Key{1, 1}});
+            }
+        }
+
+        WHEN("No chunk is accessed") {
+            space.charge(Key{2, 0}, 1);
+
+            THEN("The least recently used one is evicted") {
+                CHECK(drain(space) == std::vector<Key>{Key{1, 0}});
+            }
+        }
+    }
+
+    GIVEN("An inode with chunks in both queues and in the ghost list") {
+        Dragonstash::SpaceManager space(4 * CACHE_CHUNK_BLOCKS);
+        for (std::uint64_t i = 0; i < 6; ++i) {
+            space.charge(Key{1, i}, CACHE_CHUNK_BLOCKS);
+        }
+        REQUIRE(drain(space) == std::vector<Key>{Key{1, 0}, Key{1, 1}});
+        space.charge(Key{1, 0}, CACHE_CHUNK_BLOCKS);
+        space.charge(Key{2, 0}, CACHE_CHUNK_BLOCKS);
+        drain(space);
+
+        WHEN("The inode is forgotten") {
+            space.forget(1);
+
+            THEN("Only the chunks of the other inode remain") {
+                CHECK(space.used() == CACHE_CHUNK_BLOCKS);
+            }
+
+            THEN("Its ghosts are forgotten too") {
+                space.charge(Key{1, 2}, 4 * CACHE_CHUNK_BLOCKS);
+                // a remembered chunk would enter the main queue and be
+                // evicted itself, as the in queue is within its share
+                CHECK(drain(space) == std::vector<Key>{Key{2, 0}});
+            }
+        }
+    }
+}
@@ -0,0 +1,167 @@
+/**********************************************************************
+File name: transaction_log.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <vector>
+
+#include "dragonstash/cache/transaction_log.hpp"
+
+#include "../testutils/result.hpp"
+
+SCENARIO("Transaction log") {
+    GIVEN("A log and a reference table") {
+        Dragonstash::InodeReferences refs;
+        Dragonstash::TransactionLog log;
+        std::vector<int> order;
+
+        require_result_ok(refs.incref(2, 3));
+
+        WHEN("Lock changes and hooks are recorded and rolled back") {
+            require_result_ok(refs.incref(3, 1));
+            log.record_lock(3, 1);
+            log.add_hook(nullptr, nullptr, nullptr, [&order, &refs](){
+                // runs after the release below has been undone
+                order.push_back(int(refs.refcount(2)));
+            });
+            require_result_ok(refs.decref(2, 2));
+            log.record_release(2, 2);
+            log.rollback(refs);
+
+            THEN("The counters are restored") {
+                CHECK(refs.refcount(2) == 3);
+                CHECK(refs.refcount(3) == 0);
+            }
+
+            THEN("Everything is undone in reverse order") {
+                CHECK(order == std::vector<int>{3});
+            }
+        }
+
+        WHEN("The stage 1 callback of a hook fails") {
+            log.add_hook([&order](){
+                order.push_back(1);
+                return Dragonstash::make_result();
+            }, [&order](){
+                order.push_back(-1);
+            }, [&order](){
+                order.push_back(2);
+            }, nullptr);
+            log.add_hook([&order](){
+                order.push_back(10);
+                return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+            }, [&order](){
+                order.push_back(-10);
+            }, nullptr, nullptr);
+            auto result = log.stage_1_commit();
+
+            THEN("The error is returned and later hooks do not run") {
+                check_result_error(result, EIO);
+                CHECK(order == std::vector<int>{1, 10});
+            }
+
+            THEN("Only the hooks which passed stage 1 have it rolled back") {
+                log.rollback(refs);
+                CHECK(order == std::vector<int>{1, 10, -1});
+            }
+        }
+
+        WHEN("Another log is appended") {
+            Dragonstash::TransactionLog other;
+            require_result_ok(refs.decref(2, 1));
+            other.record_release(2, 1);
+            other.add_hook(nullptr, nullptr, nullptr, [&order](){
+                order.push_back(1);
+            });
+            log.add_hook(nullptr, nullptr, nullptr, [&order](){
+                order.push_back(0);
+            });
+            log.append(other);
+
+            THEN("The other log is empty but keeps its buffer") {
+                CHECK(other.empty());
+                CHECK(other.capacity() > 0);
+                CHECK(log.size() == 3);
+            }
+
+            THEN("Rolling back undoes both, the appended records first") {
+                log.rollback(refs);
+                CHECK(order == std::vector<int>{1, 0});
+                CHECK(refs.refcount(2) == 3);
+            }
+        }
+    }
+}
+
+SCENARIO("Transaction log pool") {
+    GIVEN("A pool with room for two logs") {
+        Dragonstash::TransactionLogPool pool(2, 8);
+
+        THEN("It starts empty") {
+            CHECK(pool.size() == 0);
+            CHECK(pool.acquire().capacity() == 0);
+        }
+
+        WHEN("A used log is recycled") {
+            auto log = pool.acquire();
+            log.record_lock(2, 1);
+            log.record_lock(3, 1);
+            const std::size_t capacity = log.capacity();
+            pool.recycle(std::move(log));
+
+            THEN("It is handed out again, empty but with its buffer") {
+                CHECK(pool.size() == 1);
+                auto reused = pool.acquire();
+                CHECK(reused.empty());
+                CHECK(reused.capacity() == capacity);
+                CHECK(pool.size() == 0);
+            }
+        }
+
+        WHEN("Unused or oversized logs are recycled") {
+            pool.recycle(Dragonstash::TransactionLog());
+            Dragonstash::TransactionLog big;
+            for (Dragonstash::ino_t ino = 2; ino < 20; ++ino) {
+                big.record_lock(ino, 1);
+            }
+            pool.recycle(std::move(big));
+
+            THEN("They are dropped") {
+                CHECK(pool.size() == 0);
+            }
+        }
+
+        WHEN("More logs are recycled than the pool holds") {
+            for (int i = 0; i < 3; ++i) {
+                Dragonstash::TransactionLog log;
+                log.record_lock(2, 1);
+                pool.recycle(std::move(log));
+            }
+
+            THEN("The excess is dropped") {
+                CHECK(pool.size() == 2);
+            }
+        }
+    }
+}
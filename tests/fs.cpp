@@ -24,7 +24,16 @@ authors named in the AUTHORS file.
 **********************************************************************/
 #include <catch2/catch.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <thread>
+
 #include "dragonstash/backend/in_memory.hpp"
+#include "dragonstash/backend/local.hpp"
 #include "dragonstash/cache/cache.hpp"
 #include "dragonstash/fs.hpp"
 
@@ -34,14 +43,19 @@ authors named in the AUTHORS file.
 
 class TestEnvironment {
 public:
-    TestEnvironment():
-        m_cache(m_cachedir.path()),
-        m_fs(m_cache, m_backend),
+    explicit TestEnvironment(std::uint32_t block_size = 0):
+        m_cache(m_cachedir.path(), block_size),
+        m_fs(m_cache, m_backend,
+             Dragonstash::WorkerPool::DEFAULT_CONCURRENCY,
+             Dragonstash::Readahead::DEFAULT_CONCURRENCY,
+             0),
         m_default_uid(getuid()),
         m_default_gid(getgid()),
         m_default_timestamp{.tv_sec = 1536390000, .tv_nsec = 20180908}
     {
-
+        // notifications are sent inline, so they can be checked right after
+        // the request returns
+        m_fs.set_notifier(m_fuse.notifier());
     }
 
 private:
@@ -135,6 +149,13 @@ void check_reply_error(const TestFuseRequest &req, int err) {
     }
 }
 
+void check_negative_entry(const TestFuseRequest &req) {
+    check_reply_type(req, TestFuseReplyType::ENTRY);
+    const auto &entry = std::get<TestFuseReplyEntry>(req.reply_argv());
+    CHECK(entry.ino == 0);
+    CHECK(entry.entry_timeout > 0);
+}
+
 Dragonstash::Result<ino_t> lookup(TestFuseBackend &fuse,
                                   Dragonstash::Filesystem &fs,
                                   ino_t parent,
@@ -147,7 +168,12 @@ Dragonstash::Result<ino_t> lookup(TestFuseBackend &fuse,
     }
 
     REQUIRE(req.reply_type() == TestFuseReplyType::ENTRY);
-    return std::get<TestFuseReplyEntry>(req.reply_argv()).ino;
+    const ino_t ino = std::get<TestFuseReplyEntry>(req.reply_argv()).ino;
+    if (ino == 0) {
+        // negative entry
+        return Dragonstash::make_result(Dragonstash::FAILED, ENOENT);
+    }
+    return ino;
 }
 
 SCENARIO("lookup") {
@@ -203,8 +229,8 @@ SCENARIO("lookup") {
             auto req = env.fuse().new_request();
             fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "random name");
 
-            THEN("The FS replies with ENOENT") {
-                check_reply_error(req, ENOENT);
+            THEN("The FS replies with a negative entry") {
+                check_negative_entry(req);
             }
         }
 
@@ -289,8 +315,8 @@ SCENARIO("lookup") {
                 auto req = env.fuse().new_request();
                 fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
 
-                THEN("The FS replies with ENOENT") {
-                    check_reply_error(req, ENOENT);
+                THEN("The FS replies with a negative entry") {
+                    check_negative_entry(req);
                 }
 
                 THEN("The file is removed from the cache") {
@@ -303,12 +329,725 @@ SCENARIO("lookup") {
                     auto req = env.fuse().new_request();
                     fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
 
-                    THEN("The lookup fails with EIO (because not fully synced)") {
-                        check_reply_error(req, EIO);
+                    THEN("The negative entry is still replied") {
+                        check_negative_entry(req);
                     }
                 }
             }
         }
+
+        WHEN("Looking up a cached file which is unchanged on the backend") {
+            auto ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+            require_result_ok(ino_result);
+
+            AND_WHEN("Another thread holds a write transaction during the lookup") {
+                std::promise<void> writer_ready;
+                std::promise<void> writer_release;
+                std::thread writer([&env, &writer_ready, &writer_release](){
+                    auto txn = env.cache().begin_rw();
+                    writer_ready.set_value();
+                    writer_release.get_future().wait();
+                    txn.abort();
+                });
+                writer_ready.get_future().wait();
+
+                auto req = env.fuse().new_request();
+                auto lookup_done = std::async(std::launch::async, [&fs, &req](){
+                    fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
+                });
+                const auto status = lookup_done.wait_for(std::chrono::seconds(5));
+
+                writer_release.set_value();
+                writer.join();
+                lookup_done.wait();
+
+                THEN("The lookup does not wait for the writer") {
+                    CHECK(status == std::future_status::ready);
+                }
+
+                THEN("The same inode is returned") {
+                    check_reply_type(req, TestFuseReplyType::ENTRY);
+                    CHECK(std::get<TestFuseReplyEntry>(req.reply_argv()).ino == *ino_result);
+                }
+            }
+
+            AND_WHEN("Changing the attributes on the backend and looking it up again") {
+                auto &attr = env.backend().children().at("README.md")->attr();
+                attr.size = 4096;
+                attr.mtime.tv_sec += 10;
+
+                auto req = env.fuse().new_request();
+                fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
+
+                THEN("The new attributes are returned for the same inode") {
+                    check_reply_type(req, TestFuseReplyType::ENTRY);
+                    auto entry = std::get<TestFuseReplyEntry>(req.reply_argv());
+                    CHECK(entry.ino == *ino_result);
+                    CHECK(entry.attr.st_size == 4096);
+                    CHECK(entry.attr.st_mtim.tv_sec == env.default_timestamp().tv_sec + 10);
+                }
+
+                THEN("The cache has been updated") {
+                    auto attr_result = env.cache().getattr(*ino_result);
+                    require_result_ok(attr_result);
+                    CHECK(attr_result->attr.common.size == 4096);
+                    CHECK(attr_result->attr.common.mtime.tv_sec == env.default_timestamp().tv_sec + 10);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Negative lookups") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+    Dragonstash::Backend::Stat file_attr{
+        .mode = S_IRUSR,
+        .uid = env.default_uid(),
+        .gid = env.default_gid(),
+    };
+
+    GIVEN("A name which the backend reported as missing") {
+        {
+            auto req = env.fuse().new_request();
+            fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "late.txt");
+            check_negative_entry(req);
+        }
+
+        THEN("A negative entry is recorded in the cache") {
+            auto txn = env.cache().begin_ro();
+            auto negative_result = txn.lookup_negative(Dragonstash::ROOT_INO, "late.txt");
+            require_result_ok(negative_result);
+            CHECK(*negative_result > std::chrono::system_clock::now());
+        }
+
+        WHEN("The name appears on the backend") {
+            env.backend().emplace<Dragonstash::Backend::InMemory::File>("late.txt").update_attr(file_attr);
+
+            THEN("Lookups are answered from the negative entry") {
+                auto req = env.fuse().new_request();
+                fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "late.txt");
+                check_negative_entry(req);
+            }
+
+            AND_WHEN("The directory is read") {
+                auto req = env.fuse().new_request();
+                struct fuse_file_info fi{};
+                fs.opendir(req.wrap(), Dragonstash::ROOT_INO, &fi);
+                check_reply_type(req, TestFuseReplyType::OPEN);
+
+                THEN("The negative entry is dropped") {
+                    auto txn = env.cache().begin_ro();
+                    check_result_error(txn.lookup_negative(Dragonstash::ROOT_INO, "late.txt"), ENOENT);
+                }
+
+                THEN("The name can be looked up") {
+                    auto ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "late.txt");
+                    require_result_ok(ino_result);
+                }
+
+                auto release_req = env.fuse().new_request();
+                fs.releasedir(release_req.wrap(), Dragonstash::ROOT_INO, &fi);
+            }
+        }
+    }
+
+    GIVEN("A short negative timeout") {
+        fs.set_negative_timeout(0.01);
+        {
+            auto req = env.fuse().new_request();
+            fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "late.txt");
+            check_negative_entry(req);
+            CHECK(std::get<TestFuseReplyEntry>(req.reply_argv()).entry_timeout <= 0.01);
+        }
+
+        WHEN("The name appears on the backend after the entry expired") {
+            env.backend().emplace<Dragonstash::Backend::InMemory::File>("late.txt").update_attr(file_attr);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+            THEN("The backend is asked again") {
+                auto ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "late.txt");
+                require_result_ok(ino_result);
+            }
+
+            THEN("The negative entry is dropped") {
+                (void)lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "late.txt");
+                auto txn = env.cache().begin_ro();
+                check_result_error(txn.lookup_negative(Dragonstash::ROOT_INO, "late.txt"), ENOENT);
+            }
+        }
+    }
+
+    GIVEN("Negative caching is disabled") {
+        fs.set_negative_timeout(0);
+
+        WHEN("Looking up a missing name") {
+            auto req = env.fuse().new_request();
+            fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "late.txt");
+
+            THEN("ENOENT is replied") {
+                check_reply_error(req, ENOENT);
+            }
+
+            THEN("Nothing is recorded") {
+                auto txn = env.cache().begin_ro();
+                check_result_error(txn.lookup_negative(Dragonstash::ROOT_INO, "late.txt"), ENOENT);
+            }
+        }
+    }
+}
+
+SCENARIO("Timeout policy of the filesystem") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+
+    GIVEN("A policy with a long timeout for a subtree") {
+        Dragonstash::TimeoutPolicy policy(Dragonstash::TimeoutPolicy::Rule{2.0, 3.0, 0});
+        policy.add_subtree("/books", Dragonstash::TimeoutPolicy::Rule{100.0, 200.0, 0});
+        policy.set_offline_timeout(1000.0);
+        fs.set_timeout_policy(policy);
+
+        WHEN("Looking up an entry outside of the subtree") {
+            auto req = env.fuse().new_request();
+            fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
+            check_reply_type(req, TestFuseReplyType::ENTRY);
+            const auto entry = std::get<TestFuseReplyEntry>(req.reply_argv());
+
+            THEN("The default timeouts are used") {
+                CHECK(entry.attr_timeout == 2.0);
+                CHECK(entry.entry_timeout == 3.0);
+            }
+
+            THEN("getattr uses the default attribute timeout") {
+                auto attr_req = env.fuse().new_request();
+                fs.getattr(attr_req.wrap(), entry.ino, nullptr);
+                check_reply_type(attr_req, TestFuseReplyType::ATTR);
+                CHECK(std::get<1>(std::get<TestFuseReplyAttr>(attr_req.reply_argv())) == 2.0);
+            }
+
+            AND_WHEN("Looking it up again while the backend is disconnected") {
+                env.backend().set_connected(false);
+                auto req = env.fuse().new_request();
+                fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
+                check_reply_type(req, TestFuseReplyType::ENTRY);
+
+                THEN("The offline timeout is used") {
+                    const auto entry = std::get<TestFuseReplyEntry>(req.reply_argv());
+                    CHECK(entry.attr_timeout == 1000.0);
+                    CHECK(entry.entry_timeout == 1000.0);
+                }
+            }
+        }
+
+        WHEN("Looking up the subtree and an entry inside it") {
+            auto dir_req = env.fuse().new_request();
+            fs.lookup(dir_req.wrap(), Dragonstash::ROOT_INO, "books");
+            check_reply_type(dir_req, TestFuseReplyType::ENTRY);
+            const auto dir_entry = std::get<TestFuseReplyEntry>(dir_req.reply_argv());
+
+            auto req = env.fuse().new_request();
+            fs.lookup(req.wrap(), dir_entry.ino, "best.epub");
+            check_reply_type(req, TestFuseReplyType::ENTRY);
+            const auto entry = std::get<TestFuseReplyEntry>(req.reply_argv());
+
+            THEN("The subtree timeouts are used") {
+                CHECK(dir_entry.entry_timeout == 200.0);
+                CHECK(entry.attr_timeout == 100.0);
+                CHECK(entry.entry_timeout == 200.0);
+            }
+
+            THEN("getattr uses the subtree attribute timeout") {
+                auto attr_req = env.fuse().new_request();
+                fs.getattr(attr_req.wrap(), entry.ino, nullptr);
+                check_reply_type(attr_req, TestFuseReplyType::ATTR);
+                CHECK(std::get<1>(std::get<TestFuseReplyAttr>(attr_req.reply_argv())) == 100.0);
+            }
+        }
+    }
+
+    GIVEN("A policy which trusts entries that have not changed for a day") {
+        fs.set_timeout_policy(Dragonstash::TimeoutPolicy(
+                                  Dragonstash::TimeoutPolicy::Rule{1.0, 1.0, 86400.0}));
+        auto ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+        require_result_ok(ino_result);
+
+        WHEN("The entry is removed from the backend") {
+            env.backend().remove("README.md");
+
+            THEN("Lookups are still served from the cache") {
+                auto lookup_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+                require_result_ok(lookup_result);
+                CHECK(*lookup_result == *ino_result);
+            }
+        }
+    }
+}
+
+SCENARIO("Stale-while-revalidate") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+    const auto &notifications = env.fuse().notifications();
+
+    auto lookup_entry = [&env, &fs](std::string_view name) {
+        auto req = env.fuse().new_request();
+        fs.lookup(req.wrap(), Dragonstash::ROOT_INO, name);
+        check_reply_type(req, TestFuseReplyType::ENTRY);
+        return std::get<TestFuseReplyEntry>(req.reply_argv());
+    };
+
+    GIVEN("A policy which revalidates recently validated entries in the background") {
+        Dragonstash::TimeoutPolicy::Rule rule;
+        rule.hard_ttl = 3600.0;
+        fs.set_timeout_policy(Dragonstash::TimeoutPolicy(rule));
+        const auto first = lookup_entry("README.md");
+        env.fuse().clear_notifications();
+
+        WHEN("The file changes on the backend and is looked up") {
+            auto &attr = env.backend().children().at("README.md")->attr();
+            attr.size = 4096;
+            attr.mtime.tv_sec += 10;
+            const auto entry = lookup_entry("README.md");
+            fs.wait_revalidated();
+
+            THEN("The cached attributes are replied") {
+                CHECK(entry.ino == first.ino);
+                CHECK(entry.attr.st_size == 0);
+            }
+
+            THEN("The cache is updated once the backend has been asked") {
+                auto attr_result = env.cache().begin_ro().getattr(first.ino);
+                require_result_ok(attr_result);
+                CHECK(attr_result->attr.common.size == 4096);
+            }
+
+            THEN("The kernel cache of the inode is invalidated") {
+                REQUIRE(notifications.size() == 1);
+                CHECK(notifications[0].type == TestFuseNotifyType::INVAL_INODE);
+                CHECK(notifications[0].ino == first.ino);
+                CHECK(notifications[0].off == 0);
+            }
+
+            THEN("The next lookup replies the new attributes") {
+                CHECK(lookup_entry("README.md").attr.st_size == 4096);
+                fs.wait_revalidated();
+            }
+        }
+
+        WHEN("The file is removed on the backend and is looked up") {
+            env.backend().remove("README.md");
+            const auto entry = lookup_entry("README.md");
+            fs.wait_revalidated();
+
+            THEN("The cached entry is replied") {
+                CHECK(entry.ino == first.ino);
+            }
+
+            THEN("The entry is removed and invalidated once the backend has been asked") {
+                check_result_error(env.cache().begin_ro().lookup(Dragonstash::ROOT_INO, "README.md"), ENOENT);
+                REQUIRE(notifications.size() == 1);
+                CHECK(notifications[0].type == TestFuseNotifyType::INVAL_ENTRY);
+                CHECK(notifications[0].ino == Dragonstash::ROOT_INO);
+                CHECK(notifications[0].name == "README.md");
+            }
+        }
+
+        WHEN("The file does not change on the backend and is looked up") {
+            lookup_entry("README.md");
+            fs.wait_revalidated();
+
+            THEN("Nothing is invalidated") {
+                CHECK(notifications.empty());
+            }
+        }
+
+        WHEN("The kernel forgets the inode and the file changes on the backend") {
+            auto forget_req = env.fuse().new_request();
+            fs.forget(forget_req.wrap(), first.ino, 1);
+            env.backend().children().at("README.md")->attr().size = 4096;
+
+            THEN("The next lookup revalidates before replying") {
+                CHECK(lookup_entry("README.md").attr.st_size == 4096);
+                fs.wait_revalidated();
+            }
+        }
+    }
+
+    GIVEN("A policy with a soft TTL as long as the hard TTL") {
+        Dragonstash::TimeoutPolicy::Rule rule;
+        rule.soft_ttl = 3600.0;
+        rule.hard_ttl = 3600.0;
+        fs.set_timeout_policy(Dragonstash::TimeoutPolicy(rule));
+        const auto first = lookup_entry("README.md");
+
+        WHEN("The file changes on the backend and is looked up") {
+            env.backend().children().at("README.md")->attr().size = 4096;
+            const auto entry = lookup_entry("README.md");
+            fs.wait_revalidated();
+
+            THEN("The backend is not asked at all") {
+                CHECK(entry.attr.st_size == 0);
+                auto attr_result = env.cache().begin_ro().getattr(first.ino);
+                require_result_ok(attr_result);
+                CHECK(attr_result->attr.common.size == 0);
+            }
+        }
+    }
+}
+
+/**
+ * Backend which holds asynchronous lstat calls until they are released.
+ */
+class DeferringFilesystem: public Dragonstash::Backend::InMemoryFilesystem {
+private:
+    std::vector<std::pair<std::string, Dragonstash::Backend::Completion<Dragonstash::Backend::Stat>>> m_parked;
+
+public:
+    void lstat_async(std::string_view path,
+                     Dragonstash::Backend::Completion<Dragonstash::Backend::Stat> &&done) override
+    {
+        m_parked.emplace_back(std::string(path), std::move(done));
+    }
+
+    [[nodiscard]] std::size_t parked() const {
+        return m_parked.size();
+    }
+
+    /**
+     * Also releases the calls which are made while releasing, such as the
+     * retry of a lookup which failed on a directory handle from the table.
+     */
+    void release_all() {
+        while (!m_parked.empty()) {
+            auto parked = std::move(m_parked);
+            m_parked.clear();
+            for (auto &[path, done]: parked) {
+                done(lstat(path));
+            }
+        }
+    }
+};
+
+SCENARIO("Lookups on an asynchronous backend") {
+    TemporaryDirectory cachedir;
+    Dragonstash::Cache cache(cachedir.path());
+    TestFuseBackend fuse;
+    DeferringFilesystem backend;
+    backend.emplace<Dragonstash::Backend::InMemory::File>("README.md");
+    Dragonstash::Filesystem fs(cache, backend,
+                               Dragonstash::WorkerPool::DEFAULT_CONCURRENCY,
+                               Dragonstash::Readahead::DEFAULT_CONCURRENCY,
+                               0);
+
+    GIVEN("A lookup of an entry which is not cached") {
+        auto req = fuse.new_request();
+        fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
+
+        THEN("It is not replied to before the backend answers") {
+            CHECK(!req.has_reply());
+            CHECK(backend.parked() == 1);
+            backend.release_all();
+        }
+
+        WHEN("The backend answers") {
+            backend.release_all();
+
+            THEN("The entry is replied to and cached") {
+                check_reply_type(req, TestFuseReplyType::ENTRY);
+                const ino_t ino = std::get<TestFuseReplyEntry>(req.reply_argv()).ino;
+                CHECK(ino != 0);
+                auto txn = cache.begin_ro();
+                auto cached = txn.lookup(Dragonstash::ROOT_INO, "README.md");
+                require_result_ok(cached);
+                CHECK(*cached == ino);
+            }
+        }
+
+        WHEN("Another lookup is made before the backend answers") {
+            auto other_req = fuse.new_request();
+            fs.lookup(other_req.wrap(), Dragonstash::ROOT_INO, "missing");
+
+            THEN("Both wait for the backend") {
+                CHECK(!req.has_reply());
+                CHECK(!other_req.has_reply());
+                CHECK(backend.parked() == 2);
+                backend.release_all();
+            }
+
+            AND_WHEN("The backend answers") {
+                backend.release_all();
+
+                THEN("Both are replied to") {
+                    check_reply_type(req, TestFuseReplyType::ENTRY);
+                    check_negative_entry(other_req);
+                }
+            }
+        }
+    }
+}
+
+void sync_dir(TestFuseBackend &fuse,
+              Dragonstash::Filesystem &fs,
+              ino_t dir)
+{
+    auto req = fuse.new_request();
+    struct fuse_file_info fi{};
+    fs.opendir(req.wrap(), dir, &fi);
+    check_reply_type(req, TestFuseReplyType::OPEN);
+
+    auto release_req = fuse.new_request();
+    fs.releasedir(release_req.wrap(), dir, &fi);
+}
+
+SCENARIO("Kernel cache invalidation") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+    const auto &notifications = env.fuse().notifications();
+
+    GIVEN("A synced directory with a looked up file") {
+        sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+        auto ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+        require_result_ok(ino_result);
+        env.fuse().clear_notifications();
+
+        WHEN("The directory is synced again without changes") {
+            sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+
+            THEN("Nothing is invalidated") {
+                CHECK(notifications.empty());
+            }
+        }
+
+        WHEN("The file changes on the backend and the directory is synced") {
+            auto &attr = env.backend().children().at("README.md")->attr();
+            attr.size = 4096;
+            attr.mtime.tv_sec += 10;
+            sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+
+            THEN("The attributes and data of the inode are invalidated") {
+                REQUIRE(notifications.size() == 1);
+                CHECK(notifications[0].type == TestFuseNotifyType::INVAL_INODE);
+                CHECK(notifications[0].ino == *ino_result);
+                CHECK(notifications[0].off == 0);
+                CHECK(notifications[0].len == 0);
+            }
+        }
+
+        WHEN("The file changes on the backend and is looked up") {
+            auto &attr = env.backend().children().at("README.md")->attr();
+            attr.size = 4096;
+            attr.mtime.tv_sec += 10;
+            auto new_ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+            require_result_ok(new_ino_result);
+            REQUIRE(*new_ino_result == *ino_result);
+
+            THEN("The data of the inode is invalidated") {
+                REQUIRE(notifications.size() == 1);
+                CHECK(notifications[0].type == TestFuseNotifyType::INVAL_INODE);
+                CHECK(notifications[0].ino == *ino_result);
+                CHECK(notifications[0].off == 0);
+            }
+        }
+
+        WHEN("The file is removed on the backend and the directory is synced") {
+            env.backend().remove("README.md");
+            sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+
+            THEN("The entry is invalidated") {
+                REQUIRE(notifications.size() == 1);
+                CHECK(notifications[0].type == TestFuseNotifyType::INVAL_ENTRY);
+                CHECK(notifications[0].ino == Dragonstash::ROOT_INO);
+                CHECK(notifications[0].name == "README.md");
+            }
+        }
+
+        WHEN("The file is replaced by a directory on the backend and the directory is synced") {
+            env.backend().remove("README.md");
+            env.backend().emplace<Dragonstash::Backend::InMemory::Directory>("README.md");
+            sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+
+            THEN("The entry is invalidated") {
+                REQUIRE(notifications.size() == 1);
+                CHECK(notifications[0].type == TestFuseNotifyType::INVAL_ENTRY);
+                CHECK(notifications[0].ino == Dragonstash::ROOT_INO);
+                CHECK(notifications[0].name == "README.md");
+            }
+        }
+
+        WHEN("A name reported missing appears on the backend and the directory is synced") {
+            auto req = env.fuse().new_request();
+            fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "late.txt");
+            check_negative_entry(req);
+            env.backend().emplace<Dragonstash::Backend::InMemory::File>("late.txt");
+            sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+
+            THEN("The negative entry is invalidated") {
+                REQUIRE(notifications.size() == 1);
+                CHECK(notifications[0].type == TestFuseNotifyType::INVAL_ENTRY);
+                CHECK(notifications[0].ino == Dragonstash::ROOT_INO);
+                CHECK(notifications[0].name == "late.txt");
+            }
+        }
+
+        WHEN("No notifier is set") {
+            fs.set_notifier(Fuse::Notifier());
+            env.backend().remove("README.md");
+            sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+
+            THEN("Nothing is sent") {
+                CHECK(notifications.empty());
+            }
+        }
+    }
+
+    GIVEN("An opened file which changed on the backend") {
+        auto ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+        require_result_ok(ino_result);
+        auto &attr = env.backend().children().at("README.md")->attr();
+        attr.size = 4096;
+        attr.mtime.tv_sec += 10;
+        env.fuse().clear_notifications();
+
+        auto req = env.fuse().new_request();
+        struct fuse_file_info fi{};
+        fs.open(req.wrap(), *ino_result, &fi);
+        check_reply_type(req, TestFuseReplyType::OPEN);
+
+        THEN("Only the attributes are invalidated") {
+            REQUIRE(notifications.size() == 1);
+            CHECK(notifications[0].type == TestFuseNotifyType::INVAL_INODE);
+            CHECK(notifications[0].ino == *ino_result);
+            CHECK(notifications[0].off < 0);
+        }
+
+        auto release_req = env.fuse().new_request();
+        fs.release(release_req.wrap(), *ino_result, &fi);
+    }
+}
+
+/**
+ * Notification backend which holds all notifications until the gate opens,
+ * like a kernel which waits for a lock held by a request.
+ */
+static std::shared_future<void> notify_gate;
+static std::atomic<int> gated_notifications;
+
+static int gated_inval_inode(fuse_session*, fuse_ino_t, off_t, off_t)
+{
+    notify_gate.wait();
+    ++gated_notifications;
+    return 0;
+}
+
+static int gated_inval_entry(fuse_session*, fuse_ino_t, const char*, size_t)
+{
+    notify_gate.wait();
+    ++gated_notifications;
+    return 0;
+}
+
+SCENARIO("Invalidations while the kernel is slow to process them") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem fs(env.cache(), env.backend(),
+                               Dragonstash::WorkerPool::DEFAULT_CONCURRENCY,
+                               Dragonstash::Readahead::DEFAULT_CONCURRENCY,
+                               1);
+    fs.set_notifier(env.fuse().notifier());
+
+    GIVEN("A synced directory with a looked up file") {
+        sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+        require_result_ok(lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md"));
+
+        std::promise<void> open_gate;
+        notify_gate = open_gate.get_future().share();
+        gated_notifications = 0;
+        Fuse::notify_backend.inval_inode = &gated_inval_inode;
+        Fuse::notify_backend.inval_entry = &gated_inval_entry;
+
+        WHEN("The file changes more often than the notification queue is long") {
+            static constexpr int CHANGES = 16;
+            auto syncs = std::async(std::launch::async, [&env, &fs]() {
+                for (int i = 0; i < CHANGES; ++i) {
+                    auto &attr = env.backend().children().at("README.md")->attr();
+                    attr.size += 1;
+                    attr.mtime.tv_sec += 10;
+                    sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+                }
+            });
+            const auto status = syncs.wait_for(std::chrono::seconds(10));
+            open_gate.set_value();
+            syncs.get();
+            fs.set_notifier(Fuse::Notifier());
+
+            THEN("The requests do not wait for the notifications") {
+                CHECK(status == std::future_status::ready);
+            }
+
+            THEN("All invalidations are sent eventually") {
+                CHECK(gated_notifications == CHANGES);
+            }
+        }
+    }
+}
+
+SCENARIO("forget") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+
+    GIVEN("Looked up entries which are removed on the backend") {
+        sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+        auto file_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+        require_result_ok(file_result);
+        require_result_ok(lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md"));
+        auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "books");
+        require_result_ok(dir_result);
+
+        env.backend().remove("README.md");
+        env.backend().remove("books");
+        sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+
+        THEN("The inodes are kept while the kernel references them") {
+            check_result_ok(env.cache().getattr(*file_result));
+            check_result_ok(env.cache().getattr(*dir_result));
+        }
+
+        WHEN("All lookups are forgotten in one batch") {
+            std::array<fuse_forget_data, 3> forgets{{
+                {*file_result, 2},
+                {*dir_result, 1},
+                {Dragonstash::ROOT_INO, 0},
+            }};
+            auto req = env.fuse().new_request();
+            fs.forget_multi(req.wrap(), forgets.size(), forgets.data());
+
+            THEN("The FS does not reply") {
+                check_reply_type(req, TestFuseReplyType::NONE);
+            }
+
+            THEN("The inodes are reaped") {
+                check_result_error(env.cache().getattr(*file_result), ENOENT);
+                check_result_error(env.cache().getattr(*dir_result), ENOENT);
+            }
+        }
+
+        WHEN("Only some lookups are forgotten in one batch") {
+            std::array<fuse_forget_data, 2> forgets{{
+                {*file_result, 1},
+                {*dir_result, 1},
+            }};
+            auto req = env.fuse().new_request();
+            fs.forget_multi(req.wrap(), forgets.size(), forgets.data());
+
+            THEN("Only the unreferenced inode is reaped") {
+                check_result_ok(env.cache().getattr(*file_result));
+                check_result_error(env.cache().getattr(*dir_result), ENOENT);
+            }
+        }
     }
 }
 
@@ -492,7 +1231,7 @@ SCENARIO("opendir and readdir") {
 
                 auto req = env.fuse().new_request();
                 fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
-                check_reply_error(req, ENOENT);
+                check_negative_entry(req);
 
                 THEN("The file is removed from the cache") {
                     check_result_error(env.cache().lookup(Dragonstash::ROOT_INO, "README.md"), ENOENT);
@@ -501,10 +1240,10 @@ SCENARIO("opendir and readdir") {
                 AND_WHEN("Disconnecting the backend") {
                     env.backend().set_connected(false);
 
-                    THEN("Lookup for the removed file returns ENOENT") {
+                    THEN("Lookup for the removed file returns a negative entry") {
                         auto req = env.fuse().new_request();
                         fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
-                        check_reply_error(req, ENOENT);
+                        check_negative_entry(req);
                     }
                 }
             }
@@ -512,15 +1251,187 @@ SCENARIO("opendir and readdir") {
     }
 }
 
-SCENARIO("readlink") {
+SCENARIO("opendir on large directories") {
     TestEnvironment env;
 
-    GIVEN("A filesystem with default contents") {
-        env.with_default_contents();
+    GIVEN("A backend directory with many entries") {
         Dragonstash::Filesystem &fs = env.fs();
+        constexpr std::size_t nentries = 500;
+        for (std::size_t i = 0; i < nentries; ++i) {
+            Dragonstash::Backend::Stat file_attr{
+                .mode = S_IFREG | S_IRUSR,
+                .size = i,
+                .uid = env.default_uid(),
+                .gid = env.default_gid(),
+            };
+            env.backend().emplace<Dragonstash::Backend::InMemory::File>(
+                        "file" + std::to_string(i)).update_attr(file_attr);
+        }
 
-        auto dir_lookup_result = lookup(env.fuse(), env.fs(), Dragonstash::ROOT_INO, "books");
-        require_result_ok(dir_lookup_result);
+        WHEN("Opening the directory") {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fs.opendir(req.wrap(), Dragonstash::ROOT_INO, &fi);
+
+            THEN("All entries are cached with their attributes") {
+                check_reply_type(req, TestFuseReplyType::OPEN);
+
+                auto txn = env.cache().begin_ro();
+                for (std::size_t i = 0; i < nentries; ++i) {
+                    auto lookup_result = txn.lookup(Dragonstash::ROOT_INO,
+                                                    "file" + std::to_string(i));
+                    require_result_ok(lookup_result);
+                    auto stat_result = txn.getattr(*lookup_result);
+                    require_result_ok(stat_result);
+                    CHECK(stat_result->attr.common.size == i);
+                }
+
+                auto flag_result = txn.test_flag(Dragonstash::ROOT_INO, Dragonstash::InodeFlag::SYNCED);
+                require_result_ok(flag_result);
+                CHECK(*flag_result);
+            }
+
+            req = env.fuse().new_request();
+            fs.releasedir(req.wrap(), Dragonstash::ROOT_INO, &fi);
+        }
+    }
+}
+
+SCENARIO("Directory change detection") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+
+    Dragonstash::Backend::Stat root_attr{
+        .mode = S_IRUSR | S_IWUSR | S_IXUSR,
+        .uid = env.default_uid(),
+        .gid = env.default_gid(),
+        .atime = env.default_timestamp(),
+        .mtime = env.default_timestamp(),
+        .ctime = env.default_timestamp(),
+    };
+    env.backend().update_attr(root_attr);
+
+    auto opendir = [&env, &fs]() {
+        auto req = env.fuse().new_request();
+        struct fuse_file_info fi{};
+        fs.opendir(req.wrap(), Dragonstash::ROOT_INO, &fi);
+        check_reply_type(req, TestFuseReplyType::OPEN);
+        fi = std::get<TestFuseReplyOpen>(req.reply_argv());
+        req = env.fuse().new_request();
+        fs.releasedir(req.wrap(), Dragonstash::ROOT_INO, &fi);
+    };
+
+    // the directory is not touched by this
+    auto rewrite_in_place = [&env]() {
+        auto &attr = env.backend().children().at("README.md")->attr();
+        attr.size = 4096;
+        attr.mtime.tv_sec += 10;
+    };
+
+    auto cached_size = [&env]() {
+        auto ino_result = env.cache().lookup(Dragonstash::ROOT_INO, "README.md");
+        require_result_ok(ino_result);
+        auto attr_result = env.cache().getattr(*ino_result);
+        require_result_ok(attr_result);
+        return attr_result->attr.common.size;
+    };
+
+    GIVEN("A filesystem with default settings") {
+        WHEN("Opening the root directory") {
+            opendir();
+
+            AND_WHEN("Rewriting a file in place and opening the directory again") {
+                rewrite_in_place();
+                opendir();
+
+                THEN("The attributes of the file are refreshed") {
+                    CHECK(cached_size() == 4096);
+                }
+            }
+        }
+    }
+
+    GIVEN("A filesystem with change detection enabled") {
+        fs.set_dir_change_detection(true);
+
+        WHEN("Opening the root directory") {
+            opendir();
+
+            THEN("The backend metadata of the directory is recorded") {
+                auto stamp_result = env.cache().begin_ro().dir_sync_stamp(Dragonstash::ROOT_INO);
+                require_result_ok(stamp_result);
+                CHECK(*stamp_result == Dragonstash::DirSyncStamp::from_backend_stat(env.backend().attr()));
+            }
+
+            AND_WHEN("Removing a file without touching the directory and opening it again") {
+                env.backend().remove("README.md");
+                opendir();
+
+                THEN("The directory is not read from the backend again") {
+                    require_result_ok(env.cache().lookup(Dragonstash::ROOT_INO, "README.md"));
+                }
+            }
+
+            AND_WHEN("Rewriting a file in place and opening the directory again") {
+                rewrite_in_place();
+                opendir();
+
+                THEN("The directory is not read from the backend again") {
+                    CHECK(cached_size() == 0);
+                }
+
+                THEN("A lookup returns the new attributes") {
+                    auto req = env.fuse().new_request();
+                    fs.lookup(req.wrap(), Dragonstash::ROOT_INO, "README.md");
+                    check_reply_type(req, TestFuseReplyType::ENTRY);
+                    CHECK(std::get<TestFuseReplyEntry>(req.reply_argv()).attr.st_size == 4096);
+                    CHECK(cached_size() == 4096);
+                }
+            }
+
+            AND_WHEN("Removing a file, updating the directory mtime and opening it again") {
+                env.backend().remove("README.md");
+                root_attr.mtime.tv_sec += 60;
+                env.backend().update_attr(root_attr);
+                opendir();
+
+                THEN("The directory is synced again") {
+                    check_result_error(env.cache().lookup(Dragonstash::ROOT_INO, "README.md"), ENOENT);
+                }
+            }
+        }
+
+        WHEN("Opening the root directory right after it changed") {
+            root_attr.mtime.tv_sec = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+            env.backend().update_attr(root_attr);
+            opendir();
+
+            THEN("No stamp is recorded") {
+                check_result_error(env.cache().begin_ro().dir_sync_stamp(Dragonstash::ROOT_INO), ENODATA);
+            }
+
+            AND_WHEN("Removing a file and opening it again") {
+                env.backend().remove("README.md");
+                opendir();
+
+                THEN("The directory is synced again") {
+                    check_result_error(env.cache().lookup(Dragonstash::ROOT_INO, "README.md"), ENOENT);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("readlink") {
+    TestEnvironment env;
+
+    GIVEN("A filesystem with default contents") {
+        env.with_default_contents();
+        Dragonstash::Filesystem &fs = env.fs();
+
+        auto dir_lookup_result = lookup(env.fuse(), env.fs(), Dragonstash::ROOT_INO, "books");
+        require_result_ok(dir_lookup_result);
         const ino_t dir_ino = *dir_lookup_result;
 
         auto link_lookup_result = lookup(env.fuse(), env.fs(), dir_ino, "best.epub");
@@ -594,3 +1505,1586 @@ SCENARIO("readlink") {
         }
     }
 }
+
+static std::basic_string<std::byte> make_file_data(std::size_t size, unsigned seed)
+{
+    std::basic_string<std::byte> result(size, std::byte(0));
+    for (std::size_t i = 0; i < size; ++i) {
+        result[i] = std::byte((i * 31 + seed) & 0xff);
+    }
+    return result;
+}
+
+static std::string as_string(const std::basic_string<std::byte> &data,
+                             std::size_t offset = 0,
+                             std::size_t size = std::string::npos)
+{
+    const auto sub = data.substr(offset, size);
+    return std::string(reinterpret_cast<const char*>(sub.data()), sub.size());
+}
+
+/**
+ * Return the data of a BUF or DATA reply.
+ */
+static std::string reply_contents(const TestFuseRequest &req)
+{
+    REQUIRE(req.has_reply());
+    if (req.reply_type() == TestFuseReplyType::DATA) {
+        auto [bufv, flags] = std::get<TestFuseReplyData>(req.reply_argv());
+        const fuse_buf &buf = bufv.buf[0];
+        REQUIRE((buf.flags & FUSE_BUF_IS_FD));
+        std::string result(buf.size, '\0');
+        REQUIRE(pread(buf.fd, result.data(), result.size(), buf.pos) == ssize_t(buf.size));
+        return result;
+    }
+    check_reply_type(req, TestFuseReplyType::BUF);
+    return std::get<TestFuseReplyBuf>(req.reply_argv());
+}
+
+SCENARIO("init") {
+    TestEnvironment env;
+
+    WHEN("The kernel supports splicing") {
+        struct fuse_conn_info conn{};
+        conn.capable = FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ;
+        env.fs().init(&conn);
+
+        THEN("Splicing replies is requested") {
+            CHECK((conn.want & FUSE_CAP_SPLICE_WRITE));
+            CHECK((conn.want & FUSE_CAP_SPLICE_MOVE));
+        }
+    }
+
+    WHEN("The kernel does not support splicing") {
+        struct fuse_conn_info conn{};
+        env.fs().init(&conn);
+
+        THEN("Splicing is not requested") {
+            CHECK(!(conn.want & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE)));
+        }
+    }
+}
+
+SCENARIO("open and read") {
+    TestEnvironment env;
+
+    GIVEN("A backend file spanning several blocks") {
+        Dragonstash::Filesystem &fs = env.fs();
+        constexpr std::size_t file_size = Dragonstash::CACHE_PAGE_SIZE * 3 + 100;
+        auto &file = env.backend().emplace<Dragonstash::Backend::InMemory::File>("data.bin");
+        file.data() = make_file_data(file_size, 1);
+        file.update_attr(Dragonstash::Backend::Stat{
+                             .mode = S_IRUSR,
+                             .size = file_size,
+                             .uid = env.default_uid(),
+                             .gid = env.default_gid(),
+                             .mtime = env.default_timestamp(),
+                         });
+        const auto original = file.data();
+
+        auto lookup_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "data.bin");
+        require_result_ok(lookup_result);
+        const ino_t ino = *lookup_result;
+
+        auto open_file = [&env, &fs, ino](int flags) {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = flags;
+            fs.open(req.wrap(), ino, &fi);
+            check_reply_type(req, TestFuseReplyType::OPEN);
+            return std::get<TestFuseReplyOpen>(req.reply_argv());
+        };
+
+        auto read_file = [&env, &fs, ino](struct fuse_file_info &fi,
+                                          std::size_t size, off_t off) {
+            auto req = env.fuse().new_request();
+            fs.read(req.wrap(), ino, size, off, &fi);
+            return reply_contents(req);
+        };
+
+        auto release_file = [&env, &fs, ino](struct fuse_file_info &fi) {
+            auto req = env.fuse().new_request();
+            fs.release(req.wrap(), ino, &fi);
+        };
+
+        WHEN("Opening the file for writing") {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = O_RDWR;
+            fs.open(req.wrap(), ino, &fi);
+
+            THEN("EROFS is returned") {
+                check_reply_error(req, EROFS);
+            }
+        }
+
+        WHEN("Reading the file") {
+            auto fi = open_file(O_RDONLY);
+            auto data = read_file(fi, file_size * 2, 0);
+
+            THEN("The backend contents are returned") {
+                CHECK(data == as_string(original));
+            }
+
+            THEN("All blocks are cached") {
+                auto content_result = env.cache().open_file(ino);
+                require_result_ok(content_result);
+                CHECK((*content_result)->cached_blocks() == 4);
+            }
+
+            AND_WHEN("The backend data changes behind our back and the file is read again") {
+                file.data() = make_file_data(file_size, 2);
+                auto second = read_file(fi, file_size, 0);
+
+                THEN("The cached data is returned without going to the backend") {
+                    CHECK(second == as_string(original));
+                }
+            }
+
+            AND_WHEN("Reading a cached range again") {
+                auto req = env.fuse().new_request();
+                fs.read(req.wrap(), ino, Dragonstash::CACHE_PAGE_SIZE, 100, &fi);
+
+                THEN("The data file is passed by descriptor") {
+                    check_reply_type(req, TestFuseReplyType::DATA);
+                    auto [bufv, flags] = std::get<TestFuseReplyData>(req.reply_argv());
+                    CHECK(bufv.count == 1);
+                    CHECK((bufv.buf[0].flags & FUSE_BUF_IS_FD));
+                    CHECK((bufv.buf[0].flags & FUSE_BUF_FD_SEEK));
+                    CHECK(bufv.buf[0].pos == 100);
+                    CHECK(bufv.buf[0].size == Dragonstash::CACHE_PAGE_SIZE);
+                    CHECK(reply_contents(req) == as_string(original, 100, Dragonstash::CACHE_PAGE_SIZE));
+                }
+            }
+
+            AND_WHEN("Reading a misaligned range") {
+                auto part = read_file(fi, Dragonstash::CACHE_PAGE_SIZE, 100);
+
+                THEN("The requested range is returned") {
+                    CHECK(part == as_string(original, 100, Dragonstash::CACHE_PAGE_SIZE));
+                }
+            }
+
+            release_file(fi);
+
+            AND_WHEN("The backend is disconnected and the file is opened and read again") {
+                env.backend().set_connected(false);
+                auto fi = open_file(O_RDONLY);
+                auto second = read_file(fi, file_size, 0);
+                release_file(fi);
+
+                THEN("The cached contents are returned") {
+                    CHECK(second == as_string(original));
+                }
+            }
+
+            AND_WHEN("The file changes on the backend and is opened again") {
+                file.data() = make_file_data(file_size, 2);
+                file.attr().mtime.tv_sec += 1;
+                auto fi = open_file(O_RDONLY);
+                auto second = read_file(fi, file_size, 0);
+                release_file(fi);
+
+                THEN("The kernel is told to drop its page cache") {
+                    CHECK(fi.keep_cache == 0);
+                }
+
+                THEN("The new contents are returned") {
+                    CHECK(second == as_string(file.data()));
+                }
+            }
+        }
+
+        WHEN("Reading a range in the middle of the file") {
+            auto fi = open_file(O_RDONLY);
+            auto part = read_file(fi, 10, Dragonstash::CACHE_PAGE_SIZE + 5);
+
+            THEN("The range is returned") {
+                CHECK(part == as_string(original, Dragonstash::CACHE_PAGE_SIZE + 5, 10));
+            }
+
+            THEN("Only the touched block is cached") {
+                auto content_result = env.cache().open_file(ino);
+                require_result_ok(content_result);
+                CHECK((*content_result)->cached_blocks() == 1);
+            }
+
+            release_file(fi);
+        }
+
+        WHEN("Reading beyond the end of the file") {
+            auto fi = open_file(O_RDONLY);
+            auto data = read_file(fi, 100, file_size);
+            release_file(fi);
+
+            THEN("Nothing is returned") {
+                CHECK(data.empty());
+            }
+        }
+
+        WHEN("The backend is disconnected before anything has been read") {
+            env.backend().set_connected(false);
+            auto fi = open_file(O_RDONLY);
+            auto req = env.fuse().new_request();
+            fs.read(req.wrap(), ino, file_size, 0, &fi);
+            release_file(fi);
+
+            THEN("EIO is returned") {
+                check_reply_error(req, EIO);
+            }
+        }
+    }
+}
+
+SCENARIO("Cache block size") {
+    constexpr std::size_t block_size = 64 * 1024;
+    TestEnvironment env(block_size);
+    Dragonstash::Filesystem &fs = env.fs();
+
+    GIVEN("A backend file spanning several large blocks") {
+        constexpr std::size_t file_size = block_size * 2 + 100;
+        auto &file = env.backend().emplace<Dragonstash::Backend::InMemory::File>("video.mkv");
+        file.data() = make_file_data(file_size, 5);
+        file.update_attr(Dragonstash::Backend::Stat{
+                             .mode = S_IRUSR,
+                             .size = file_size,
+                             .uid = env.default_uid(),
+                             .gid = env.default_gid(),
+                         });
+        const auto original = file.data();
+
+        auto lookup_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "video.mkv");
+        require_result_ok(lookup_result);
+        const ino_t ino = *lookup_result;
+
+        THEN("The block size is reported to the kernel") {
+            auto req = env.fuse().new_request();
+            fs.getattr(req.wrap(), ino, nullptr);
+            check_reply_type(req, TestFuseReplyType::ATTR);
+            const auto &attr = std::get<TestFuseReplyAttr>(req.reply_argv());
+            CHECK(std::get<0>(attr).st_blksize == blksize_t(block_size));
+        }
+
+        WHEN("A small range in the middle of a block is read") {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fs.open(req.wrap(), ino, &fi);
+            check_reply_type(req, TestFuseReplyType::OPEN);
+            fi = std::get<TestFuseReplyOpen>(req.reply_argv());
+
+            auto read_req = env.fuse().new_request();
+            fs.read(read_req.wrap(), ino, 4096, block_size + 1000, &fi);
+            const auto data = reply_contents(read_req);
+
+            THEN("The whole block is fetched and cached") {
+                CHECK(data == as_string(original).substr(block_size + 1000, 4096));
+                auto content_result = env.cache().open_file(ino);
+                require_result_ok(content_result);
+                CHECK((*content_result)->block_size() == block_size);
+                CHECK((*content_result)->cached_blocks() == 1);
+                CHECK((*content_result)->with_cached_range(
+                          block_size, block_size,
+                          [](int, std::size_t available) { return available; }) == block_size);
+            }
+
+            auto release_req = env.fuse().new_request();
+            fs.release(release_req.wrap(), ino, &fi);
+        }
+    }
+}
+
+SCENARIO("Sequential readahead") {
+    TestEnvironment env;
+    // without worker threads, prefetches run inline and the test is
+    // deterministic
+    Dragonstash::Filesystem fs(env.cache(), env.backend(), 0, 0);
+    Dragonstash::Readahead::Config config;
+    config.min_window = Dragonstash::CACHE_PAGE_SIZE * 4;
+    config.max_window = Dragonstash::CACHE_PAGE_SIZE * 16;
+    fs.set_readahead_config(config);
+
+    GIVEN("A large backend file") {
+        constexpr std::size_t file_size = Dragonstash::CACHE_PAGE_SIZE * 64;
+        auto &file = env.backend().emplace<Dragonstash::Backend::InMemory::File>("movie.mkv");
+        file.data() = make_file_data(file_size, 3);
+        file.update_attr(Dragonstash::Backend::Stat{
+                             .mode = S_IRUSR,
+                             .size = file_size,
+                             .uid = env.default_uid(),
+                             .gid = env.default_gid(),
+                         });
+        const auto original = file.data();
+
+        auto lookup_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "movie.mkv");
+        require_result_ok(lookup_result);
+        const ino_t ino = *lookup_result;
+
+        auto req = env.fuse().new_request();
+        struct fuse_file_info fi{};
+        fs.open(req.wrap(), ino, &fi);
+        check_reply_type(req, TestFuseReplyType::OPEN);
+
+        auto content_result = env.cache().open_file(ino);
+        require_result_ok(content_result);
+        auto content = *content_result;
+
+        auto read_block = [&env, &fs, &fi, ino](std::size_t block) {
+            auto req = env.fuse().new_request();
+            fs.read(req.wrap(), ino, Dragonstash::CACHE_PAGE_SIZE,
+                    block * Dragonstash::CACHE_PAGE_SIZE, &fi);
+            return reply_contents(req);
+        };
+
+        WHEN("Reading the first two blocks") {
+            CHECK(read_block(0) == as_string(original, 0, Dragonstash::CACHE_PAGE_SIZE));
+            CHECK(read_block(1) == as_string(original, Dragonstash::CACHE_PAGE_SIZE, Dragonstash::CACHE_PAGE_SIZE));
+
+            THEN("The blocks behind them are prefetched as READAHEAD") {
+                CHECK(content->cached_blocks(Dragonstash::Blocklist::READ) == 2);
+                CHECK(content->cached_blocks(Dragonstash::Blocklist::READAHEAD) == 8);
+            }
+
+            AND_WHEN("Reading a prefetched block") {
+                const auto data = read_block(2);
+
+                THEN("It is returned and promoted to READ") {
+                    CHECK(data == as_string(original, 2 * Dragonstash::CACHE_PAGE_SIZE, Dragonstash::CACHE_PAGE_SIZE));
+                    CHECK(content->cached_blocks(Dragonstash::Blocklist::READ) == 3);
+                }
+            }
+
+            AND_WHEN("Reading the whole file sequentially") {
+                std::string data = as_string(original, 0, 2 * Dragonstash::CACHE_PAGE_SIZE);
+                for (std::size_t block = 2; block < 64; ++block) {
+                    data += read_block(block);
+                }
+
+                THEN("The data is correct and all blocks end up READ") {
+                    CHECK(data == as_string(original));
+                    CHECK(content->cached_blocks(Dragonstash::Blocklist::READ) == 64);
+                    CHECK(content->cached_blocks(Dragonstash::Blocklist::READAHEAD) == 0);
+                }
+            }
+        }
+
+        WHEN("Reading blocks in random order") {
+            (void)read_block(10);
+            (void)read_block(3);
+            (void)read_block(40);
+
+            THEN("Nothing is prefetched") {
+                CHECK(content->cached_blocks(Dragonstash::Blocklist::READAHEAD) == 0);
+            }
+        }
+
+        req = env.fuse().new_request();
+        fs.release(req.wrap(), ino, &fi);
+    }
+}
+
+SCENARIO("prefetch") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+
+    constexpr std::size_t file_size = Dragonstash::CACHE_PAGE_SIZE * 2 + 10;
+    using namespace Dragonstash::Backend::InMemory;
+    auto &archive = env.backend().emplace<Directory>("archive");
+    archive.update_attr(Dragonstash::Backend::Stat{.mode = S_IRWXU});
+    auto &year = archive.emplace<Directory>("2019");
+    year.update_attr(Dragonstash::Backend::Stat{.mode = S_IRWXU});
+    auto &file = year.emplace<File>("report.pdf");
+    file.data() = make_file_data(file_size, 3);
+    file.update_attr(Dragonstash::Backend::Stat{
+                         .mode = S_IRUSR,
+                         .size = file_size,
+                         .mtime = env.default_timestamp(),
+                     });
+
+    auto cached_ino = [&env](std::initializer_list<std::string_view> names) {
+        auto txn = env.cache().begin_ro();
+        Dragonstash::Result<ino_t> ino = Dragonstash::ROOT_INO;
+        for (auto name: names) {
+            ino = txn.lookup(*ino, name);
+            if (!ino) {
+                break;
+            }
+        }
+        return ino;
+    };
+
+    GIVEN("An empty cache") {
+        WHEN("Prefetching the whole tree") {
+            auto result = fs.prefetch("/", Dragonstash::PrefetchOptions());
+            require_result_ok(result);
+
+            THEN("All directories are synced") {
+                CHECK(result->directories == 4);
+                CHECK(result->errors == 0);
+                check_result_ok(cached_ino({"books", "The Elements of Style.epub"}));
+                check_result_ok(cached_ino({"archive", "2019", "report.pdf"}));
+            }
+
+            THEN("No contents are downloaded") {
+                CHECK(result->files == 0);
+                CHECK(result->bytes == 0);
+            }
+
+            AND_WHEN("The backend goes away") {
+                env.backend().set_connected(false);
+
+                THEN("The tree can be looked up") {
+                    auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "archive");
+                    require_result_ok(dir_result);
+                    auto year_result = lookup(env.fuse(), fs, *dir_result, "2019");
+                    require_result_ok(year_result);
+                    check_result_ok(lookup(env.fuse(), fs, *year_result, "report.pdf"));
+                }
+            }
+        }
+
+        WHEN("Prefetching with a depth of zero") {
+            Dragonstash::PrefetchOptions options;
+            options.depth = 0;
+            auto result = fs.prefetch("", options);
+            require_result_ok(result);
+
+            THEN("Only the start directory is synced") {
+                CHECK(result->directories == 1);
+                check_result_ok(cached_ino({"archive"}));
+                check_result_error(cached_ino({"archive", "2019"}), ENOENT);
+            }
+        }
+
+        WHEN("Prefetching a subtree with contents") {
+            Dragonstash::PrefetchOptions options;
+            options.content = true;
+            options.concurrency = 2;
+            auto result = fs.prefetch("archive/2019", options);
+            require_result_ok(result);
+
+            THEN("The subtree and the directories leading to it are cached") {
+                CHECK(result->directories == 1);
+                check_result_ok(cached_ino({"archive", "2019", "report.pdf"}));
+            }
+
+            THEN("The contents are downloaded and pinned") {
+                CHECK(result->files == 1);
+                CHECK(result->bytes == file_size);
+                auto ino_result = cached_ino({"archive", "2019", "report.pdf"});
+                require_result_ok(ino_result);
+                auto content_result = env.cache().open_file(*ino_result);
+                require_result_ok(content_result);
+                CHECK((*content_result)->cached_blocks(Dragonstash::Blocklist::PINNED) == 3);
+            }
+
+            AND_WHEN("Prefetching it again") {
+                auto again = fs.prefetch("/archive/2019/", options);
+                require_result_ok(again);
+
+                THEN("Nothing is downloaded") {
+                    CHECK(again->files == 1);
+                    CHECK(again->bytes == 0);
+                }
+            }
+        }
+
+        WHEN("Prefetching a file which has been read before") {
+            auto first = fs.prefetch("/archive", Dragonstash::PrefetchOptions());
+            require_result_ok(first);
+            auto ino_result = cached_ino({"archive", "2019", "report.pdf"});
+            require_result_ok(ino_result);
+            {
+                auto req = env.fuse().new_request();
+                struct fuse_file_info fi{};
+                fs.open(req.wrap(), *ino_result, &fi);
+                check_reply_type(req, TestFuseReplyType::OPEN);
+                fi = std::get<TestFuseReplyOpen>(req.reply_argv());
+                auto read_req = env.fuse().new_request();
+                fs.read(read_req.wrap(), *ino_result, file_size, 0, &fi);
+                CHECK(reply_contents(read_req) == as_string(file.data()));
+                auto release_req = env.fuse().new_request();
+                fs.release(release_req.wrap(), *ino_result, &fi);
+            }
+
+            Dragonstash::PrefetchOptions options;
+            options.content = true;
+            auto result = fs.prefetch("/archive", options);
+            require_result_ok(result);
+
+            THEN("The cached blocks are pinned without downloading them again") {
+                CHECK(result->bytes == 0);
+                auto content_result = env.cache().open_file(*ino_result);
+                require_result_ok(content_result);
+                CHECK((*content_result)->cached_blocks(Dragonstash::Blocklist::PINNED) == 3);
+                CHECK((*content_result)->cached_blocks(Dragonstash::Blocklist::READ) == 0);
+            }
+        }
+
+        WHEN("Prefetching a nonexistent path") {
+            THEN("ENOENT is returned") {
+                check_result_error(fs.prefetch("/nonexistent", Dragonstash::PrefetchOptions()), ENOENT);
+            }
+        }
+
+        WHEN("Prefetching a file") {
+            THEN("ENOTDIR is returned") {
+                check_result_error(fs.prefetch("/README.md", Dragonstash::PrefetchOptions()), ENOTDIR);
+            }
+        }
+
+        WHEN("Prefetching a path containing ..") {
+            THEN("EINVAL is returned") {
+                check_result_error(fs.prefetch("/books/../archive", Dragonstash::PrefetchOptions()), EINVAL);
+            }
+        }
+    }
+
+    GIVEN("A mounted filesystem") {
+        auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "archive");
+        require_result_ok(dir_result);
+
+        WHEN("Setting the prefetch attribute on a directory") {
+            auto req = env.fuse().new_request();
+            fs.setxattr(req.wrap(), *dir_result, Dragonstash::PREFETCH_XATTR, "depth=1,content", 0);
+
+            THEN("The subtree is prefetched in the background") {
+                check_reply_error(req, 0);
+                fs.wait_prefetched();
+                check_result_ok(cached_ino({"archive", "2019", "report.pdf"}));
+            }
+        }
+
+        WHEN("Setting the prefetch attribute on a file") {
+            auto file_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+            require_result_ok(file_result);
+            auto req = env.fuse().new_request();
+            fs.setxattr(req.wrap(), *file_result, Dragonstash::PREFETCH_XATTR, "", 0);
+
+            THEN("ENOTDIR is returned") {
+                check_reply_error(req, ENOTDIR);
+            }
+        }
+
+        WHEN("Setting the prefetch attribute with malformed options") {
+            auto req = env.fuse().new_request();
+            fs.setxattr(req.wrap(), *dir_result, Dragonstash::PREFETCH_XATTR, "depth=x", 0);
+
+            THEN("EINVAL is returned") {
+                check_reply_error(req, EINVAL);
+            }
+        }
+
+        WHEN("Setting another attribute") {
+            auto req = env.fuse().new_request();
+            fs.setxattr(req.wrap(), *dir_result, "user.other", "", 0);
+
+            THEN("ENOTSUP is returned") {
+                check_reply_error(req, ENOTSUP);
+            }
+        }
+    }
+}
+
+SCENARIO("Prefetch attribute while the kernel is slow to process invalidations") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem fs(env.cache(), env.backend(),
+                               Dragonstash::WorkerPool::DEFAULT_CONCURRENCY,
+                               Dragonstash::Readahead::DEFAULT_CONCURRENCY,
+                               1);
+    fs.set_notifier(env.fuse().notifier());
+
+    static constexpr int DIRS = 8;
+    using namespace Dragonstash::Backend::InMemory;
+    auto &archive = env.backend().emplace<Directory>("archive");
+    archive.update_attr(Dragonstash::Backend::Stat{.mode = S_IRWXU});
+    for (int i = 0; i < DIRS; ++i) {
+        auto &dir = archive.emplace<Directory>("dir" + std::to_string(i));
+        dir.update_attr(Dragonstash::Backend::Stat{.mode = S_IRWXU});
+        dir.emplace<File>("data").update_attr(Dragonstash::Backend::Stat{.mode = S_IRUSR});
+    }
+
+    GIVEN("A prefetched subtree whose files changed on the backend") {
+        require_result_ok(fs.prefetch("/archive", Dragonstash::PrefetchOptions()));
+        auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "archive");
+        require_result_ok(dir_result);
+        for (int i = 0; i < DIRS; ++i) {
+            auto &dir = static_cast<Directory&>(*archive.children().at("dir" + std::to_string(i)));
+            auto &attr = dir.children().at("data")->attr();
+            attr.size = 4096;
+            attr.mtime.tv_sec += 10;
+        }
+
+        // the kernel holds the lock of the directory until the reply
+        std::promise<void> open_gate;
+        notify_gate = open_gate.get_future().share();
+        gated_notifications = 0;
+        Fuse::notify_backend.inval_inode = &gated_inval_inode;
+        Fuse::notify_backend.inval_entry = &gated_inval_entry;
+
+        WHEN("Setting the prefetch attribute on it") {
+            auto req = env.fuse().new_request();
+            auto setxattr = std::async(std::launch::async, [&fs, &req, &dir_result]() {
+                fs.setxattr(req.wrap(), *dir_result, Dragonstash::PREFETCH_XATTR, "", 0);
+            });
+            const auto status = setxattr.wait_for(std::chrono::seconds(10));
+            open_gate.set_value();
+            setxattr.get();
+            fs.wait_prefetched();
+            fs.set_notifier(Fuse::Notifier());
+
+            THEN("The request is answered without waiting for the invalidations") {
+                CHECK(status == std::future_status::ready);
+                check_reply_error(req, 0);
+            }
+
+            THEN("The changed files are invalidated") {
+                CHECK(gated_notifications >= DIRS);
+            }
+        }
+    }
+}
+
+SCENARIO("pinning") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+
+    constexpr std::size_t small_size = Dragonstash::CACHE_PAGE_SIZE * 2 + 10;
+    constexpr std::size_t large_size = Dragonstash::CACHE_PAGE_SIZE * 8;
+    using namespace Dragonstash::Backend::InMemory;
+    auto &datasets = env.backend().emplace<Directory>("datasets");
+    datasets.update_attr(Dragonstash::Backend::Stat{.mode = S_IRWXU});
+    for (const auto &[name, size]: {std::make_pair("small.csv", small_size),
+                                    std::make_pair("large.csv", large_size)}) {
+        auto &file = datasets.emplace<File>(name);
+        file.data() = make_file_data(size, 4);
+        file.update_attr(Dragonstash::Backend::Stat{
+                             .mode = S_IRUSR,
+                             .size = size,
+                             .mtime = env.default_timestamp(),
+                         });
+    }
+
+    std::uint64_t rule_id = 0;
+    require_result_ok(env.cache().write([&rule_id](Dragonstash::CacheTransactionRW &txn) {
+        rule_id = txn.add_pin_rule(Dragonstash::PinRule::make_subtree(
+                                       "/datasets", Dragonstash::CACHE_PAGE_SIZE * 4));
+        return Dragonstash::make_result();
+    }));
+
+    auto pinned_blocks = [&env](ino_t ino, Dragonstash::Blocklist::State state) {
+        auto content_result = env.cache().open_file(ino);
+        REQUIRE(content_result);
+        return (*content_result)->cached_blocks(state);
+    };
+
+    auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "datasets");
+    require_result_ok(dir_result);
+
+    GIVEN("A pin rule for a subtree") {
+        WHEN("A matching file is looked up") {
+            auto small_result = lookup(env.fuse(), fs, *dir_result, "small.csv");
+            require_result_ok(small_result);
+            fs.wait_pinned();
+
+            THEN("Its contents are downloaded and pinned") {
+                CHECK(pinned_blocks(*small_result, Dragonstash::Blocklist::PINNED) == 3);
+            }
+        }
+
+        WHEN("A file outside the subtree is looked up") {
+            auto other_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md");
+            require_result_ok(other_result);
+            fs.wait_pinned();
+
+            THEN("Nothing is downloaded") {
+                CHECK(pinned_blocks(*other_result, Dragonstash::Blocklist::PINNED) == 0);
+            }
+        }
+
+        WHEN("The directory is opened") {
+            sync_dir(env.fuse(), fs, *dir_result);
+            fs.wait_pinned();
+
+            THEN("Matching files are pinned") {
+                auto small_result = env.cache().lookup(*dir_result, "small.csv");
+                require_result_ok(small_result);
+                CHECK(pinned_blocks(*small_result, Dragonstash::Blocklist::PINNED) == 3);
+            }
+
+            THEN("Files above the size limit are not") {
+                auto large_result = env.cache().lookup(*dir_result, "large.csv");
+                require_result_ok(large_result);
+                CHECK(pinned_blocks(*large_result, Dragonstash::Blocklist::PINNED) == 0);
+            }
+
+            AND_WHEN("The backend goes away") {
+                env.backend().set_connected(false);
+                auto small_result = lookup(env.fuse(), fs, *dir_result, "small.csv");
+                require_result_ok(small_result);
+
+                THEN("The pinned file can be read") {
+                    auto req = env.fuse().new_request();
+                    struct fuse_file_info fi{};
+                    fs.open(req.wrap(), *small_result, &fi);
+                    check_reply_type(req, TestFuseReplyType::OPEN);
+                    fi = std::get<TestFuseReplyOpen>(req.reply_argv());
+                    auto read_req = env.fuse().new_request();
+                    fs.read(read_req.wrap(), *small_result, small_size, 0, &fi);
+                    CHECK(reply_contents(read_req) == as_string(make_file_data(small_size, 4)));
+                    auto release_req = env.fuse().new_request();
+                    fs.release(release_req.wrap(), *small_result, &fi);
+                }
+            }
+
+            AND_WHEN("The rule is removed") {
+                require_result_ok(env.cache().write([rule_id](Dragonstash::CacheTransactionRW &txn) {
+                    return txn.remove_pin_rule(rule_id);
+                }));
+                // the change is picked up by the next request
+                require_result_ok(lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md"));
+                fs.wait_pinned();
+
+                THEN("The contents become evictable") {
+                    auto small_result = env.cache().lookup(*dir_result, "small.csv");
+                    require_result_ok(small_result);
+                    CHECK(pinned_blocks(*small_result, Dragonstash::Blocklist::PINNED) == 0);
+                    CHECK(pinned_blocks(*small_result, Dragonstash::Blocklist::READ) == 3);
+                }
+
+                THEN("The rule is purged") {
+                    CHECK(env.cache().begin_ro().pin_rules().empty());
+                }
+            }
+        }
+
+        WHEN("A file has been prefetched with contents") {
+            Dragonstash::PrefetchOptions options;
+            options.content = true;
+            require_result_ok(fs.prefetch("/datasets", options));
+            auto large_result = env.cache().lookup(*dir_result, "large.csv");
+            require_result_ok(large_result);
+
+            AND_WHEN("The rule is removed") {
+                require_result_ok(env.cache().write([rule_id](Dragonstash::CacheTransactionRW &txn) {
+                    return txn.remove_pin_rule(rule_id);
+                }));
+                require_result_ok(lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md"));
+                fs.wait_pinned();
+
+                THEN("Contents the rule did not select stay pinned") {
+                    CHECK(pinned_blocks(*large_result, Dragonstash::Blocklist::PINNED) == 8);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Write-back") {
+    TestEnvironment env;
+    Dragonstash::Filesystem &fs = env.fs();
+    constexpr std::size_t file_size = Dragonstash::CACHE_PAGE_SIZE * 2 + 100;
+    using namespace Dragonstash::Backend::InMemory;
+    auto &file = env.backend().emplace<File>("data.bin");
+    file.data() = make_file_data(file_size, 5);
+    file.update_attr(Dragonstash::Backend::Stat{
+                         .mode = S_IRUSR | S_IWUSR,
+                         .size = file_size,
+                         .uid = env.default_uid(),
+                         .gid = env.default_gid(),
+                         .mtime = env.default_timestamp(),
+                     });
+    const auto original = file.data();
+
+    auto lookup_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "data.bin");
+    require_result_ok(lookup_result);
+    const ino_t ino = *lookup_result;
+
+    auto open_file = [&env, &fs](ino_t ino, int flags) {
+        auto req = env.fuse().new_request();
+        struct fuse_file_info fi{};
+        fi.flags = flags;
+        fs.open(req.wrap(), ino, &fi);
+        check_reply_type(req, TestFuseReplyType::OPEN);
+        return std::get<TestFuseReplyOpen>(req.reply_argv());
+    };
+
+    auto read_file = [&env, &fs](ino_t ino, struct fuse_file_info &fi,
+                                 std::size_t size, off_t off) {
+        auto req = env.fuse().new_request();
+        fs.read(req.wrap(), ino, size, off, &fi);
+        return reply_contents(req);
+    };
+
+    auto write_file = [&env, &fs](ino_t ino, struct fuse_file_info &fi,
+                                  std::string_view data, off_t off) {
+        auto req = env.fuse().new_request();
+        fs.write(req.wrap(), ino, data, off, &fi);
+        return req;
+    };
+
+    auto release_file = [&env, &fs](ino_t ino, struct fuse_file_info &fi) {
+        auto req = env.fuse().new_request();
+        fs.release(req.wrap(), ino, &fi);
+    };
+
+    auto journaled = [&env](ino_t ino) {
+        return env.cache().begin_ro().journaled(ino);
+    };
+
+    GIVEN("Write-back is disabled") {
+        WHEN("Creating a file") {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = O_WRONLY | O_CREAT;
+            fs.create(req.wrap(), Dragonstash::ROOT_INO, "new.txt", S_IFREG | 0644, &fi);
+
+            THEN("EROFS is returned") {
+                check_reply_error(req, EROFS);
+            }
+        }
+
+        WHEN("Truncating a file") {
+            auto req = env.fuse().new_request();
+            struct stat attr{};
+            fs.setattr(req.wrap(), ino, attr, FUSE_SET_ATTR_SIZE, nullptr);
+
+            THEN("EROFS is returned") {
+                check_reply_error(req, EROFS);
+            }
+        }
+    }
+
+    GIVEN("Write-back without a background flusher") {
+        fs.set_write_back(true, std::chrono::milliseconds(0));
+
+        WHEN("Writing into the middle of a file") {
+            const std::string patch(10, 'W');
+            auto fi = open_file(ino, O_RDWR);
+            auto req = write_file(ino, fi, patch, 5);
+
+            THEN("The write is acknowledged") {
+                check_reply_type(req, TestFuseReplyType::WRITE);
+                CHECK(std::get<TestFuseReplyWrite>(req.reply_argv()) == patch.size());
+            }
+
+            THEN("The change is visible through the file system") {
+                auto expected = as_string(original);
+                expected.replace(5, patch.size(), patch);
+                CHECK(read_file(ino, fi, file_size, 0) == expected);
+            }
+
+            THEN("The backend is not changed yet") {
+                CHECK(file.data() == original);
+                CHECK(journaled(ino));
+            }
+
+            AND_WHEN("The changes are written back") {
+                release_file(ino, fi);
+                const auto stats = fs.write_back();
+
+                THEN("The backend has the new contents") {
+                    CHECK(stats.files == 1);
+                    CHECK(stats.failed == 0);
+                    CHECK(stats.bytes == patch.size());
+                    auto expected = as_string(original);
+                    expected.replace(5, patch.size(), patch);
+                    CHECK(as_string(file.data()) == expected);
+                }
+
+                THEN("The journal is empty") {
+                    CHECK(!journaled(ino));
+                }
+
+                THEN("The cached contents are kept") {
+                    auto fi = open_file(ino, O_RDONLY);
+                    env.backend().set_connected(false);
+                    CHECK(read_file(ino, fi, patch.size(), 5) == patch);
+                    release_file(ino, fi);
+                }
+            }
+        }
+
+        WHEN("Journaling a later write fails") {
+            const std::string patch(10, 'W');
+            const std::string tail(20, 'T');
+            auto fi = open_file(ino, O_RDWR);
+            check_reply_type(write_file(ino, fi, patch, 5), TestFuseReplyType::WRITE);
+
+            // the failing operation and the write end up in the same group
+            env.cache().group_commit().set_window(std::chrono::seconds(10), 2);
+            auto failing = std::async(std::launch::async, [&env](){
+                return env.cache().write([](Dragonstash::CacheTransactionRW &txn) {
+                    txn.add_transaction_hook([](){
+                        return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+                    }, nullptr, nullptr, nullptr);
+                    return Dragonstash::make_result();
+                });
+            });
+            auto req = write_file(ino, fi, tail, file_size);
+            check_result_error(failing.get(), EIO);
+            env.cache().group_commit().set_window(std::chrono::microseconds(0), 1024);
+
+            THEN("The write fails") {
+                check_reply_error(req, EIO);
+            }
+
+            THEN("The earlier write is still visible") {
+                release_file(ino, fi);
+                auto fi = open_file(ino, O_RDONLY);
+                auto expected = as_string(original);
+                expected.replace(5, patch.size(), patch);
+                CHECK(read_file(ino, fi, file_size + tail.size(), 0) == expected);
+                release_file(ino, fi);
+            }
+
+            AND_WHEN("The changes are written back") {
+                release_file(ino, fi);
+                const auto stats = fs.write_back();
+
+                THEN("The backend has the contents of the earlier write") {
+                    CHECK(stats.failed == 0);
+                    auto expected = as_string(original);
+                    expected.replace(5, patch.size(), patch);
+                    CHECK(as_string(file.data()) == expected);
+                    CHECK(!journaled(ino));
+                }
+            }
+        }
+
+        WHEN("The file is cached and the backend goes away") {
+            auto fi = open_file(ino, O_RDWR);
+            CHECK(read_file(ino, fi, file_size, 0) == as_string(original));
+            env.backend().set_connected(false);
+
+            AND_WHEN("The file is extended") {
+                const std::string tail(20, 'T');
+                auto req = write_file(ino, fi, tail, file_size);
+                check_reply_type(req, TestFuseReplyType::WRITE);
+
+                THEN("The new size is reported") {
+                    auto req = env.fuse().new_request();
+                    fs.getattr(req.wrap(), ino, nullptr);
+                    check_reply_type(req, TestFuseReplyType::ATTR);
+                    CHECK(std::get<0>(std::get<TestFuseReplyAttr>(req.reply_argv())).st_size ==
+                          off_t(file_size + tail.size()));
+                }
+
+                THEN("Writing back fails and keeps the journal") {
+                    const auto stats = fs.write_back();
+                    CHECK(stats.failed == 1);
+                    CHECK(journaled(ino));
+                }
+
+                AND_WHEN("The backend comes back and the changes are written back") {
+                    release_file(ino, fi);
+                    env.backend().set_connected(true);
+                    const auto stats = fs.write_back();
+
+                    THEN("The backend has the new contents") {
+                        CHECK(stats.files == 1);
+                        CHECK(as_string(file.data()) == as_string(original) + tail);
+                        CHECK(file.attr().size == file_size + tail.size());
+                        CHECK(!journaled(ino));
+                    }
+                }
+            }
+
+            release_file(ino, fi);
+        }
+
+        WHEN("Writing part of an uncached block while the backend is away") {
+            env.backend().set_connected(false);
+            auto fi = open_file(ino, O_RDWR);
+            auto req = write_file(ino, fi, "x", 5);
+            release_file(ino, fi);
+
+            THEN("EIO is returned") {
+                check_reply_error(req, EIO);
+                CHECK(!journaled(ino));
+            }
+        }
+
+        WHEN("Truncating the file") {
+            auto req = env.fuse().new_request();
+            struct stat attr{};
+            attr.st_size = 10;
+            fs.setattr(req.wrap(), ino, attr, FUSE_SET_ATTR_SIZE, nullptr);
+
+            THEN("The new size is returned") {
+                check_reply_type(req, TestFuseReplyType::ATTR);
+                CHECK(std::get<0>(std::get<TestFuseReplyAttr>(req.reply_argv())).st_size == 10);
+            }
+
+            AND_WHEN("The change is written back") {
+                const auto stats = fs.write_back();
+
+                THEN("The backend file is truncated") {
+                    CHECK(stats.files == 1);
+                    CHECK(file.data() == original.substr(0, 10));
+                }
+            }
+        }
+
+        WHEN("Creating a file while the backend is away") {
+            env.backend().set_connected(false);
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = O_WRONLY | O_CREAT;
+            fs.create(req.wrap(), Dragonstash::ROOT_INO, "new.txt", S_IFREG | 0644, &fi);
+            check_reply_type(req, TestFuseReplyType::CREATE);
+            auto [entry, created_fi] = std::get<TestFuseReplyCreate>(req.reply_argv());
+            const ino_t new_ino = entry.ino;
+            auto write_req = write_file(new_ino, created_fi, "hello", 0);
+            check_reply_type(write_req, TestFuseReplyType::WRITE);
+            release_file(new_ino, created_fi);
+
+            THEN("It can be looked up and read") {
+                auto lookup_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "new.txt");
+                require_result_ok(lookup_result);
+                CHECK(*lookup_result == new_ino);
+                auto fi = open_file(new_ino, O_RDONLY);
+                CHECK(read_file(new_ino, fi, 100, 0) == "hello");
+                release_file(new_ino, fi);
+            }
+
+            THEN("Creating it again fails with EEXIST") {
+                auto req = env.fuse().new_request();
+                struct fuse_file_info fi{};
+                fi.flags = O_WRONLY | O_CREAT | O_EXCL;
+                fs.create(req.wrap(), Dragonstash::ROOT_INO, "new.txt", S_IFREG | 0644, &fi);
+                check_reply_error(req, EEXIST);
+            }
+
+            AND_WHEN("The backend comes back and the changes are written back") {
+                env.backend().set_connected(true);
+                const auto stats = fs.write_back();
+
+                THEN("The file exists on the backend") {
+                    CHECK(stats.files == 1);
+                    auto node_result = env.backend().find("/new.txt");
+                    require_result_ok(node_result);
+                    auto *created = dynamic_cast<File*>(*node_result);
+                    REQUIRE(created != nullptr);
+                    CHECK(as_string(created->data()) == "hello");
+                    CHECK(!journaled(new_ino));
+                }
+
+                THEN("A lookup keeps the inode") {
+                    auto lookup_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "new.txt");
+                    require_result_ok(lookup_result);
+                    CHECK(*lookup_result == new_ino);
+                }
+
+                AND_WHEN("The file is changed and written back again") {
+                    auto fi = open_file(new_ino, O_RDWR);
+                    check_reply_type(write_file(new_ino, fi, "!", 5), TestFuseReplyType::WRITE);
+                    release_file(new_ino, fi);
+                    const auto stats = fs.write_back();
+
+                    THEN("The file created before is updated") {
+                        CHECK(stats.files == 1);
+                        CHECK(stats.failed == 0);
+                        auto node_result = env.backend().find("/new.txt");
+                        require_result_ok(node_result);
+                        auto *created = dynamic_cast<File*>(*node_result);
+                        REQUIRE(created != nullptr);
+                        CHECK(as_string(created->data()) == "hello!");
+                    }
+                }
+            }
+
+            AND_WHEN("A file of the same name appears on the backend before the write-back") {
+                auto &theirs = env.backend().emplace<File>("new.txt");
+                theirs.data() = make_file_data(100, 7);
+                const auto their_data = theirs.data();
+                env.backend().set_connected(true);
+                const auto stats = fs.write_back();
+
+                THEN("The write-back fails with EEXIST") {
+                    CHECK(stats.files == 0);
+                    CHECK(stats.failed == 1);
+                    CHECK(stats.error == EEXIST);
+                }
+
+                THEN("The backend file is not replaced") {
+                    CHECK(theirs.data() == their_data);
+                }
+
+                THEN("The changes stay journaled") {
+                    CHECK(journaled(new_ino));
+                }
+            }
+        }
+
+        WHEN("Creating a file which exists on the backend but is not cached yet") {
+            auto &theirs = env.backend().emplace<File>("other.txt");
+            theirs.data() = make_file_data(100, 7);
+            const auto their_data = theirs.data();
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = O_WRONLY | O_CREAT | O_EXCL;
+            fs.create(req.wrap(), Dragonstash::ROOT_INO, "other.txt", S_IFREG | 0644, &fi);
+
+            THEN("EEXIST is returned") {
+                check_reply_error(req, EEXIST);
+            }
+
+            THEN("The backend file is not replaced") {
+                CHECK(theirs.data() == their_data);
+            }
+        }
+    }
+}
+
+/**
+ * Backend whose file reads wait until they are released.
+ */
+class StallingFilesystem: public Dragonstash::Backend::InMemoryFilesystem {
+private:
+    class StallingFile: public Dragonstash::Backend::File {
+    public:
+        StallingFile(StallingFilesystem &fs, std::unique_ptr<Dragonstash::Backend::File> file):
+            m_fs(fs),
+            m_file(std::move(file))
+        {
+        }
+
+    private:
+        StallingFilesystem &m_fs;
+        std::unique_ptr<Dragonstash::Backend::File> m_file;
+
+    public:
+        Dragonstash::Result<Dragonstash::Backend::Stat> fstat() override {
+            return m_file->fstat();
+        }
+
+        Dragonstash::Result<ssize_t> pread(void *buf, size_t count, off_t offset) override {
+            if (!m_fs.m_stalled.exchange(true)) {
+                m_fs.m_stalling.set_value();
+            }
+            m_fs.m_released.wait();
+            return m_file->pread(buf, count, offset);
+        }
+
+        Dragonstash::Result<ssize_t> pwrite(const void *buf, size_t count, off_t offset) override {
+            return m_file->pwrite(buf, count, offset);
+        }
+
+        Dragonstash::Result<void> fsync() override {
+            return m_file->fsync();
+        }
+
+        Dragonstash::Result<void> close() override {
+            return m_file->close();
+        }
+    };
+
+    std::atomic<bool> m_stalled{false};
+    std::promise<void> m_stalling;
+    std::promise<void> m_release;
+    std::shared_future<void> m_released{m_release.get_future().share()};
+
+public:
+    Dragonstash::Result<std::unique_ptr<Dragonstash::Backend::File>> open(
+            std::string_view path, int accesstype, mode_t mode) override
+    {
+        auto open_result = InMemoryFilesystem::open(path, accesstype, mode);
+        if (!open_result) {
+            return Dragonstash::copy_error(open_result);
+        }
+        return Dragonstash::make_result(std::unique_ptr<Dragonstash::Backend::File>(
+                    std::make_unique<StallingFile>(*this, std::move(*open_result))));
+    }
+
+    /**
+     * @brief Wait until the first read has started.
+     */
+    void wait_stalling() {
+        m_stalling.get_future().wait();
+    }
+
+    void release() {
+        m_release.set_value();
+    }
+};
+
+SCENARIO("Writes while another file is filled from the backend") {
+    TemporaryDirectory cachedir;
+    Dragonstash::Cache cache(cachedir.path());
+    TestFuseBackend fuse;
+    StallingFilesystem backend;
+    using namespace Dragonstash::Backend::InMemory;
+    auto &slow = backend.emplace<File>("slow.bin");
+    slow.data() = make_file_data(Dragonstash::CACHE_PAGE_SIZE, 3);
+    slow.update_attr(Dragonstash::Backend::Stat{
+                         .mode = S_IRUSR | S_IWUSR,
+                         .size = Dragonstash::CACHE_PAGE_SIZE,
+                     });
+    backend.emplace<File>("fast.bin").update_attr(Dragonstash::Backend::Stat{
+                                                      .mode = S_IRUSR | S_IWUSR,
+                                                  });
+    Dragonstash::Filesystem fs(cache, backend,
+                               Dragonstash::WorkerPool::DEFAULT_CONCURRENCY,
+                               Dragonstash::Readahead::DEFAULT_CONCURRENCY,
+                               0);
+    fs.set_notifier(fuse.notifier());
+    fs.set_write_back(true, std::chrono::milliseconds(0));
+
+    auto open_file = [&fuse, &fs](std::string_view name) {
+        auto lookup_result = lookup(fuse, fs, Dragonstash::ROOT_INO, name);
+        require_result_ok(lookup_result);
+        auto req = fuse.new_request();
+        struct fuse_file_info fi{};
+        fi.flags = O_RDWR;
+        fs.open(req.wrap(), *lookup_result, &fi);
+        check_reply_type(req, TestFuseReplyType::OPEN);
+        return std::make_pair(*lookup_result, std::get<TestFuseReplyOpen>(req.reply_argv()));
+    };
+    auto [slow_ino, slow_fi] = open_file("slow.bin");
+    auto [fast_ino, fast_fi] = open_file("fast.bin");
+
+    WHEN("A partial write waits for the rest of its block") {
+        auto slow_req = fuse.new_request();
+        auto slow_write = std::async(std::launch::async, [&, slow_ino = slow_ino]() {
+            fs.write(slow_req.wrap(), slow_ino, "patch", 5, &slow_fi);
+        });
+        backend.wait_stalling();
+
+        auto fast_req = fuse.new_request();
+        auto fast_write = std::async(std::launch::async, [&, fast_ino = fast_ino]() {
+            fs.write(fast_req.wrap(), fast_ino, "hello", 0, &fast_fi);
+        });
+        const auto status = fast_write.wait_for(std::chrono::seconds(10));
+
+        backend.release();
+        slow_write.wait();
+        fast_write.wait();
+
+        THEN("A write to another file does not wait for the backend") {
+            CHECK(status == std::future_status::ready);
+        }
+
+        THEN("Both writes are acknowledged") {
+            check_reply_type(slow_req, TestFuseReplyType::WRITE);
+            check_reply_type(fast_req, TestFuseReplyType::WRITE);
+        }
+
+        THEN("The rest of the block is kept") {
+            auto expected = as_string(slow.data());
+            expected.replace(5, 5, "patch");
+            auto req = fuse.new_request();
+            fs.read(req.wrap(), slow_ino, Dragonstash::CACHE_PAGE_SIZE, 0, &slow_fi);
+            CHECK(reply_contents(req) == expected);
+        }
+    }
+}
+
+SCENARIO("Directories renamed on a backend which keeps them open") {
+    TemporaryDirectory cachedir;
+    TemporaryDirectory backenddir;
+    Dragonstash::Cache cache(cachedir.path());
+    TestFuseBackend fuse;
+    Dragonstash::Backend::LocalFilesystem backend(backenddir.path());
+    const auto write_backend_file = [](const std::filesystem::path &path,
+                                       std::string_view contents) {
+        std::ofstream out(path);
+        out << contents;
+    };
+    std::filesystem::create_directory(backenddir.path() / "a");
+    write_backend_file(backenddir.path() / "a" / "f", "old");
+
+    Dragonstash::Filesystem fs(cache, backend,
+                               Dragonstash::WorkerPool::DEFAULT_CONCURRENCY,
+                               Dragonstash::Readahead::DEFAULT_CONCURRENCY,
+                               0);
+    fs.set_notifier(fuse.notifier());
+    // handles from the table are checked on every use
+    Dragonstash::TimeoutPolicy::Rule rule;
+    rule.attr_timeout = 0;
+    fs.set_timeout_policy(Dragonstash::TimeoutPolicy(rule));
+
+    auto dir_result = lookup(fuse, fs, Dragonstash::ROOT_INO, "a");
+    require_result_ok(dir_result);
+    const ino_t dir_ino = *dir_result;
+    // this puts the handle of the directory into the table
+    require_result_ok(lookup(fuse, fs, dir_ino, "f"));
+
+    WHEN("The directory is replaced by another one") {
+        std::filesystem::rename(backenddir.path() / "a", backenddir.path() / "b");
+        std::filesystem::create_directory(backenddir.path() / "a");
+        write_backend_file(backenddir.path() / "a" / "f", "newer");
+
+        THEN("Lookups in it go to the new directory") {
+            auto req = fuse.new_request();
+            fs.lookup(req.wrap(), dir_ino, "f");
+            check_reply_type(req, TestFuseReplyType::ENTRY);
+            CHECK(std::get<TestFuseReplyEntry>(req.reply_argv()).attr.st_size == 5);
+        }
+    }
+
+    WHEN("The directory is renamed away") {
+        std::filesystem::rename(backenddir.path() / "a", backenddir.path() / "b");
+
+        THEN("Lookups in it do not find the entries of the renamed directory") {
+            check_result_error(lookup(fuse, fs, dir_ino, "f"), ENOENT);
+        }
+    }
+}
+
+static Dragonstash::Result<ino_t> lookup_control_file(TestFuseBackend &fuse,
+                                                      Dragonstash::Filesystem &fs,
+                                                      std::string_view name)
+{
+    auto dir_result = lookup(fuse, fs, Dragonstash::ROOT_INO,
+                             Dragonstash::Filesystem::CONTROL_DIR_NAME);
+    if (!dir_result) {
+        return Dragonstash::copy_error(dir_result);
+    }
+    return lookup(fuse, fs, *dir_result, name);
+}
+
+SCENARIO("Metrics file") {
+    TestEnvironment env;
+    Dragonstash::Filesystem &fs = env.fs();
+
+    GIVEN("A filesystem with the metrics file disabled") {
+        WHEN("Looking up the metrics file") {
+            auto ino_result = lookup_control_file(env.fuse(), fs,
+                                                    Dragonstash::Filesystem::METRICS_FILE_NAME);
+
+            THEN("It does not exist") {
+                check_result_error(ino_result, ENOENT);
+            }
+        }
+    }
+
+    GIVEN("A filesystem with the metrics file enabled and a few lookups") {
+        env.with_default_contents();
+        fs.set_metrics_file(true);
+        require_result_ok(lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md"));
+        require_result_ok(lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "README.md"));
+
+        auto ino_result = lookup_control_file(env.fuse(), fs,
+                                                Dragonstash::Filesystem::METRICS_FILE_NAME);
+        require_result_ok(ino_result);
+        const ino_t ino = *ino_result;
+
+        THEN("It has the reserved inode number") {
+            CHECK(ino == Dragonstash::Filesystem::METRICS_INO);
+        }
+
+        WHEN("Looking up the control directory") {
+            auto req = env.fuse().new_request();
+            fs.lookup(req.wrap(), Dragonstash::ROOT_INO,
+                      Dragonstash::Filesystem::CONTROL_DIR_NAME);
+            check_reply_type(req, TestFuseReplyType::ENTRY);
+            const auto entry = std::get<TestFuseReplyEntry>(req.reply_argv());
+
+            THEN("It is a directory with the reserved inode number") {
+                CHECK(entry.ino == Dragonstash::Filesystem::CONTROL_DIR_INO);
+                CHECK(S_ISDIR(entry.attr.st_mode));
+            }
+        }
+
+        WHEN("Listing the control directory") {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fs.opendir(req.wrap(), Dragonstash::Filesystem::CONTROL_DIR_INO, &fi);
+            check_reply_type(req, TestFuseReplyType::OPEN);
+            fi = std::get<TestFuseReplyOpen>(req.reply_argv());
+
+            auto first_req = env.fuse().new_request();
+            fs.readdir(first_req.wrap(), Dragonstash::Filesystem::CONTROL_DIR_INO, 4096, 0, &fi);
+            auto end_req = env.fuse().new_request();
+            fs.readdir(end_req.wrap(), Dragonstash::Filesystem::CONTROL_DIR_INO, 4096, 3, &fi);
+
+            THEN("It returns dot, dotdot and the metrics file and then ends") {
+                CHECK(!reply_contents(first_req).empty());
+                CHECK(reply_contents(end_req).empty());
+            }
+        }
+
+        WHEN("Looking up the trace file while tracing is disabled") {
+            THEN("It does not exist") {
+                check_result_error(lookup_control_file(env.fuse(), fs,
+                                                       Dragonstash::Filesystem::TRACE_FILE_NAME),
+                                   ENOENT);
+            }
+        }
+
+        WHEN("Reading the metrics file") {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = O_RDONLY;
+            fs.open(req.wrap(), ino, &fi);
+            check_reply_type(req, TestFuseReplyType::OPEN);
+            fi = std::get<TestFuseReplyOpen>(req.reply_argv());
+
+            auto read_req = env.fuse().new_request();
+            fs.read(read_req.wrap(), ino, 1 << 20, 0, &fi);
+            const std::string text = reply_contents(read_req);
+
+            auto release_req = env.fuse().new_request();
+            fs.release(release_req.wrap(), ino, &fi);
+
+            THEN("It bypasses the page cache") {
+                CHECK(fi.direct_io);
+            }
+
+            THEN("It contains request latencies") {
+                CHECK(text.find("# TYPE dragonstash_fuse_request_duration_seconds histogram\n") != std::string::npos);
+                CHECK(text.find("dragonstash_fuse_request_duration_seconds_count{op=\"lookup\"} ") != std::string::npos);
+            }
+
+            THEN("It contains the lookup outcomes") {
+                CHECK(text.find("dragonstash_lookups_total{result=\"miss\"} 1\n") != std::string::npos);
+                CHECK(text.find("dragonstash_lookups_total{result=\"revalidated\"} 1\n") != std::string::npos);
+            }
+
+            THEN("It contains the cache metrics") {
+                CHECK(text.find("dragonstash_cache_transaction_duration_seconds_count{mode=\"rw\"} ") != std::string::npos);
+            }
+        }
+
+        WHEN("Opening the metrics file for writing") {
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = O_RDWR;
+            fs.open(req.wrap(), ino, &fi);
+
+            THEN("EACCES is returned") {
+                check_reply_error(req, EACCES);
+            }
+        }
+    }
+
+    GIVEN("A backend with entries named like the control directory and file") {
+        using namespace Dragonstash::Backend::InMemory;
+        env.backend().emplace<Directory>(Dragonstash::Filesystem::CONTROL_DIR_NAME)
+                .emplace<File>("notes.txt");
+        env.backend().emplace<File>(Dragonstash::Filesystem::METRICS_FILE_NAME);
+
+        WHEN("The metrics file is enabled") {
+            fs.set_metrics_file(true);
+
+            THEN("The control directory hides the backend directory") {
+                auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO,
+                                         Dragonstash::Filesystem::CONTROL_DIR_NAME);
+                require_result_ok(dir_result);
+                CHECK(*dir_result == Dragonstash::Filesystem::CONTROL_DIR_INO);
+                check_result_error(lookup(env.fuse(), fs, *dir_result, "notes.txt"), ENOENT);
+            }
+
+            THEN("The backend file named like the metrics file is not shadowed") {
+                auto ino_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO,
+                                         Dragonstash::Filesystem::METRICS_FILE_NAME);
+                require_result_ok(ino_result);
+                CHECK(*ino_result < Dragonstash::Filesystem::CONTROL_DIR_INO);
+            }
+
+            AND_WHEN("The root directory is synced and the metrics file is disabled again") {
+                sync_dir(env.fuse(), fs, Dragonstash::ROOT_INO);
+                fs.set_metrics_file(false);
+
+                THEN("The backend directory is found again") {
+                    auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO,
+                                             Dragonstash::Filesystem::CONTROL_DIR_NAME);
+                    require_result_ok(dir_result);
+                    CHECK(*dir_result < Dragonstash::Filesystem::CONTROL_DIR_INO);
+                    require_result_ok(lookup(env.fuse(), fs, *dir_result, "notes.txt"));
+                }
+            }
+        }
+
+        WHEN("The metrics file is disabled") {
+            THEN("The backend directory is visible") {
+                auto dir_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO,
+                                         Dragonstash::Filesystem::CONTROL_DIR_NAME);
+                require_result_ok(dir_result);
+                CHECK(*dir_result < Dragonstash::Filesystem::CONTROL_DIR_INO);
+                require_result_ok(lookup(env.fuse(), fs, *dir_result, "notes.txt"));
+            }
+        }
+    }
+}
+
+#ifdef DRAGONSTASH_TRACING
+
+SCENARIO("Request tracing") {
+    TestEnvironment env;
+    env.with_default_contents();
+    Dragonstash::Filesystem &fs = env.fs();
+
+    GIVEN("A filesystem which traces every request") {
+        fs.set_tracing(1, Dragonstash::Trace::Clock::duration::zero());
+
+        WHEN("Looking up an entry which is not cached yet") {
+            auto books_result = lookup(env.fuse(), fs, Dragonstash::ROOT_INO, "books");
+            require_result_ok(books_result);
+            fs.tracer().clear();
+            require_result_ok(lookup(env.fuse(), fs, *books_result, "best.epub"));
+
+            THEN("The trace shows the phases of the lookup") {
+                const auto records = fs.tracer().records();
+                REQUIRE(records.size() == 1);
+                CHECK(std::string(records[0].op) == "lookup");
+
+                auto has_phase = [&records](Dragonstash::Trace::Phase phase) {
+                    const auto &events = records[0].events;
+                    return std::any_of(events.begin(), events.end(),
+                                       [phase](const auto &event) { return event.phase == phase; });
+                };
+                CHECK(has_phase(Dragonstash::Trace::Phase::PATH_WALK));
+                CHECK(has_phase(Dragonstash::Trace::Phase::BACKEND_LSTAT));
+                CHECK(has_phase(Dragonstash::Trace::Phase::EMPLACE));
+                CHECK(has_phase(Dragonstash::Trace::Phase::COMMIT));
+                for (const auto &event: records[0].events) {
+                    CHECK(event.start >= records[0].start);
+                    CHECK(event.start + event.duration <= records[0].start + records[0].duration);
+                }
+            }
+        }
+
+        WHEN("Reading the trace file") {
+            auto ino_result = lookup_control_file(env.fuse(), fs,
+                                                    Dragonstash::Filesystem::TRACE_FILE_NAME);
+            require_result_ok(ino_result);
+            CHECK(*ino_result == Dragonstash::Filesystem::TRACE_INO);
+
+            auto req = env.fuse().new_request();
+            struct fuse_file_info fi{};
+            fi.flags = O_RDONLY;
+            fs.open(req.wrap(), *ino_result, &fi);
+            check_reply_type(req, TestFuseReplyType::OPEN);
+            fi = std::get<TestFuseReplyOpen>(req.reply_argv());
+
+            auto read_req = env.fuse().new_request();
+            fs.read(read_req.wrap(), *ino_result, 1 << 20, 0, &fi);
+            const std::string text = reply_contents(read_req);
+
+            auto release_req = env.fuse().new_request();
+            fs.release(release_req.wrap(), *ino_result, &fi);
+
+            THEN("It contains the traced requests") {
+                CHECK(text.find("\"traceEvents\":[") != std::string::npos);
+                CHECK(text.find("\"name\":\"lookup\",\"cat\":\"request\"") != std::string::npos);
+            }
+        }
+    }
+
+    GIVEN("A filesystem which does not trace") {
+        WHEN("Looking up the trace file") {
+            auto ino_result = lookup_control_file(env.fuse(), fs,
+                                                    Dragonstash::Filesystem::TRACE_FILE_NAME);
+
+            THEN("It does not exist") {
+                check_result_error(ino_result, ENOENT);
+            }
+        }
+    }
+}
+
+#endif
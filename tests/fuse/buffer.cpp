@@ -0,0 +1,126 @@
+/**********************************************************************
+File name: buffer.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <sys/stat.h>
+
+#include "dragonstash/fuse/buffer.hpp"
+
+#include "../testutils/fuse_backend.hpp"
+
+SCENARIO("Directory reply buffers") {
+    TestFuseBackend fuse;
+    auto req_wrap = fuse.new_request();
+    Fuse::Request req(req_wrap);
+    struct stat stbuf{};
+    stbuf.st_mode = S_IFREG;
+
+    GIVEN("A buffer with a limit") {
+        const std::size_t entry_size = fuse_add_direntry(*req, nullptr, 0, "entry", nullptr, 0);
+        Fuse::DirBuffer buffer(entry_size * 2 + entry_size / 2);
+
+        WHEN("Adding entries until it is full") {
+            CHECK(buffer.add(req, "entry", stbuf, 1));
+            CHECK(buffer.add(req, "entry", stbuf, 2));
+            const bool third = buffer.add(req, "entry", stbuf, 3);
+
+            THEN("Entries beyond the limit are refused") {
+                CHECK(!third);
+                CHECK(buffer.length() == entry_size * 2);
+                CHECK(buffer.get().size() == entry_size * 2);
+            }
+        }
+
+        WHEN("Rewinding the buffer") {
+            CHECK(buffer.add(req, "entry", stbuf, 1));
+            CHECK(buffer.add(req, "entry", stbuf, 2));
+            buffer.rewind(entry_size);
+
+            THEN("Space is available again") {
+                CHECK(buffer.length() == entry_size);
+                CHECK(buffer.add(req, "entry", stbuf, 2));
+            }
+        }
+    }
+
+    GIVEN("A name which is not NUL-terminated") {
+        const std::string storage = "entryXYZ";
+        const std::string_view name(storage.data(), 5);
+        Fuse::DirBuffer buffer;
+        Fuse::DirBuffer reference;
+
+        WHEN("Adding it") {
+            CHECK(buffer.add(req, name, stbuf, 1));
+            CHECK(reference.add(req, "entry", stbuf, 1));
+
+            THEN("Only the viewed part is used") {
+                CHECK(buffer.get() == reference.get());
+            }
+        }
+    }
+
+    GIVEN("A buffer without a limit") {
+        Fuse::DirBufferPlus buffer;
+        struct fuse_entry_param e{};
+        e.attr = stbuf;
+
+        WHEN("Adding many entries") {
+            for (int i = 0; i < 1000; ++i) {
+                REQUIRE(buffer.add(req, "entry", e));
+            }
+
+            THEN("The buffer grows") {
+                const std::size_t entry_size = fuse_add_direntry_plus(*req, nullptr, 0, "entry", &e, 0);
+                CHECK(buffer.length() == entry_size * 1000);
+            }
+        }
+    }
+
+    GIVEN("A buffer which has been destroyed") {
+        const char *data = nullptr;
+        {
+            Fuse::DirBuffer buffer(4096);
+            CHECK(buffer.add(req, "entry", stbuf, 1));
+            data = buffer.get().data();
+        }
+
+        WHEN("Another buffer is created on the same thread") {
+            Fuse::DirBuffer buffer(4096);
+
+            THEN("It reuses the storage") {
+                CHECK(buffer.get().data() == data);
+                CHECK(buffer.length() == 0);
+            }
+
+            AND_WHEN("A second buffer is created while the first is alive") {
+                Fuse::DirBuffer other(4096);
+
+                THEN("It uses separate storage") {
+                    CHECK(other.get().data() != data);
+                }
+            }
+        }
+    }
+}
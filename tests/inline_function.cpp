@@ -0,0 +1,104 @@
+/**********************************************************************
+File name: inline_function.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <memory>
+
+#include "dragonstash/inline_function.hpp"
+
+using Function = Dragonstash::InlineFunction<int(int), 2 * sizeof(void*)>;
+
+SCENARIO("Inline functions") {
+    GIVEN("An empty function") {
+        Function f;
+
+        THEN("It is false") {
+            CHECK(!f);
+        }
+
+        THEN("It can be constructed from nullptr") {
+            Function g(nullptr);
+            CHECK(!g);
+        }
+    }
+
+    GIVEN("A function holding a capturing lambda") {
+        int offset = 10;
+        Function f([&offset](int x) { return x + offset; });
+
+        THEN("It is true and calls the lambda") {
+            CHECK(f);
+            CHECK(f(1) == 11);
+            offset = 20;
+            CHECK(f(1) == 21);
+        }
+
+        WHEN("It is moved") {
+            Function g(std::move(f));
+
+            THEN("The target holds the lambda and the source is empty") {
+                CHECK(g);
+                CHECK(g(2) == 12);
+                CHECK(!f);
+            }
+        }
+
+        WHEN("It is reset") {
+            f = nullptr;
+
+            THEN("It is empty") {
+                CHECK(!f);
+            }
+        }
+    }
+
+    GIVEN("A function holding a callable with state") {
+        auto token = std::make_shared<int>(5);
+        std::weak_ptr<int> weak = token;
+        {
+            Function f([token](int x) { return x * *token; });
+            token.reset();
+
+            THEN("The state lives inside the function") {
+                CHECK(f(2) == 10);
+                CHECK(!weak.expired());
+            }
+
+            AND_WHEN("It is move-assigned") {
+                Function g;
+                g = std::move(f);
+
+                THEN("The state is moved along") {
+                    CHECK(g(3) == 15);
+                    CHECK(!weak.expired());
+                }
+            }
+        }
+
+        THEN("The state is destroyed with the function") {
+            CHECK(weak.expired());
+        }
+    }
+}
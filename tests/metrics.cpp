@@ -0,0 +1,172 @@
+/**********************************************************************
+File name: metrics.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dragonstash/metrics.hpp"
+
+using Dragonstash::Metrics::Counter;
+using Dragonstash::Metrics::Histogram;
+using Dragonstash::Metrics::Registry;
+using Dragonstash::Metrics::TextWriter;
+
+SCENARIO("Metrics counters")
+{
+    GIVEN("A counter") {
+        Counter counter;
+
+        THEN("It starts at zero") {
+            CHECK(counter.value() == 0);
+        }
+
+        WHEN("Several threads increment it") {
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 8; ++i) {
+                threads.emplace_back([&counter]() {
+                    for (int j = 0; j < 1000; ++j) {
+                        counter.add();
+                    }
+                    counter.add(5);
+                });
+            }
+            for (auto &thread: threads) {
+                thread.join();
+            }
+
+            THEN("No increment is lost") {
+                CHECK(counter.value() == 8 * 1005);
+            }
+        }
+    }
+}
+
+SCENARIO("Latency histograms")
+{
+    GIVEN("The bucket layout") {
+        THEN("Small values have buckets of their own") {
+            for (std::uint64_t value = 0; value < Histogram::SUB_BUCKETS * 2; ++value) {
+                CHECK(Histogram::bucket_start(Histogram::bucket_of(value)) == value);
+            }
+        }
+
+        THEN("Larger values are bucketed with bounded relative error") {
+            for (std::uint64_t value: {std::uint64_t(100), std::uint64_t(12345),
+                                       std::uint64_t(1) << 30, (std::uint64_t(1) << 40) + 12345}) {
+                const std::size_t bucket = Histogram::bucket_of(value);
+                const std::uint64_t start = Histogram::bucket_start(bucket);
+                const std::uint64_t end = Histogram::bucket_start(bucket + 1);
+                CHECK(start <= value);
+                CHECK(value < end);
+                CHECK(double(end - start) <= double(start) / Histogram::SUB_BUCKETS);
+            }
+        }
+
+        THEN("Huge values end up in the last bucket") {
+            CHECK(Histogram::bucket_of(~std::uint64_t(0)) == Histogram::BUCKETS - 1);
+        }
+    }
+
+    GIVEN("A histogram with recorded values") {
+        Histogram histogram;
+        for (std::uint64_t i = 1; i <= 1000; ++i) {
+            histogram.record(i * 1000);
+        }
+
+        WHEN("Taking a snapshot") {
+            const Histogram::Snapshot snapshot = histogram.snapshot();
+
+            THEN("Count and sum are exact") {
+                CHECK(snapshot.count == 1000);
+                CHECK(snapshot.sum == 1000 * 1001 / 2 * 1000);
+            }
+
+            THEN("Quantiles are within the bucket resolution") {
+                const std::uint64_t median = snapshot.quantile(0.5);
+                CHECK(median >= 500000);
+                CHECK(median <= 500000 + 500000 / Histogram::SUB_BUCKETS);
+                const std::uint64_t max = snapshot.quantile(1.0);
+                CHECK(max >= 1000000);
+                CHECK(max <= 1000000 + 1000000 / Histogram::SUB_BUCKETS);
+            }
+
+            THEN("Counts below powers of two are exact") {
+                CHECK(snapshot.count_below(std::uint64_t(1) << 16) == 65);
+                CHECK(snapshot.count_below(std::uint64_t(1) << 20) == 1000);
+            }
+        }
+    }
+
+    GIVEN("An empty histogram") {
+        Histogram histogram;
+
+        THEN("The quantiles are zero") {
+            CHECK(histogram.snapshot().quantile(0.99) == 0);
+        }
+    }
+}
+
+SCENARIO("Prometheus text output")
+{
+    GIVEN("A registry with a counter and a histogram") {
+        Counter counter;
+        counter.add(42);
+        Histogram histogram;
+        histogram.record(std::uint64_t(1500));
+        histogram.record(std::uint64_t(3000000000));
+
+        Registry registry;
+        registry.add([&](TextWriter &out) {
+            out.family("test_events_total", TextWriter::Type::COUNTER, "Events.");
+            out.sample("kind=\"a\"", counter.value());
+            out.family("test_duration_seconds", TextWriter::Type::HISTOGRAM, "Durations.");
+            out.histogram("op=\"x\"", histogram);
+        });
+
+        WHEN("Rendering it") {
+            const std::string text = registry.render();
+
+            THEN("The families are announced") {
+                CHECK(text.find("# HELP test_events_total Events.\n") != std::string::npos);
+                CHECK(text.find("# TYPE test_events_total counter\n") != std::string::npos);
+                CHECK(text.find("# TYPE test_duration_seconds histogram\n") != std::string::npos);
+            }
+
+            THEN("Samples carry their labels") {
+                CHECK(text.find("test_events_total{kind=\"a\"} 42\n") != std::string::npos);
+            }
+
+            THEN("Histogram buckets are cumulative and in seconds") {
+                CHECK(text.find("test_duration_seconds_bucket{op=\"x\",le=\"1.024e-06\"} 0\n") != std::string::npos);
+                CHECK(text.find("test_duration_seconds_bucket{op=\"x\",le=\"2.048e-06\"} 1\n") != std::string::npos);
+                CHECK(text.find("test_duration_seconds_bucket{op=\"x\",le=\"+Inf\"} 2\n") != std::string::npos);
+                CHECK(text.find("test_duration_seconds_count{op=\"x\"} 2\n") != std::string::npos);
+                CHECK(text.find("test_duration_seconds_sum{op=\"x\"} 3.0000015\n") != std::string::npos);
+            }
+        }
+    }
+}
@@ -0,0 +1,168 @@
+/**********************************************************************
+File name: pin_policy.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include "dragonstash/pin_policy.hpp"
+
+#include "testutils/result.hpp"
+
+SCENARIO("Pin rules") {
+    GIVEN("A subtree rule") {
+        auto rule = Dragonstash::PinRule::make_subtree("datasets/");
+
+        THEN("The path is normalised") {
+            CHECK(rule.pattern == "/datasets");
+        }
+
+        THEN("Files below the subtree match") {
+            CHECK(rule.matches("/datasets", 10));
+            CHECK(rule.matches("/datasets/a.csv", 10));
+            CHECK(rule.matches("/datasets/2019/a.csv", 10));
+        }
+
+        THEN("Other files do not match") {
+            CHECK(!rule.matches("/datasets2/a.csv", 10));
+            CHECK(!rule.matches("/other/datasets/a.csv", 10));
+            CHECK(!rule.matches("", 10));
+        }
+
+        THEN("Directories in the subtree may contain matches") {
+            CHECK(rule.may_match_in("/datasets"));
+            CHECK(rule.may_match_in("/datasets/2019"));
+            CHECK(rule.may_match_in(""));
+            CHECK(!rule.may_match_in("/other"));
+        }
+    }
+
+    GIVEN("A subtree rule for the root") {
+        auto rule = Dragonstash::PinRule::make_subtree("/");
+
+        THEN("Everything matches") {
+            CHECK(rule.pattern.empty());
+            CHECK(rule.matches("/README.md", 10));
+            CHECK(rule.may_match_in(""));
+            CHECK(rule.may_match_in("/books"));
+        }
+    }
+
+    GIVEN("A pattern") {
+        auto rule = Dragonstash::PinRule::make_glob("data/*.csv");
+
+        THEN("A leading slash is added") {
+            CHECK(rule.pattern == "/data/*.csv");
+        }
+
+        THEN("Files directly in the directory match") {
+            CHECK(rule.matches("/data/a.csv", 10));
+            CHECK(!rule.matches("/data/a.txt", 10));
+        }
+
+        THEN("Wildcards do not match slashes or leading dots") {
+            CHECK(!rule.matches("/data/2019/a.csv", 10));
+            CHECK(!rule.matches("/data/.hidden.csv", 10));
+        }
+
+        THEN("Only the directory of the pattern may contain matches") {
+            CHECK(rule.may_match_in("/data"));
+            CHECK(!rule.may_match_in("/data/2019"));
+            CHECK(!rule.may_match_in(""));
+        }
+    }
+
+    GIVEN("A rule with a size limit") {
+        auto rule = Dragonstash::PinRule::make_subtree("/", 100);
+
+        THEN("Larger files do not match") {
+            CHECK(rule.matches("/a", 100));
+            CHECK(!rule.matches("/a", 101));
+        }
+    }
+
+    GIVEN("A serialised rule") {
+        auto rule = Dragonstash::PinRule::make_glob("/data/*.csv", 4096);
+        rule.retired = true;
+        const std::string record = rule.serialise();
+
+        WHEN("It is parsed") {
+            auto result = Dragonstash::PinRule::parse(7, record);
+            require_result_ok(result);
+
+            THEN("The rule is restored") {
+                CHECK(result->id == 7);
+                CHECK(result->kind == Dragonstash::PinRule::Kind::GLOB);
+                CHECK(result->pattern == "/data/*.csv");
+                CHECK(result->max_size == 4096);
+                CHECK(result->retired);
+            }
+        }
+
+        WHEN("A truncated record is parsed") {
+            THEN("EINVAL is returned") {
+                check_result_error(Dragonstash::PinRule::parse(7, std::string_view(record).substr(0, 8)), EINVAL);
+            }
+        }
+
+        WHEN("A record with an unknown kind is parsed") {
+            std::string broken = record;
+            broken[0] = 42;
+
+            THEN("EINVAL is returned") {
+                check_result_error(Dragonstash::PinRule::parse(7, broken), EINVAL);
+            }
+        }
+    }
+}
+
+SCENARIO("Pin policy") {
+    GIVEN("An empty policy") {
+        Dragonstash::PinPolicy policy;
+
+        THEN("Nothing matches") {
+            CHECK(policy.empty());
+            CHECK(!policy.matches("/a", 1));
+            CHECK(!policy.may_match_in(""));
+        }
+    }
+
+    GIVEN("A policy with several rules") {
+        Dragonstash::PinPolicy policy({
+            Dragonstash::PinRule::make_subtree("/books"),
+            Dragonstash::PinRule::make_glob("/*.md", 10),
+        });
+
+        THEN("Files matching any rule match") {
+            CHECK(policy.matches("/books/a.epub", 1000));
+            CHECK(policy.matches("/README.md", 10));
+            CHECK(!policy.matches("/README.md", 11));
+            CHECK(!policy.matches("/notes.txt", 1));
+        }
+
+        THEN("Directories are checked against all rules") {
+            CHECK(policy.may_match_in(""));
+            CHECK(policy.may_match_in("/books"));
+            CHECK(!policy.may_match_in("/music"));
+        }
+    }
+}
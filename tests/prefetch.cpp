@@ -0,0 +1,64 @@
+/**********************************************************************
+File name: prefetch.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include "dragonstash/prefetch.hpp"
+
+#include "testutils/result.hpp"
+
+SCENARIO("Prefetch options") {
+    WHEN("Parsing an empty specification") {
+        auto result = Dragonstash::PrefetchOptions::parse("");
+        require_result_ok(result);
+
+        THEN("The defaults are used") {
+            CHECK(result->depth == Dragonstash::PrefetchOptions::UNLIMITED_DEPTH);
+            CHECK(!result->content);
+            CHECK(result->concurrency == 0);
+        }
+    }
+
+    WHEN("Parsing a full specification") {
+        auto result = Dragonstash::PrefetchOptions::parse("depth=3,content,jobs=8");
+        require_result_ok(result);
+
+        THEN("All options are set") {
+            CHECK(result->depth == 3);
+            CHECK(result->content);
+            CHECK(result->concurrency == 8);
+        }
+    }
+
+    WHEN("Parsing malformed specifications") {
+        THEN("EINVAL is returned") {
+            check_result_error(Dragonstash::PrefetchOptions::parse("depth"), EINVAL);
+            check_result_error(Dragonstash::PrefetchOptions::parse("depth=-1"), EINVAL);
+            check_result_error(Dragonstash::PrefetchOptions::parse("depth=2x"), EINVAL);
+            check_result_error(Dragonstash::PrefetchOptions::parse("content=1"), EINVAL);
+            check_result_error(Dragonstash::PrefetchOptions::parse("depth=1,,content"), EINVAL);
+            check_result_error(Dragonstash::PrefetchOptions::parse("colour=blue"), EINVAL);
+        }
+    }
+}
@@ -0,0 +1,160 @@
+/**********************************************************************
+File name: readahead.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include "dragonstash/readahead.hpp"
+
+using namespace std::chrono_literals;
+
+static Dragonstash::Readahead::Config test_config()
+{
+    Dragonstash::Readahead::Config config;
+    config.min_window = 1000;
+    config.max_window = 16000;
+    config.lead_time = 1000ms;
+    config.sequential_threshold = 2;
+    return config;
+}
+
+SCENARIO("Readahead window") {
+    GIVEN("A tracker for a large file") {
+        Dragonstash::Readahead readahead(test_config(), 1000000);
+
+        WHEN("Reading once") {
+            auto prefetch = readahead.access(0, 100);
+
+            THEN("Nothing is prefetched") {
+                CHECK(!prefetch);
+            }
+        }
+
+        WHEN("Reading sequentially") {
+            (void)readahead.access(0, 100);
+            auto prefetch = readahead.access(100, 100);
+
+            THEN("The window after the read is prefetched") {
+                REQUIRE(prefetch);
+                CHECK(prefetch->offset == 200);
+                CHECK(prefetch->size == 2000);
+            }
+
+            AND_WHEN("Reading on while the prefetch is in flight") {
+                auto second = readahead.access(200, 100);
+
+                THEN("Nothing else is prefetched") {
+                    CHECK(!second);
+                }
+            }
+
+            AND_WHEN("The prefetch completes and the reader approaches its end") {
+                readahead.completed(*prefetch, prefetch->size, 0s);
+                (void)readahead.access(200, 100);
+                auto second = readahead.access(300, 1500);
+
+                THEN("The doubled window is prefetched behind the previous one") {
+                    REQUIRE(second);
+                    CHECK(second->offset == 2200);
+                    CHECK(second->offset + second->size == 1800 + 4000);
+                    CHECK(readahead.window() == 4000);
+                }
+            }
+
+            AND_WHEN("A random read follows") {
+                readahead.completed(*prefetch, prefetch->size, 0s);
+                auto second = readahead.access(500000, 100);
+
+                THEN("Readahead starts over") {
+                    CHECK(!second);
+                    CHECK(readahead.window() == 1000);
+                }
+            }
+        }
+
+        WHEN("The backend is slow") {
+            (void)readahead.access(0, 100);
+            auto prefetch = readahead.access(100, 100);
+            REQUIRE(prefetch);
+            // 2000 bytes in a second; the lead time of one second only
+            // needs a window of 2000 bytes
+            readahead.completed(*prefetch, prefetch->size, 1s);
+            CHECK(readahead.throughput() == Approx(2000));
+
+            std::uint64_t pos = 200;
+            for (int i = 0; i < 20; ++i) {
+                if (auto next = readahead.access(pos, 100)) {
+                    readahead.completed(*next, next->size, std::chrono::milliseconds(next->size / 2));
+                }
+                pos += 100;
+            }
+
+            THEN("The window does not grow beyond what the backend delivers within the lead time") {
+                CHECK(readahead.window() == 2000);
+            }
+        }
+
+        WHEN("A prefetch comes up short") {
+            (void)readahead.access(0, 100);
+            auto prefetch = readahead.access(100, 100);
+            REQUIRE(prefetch);
+            readahead.completed(*prefetch, 0, 0s);
+
+            THEN("Readahead is suspended until the stream is detected again") {
+                CHECK(!readahead.access(200, 100));
+                auto next = readahead.access(300, 100);
+                REQUIRE(next);
+                CHECK(next->offset == 400);
+            }
+        }
+    }
+
+    GIVEN("A tracker for a small file") {
+        Dragonstash::Readahead readahead(test_config(), 500);
+
+        WHEN("Reading sequentially") {
+            (void)readahead.access(0, 100);
+            auto prefetch = readahead.access(100, 100);
+
+            THEN("The prefetch ends at the end of the file") {
+                REQUIRE(prefetch);
+                CHECK(prefetch->offset + prefetch->size == 500);
+            }
+        }
+    }
+
+    GIVEN("A tracker with readahead disabled") {
+        auto config = test_config();
+        config.max_window = 0;
+        Dragonstash::Readahead readahead(config, 1000000);
+
+        WHEN("Reading sequentially") {
+            (void)readahead.access(0, 100);
+            auto prefetch = readahead.access(100, 100);
+
+            THEN("Nothing is prefetched") {
+                CHECK(!prefetch);
+            }
+        }
+    }
+}
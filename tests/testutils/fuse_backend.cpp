@@ -123,6 +123,27 @@ static int dummy_reply_data(fuse_req_t req, struct fuse_bufvec *bv,
     return 0;
 }
 
+static TestFuseBackend &get_impl(fuse_session *session)
+{
+    return *reinterpret_cast<TestFuseBackend*>(session);
+}
+
+static int dummy_notify_inval_inode(fuse_session *session, fuse_ino_t ino,
+                                    off_t off, off_t len)
+{
+    get_impl(session).record_notification(TestFuseNotification{
+        TestFuseNotifyType::INVAL_INODE, ino, std::string(), off, len});
+    return 0;
+}
+
+static int dummy_notify_inval_entry(fuse_session *session, fuse_ino_t parent,
+                                    const char *name, size_t namelen)
+{
+    get_impl(session).record_notification(TestFuseNotification{
+        TestFuseNotifyType::INVAL_ENTRY, parent, std::string(name, namelen), 0, 0});
+    return 0;
+}
+
 
 TestFuseRequest::TestFuseRequest(uint64_t id):
     m_id(id)
@@ -133,6 +154,7 @@ TestFuseRequest::TestFuseRequest(uint64_t id):
 
 TestFuseBackend::TestFuseBackend():
     m_backup(Fuse::backend),
+    m_notify_backup(Fuse::notify_backend),
     m_id_counter(1)
 {
     Fuse::backend.req_userdata = &dummy_req_userdata;
@@ -151,16 +173,31 @@ TestFuseBackend::TestFuseBackend():
     Fuse::backend.reply_write = &dummy_reply_write;
     Fuse::backend.reply_buf = &dummy_reply_buf;
     Fuse::backend.reply_data = &dummy_reply_data;
+
+    Fuse::notify_backend.inval_inode = &dummy_notify_inval_inode;
+    Fuse::notify_backend.inval_entry = &dummy_notify_inval_entry;
 }
 
 TestFuseBackend::~TestFuseBackend()
 {
     Fuse::backend = m_backup;
+    Fuse::notify_backend = m_notify_backup;
 }
 
 TestFuseRequest TestFuseBackend::new_request()
 {
-    return TestFuseRequest(m_id_counter++);
+    return TestFuseRequest(m_id_counter.fetch_add(1, std::memory_order_relaxed));
+}
+
+Fuse::Notifier TestFuseBackend::notifier()
+{
+    return Fuse::Notifier(reinterpret_cast<fuse_session*>(this));
+}
+
+void TestFuseBackend::record_notification(TestFuseNotification &&notification)
+{
+    std::lock_guard<std::mutex> guard(m_notifications_mutex);
+    m_notifications.emplace_back(std::move(notification));
 }
 
 
@@ -309,3 +346,31 @@ TEST_CASE("Reply interception", "[selftest]")
         CHECK(std::get<TestFuseReplyBuf>(req_wrap.reply_argv()) == copy);
     }
 }
+
+TEST_CASE("Notification interception", "[selftest]")
+{
+    TestFuseBackend fake_backend;
+    Fuse::Notifier notifier = fake_backend.notifier();
+    REQUIRE(notifier);
+
+    CHECK(notifier.inval_inode(2, -1, 0) == 0);
+    CHECK(notifier.inval_entry(1, "foo") == 0);
+
+    const auto &notifications = fake_backend.notifications();
+    REQUIRE(notifications.size() == 2);
+    CHECK(notifications[0].type == TestFuseNotifyType::INVAL_INODE);
+    CHECK(notifications[0].ino == 2);
+    CHECK(notifications[0].off == -1);
+    CHECK(notifications[0].len == 0);
+    CHECK(notifications[1].type == TestFuseNotifyType::INVAL_ENTRY);
+    CHECK(notifications[1].ino == 1);
+    CHECK(notifications[1].name == "foo");
+
+    SECTION("Detached notifiers drop notifications") {
+        fake_backend.clear_notifications();
+        Fuse::Notifier detached;
+        CHECK(!detached);
+        CHECK(detached.inval_entry(1, "foo") == 0);
+        CHECK(fake_backend.notifications().empty());
+    }
+}
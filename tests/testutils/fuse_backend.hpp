@@ -25,11 +25,15 @@ authors named in the AUTHORS file.
 #ifndef DRAGONSTASH_TESTUTILS_FUSE_BACKEND_H
 #define DRAGONSTASH_TESTUTILS_FUSE_BACKEND_H
 
+#include <atomic>
 #include <cstdint>
+#include <mutex>
 #include <optional>
 #include <variant>
 #include <tuple>
+#include <vector>
 
+#include "dragonstash/fuse/notify.hpp"
 #include "dragonstash/fuse/request.hpp"
 
 
@@ -108,6 +112,32 @@ public:
 };
 
 
+enum class TestFuseNotifyType {
+    INVAL_INODE,
+    INVAL_ENTRY,
+};
+
+
+/**
+ * @brief A notification sent through the notifier of a TestFuseBackend.
+ *
+ * For INVAL_ENTRY, ino is the parent; off and len are only used by
+ * INVAL_INODE.
+ */
+struct TestFuseNotification {
+    TestFuseNotifyType type;
+    fuse_ino_t ino;
+    std::string name;
+    off_t off;
+    off_t len;
+};
+
+
+/**
+ * @brief Intercepts replies and notifications while it exists.
+ *
+ * Requests can be created and replied to from several threads at once.
+ */
 class TestFuseBackend {
 public:
     TestFuseBackend();
@@ -119,11 +149,30 @@ public:
 
 private:
     Fuse::RequestBackend m_backup;
-    std::uint64_t m_id_counter;
+    Fuse::NotifyBackend m_notify_backup;
+    std::atomic<std::uint64_t> m_id_counter;
+    std::mutex m_notifications_mutex;
+    std::vector<TestFuseNotification> m_notifications;
 
 public:
     TestFuseRequest new_request();
 
+    /**
+     * @brief A notifier which records the notifications sent through it.
+     */
+    [[nodiscard]] Fuse::Notifier notifier();
+
+    void record_notification(TestFuseNotification &&notification);
+
+    [[nodiscard]] inline const std::vector<TestFuseNotification> &notifications() const {
+        return m_notifications;
+    }
+
+    inline void clear_notifications() {
+        std::lock_guard<std::mutex> guard(m_notifications_mutex);
+        m_notifications.clear();
+    }
+
 };
 
 #endif
@@ -0,0 +1,266 @@
+/**********************************************************************
+File name: load.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "load.hpp"
+
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+
+namespace {
+
+/**
+ * @brief Names and offsets in a readdirplus reply.
+ *
+ * Each entry is a struct fuse_entry_out followed by a struct fuse_dirent
+ * (ino, off, namelen, type, name), padded to 8 bytes.
+ */
+off_t parse_direntplus(std::string_view reply, std::vector<LoadClient::Entry> &entries)
+{
+    constexpr std::size_t entry_out_size = 128;
+    constexpr std::size_t dirent_size = 24;
+    off_t last = -1;
+    std::size_t pos = 0;
+    while (pos + entry_out_size + dirent_size <= reply.size()) {
+        const char *entry = reply.data() + pos;
+        const char *dirent = entry + entry_out_size;
+        std::uint64_t nodeid, off;
+        std::uint32_t namelen, type;
+        std::memcpy(&nodeid, entry, sizeof(nodeid));
+        std::memcpy(&off, dirent + 8, sizeof(off));
+        std::memcpy(&namelen, dirent + 16, sizeof(namelen));
+        std::memcpy(&type, dirent + 20, sizeof(type));
+        std::string name(dirent + dirent_size, namelen);
+        if (name != "." && name != "..") {
+            entries.push_back(LoadClient::Entry{std::move(name), fuse_ino_t(nodeid),
+                                                mode_t(type << 12)});
+        }
+        last = off_t(off);
+        pos += (entry_out_size + dirent_size + namelen + 7) & ~std::size_t(7);
+    }
+    return last;
+}
+
+}
+
+LoadClient::LoadClient(Dragonstash::Filesystem &fs, TestFuseBackend &fuse,
+                       Dragonstash::Metrics::Histogram &latency):
+    m_fs(fs),
+    m_fuse(fuse),
+    m_latency(latency),
+    m_errors(0)
+{
+
+}
+
+bool LoadClient::check(const TestFuseRequest &req, TestFuseReplyType expected)
+{
+    if (!req.has_reply() || req.reply_type() != expected) {
+        ++m_errors;
+        return false;
+    }
+    return true;
+}
+
+Dragonstash::Result<fuse_ino_t> LoadClient::lookup(fuse_ino_t parent, std::string_view name)
+{
+    auto req = m_fuse.new_request();
+    const auto started = Dragonstash::Metrics::Clock::now();
+    m_fs.lookup(req.wrap(), parent, name);
+    m_latency.record_since(started);
+    if (!check(req, TestFuseReplyType::ENTRY)) {
+        return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+    }
+    const fuse_ino_t ino = std::get<TestFuseReplyEntry>(req.reply_argv()).ino;
+    if (ino == 0) {
+        ++m_errors;
+        return Dragonstash::make_result(Dragonstash::FAILED, ENOENT);
+    }
+    return ino;
+}
+
+Dragonstash::Result<struct stat> LoadClient::getattr(fuse_ino_t ino)
+{
+    auto req = m_fuse.new_request();
+    const auto started = Dragonstash::Metrics::Clock::now();
+    m_fs.getattr(req.wrap(), ino, nullptr);
+    m_latency.record_since(started);
+    if (!check(req, TestFuseReplyType::ATTR)) {
+        return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+    }
+    return std::get<0>(std::get<TestFuseReplyAttr>(req.reply_argv()));
+}
+
+Dragonstash::Result<fuse_file_info> LoadClient::opendir(fuse_ino_t ino)
+{
+    auto req = m_fuse.new_request();
+    struct fuse_file_info fi{};
+    const auto started = Dragonstash::Metrics::Clock::now();
+    m_fs.opendir(req.wrap(), ino, &fi);
+    m_latency.record_since(started);
+    if (!check(req, TestFuseReplyType::OPEN)) {
+        return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+    }
+    return std::get<TestFuseReplyOpen>(req.reply_argv());
+}
+
+Dragonstash::Result<std::vector<LoadClient::Entry>> LoadClient::readdirplus(
+        fuse_ino_t ino, fuse_file_info &fi)
+{
+    // the size the kernel asks for
+    constexpr std::size_t reply_size = 4096;
+    std::vector<Entry> entries;
+    off_t off = 0;
+    while (true) {
+        auto req = m_fuse.new_request();
+        const auto started = Dragonstash::Metrics::Clock::now();
+        m_fs.readdirplus(req.wrap(), ino, reply_size, off, &fi);
+        m_latency.record_since(started);
+        if (!check(req, TestFuseReplyType::BUF)) {
+            return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+        }
+        const off_t last = parse_direntplus(std::get<TestFuseReplyBuf>(req.reply_argv()), entries);
+        if (last < 0) {
+            return entries;
+        }
+        off = last;
+    }
+}
+
+void LoadClient::releasedir(fuse_ino_t ino, fuse_file_info &fi)
+{
+    auto req = m_fuse.new_request();
+    const auto started = Dragonstash::Metrics::Clock::now();
+    m_fs.releasedir(req.wrap(), ino, &fi);
+    m_latency.record_since(started);
+    check(req, TestFuseReplyType::ERROR);
+}
+
+Dragonstash::Result<fuse_file_info> LoadClient::open(fuse_ino_t ino)
+{
+    auto req = m_fuse.new_request();
+    struct fuse_file_info fi{};
+    fi.flags = O_RDONLY;
+    const auto started = Dragonstash::Metrics::Clock::now();
+    m_fs.open(req.wrap(), ino, &fi);
+    m_latency.record_since(started);
+    if (!check(req, TestFuseReplyType::OPEN)) {
+        return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+    }
+    return std::get<TestFuseReplyOpen>(req.reply_argv());
+}
+
+Dragonstash::Result<std::size_t> LoadClient::read(fuse_ino_t ino, fuse_file_info &fi,
+                                                  std::size_t size, off_t off)
+{
+    auto req = m_fuse.new_request();
+    const auto started = Dragonstash::Metrics::Clock::now();
+    m_fs.read(req.wrap(), ino, size, off, &fi);
+    m_latency.record_since(started);
+    if (req.has_reply() && req.reply_type() == TestFuseReplyType::DATA) {
+        // spliced from the cache; the kernel would copy it from the fd
+        return std::get<0>(std::get<TestFuseReplyData>(req.reply_argv())).buf[0].size;
+    }
+    if (!check(req, TestFuseReplyType::BUF)) {
+        return Dragonstash::make_result(Dragonstash::FAILED, EIO);
+    }
+    return std::get<TestFuseReplyBuf>(req.reply_argv()).size();
+}
+
+void LoadClient::release(fuse_ino_t ino, fuse_file_info &fi)
+{
+    auto req = m_fuse.new_request();
+    const auto started = Dragonstash::Metrics::Clock::now();
+    m_fs.release(req.wrap(), ino, &fi);
+    m_latency.record_since(started);
+    check(req, TestFuseReplyType::ERROR);
+}
+
+void LoadClient::forget(const std::vector<fuse_ino_t> &inos)
+{
+    if (inos.empty()) {
+        return;
+    }
+    std::vector<fuse_forget_data> forgets;
+    forgets.reserve(inos.size());
+    for (fuse_ino_t ino: inos) {
+        forgets.push_back(fuse_forget_data{ino, 1});
+    }
+    auto req = m_fuse.new_request();
+    m_fs.forget_multi(req.wrap(), forgets.size(), forgets.data());
+}
+
+LoadResult run_load(Dragonstash::Filesystem &fs, TestFuseBackend &fuse,
+                    std::size_t threads,
+                    std::chrono::duration<double> duration,
+                    const LoadWorker &worker)
+{
+    Dragonstash::Metrics::Histogram latency;
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> errors{0};
+
+    std::mutex start_mutex;
+    std::condition_variable start_cv;
+    std::size_t ready = 0;
+    bool started = false;
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+        pool.emplace_back([&, i]() {
+            LoadClient client(fs, fuse, latency);
+            {
+                std::unique_lock<std::mutex> guard(start_mutex);
+                ++ready;
+                start_cv.notify_all();
+                start_cv.wait(guard, [&started]() { return started; });
+            }
+            worker(client, i, stop);
+            errors.fetch_add(client.errors(), std::memory_order_relaxed);
+        });
+    }
+
+    Dragonstash::Metrics::Clock::time_point start;
+    {
+        std::unique_lock<std::mutex> guard(start_mutex);
+        start_cv.wait(guard, [&ready, threads]() { return ready == threads; });
+        started = true;
+        start = Dragonstash::Metrics::Clock::now();
+    }
+    start_cv.notify_all();
+
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto &thread: pool) {
+        thread.join();
+    }
+    const auto elapsed = Dragonstash::Metrics::Clock::now() - start;
+
+    LoadResult result{threads, 0, errors.load(), elapsed, latency.snapshot()};
+    result.requests = result.latency.count;
+    return result;
+}
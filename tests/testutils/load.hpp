@@ -0,0 +1,131 @@
+/**********************************************************************
+File name: load.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_TESTUTILS_LOAD_H
+#define DRAGONSTASH_TESTUTILS_LOAD_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dragonstash/error.hpp"
+#include "dragonstash/fs.hpp"
+#include "dragonstash/metrics.hpp"
+
+#include "fuse_backend.hpp"
+
+/**
+ * @brief Issues requests to a file system like the kernel would, and
+ * records the latency of each.
+ *
+ * Every reply other than the expected one counts as an error.
+ */
+class LoadClient {
+public:
+    struct Entry {
+        std::string name;
+        fuse_ino_t ino;
+        mode_t mode;
+    };
+
+    LoadClient(Dragonstash::Filesystem &fs, TestFuseBackend &fuse,
+               Dragonstash::Metrics::Histogram &latency);
+
+private:
+    Dragonstash::Filesystem &m_fs;
+    TestFuseBackend &m_fuse;
+    Dragonstash::Metrics::Histogram &m_latency;
+    std::uint64_t m_errors;
+
+    /**
+     * @brief Check the reply type of a request, counting an error if it is
+     * not the expected one.
+     */
+    bool check(const TestFuseRequest &req, TestFuseReplyType expected);
+
+public:
+    [[nodiscard]] Dragonstash::Result<fuse_ino_t> lookup(fuse_ino_t parent, std::string_view name);
+    [[nodiscard]] Dragonstash::Result<struct stat> getattr(fuse_ino_t ino);
+    [[nodiscard]] Dragonstash::Result<fuse_file_info> opendir(fuse_ino_t ino);
+
+    /**
+     * @brief List an opened directory to the end with readdirplus.
+     *
+     * The entries are looked up by the listing; see forget().
+     */
+    [[nodiscard]] Dragonstash::Result<std::vector<Entry>> readdirplus(fuse_ino_t ino, fuse_file_info &fi);
+    void releasedir(fuse_ino_t ino, fuse_file_info &fi);
+
+    [[nodiscard]] Dragonstash::Result<fuse_file_info> open(fuse_ino_t ino);
+    [[nodiscard]] Dragonstash::Result<std::size_t> read(fuse_ino_t ino, fuse_file_info &fi,
+                                                        std::size_t size, off_t off);
+    void release(fuse_ino_t ino, fuse_file_info &fi);
+
+    /**
+     * @brief Drop one lookup of each of @a inos, like the kernel does when
+     * it evicts entries; not recorded.
+     */
+    void forget(const std::vector<fuse_ino_t> &inos);
+
+    [[nodiscard]] inline std::uint64_t errors() const {
+        return m_errors;
+    }
+};
+
+struct LoadResult {
+    std::size_t threads;
+    std::uint64_t requests;
+    std::uint64_t errors;
+    std::chrono::duration<double> elapsed;
+    Dragonstash::Metrics::Histogram::Snapshot latency;
+
+    [[nodiscard]] inline double requests_per_second() const {
+        return elapsed.count() > 0 ? double(requests) / elapsed.count() : 0.;
+    }
+};
+
+/**
+ * @brief Body of a load thread; runs until @a stop is set.
+ *
+ * @param thread Number of the thread, starting at zero.
+ */
+using LoadWorker = std::function<void(LoadClient &client, std::size_t thread,
+                                      const std::atomic<bool> &stop)>;
+
+/**
+ * @brief Run @a worker from @a threads threads for @a duration.
+ *
+ * The threads start at the same time; the elapsed time ends when the last
+ * thread has returned.
+ */
+[[nodiscard]] LoadResult run_load(Dragonstash::Filesystem &fs, TestFuseBackend &fuse,
+                                  std::size_t threads,
+                                  std::chrono::duration<double> duration,
+                                  const LoadWorker &worker);
+
+#endif
@@ -0,0 +1,450 @@
+/**********************************************************************
+File name: sftp_server.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include "sftp_server.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Dragonstash::Backend::Sftp::Decoder;
+using Dragonstash::Backend::Sftp::Encoder;
+using Dragonstash::Backend::Sftp::PacketType;
+using Dragonstash::Backend::Sftp::Status;
+
+/**
+ * @brief Time without requests after which held READ replies are sent.
+ */
+static constexpr int READ_BATCH_TIMEOUT_MS = 200;
+
+/**
+ * @brief Number of entries per READDIR reply.
+ */
+static constexpr std::size_t READDIR_BATCH = 8;
+
+static bool read_all(int fd, char *buf, std::size_t size)
+{
+    while (size > 0) {
+        const ssize_t received = ::read(fd, buf, size);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        buf += received;
+        size -= static_cast<std::size_t>(received);
+    }
+    return true;
+}
+
+static bool write_all(int fd, const std::string &data)
+{
+    std::size_t offset = 0;
+    while (offset < data.size()) {
+        const ssize_t sent = ::send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        offset += static_cast<std::size_t>(sent);
+    }
+    return true;
+}
+
+static bool read_packet(int fd, std::string &packet)
+{
+    char length_buf[4];
+    std::uint32_t length = 0;
+    if (!read_all(fd, length_buf, sizeof(length_buf)) ||
+            !Decoder(std::string_view(length_buf, sizeof(length_buf))).u32(length)) {
+        return false;
+    }
+    packet.resize(length);
+    return read_all(fd, packet.data(), packet.size());
+}
+
+static std::string make_packet(PacketType type, const std::uint32_t *id, const std::string &body)
+{
+    Encoder packet;
+    packet.u32(static_cast<std::uint32_t>(1 + (id ? 4 : 0) + body.size()));
+    packet.u8(static_cast<std::uint8_t>(type));
+    if (id) {
+        packet.u32(*id);
+    }
+    std::string result = packet.take();
+    result.append(body);
+    return result;
+}
+
+static std::string status_packet(std::uint32_t id, Status status)
+{
+    Encoder body;
+    body.u32(static_cast<std::uint32_t>(status)).string("").string("");
+    return make_packet(PacketType::STATUS, &id, body.data());
+}
+
+static std::string error_packet(std::uint32_t id, int err)
+{
+    return status_packet(id, Dragonstash::Backend::Sftp::errno_to_status(err));
+}
+
+static std::string backend_path(std::string_view path)
+{
+    if (path == ".") {
+        return "/";
+    }
+    if (!path.empty() && path[0] == '/') {
+        return std::string(path);
+    }
+    return "/" + std::string(path);
+}
+
+TestSftpServer::TestSftpServer(Dragonstash::Backend::Filesystem &backend):
+    m_backend(backend),
+    m_reachable(true),
+    m_read_batch(1),
+    m_max_pending_reads(0)
+{
+
+}
+
+TestSftpServer::~TestSftpServer()
+{
+    disconnect_all();
+    for (auto &connection: m_connections) {
+        connection->thread.join();
+        ::close(connection->fd);
+    }
+}
+
+void TestSftpServer::serve(int fd)
+{
+    std::string packet;
+    if (!read_packet(fd, packet)) {
+        return;
+    }
+    {
+        Encoder body;
+        body.u32(Dragonstash::Backend::Sftp::PROTOCOL_VERSION);
+        if (!write_all(fd, make_packet(PacketType::VERSION, nullptr, body.data()))) {
+            return;
+        }
+    }
+
+    std::unordered_map<std::string, std::unique_ptr<Dragonstash::Backend::File>> files;
+    std::unordered_map<std::string, std::unique_ptr<Dragonstash::Backend::Dir>> dirs;
+    std::uint64_t next_handle = 0;
+    std::vector<std::string> held_reads;
+
+    auto flush_reads = [fd, &held_reads]() {
+        for (const std::string &reply: held_reads) {
+            (void)write_all(fd, reply);
+        }
+        held_reads.clear();
+    };
+
+    while (true) {
+        if (!held_reads.empty()) {
+            struct pollfd pfd{fd, POLLIN, 0};
+            if (::poll(&pfd, 1, READ_BATCH_TIMEOUT_MS) == 0) {
+                flush_reads();
+                continue;
+            }
+        }
+        if (!read_packet(fd, packet)) {
+            return;
+        }
+
+        Decoder request(packet);
+        std::uint8_t type_byte = 0;
+        std::uint32_t id = 0;
+        if (!request.u8(type_byte) || !request.u32(id)) {
+            return;
+        }
+        const auto type = static_cast<PacketType>(type_byte);
+
+        std::size_t read_batch = 1;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_requests[type] += 1;
+            read_batch = m_read_batch;
+        }
+        if (type != PacketType::READ) {
+            flush_reads();
+        }
+
+        std::string reply;
+        std::string_view path, handle;
+        switch (type) {
+        case PacketType::OPEN: {
+            std::uint32_t pflags = 0;
+            if (!request.string(path) || !request.u32(pflags)) {
+                return;
+            }
+            int accesstype = O_RDONLY;
+            if ((pflags & Dragonstash::Backend::Sftp::OPEN_WRITE) != 0) {
+                accesstype = (pflags & Dragonstash::Backend::Sftp::OPEN_READ) ? O_RDWR : O_WRONLY;
+            }
+            auto file = m_backend.open(backend_path(path), accesstype, 0);
+            if (!file) {
+                reply = error_packet(id, file.error());
+                break;
+            }
+            const std::string name = std::to_string(next_handle++);
+            files.emplace(name, std::move(*file));
+            Encoder body;
+            body.string(name);
+            reply = make_packet(PacketType::HANDLE, &id, body.data());
+            break;
+        }
+        case PacketType::OPENDIR: {
+            if (!request.string(path)) {
+                return;
+            }
+            auto dir = m_backend.opendir(backend_path(path));
+            if (!dir) {
+                reply = error_packet(id, dir.error());
+                break;
+            }
+            const std::string name = std::to_string(next_handle++);
+            dirs.emplace(name, std::move(*dir));
+            Encoder body;
+            body.string(name);
+            reply = make_packet(PacketType::HANDLE, &id, body.data());
+            break;
+        }
+        case PacketType::CLOSE: {
+            if (!request.string(handle)) {
+                return;
+            }
+            const std::size_t erased = files.erase(std::string(handle)) +
+                    dirs.erase(std::string(handle));
+            reply = status_packet(id, erased > 0 ? Status::OK : Status::FAILURE);
+            break;
+        }
+        case PacketType::READ: {
+            std::uint64_t offset = 0;
+            std::uint32_t length = 0;
+            if (!request.string(handle) || !request.u64(offset) || !request.u32(length)) {
+                return;
+            }
+            auto iter = files.find(std::string(handle));
+            if (iter == files.end()) {
+                reply = status_packet(id, Status::FAILURE);
+                break;
+            }
+            std::string data(length, '\0');
+            auto read_result = iter->second->pread(data.data(), data.size(), static_cast<off_t>(offset));
+            if (!read_result) {
+                reply = error_packet(id, read_result.error());
+            } else if (*read_result == 0) {
+                reply = status_packet(id, Status::END_OF_FILE);
+            } else {
+                data.resize(static_cast<std::size_t>(*read_result));
+                Encoder body;
+                body.string(data);
+                reply = make_packet(PacketType::DATA, &id, body.data());
+            }
+            held_reads.emplace_back(std::move(reply));
+            reply.clear();
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                m_max_pending_reads = std::max(m_max_pending_reads, held_reads.size());
+            }
+            if (held_reads.size() >= read_batch) {
+                flush_reads();
+            }
+            break;
+        }
+        case PacketType::WRITE: {
+            std::uint64_t offset = 0;
+            std::string_view data;
+            if (!request.string(handle) || !request.u64(offset) || !request.string(data)) {
+                return;
+            }
+            auto iter = files.find(std::string(handle));
+            if (iter == files.end()) {
+                reply = status_packet(id, Status::FAILURE);
+                break;
+            }
+            auto write_result = iter->second->pwrite(data.data(), data.size(), static_cast<off_t>(offset));
+            reply = write_result ? status_packet(id, Status::OK) : error_packet(id, write_result.error());
+            break;
+        }
+        case PacketType::LSTAT:
+        case PacketType::STAT:
+        case PacketType::FSTAT: {
+            Dragonstash::Result<Dragonstash::Backend::Stat> stat_result = Dragonstash::make_result(Dragonstash::FAILED, EBADF);
+            if (type == PacketType::FSTAT) {
+                if (!request.string(handle)) {
+                    return;
+                }
+                auto iter = files.find(std::string(handle));
+                if (iter != files.end()) {
+                    stat_result = iter->second->fstat();
+                }
+            } else {
+                if (!request.string(path)) {
+                    return;
+                }
+                stat_result = m_backend.lstat(backend_path(path));
+            }
+            if (!stat_result) {
+                reply = error_packet(id, stat_result.error());
+                break;
+            }
+            Encoder body;
+            body.attrs(*stat_result, Dragonstash::Backend::Sftp::ATTR_ALL);
+            reply = make_packet(PacketType::ATTRS, &id, body.data());
+            break;
+        }
+        case PacketType::READDIR: {
+            if (!request.string(handle)) {
+                return;
+            }
+            auto iter = dirs.find(std::string(handle));
+            if (iter == dirs.end()) {
+                reply = status_packet(id, Status::FAILURE);
+                break;
+            }
+            Encoder entries;
+            std::uint32_t count = 0;
+            while (count < READDIR_BATCH) {
+                auto entry = iter->second->readdir();
+                if (!entry) {
+                    break;
+                }
+                entries.string(entry->name).string(entry->name)
+                        .attrs(*entry, entry->complete
+                               ? Dragonstash::Backend::Sftp::ATTR_ALL
+                               : Dragonstash::Backend::Sftp::ATTR_PERMISSIONS);
+                ++count;
+            }
+            if (count == 0) {
+                reply = status_packet(id, Status::END_OF_FILE);
+                break;
+            }
+            Encoder body;
+            body.u32(count);
+            reply = make_packet(PacketType::NAME, &id, body.data() + entries.data());
+            break;
+        }
+        case PacketType::READLINK: {
+            if (!request.string(path)) {
+                return;
+            }
+            auto link = m_backend.readlink(backend_path(path));
+            if (!link) {
+                reply = error_packet(id, link.error());
+                break;
+            }
+            Encoder body;
+            body.u32(1).string(*link).string(*link).attrs(Dragonstash::Backend::Stat{}, 0);
+            reply = make_packet(PacketType::NAME, &id, body.data());
+            break;
+        }
+        default:
+            reply = status_packet(id, Status::OP_UNSUPPORTED);
+            break;
+        }
+
+        if (!reply.empty() && !write_all(fd, reply)) {
+            return;
+        }
+    }
+}
+
+Dragonstash::Backend::SftpFilesystem::Connector TestSftpServer::connector()
+{
+    return [this]() -> Dragonstash::Result<std::unique_ptr<Dragonstash::Backend::SftpSession>> {
+        int fds[2];
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (!m_reachable) {
+                return Dragonstash::make_result(Dragonstash::FAILED, ECONNREFUSED);
+            }
+            if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+                return Dragonstash::make_result(Dragonstash::FAILED, errno);
+            }
+            auto connection = std::make_unique<Connection>();
+            connection->fd = fds[1];
+            connection->thread = std::thread(&TestSftpServer::serve, this, fds[1]);
+            m_connections.emplace_back(std::move(connection));
+        }
+
+        auto session = std::make_unique<Dragonstash::Backend::SftpSession>(fds[0]);
+        auto init_result = session->init();
+        if (!init_result) {
+            return Dragonstash::copy_error(init_result);
+        }
+        return session;
+    };
+}
+
+std::size_t TestSftpServer::connections()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_connections.size();
+}
+
+std::size_t TestSftpServer::max_pending_reads()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_max_pending_reads;
+}
+
+std::size_t TestSftpServer::requests(PacketType type)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_requests[type];
+}
+
+void TestSftpServer::set_read_batch(std::size_t nreads)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_read_batch = std::max<std::size_t>(nreads, 1);
+}
+
+void TestSftpServer::set_reachable(bool reachable)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_reachable = reachable;
+}
+
+void TestSftpServer::disconnect_all()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto &connection: m_connections) {
+        ::shutdown(connection->fd, SHUT_RDWR);
+    }
+}
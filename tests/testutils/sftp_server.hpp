@@ -0,0 +1,103 @@
+/**********************************************************************
+File name: sftp_server.hpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#ifndef DRAGONSTASH_TESTUTILS_SFTP_SERVER_H
+#define DRAGONSTASH_TESTUTILS_SFTP_SERVER_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dragonstash/backend/sftp.hpp"
+
+/**
+ * @brief Minimal SFTP server which serves a backend filesystem over
+ * socketpairs, one thread per connection.
+ *
+ * Requests on a connection are handled in order. If a read batch is set,
+ * replies to READ requests are held back until that many are queued, the
+ * next request is not a READ, or no request arrived for a while; this
+ * shows how many reads a client keeps in flight.
+ */
+class TestSftpServer {
+public:
+    explicit TestSftpServer(Dragonstash::Backend::Filesystem &backend);
+    TestSftpServer(const TestSftpServer &src) = delete;
+    TestSftpServer(TestSftpServer &&src) = delete;
+    TestSftpServer &operator=(const TestSftpServer &src) = delete;
+    TestSftpServer &operator=(TestSftpServer &&src) = delete;
+    ~TestSftpServer();
+
+private:
+    struct Connection {
+        int fd;
+        std::thread thread;
+    };
+
+    Dragonstash::Backend::Filesystem &m_backend;
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Connection>> m_connections;
+    bool m_reachable;
+    std::size_t m_read_batch;
+    std::size_t m_max_pending_reads;
+    std::map<Dragonstash::Backend::Sftp::PacketType, std::size_t> m_requests;
+
+    void serve(int fd);
+
+public:
+    /**
+     * @brief Connector for Backend::SftpFilesystem.
+     */
+    [[nodiscard]] Dragonstash::Backend::SftpFilesystem::Connector connector();
+
+    /**
+     * @brief Number of connections made so far.
+     */
+    [[nodiscard]] std::size_t connections();
+
+    /**
+     * @brief Largest number of READ requests which were queued at once.
+     */
+    [[nodiscard]] std::size_t max_pending_reads();
+
+    [[nodiscard]] std::size_t requests(Dragonstash::Backend::Sftp::PacketType type);
+
+    void set_read_batch(std::size_t nreads);
+
+    /**
+     * @brief Refuse new connections if unset.
+     */
+    void set_reachable(bool reachable);
+
+    /**
+     * @brief Break all connections.
+     */
+    void disconnect_all();
+
+};
+
+#endif
@@ -0,0 +1,143 @@
+/**********************************************************************
+File name: timeout_policy.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include "dragonstash/timeout_policy.hpp"
+
+#include "testutils/result.hpp"
+
+SCENARIO("Timeout rules") {
+    GIVEN("A policy with subtree rules") {
+        Dragonstash::TimeoutPolicy policy(Dragonstash::TimeoutPolicy::Rule{2.0, 3.0, 0});
+        policy.add_subtree("archive", Dragonstash::TimeoutPolicy::Rule{100.0, 100.0, 0});
+        policy.add_subtree("/archive/new/", Dragonstash::TimeoutPolicy::Rule{5.0, 5.0, 0});
+
+        THEN("Paths outside of the subtrees use the defaults") {
+            CHECK(policy.rule_for("").entry_timeout == 3.0);
+            CHECK(policy.rule_for("/books").entry_timeout == 3.0);
+            CHECK(policy.rule_for("/archived").entry_timeout == 3.0);
+        }
+
+        THEN("The subtree root and its contents use the subtree rule") {
+            CHECK(policy.rule_for("/archive").entry_timeout == 100.0);
+            CHECK(policy.rule_for("/archive/2019/a.tar").entry_timeout == 100.0);
+        }
+
+        THEN("The most specific subtree wins") {
+            CHECK(policy.rule_for("/archive/new").entry_timeout == 5.0);
+            CHECK(policy.rule_for("/archive/new/b.tar").entry_timeout == 5.0);
+            CHECK(policy.rule_for("/archive/newer").entry_timeout == 100.0);
+        }
+
+        WHEN("A rule is added for an existing subtree") {
+            policy.add_subtree("/archive", Dragonstash::TimeoutPolicy::Rule{50.0, 50.0, 0});
+
+            THEN("It replaces the old rule") {
+                CHECK(policy.rule_for("/archive/2019").entry_timeout == 50.0);
+                CHECK(policy.rule_for("/archive/new").entry_timeout == 5.0);
+            }
+        }
+
+        WHEN("A rule is added for the root") {
+            policy.add_subtree("/", Dragonstash::TimeoutPolicy::Rule{7.0, 7.0, 0});
+
+            THEN("It replaces the defaults") {
+                CHECK(policy.defaults().entry_timeout == 7.0);
+                CHECK(policy.rule_for("/books").entry_timeout == 7.0);
+            }
+        }
+    }
+
+    GIVEN("A rule which trusts entries older than a minute") {
+        const Dragonstash::TimeoutPolicy::Rule rule{1.0, 1.0, 60.0};
+        const struct timespec now{1000000, 500};
+
+        THEN("Old entries are stable") {
+            CHECK(Dragonstash::TimeoutPolicy::is_stable(rule, {now.tv_sec - 61, 0}, now));
+        }
+
+        THEN("Recently modified entries are not") {
+            CHECK(!Dragonstash::TimeoutPolicy::is_stable(rule, {now.tv_sec - 59, 0}, now));
+            CHECK(!Dragonstash::TimeoutPolicy::is_stable(rule, {now.tv_sec + 10, 0}, now));
+        }
+
+        THEN("Nothing is stable without the setting") {
+            CHECK(!Dragonstash::TimeoutPolicy::is_stable(Dragonstash::TimeoutPolicy::Rule{}, {0, 0}, now));
+        }
+    }
+
+    GIVEN("A rule with a soft and a hard TTL") {
+        using Revalidation = Dragonstash::TimeoutPolicy::Revalidation;
+        Dragonstash::TimeoutPolicy::Rule rule;
+        rule.soft_ttl = 5.0;
+        rule.hard_ttl = 60.0;
+
+        THEN("Entries younger than the soft TTL are used as-is") {
+            CHECK(Dragonstash::TimeoutPolicy::revalidation(rule, 0) == Revalidation::NONE);
+            CHECK(Dragonstash::TimeoutPolicy::revalidation(rule, 4.9) == Revalidation::NONE);
+        }
+
+        THEN("Entries between the TTLs are revalidated in the background") {
+            CHECK(Dragonstash::TimeoutPolicy::revalidation(rule, 5.0) == Revalidation::BACKGROUND);
+            CHECK(Dragonstash::TimeoutPolicy::revalidation(rule, 59.9) == Revalidation::BACKGROUND);
+        }
+
+        THEN("Entries older than the hard TTL are revalidated right away") {
+            CHECK(Dragonstash::TimeoutPolicy::revalidation(rule, 60.0) == Revalidation::SYNCHRONOUS);
+        }
+
+        THEN("Without a hard TTL, entries are always revalidated right away") {
+            CHECK(Dragonstash::TimeoutPolicy::revalidation(Dragonstash::TimeoutPolicy::Rule{}, 0) == Revalidation::SYNCHRONOUS);
+        }
+    }
+}
+
+TEST_CASE("Subtree rules are parsed", "[timeout_policy]")
+{
+    SECTION("Timeout only") {
+        auto result = Dragonstash::TimeoutPolicy::parse_subtree("/archive=3600");
+        require_result_ok(result);
+        CHECK(result->first == "/archive");
+        CHECK(result->second.attr_timeout == 3600.0);
+        CHECK(result->second.entry_timeout == 3600.0);
+        CHECK(result->second.stable_after == 0);
+    }
+
+    SECTION("Timeout and stable age") {
+        auto result = Dragonstash::TimeoutPolicy::parse_subtree("media/old/=0.5,86400");
+        require_result_ok(result);
+        CHECK(result->first == "/media/old");
+        CHECK(result->second.entry_timeout == 0.5);
+        CHECK(result->second.stable_after == 86400.0);
+    }
+
+    SECTION("Malformed specifications") {
+        check_result_error(Dragonstash::TimeoutPolicy::parse_subtree("/archive"), EINVAL);
+        check_result_error(Dragonstash::TimeoutPolicy::parse_subtree("=10"), EINVAL);
+        check_result_error(Dragonstash::TimeoutPolicy::parse_subtree("/archive=abc"), EINVAL);
+        check_result_error(Dragonstash::TimeoutPolicy::parse_subtree("/archive=10,"), EINVAL);
+        check_result_error(Dragonstash::TimeoutPolicy::parse_subtree("/archive=-1"), EINVAL);
+    }
+}
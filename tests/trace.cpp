@@ -0,0 +1,208 @@
+/**********************************************************************
+File name: trace.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#include "dragonstash/trace.hpp"
+
+using Dragonstash::Trace::Clock;
+using Dragonstash::Trace::Phase;
+using Dragonstash::Trace::Recorder;
+
+SCENARIO("Trace recorder")
+{
+    GIVEN("A recorder which is not configured") {
+        Recorder recorder;
+
+        THEN("It is disabled and picks no request") {
+            CHECK(!recorder.enabled());
+            CHECK(recorder.begin("lookup") == nullptr);
+        }
+    }
+
+    GIVEN("A recorder which samples every third request") {
+        Recorder recorder;
+        recorder.configure(3, Clock::duration::zero());
+
+        WHEN("Six requests are started and finished") {
+            std::size_t traced = 0;
+            for (int i = 0; i < 6; ++i) {
+                auto trace = recorder.begin("getattr");
+                if (trace) {
+                    ++traced;
+                    trace->add(Phase::COMMIT, Clock::now(), Clock::now());
+                    trace->finish();
+                }
+            }
+
+            THEN("Two of them are kept with their phases") {
+                CHECK(traced == 2);
+                const auto records = recorder.records();
+                REQUIRE(records.size() == 2);
+                CHECK(records[0].id == 3);
+                CHECK(records[1].id == 6);
+                CHECK(std::string(records[0].op) == "getattr");
+                REQUIRE(records[0].events.size() == 1);
+                CHECK(records[0].events[0].phase == Phase::COMMIT);
+            }
+        }
+    }
+
+    GIVEN("A recorder with a threshold") {
+        Recorder recorder;
+        recorder.configure(0, std::chrono::milliseconds(20));
+
+        WHEN("A fast and a slow request finish") {
+            auto fast = recorder.begin("lookup");
+            auto slow = recorder.begin("lookup");
+            REQUIRE(fast);
+            REQUIRE(slow);
+            fast->finish();
+            std::this_thread::sleep_for(std::chrono::milliseconds(25));
+            slow->finish();
+
+            THEN("Only the slow one is kept") {
+                const auto records = recorder.records();
+                REQUIRE(records.size() == 1);
+                CHECK(records[0].id == slow->id());
+                CHECK(records[0].duration >= std::chrono::milliseconds(20));
+            }
+        }
+    }
+
+    GIVEN("A recorder with a small capacity") {
+        Recorder recorder(2);
+        recorder.configure(1, Clock::duration::zero());
+
+        WHEN("More requests are traced than fit") {
+            for (int i = 0; i < 5; ++i) {
+                recorder.begin("read")->finish();
+            }
+
+            THEN("The most recent traces are kept") {
+                const auto records = recorder.records();
+                REQUIRE(records.size() == 2);
+                CHECK(records[0].id == 4);
+                CHECK(records[1].id == 5);
+            }
+        }
+    }
+
+    GIVEN("A finished trace") {
+        Recorder recorder;
+        recorder.configure(1, Clock::duration::zero());
+        auto trace = recorder.begin("lookup");
+        const auto start = Clock::now();
+        trace->add(Phase::BACKEND_LSTAT, start, start + std::chrono::microseconds(1500));
+        trace->finish();
+
+        WHEN("Adding a phase after the reply") {
+            trace->add(Phase::COMMIT, start, start);
+
+            THEN("It is dropped") {
+                const auto records = recorder.records();
+                REQUIRE(records.size() == 1);
+                CHECK(records[0].events.size() == 1);
+            }
+        }
+
+        WHEN("Rendering the Chrome trace") {
+            const std::string json = recorder.chrome_trace();
+
+            THEN("The request and its phase are complete events") {
+                CHECK(json.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0) == 0);
+                CHECK(json.find("\"name\":\"lookup\",\"cat\":\"request\",\"ph\":\"X\"") != std::string::npos);
+                CHECK(json.find("\"name\":\"backend_lstat\",\"cat\":\"phase\",\"ph\":\"X\"") != std::string::npos);
+                CHECK(json.find("\"dur\":1500.000") != std::string::npos);
+                CHECK(json.find("\"args\":{\"request\":1}") != std::string::npos);
+                CHECK(json.substr(json.size() - 3) == "]}\n");
+            }
+        }
+    }
+}
+
+#ifdef DRAGONSTASH_TRACING
+
+using Dragonstash::Trace::Scope;
+using Dragonstash::Trace::Span;
+
+SCENARIO("Trace spans")
+{
+    GIVEN("A traced request") {
+        Recorder recorder;
+        recorder.configure(1, Clock::duration::zero());
+        auto trace = recorder.begin("lookup");
+
+        WHEN("Spans are recorded while its scope is active") {
+            {
+                const Scope scope(trace);
+                CHECK(Dragonstash::Trace::current() == trace.get());
+                {
+                    Span span(Phase::PATH_WALK);
+                }
+                Span moved(Phase::BACKEND_LSTAT);
+                std::thread([span = std::move(moved)]() mutable {
+                    span.end();
+                }).join();
+            }
+            Span outside(Phase::COMMIT);
+            outside.end();
+            trace->finish();
+
+            THEN("They end up in the trace, also when ended on another thread") {
+                const auto records = recorder.records();
+                REQUIRE(records.size() == 1);
+                const auto &events = records[0].events;
+                REQUIRE(events.size() == 2);
+                CHECK(events[0].phase == Phase::PATH_WALK);
+                CHECK(events[1].phase == Phase::BACKEND_LSTAT);
+                CHECK(events[0].thread == records[0].thread);
+                CHECK(events[1].thread != records[0].thread);
+            }
+
+            THEN("The scope is left") {
+                CHECK(Dragonstash::Trace::current() == nullptr);
+            }
+        }
+
+        WHEN("Scopes are nested") {
+            auto other = recorder.begin("getattr");
+            const Scope outer(trace);
+            {
+                const Scope inner(other);
+                CHECK(Dragonstash::Trace::current() == other.get());
+            }
+
+            THEN("The outer trace is restored") {
+                CHECK(Dragonstash::Trace::current() == trace.get());
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,123 @@
+/**********************************************************************
+File name: worker_pool.cpp
+This file is part of: DragonStash
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about DragonStash please e-mail one of the
+authors named in the AUTHORS file.
+**********************************************************************/
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "dragonstash/worker_pool.hpp"
+
+SCENARIO("Worker pool") {
+    GIVEN("A pool with four threads and a small queue") {
+        Dragonstash::WorkerPool pool(4, 2);
+
+        WHEN("Running many tasks in a group") {
+            std::atomic<unsigned> executed{0};
+            std::atomic<unsigned> in_flight{0};
+            std::atomic<unsigned> max_in_flight{0};
+            {
+                Dragonstash::TaskGroup group(pool);
+                for (unsigned i = 0; i < 64; ++i) {
+                    group.submit([&]() {
+                        const unsigned now = ++in_flight;
+                        unsigned prev = max_in_flight.load();
+                        while (prev < now && !max_in_flight.compare_exchange_weak(prev, now));
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        --in_flight;
+                        ++executed;
+                    });
+                }
+                group.wait();
+            }
+
+            THEN("All tasks have run when wait returns") {
+                CHECK(executed == 64);
+            }
+
+            THEN("No more tasks than threads ran concurrently") {
+                CHECK(max_in_flight <= 4);
+                CHECK(max_in_flight >= 1);
+            }
+        }
+
+        WHEN("A task throws") {
+            Dragonstash::TaskGroup group(pool);
+            std::atomic<unsigned> executed{0};
+            group.submit([]() { throw std::runtime_error("test"); });
+            group.submit([&]() { ++executed; });
+
+            THEN("wait rethrows the exception after all tasks completed") {
+                CHECK_THROWS_AS(group.wait(), std::runtime_error);
+                CHECK(executed == 1);
+            }
+        }
+    }
+
+    GIVEN("A pool with a single thread and a single queue slot") {
+        Dragonstash::WorkerPool pool(1, 1);
+
+        WHEN("Trying to submit while the worker is busy and the queue is full") {
+            std::mutex block;
+            std::unique_lock<std::mutex> blocker(block);
+            std::atomic<bool> started{false};
+            std::atomic<unsigned> executed{0};
+            pool.submit([&]() {
+                started = true;
+                std::lock_guard<std::mutex> guard(block);
+                ++executed;
+            });
+            while (!started) {
+                std::this_thread::yield();
+            }
+            const bool queued = pool.try_submit([&]() { ++executed; });
+            const bool dropped = !pool.try_submit([&]() { ++executed; });
+            blocker.unlock();
+
+            THEN("Only the task which fits into the queue is accepted") {
+                CHECK(queued);
+                CHECK(dropped);
+            }
+        }
+    }
+
+    GIVEN("A pool without threads") {
+        Dragonstash::WorkerPool pool(0);
+
+        WHEN("Submitting a task") {
+            const auto caller = std::this_thread::get_id();
+            std::thread::id runner;
+            Dragonstash::TaskGroup group(pool);
+            group.submit([&]() { runner = std::this_thread::get_id(); });
+
+            THEN("It has run inline") {
+                CHECK(pool.concurrency() == 0);
+                CHECK(runner == caller);
+            }
+        }
+    }
+}